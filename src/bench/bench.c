@@ -0,0 +1,441 @@
+#include <dotnet/jit/jit.h>
+#include <dotnet/gc/gc.h>
+#include <dotnet/monitor.h>
+#include <dotnet/loader.h>
+#include <dotnet/types.h>
+
+#include <thread/scheduler.h>
+#include <thread/thread.h>
+#include <sync/wait_group.h>
+#include <util/strbuilder.h>
+#include <util/stb_ds.h>
+#include <util/except.h>
+#include <util/trace.h>
+#include <time/tsc.h>
+
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+//
+// The benchmark driver, runs a fixed set of measurements against the runtime and writes
+// the results as json, so they can be compared between builds:
+//
+//      tinydotnet-bench [corelib] [benchmarks]
+//
+// The native benchmarks time the runtime paths directly, the corelib loading, the jit, the
+// allocator, the collector, the casts and the monitors. The managed benchmarks come from
+// an optional assembly, every `public static void Name(int iterations)` in `Bench.Benchmarks`
+// runs its own loop over the given iterations, which is where dispatch, Array.Copy and the
+// string operations are measured, since those only make sense from jitted code.
+//
+// The results go to TDN_BENCH_OUTPUT, or tdn-bench.json, stdout has the runtime traces.
+//
+
+// the default paths, same as the main runner
+#define BENCH_DEFAULT_CORELIB       "Pentagon/Corelib/bin/Release/net6.0/Corelib.dll"
+#define BENCH_DEFAULT_OUTPUT        "tdn-bench.json"
+
+// the iterations of the native micro benchmarks
+#define BENCH_ITERATIONS            (1000 * 1000)
+
+// the iterations given to every managed benchmark, the warmup run gets a tenth
+#define BENCH_MANAGED_ITERATIONS    (1000 * 1000)
+
+// the collections to run for each generation
+#define BENCH_GC_CYCLES             16
+
+// the threads fighting over a single monitor
+#define BENCH_MONITOR_THREADS       4
+
+typedef struct bench_result {
+    char* name;
+    uint64_t iterations;
+    uint64_t total_time;
+} bench_result_t;
+
+typedef struct bench_file {
+    void* buffer;
+    size_t size;
+} bench_file_t;
+
+static bench_result_t* m_bench_results = NULL;
+
+static uint64_t m_bench_corelib_load_time = 0;
+
+static uint64_t m_bench_jit_time = 0;
+static uint64_t m_bench_jit_il_bytes = 0;
+static int m_bench_jit_types = 0;
+static int m_bench_jit_failed = 0;
+
+static gc_cycle_info_t* m_bench_gc_cycles = NULL;
+
+/**
+ * Keeps the compiler from throwing away the work of a benchmark
+ */
+static volatile uintptr_t m_bench_sink = 0;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Helpers
+//----------------------------------------------------------------------------------------------------------------------
+
+static err_t bench_load_file(const char* path, bench_file_t* file) {
+    err_t err = NO_ERROR;
+
+    int fd = open(path, O_RDONLY);
+    CHECK_ERROR(fd >= 0, ERROR_NOT_FOUND, "Failed to open %s", path);
+
+    struct stat s;
+    CHECK(fstat(fd, &s) == 0);
+    file->size = s.st_size;
+    file->buffer = mmap(0, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    CHECK(file->buffer != MAP_FAILED);
+
+cleanup:
+    if (fd >= 0) {
+        close(fd);
+    }
+    return err;
+}
+
+static void bench_add_result(const char* name, uint64_t iterations, uint64_t total_time) {
+    bench_result_t result = {
+        .name = strdup(name),
+        .iterations = iterations,
+        .total_time = total_time,
+    };
+    arrpush(m_bench_results, result);
+    TRACE("bench: %s: %lu iterations in %luus", name, iterations, total_time);
+}
+
+/**
+ * The sum of the il of all the methods of the assembly that have code
+ */
+static uint64_t bench_count_jitted_il(System_Reflection_Assembly assembly) {
+    uint64_t bytes = 0;
+    for (int i = 0; i < assembly->DefinedMethods->Length; i++) {
+        System_Reflection_MethodInfo method = assembly->DefinedMethods->Data[i];
+        if (method == NULL || method->MirFunc == NULL || method->MethodBody == NULL || method->MethodBody->Il == NULL) {
+            continue;
+        }
+        bytes += method->MethodBody->Il->Length;
+    }
+    return bytes;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Native benchmarks
+//----------------------------------------------------------------------------------------------------------------------
+
+static err_t bench_corelib_load(const char* path) {
+    err_t err = NO_ERROR;
+
+    bench_file_t file = { 0 };
+    CHECK_AND_RETHROW(bench_load_file(path, &file));
+
+    uint64_t start = microtime();
+    CHECK_AND_RETHROW(loader_load_corelib(file.buffer, file.size));
+    m_bench_corelib_load_time = microtime() - start;
+
+cleanup:
+    return err;
+}
+
+/**
+ * Generate the code of every type of the corelib right away, types which the
+ * jit can't handle are counted and skipped, the amount of il is only taken
+ * from the methods that actually got code
+ */
+static void bench_jit() {
+    uint64_t il_before = bench_count_jitted_il(g_corelib);
+
+    uint64_t start = microtime();
+    for (int i = 0; i < g_corelib->DefinedTypes->Length; i++) {
+        System_Type type = g_corelib->DefinedTypes->Data[i];
+        if (type->MirType != NULL || type_is_generic_definition(type) || type_is_interface(type)) {
+            continue;
+        }
+
+        if (IS_ERROR(jit_type(type))) {
+            m_bench_jit_failed++;
+        } else {
+            m_bench_jit_types++;
+        }
+    }
+    m_bench_jit_time = microtime() - start;
+
+    m_bench_jit_il_bytes = bench_count_jitted_il(g_corelib) - il_before;
+}
+
+static void bench_gc_new() {
+    uint64_t start = microtime();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        m_bench_sink = (uintptr_t)gc_new(tSystem_Object, tSystem_Object->ManagedSize);
+    }
+    bench_add_result("gc_new/object", BENCH_ITERATIONS, microtime() - start);
+
+    start = microtime();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        m_bench_sink = (uintptr_t)gc_new_array(tSystem_Int32, 64);
+    }
+    bench_add_result("gc_new/int[64]", BENCH_ITERATIONS, microtime() - start);
+}
+
+/**
+ * Run a few collections of each kind with garbage in the heap, and keep
+ * their statistics for the report
+ */
+static void bench_gc_cycles() {
+    for (int full = 0; full <= 1; full++) {
+        for (int i = 0; i < BENCH_GC_CYCLES; i++) {
+            for (int j = 0; j < BENCH_ITERATIONS / BENCH_GC_CYCLES; j++) {
+                m_bench_sink = (uintptr_t)gc_new(tSystem_Object, tSystem_Object->ManagedSize);
+            }
+
+            gc_wait(full);
+
+            System_GCMemoryInfo info;
+            gc_get_memory_info(&info);
+
+            gc_cycle_info_t cycle;
+            if (gc_get_cycle_info(info.Index, &cycle)) {
+                arrpush(m_bench_gc_cycles, cycle);
+            }
+        }
+    }
+}
+
+static void bench_isinstance() {
+    System_String string = GC_NEW_STRING(0);
+
+    uint64_t start = microtime();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        m_bench_sink += isinstance((System_Object)string, tSystem_Object);
+    }
+    bench_add_result("isinstance/base", BENCH_ITERATIONS, microtime() - start);
+
+    start = microtime();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        m_bench_sink += isinstance((System_Object)string, tSystem_Exception);
+    }
+    bench_add_result("isinstance/unrelated", BENCH_ITERATIONS, microtime() - start);
+}
+
+/**
+ * The object all the monitor benchmarks lock, rooted for the whole run
+ */
+static System_Object m_bench_monitor_object = NULL;
+
+static wait_group_t m_bench_monitor_wg = INIT_WAIT_GROUP();
+
+static void bench_monitor_thread(void* arg) {
+    for (int i = 0; i < BENCH_ITERATIONS / BENCH_MONITOR_THREADS; i++) {
+        ASSERT(!IS_ERROR(monitor_enter(m_bench_monitor_object)));
+        m_bench_sink++;
+        ASSERT(!IS_ERROR(monitor_exit(m_bench_monitor_object)));
+    }
+    wait_group_done(&m_bench_monitor_wg);
+}
+
+static err_t bench_monitor() {
+    err_t err = NO_ERROR;
+
+    m_bench_monitor_object = GC_NEW(tSystem_Object);
+    gc_add_root(&m_bench_monitor_object);
+
+    uint64_t start = microtime();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        CHECK_AND_RETHROW(monitor_enter(m_bench_monitor_object));
+        CHECK_AND_RETHROW(monitor_exit(m_bench_monitor_object));
+    }
+    bench_add_result("monitor/uncontended", BENCH_ITERATIONS, microtime() - start);
+
+    start = microtime();
+    wait_group_add(&m_bench_monitor_wg, BENCH_MONITOR_THREADS);
+    for (int i = 0; i < BENCH_MONITOR_THREADS; i++) {
+        thread_t* thread = create_thread(bench_monitor_thread, NULL, "bench/monitor[%d]", i);
+        CHECK_ERROR(thread != NULL, ERROR_OUT_OF_MEMORY);
+        scheduler_ready_thread(thread);
+    }
+    wait_group_wait(&m_bench_monitor_wg);
+    bench_add_result("monitor/contended", BENCH_ITERATIONS, microtime() - start);
+
+cleanup:
+    return err;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Managed benchmarks
+//----------------------------------------------------------------------------------------------------------------------
+
+static err_t bench_managed(const char* path) {
+    err_t err = NO_ERROR;
+    strbuilder_t name = strbuilder_new();
+
+    bench_file_t file = { 0 };
+    CHECK_AND_RETHROW(bench_load_file(path, &file));
+
+    System_Reflection_Assembly assembly = NULL;
+    CHECK_AND_RETHROW(loader_load_assembly(file.buffer, file.size, &assembly));
+
+    System_Type benchmarks = assembly_get_type_by_name(assembly, "Benchmarks", "Bench");
+    CHECK_ERROR(benchmarks != NULL, ERROR_NOT_FOUND, "Missing Bench.Benchmarks in %s", path);
+    CHECK_AND_RETHROW(jit_type(benchmarks));
+
+    for (int i = 0; i < benchmarks->Methods->Length; i++) {
+        System_Reflection_MethodInfo method = benchmarks->Methods->Data[i];
+        if (!method_is_static(method) || method->ReturnType != NULL ||
+            method->Parameters->Length != 1 || method->Parameters->Data[0]->ParameterType != tSystem_Int32) {
+            continue;
+        }
+
+        strbuilder_free(&name);
+        name = strbuilder_new();
+        strbuilder_cstr(&name, "managed/");
+        strbuilder_utf16(&name, method->Name->Chars, method->Name->Length);
+
+        System_Exception(*func)(int32_t) = method->MirFunc->addr;
+
+        // the first call also generates the code of anything the benchmark uses
+        System_Exception exception = func(BENCH_MANAGED_ITERATIONS / 10);
+        CHECK(exception == NULL, "%s threw: %U", strbuilder_get(&name), exception->Message);
+
+        uint64_t start = microtime();
+        exception = func(BENCH_MANAGED_ITERATIONS);
+        uint64_t total_time = microtime() - start;
+        CHECK(exception == NULL, "%s threw: %U", strbuilder_get(&name), exception->Message);
+
+        bench_add_result(strbuilder_get(&name), BENCH_MANAGED_ITERATIONS, total_time);
+    }
+
+cleanup:
+    strbuilder_free(&name);
+    return err;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Report
+//----------------------------------------------------------------------------------------------------------------------
+
+static err_t bench_write_report(const char* path) {
+    err_t err = NO_ERROR;
+
+    FILE* out = fopen(path, "w");
+    CHECK_ERROR(out != NULL, ERROR_NOT_FOUND, "Failed to open %s", path);
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"corelib_load_us\": %lu,\n", m_bench_corelib_load_time);
+
+    fprintf(out, "  \"jit\": {\n");
+    fprintf(out, "    \"types\": %d,\n", m_bench_jit_types);
+    fprintf(out, "    \"failed_types\": %d,\n", m_bench_jit_failed);
+    fprintf(out, "    \"il_bytes\": %lu,\n", m_bench_jit_il_bytes);
+    fprintf(out, "    \"total_us\": %lu,\n", m_bench_jit_time);
+    fprintf(out, "    \"ns_per_il_byte\": %.2f\n",
+            m_bench_jit_il_bytes == 0 ? 0.0 : (double)m_bench_jit_time * 1000.0 / (double)m_bench_jit_il_bytes);
+    fprintf(out, "  },\n");
+
+    fprintf(out, "  \"gc_cycles\": [\n");
+    for (int i = 0; i < arrlen(m_bench_gc_cycles); i++) {
+        gc_cycle_info_t* cycle = &m_bench_gc_cycles[i];
+        fprintf(out, "    { \"generation\": %d, \"total_us\": %lu, \"mark_us\": %lu, \"sweep_us\": %lu, "
+                     "\"handshake_us\": %lu, \"max_handshake_latency_us\": %lu, "
+                     "\"heap_bytes_before\": %lu, \"heap_bytes_after\": %lu }%s\n",
+                cycle->generation, cycle->total_time, cycle->mark_time, cycle->sweep_time,
+                cycle->handshake_time, cycle->max_handshake_latency,
+                cycle->heap_bytes_before, cycle->heap_bytes_after,
+                i == arrlen(m_bench_gc_cycles) - 1 ? "" : ",");
+    }
+    fprintf(out, "  ],\n");
+
+    fprintf(out, "  \"benchmarks\": [\n");
+    for (int i = 0; i < arrlen(m_bench_results); i++) {
+        bench_result_t* result = &m_bench_results[i];
+        fprintf(out, "    { \"name\": \"%s\", \"iterations\": %lu, \"total_us\": %lu, \"ns_per_op\": %.2f }%s\n",
+                result->name, result->iterations, result->total_time,
+                (double)result->total_time * 1000.0 / (double)result->iterations,
+                i == arrlen(m_bench_results) - 1 ? "" : ",");
+    }
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+
+    CHECK(fclose(out) == 0);
+    TRACE("bench: wrote the results to %s", path);
+
+cleanup:
+    return err;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Entry
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef struct bench_args {
+    const char* corelib;
+    const char* managed;
+    const char* output;
+    err_t err;
+    sem_t done;
+} bench_args_t;
+
+static err_t bench_run(bench_args_t* args) {
+    err_t err = NO_ERROR;
+
+    CHECK_AND_RETHROW(init_gc());
+
+    // generate all the code right away, so the jit is measured
+    // as a whole and not as part of the first calls
+    jit_set_lazy_compilation(false);
+    CHECK_AND_RETHROW(init_jit());
+
+    CHECK_AND_RETHROW(bench_corelib_load(args->corelib));
+    bench_jit();
+
+    bench_gc_new();
+    bench_gc_cycles();
+    bench_isinstance();
+    CHECK_AND_RETHROW(bench_monitor());
+
+    if (args->managed != NULL) {
+        CHECK_AND_RETHROW(bench_managed(args->managed));
+    }
+
+    CHECK_AND_RETHROW(bench_write_report(args->output));
+
+cleanup:
+    return err;
+}
+
+/**
+ * Everything runs on a runtime thread, the collector and the monitors
+ * expect to be used from threads the scheduler knows about
+ */
+static void bench_thread(void* arg) {
+    bench_args_t* args = arg;
+    args->err = bench_run(args);
+    sem_post(&args->done);
+}
+
+int main(int argc, char** argv) {
+    bench_args_t args = {
+        .corelib = argc > 1 ? argv[1] : BENCH_DEFAULT_CORELIB,
+        .managed = argc > 2 ? argv[2] : NULL,
+        .output = getenv("TDN_BENCH_OUTPUT") != NULL ? getenv("TDN_BENCH_OUTPUT") : BENCH_DEFAULT_OUTPUT,
+    };
+    sem_init(&args.done, 0, 0);
+
+    thread_t* thread = create_thread(bench_thread, &args, "bench/main");
+    if (thread == NULL) {
+        return EXIT_FAILURE;
+    }
+    scheduler_ready_thread(thread);
+
+    while (sem_wait(&args.done) != 0);
+
+    return IS_ERROR(args.err) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -2,138 +2,196 @@
 #include "dotnet/gc/gc.h"
 #include "dotnet/jit/jit.h"
 
-err_t activator_create_instance(System_Type type, System_Object* args, int argsCount, System_Object* created) {
+#include <sync/mutex.h>
+#include <util/stb_ds.h>
+
+#include <stdlib.h>
+
+//
+// Everything we need to create instances of a type is resolved on the first use and kept
+// per type, so creating more instances only has to match the arguments against the
+// constructors. The constructors are called through invoke thunks, which unbox the
+// arguments right into the parameters.
+//
+
+typedef struct activator_ctor {
+    System_Reflection_MethodInfo ctor;
+
+    // generated on the first call
+    jit_invoke_thunk_t thunk;
+} activator_ctor_t;
+
+typedef struct activator_type {
+    // all the instance constructors of the type
+    activator_ctor_t* ctors;
+
+    // the parameterless constructor, -1 if none
+    int default_ctor;
+} activator_type_t;
+
+/**
+ * The types we have already seen, protected by the activator lock
+ */
+static struct {
+    System_Type key;
+    activator_type_t* value;
+}* m_activator_types = NULL;
+
+static mutex_t m_activator_lock = INIT_MUTEX();
+
+/**
+ * Get the cached info of the type, called with the activator lock held
+ */
+static err_t activator_get_type(System_Type type, activator_type_t** out_type) {
     err_t err = NO_ERROR;
+    activator_type_t* info = NULL;
 
-    // TODO: method access????
+    int index = hmgeti(m_activator_types, type);
+    if (index >= 0) {
+        *out_type = m_activator_types[index].value;
+        goto cleanup;
+    }
 
     // make sure that all the methods of this type
     // are properly jitted and ready to be called
     CHECK_AND_RETHROW(jit_type(type));
 
-    // reset
-    *created = NULL;
+    info = calloc(1, sizeof(activator_type_t));
+    CHECK_ERROR(info != NULL, ERROR_OUT_OF_MEMORY);
+    info->default_ctor = -1;
 
-    System_Object new;
-    if (type == tSystem_String) {
-        // Strings are variable length, so need to
-        // figure it properly
-        CHECK_FAIL("TODO: string from activator");
-    } else {
-        new = UNSAFE_GC_NEW(type);
-        if (new == NULL) {
-            // handle quietly
-            err = ERROR_OUT_OF_MEMORY;
-            goto cleanup;
-        }
-    }
-
-    // find the ctor
-    int index = 0;
+    int ctor_index = 0;
     System_Reflection_MethodInfo ctor = NULL;
-    while ((ctor = type_iterate_methods_cstr(type, ".ctor", &index)) != NULL) {
+    while ((ctor = type_iterate_methods_cstr(type, ".ctor", &ctor_index)) != NULL) {
         if (!method_is_rt_special_name(ctor)) continue;
 
-        // special case this
-        if (args == NULL) {
-            if (ctor->Parameters->Length == 0) {
-                break;
-            }
-            continue;
-        } else if (ctor->Parameters->Length != argsCount) {
-            continue;
+        if (ctor->Parameters->Length == 0) {
+            info->default_ctor = arrlen(info->ctors);
         }
+        arrpush(info->ctors, ((activator_ctor_t){ .ctor = ctor }));
+    }
 
-        // check that the parameters are the same
-        bool found = true;
-        for (int pi = 0; pi < ctor->Parameters->Length; pi++) {
-            System_Type argType = OBJECT_TYPE(args[pi]);
-            System_Type paramType = ctor->Parameters->Data[pi]->ParameterType;
-            if (!type_is_verifier_assignable_to(argType, paramType)) {
-                found = false;
-                break;
+    hmput(m_activator_types, type, info);
+    *out_type = info;
+    info = NULL;
+
+cleanup:
+    free(info);
+    return err;
+}
+
+/**
+ * Check if the arguments can be passed to the ctor as is
+ */
+static bool activator_ctor_matches(System_Reflection_MethodInfo ctor, System_Object* args, int argsCount) {
+    if (ctor->Parameters->Length != argsCount) {
+        return false;
+    }
+
+    for (int pi = 0; pi < argsCount; pi++) {
+        System_Type paramType = ctor->Parameters->Data[pi]->ParameterType;
+        if (args[pi] == NULL) {
+            // null can only go to references
+            if (!type_is_object_ref(paramType)) {
+                return false;
             }
+        } else if (!type_is_verifier_assignable_to(OBJECT_TYPE(args[pi]), paramType)) {
+            return false;
         }
+    }
 
-        if (found) {
-            break;
-        }
+    return true;
+}
+
+err_t activator_create_instance(System_Type type, System_Object* args, int argsCount, System_Object* created) {
+    err_t err = NO_ERROR;
+
+    // TODO: method access????
+
+    // reset
+    *created = NULL;
+
+    if (args == NULL) {
+        argsCount = 0;
     }
 
-    if (ctor == NULL) {
-        err = ERROR_MISSING_METHOD;
+    mutex_lock(&m_activator_lock);
+
+    activator_type_t* info = NULL;
+    err = activator_get_type(type, &info);
+    if (IS_ERROR(err)) {
+        mutex_unlock(&m_activator_lock);
         goto cleanup;
     }
 
+    // find the ctor
+    activator_ctor_t* ctor = NULL;
+    if (argsCount == 0) {
+        if (info->default_ctor >= 0) {
+            ctor = &info->ctors[info->default_ctor];
+        }
+    } else {
+        for (int i = 0; i < arrlen(info->ctors); i++) {
+            if (activator_ctor_matches(info->ctors[i].ctor, args, argsCount)) {
+                ctor = &info->ctors[i];
+                break;
+            }
+        }
+    }
+
     // check the access
     // TODO: we could in theory do it by the caller of this instead
-    if (method_get_access(ctor) != METHOD_PUBLIC) {
+    if (ctor != NULL && method_get_access(ctor->ctor) != METHOD_PUBLIC) {
+        mutex_unlock(&m_activator_lock);
         err = ERROR_MEMBER_ACCESS;
         goto cleanup;
     }
 
-    ASSERT(ctor->MirFunc != NULL);
-    ASSERT(ctor->MirFunc->addr != NULL);
+    // ctors are never freed, so the thunk can be used outside the lock
+    System_Reflection_MethodInfo method = NULL;
+    jit_invoke_thunk_t thunk = NULL;
+    if (ctor != NULL) {
+        if (ctor->thunk == NULL) {
+            err = jit_get_invoke_thunk(ctor->ctor, &ctor->thunk);
+        }
+        method = ctor->ctor;
+        thunk = ctor->thunk;
+    }
+
+    mutex_unlock(&m_activator_lock);
 
-    // actually invoke the ctor
-    System_Exception exception = NULL;
-    if (argsCount == 0) {
-        // small optimization for default ctors
-//        exception = ((System_Exception(*)(System_Object))(ctor->MirFunc->addr))(new);
+    if (IS_ERROR(err)) {
+        goto cleanup;
+    }
+
+    // value types can always be created empty
+    if (ctor == NULL && !(type->IsValueType && argsCount == 0)) {
+        err = ERROR_MISSING_METHOD;
+        goto cleanup;
+    }
+
+    System_Object new;
+    if (type == tSystem_String) {
+        // Strings are variable length, so need to
+        // figure it properly
+        CHECK_FAIL("TODO: string from activator");
     } else {
-        // build the arguments nicely
-        MIR_val_t vals[argsCount];
-        for (int i = 0; i < ctor->Parameters->Length; i++) {
-            System_Type paramType = ctor->Parameters->Data[i]->ParameterType;
-            System_Object value = args[i];
-            System_Type valueType = OBJECT_TYPE(value);
-
-            switch (type_get_stack_type(paramType)) {
-                case STACK_TYPE_O: {
-                    if (type_is_interface(paramType)) {
-                        CHECK_FAIL("TODO: activator pass interface");
-                    } else {
-                        // because we box everything, interfaces are going to
-                        // be turned into objects, so we can't have this in here
-                        ASSERT(!type_is_interface(valueType));
-                        vals[i].a = value;
-                    }
-                } break;
-
-                // integer types, copy the value from the object, remember
-                // to zero it first so the copy will work nicely
-                case STACK_TYPE_INT32:
-                case STACK_TYPE_INT64:
-                case STACK_TYPE_INTPTR: {
-                    vals[i].u = 0;
-                    memcpy(&vals[i].u, value + 1, valueType->ManagedSize);
-                    // TODO: do we need to sign extend in here?
-                } break;
-
-                case STACK_TYPE_FLOAT: {
-                    if (paramType == tSystem_Single) {
-                        vals[i].f = *(float*)(value + 1);
-                    } else {
-                        vals[i].d = *(double*)(value + 1);
-                    }
-                } break;
-
-                case STACK_TYPE_VALUE_TYPE: {
-                    CHECK_FAIL("TODO: pass by value");
-                } break;
-
-                case STACK_TYPE_REF: {
-                    CHECK_FAIL("TODO: is this even valid");
-                } break;
-            }
+        new = UNSAFE_GC_NEW(type);
+        if (new == NULL) {
+            // handle quietly
+            err = ERROR_OUT_OF_MEMORY;
+            goto cleanup;
         }
+    }
+
+    // actually invoke the ctor, value types get a reference to the boxed value
+    System_Exception exception = NULL;
+    if (method != NULL) {
+        ASSERT(method->MirFunc != NULL);
+        ASSERT(method->MirFunc->addr != NULL);
 
-        // now that we built the arguments, call into it
-        MIR_val_t result = { 0 };
-        MIR_context_t ctx = jit_get_mir_context();
-        MIR_interp_arr(ctx, ctor->MirFunc, &result, argsCount, vals);
-        jit_release_mir_context();
-        exception = result.a;
+        void* this = type->IsValueType ? (void*)(new + 1) : new;
+        exception = thunk(method->MirFunc->addr, this, args, NULL);
     }
 
     // check the exception
@@ -4,9 +4,43 @@
 
 #include <converter.h>
 
+#include <stdlib.h>
 #include <string.h>
 
+/**
+ * Get the length of the ascii prefix of the string, checks a word at a time
+ */
+static size_t ascii_prefix_length(const char* str, size_t len) {
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, str + i, sizeof(word));
+        if (word & 0x8080808080808080ull) {
+            break;
+        }
+    }
+
+    for (; i < len; i++) {
+        if (str[i] & 0x80) {
+            break;
+        }
+    }
+
+    return i;
+}
+
 System_String new_string_from_utf8(const char* str, size_t len) {
+    // most strings are pure ascii, in which case every byte is a single char
+    // and we can skip the converter, which needs to go over the input twice
+    if (ascii_prefix_length(str, len) == len) {
+        ASSERT(len < SIZE_2GB);
+        System_String newStr = GC_NEW_STRING(len);
+        for (size_t i = 0; i < len; i++) {
+            newStr->Chars[i] = (uint8_t)str[i];
+        }
+        return newStr;
+    }
+
     // calculate the size needed
     size_t size_needed = utf8_to_utf16((const utf8_t*)str, len, NULL, 0);
     ASSERT(size_needed < SIZE_2GB);
@@ -19,15 +53,37 @@ System_String new_string_from_utf8(const char* str, size_t len) {
 }
 
 System_String new_string_from_cstr(const char* str) {
-    size_t len = strlen(str);
+    return new_string_from_utf8(str, strlen(str));
+}
 
-    // calculate the size needed
-    size_t size_needed = utf8_to_utf16((const utf8_t*)str, len, NULL, 0);
-    ASSERT(size_needed < SIZE_2GB);
+System_String string_intern_utf8(const char* str, size_t len) {
+    // names are short, so convert them on the stack
+    System_Char small[128];
+    System_Char* chars = small;
 
-    // allocate the string and actually do the convertion
-    System_String newStr = GC_NEW_STRING(size_needed);
-    utf8_to_utf16((const utf8_t*)str, len, newStr->Chars, newStr->Length);
+    bool ascii = ascii_prefix_length(str, len) == len;
+    size_t length = ascii ? len : utf8_to_utf16((const utf8_t*)str, len, NULL, 0);
+    ASSERT(length < SIZE_2GB);
 
-    return newStr;
+    if (length > ARRAY_LEN(small)) {
+        chars = malloc(length * sizeof(System_Char));
+        if (chars == NULL) {
+            return NULL;
+        }
+    }
+
+    if (ascii) {
+        for (size_t i = 0; i < len; i++) {
+            chars[i] = (uint8_t)str[i];
+        }
+    } else {
+        utf8_to_utf16((const utf8_t*)str, len, chars, length);
+    }
+
+    System_String string = string_intern_chars(chars, length);
+
+    if (chars != small) {
+        free(chars);
+    }
+    return string;
 }
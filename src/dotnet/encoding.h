@@ -11,3 +11,12 @@
 System_String new_string_from_utf8(const char* str, size_t len);
 
 System_String new_string_from_cstr(const char* str);
+
+/**
+ * Get the interned string with the given UTF8 chars, only allocates
+ * if there is none yet, NULL if out of memory
+ *
+ * @param str   [IN] The input string
+ * @param len   [IN] The input string length (in bytes)
+ */
+System_String string_intern_utf8(const char* str, size_t len);
@@ -0,0 +1,384 @@
+#include "alloc_profiler.h"
+
+#include "../jit/jit.h"
+
+#include <thread/thread.h>
+#include <util/strbuilder.h>
+#include <util/fastrand.h>
+#include <util/stb_ds.h>
+#include <util/trace.h>
+#include <util/defs.h>
+
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+//
+// The distance between samples is random with an exponential distribution, so every byte has
+// the same chance of being sampled no matter the size or the pattern of the allocations. Every
+// sample stands for the average distance worth of bytes, or for the object itself if it is
+// bigger than that, which keeps the totals unbiased.
+//
+// Every thread has its own table of allocation sites which only it writes to, an entry is
+// published by setting its hash last, and the counters are atomic, so taking a sample needs
+// no locks. The tables are only read when the profile is written, and are never freed since
+// the threads reuse their pthreads, and with them the table.
+//
+// The addresses are only turned into method names once the profile is written.
+//
+
+// the most frames we keep for a single allocation site, leaf first
+#define ALLOC_PROFILER_MAX_FRAMES   16
+
+// the allocation sites a single thread can tell apart, must be a power of two
+#define ALLOC_PROFILER_TABLE_SIZE   1024
+
+typedef struct alloc_profiler_entry {
+    // zero while the entry is free, set once everything else is
+    _Atomic(size_t) hash;
+
+    System_Type type;
+    int frame_count;
+    uintptr_t frames[ALLOC_PROFILER_MAX_FRAMES];
+
+    _Atomic(uint64_t) samples;
+    _Atomic(uint64_t) count;
+    _Atomic(uint64_t) bytes;
+} alloc_profiler_entry_t;
+
+typedef struct alloc_profiler_table {
+    struct alloc_profiler_table* next;
+
+    // the profiler run the entries belong to, the table is cleared
+    // by its thread when it sees a newer one
+    _Atomic(uint64_t) generation;
+
+    // samples that did not fit in the table
+    _Atomic(uint64_t) lost;
+
+    alloc_profiler_entry_t entries[ALLOC_PROFILER_TABLE_SIZE];
+} alloc_profiler_table_t;
+
+_Atomic(size_t) g_alloc_profiler_rate = 0;
+
+/**
+ * Protects the starting and stopping of the profiler
+ */
+static pthread_mutex_t m_alloc_profiler_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Bumped on every start, so old samples are thrown away
+ */
+static _Atomic(uint64_t) m_alloc_profiler_generation = 0;
+
+/**
+ * All the tables ever created, only ever pushed to
+ */
+static _Atomic(alloc_profiler_table_t*) m_alloc_profiler_tables = NULL;
+
+static THREAD_LOCAL alloc_profiler_table_t* m_alloc_profiler_table = NULL;
+
+/**
+ * The bytes the thread can still allocate before the next sample
+ */
+static THREAD_LOCAL int64_t m_alloc_profiler_next_sample = 0;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Sampling
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * A rough log2, good to about a percent which is plenty for picking the
+ * distance to the next sample, avoids pulling in libm
+ */
+static double alloc_profiler_log2(double x) {
+    union {
+        double value;
+        uint64_t bits;
+    } u = { .value = x };
+
+    int exponent = (int)((u.bits >> 52) & 0x7FF) - 1023;
+    u.bits = (u.bits & ((1ull << 52) - 1)) | (1023ull << 52);
+
+    // the mantissa is now in [1, 2)
+    double m = u.value;
+    return exponent + (-0.34484843 * m + 2.02466578) * m - 1.67487759;
+}
+
+/**
+ * Pick the distance to the next sample from an exponential distribution
+ * with the given average
+ */
+static int64_t alloc_profiler_next_distance(size_t rate) {
+    // uniform in (0, 1]
+    double u = ((double)(fastrand() >> 6) + 1.0) / (double)(1 << 26);
+    double distance = -alloc_profiler_log2(u) * 0.69314718 * (double)rate;
+    return (int64_t)distance + 1;
+}
+
+static alloc_profiler_table_t* alloc_profiler_get_table(uint64_t generation) {
+    alloc_profiler_table_t* table = m_alloc_profiler_table;
+    if (table == NULL) {
+        table = calloc(1, sizeof(alloc_profiler_table_t));
+        if (table == NULL) {
+            return NULL;
+        }
+        atomic_store_explicit(&table->generation, generation, memory_order_relaxed);
+
+        // publish it for the writer
+        table->next = atomic_load_explicit(&m_alloc_profiler_tables, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&m_alloc_profiler_tables, &table->next, table,
+                                                      memory_order_release, memory_order_relaxed));
+
+        m_alloc_profiler_table = table;
+    } else if (atomic_load_explicit(&table->generation, memory_order_relaxed) != generation) {
+        // left over from an older run, the writer ignores the table
+        // until the generation matches, so it is safe to clear it
+        for (int i = 0; i < ALLOC_PROFILER_TABLE_SIZE; i++) {
+            atomic_store_explicit(&table->entries[i].hash, 0, memory_order_relaxed);
+        }
+        atomic_store_explicit(&table->lost, 0, memory_order_relaxed);
+        atomic_store_explicit(&table->generation, generation, memory_order_release);
+    }
+
+    return table;
+}
+
+static void alloc_profiler_record(alloc_profiler_table_t* table, System_Type type, uintptr_t* frames, int frame_count,
+                                  uint64_t count, uint64_t bytes) {
+    size_t hash = stbds_hash_bytes(frames, frame_count * sizeof(uintptr_t), (size_t)type);
+    if (hash == 0) {
+        hash = 1;
+    }
+
+    for (int i = 0; i < ALLOC_PROFILER_TABLE_SIZE; i++) {
+        alloc_profiler_entry_t* entry = &table->entries[(hash + i) & (ALLOC_PROFILER_TABLE_SIZE - 1)];
+        size_t entry_hash = atomic_load_explicit(&entry->hash, memory_order_relaxed);
+
+        if (entry_hash == 0) {
+            // a new site, fill it before it becomes visible
+            entry->type = type;
+            entry->frame_count = frame_count;
+            memcpy(entry->frames, frames, frame_count * sizeof(uintptr_t));
+            atomic_store_explicit(&entry->samples, 0, memory_order_relaxed);
+            atomic_store_explicit(&entry->count, 0, memory_order_relaxed);
+            atomic_store_explicit(&entry->bytes, 0, memory_order_relaxed);
+            atomic_store_explicit(&entry->hash, hash, memory_order_release);
+        } else if (entry_hash != hash || entry->type != type || entry->frame_count != frame_count ||
+                   memcmp(entry->frames, frames, frame_count * sizeof(uintptr_t)) != 0) {
+            continue;
+        }
+
+        atomic_fetch_add_explicit(&entry->samples, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&entry->count, count, memory_order_relaxed);
+        atomic_fetch_add_explicit(&entry->bytes, bytes, memory_order_relaxed);
+        return;
+    }
+
+    atomic_fetch_add_explicit(&table->lost, 1, memory_order_relaxed);
+}
+
+__attribute__((noinline))
+void alloc_profiler_sample(System_Type type, size_t size) {
+    size_t rate = atomic_load_explicit(&g_alloc_profiler_rate, memory_order_relaxed);
+    if (rate == 0) {
+        return;
+    }
+
+    // the first allocation of a thread only starts the countdown
+    uint64_t generation = atomic_load_explicit(&m_alloc_profiler_generation, memory_order_acquire);
+    alloc_profiler_table_t* table = m_alloc_profiler_table;
+    if (table == NULL || atomic_load_explicit(&table->generation, memory_order_relaxed) != generation) {
+        m_alloc_profiler_next_sample = alloc_profiler_next_distance(rate);
+        if (alloc_profiler_get_table(generation) == NULL) {
+            return;
+        }
+    }
+
+    m_alloc_profiler_next_sample -= (int64_t)size;
+    if (m_alloc_profiler_next_sample > 0) {
+        return;
+    }
+    m_alloc_profiler_next_sample = alloc_profiler_next_distance(rate);
+    table = m_alloc_profiler_table;
+
+    // follow the frame pointers, the jitted code always keeps them, and only while
+    // they stay on our own stack, threads outside of the scheduler get no stack
+    uintptr_t frames[ALLOC_PROFILER_MAX_FRAMES];
+    int frame_count = 0;
+    thread_t* thread = get_current_thread();
+    if (thread != NULL) {
+        uintptr_t frame = (uintptr_t)__builtin_frame_address(0);
+        uintptr_t low = frame;
+        while (frame_count < ALLOC_PROFILER_MAX_FRAMES && frame >= low && frame + 16 <= thread->stack_top && (frame & 7) == 0) {
+            uintptr_t* words = (uintptr_t*)frame;
+            if (words[1] == 0) {
+                break;
+            }
+            frames[frame_count++] = words[1];
+            low = frame + 16;
+            frame = words[0];
+        }
+    }
+
+    // the sample stands for everything allocated since the last one
+    uint64_t bytes = MAX(size, rate);
+    uint64_t count = size == 0 ? 1 : MAX(bytes / size, 1);
+    alloc_profiler_record(table, type, frames, frame_count, count, bytes);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Writing
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef struct alloc_profiler_type_total {
+    uint64_t samples;
+    uint64_t count;
+    uint64_t bytes;
+} alloc_profiler_type_total_t;
+
+static void alloc_profiler_print_type(System_Type type, strbuilder_t* builder) {
+    if (type == NULL) {
+        strbuilder_cstr(builder, "[untyped]");
+    } else {
+        type_print_full_name(type, builder);
+    }
+}
+
+/**
+ * Write the collected sites and type totals, called with the profiler lock held
+ */
+static void alloc_profiler_write(uint64_t generation) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/tdn-alloc-%d.folded", getpid());
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        WARN("alloc profiler: failed to open %s", path);
+        return;
+    }
+
+    struct {
+        System_Type key;
+        alloc_profiler_type_total_t value;
+    }* totals = NULL;
+    uint64_t samples = 0;
+    uint64_t lost = 0;
+
+    for (alloc_profiler_table_t* table = atomic_load_explicit(&m_alloc_profiler_tables, memory_order_acquire);
+         table != NULL; table = table->next) {
+        if (atomic_load_explicit(&table->generation, memory_order_acquire) != generation) {
+            continue;
+        }
+        lost += atomic_load_explicit(&table->lost, memory_order_relaxed);
+
+        for (int i = 0; i < ALLOC_PROFILER_TABLE_SIZE; i++) {
+            alloc_profiler_entry_t* entry = &table->entries[i];
+            if (atomic_load_explicit(&entry->hash, memory_order_acquire) == 0) {
+                continue;
+            }
+
+            alloc_profiler_type_total_t total = {
+                .samples = atomic_load_explicit(&entry->samples, memory_order_relaxed),
+                .count = atomic_load_explicit(&entry->count, memory_order_relaxed),
+                .bytes = atomic_load_explicit(&entry->bytes, memory_order_relaxed),
+            };
+            samples += total.samples;
+
+            // the site, root first with the type as the leaf
+            bool last_native = false;
+            for (int j = entry->frame_count - 1; j >= 0; j--) {
+                // all of them are return addresses, which point past the call
+                const char* name = jit_get_code_name(entry->frames[j] - 1);
+
+                // native code doesn't have names, so fold it into a single frame
+                bool native = name == NULL;
+                if (native) {
+                    if (last_native) {
+                        continue;
+                    }
+                    name = "[native]";
+                }
+                last_native = native;
+
+                fprintf(file, "%s;", name);
+            }
+
+            strbuilder_t type_name = strbuilder_new();
+            alloc_profiler_print_type(entry->type, &type_name);
+            fprintf(file, "%s %lu\n", strbuilder_get(&type_name), total.bytes);
+            strbuilder_free(&type_name);
+
+            int index = hmgeti(totals, entry->type);
+            if (index < 0) {
+                hmput(totals, entry->type, total);
+            } else {
+                totals[index].value.samples += total.samples;
+                totals[index].value.count += total.count;
+                totals[index].value.bytes += total.bytes;
+            }
+        }
+    }
+
+    fclose(file);
+    TRACE("alloc profiler: wrote %lu samples to %s, %lu lost", samples, path, lost);
+
+    snprintf(path, sizeof(path), "/tmp/tdn-alloc-%d.types", getpid());
+    file = fopen(path, "w");
+    if (file == NULL) {
+        WARN("alloc profiler: failed to open %s", path);
+        goto cleanup;
+    }
+
+    // estimated objects and bytes, and the samples they are based on
+    for (int i = 0; i < hmlen(totals); i++) {
+        strbuilder_t type_name = strbuilder_new();
+        alloc_profiler_print_type(totals[i].key, &type_name);
+        fprintf(file, "%s\t%lu\t%lu\t%lu\n", strbuilder_get(&type_name),
+                totals[i].value.count, totals[i].value.bytes, totals[i].value.samples);
+        strbuilder_free(&type_name);
+    }
+
+    fclose(file);
+    TRACE("alloc profiler: wrote %d types to %s", (int)hmlen(totals), path);
+
+cleanup:
+    hmfree(totals);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Control
+//----------------------------------------------------------------------------------------------------------------------
+
+void alloc_profiler_start(size_t rate) {
+    if (rate == 0) {
+        rate = ALLOC_PROFILER_DEFAULT_RATE;
+    }
+
+    pthread_mutex_lock(&m_alloc_profiler_lock);
+
+    if (atomic_load(&g_alloc_profiler_rate) == 0) {
+        // the threads clear their own tables once they see the new generation
+        atomic_fetch_add(&m_alloc_profiler_generation, 1);
+        atomic_store(&g_alloc_profiler_rate, rate);
+        TRACE("alloc profiler: sampling every %zu bytes", rate);
+    }
+
+    pthread_mutex_unlock(&m_alloc_profiler_lock);
+}
+
+void alloc_profiler_stop() {
+    pthread_mutex_lock(&m_alloc_profiler_lock);
+
+    if (atomic_load(&g_alloc_profiler_rate) != 0) {
+        atomic_store(&g_alloc_profiler_rate, 0);
+        alloc_profiler_write(atomic_load(&m_alloc_profiler_generation));
+    }
+
+    pthread_mutex_unlock(&m_alloc_profiler_lock);
+}
+
+bool alloc_profiler_is_running() {
+    return atomic_load(&g_alloc_profiler_rate) != 0;
+}
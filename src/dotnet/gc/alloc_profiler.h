@@ -0,0 +1,49 @@
+#pragma once
+
+#include "../types.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/**
+ * The average amount of bytes between samples when none is given
+ */
+#define ALLOC_PROFILER_DEFAULT_RATE (512 * 1024)
+
+/**
+ * The average amount of bytes between samples, zero while the profiler is off
+ */
+extern _Atomic(size_t) g_alloc_profiler_rate;
+
+/**
+ * Start sampling the allocations of all the threads
+ *
+ * @param rate  [IN] The average amount of bytes between samples, ALLOC_PROFILER_DEFAULT_RATE if zero
+ */
+void alloc_profiler_start(size_t rate);
+
+/**
+ * Stop sampling, and write everything collected since the start, the allocation sites
+ * to /tmp/tdn-alloc-<pid>.folded in the collapsed stack format, weighted by bytes, and
+ * the totals of every type to /tmp/tdn-alloc-<pid>.types
+ */
+void alloc_profiler_stop();
+
+/**
+ * Is the profiler currently sampling
+ */
+bool alloc_profiler_is_running();
+
+/**
+ * Take a sample if the thread allocated enough since the last one
+ */
+void alloc_profiler_sample(System_Type type, size_t size);
+
+/**
+ * Called by the gc for every allocation, only costs a load while the profiler is off
+ */
+static inline void alloc_profiler_allocated(System_Type type, size_t size) {
+    if (atomic_load_explicit(&g_alloc_profiler_rate, memory_order_relaxed) != 0) {
+        alloc_profiler_sample(type, size);
+    }
+}
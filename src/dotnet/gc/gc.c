@@ -1,6 +1,8 @@
 #include "gc.h"
 
+#include "alloc_profiler.h"
 #include "gc_thread_data.h"
+#include "heap_snapshot.h"
 #include "heap.h"
 
 #include "../monitor.h"
@@ -8,16 +10,27 @@
 
 #include <sync/conditional.h>
 #include <sync/wait_group.h>
+#include <sync/semaphore.h>
 
 #include <thread/scheduler.h>
 #include <thread/thread.h>
 
+#include <util/strbuilder.h>
 #include <util/stb_ds.h>
+#include <util/fastrand.h>
+#include <util/trace_event.h>
 #include <time/tsc.h>
+#include <mem/malloc.h>
+#include <mem/system_memory.h>
 
 
 #include <stdnoreturn.h>
 #include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 
 /**
  * Get the gc local data as fs relative pointer, this should allow the compiler
@@ -45,6 +58,16 @@ static int m_clear_color = COLOR_YELLOW;
  */
 static _Atomic(bool) m_gc_tracing = false;
 
+/**
+ * The color of the write-barrier fast path, with side colors the JIT
+ * can't check the color inline so the fast path is always disabled
+ */
+#ifdef TDN_GC_SIDE_COLORS
+volatile uint8_t g_gc_barrier_fast_color = GC_BARRIER_FAST_COLOR_NONE;
+#else
+volatile uint8_t g_gc_barrier_fast_color = COLOR_WHITE;
+#endif
+
 /**
  * The gc/collector thread
  */
@@ -73,11 +96,373 @@ void gc_add_root(void* object) {
     spinlock_unlock(&m_global_roots_lock);
 }
 
-void* gc_new(System_Type type, size_t size) {
-    scheduler_preempt_disable();
+/**
+ * A batch of roots that was added at once, these are immutable once
+ * added so they can be scanned without taking any lock
+ */
+typedef struct gc_root_segment {
+    struct gc_root_segment* next;
+    size_t count;
+    System_Object* roots[];
+} gc_root_segment_t;
+
+static _Atomic(gc_root_segment_t*) m_gc_root_segments = NULL;
+
+err_t gc_add_root_segment(void** roots, size_t count) {
+    err_t err = NO_ERROR;
+
+    if (count == 0) {
+        goto cleanup;
+    }
+
+    gc_root_segment_t* segment = malloc(sizeof(gc_root_segment_t) + count * sizeof(System_Object*));
+    CHECK_ERROR(segment != NULL, ERROR_OUT_OF_MEMORY);
+    segment->count = count;
+    memcpy(segment->roots, roots, count * sizeof(System_Object*));
+
+    // publish it
+    segment->next = atomic_load(&m_gc_root_segments);
+    while (!atomic_compare_exchange_weak(&m_gc_root_segments, &segment->next, segment));
+
+cleanup:
+    return err;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Pacing, triggers a collection once enough memory was allocated since the last one
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Allocations are accounted locally and only flushed to the global
+ * counters once in a while, to not bounce the cache line around
+ */
+#define GC_PACER_FLUSH_BYTES    (64 * 1024)
+
+/**
+ * The minimum amount of bytes to allocate before triggering a collection
+ */
+#define GC_PACER_MIN_TRIGGER    (4 * 1024 * 1024)
+
+/**
+ * How much of the cgroup memory limit the heap gets when there is no explicit
+ * hard limit, the rest is left for fragmentation and the native allocations
+ */
+#define GC_HARD_LIMIT_CGROUP_PERCENT    75
+
+/**
+ * Once this much of the hard limit is in use the system is considered under
+ * high memory load, and the pacer won't let the heap grow past this point
+ */
+#define GC_HIGH_MEMORY_LOAD_PERCENT     90
+
+/**
+ * The percent of the live heap that can be allocated before
+ * the next collection is triggered
+ */
+static int m_gc_target_percent = 100;
+
+/**
+ * The soft memory limit of the heap, 0 for no limit, once we get close
+ * to it collections are going to be triggered more often
+ */
+static size_t m_gc_soft_memory_limit = 0;
+
+/**
+ * The hard memory limit of the heap, 0 for no limit, past it allocations have
+ * to wait for a collection to make room, and fail if it can't
+ */
+static size_t m_gc_hard_memory_limit = 0;
+
+/**
+ * The amount of bytes that are in use on the heap, updated when
+ * allocations and frees are flushed
+ */
+static atomic_size_t m_gc_heap_bytes = 0;
+
+/**
+ * The amount of bytes allocated since the last collection
+ */
+static atomic_size_t m_gc_allocated_bytes = 0;
+
+/**
+ * Once the allocated bytes reach this a collection is triggered
+ */
+static atomic_size_t m_gc_trigger_bytes = GC_PACER_MIN_TRIGGER;
+
+static THREAD_LOCAL size_t m_gc_local_allocated_bytes = 0;
+static THREAD_LOCAL size_t m_gc_local_freed_bytes = 0;
+
+/**
+ * The pacer wants the collector woken up, the pacer runs with preemption disabled
+ * so the wakeup, which takes the gc mutex, is done once the allocation is done
+ */
+static THREAD_LOCAL bool m_gc_wake_pending = false;
 
+/**
+ * Set while the collector runs or a collection was requested, the pacer reads
+ * it without the gc mutex so only the flush that starts a collection locks it
+ */
+static atomic_bool m_gc_running;
+
+void gc_set_target_percent(int percent) {
+    m_gc_target_percent = percent;
+}
+
+void gc_set_soft_memory_limit(size_t bytes) {
+    m_gc_soft_memory_limit = bytes;
+}
+
+void gc_set_hard_memory_limit(size_t bytes) {
+    m_gc_hard_memory_limit = MIN(bytes, heap_get_max_size());
+}
+
+/**
+ * The point past which the memory load is considered high, relative to the
+ * hard limit if there is one and to the whole memory otherwise
+ */
+static size_t gc_high_memory_load_threshold(size_t total) {
+    return total / 100 * GC_HIGH_MEMORY_LOAD_PERCENT;
+}
+
+/**
+ * Parse a size with an optional k/m/g suffix, 0 if invalid
+ */
+static size_t gc_parse_size(const char* str) {
+    char* end;
+    size_t value = strtoull(str, &end, 0);
+    switch (*end) {
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+        default: break;
+    }
+    return *end == '\0' ? value : 0;
+}
+
+/**
+ * Take the hard limit from TDN_GC_HEAP_HARD_LIMIT, or from the cgroup we run in
+ */
+static void gc_init_memory_limit() {
+    const char* env = getenv("TDN_GC_HEAP_HARD_LIMIT");
+    if (env != NULL) {
+        size_t limit = gc_parse_size(env);
+        if (limit == 0) {
+            WARN("gc: invalid TDN_GC_HEAP_HARD_LIMIT `%s`", env);
+        }
+        gc_set_hard_memory_limit(limit);
+        return;
+    }
+
+    size_t cgroup_limit = get_cgroup_memory_limit();
+    if (cgroup_limit != 0) {
+        gc_set_hard_memory_limit(cgroup_limit / 100 * GC_HARD_LIMIT_CGROUP_PERCENT);
+    }
+}
+
+static void gc_pacer_allocated(size_t size) {
+    m_gc_local_allocated_bytes += size;
+    if (m_gc_local_allocated_bytes < GC_PACER_FLUSH_BYTES) {
+        return;
+    }
+
+    size_t bytes = m_gc_local_allocated_bytes;
+    m_gc_local_allocated_bytes = 0;
+    atomic_fetch_add(&m_gc_heap_bytes, bytes);
+    size_t allocated = atomic_fetch_add(&m_gc_allocated_bytes, bytes) + bytes;
+
+    // negative percent means the pacer is disabled, and if a collection
+    // is already on its way there is nothing to wake
+    if (m_gc_target_percent >= 0 && allocated >= m_gc_trigger_bytes && !atomic_load(&m_gc_running)) {
+        m_gc_wake_pending = true;
+    }
+}
+
+/**
+ * Wake the collector if the pacer asked for it, must be called with preemption enabled
+ */
+static void gc_pacer_wake_pending() {
+    if (m_gc_wake_pending) {
+        m_gc_wake_pending = false;
+        gc_wake(false);
+    }
+}
+
+static void gc_pacer_freed(size_t size) {
+    m_gc_local_freed_bytes += size;
+}
+
+static void gc_pacer_flush_freed() {
+    atomic_fetch_sub(&m_gc_heap_bytes, MIN(m_gc_local_freed_bytes, m_gc_heap_bytes));
+    m_gc_local_freed_bytes = 0;
+}
+
+/**
+ * Called at the end of a collection to calculate the next trigger
+ */
+static void gc_pacer_update() {
+    size_t live = m_gc_heap_bytes;
+
+    // the goal is relative to the live heap
+    size_t trigger = live / 100 * MAX(m_gc_target_percent, 0);
+
+    // try to stay under the soft memory limit
+    if (m_gc_soft_memory_limit != 0) {
+        size_t headroom = m_gc_soft_memory_limit > live ? m_gc_soft_memory_limit - live : 0;
+        trigger = MIN(trigger, headroom);
+    }
+
+    // and to collect in the background well before the hard limit
+    // makes the allocations wait for it
+    if (m_gc_hard_memory_limit != 0) {
+        size_t threshold = gc_high_memory_load_threshold(m_gc_hard_memory_limit);
+        size_t headroom = threshold > live ? threshold - live : 0;
+        trigger = MIN(trigger, headroom);
+    }
+
+    m_gc_trigger_bytes = MAX(trigger, GC_PACER_MIN_TRIGGER);
+    m_gc_allocated_bytes = 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Finalization queues
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * All the objects that have a finalizer, registered on allocation and
+ * checked on every sweep
+ */
+static System_Object* m_gc_finalizable = NULL;
+static spinlock_t m_gc_finalizable_lock;
+
+/**
+ * Objects that are dead and should have their finalizer ran, these are roots
+ * until the finalizer thread takes them
+ */
+static System_Object* m_gc_finalization_queue = NULL;
+static spinlock_t m_gc_finalization_queue_lock;
+
+/**
+ * The object that is currently being finalized, also a root
+ */
+static System_Object m_gc_finalizing = NULL;
+
+/**
+ * The amount of objects in the finalization queue
+ */
+static atomic_size_t m_objects_to_finalize = 0;
+
+static void gc_register_finalizable(System_Object object) {
+    spinlock_lock(&m_gc_finalizable_lock);
+    arrpush(m_gc_finalizable, object);
+    spinlock_unlock(&m_gc_finalizable_lock);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Immortal objects
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * While above zero all the allocations of this thread are immortal
+ */
+static THREAD_LOCAL int m_gc_immortal_depth = 0;
+
+/**
+ * All the immortal objects, these are never traced as part of the graph nor freed, instead
+ * their fields are scanned as roots on every collection
+ */
+static System_Object* m_gc_immortal = NULL;
+static spinlock_t m_gc_immortal_lock;
+
+/**
+ * The immortal objects before this index were already scanned by a previous
+ * collection, a young collection only scans them again if they were written to
+ */
+static size_t m_gc_immortal_scanned = 0;
+
+/**
+ * The immortal objects on dirty cards, found when clearing the cards
+ */
+static System_Object* m_gc_immortal_dirty = NULL;
+
+void gc_immortal_begin() {
+    m_gc_immortal_depth++;
+}
+
+void gc_immortal_end() {
+    ASSERT(m_gc_immortal_depth > 0);
+    m_gc_immortal_depth--;
+}
+
+/**
+ * Run a collection for an allocation that has no room, each attempt is more aggressive
+ * than the one before, returns false once there is nothing left to try
+ */
+static bool gc_collect_for_allocation(int attempt) {
+    // the collector needs us to reach a safepoint, which we can't
+    // do if the caller has preemption disabled
+    if (!scheduler_is_preemption()) {
+        return false;
+    }
+
+    switch (attempt) {
+        // most of what is allocated dies young
+        case 0: gc_wait(false); return true;
+
+        // everything that is unreachable
+        case 1: gc_wait(true); return true;
+
+        // and whatever the finalizers let go of since
+        case 2: gc_wait(true); return true;
+
+        default: return false;
+    }
+}
+
+static bool gc_has_room(size_t size) {
+    return m_gc_hard_memory_limit == 0 || m_gc_heap_bytes + size <= m_gc_hard_memory_limit;
+}
+
+/**
+ * Allocate from the heap, collecting first if it is at the hard limit or out of memory,
+ * returns with preemption disabled unless it failed
+ */
+static System_Object gc_heap_alloc(size_t size, bool immortal) {
+    for (int attempt = 0; ; attempt++) {
+        if (gc_has_room(size)) {
+            scheduler_preempt_disable();
+            System_Object o = heap_alloc(size, immortal ? COLOR_IMMORTAL : m_allocation_color);
+            if (o != NULL) {
+                return o;
+            }
+            scheduler_preempt_enable();
+        }
+
+        if (!gc_collect_for_allocation(attempt)) {
+            return NULL;
+        }
+    }
+}
+
+void* gc_new(System_Type type, size_t size) {
     // allocate the object
-    System_Object o = heap_alloc(size, m_allocation_color);
+    bool immortal = m_gc_immortal_depth != 0;
+    System_Object o = gc_heap_alloc(size, immortal);
+    if (o == NULL) {
+        return NULL;
+    }
+
+    if (immortal) {
+        spinlock_lock(&m_gc_immortal_lock);
+        arrpush(m_gc_immortal, o);
+        spinlock_unlock(&m_gc_immortal_lock);
+    }
+
+    // account for it, might trigger a collection
+    size_t allocated = heap_object_size(o);
+    gc_pacer_allocated(allocated);
+    if (!immortal) {
+        alloc_profiler_allocated(type, allocated);
+    }
 
     // set the object type
     if (type != NULL) {
@@ -85,31 +470,367 @@ void* gc_new(System_Type type, size_t size) {
         o->vtable = type->VTable;
     }
 
-    // if there is no finalize then always suppress the finalizer
+    // if there is no finalize then always suppress the finalizer,
+    // otherwise remember it so the sweep can find it
     if (type != NULL) {
         o->suppress_finalizer = type->Finalize == NULL;
+        if (type->Finalize != NULL && !immortal) {
+            gc_register_finalizable(o);
+        }
     }
 
     scheduler_preempt_enable();
+    gc_pacer_wake_pending();
 
     return o;
 }
 
+void* gc_new_fixed(System_Type type) {
+    // immortal allocations need the extra tracking
+    if (m_gc_immortal_depth != 0) {
+        return gc_new(type, type->ManagedSize);
+    }
+
+    // no finalizer and no immortal tracking, so this is only the
+    // heap allocation and the header
+    System_Object o = gc_heap_alloc(type->ManagedSize, false);
+    if (o == NULL) {
+        return NULL;
+    }
+
+    size_t allocated = heap_object_size(o);
+    gc_pacer_allocated(allocated);
+    alloc_profiler_allocated(type, allocated);
+    o->type = (uintptr_t)type;
+    o->vtable = type->VTable;
+    o->suppress_finalizer = true;
+
+    scheduler_preempt_enable();
+    gc_pacer_wake_pending();
+
+    return o;
+}
+
+void* gc_new_array(System_Type elementType, size_t count) {
+    System_Type arrayType = get_array_type(elementType);
+    if (arrayType == NULL) return NULL;
+
+    // calculate the size once, making sure it won't overflow
+    size_t size;
+    if (__builtin_mul_overflow(elementType->StackSize, count, &size)) return NULL;
+    if (__builtin_add_overflow(size, arrayType->ManagedSize, &size)) return NULL;
+
+    System_Array array = gc_new(arrayType, size);
+    if (array == NULL) return NULL;
+    array->Length = count;
+
+    return array;
+}
+
+/**
+ * The shared empty arrays, by element type
+ */
+static struct {
+    System_Type key;
+    System_Array value;
+}* m_gc_empty_arrays = NULL;
+static spinlock_t m_gc_empty_arrays_lock;
+
+void* gc_empty_array(System_Type elementType) {
+    spinlock_lock(&m_gc_empty_arrays_lock);
+    int idx = hmgeti(m_gc_empty_arrays, elementType);
+    System_Array array = idx < 0 ? NULL : m_gc_empty_arrays[idx].value;
+    spinlock_unlock(&m_gc_empty_arrays_lock);
+    if (array != NULL) {
+        return array;
+    }
+
+    // allocate outside of the lock since the allocation might have to wait
+    // for a collection, if we raced with another thread then ours is wasted
+    // but it is tiny and this only happens once per element type
+    gc_immortal_begin();
+    array = gc_new_array(elementType, 0);
+    gc_immortal_end();
+    if (array == NULL) return NULL;
+
+    spinlock_lock(&m_gc_empty_arrays_lock);
+    idx = hmgeti(m_gc_empty_arrays, elementType);
+    if (idx < 0) {
+        hmput(m_gc_empty_arrays, elementType, array);
+    } else {
+        array = m_gc_empty_arrays[idx].value;
+    }
+    spinlock_unlock(&m_gc_empty_arrays_lock);
+
+    return array;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Mark stack, holds all the gray objects that still need to be traced
+//----------------------------------------------------------------------------------------------------------------------
+
 /**
- * Used to tell the collector that there are more gray objects
+ * The amount of objects the mark stack can hold before overflowing
  */
-static _Atomic(bool) m_gc_has_gray_objects = false;
+#define GC_MARK_STACK_SIZE  (64 * 1024)
+
+/**
+ * The amount of objects the collector takes from the mark stack at once
+ */
+#define GC_MARK_STACK_BATCH 64
+
+/**
+ * The gray objects, can be pushed by both the mutators and the collector
+ */
+static System_Object m_gc_mark_stack[GC_MARK_STACK_SIZE];
+static _Atomic(size_t) m_gc_mark_stack_top = 0;
+static spinlock_t m_gc_mark_stack_lock;
+
+/**
+ * Set when a gray object could not be pushed to the mark stack, in which case
+ * the collector will have to rescan the heap for gray objects
+ */
+static _Atomic(bool) m_gc_mark_stack_overflow = false;
+
+static void gc_mark_stack_push(System_Object object) {
+    // the lock holder may be a mutator which is currently suspended by a
+    // handshake, so never block on it, just let the collector rescan
+    if (!spinlock_try_lock(&m_gc_mark_stack_lock)) {
+        m_gc_mark_stack_overflow = true;
+        return;
+    }
+
+    if (m_gc_mark_stack_top < GC_MARK_STACK_SIZE) {
+        m_gc_mark_stack[m_gc_mark_stack_top++] = object;
+    } else {
+        m_gc_mark_stack_overflow = true;
+    }
+    spinlock_unlock(&m_gc_mark_stack_lock);
+}
+
+static size_t gc_mark_stack_pop(System_Object* objects, size_t count) {
+    spinlock_lock(&m_gc_mark_stack_lock);
+    count = MIN(count, m_gc_mark_stack_top);
+    m_gc_mark_stack_top -= count;
+    memcpy(objects, &m_gc_mark_stack[m_gc_mark_stack_top], count * sizeof(System_Object));
+    spinlock_unlock(&m_gc_mark_stack_lock);
+    return count;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Mark workers, each of them has its own local mark stack which the other workers can steal from
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * The max amount of mark workers, including the collector itself
+ */
+#define GC_MAX_MARK_WORKERS         32
+
+/**
+ * The amount of objects a single worker can hold locally before
+ * spilling to the global mark stack
+ */
+#define GC_MARK_WORKER_STACK_SIZE   4096
+
+typedef struct gc_mark_worker {
+    // the local gray objects, the owner pushes and pops from the
+    // top while thieves steal from the bottom
+    System_Object objects[GC_MARK_WORKER_STACK_SIZE];
+    _Atomic(size_t) top;
+    spinlock_t lock;
+
+    // used to wake the worker for a new trace
+    semaphore_t wake;
+
+    // the thread running this worker
+    thread_t* thread;
+} gc_mark_worker_t;
+
+/**
+ * All the mark workers, the first one is always the collector thread
+ */
+static gc_mark_worker_t m_gc_mark_workers[GC_MAX_MARK_WORKERS];
+static int m_gc_mark_workers_count = 1;
+
+/**
+ * The worker of the current thread, NULL for mutators
+ */
+static THREAD_LOCAL gc_mark_worker_t* m_gc_mark_worker = NULL;
+
+/**
+ * Amount of workers that found no work, once it reaches the amount
+ * of workers the trace is complete
+ */
+static atomic_int m_gc_mark_idle_workers = 0;
+
+/**
+ * Signaled by the helper workers when they are done with a trace
+ */
+static wait_group_t m_gc_mark_done = INIT_WAIT_GROUP();
+
+/**
+ * The status the helpers should trace with, same as the collector
+ */
+static gc_thread_status_t m_gc_mark_status = THREAD_STATUS_ASYNC;
+
+static void gc_mark_worker_push(gc_mark_worker_t* worker, System_Object object) {
+    spinlock_lock(&worker->lock);
+    if (worker->top < GC_MARK_WORKER_STACK_SIZE) {
+        worker->objects[worker->top++] = object;
+        object = NULL;
+    }
+    spinlock_unlock(&worker->lock);
+
+    // no place locally, spill to the global stack
+    if (object != NULL) {
+        gc_mark_stack_push(object);
+    }
+}
+
+static size_t gc_mark_worker_pop(gc_mark_worker_t* worker, System_Object* objects, size_t count) {
+    spinlock_lock(&worker->lock);
+    count = MIN(count, worker->top);
+    worker->top -= count;
+    memcpy(objects, &worker->objects[worker->top], count * sizeof(System_Object));
+    spinlock_unlock(&worker->lock);
+    return count;
+}
+
+static size_t gc_mark_worker_steal(gc_mark_worker_t* thief, System_Object* objects, size_t count) {
+    // start from a random victim so the thieves won't all go after the same worker
+    int start = fastrandn(m_gc_mark_workers_count);
+    for (int i = 0; i < m_gc_mark_workers_count; i++) {
+        gc_mark_worker_t* victim = &m_gc_mark_workers[(start + i) % m_gc_mark_workers_count];
+        if (victim == thief || victim->top == 0) continue;
+
+        // take up to half of the victim's objects from the bottom, these
+        // are the oldest so are most likely to have large sub-graphs
+        spinlock_lock(&victim->lock);
+        size_t stolen = MIN(count, (victim->top + 1) / 2);
+        memcpy(objects, victim->objects, stolen * sizeof(System_Object));
+        memmove(victim->objects, &victim->objects[stolen], (victim->top - stolen) * sizeof(System_Object));
+        victim->top -= stolen;
+        spinlock_unlock(&victim->lock);
+
+        if (stolen != 0) {
+            return stolen;
+        }
+    }
+    return 0;
+}
+
+static bool gc_mark_has_work() {
+    if (m_gc_mark_stack_top != 0) return true;
+    for (int i = 0; i < m_gc_mark_workers_count; i++) {
+        if (m_gc_mark_workers[i].top != 0) return true;
+    }
+    return false;
+}
+
+/**
+ * How many times an idle worker looks for work before it starts yielding, and
+ * how many times it yields before going to sleep until there is work
+ */
+#define GC_MARK_IDLE_SPINS      64
+#define GC_MARK_IDLE_YIELDS     4
+
+/**
+ * The idle workers that went to sleep, woken once there is work or the trace
+ * is done, there are as many posts on the semaphore as the sleepers taken
+ */
+static atomic_int m_gc_mark_sleepers = 0;
+static semaphore_t m_gc_mark_idle;
+
+/**
+ * Wake all the sleeping workers, called after pushing work
+ */
+static void gc_mark_wake_sleepers() {
+    // pairs with the sleeper looking for work once it counted itself
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&m_gc_mark_sleepers, memory_order_relaxed) == 0) {
+        return;
+    }
+
+    int count = atomic_exchange(&m_gc_mark_sleepers, 0);
+    for (int i = 0; i < count; i++) {
+        semaphore_release(&m_gc_mark_idle, false);
+    }
+}
+
+static bool gc_mark_worker_should_wake() {
+    return atomic_load(&m_gc_mark_idle_workers) == m_gc_mark_workers_count || gc_mark_has_work();
+}
+
+static void gc_mark_worker_sleep() {
+    atomic_fetch_add(&m_gc_mark_sleepers, 1);
+
+    // look again now that anyone pushing work will see us, and take ourselves
+    // out unless someone already took us and is about to wake us
+    if (gc_mark_worker_should_wake()) {
+        int sleepers = atomic_load(&m_gc_mark_sleepers);
+        while (sleepers > 0) {
+            if (atomic_compare_exchange_weak(&m_gc_mark_sleepers, &sleepers, sleepers - 1)) {
+                return;
+            }
+        }
+    }
+
+    semaphore_acquire(&m_gc_mark_idle, false);
+}
+
+/**
+ * Called by a worker that has no more work, returns true once all the workers
+ * are out of work, or false if there is more work to be done
+ */
+static bool gc_mark_worker_terminate() {
+    if (atomic_fetch_add(&m_gc_mark_idle_workers, 1) + 1 == m_gc_mark_workers_count) {
+        // we are the last one, let the sleeping ones know
+        gc_mark_wake_sleepers();
+        return true;
+    }
+
+    for (int i = 0; ; i++) {
+        if (atomic_load(&m_gc_mark_idle_workers) == m_gc_mark_workers_count) {
+            return true;
+        }
+
+        if (gc_mark_has_work()) {
+            atomic_fetch_sub(&m_gc_mark_idle_workers, 1);
+            return false;
+        }
+
+        // the worker with the work might need our cpu
+        if (i < GC_MARK_IDLE_SPINS) {
+            __builtin_ia32_pause();
+        } else if (i < GC_MARK_IDLE_SPINS + GC_MARK_IDLE_YIELDS) {
+            scheduler_yield();
+        } else {
+            gc_mark_worker_sleep();
+        }
+    }
+}
+
+static bool gc_is_mark_worker(thread_t* thread) {
+    for (int i = 1; i < m_gc_mark_workers_count; i++) {
+        if (m_gc_mark_workers[i].thread == thread) return true;
+    }
+    return false;
+}
 
 static void gc_mark_gray(System_Object object) {
+    if (object == NULL) return;
+
+    int color = heap_get_color(object);
     if (
-        object != NULL &&
-        (
-            object->color == m_clear_color ||
-            (object->color == m_allocation_color && GTD->status != THREAD_STATUS_ASYNC)
-        )
+        color == m_clear_color ||
+        (color == m_allocation_color && GTD->status != THREAD_STATUS_ASYNC)
     ) {
-        object->color = COLOR_GRAY;
-        m_gc_has_gray_objects = true;
+        heap_set_color(object, COLOR_GRAY);
+        if (m_gc_mark_worker != NULL) {
+            gc_mark_worker_push(m_gc_mark_worker, object);
+        } else {
+            gc_mark_stack_push(object);
+        }
     }
 }
 
@@ -121,13 +842,11 @@ void gc_update(void* o, size_t offset, void* new) {
         gc_mark_gray(new);
     } else if (m_gc_tracing) {
         gc_mark_gray(o);
-        // Mark card, done implicitly because we
-        // are going to change the object
-    } else {
-        // Mark card, done implicitly because we
-        // are going to change the object
     }
 
+    // mark the card, must happen before the store
+    heap_mark_card(o);
+
     // set it
     write_field(o, offset, new);
 
@@ -144,49 +863,335 @@ void gc_compare_exchange_ref(_Atomic System_Object* ptr, System_Object new, Syst
             gc_mark_gray(new);
         } else if (m_gc_tracing) {
             gc_mark_gray(object);
-            // Mark card, done implicitly because we
-            // are going to change the object
-        } else {
-            // Mark card, done implicitly because we
-            // are going to change the object
         }
 
+        // mark the card, must happen before the store
+        heap_mark_card(object);
+
         // set it
         atomic_compare_exchange_strong(ptr, &comparand, new);
 
-        scheduler_preempt_enable();
-    } else {
-        atomic_compare_exchange_strong(ptr, &comparand, new);
+        scheduler_preempt_enable();
+    } else {
+        atomic_compare_exchange_strong(ptr, &comparand, new);
+    }
+}
+
+void gc_update_ref(void* ptr, void* new) {
+    System_Object object = heap_find_fast(ptr);
+    if (object != NULL) {
+        gc_update(object, (uintptr_t)ptr - (uintptr_t)object, new);
+    } else {
+        write_field(ptr, 0, new);
+    }
+}
+
+static void gc_mark_refs_gray(System_Object* refs, size_t count);
+
+static void gc_mark_offsets_in_range_gray(uint8_t* base, size_t base_offset, int* offsets, size_t start, size_t end) {
+    for (int i = 0; i < arrlen(offsets); i++) {
+        size_t offset = base_offset + offsets[i];
+        if (offset >= start && offset < end) {
+            gc_mark_gray(read_field(base, offset));
+        }
+    }
+}
+
+/**
+ * Shade all the references of the object that are inside of the given range
+ */
+static void gc_mark_range_gray(System_Object object, size_t offset, size_t size) {
+    System_Type type = OBJECT_TYPE(object);
+    size_t end = offset + size;
+
+    if (!type->IsArray) {
+        gc_mark_offsets_in_range_gray((uint8_t*)object, 0, type->ManagedPointersOffsets, offset, end);
+        return;
+    }
+
+    System_Array array = (System_Array)object;
+    System_Type elementType = type->ElementType;
+    size_t data = sizeof(struct System_Array);
+    if (offset < data) offset = data;
+    if (end <= offset) return;
+
+    if (elementType->IsValueType) {
+        if (arrlen(elementType->ManagedPointersOffsets) == 0) return;
+
+        // only go over the items that are intersecting the range
+        size_t stride = elementType->StackSize;
+        size_t first = (offset - data) / stride;
+        size_t last = MIN((end - data + stride - 1) / stride, (size_t)array->Length);
+        for (size_t i = first; i < last; i++) {
+            gc_mark_offsets_in_range_gray((uint8_t*)object, data + i * stride,
+                                          elementType->ManagedPointersOffsets, offset, end);
+        }
+    } else {
+        size_t first = (offset - data + sizeof(void*) - 1) / sizeof(void*);
+        size_t last = MIN((end - data) / sizeof(void*), (size_t)array->Length);
+        if (first < last) {
+            gc_mark_refs_gray((System_Object*)(array + 1) + first, last - first);
+        }
+    }
+}
+
+void gc_update_range(void* o, size_t offset, const void* from, size_t size) {
+    scheduler_preempt_disable();
+
+    // mark the card once for the whole range, must happen before the copy
+    heap_mark_card(o);
+
+    memmove((uint8_t*)o + offset, from, size);
+
+    // the new references are only in there after the copy, and no
+    // collection can start in between with preemption disabled
+    if (GTD->status != THREAD_STATUS_ASYNC) {
+        gc_mark_gray(o);
+        gc_mark_range_gray(o, offset, size);
+    } else if (m_gc_tracing) {
+        gc_mark_gray(o);
+    }
+
+    scheduler_preempt_enable();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Statistics of the collection cycles
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * The amount of cycles we keep the statistics of
+ */
+#define GC_CYCLE_HISTORY 64
+
+/**
+ * The statistics of the last cycles, as a ring buffer
+ */
+static gc_cycle_info_t m_gc_cycles[GC_CYCLE_HISTORY];
+static spinlock_t m_gc_cycles_lock;
+
+/**
+ * The statistics of the cycle that currently runs, only
+ * modified by the collector and the handshake thread
+ */
+static gc_cycle_info_t m_gc_current_cycle;
+
+/**
+ * The total amount of time mutators were suspended by the
+ * handshakes, and when the gc was initialized
+ */
+static atomic_uint_fast64_t m_gc_total_pause_time = 0;
+static uint64_t m_gc_init_time = 0;
+
+static void gc_cycle_record_handshake(thread_t* thread, uint64_t latency) {
+    thread->tcb->gc_data.last_handshake_latency = latency;
+    m_gc_current_cycle.handshake_time += latency;
+    if (latency > m_gc_current_cycle.max_handshake_latency) {
+        m_gc_current_cycle.max_handshake_latency = latency;
+        m_gc_current_cycle.max_handshake_latency_tid = thread->tid;
+    }
+    m_gc_total_pause_time += latency;
+}
+
+static void gc_cycle_commit() {
+    spinlock_lock(&m_gc_cycles_lock);
+    m_gc_cycles[m_gc_current_cycle.index % GC_CYCLE_HISTORY] = m_gc_current_cycle;
+    spinlock_unlock(&m_gc_cycles_lock);
+}
+
+bool gc_get_cycle_info(uint64_t index, gc_cycle_info_t* info) {
+    bool found = false;
+    spinlock_lock(&m_gc_cycles_lock);
+    gc_cycle_info_t* cycle = &m_gc_cycles[index % GC_CYCLE_HISTORY];
+    if (index != 0 && cycle->index == index) {
+        *info = *cycle;
+        found = true;
+    }
+    spinlock_unlock(&m_gc_cycles_lock);
+    return found;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Handshaking with all the threads, async to the main collector
+//----------------------------------------------------------------------------------------------------------------------
+
+static const char* m_status_str[] = {
+    [THREAD_STATUS_ASYNC] = "ASYNC",
+    [THREAD_STATUS_SYNC1] = "SYNC1",
+    [THREAD_STATUS_SYNC2] = "SYNC2",
+};
+
+static void gc_mark_ptr(uintptr_t ptr) {
+    System_Object object = heap_find(ptr);
+    if (object != NULL) {
+        gc_mark_gray(object);
+    }
+}
+
+static wait_group_t m_gc_handshake_wg = INIT_WAIT_GROUP();
+
+/**
+ * How long to wait for a thread to get to a safepoint before falling
+ * back to suspending it with a signal, in microseconds
+ */
+#define GC_SAFEPOINT_TIMEOUT 1000
+
+volatile uint8_t g_gc_safepoint_pending = 0;
+
+/**
+ * The status of the handshake that is currently running
+ */
+static gc_thread_status_t m_gc_handshake_status = THREAD_STATUS_ASYNC;
+
+/**
+ * The amount of threads that were asked to handshake and did not yet
+ */
+static atomic_int m_gc_handshake_remaining = 0;
+
+typedef struct gc_handshake_request {
+    thread_t* thread;
+    bool done;
+} gc_handshake_request_t;
+
+/**
+ * The threads that were asked to handshake, only used by the handshake thread
+ */
+static gc_handshake_request_t* m_gc_handshake_requests = NULL;
+
+/**
+ * Do the handshake of a thread that is stopped, the thread's registers
+ * must have been saved
+ */
+static void gc_handshake_stopped_thread(thread_t* thread, gc_thread_status_t status) {
+    gc_thread_data_t* gcl = &thread->tcb->tcb->gc_data;
+
+    // sync2 == finding roots
+    if (status == THREAD_STATUS_SYNC2) {
+        thread_save_state_t* regs = &thread->save_state;
+
+        // mark the stack
+        for (uintptr_t ptr = ALIGN_UP(regs->rsp - 128, 8); ptr <= (uintptr_t)thread->stack_top - 8; ptr += 8) {
+            gc_mark_ptr(*((uintptr_t*)(ptr)));
+        }
+
+        // mark the registers
+        gc_mark_ptr(regs->r15);
+        gc_mark_ptr(regs->r14);
+        gc_mark_ptr(regs->r13);
+        gc_mark_ptr(regs->r12);
+        gc_mark_ptr(regs->r11);
+        gc_mark_ptr(regs->r10);
+        gc_mark_ptr(regs->r9);
+        gc_mark_ptr(regs->r8);
+        gc_mark_ptr(regs->rbp);
+        gc_mark_ptr(regs->rdi);
+        gc_mark_ptr(regs->rsi);
+        gc_mark_ptr(regs->rdx);
+        gc_mark_ptr(regs->rcx);
+        gc_mark_ptr(regs->rbx);
+        gc_mark_ptr(regs->rax);
+
+        // the managed thread instance for this thread
+        gc_mark_ptr((uintptr_t) thread->tcb->managed_thread);
+    }
+
+    // set the status
+    gcl->status = status;
+}
+
+/**
+ * Handshake with a thread that is blocked in a safe region, returns false
+ * if the thread is not in one
+ */
+static bool gc_handshake_safe_thread(thread_t* thread, gc_thread_status_t status) {
+    spinlock_lock(&thread->gc_lock);
+    bool safe = thread->gc_safe;
+    if (safe) {
+        gc_handshake_stopped_thread(thread, status);
+    }
+    spinlock_unlock(&thread->gc_lock);
+    return safe;
+}
+
+void gc_safepoint() {
+    thread_t* thread = get_current_thread();
+    if (thread == NULL) {
+        return;
+    }
+
+    // take the request, unless the collector already gave up on us
+    int expected = THREAD_GC_REQUEST_PENDING;
+    if (atomic_compare_exchange_strong(&thread->gc_request, &expected, THREAD_GC_REQUEST_HANDLING)) {
+        thread_save_registers(&thread->save_state);
+        gc_handshake_stopped_thread(thread, m_gc_handshake_status);
+
+        atomic_store(&thread->gc_request, THREAD_GC_REQUEST_NONE);
+        atomic_fetch_sub(&m_gc_handshake_remaining, 1);
+    }
+
+    // the poll is shared with the scheduler
+    scheduler_preempt_point();
+}
+
+/**
+ * Take back the request from a thread that did not get to a safepoint, and
+ * do the handshake ourselves, returns false if the thread took it meanwhile
+ */
+static bool gc_handshake_revoke(thread_t* thread, gc_thread_status_t status) {
+    int expected = THREAD_GC_REQUEST_PENDING;
+    if (!atomic_compare_exchange_strong(&thread->gc_request, &expected, THREAD_GC_REQUEST_NONE)) {
+        return false;
+    }
+    atomic_fetch_sub(&m_gc_handshake_remaining, 1);
+
+    if (gc_handshake_safe_thread(thread, status)) {
+        return true;
     }
-}
 
-void gc_update_ref(void* ptr, void* new) {
-    System_Object object = heap_find_fast(ptr);
-    if (object != NULL) {
-        gc_update(object, (uintptr_t)ptr - (uintptr_t)object, new);
-    } else {
-        write_field(ptr, 0, new);
+    // fallback to suspending the thread
+    suspend_state_t state = scheduler_suspend_thread(thread);
+    if (!state.dead) {
+        gc_handshake_stopped_thread(thread, status);
     }
+    scheduler_resume_thread(state);
+    return true;
 }
 
-//----------------------------------------------------------------------------------------------------------------------
-// Handshaking with all the threads, async to the main collector
-//----------------------------------------------------------------------------------------------------------------------
+/**
+ * Wait for all the requested threads to handshake, every thread that
+ * blocks before getting to a safepoint, or does not get to one in time
+ * is handled by us instead
+ */
+static void gc_handshake_wait_requests(gc_thread_status_t status, uint64_t start) {
+    while (atomic_load(&m_gc_handshake_remaining) > 0) {
+        bool timeout = microtime() - start > GC_SAFEPOINT_TIMEOUT;
+
+        for (int i = 0; i < arrlen(m_gc_handshake_requests); i++) {
+            gc_handshake_request_t* request = &m_gc_handshake_requests[i];
+            if (request->done) continue;
+
+            thread_t* thread = request->thread;
+            bool done = atomic_load(&thread->gc_request) == THREAD_GC_REQUEST_NONE;
+            if (!done && (timeout || thread->gc_safe || thread->dead)) {
+                done = gc_handshake_revoke(thread, status);
+            }
 
-static const char* m_status_str[] = {
-    [THREAD_STATUS_ASYNC] = "ASYNC",
-    [THREAD_STATUS_SYNC1] = "SYNC1",
-    [THREAD_STATUS_SYNC2] = "SYNC2",
-};
+            if (done) {
+                request->done = true;
+                gc_cycle_record_handshake(thread, microtime() - start);
+            }
+        }
 
-static void gc_mark_ptr(uintptr_t ptr) {
-    System_Object object = heap_find(ptr);
-    if (object != NULL) {
-        gc_mark_gray(object);
+        __builtin_ia32_pause();
     }
-}
 
-static wait_group_t m_gc_handshake_wg = INIT_WAIT_GROUP();
+    // the rest finished since we last looked
+    for (int i = 0; i < arrlen(m_gc_handshake_requests); i++) {
+        if (!m_gc_handshake_requests[i].done) {
+            gc_cycle_record_handshake(m_gc_handshake_requests[i].thread, microtime() - start);
+        }
+    }
+}
 
 static void gc_handshake_thread(void* arg) {
     gc_thread_status_t status = (gc_thread_status_t)(uintptr_t)arg;
@@ -195,65 +1200,44 @@ static void gc_handshake_thread(void* arg) {
     // our status
     GTD->status = status;
 
-    // iterate over all mutators, suspend them, and
-    // set the status as needed, if more work is needed
-    // do it now
+    // ask all the mutators to handshake at once, and do it ourselves for
+    // the ones that are blocked, if more work is needed do it now
     lock_all_threads();
 
     // set the default status for the next threads that will be created
     m_default_gc_thread_data.status = status;
 
+    // let the mutators know they should poll for a handshake
+    m_gc_handshake_status = status;
+    g_gc_safepoint_pending = 1;
+
+    uint64_t start = microtime();
+    arrsetlen(m_gc_handshake_requests, 0);
     for (int i = 0; i < arrlen(g_all_threads); i++) {
-        // get the thread and suspend it if it is not us
-        // TODO: optimize by only doing the threads that don't run right now or something
-        // TODO: skip any gc thread
         thread_t* thread = g_all_threads[i];
         
-        if (!thread) continue;
+        if (!thread || thread->dead) continue;
         
-        // don't suspend either our thread or the collector thread
-        if (thread == get_current_thread() || thread == m_collector_thread) continue;
+        // skip either our thread, the collector thread or the mark workers
+        if (thread == get_current_thread() || thread == m_collector_thread || gc_is_mark_worker(thread)) continue;
+
+        // blocked threads are done right away
+        uint64_t handshake_start = microtime();
+        if (gc_handshake_safe_thread(thread, status)) {
+            gc_cycle_record_handshake(thread, microtime() - handshake_start);
+            continue;
+        }
 
-        // suspend and get the thread state
-        suspend_state_t state = scheduler_suspend_thread(thread);
+        // ask the thread to do it on its next safepoint
+        arrpush(m_gc_handshake_requests, ((gc_handshake_request_t){ .thread = thread }));
+        atomic_fetch_add(&m_gc_handshake_remaining, 1);
+        atomic_store(&thread->gc_request, THREAD_GC_REQUEST_PENDING);
+    }
 
-        gc_thread_data_t* gcl = &thread->tcb->tcb->gc_data;
-        // sync2 == finding roots
-        if (status == THREAD_STATUS_SYNC2 && !state.dead) {
-            thread_save_state_t* regs = &thread->save_state;
+    gc_handshake_wait_requests(status, start);
 
-            // mark the stack
-            for (uintptr_t ptr = ALIGN_UP(regs->rsp - 128, 8); ptr <= (uintptr_t)thread->stack_top - 8; ptr += 8) {
-                gc_mark_ptr(*((uintptr_t*)(ptr)));
-            }
+    g_gc_safepoint_pending = 0;
 
-            // mark the registers
-            gc_mark_ptr(regs->r15);
-            gc_mark_ptr(regs->r14);
-            gc_mark_ptr(regs->r13);
-            gc_mark_ptr(regs->r12);
-            gc_mark_ptr(regs->r11);
-            gc_mark_ptr(regs->r10);
-            gc_mark_ptr(regs->r9);
-            gc_mark_ptr(regs->r8);
-            gc_mark_ptr(regs->rbp);
-            gc_mark_ptr(regs->rdi);
-            gc_mark_ptr(regs->rsi);
-            gc_mark_ptr(regs->rdx);
-            gc_mark_ptr(regs->rcx);
-            gc_mark_ptr(regs->rbx);
-            gc_mark_ptr(regs->rax);
-
-            // the managed thread instance for this thread
-            gc_mark_ptr((uintptr_t) thread->tcb->managed_thread);
-        }
-
-        // set the status
-        gcl->status = status;
-
-        // resume the threads operation
-        scheduler_resume_thread(state);
-    }
     unlock_all_threads();
     
     wait_group_done(&m_gc_handshake_wg);
@@ -280,8 +1264,10 @@ static void gc_wait_handshake() {
 }
 
 static void gc_handshake(gc_thread_status_t status) {
+    TRACE_EVENT(TRACE_CATEGORY_GC, "gc: handshake %s", m_status_str[status]);
     gc_post_handshake(status);
     gc_wait_handshake();
+    TRACE_EVENT(TRACE_CATEGORY_GC, "gc: handshake %s done", m_status_str[status]);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -290,8 +1276,9 @@ static void gc_handshake(gc_thread_status_t status) {
 
 static void gc_set_allocation_color(System_Object object) {
     // set all
-    if (object->color == COLOR_BLACK || object->color == COLOR_GRAY) {
-        object->color = m_allocation_color;
+    int color = heap_get_color(object);
+    if (color == COLOR_BLACK || color == COLOR_GRAY) {
+        heap_set_color(object, m_allocation_color);
     }
 }
 
@@ -304,9 +1291,13 @@ static void gc_init_full_collection() {
 }
 
 static void gc_clear_cards_callback(System_Object object) {
-    if (object->color == COLOR_BLACK) {
-        object->color = COLOR_GRAY;
-        m_gc_has_gray_objects = true;
+    int color = heap_get_color(object);
+    if (color == COLOR_BLACK) {
+        heap_set_color(object, COLOR_GRAY);
+        gc_mark_stack_push(object);
+    } else if (color == COLOR_IMMORTAL && object->type != 0) {
+        // immortal objects are never traced, their fields are scanned as roots
+        arrpush(m_gc_immortal_dirty, object);
     }
 }
 
@@ -314,6 +1305,13 @@ static void gc_clear_cards() {
     heap_iterate_dirty_objects(gc_clear_cards_callback);
 }
 
+/**
+ * The collector is generational by using sticky mark bits, objects which survived a
+ * collection stay black, and only the objects allocated since the last cycle (which
+ * have the allocation color) are candidates for freeing in a young collection. Old objects
+ * that were modified since are found by the card table and traced again. A full collection
+ * first moves all the objects back to the allocation color, so everything is traced again.
+ */
 static void gc_clear(bool full_collection) {
     if (full_collection) {
         gc_init_full_collection();
@@ -327,85 +1325,227 @@ static void gc_switch_allocation_clear_colors() {
     m_allocation_color = temp;
 }
 
-static void gc_mark_global_roots() {
+static void gc_mark_children(System_Object object);
+
+static void gc_mark_global_roots(bool full_collection) {
     spinlock_lock(&m_global_roots_lock);
     for (int i = 0; i < arrlen(m_global_roots); i++) {
         System_Object object = *m_global_roots[i];
         if (!object) continue;
-        if (object->color == m_clear_color || object->color == m_allocation_color) {
+        int color = heap_get_color(object);
+        if (color == m_clear_color || color == m_allocation_color) {
             gc_mark_gray(object);
         }
     }
     spinlock_unlock(&m_global_roots_lock);
 
+    // the root segments, no need for a lock since we only ever add to the head
+    for (gc_root_segment_t* segment = atomic_load(&m_gc_root_segments); segment != NULL; segment = segment->next) {
+        for (size_t i = 0; i < segment->count; i++) {
+            gc_mark_gray(*segment->roots[i]);
+        }
+    }
+
+    // the objects waiting for finalization
+    spinlock_lock(&m_gc_finalization_queue_lock);
+    for (int i = 0; i < arrlen(m_gc_finalization_queue); i++) {
+        gc_mark_gray(m_gc_finalization_queue[i]);
+    }
+    gc_mark_gray(m_gc_finalizing);
+    spinlock_unlock(&m_gc_finalization_queue_lock);
+
+    // the immortal objects are roots for everything they reference, what they reference
+    // only changes when they are written to, so a young collection only scans the ones
+    // on dirty cards and the ones created since the last collection, a full collection
+    // traces everything again so it needs all of them
+    for (int i = 0; i < arrlen(m_gc_immortal_dirty); i++) {
+        gc_mark_children(m_gc_immortal_dirty[i]);
+    }
+    arrsetlen(m_gc_immortal_dirty, 0);
+
+    spinlock_lock(&m_gc_immortal_lock);
+    size_t count = arrlen(m_gc_immortal);
+    size_t i = full_collection ? 0 : m_gc_immortal_scanned;
+
+    // the loader might still be setting the type of some of them, these
+    // and everything after them count as new until the next collection
+    for (; i < count && m_gc_immortal[i]->type != 0; i++) {
+        gc_mark_children(m_gc_immortal[i]);
+    }
+    m_gc_immortal_scanned = i;
+    for (; i < count; i++) {
+        if (m_gc_immortal[i]->type == 0) continue;
+        gc_mark_children(m_gc_immortal[i]);
+    }
+    spinlock_unlock(&m_gc_immortal_lock);
+
     // get all the app domains and iterate all their assemblies and stuff
 }
 
-static void gc_mark_fields_gray(void* base, System_Type type) {
-    for (int i = 0; i < arrlen(type->ManagedPointersOffsets); i++) {
-        gc_mark_gray(read_field(base, type->ManagedPointersOffsets[i]));
+static void gc_mark_refs_gray(System_Object* refs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        gc_mark_gray(refs[i]);
     }
 }
 
-static void gc_mark_black(System_Object object) {
+static void gc_mark_fields_gray(void* base, int* offsets, int count) {
+    for (int i = 0; i < count; i++) {
+        gc_mark_gray(read_field(base, offsets[i]));
+    }
+}
+
+static void gc_mark_struct_array_gray(System_Array array, System_Type elementType) {
+    int* offsets = elementType->ManagedPointersOffsets;
+    int count = arrlen(offsets);
+    size_t stride = elementType->StackSize;
+    size_t length = array->Length;
+    uint8_t* items = (uint8_t*)(array + 1);
+
+    if (count == 0) {
+        // pointer free structs, nothing to do
+    } else if (count * sizeof(void*) == stride) {
+        // the struct is made only of references, treat it like a flat array of references
+        gc_mark_refs_gray((System_Object*)items, length * count);
+    } else if (count == 1) {
+        // a single reference per item, just stride over it
+        uint8_t* ref = items + offsets[0];
+        for (size_t i = 0; i < length; i++, ref += stride) {
+            gc_mark_gray(*(System_Object*)ref);
+        }
+    } else {
+        for (size_t i = 0; i < length; i++, items += stride) {
+            gc_mark_fields_gray(items, offsets, count);
+        }
+    }
+}
+
+static void gc_mark_children(System_Object object) {
     System_Type type = OBJECT_TYPE(object);
 
     // mark all the children as gray
     if (type->IsArray) {
-        // array object, mark all the items
         System_Array array = (System_Array) object;
         System_Type elementType = type->ElementType;
-        if (elementType->IsValueType && arrlen(elementType->ManagedPointersOffsets) != 0) {
-            // this is an array of structs that have managed values, so we need to iterate each
-            // of the items and read all the pointers
-            for (int i = 0; i < array->Length; i++) {
-                size_t offset = sizeof(struct System_Array) + i * elementType->StackSize;
-                gc_mark_fields_gray(read_field(object, offset), elementType);
-            }
-        } else if (!elementType->IsValueType) {
+        if (elementType->IsValueType) {
+            gc_mark_struct_array_gray(array, elementType);
+        } else {
             // this is an array of pointers
-            for (int i = 0; i < array->Length; i++) {
-                size_t offset = sizeof(struct System_Array) + i * sizeof(void *);
-                gc_mark_gray(read_field(object, offset));
-            }
+            gc_mark_refs_gray((System_Object*)(array + 1), array->Length);
         }
     } else {
         // for normal objects iterate the managed pointer offsets, which
         // essentially contains all the offsets for all the pointers in
         // the object
-        gc_mark_fields_gray(object, type);
+        gc_mark_fields_gray(object, type->ManagedPointersOffsets, arrlen(type->ManagedPointersOffsets));
     }
 
     // don't forget about the Type object
     gc_mark_gray((System_Object)type);
+}
+
+static void gc_mark_black(System_Object object) {
+    gc_mark_children(object);
 
     // mark this as black
-    object->color = COLOR_BLACK;
+    heap_set_color(object, COLOR_BLACK);
 }
 
 static void gc_trace_gray(System_Object object) {
     // skip non-gray objects
-    if (object->color != COLOR_GRAY) return;
+    if (heap_get_color(object) != COLOR_GRAY) return;
 
     // mark as black
     gc_mark_black(object);
 }
 
+static void gc_mark_worker_trace(gc_mark_worker_t* worker) {
+    System_Object objects[GC_MARK_STACK_BATCH];
+    while (true) {
+        // first our own work, then the global stack, and only then
+        // try to steal from the other workers
+        size_t count = gc_mark_worker_pop(worker, objects, ARRAY_LEN(objects));
+        if (count == 0) count = gc_mark_stack_pop(objects, ARRAY_LEN(objects));
+        if (count == 0) count = gc_mark_worker_steal(worker, objects, ARRAY_LEN(objects));
+
+        if (count == 0) {
+            if (gc_mark_worker_terminate()) {
+                break;
+            }
+            continue;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            gc_trace_gray(objects[i]);
+        }
+
+        // more than we can do ourselves, let the sleeping workers take some
+        if (worker->top > 1 || m_gc_mark_stack_top != 0) {
+            gc_mark_wake_sleepers();
+        }
+    }
+}
+
+typedef void (*gc_worker_job_t)(gc_mark_worker_t* worker);
+
+/**
+ * The job the helper workers should run once woken up
+ */
+static gc_worker_job_t m_gc_worker_job = NULL;
+
+noreturn static void gc_mark_worker_thread(void* ctx) {
+    gc_mark_worker_t* worker = ctx;
+    m_gc_mark_worker = worker;
+
+    while (true) {
+        semaphore_acquire(&worker->wake, false);
+        GTD->status = m_gc_mark_status;
+        m_gc_worker_job(worker);
+        wait_group_done(&m_gc_mark_done);
+    }
+}
+
+/**
+ * Run the job on all the workers, including the collector,
+ * returns once all the workers are done with it
+ */
+static void gc_run_workers(gc_worker_job_t job) {
+    m_gc_worker_job = job;
+    m_gc_mark_status = GTD->status;
+    wait_group_add(&m_gc_mark_done, m_gc_mark_workers_count - 1);
+    for (int i = 1; i < m_gc_mark_workers_count; i++) {
+        semaphore_release(&m_gc_mark_workers[i].wake, false);
+    }
+    job(&m_gc_mark_workers[0]);
+    wait_group_wait(&m_gc_mark_done);
+}
+
 static void gc_complete_trace() {
-    while (m_gc_has_gray_objects) {
-        m_gc_has_gray_objects = false;
+    while (true) {
+        // wake all the helpers and join them, we are done only once there are no
+        // more gray objects in any of the workers
+        m_gc_mark_idle_workers = 0;
+        gc_run_workers(gc_mark_worker_trace);
+
+        // if nothing got lost we are done
+        if (!atomic_exchange(&m_gc_mark_stack_overflow, false)) {
+            break;
+        }
+
+        // some gray objects did not fit in the mark stack, find
+        // them by scanning the heap, the rest are going to get
+        // pushed to the stack again
         heap_iterate_objects(gc_trace_gray);
     }
 }
 
-static void gc_mark() {
+static void gc_mark(bool full_collection) {
     gc_post_handshake(THREAD_STATUS_SYNC2);
     gc_clear_cards();
     gc_switch_allocation_clear_colors();
     gc_wait_handshake();
 
     gc_post_handshake(THREAD_STATUS_ASYNC);
-    gc_mark_global_roots();
+    gc_mark_global_roots(full_collection);
     gc_complete_trace();
     gc_wait_handshake();
 }
@@ -414,49 +1554,100 @@ static void gc_trace() {
     gc_complete_trace();
 }
 
-static atomic_size_t m_objects_to_finalize = 0;
+static void gc_revive_finalized_objects() {
+    // take the list, so mutators can keep on allocating
+    spinlock_lock(&m_gc_finalizable_lock);
+    System_Object* finalizable = m_gc_finalizable;
+    m_gc_finalizable = NULL;
+    spinlock_unlock(&m_gc_finalizable_lock);
+
+    System_Object* survivors = NULL;
+    for (int i = 0; i < arrlen(finalizable); i++) {
+        System_Object object = finalizable[i];
+
+        if (heap_get_color(object) != m_clear_color) {
+            // still alive, check again next time
+            arrpush(survivors, object);
+            continue;
+        }
+
+        // dead but the finalizer was suppressed, let the sweep free it
+        if (object->suppress_finalizer) {
+            continue;
+        }
 
-static void gc_revive_finalized_objects(System_Object object) {
-    if (object->color == m_clear_color && !object->suppress_finalizer) {
         // mark that no need for finalizer anymore
         object->suppress_finalizer = 1;
 
-        // revive all the children
+        // revive it and all the children
         gc_mark_black(object);
 
-        // mark as a green object
-        object->color = COLOR_GREEN;
-
         // we have another object to finalize
+        spinlock_lock(&m_gc_finalization_queue_lock);
+        arrpush(m_gc_finalization_queue, object);
+        spinlock_unlock(&m_gc_finalization_queue_lock);
         m_objects_to_finalize++;
     }
+    arrfree(finalizable);
+
+    // put the survivors back
+    spinlock_lock(&m_gc_finalizable_lock);
+    for (int i = 0; i < arrlen(survivors); i++) {
+        arrpush(m_gc_finalizable, survivors[i]);
+    }
+    spinlock_unlock(&m_gc_finalizable_lock);
+    arrfree(survivors);
 }
 
 static void gc_free_clear_objects(System_Object object) {
-    if (object->color == m_clear_color) {
+    if (heap_get_color(object) == m_clear_color) {
         // if this is still marked as clear color it means
-        // that it should not be alive for finalization
+        // that it should not be alive for finalization, only
+        // objects with an inflated lock have a monitor to free
         free_monitor(object);
+        gc_pacer_freed(heap_object_size(object));
         heap_free(object);
     }
 }
 
+/**
+ * The next heap segment to be swept
+ */
+static atomic_size_t m_gc_sweep_cursor = 0;
+
+static void gc_sweep_worker(gc_mark_worker_t* worker) {
+    size_t count = heap_segments_count();
+    size_t index;
+    while ((index = atomic_fetch_add(&m_gc_sweep_cursor, 1)) < count) {
+        heap_iterate_segment_objects(index, gc_free_clear_objects);
+    }
+    gc_pacer_flush_freed();
+}
+
+static void gc_wake_finalizer();
+
 static void gc_sweep(bool full_collection) {
     // go over all the objects that should be freed but have a finalizer
-    heap_iterate_objects(gc_revive_finalized_objects);
+    gc_revive_finalized_objects();
 
     // revive all these objects
     gc_complete_trace();
 
-    // now free all the objects that don't need to stay alive anymore
-    heap_iterate_objects(gc_free_clear_objects);
+    // now free all the objects that don't need to stay alive anymore, each
+    // segment is swept as a whole by one of the workers
+    m_gc_sweep_cursor = 0;
+    gc_run_workers(gc_sweep_worker);
 
-    if (full_collection) {
-        // if we do a full collection run the finalizers right now
-        if (gc_need_to_run_finalizers()) {
-            gc_run_finalizers();
-        }
+    // the large objects are swept on their own
+    heap_iterate_large_objects(gc_free_clear_objects);
+    gc_pacer_flush_freed();
+
+    // let the finalizer thread handle all the new objects
+    if (gc_need_to_run_finalizers()) {
+        gc_wake_finalizer();
+    }
 
+    if (full_collection) {
         // in a full collection we are also going to reclaim memory back
         // from the collector to the pmm, this is a bit slower so only
         // done on full collection
@@ -465,20 +1656,40 @@ static void gc_sweep(bool full_collection) {
 }
 
 static void gc_collection_cycle(bool full_collection) {
+    uint64_t start = microtime();
+
+    // from now on all the stores need the full write-barrier
+    g_gc_barrier_fast_color = GC_BARRIER_FAST_COLOR_NONE;
+
+    TRACE_EVENT(TRACE_CATEGORY_GC, "gc: clear");
     gc_clear(full_collection);
-    gc_mark();
 
+    uint64_t mark_start = microtime();
+    m_gc_current_cycle.clear_time = mark_start - start;
+    TRACE_EVENT(TRACE_CATEGORY_GC, "gc: mark");
+    gc_mark(full_collection);
+
+    uint64_t trace_start = microtime();
+    m_gc_current_cycle.mark_time = trace_start - mark_start;
     m_gc_tracing = true;
+    TRACE_EVENT(TRACE_CATEGORY_GC, "gc: trace");
     gc_trace();
+
+    uint64_t sweep_start = microtime();
+    m_gc_current_cycle.trace_time = sweep_start - trace_start;
+    TRACE_EVENT(TRACE_CATEGORY_GC, "gc: sweep");
     gc_sweep(full_collection);
     m_gc_tracing = false;
-}
 
-static void gc_finalize(System_Object object) {
-    if (object->color != COLOR_GREEN) return;
+    // everything allocated from now on is traced by the next collection
+#ifndef TDN_GC_SIDE_COLORS
+    g_gc_barrier_fast_color = m_allocation_color;
+#endif
 
-    m_objects_to_finalize--;
+    m_gc_current_cycle.sweep_time = microtime() - sweep_start;
+}
 
+static void gc_finalize(System_Object object) {
     // get the finalizer function and run it
     System_Exception(*finalize)(System_Object this) = OBJECT_TYPE(object)->Finalize->MirFunc->addr;
     System_Exception exception = finalize(object);
@@ -486,14 +1697,61 @@ static void gc_finalize(System_Object object) {
         WARN("Got exception in finalizer: `%U`", exception->Message);
     }
 
-    // we can now free this object, the rest will follow suite
-    free_monitor(object);
-    heap_free(object);
+    // the object stays as a normal object from now on, since the finalizer is suppressed it
+    // is going to be freed once it is unreachable, even if the finalizer resurrected it
 }
 
+/**
+ * Only a single thread runs finalizers at a time
+ */
+static mutex_t m_gc_finalizer_run_mutex = INIT_MUTEX();
+
 void gc_run_finalizers() {
-    while (atomic_load(&m_objects_to_finalize) != 0) {
-        heap_iterate_objects(gc_finalize);
+    mutex_lock(&m_gc_finalizer_run_mutex);
+    while (true) {
+        // take the next object, it stays a root while we run it
+        spinlock_lock(&m_gc_finalization_queue_lock);
+        if (arrlen(m_gc_finalization_queue) == 0) {
+            spinlock_unlock(&m_gc_finalization_queue_lock);
+            break;
+        }
+        System_Object object = arrpop(m_gc_finalization_queue);
+        m_gc_finalizing = object;
+        spinlock_unlock(&m_gc_finalization_queue_lock);
+
+        m_objects_to_finalize--;
+        gc_finalize(object);
+
+        spinlock_lock(&m_gc_finalization_queue_lock);
+        m_gc_finalizing = NULL;
+        spinlock_unlock(&m_gc_finalization_queue_lock);
+    }
+    mutex_unlock(&m_gc_finalizer_run_mutex);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Finalizer thread, runs the finalizers so they won't stall the collector
+//----------------------------------------------------------------------------------------------------------------------
+
+static thread_t* m_finalizer_thread = NULL;
+static mutex_t m_gc_finalizer_mutex = INIT_MUTEX();
+static conditional_t m_gc_finalizer_wake = INIT_CONDITIONAL();
+
+static void gc_wake_finalizer() {
+    mutex_lock(&m_gc_finalizer_mutex);
+    conditional_signal(&m_gc_finalizer_wake);
+    mutex_unlock(&m_gc_finalizer_mutex);
+}
+
+noreturn static void gc_finalizer_thread(void* ctx) {
+    while (true) {
+        mutex_lock(&m_gc_finalizer_mutex);
+        while (!gc_need_to_run_finalizers()) {
+            conditional_wait(&m_gc_finalizer_wake, &m_gc_finalizer_mutex);
+        }
+        mutex_unlock(&m_gc_finalizer_mutex);
+
+        gc_run_finalizers();
     }
 }
 
@@ -501,6 +1759,233 @@ bool gc_need_to_run_finalizers() {
     return m_objects_to_finalize != 0;
 }
 
+//----------------------------------------------------------------------------------------------------------------------
+// Heap snapshot, written by the collector right after a full collection
+//----------------------------------------------------------------------------------------------------------------------
+
+//
+// The snapshot is taken on the collector thread between cycles, so nothing is freed and no
+// colors change while the heap is walked. The mutators keep running, objects allocated while
+// the snapshot is written may or may not be part of it, and objects that are only reachable
+// from the stacks are not rooted, the analyzer gives those their own root.
+//
+// The records are buffered and written with plain writes, big reference arrays are written
+// straight from the object instead of going through the buffer
+//
+
+#define GC_SNAPSHOT_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * The snapshot that was requested, and the result of writing it, protected by the gc mutex
+ */
+static const char* m_gc_snapshot_path = NULL;
+static err_t m_gc_snapshot_err = NO_ERROR;
+
+/**
+ * The state of the snapshot being written, only used by the collector
+ */
+static int m_gc_snapshot_fd = -1;
+static uint8_t* m_gc_snapshot_buffer = NULL;
+static size_t m_gc_snapshot_used = 0;
+static bool m_gc_snapshot_failed = false;
+static struct {
+    System_Type key;
+    bool value;
+}* m_gc_snapshot_types = NULL;
+
+static void gc_snapshot_write_raw(const void* data, size_t size) {
+    const uint8_t* ptr = data;
+    while (size != 0 && !m_gc_snapshot_failed) {
+        ssize_t written = write(m_gc_snapshot_fd, ptr, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            m_gc_snapshot_failed = true;
+            break;
+        }
+        ptr += written;
+        size -= written;
+    }
+}
+
+static void gc_snapshot_flush() {
+    gc_snapshot_write_raw(m_gc_snapshot_buffer, m_gc_snapshot_used);
+    m_gc_snapshot_used = 0;
+}
+
+static void gc_snapshot_write(const void* data, size_t size) {
+    if (m_gc_snapshot_used + size > GC_SNAPSHOT_BUFFER_SIZE) {
+        gc_snapshot_flush();
+    }
+
+    if (size > GC_SNAPSHOT_BUFFER_SIZE / 2) {
+        gc_snapshot_write_raw(data, size);
+    } else {
+        memcpy(m_gc_snapshot_buffer + m_gc_snapshot_used, data, size);
+        m_gc_snapshot_used += size;
+    }
+}
+
+static void gc_snapshot_tag(heap_snapshot_tag_t tag) {
+    uint8_t value = tag;
+    gc_snapshot_write(&value, sizeof(value));
+}
+
+static void gc_snapshot_type(System_Type type) {
+    if (hmgeti(m_gc_snapshot_types, type) >= 0) {
+        return;
+    }
+    hmput(m_gc_snapshot_types, type, true);
+
+    strbuilder_t name = strbuilder_new();
+    type_print_full_name(type, &name);
+    heap_snapshot_type_t record = {
+        .id = (uintptr_t)type,
+        .name_length = strlen(strbuilder_get(&name)),
+    };
+    gc_snapshot_tag(HEAP_SNAPSHOT_TYPE);
+    gc_snapshot_write(&record, sizeof(record));
+    gc_snapshot_write(strbuilder_get(&name), record.name_length);
+    strbuilder_free(&name);
+}
+
+static void gc_snapshot_root(heap_snapshot_root_kind_t kind, System_Object object) {
+    if (object == NULL) {
+        return;
+    }
+
+    heap_snapshot_root_t record = {
+        .kind = kind,
+        .address = (uintptr_t)object,
+    };
+    gc_snapshot_tag(HEAP_SNAPSHOT_ROOT);
+    gc_snapshot_write(&record, sizeof(record));
+}
+
+static void gc_snapshot_object(System_Object object) {
+    // free slots, and objects the mutators are just allocating
+    if (heap_get_color(object) == COLOR_BLUE || object->type == 0) {
+        return;
+    }
+
+    System_Type type = OBJECT_TYPE(object);
+    gc_snapshot_type(type);
+
+    heap_snapshot_object_t record = {
+        .address = (uintptr_t)object,
+        .type = (uintptr_t)type,
+        .size = heap_object_size(object),
+    };
+
+    if (!type->IsArray) {
+        int* offsets = type->ManagedPointersOffsets;
+        record.ref_count = arrlen(offsets);
+        gc_snapshot_tag(HEAP_SNAPSHOT_OBJECT);
+        gc_snapshot_write(&record, sizeof(record));
+        for (int i = 0; i < arrlen(offsets); i++) {
+            uint64_t ref = (uintptr_t)read_field(object, offsets[i]);
+            gc_snapshot_write(&ref, sizeof(ref));
+        }
+        return;
+    }
+
+    // the length might be getting set right now, so never go past the object
+    System_Array array = (System_Array)object;
+    System_Type elementType = type->ElementType;
+    size_t stride = elementType->IsValueType ? elementType->StackSize : sizeof(System_Object);
+    size_t length = array->Length;
+    if (stride != 0) {
+        length = MIN(length, (record.size - type->ManagedSize) / stride);
+    }
+    uint8_t* items = (uint8_t*)(array + 1);
+
+    if (!elementType->IsValueType) {
+        // the references are the items themselves
+        record.ref_count = length;
+        gc_snapshot_tag(HEAP_SNAPSHOT_OBJECT);
+        gc_snapshot_write(&record, sizeof(record));
+        gc_snapshot_write(items, length * sizeof(System_Object));
+    } else {
+        int* offsets = elementType->ManagedPointersOffsets;
+        record.ref_count = length * arrlen(offsets);
+        gc_snapshot_tag(HEAP_SNAPSHOT_OBJECT);
+        gc_snapshot_write(&record, sizeof(record));
+        for (size_t i = 0; i < length && arrlen(offsets) != 0; i++, items += stride) {
+            for (int j = 0; j < arrlen(offsets); j++) {
+                uint64_t ref = (uintptr_t)read_field(items, offsets[j]);
+                gc_snapshot_write(&ref, sizeof(ref));
+            }
+        }
+    }
+}
+
+static err_t gc_snapshot_write_heap(const char* path) {
+    err_t err = NO_ERROR;
+
+    m_gc_snapshot_failed = false;
+    m_gc_snapshot_used = 0;
+
+    m_gc_snapshot_buffer = malloc(GC_SNAPSHOT_BUFFER_SIZE);
+    CHECK_ERROR(m_gc_snapshot_buffer != NULL, ERROR_OUT_OF_MEMORY);
+
+    m_gc_snapshot_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK_ERROR(m_gc_snapshot_fd >= 0, ERROR_NOT_FOUND, "Failed to open %s", path);
+
+    uint64_t start = microtime();
+
+    heap_snapshot_header_t header = {
+        .magic = HEAP_SNAPSHOT_MAGIC,
+        .version = HEAP_SNAPSHOT_VERSION,
+    };
+    gc_snapshot_write(&header, sizeof(header));
+
+    // the roots, same as the ones the collector marks
+    spinlock_lock(&m_global_roots_lock);
+    for (int i = 0; i < arrlen(m_global_roots); i++) {
+        gc_snapshot_root(HEAP_SNAPSHOT_ROOT_GLOBAL, *m_global_roots[i]);
+    }
+    spinlock_unlock(&m_global_roots_lock);
+
+    for (gc_root_segment_t* segment = atomic_load(&m_gc_root_segments); segment != NULL; segment = segment->next) {
+        for (size_t i = 0; i < segment->count; i++) {
+            gc_snapshot_root(HEAP_SNAPSHOT_ROOT_SEGMENT, *segment->roots[i]);
+        }
+    }
+
+    spinlock_lock(&m_gc_finalization_queue_lock);
+    for (int i = 0; i < arrlen(m_gc_finalization_queue); i++) {
+        gc_snapshot_root(HEAP_SNAPSHOT_ROOT_FINALIZER, m_gc_finalization_queue[i]);
+    }
+    gc_snapshot_root(HEAP_SNAPSHOT_ROOT_FINALIZER, m_gc_finalizing);
+    spinlock_unlock(&m_gc_finalization_queue_lock);
+
+    spinlock_lock(&m_gc_immortal_lock);
+    for (int i = 0; i < arrlen(m_gc_immortal); i++) {
+        gc_snapshot_root(HEAP_SNAPSHOT_ROOT_IMMORTAL, m_gc_immortal[i]);
+    }
+    spinlock_unlock(&m_gc_immortal_lock);
+
+    // and every object on the heap
+    heap_iterate_objects(gc_snapshot_object);
+    heap_iterate_large_objects(gc_snapshot_object);
+
+    gc_snapshot_tag(HEAP_SNAPSHOT_END);
+    gc_snapshot_flush();
+    CHECK(!m_gc_snapshot_failed, "Failed to write the heap snapshot");
+
+    TRACE("gc: Wrote heap snapshot with %d types to %s in %dms",
+          (int)hmlen(m_gc_snapshot_types), path, (microtime() - start) / 1000);
+
+cleanup:
+    if (m_gc_snapshot_fd >= 0) {
+        close(m_gc_snapshot_fd);
+        m_gc_snapshot_fd = -1;
+    }
+    SAFE_FREE(m_gc_snapshot_buffer);
+    hmfree(m_gc_snapshot_types);
+
+    return err;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // GC Main thread
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -510,7 +1995,7 @@ bool gc_need_to_run_finalizers() {
 //----------------------------------------------------------------------------------------------------------------------
 
 /**
- * Is the gc currently running
+ * Is the gc currently running, declared with the pacer
  */
 static atomic_bool m_gc_running = true;
 
@@ -540,13 +2025,13 @@ static wait_group_t m_gc_start = INIT_WAIT_GROUP();
 static void gc_conductor_next() {
     m_gc_running = false;
     conditional_broadcast(&m_gc_done);
-    do {
+    while (!m_gc_running) {
         conditional_wait(&m_gc_wake, &m_gc_mutex);
-    } while (!m_gc_running);
+    }
 }
 
 /**
- * Wakeup the garbage collector
+ * Wakeup the garbage collector, must be called with the gc mutex held
  */
 static void gc_conductor_wake() {
     if (m_gc_running) {
@@ -574,23 +2059,64 @@ static void gc_conductor_wait() {
 static atomic_bool m_full_collection = false;
 
 void gc_wake(bool full) {
-    m_full_collection = full;
+    mutex_lock(&m_gc_mutex);
+    if (full) m_full_collection = true;
     gc_conductor_wake();
+    mutex_unlock(&m_gc_mutex);
 }
 
 void gc_wait(bool full) {
     mutex_lock(&m_gc_mutex);
-    m_full_collection = full;
+    if (full) m_full_collection = true;
     gc_conductor_wake();
     gc_conductor_wait();
     mutex_unlock(&m_gc_mutex);
 }
 
-static atomic_bool m_had_full_collection = false;
+err_t gc_write_heap_snapshot(const char* path) {
+    err_t err = NO_ERROR;
+
+    mutex_lock(&m_gc_mutex);
+
+    // one snapshot at a time
+    CHECK(m_gc_snapshot_path == NULL);
+    m_gc_snapshot_path = path;
+
+    // a cycle that already started won't take it, so keep
+    // going until the collector is done with it
+    do {
+        gc_conductor_wake();
+        gc_conductor_wait();
+    } while (m_gc_snapshot_path != NULL);
+
+    CHECK_AND_RETHROW(m_gc_snapshot_err);
+
+cleanup:
+    mutex_unlock(&m_gc_mutex);
+    return err;
+}
+
+/**
+ * The amount of young collections we allow in a row before forcing a full one,
+ * this makes sure that old objects which died are eventually freed
+ */
+#define GC_MAX_YOUNG_COLLECTIONS 8
+
+/**
+ * The amount of young collections since the last full collection
+ */
+static int m_gc_young_collections = 0;
+
+/**
+ * The generation of the last collection, 0 for young and 1 for full
+ */
+static atomic_int m_gc_last_generation = 0;
 
 static atomic_int m_gc_count = 0;
 
 noreturn static void gc_thread(void* ctx) {
+    m_gc_mark_worker = &m_gc_mark_workers[0];
+
     wait_group_done(&m_gc_start);
     wait_group_wait(&m_gc_start);
 
@@ -598,19 +2124,50 @@ noreturn static void gc_thread(void* ctx) {
     while (true) {
         mutex_lock(&m_gc_mutex);
         gc_conductor_next();
+        const char* snapshot_path = m_gc_snapshot_path;
         mutex_unlock(&m_gc_mutex);
 
         m_gc_count++;
-        TRACE("gc: Starting collection #%d", m_gc_count);
 
         // setup for the collection
-        bool was_full = m_full_collection;
-        if (was_full) m_had_full_collection = true;
+        bool was_full = m_full_collection || snapshot_path != NULL || m_gc_young_collections >= GC_MAX_YOUNG_COLLECTIONS;
+        if (was_full) {
+            m_gc_young_collections = 0;
+        } else {
+            m_gc_young_collections++;
+        }
+        m_gc_last_generation = was_full ? 1 : 0;
+
+        // setup the statistics of the cycle
+        m_gc_current_cycle = (gc_cycle_info_t){
+            .index = m_gc_count,
+            .generation = m_gc_last_generation,
+            .heap_bytes_before = m_gc_heap_bytes,
+        };
+        TRACE_EVENT(TRACE_CATEGORY_GC, "gc: collection #%lu start, generation=%lu, heap=%lu bytes",
+                    m_gc_current_cycle.index, m_gc_current_cycle.generation, m_gc_current_cycle.heap_bytes_before);
 
         // do a full cycle
         uint64_t start = microtime();
         gc_collection_cycle(was_full);
-        TRACE("gc: Collection finished after %dms", (microtime() - start) / 1000);
+        gc_pacer_update();
+
+        m_gc_current_cycle.total_time = microtime() - start;
+        m_gc_current_cycle.heap_bytes_after = m_gc_heap_bytes;
+        gc_cycle_commit();
+
+        TRACE_EVENT(TRACE_CATEGORY_GC, "gc: collection #%lu done after %luus, heap=%lu bytes, max handshake=%luus",
+                    m_gc_current_cycle.index, m_gc_current_cycle.total_time,
+                    m_gc_current_cycle.heap_bytes_after, m_gc_current_cycle.max_handshake_latency);
+
+        // while the heap only has what survived
+        if (snapshot_path != NULL) {
+            err_t err = gc_snapshot_write_heap(snapshot_path);
+            mutex_lock(&m_gc_mutex);
+            m_gc_snapshot_err = err;
+            m_gc_snapshot_path = NULL;
+            mutex_unlock(&m_gc_mutex);
+        }
 
         // clean up
         if (was_full) {
@@ -623,9 +2180,31 @@ err_t init_gc() {
     wait_group_add(&m_gc_start, 2);
 
     err_t err = NO_ERROR;
+
+    CHECK_AND_RETHROW(init_heap());
+    m_gc_init_time = microtime();
+    gc_init_memory_limit();
+
+    sem_init(&m_gc_mark_idle, 0, 0);
+
+    // the collector is always the first mark worker, the
+    // rest are helper threads
+    m_gc_mark_workers_count = MIN(MAX(get_cpu_count(), 1), GC_MAX_MARK_WORKERS);
+    for (int i = 1; i < m_gc_mark_workers_count; i++) {
+        gc_mark_worker_t* worker = &m_gc_mark_workers[i];
+        sem_init(&worker->wake, 0, 0);
+        worker->thread = create_thread(gc_mark_worker_thread, worker, "gc/mark[%d]", i);
+        CHECK(worker->thread != NULL);
+        scheduler_ready_thread(worker->thread);
+    }
+
     m_collector_thread = create_thread(gc_thread, NULL, "gc/collector");
     CHECK(m_collector_thread != NULL);
     scheduler_ready_thread(m_collector_thread);
+
+    m_finalizer_thread = create_thread(gc_finalizer_thread, NULL, "gc/finalizer");
+    CHECK(m_finalizer_thread != NULL);
+    scheduler_ready_thread(m_finalizer_thread);
     
     wait_group_done(&m_gc_start);
     wait_group_wait(&m_gc_start);
@@ -634,17 +2213,27 @@ cleanup:
 }
 
 void gc_get_memory_info(System_GCMemoryInfo* memoryInfo) {
+    // with a hard limit the heap might as well be all the memory there is
+    size_t total = m_gc_hard_memory_limit != 0 ? m_gc_hard_memory_limit : get_total_memory();
+    size_t load = m_gc_hard_memory_limit != 0 ? m_gc_heap_bytes : get_used_memory();
+
     scheduler_preempt_disable();
+
+    heap_stats_t stats;
+    heap_get_stats(&stats);
+    size_t live = MIN((size_t)m_gc_heap_bytes, stats.heap_size_bytes);
+
+    uint64_t elapsed = microtime() - m_gc_init_time;
+
     memoryInfo->FinalizationPendingCount = atomic_load(&m_objects_to_finalize);
-    memoryInfo->FragmentedBytes = 0;                            // TODO: The amount of wasted space
-    memoryInfo->Generation = m_had_full_collection ? 1 : 0;
-    memoryInfo->HeapSizeBytes = 0;                              // TODO: The size of the heap in bytes, includes both allocated and free objects
-    memoryInfo->HighMemoryLoadThresholdBytes = 0;               // TODO: I am not sure what this is supposed to be
+    memoryInfo->FragmentedBytes = stats.heap_size_bytes - live;
+    memoryInfo->Generation = m_gc_last_generation;
+    memoryInfo->HeapSizeBytes = stats.heap_size_bytes;
+    memoryInfo->HighMemoryLoadThresholdBytes = gc_high_memory_load_threshold(total);
     memoryInfo->Index = m_gc_count;
-    memoryInfo->MemoryLoadBytes = 0;                            // TODO: The amount of allocated bytes in the whole system (?)
-    memoryInfo->PauseTimePercentage = 0.0;
-    memoryInfo->TotalAvailableMemoryBytes = 0;                  // TODO: The amount of available memory in the whole system
-    memoryInfo->TotalCommittedBytes = 0;                        // TODO: The committed bytes of the heap (for now same as HeapSizeBytes)
-    m_had_full_collection = false;
+    memoryInfo->MemoryLoadBytes = load;
+    memoryInfo->PauseTimePercentage = elapsed == 0 ? 0.0 : (double)m_gc_total_pause_time * 100.0 / (double)elapsed;
+    memoryInfo->TotalAvailableMemoryBytes = total;
+    memoryInfo->TotalCommittedBytes = stats.committed_bytes;
     scheduler_preempt_enable();
 }
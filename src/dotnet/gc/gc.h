@@ -24,6 +24,15 @@ err_t init_gc();
  */
 void gc_add_root(void* object);
 
+/**
+ * Add a batch of roots at once, this is cheaper than adding each of them
+ * and the roots are scanned without taking the global roots lock
+ *
+ * @param roots     [IN] The addresses of the roots, copied by the gc
+ * @param count     [IN] The amount of roots
+ */
+err_t gc_add_root_segment(void** roots, size_t count);
+
 /**
  * Allocate a new object from the garbage collector of the given type and of
  * the given size
@@ -33,11 +42,73 @@ void gc_add_root(void* object);
  */
 void* gc_new(System_Type type, size_t size);
 
+/**
+ * Allocate a new object of a type with a known size and no finalizer, this is the
+ * fast path used by jitted code for newobj, the size is taken from the type
+ *
+ * @param type      [IN] The type of the object, must not have a finalizer
+ */
+void* gc_new_fixed(System_Type type);
+
+/**
+ * Allocate a new array of the given element type, the size is calculated once
+ * and checked for overflow, returns NULL on failure
+ *
+ * @param elementType   [IN] The element type of the array
+ * @param count         [IN] The amount of elements in the array
+ */
+void* gc_new_array(System_Type elementType, size_t count);
+
+/**
+ * Get the empty array of the given element type, there is a single immortal
+ * one per element type, returns NULL on failure
+ */
+void* gc_empty_array(System_Type elementType);
+
+/**
+ * Start allocating immortal objects on the current thread, these are never freed
+ * and are not traced as part of the object graph, meant for loader metadata
+ * that lives forever anyways. Calls may be nested.
+ */
+void gc_immortal_begin();
+
+/**
+ * Stop allocating immortal objects on the current thread
+ */
+void gc_immortal_end();
+
 /**
  * Get the memory info of the GC
  */
 void gc_get_memory_info(System_GCMemoryInfo* memoryInfo);
 
+/**
+ * The statistics of a single collection cycle, all times are in microseconds
+ */
+typedef struct gc_cycle_info {
+    uint64_t index;
+    int generation;
+    uint64_t total_time;
+    uint64_t clear_time;
+    uint64_t mark_time;
+    uint64_t trace_time;
+    uint64_t sweep_time;
+    uint64_t handshake_time;
+    uint64_t max_handshake_latency;
+    int max_handshake_latency_tid;
+    uint64_t heap_bytes_before;
+    uint64_t heap_bytes_after;
+} gc_cycle_info_t;
+
+/**
+ * Get the statistics of one of the last collection cycles, returns false
+ * if the cycle is too old or did not happen yet
+ *
+ * @param index     [IN] The index of the cycle, same as GCMemoryInfo.Index
+ * @param info      [OUT] The statistics of the cycle
+ */
+bool gc_get_cycle_info(uint64_t index, gc_cycle_info_t* info);
+
 /**
  * Helper to allocate a new gc object
  */
@@ -68,17 +139,26 @@ void gc_get_memory_info(System_GCMemoryInfo* memoryInfo);
 
 /**
  * Helper to allocate a new array
- *
- * TODO: empty array optimization
  */
 #define GC_NEW_ARRAY(elementType, count) \
+    ({ \
+        System_Array __newArray = gc_new_array(elementType, count); \
+        ASSERT(__newArray != NULL); \
+        (void*)__newArray; \
+    })
+
+/**
+ * Same as GC_NEW_ARRAY, but an empty array is the shared one of the element type
+ * since the runtime metadata is full of them, only for the metadata arrays, which
+ * nothing locks on or compares by identity
+ */
+#define GC_NEW_METADATA_ARRAY(elementType, count) \
     ({ \
         size_t __count = count; \
-        System_Type __elementType = elementType; \
-        System_Type __arrayType = get_array_type(__elementType); \
-        System_Array __newArray = gc_new(__arrayType, __arrayType->ManagedSize + __elementType->StackSize * __count); \
+        System_Array __newArray = __count == 0 ? \
+            gc_empty_array(elementType) : \
+            gc_new_array(elementType, __count); \
         ASSERT(__newArray != NULL); \
-        __newArray->Length = __count; \
         (void*)__newArray; \
     })
 
@@ -97,6 +177,47 @@ void gc_get_memory_info(System_GCMemoryInfo* memoryInfo);
  */
 void gc_update(void* o, size_t offset, void* new);
 
+/**
+ * Bulk write-barrier, copies a range that contains references into an object
+ * with a plain memmove. This replaces calling gc_update on each of the references
+ * in the range.
+ *
+ * @param o         [IN] The object we copy into
+ * @param offset    [IN] The offset of the range inside the object
+ * @param from      [IN] What to copy into the range, may overlap it
+ * @param size      [IN] The size of the range
+ */
+void gc_update_range(void* o, size_t offset, const void* from, size_t size);
+
+/**
+ * No object has this color, used to disable the write-barrier fast path
+ */
+#define GC_BARRIER_FAST_COLOR_NONE 0xFF
+
+/**
+ * Stores into objects of this color may skip gc_update and be done directly, these
+ * objects were allocated since the last collection and are going to be traced fully
+ * by the next one, so no shading nor card marking is needed. This is set to
+ * GC_BARRIER_FAST_COLOR_NONE while a collection runs.
+ *
+ * The JIT reads this to emit the fast path of the write-barrier inline.
+ */
+extern volatile uint8_t g_gc_barrier_fast_color;
+
+/**
+ * Set while the gc is handshaking with the mutators, whenever this is set the
+ * mutator should call gc_safepoint.
+ *
+ * The JIT polls this at method entry and on backward branches.
+ */
+extern volatile uint8_t g_gc_safepoint_pending;
+
+/**
+ * Do a handshake the gc requested from the current thread, if any, and yield
+ * if the scheduler wants to preempt it, this is the slow path of the safepoint poll
+ */
+void gc_safepoint();
+
 void gc_compare_exchange_ref(_Atomic  System_Object* ptr, System_Object new, System_Object comparand);
 
 /**
@@ -109,7 +230,8 @@ void gc_compare_exchange_ref(_Atomic  System_Object* ptr, System_Object new, Sys
 void gc_update_ref(void* ptr, void* new);
 
 /**
- * Run finalizers on the current thread until no finalizers are available
+ * Run finalizers on the current thread until no finalizers are available, normally
+ * this is done by the finalizer thread
  */
 void gc_run_finalizers();
 
@@ -139,6 +261,30 @@ bool gc_need_to_run_finalizers();
 // Triggering the garbage collector
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Set the percent of the live heap that can be allocated before a
+ * collection is automatically triggered, negative disables it
+ *
+ * @param percent   [IN] The percent, 100 means the heap can double
+ */
+void gc_set_target_percent(int percent);
+
+/**
+ * Set a soft limit on the heap size, collections are triggered more
+ * often as the heap gets closer to it, 0 means no limit
+ *
+ * @param bytes     [IN] The soft limit in bytes
+ */
+void gc_set_soft_memory_limit(size_t bytes);
+
+/**
+ * Set a hard limit on the heap size, an allocation that would go over it first
+ * runs synchronous collections and only then fails, 0 means no limit
+ *
+ * @param bytes     [IN] The hard limit in bytes
+ */
+void gc_set_hard_memory_limit(size_t bytes);
+
 /**
  * Trigger the collection in an async manner
  */
@@ -148,3 +294,11 @@ void gc_wake(bool full);
  * Trigger the gc and wait for it to finish
  */
 void gc_wait(bool full);
+
+/**
+ * Run a full collection and write a snapshot of the heap right after it, in the
+ * format of heap_snapshot.h, returns once the snapshot is written
+ *
+ * @param path      [IN] The file to write the snapshot to
+ */
+err_t gc_write_heap_snapshot(const char* path);
@@ -20,6 +20,10 @@ typedef enum gc_thread_status {
 
 typedef struct gc_thread_data {
     gc_thread_status_t status;
+
+    // how long the last handshake took to suspend and resume
+    // the thread, in microseconds
+    uint64_t last_handshake_latency;
 } gc_thread_data_t;
 
 /**
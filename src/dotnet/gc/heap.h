@@ -4,18 +4,27 @@
 
 #include <stddef.h>
 
+/**
+ * Initialize the heap
+ */
 err_t init_heap();
 
-void heap_dump_mapping();
-
 /**
- * Allocate a new object
+ * Allocate a new zeroed object, returns NULL if out of memory
  *
  * @param size      [IN] The requested size
  * @param color     [IN] The color to give the object
  */
 System_Object heap_alloc(size_t size, int color);
 
+/**
+ * Get the actual size an object takes on the heap, which may be
+ * bigger than the size that was requested
+ *
+ * @param object    [IN] The object
+ */
+size_t heap_object_size(System_Object object);
+
 /**
  * Free an allocated object
  *
@@ -25,12 +34,73 @@ void heap_free(System_Object object);
 
 /**
  * Reclaim heap memory, should be done after alot of object freeing
+ *
+ * Free segments are decommitted back to the os, except for the
+ * retention target which is kept committed for future allocations,
+ * the other threads give theirs back on their next allocation and
+ * those are decommitted by the next reclaim
  */
 void heap_reclaim();
 
+/**
+ * Set the amount of free committed memory heap_reclaim will keep
+ *
+ * @param bytes     [IN] The amount of bytes to keep committed
+ */
+void heap_set_retention_target(size_t bytes);
+
+/**
+ * The most the heap can ever grow to, all of its regions are reserved up front
+ */
+size_t heap_get_max_size();
+
+typedef struct heap_stats {
+    // the size of the heap, including both allocated and free objects
+    size_t heap_size_bytes;
+
+    // the memory the heap has committed
+    size_t committed_bytes;
+} heap_stats_t;
+
+/**
+ * Get the current statistics of the heap
+ *
+ * @param stats     [OUT] The statistics
+ */
+void heap_get_stats(heap_stats_t* stats);
+
+#ifdef TDN_GC_SIDE_COLORS
+
+/**
+ * Get the color of an object, the colors of small objects are kept in a side table
+ * so the collector won't need to write to the header of every live object
+ *
+ * @param object    [IN] The object
+ */
+int heap_get_color(System_Object object);
+
+/**
+ * Set the color of an object
+ *
+ * @param object    [IN] The object
+ * @param color     [IN] The new color
+ */
+void heap_set_color(System_Object object, int color);
+
+#else
+
+static inline int heap_get_color(System_Object object) { return object->color; }
+static inline void heap_set_color(System_Object object, int color) { object->color = color; }
+
+#endif
+
 /**
  * Find the object from a pointer, returns NULL if it is
  * not a real object
+ *
+ * This is used for the conservative scanning, values outside of the heap, in free
+ * segments or in slots that were never allocated are rejected without touching
+ * the memory they point to
  */
 System_Object heap_find(uintptr_t ptr);
 
@@ -43,19 +113,45 @@ System_Object heap_find_fast(void* ptr);
 typedef void (*object_callback_t)(System_Object object);
 
 /**
- * Iterate all the dirty objects in the heap
+ * Mark the card of the given object as dirty, should be called
+ * whenever a reference field inside of the object is changed
  *
- * once iterated the card will be marked as clear
+ * @param object    [IN] The object that is going to be modified
+ */
+void heap_mark_card(System_Object object);
+
+/**
+ * Iterate all the dirty objects in the heap, this will call the callback on
+ * every object (allocated or not) that shares a card with a modified object
+ *
+ * once iterated the card will be marked as clear, passing NULL as the callback
+ * will simply clear all the cards
  */
 void heap_iterate_dirty_objects(object_callback_t callback);
 
 /**
  * Iterate all the objects on the heap, be it allocated or not, and call the
- * iven callback function
+ * iven callback function, with side colors free slots are skipped
  */
 void heap_iterate_objects(object_callback_t callback);
 
 /**
- * Dump the whole heap
+ * Iterate all the large objects, these are not part of the segment iteration
+ * and are instead kept in their own list
+ */
+void heap_iterate_large_objects(object_callback_t callback);
+
+/**
+ * Get the amount of segments the heap may be iterated with, some of
+ * them may not be in use
+ */
+size_t heap_segments_count();
+
+/**
+ * Iterate all the small objects of a single heap segment, does nothing if the
+ * segment is not in use, allows to split the work of iterating the heap
+ *
+ * @param index     [IN] The segment index, smaller than heap_segments_count()
+ * @param callback  [IN] The callback to call on each object
  */
-void heap_dump();
+void heap_iterate_segment_objects(size_t index, object_callback_t callback);
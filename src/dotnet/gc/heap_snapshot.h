@@ -0,0 +1,58 @@
+#pragma once
+
+#include <util/defs.h>
+
+#include <stdint.h>
+
+//
+// The heap snapshot is a header followed by a stream of records, each one starting with
+// its tag, all the numbers are little endian. A type record comes before the first object
+// of that type, objects are identified by their address and types by the address of their
+// type object. The references of an object may contain zeros, which should be skipped.
+//
+
+#define HEAP_SNAPSHOT_MAGIC     SIGNATURE_64('T', 'D', 'N', 'H', 'E', 'A', 'P', 0)
+#define HEAP_SNAPSHOT_VERSION   1
+
+typedef struct heap_snapshot_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t reserved;
+} PACKED heap_snapshot_header_t;
+
+typedef enum heap_snapshot_tag {
+    HEAP_SNAPSHOT_END,
+    HEAP_SNAPSHOT_TYPE,
+    HEAP_SNAPSHOT_OBJECT,
+    HEAP_SNAPSHOT_ROOT,
+} heap_snapshot_tag_t;
+
+/**
+ * Followed by the utf8 full name of the type
+ */
+typedef struct heap_snapshot_type {
+    uint64_t id;
+    uint32_t name_length;
+} PACKED heap_snapshot_type_t;
+
+/**
+ * Followed by the references of the object
+ */
+typedef struct heap_snapshot_object {
+    uint64_t address;
+    uint64_t type;
+    uint64_t size;
+    uint32_t ref_count;
+} PACKED heap_snapshot_object_t;
+
+typedef enum heap_snapshot_root_kind {
+    HEAP_SNAPSHOT_ROOT_GLOBAL,
+    HEAP_SNAPSHOT_ROOT_SEGMENT,
+    HEAP_SNAPSHOT_ROOT_FINALIZER,
+    HEAP_SNAPSHOT_ROOT_IMMORTAL,
+} heap_snapshot_root_kind_t;
+
+typedef struct heap_snapshot_root {
+    uint8_t kind;
+    uint64_t address;
+} PACKED heap_snapshot_root_t;
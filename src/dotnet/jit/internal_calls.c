@@ -6,13 +6,21 @@
 #include "../types.h"
 #include "time/tsc.h"
 #include "thread/waitable.h"
+#include "io/io.h"
 #include "converter.h"
 #include "dotnet/monitor.h"
 #include "dotnet/loader.h"
 #include "dotnet/activator.h"
+#include "dotnet/thread_pool.h"
 
 #include <thread/scheduler.h>
 
+#include <cpuid.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Other more generic utilities
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -20,29 +28,12 @@
 void managed_memcpy(System_Object this, System_Type struct_type, size_t offset, void* from) {
     uint8_t* this_base = (uint8_t*)this;
 
-    int last_offset = 0;
-    for (int i = 0; i < arrlen(struct_type->ManagedPointersOffsets); i++) {
-        int current_offset = struct_type->ManagedPointersOffsets[i];
-
-        // check if we have some unmanaged bytes to copy, if so copy them
-        if (last_offset != current_offset) {
-            memcpy(this_base + offset + last_offset, from + last_offset, current_offset - last_offset);
-        }
-
-        // copy the managed reference
-        gc_update(this, offset + current_offset, *(System_Object*)(from + current_offset));
-
-        // increment past the pointer
-        current_offset += sizeof(void*);
-
-        // update the last offset
-        last_offset = current_offset;
-    }
-
-    // if we have more bytes at the end, copy them, in the case of an unmanaged
-    // struct this is going to just copy all of the bytes
-    if (last_offset != struct_type->StackSize) {
-        memcpy(this_base + offset + last_offset, from + last_offset, struct_type->StackSize - last_offset);
+    // copy everything at once, with a single barrier for the
+    // whole struct if it has any references
+    if (arrlen(struct_type->ManagedPointersOffsets) != 0) {
+        gc_update_range(this, offset, from, struct_type->StackSize);
+    } else {
+        memcpy(this_base + offset, from, struct_type->StackSize);
     }
 }
 
@@ -55,7 +46,7 @@ void managed_memcpy(System_Object this, System_Type struct_type, size_t offset,
 //----------------------------------------------------------------------------------------------------------------------
 
 static method_result_t System_Diagnostic_Stopwatch_GetTscFrequency() {
-    return (method_result_t) { .exception = NULL, .value = get_tsc_freq() * 1000000 };
+    return (method_result_t) { .exception = NULL, .value = get_tsc_freq() };
 }
 
 static method_result_t System_Diagnostic_Stopwatch_GetTimestamp() {
@@ -76,6 +67,11 @@ static method_result_t System_Threading_Monitor_EnterInternal(System_Object obj,
     return (method_result_t) { .exception = NULL, .value = err };
 }
 
+static method_result_t System_Threading_Monitor_TryEnterInternal(System_Object obj, int32_t timeout, bool* lockTaken) {
+    err_t err = monitor_try_enter(obj, timeout, lockTaken);
+    return (method_result_t) { .exception = NULL, .value = err };
+}
+
 static method_result_t System_Threading_Monitor_ExitInternal(System_Object obj) {
     err_t err = monitor_exit(obj);
     return (method_result_t) { .exception = NULL, .value = err };
@@ -96,6 +92,11 @@ static method_result_t System_Threading_Monitor_WaitInternal(System_Object obj)
     return (method_result_t) { .exception = NULL, .value = err };
 }
 
+static method_result_t System_Threading_Monitor_WaitTimeoutInternal(System_Object obj, int32_t timeout, bool* signaled) {
+    err_t err = monitor_wait_timeout(obj, timeout, signaled);
+    return (method_result_t) { .exception = NULL, .value = err };
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 // System.Threading.WaitHandle
 //----------------------------------------------------------------------------------------------------------------------
@@ -113,6 +114,11 @@ static method_result_t System_Threading_WaitHandle_WaitableSelect2(waitable_t* w
     return (method_result_t) { .exception = NULL, .value = waitable_select(waitables, 0, 2, block).index };
 }
 
+static method_result_t System_Threading_WaitHandle_WaitableSelectAny(System_Array waitables, bool block) {
+    // the array holds the native waitable handles
+    return (method_result_t) { .exception = NULL, .value = waitable_select((waitable_t**)(waitables + 1), 0, waitables->Length, block).index };
+}
+
 static method_result_t System_Threading_WaitHandle_CreateWaitable(int count) {
     return (method_result_t) { .exception = NULL, .value = (uintptr_t) create_waitable(count)};
 }
@@ -144,6 +150,159 @@ static System_Exception System_Runtime_Intrinsics_X86_X86Base_Pause() {
     return NULL;
 }
 
+typedef enum x86_isa {
+    X86_ISA_SSE         = 1 << 0,
+    X86_ISA_SSE2        = 1 << 1,
+    X86_ISA_SSE3        = 1 << 2,
+    X86_ISA_SSSE3       = 1 << 3,
+    X86_ISA_SSE41       = 1 << 4,
+    X86_ISA_SSE42       = 1 << 5,
+    X86_ISA_POPCNT      = 1 << 6,
+    X86_ISA_AVX         = 1 << 7,
+    X86_ISA_AVX2        = 1 << 8,
+    X86_ISA_BMI1        = 1 << 9,
+    X86_ISA_BMI2        = 1 << 10,
+    X86_ISA_LZCNT       = 1 << 11,
+
+    // set once the cpuid was read
+    X86_ISA_PROBED      = 1 << 30,
+} x86_isa_t;
+
+static uint32_t m_x86_isa = 0;
+
+/**
+ * Read the supported instruction sets from cpuid, racing on the first
+ * call is fine since everyone writes the same value
+ */
+static bool x86_isa_supported(x86_isa_t isa) {
+    uint32_t supported = m_x86_isa;
+    if (supported == 0) {
+        unsigned int eax, ebx, ecx, edx;
+        supported = X86_ISA_PROBED;
+
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+            if (edx & bit_SSE) supported |= X86_ISA_SSE;
+            if (edx & bit_SSE2) supported |= X86_ISA_SSE2;
+            if (ecx & bit_SSE3) supported |= X86_ISA_SSE3;
+            if (ecx & bit_SSSE3) supported |= X86_ISA_SSSE3;
+            if (ecx & bit_SSE4_1) supported |= X86_ISA_SSE41;
+            if (ecx & bit_SSE4_2) supported |= X86_ISA_SSE42;
+            if (ecx & bit_POPCNT) supported |= X86_ISA_POPCNT;
+
+            // avx needs the os to save the ymm state as well
+            if ((ecx & bit_AVX) && (ecx & bit_OSXSAVE)) {
+                uint32_t xcr0_lo, xcr0_hi;
+                asm volatile ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+                if ((xcr0_lo & 0b110) == 0b110) {
+                    supported |= X86_ISA_AVX;
+                }
+            }
+        }
+
+        if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+            if ((ebx & bit_AVX2) && (supported & X86_ISA_AVX)) supported |= X86_ISA_AVX2;
+            if (ebx & bit_BMI) supported |= X86_ISA_BMI1;
+            if (ebx & bit_BMI2) supported |= X86_ISA_BMI2;
+        }
+
+        if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx)) {
+            if (ecx & bit_LZCNT) supported |= X86_ISA_LZCNT;
+        }
+
+        m_x86_isa = supported;
+    }
+
+    return (supported & isa) == isa;
+}
+
+#define X86_ISA_IS_SUPPORTED(name, isa) \
+    static method_result_t System_Runtime_Intrinsics_X86_##name##_get_IsSupported() { \
+        return (method_result_t){ .exception = NULL, .value = x86_isa_supported(isa) }; \
+    }
+
+// the classes that we have the scalar kernels of below
+X86_ISA_IS_SUPPORTED(Sse42, X86_ISA_SSE42)
+X86_ISA_IS_SUPPORTED(Popcnt, X86_ISA_POPCNT)
+X86_ISA_IS_SUPPORTED(Bmi1, X86_ISA_BMI1)
+X86_ISA_IS_SUPPORTED(Bmi2, X86_ISA_BMI2)
+X86_ISA_IS_SUPPORTED(Lzcnt, X86_ISA_LZCNT)
+
+//
+// The vector operations of Vector128/Vector256 and the Sse through Avx2 classes are not
+// implemented. MIR has no vector types, and a kernel taking a Vector128 by value does not
+// line up with how MIR passes value types: MIR_T_BLK always goes in memory, while the C
+// ABI passes a 16 byte struct in two registers. Until the jit lowers them, those classes
+// report themselves as unsupported so managed code takes its scalar path instead of
+// calling methods that have no implementation.
+//
+#define X86_ISA_NOT_SUPPORTED(name) \
+    static method_result_t System_Runtime_Intrinsics_X86_##name##_get_IsSupported() { \
+        return (method_result_t){ .exception = NULL, .value = false }; \
+    }
+
+X86_ISA_NOT_SUPPORTED(Sse)
+X86_ISA_NOT_SUPPORTED(Sse2)
+X86_ISA_NOT_SUPPORTED(Sse3)
+X86_ISA_NOT_SUPPORTED(Ssse3)
+X86_ISA_NOT_SUPPORTED(Sse41)
+X86_ISA_NOT_SUPPORTED(Avx)
+X86_ISA_NOT_SUPPORTED(Avx2)
+
+static method_result_t System_Runtime_Intrinsics_X86_X86Base_get_IsSupported() {
+    return (method_result_t){ .exception = NULL, .value = true };
+}
+
+static method_result_t System_Runtime_Intrinsics_Vector_get_IsHardwareAccelerated() {
+    return (method_result_t){ .exception = NULL, .value = false };
+}
+
+// like in .NET, these must only be called after checking IsSupported
+
+__attribute__((target("sse4.2")))
+static method_result_t System_Runtime_Intrinsics_X86_Sse42_Crc32_u8(uint32_t crc, uint8_t data) {
+    return (method_result_t){ .exception = NULL, .value = __builtin_ia32_crc32qi(crc, data) };
+}
+
+__attribute__((target("sse4.2")))
+static method_result_t System_Runtime_Intrinsics_X86_Sse42_Crc32_u16(uint32_t crc, uint16_t data) {
+    return (method_result_t){ .exception = NULL, .value = __builtin_ia32_crc32hi(crc, data) };
+}
+
+__attribute__((target("sse4.2")))
+static method_result_t System_Runtime_Intrinsics_X86_Sse42_Crc32_u32(uint32_t crc, uint32_t data) {
+    return (method_result_t){ .exception = NULL, .value = __builtin_ia32_crc32si(crc, data) };
+}
+
+__attribute__((target("popcnt")))
+static method_result_t System_Runtime_Intrinsics_X86_Popcnt_PopCount(uint32_t value) {
+    return (method_result_t){ .exception = NULL, .value = __builtin_popcount(value) };
+}
+
+__attribute__((target("lzcnt")))
+static method_result_t System_Runtime_Intrinsics_X86_Lzcnt_LeadingZeroCount(uint32_t value) {
+    return (method_result_t){ .exception = NULL, .value = __builtin_ia32_lzcnt_u32(value) };
+}
+
+__attribute__((target("bmi")))
+static method_result_t System_Runtime_Intrinsics_X86_Bmi1_TrailingZeroCount(uint32_t value) {
+    return (method_result_t){ .exception = NULL, .value = __builtin_ia32_tzcnt_u32(value) };
+}
+
+__attribute__((target("bmi2")))
+static method_result_t System_Runtime_Intrinsics_X86_Bmi2_ZeroHighBits(uint32_t value, uint32_t index) {
+    return (method_result_t){ .exception = NULL, .value = __builtin_ia32_bzhi_si(value, index) };
+}
+
+__attribute__((target("bmi2")))
+static method_result_t System_Runtime_Intrinsics_X86_Bmi2_ParallelBitDeposit(uint32_t value, uint32_t mask) {
+    return (method_result_t){ .exception = NULL, .value = __builtin_ia32_pdep_si(value, mask) };
+}
+
+__attribute__((target("bmi2")))
+static method_result_t System_Runtime_Intrinsics_X86_Bmi2_ParallelBitExtract(uint32_t value, uint32_t mask) {
+    return (method_result_t){ .exception = NULL, .value = __builtin_ia32_pext_si(value, mask) };
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 // System.Threading.Thread
 //----------------------------------------------------------------------------------------------------------------------
@@ -153,10 +312,23 @@ static method_result_t System_Threading_Thread_get_CurrentThread(System_Object t
 }
 
 static method_result_t System_Threading_Thread_Yield() {
-    // TODO: properly figure out if we got a reschedule or not, probably via
-    //       implementing it in the scheduler_yield function
-    scheduler_yield();
-    return (method_result_t){ .exception = NULL, .value = true };
+    return (method_result_t){ .exception = NULL, .value = scheduler_yield() };
+}
+
+static System_Exception System_Threading_Thread_Sleep(int32_t millisecondsTimeout) {
+    if (millisecondsTimeout == 0) {
+        scheduler_yield();
+        return NULL;
+    }
+
+    // an infinite sleep waits on a waitable nobody sends to
+    waitable_t* waitable = millisecondsTimeout < 0 ? create_waitable(0) : after((int64_t)millisecondsTimeout * 1000);
+    if (waitable != NULL) {
+        waitable_wait(waitable, true);
+        release_waitable(waitable);
+    }
+
+    return NULL;
 }
 
 static method_result_t System_Threading_Thread_GetNativeThreadState() {
@@ -172,6 +344,10 @@ static method_result_t System_Threading_CreateNativeThread(System_Delegate deleg
     // create the thread, the parameter is the delegate instance, and set
     // the managed thread that is related to this thread
     thread_t* new_thread = create_thread(invoke->MirFunc->addr, delegate, "dotnet/thread");
+    if (new_thread == NULL) {
+        // no memory for the thread or its stack, same as .NET reports it
+        return (method_result_t){ .exception = activator_create_exception(tSystem_OutOfMemoryException), .value = 0 };
+    }
     new_thread->tcb->managed_thread = new_thread;
 
     // we need to keep an instance of the thread since
@@ -204,6 +380,202 @@ static System_Exception System_Threading_SetNativeThreadName(thread_t* thread, S
     return NULL;
 }
 
+static System_Exception System_Threading_SetNativeThreadAffinity(thread_t* thread, int32_t cpu) {
+    // a negative cpu lets the thread run anywhere again, the scheduler
+    // wraps cpus past the processor count
+    scheduler_set_affinity(thread, cpu);
+    return NULL;
+}
+
+static method_result_t System_Threading_Thread_GetNativeProcessorCount() {
+    return (method_result_t){ .exception = NULL, .value = get_cpu_count() };
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// System.Threading.ThreadPool
+//----------------------------------------------------------------------------------------------------------------------
+
+static System_Exception System_Threading_ThreadPool_QueueNativeWorkItem(System_Delegate callBack, System_Object state, bool preferLocal) {
+    switch (thread_pool_queue(callBack, state, preferLocal)) {
+        case NO_ERROR: return NULL;
+        case ERROR_OUT_OF_MEMORY: return activator_create_exception(tSystem_OutOfMemoryException);
+        default: return activator_create_exception(tSystem_Exception);
+    }
+}
+
+static method_result_t System_Threading_ThreadPool_get_ThreadCount() {
+    return (method_result_t){ .exception = NULL, .value = thread_pool_get_worker_count() };
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// System.IO.FileStream
+//----------------------------------------------------------------------------------------------------------------------
+
+//
+// The handles are io_handle_t pointers, all of the calls return a negative errno on failure
+// which the managed side turns into an exception. Closing only closes the handle, calls on it
+// after that fail, it is released by the finalizer of the owner once nothing can use it. The
+// buffers are passed as a reference to their first byte, the heap does not move objects so the
+// kernel reads and writes straight into the managed array or span, which the caller keeps alive
+// for the duration of the call.
+//
+
+// System.IO.FileMode
+#define FILE_MODE_CREATE_NEW        1
+#define FILE_MODE_CREATE            2
+#define FILE_MODE_OPEN              3
+#define FILE_MODE_OPEN_OR_CREATE    4
+#define FILE_MODE_TRUNCATE          5
+#define FILE_MODE_APPEND            6
+
+// System.IO.FileAccess
+#define FILE_ACCESS_READ            1
+#define FILE_ACCESS_WRITE           2
+#define FILE_ACCESS_READ_WRITE      3
+
+static method_result_t System_IO_FileStream_OpenNative(System_String path, int32_t mode, int32_t access, io_handle_t** handle) {
+    int flags;
+    switch (access) {
+        case FILE_ACCESS_READ: flags = O_RDONLY; break;
+        case FILE_ACCESS_WRITE: flags = O_WRONLY; break;
+        case FILE_ACCESS_READ_WRITE: flags = O_RDWR; break;
+        default: return (method_result_t){ .exception = NULL, .value = -EINVAL };
+    }
+
+    switch (mode) {
+        case FILE_MODE_CREATE_NEW: flags |= O_CREAT | O_EXCL; break;
+        case FILE_MODE_CREATE: flags |= O_CREAT | O_TRUNC; break;
+        case FILE_MODE_OPEN: break;
+        case FILE_MODE_OPEN_OR_CREATE: flags |= O_CREAT; break;
+        case FILE_MODE_TRUNCATE: flags |= O_TRUNC; break;
+        case FILE_MODE_APPEND: flags |= O_CREAT | O_APPEND; break;
+        default: return (method_result_t){ .exception = NULL, .value = -EINVAL };
+    }
+
+    // a path cut short would open a different file
+    char native_path[PATH_MAX] = { 0 };
+    size_t length = utf16_to_utf8(path->Chars, path->Length, NULL, 0);
+    if (length >= sizeof(native_path)) {
+        return (method_result_t){ .exception = NULL, .value = -ENAMETOOLONG };
+    }
+    utf16_to_utf8(path->Chars, path->Length, (utf8_t*)native_path, length);
+
+    return (method_result_t){ .exception = NULL, .value = io_open(native_path, flags, 0666, handle) };
+}
+
+static method_result_t System_IO_FileStream_ReadNative(io_handle_t* handle, uint8_t* buffer, int32_t count, int64_t offset) {
+    return (method_result_t){ .exception = NULL, .value = io_read(handle, buffer, count, offset) };
+}
+
+static method_result_t System_IO_FileStream_WriteNative(io_handle_t* handle, uint8_t* buffer, int32_t count, int64_t offset) {
+    return (method_result_t){ .exception = NULL, .value = io_write(handle, buffer, count, offset) };
+}
+
+static method_result_t System_IO_FileStream_SeekNative(io_handle_t* handle, int64_t offset, int32_t origin) {
+    // System.IO.SeekOrigin has the same values as the whence
+    return (method_result_t){ .exception = NULL, .value = io_seek(handle, offset, origin) };
+}
+
+static method_result_t System_IO_FileStream_GetLengthNative(io_handle_t* handle) {
+    return (method_result_t){ .exception = NULL, .value = io_get_length(handle) };
+}
+
+static method_result_t System_IO_FileStream_SetLengthNative(io_handle_t* handle, int64_t length) {
+    return (method_result_t){ .exception = NULL, .value = io_set_length(handle, length) };
+}
+
+static method_result_t System_IO_FileStream_FlushNative(io_handle_t* handle) {
+    return (method_result_t){ .exception = NULL, .value = io_flush(handle) };
+}
+
+static System_Exception System_IO_FileStream_CloseNative(io_handle_t* handle) {
+    io_close(handle);
+    return NULL;
+}
+
+static System_Exception System_IO_FileStream_ReleaseNative(io_handle_t* handle) {
+    io_release(handle);
+    return NULL;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// System.Net.Sockets.Socket
+//----------------------------------------------------------------------------------------------------------------------
+
+// System.Net.Sockets.AddressFamily, the rest have the same values as on linux
+#define ADDRESS_FAMILY_INTER_NETWORK_V6     23
+
+static int socket_native_family(int family) {
+    return family == ADDRESS_FAMILY_INTER_NETWORK_V6 ? AF_INET6 : family;
+}
+
+/**
+ * A SocketAddress buffer has the same layout as a sockaddr, other than the family
+ */
+static int socket_native_address(uint8_t* buffer, int32_t length, struct sockaddr_storage* address) {
+    if (length < (int32_t)sizeof(sa_family_t) || length > (int32_t)sizeof(*address)) {
+        return -EINVAL;
+    }
+
+    memcpy(address, buffer, length);
+    address->ss_family = socket_native_family(address->ss_family);
+    return 0;
+}
+
+static method_result_t System_Net_Sockets_Socket_SocketNative(int32_t family, int32_t type, int32_t protocol, io_handle_t** handle) {
+    // System.Net.Sockets.SocketType and ProtocolType match linux
+    return (method_result_t){ .exception = NULL, .value = io_socket(socket_native_family(family), type, protocol, handle) };
+}
+
+static method_result_t System_Net_Sockets_Socket_BindNative(io_handle_t* handle, uint8_t* buffer, int32_t length) {
+    struct sockaddr_storage address;
+    int result = socket_native_address(buffer, length, &address);
+    if (result == 0) {
+        result = io_bind(handle, (struct sockaddr*)&address, length);
+    }
+    return (method_result_t){ .exception = NULL, .value = result };
+}
+
+static method_result_t System_Net_Sockets_Socket_ListenNative(io_handle_t* handle, int32_t backlog) {
+    return (method_result_t){ .exception = NULL, .value = io_listen(handle, backlog) };
+}
+
+static method_result_t System_Net_Sockets_Socket_AcceptNative(io_handle_t* handle, io_handle_t** accepted) {
+    return (method_result_t){ .exception = NULL, .value = io_accept(handle, accepted) };
+}
+
+static method_result_t System_Net_Sockets_Socket_ConnectNative(io_handle_t* handle, uint8_t* buffer, int32_t length) {
+    struct sockaddr_storage address;
+    int result = socket_native_address(buffer, length, &address);
+    if (result == 0) {
+        result = io_connect(handle, (struct sockaddr*)&address, length);
+    }
+    return (method_result_t){ .exception = NULL, .value = result };
+}
+
+static method_result_t System_Net_Sockets_Socket_SendNative(io_handle_t* handle, uint8_t* buffer, int32_t count) {
+    return (method_result_t){ .exception = NULL, .value = io_write(handle, buffer, count, -1) };
+}
+
+static method_result_t System_Net_Sockets_Socket_ReceiveNative(io_handle_t* handle, uint8_t* buffer, int32_t count) {
+    return (method_result_t){ .exception = NULL, .value = io_read(handle, buffer, count, -1) };
+}
+
+static method_result_t System_Net_Sockets_Socket_ShutdownNative(io_handle_t* handle, int32_t how) {
+    // System.Net.Sockets.SocketShutdown matches linux
+    return (method_result_t){ .exception = NULL, .value = io_shutdown(handle, how) };
+}
+
+static System_Exception System_Net_Sockets_Socket_CloseNative(io_handle_t* handle) {
+    io_close(handle);
+    return NULL;
+}
+
+static System_Exception System_Net_Sockets_Socket_ReleaseNative(io_handle_t* handle) {
+    io_release(handle);
+    return NULL;
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 // System.Object
 //----------------------------------------------------------------------------------------------------------------------
@@ -213,6 +585,27 @@ static method_result_t object_GetType(System_Object this) {
     return (method_result_t){ .exception = NULL, .value = (uintptr_t) OBJECT_TYPE(this) };
 }
 
+//----------------------------------------------------------------------------------------------------------------------
+// System.String
+//----------------------------------------------------------------------------------------------------------------------
+
+static method_result_t System_String_Intern(System_String str) {
+    if (str == NULL) {
+        return (method_result_t){ .exception = activator_create_exception(tSystem_ArgumentNullException), .value = 0 };
+    }
+
+    System_String interned = string_intern(str);
+    if (interned == NULL) {
+        return (method_result_t){ .exception = activator_create_exception(tSystem_OutOfMemoryException), .value = 0 };
+    }
+
+    return (method_result_t){ .exception = NULL, .value = (uintptr_t) interned };
+}
+
+static method_result_t System_String_IsInterned(System_String str) {
+    return (method_result_t){ .exception = NULL, .value = (uintptr_t) (str == NULL ? NULL : string_is_interned(str)) };
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 // System.Threading.Interlocked
 //----------------------------------------------------------------------------------------------------------------------
@@ -285,8 +678,17 @@ static method_result_t System_Reflection_Assembly_LoadInternal_raw(System_Byte_A
     err_t err = NO_ERROR;
     System_Exception exception = NULL;
 
+    // the assembly keeps using the binary, and the array is not going to stay alive
+    void* buffer = malloc(rawAssembly->Length);
+    CHECK_ERROR(buffer != NULL, ERROR_OUT_OF_MEMORY);
+    memcpy(buffer, rawAssembly->Data, rawAssembly->Length);
+
     System_Reflection_Assembly assembly = NULL;
-    CHECK_AND_RETHROW(loader_load_assembly(rawAssembly->Data, rawAssembly->Length, &assembly));
+    err = loader_load_assembly(buffer, rawAssembly->Length, &assembly);
+    if (IS_ERROR(err)) {
+        free(buffer);
+    }
+    CHECK_AND_RETHROW(err);
 
     if (!reflection) {
         // TODO: instead we probably want to jit specifically the entry point
@@ -385,41 +787,15 @@ static System_Exception System_Array_CopyInternal(System_Array sourceArray, int6
     size_t copy_size = length * elementSize;
 
     if (type_get_stack_type(elementType) == STACK_TYPE_VALUE_TYPE || type_is_interface(elementType)) {
-        if (arrlen(elementType->ManagedPointersOffsets) == 0) {
-            // fast path for copying non-managed struct arrays
-            memmove(dst_data, src_data, copy_size);
+        // only structs with references need a barrier
+        if (arrlen(elementType->ManagedPointersOffsets) != 0) {
+            gc_update_range(destinationArray, dst_offset, src_data, copy_size);
         } else {
-            // copying an array, copy each item as a managed memcpy
-            if ((src_data < dst_data) && dst_data < src_data + copy_size) {
-                for (dst_offset += copy_size, src_data += copy_size; length--; ) {
-                    src_data -= elementSize;
-                    dst_offset -= elementSize;
-                    managed_memcpy((System_Object)destinationArray, elementType, dst_offset, src_data);
-                }
-            } else {
-                while (length--) {
-                    managed_memcpy((System_Object)destinationArray, elementType, dst_offset, src_data);
-                    src_data += elementSize;
-                    dst_offset += elementSize;
-                }
-            }
+            memmove(dst_data, src_data, copy_size);
         }
     } else if (type_get_stack_type(elementType) == STACK_TYPE_O) {
-        // we are copying objects, need to use a membarrier for each
-        // TODO: maybe do group copies/barriers instead of one by one
-        if ((src_data < dst_data) && dst_data < src_data + copy_size) {
-            for (dst_offset += copy_size, src_data += copy_size; length--; ) {
-                src_data -= elementSize;
-                dst_offset -= elementSize;
-                gc_update((System_Object)destinationArray, dst_offset, *(void**)src_data);
-            }
-        } else {
-            while (length--) {
-                gc_update((System_Object)destinationArray, dst_offset, *(void**)src_data);
-                src_data += elementSize;
-                dst_offset += elementSize;
-            }
-        }
+        // copy all the references and do a single barrier for all of them
+        gc_update_range(destinationArray, dst_offset, src_data, copy_size);
     } else {
         // normal memcpy, no need to do anything special
         memmove(dst_data, src_data, copy_size);
@@ -428,6 +804,75 @@ static System_Exception System_Array_CopyInternal(System_Array sourceArray, int6
     return NULL;
 }
 
+//----------------------------------------------------------------------------------------------------------------------
+// System.SpanHelpers
+//----------------------------------------------------------------------------------------------------------------------
+
+//
+// The byte primitives go to libc, which picks the best version for the cpu at startup,
+// the char ones go over 4 chars at a time and only look at single chars on a hit
+//
+
+#define CHARS_PER_WORD  (sizeof(uint64_t) / sizeof(System_Char))
+#define CHAR_LOW_BITS   0x0001000100010001ull
+#define CHAR_HIGH_BITS  0x8000800080008000ull
+
+static method_result_t System_SpanHelpers_SequenceEqual(uint8_t* first, uint8_t* second, size_t length) {
+    return (method_result_t){ .exception = NULL, .value = memcmp(first, second, length) == 0 };
+}
+
+static method_result_t System_SpanHelpers_IndexOf(uint8_t* search_space, uint8_t value, int length) {
+    uint8_t* found = memchr(search_space, value, length);
+    return (method_result_t){ .exception = NULL, .value = found == NULL ? -1 : (int)(found - search_space) };
+}
+
+static method_result_t System_SpanHelpers_IndexOfChar(System_Char* search_space, System_Char value, int length) {
+    uint64_t pattern = value * CHAR_LOW_BITS;
+
+    int i = 0;
+    for (; i + CHARS_PER_WORD <= length; i += CHARS_PER_WORD) {
+        uint64_t word;
+        memcpy(&word, search_space + i, sizeof(word));
+
+        // a char that matches the value turns into zero
+        word ^= pattern;
+        if ((word - CHAR_LOW_BITS) & ~word & CHAR_HIGH_BITS) {
+            break;
+        }
+    }
+
+    for (; i < length; i++) {
+        if (search_space[i] == value) {
+            return (method_result_t){ .exception = NULL, .value = i };
+        }
+    }
+
+    return (method_result_t){ .exception = NULL, .value = -1 };
+}
+
+static method_result_t System_SpanHelpers_SequenceCompareTo(System_Char* first, int first_length, System_Char* second, int second_length) {
+    int length = MIN(first_length, second_length);
+
+    // skip the common prefix a word at a time
+    int i = 0;
+    for (; i + CHARS_PER_WORD <= length; i += CHARS_PER_WORD) {
+        uint64_t a, b;
+        memcpy(&a, first + i, sizeof(a));
+        memcpy(&b, second + i, sizeof(b));
+        if (a != b) {
+            break;
+        }
+    }
+
+    for (; i < length; i++) {
+        if (first[i] != second[i]) {
+            return (method_result_t){ .exception = NULL, .value = (int)first[i] - (int)second[i] };
+        }
+    }
+
+    return (method_result_t){ .exception = NULL, .value = first_length - second_length };
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 // System.GC
 //----------------------------------------------------------------------------------------------------------------------
@@ -456,6 +901,15 @@ static System_Exception System_GC_KeepAlive(void* obj) {
     return NULL;
 }
 
+static System_Exception System_GC_GetMemoryInfoInternal(System_GCMemoryInfo* memoryInfo) {
+    gc_get_memory_info(memoryInfo);
+    return NULL;
+}
+
+static method_result_t System_GC_GetCycleInfoInternal(uint64_t index, gc_cycle_info_t* info) {
+    return (method_result_t) { .exception = NULL, .value = gc_get_cycle_info(index, info) };
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 // everything
 //----------------------------------------------------------------------------------------------------------------------
@@ -466,36 +920,100 @@ internal_call_t g_internal_calls[] = {
     { "[Corelib-v1]System.Reflection.Assembly::LoadInternal([Corelib-v1]System.Byte[],bool)", System_Reflection_Assembly_LoadInternal_raw },
     { "[Corelib-v1]System.Reflection.Assembly::LoadInternal(string,bool)", System_Reflection_Assembly_LoadInternal_string },
 
+    { "string::Intern(string)", System_String_Intern },
+    { "string::IsInterned(string)", System_String_IsInterned },
+
     { "[Corelib-v1]System.Activator::CreateInstance([Corelib-v1]System.Type,[Corelib-v1]System.Object[])", System_Activator_CreateInstance },
 
     { "[Corelib-v1]System.Array::ClearInternal([Corelib-v1]System.Array,int32,int32)", System_Array_ClearInternal },
     { "[Corelib-v1]System.Array::CopyInternal([Corelib-v1]System.Array,int64,[Corelib-v1]System.Array,int64,int64)", System_Array_CopyInternal },
 
+    { "[Corelib-v1]System.SpanHelpers::SequenceEqual([Corelib-v1]System.Byte&,[Corelib-v1]System.Byte&,native uint)", System_SpanHelpers_SequenceEqual },
+    { "[Corelib-v1]System.SpanHelpers::IndexOf([Corelib-v1]System.Byte&,uint8,int32)", System_SpanHelpers_IndexOf },
+    { "[Corelib-v1]System.SpanHelpers::IndexOfChar([Corelib-v1]System.Char&,char,int32)", System_SpanHelpers_IndexOfChar },
+    { "[Corelib-v1]System.SpanHelpers::SequenceCompareTo([Corelib-v1]System.Char&,int32,[Corelib-v1]System.Char&,int32)", System_SpanHelpers_SequenceCompareTo },
+
     { "[Corelib-v1]System.GC::Collect(int32,[Corelib-v1]System.GCCollectionMode,bool)", System_GC_Collect },
     { "[Corelib-v1]System.GC::KeepAlive(object)", System_GC_KeepAlive },
+    { "[Corelib-v1]System.GC::GetMemoryInfoInternal([Corelib-v1]System.GCMemoryInfo&)", System_GC_GetMemoryInfoInternal },
+    { "[Corelib-v1]System.GC::GetCycleInfoInternal(uint64,[Corelib-v1]System.GCCycleInfo&)", System_GC_GetCycleInfoInternal },
 
     { "[Corelib-v1]System.Threading.Monitor::EnterInternal(object,[Corelib-v1]System.Boolean&)", System_Threading_Monitor_EnterInternal },
+    { "[Corelib-v1]System.Threading.Monitor::TryEnterInternal(object,int32,[Corelib-v1]System.Boolean&)", System_Threading_Monitor_TryEnterInternal },
     { "[Corelib-v1]System.Threading.Monitor::ExitInternal(object)", System_Threading_Monitor_ExitInternal },
     { "[Corelib-v1]System.Threading.Monitor::PulseInternal(object)", System_Threading_Monitor_PulseInternal },
     { "[Corelib-v1]System.Threading.Monitor::PulseAllInternal(object)", System_Threading_Monitor_PulseAllInternal },
     { "[Corelib-v1]System.Threading.Monitor::WaitInternal(object)", System_Threading_Monitor_WaitInternal },
+    { "[Corelib-v1]System.Threading.Monitor::WaitInternal(object,int32,[Corelib-v1]System.Boolean&)", System_Threading_Monitor_WaitTimeoutInternal },
 
     { "[Corelib-v1]System.Runtime.Intrinsics.X86.X86Base::Pause()", System_Runtime_Intrinsics_X86_X86Base_Pause },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.X86Base::get_IsSupported()", System_Runtime_Intrinsics_X86_X86Base_get_IsSupported },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Sse::get_IsSupported()", System_Runtime_Intrinsics_X86_Sse_get_IsSupported },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Sse2::get_IsSupported()", System_Runtime_Intrinsics_X86_Sse2_get_IsSupported },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Sse3::get_IsSupported()", System_Runtime_Intrinsics_X86_Sse3_get_IsSupported },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Ssse3::get_IsSupported()", System_Runtime_Intrinsics_X86_Ssse3_get_IsSupported },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Sse41::get_IsSupported()", System_Runtime_Intrinsics_X86_Sse41_get_IsSupported },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Sse42::get_IsSupported()", System_Runtime_Intrinsics_X86_Sse42_get_IsSupported },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Popcnt::get_IsSupported()", System_Runtime_Intrinsics_X86_Popcnt_get_IsSupported },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Avx::get_IsSupported()", System_Runtime_Intrinsics_X86_Avx_get_IsSupported },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Avx2::get_IsSupported()", System_Runtime_Intrinsics_X86_Avx2_get_IsSupported },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Bmi1::get_IsSupported()", System_Runtime_Intrinsics_X86_Bmi1_get_IsSupported },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Bmi2::get_IsSupported()", System_Runtime_Intrinsics_X86_Bmi2_get_IsSupported },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Lzcnt::get_IsSupported()", System_Runtime_Intrinsics_X86_Lzcnt_get_IsSupported },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Sse42::Crc32(uint32,uint8)", System_Runtime_Intrinsics_X86_Sse42_Crc32_u8 },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Sse42::Crc32(uint32,uint16)", System_Runtime_Intrinsics_X86_Sse42_Crc32_u16 },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Sse42::Crc32(uint32,uint32)", System_Runtime_Intrinsics_X86_Sse42_Crc32_u32 },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Popcnt::PopCount(uint32)", System_Runtime_Intrinsics_X86_Popcnt_PopCount },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Lzcnt::LeadingZeroCount(uint32)", System_Runtime_Intrinsics_X86_Lzcnt_LeadingZeroCount },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Bmi1::TrailingZeroCount(uint32)", System_Runtime_Intrinsics_X86_Bmi1_TrailingZeroCount },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Bmi2::ZeroHighBits(uint32,uint32)", System_Runtime_Intrinsics_X86_Bmi2_ZeroHighBits },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Bmi2::ParallelBitDeposit(uint32,uint32)", System_Runtime_Intrinsics_X86_Bmi2_ParallelBitDeposit },
+    { "[Corelib-v1]System.Runtime.Intrinsics.X86.Bmi2::ParallelBitExtract(uint32,uint32)", System_Runtime_Intrinsics_X86_Bmi2_ParallelBitExtract },
+    { "[Corelib-v1]System.Runtime.Intrinsics.Vector128::get_IsHardwareAccelerated()", System_Runtime_Intrinsics_Vector_get_IsHardwareAccelerated },
+    { "[Corelib-v1]System.Runtime.Intrinsics.Vector256::get_IsHardwareAccelerated()", System_Runtime_Intrinsics_Vector_get_IsHardwareAccelerated },
 
     { "[Corelib-v1]System.Diagnostics.Stopwatch::GetTscFrequency()", System_Diagnostic_Stopwatch_GetTscFrequency },
     { "[Corelib-v1]System.Diagnostics.Stopwatch::GetTimestamp()", System_Diagnostic_Stopwatch_GetTimestamp },
 
     { "[Corelib-v1]System.Threading.Thread::get_CurrentThread()", System_Threading_Thread_get_CurrentThread },
     { "[Corelib-v1]System.Threading.Thread::Yield()", System_Threading_Thread_Yield },
+    { "[Corelib-v1]System.Threading.Thread::Sleep(int32)", System_Threading_Thread_Sleep },
     { "[Corelib-v1]System.Threading.Thread::GetNativeThreadState(uint64)", System_Threading_Thread_GetNativeThreadState },
     { "[Corelib-v1]System.Threading.Thread::CreateNativeThread([Corelib-v1]System.Delegate,[Corelib-v1]System.Threading.Thread)", System_Threading_CreateNativeThread },
     { "[Corelib-v1]System.Threading.Thread::StartNativeThread(uint64,object)", System_Threading_StartNativeThread },
     { "[Corelib-v1]System.Threading.Thread::ReleaseNativeThread(uint64)", System_Threading_ReleaseNativeThread },
     { "[Corelib-v1]System.Threading.Thread::SetNativeThreadName(uint64,string)", System_Threading_SetNativeThreadName },
+    { "[Corelib-v1]System.Threading.Thread::SetNativeThreadAffinity(uint64,int32)", System_Threading_SetNativeThreadAffinity },
+    { "[Corelib-v1]System.Threading.Thread::GetNativeProcessorCount()", System_Threading_Thread_GetNativeProcessorCount },
+
+    { "[Corelib-v1]System.Threading.ThreadPool::QueueNativeWorkItem([Corelib-v1]System.Delegate,object,bool)", System_Threading_ThreadPool_QueueNativeWorkItem },
+    { "[Corelib-v1]System.Threading.ThreadPool::get_ThreadCount()", System_Threading_ThreadPool_get_ThreadCount },
+
+    { "[Corelib-v1]System.IO.FileStream::OpenNative(string,int32,int32,[Corelib-v1]System.UInt64&)",           System_IO_FileStream_OpenNative },
+    { "[Corelib-v1]System.IO.FileStream::ReadNative(uint64,[Corelib-v1]System.Byte&,int32,int64)",            System_IO_FileStream_ReadNative },
+    { "[Corelib-v1]System.IO.FileStream::WriteNative(uint64,[Corelib-v1]System.Byte&,int32,int64)",           System_IO_FileStream_WriteNative },
+    { "[Corelib-v1]System.IO.FileStream::SeekNative(uint64,int64,int32)",                                     System_IO_FileStream_SeekNative },
+    { "[Corelib-v1]System.IO.FileStream::GetLengthNative(uint64)",                                            System_IO_FileStream_GetLengthNative },
+    { "[Corelib-v1]System.IO.FileStream::SetLengthNative(uint64,int64)",                                      System_IO_FileStream_SetLengthNative },
+    { "[Corelib-v1]System.IO.FileStream::FlushNative(uint64)",                                                System_IO_FileStream_FlushNative },
+    { "[Corelib-v1]System.IO.FileStream::CloseNative(uint64)",                                                System_IO_FileStream_CloseNative },
+    { "[Corelib-v1]System.IO.FileStream::ReleaseNative(uint64)",                                              System_IO_FileStream_ReleaseNative },
+
+    { "[Corelib-v1]System.Net.Sockets.Socket::SocketNative(int32,int32,int32,[Corelib-v1]System.UInt64&)",    System_Net_Sockets_Socket_SocketNative },
+    { "[Corelib-v1]System.Net.Sockets.Socket::BindNative(uint64,[Corelib-v1]System.Byte&,int32)",             System_Net_Sockets_Socket_BindNative },
+    { "[Corelib-v1]System.Net.Sockets.Socket::ListenNative(uint64,int32)",                                    System_Net_Sockets_Socket_ListenNative },
+    { "[Corelib-v1]System.Net.Sockets.Socket::AcceptNative(uint64,[Corelib-v1]System.UInt64&)",               System_Net_Sockets_Socket_AcceptNative },
+    { "[Corelib-v1]System.Net.Sockets.Socket::ConnectNative(uint64,[Corelib-v1]System.Byte&,int32)",          System_Net_Sockets_Socket_ConnectNative },
+    { "[Corelib-v1]System.Net.Sockets.Socket::SendNative(uint64,[Corelib-v1]System.Byte&,int32)",             System_Net_Sockets_Socket_SendNative },
+    { "[Corelib-v1]System.Net.Sockets.Socket::ReceiveNative(uint64,[Corelib-v1]System.Byte&,int32)",          System_Net_Sockets_Socket_ReceiveNative },
+    { "[Corelib-v1]System.Net.Sockets.Socket::ShutdownNative(uint64,int32)",                                  System_Net_Sockets_Socket_ShutdownNative },
+    { "[Corelib-v1]System.Net.Sockets.Socket::CloseNative(uint64)",                                           System_Net_Sockets_Socket_CloseNative },
+    { "[Corelib-v1]System.Net.Sockets.Socket::ReleaseNative(uint64)",                                         System_Net_Sockets_Socket_ReleaseNative },
 
     { "[Corelib-v1]System.Threading.WaitHandle::WaitableSend(uint64,bool)",             System_Threading_WaitHandle_WaitableSend },
     { "[Corelib-v1]System.Threading.WaitHandle::WaitableWait(uint64,bool)",             System_Threading_WaitHandle_WaitableWait },
     { "[Corelib-v1]System.Threading.WaitHandle::WaitableSelect2(uint64,uint64,bool)",   System_Threading_WaitHandle_WaitableSelect2 },
+    { "[Corelib-v1]System.Threading.WaitHandle::WaitableSelectAny(uint64[],bool)",      System_Threading_WaitHandle_WaitableSelectAny },
     { "[Corelib-v1]System.Threading.WaitHandle::CreateWaitable(int32)",                 System_Threading_WaitHandle_CreateWaitable },
     { "[Corelib-v1]System.Threading.WaitHandle::WaitableAfter(int64)",                  System_Threading_WaitHandle_WaitableAfter },
     { "[Corelib-v1]System.Threading.WaitHandle::ReleaseWaitable(uint64)",               System_Threading_WaitHandle_ReleaseWaitable },
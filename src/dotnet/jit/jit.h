@@ -9,6 +9,30 @@
  */
 err_t init_jit();
 
+/**
+ * Enable or disable tiered compilation, must be set before init_jit, when
+ * disabled every method is generated fully optimized right away
+ */
+void jit_set_tiered_compilation(bool enabled);
+
+/**
+ * Enable or disable lazy compilation, when enabled the machine code of a method is
+ * generated on its first call instead of generating the whole module when it is linked
+ */
+void jit_set_lazy_compilation(bool enabled);
+
+/**
+ * Enable or disable writing /tmp/perf-<pid>.map, which sampling profilers like perf use
+ * to find the names of the jitted methods, must be set before anything is jitted
+ */
+void jit_set_perf_map(bool enabled);
+
+/**
+ * Get the name of the method the given address is in, NULL if the address
+ * is not in any jitted code, safe to call from any thread
+ */
+const char* jit_get_code_name(uintptr_t pc);
+
 /**
  * Fully jit a type, and all the types that reference this type
  */
@@ -40,6 +64,18 @@ MIR_context_t jit_get_mir_context();
  */
 void jit_release_mir_context();
 
+/**
+ * Calls a method with the arguments given as objects, value types are unboxed into the
+ * parameters, the this is passed as is, and the return value, if any, is stored to result
+ */
+typedef System_Exception (*jit_invoke_thunk_t)(void* func, void* this, System_Object* args, void* result);
+
+/**
+ * Get the invoke thunk for the signature of the method, it is generated on the first
+ * use and shared by all the methods with the same mir signature
+ */
+err_t jit_get_invoke_thunk(System_Reflection_MethodInfo method, jit_invoke_thunk_t* out_thunk);
+
 /**
  * Dump the MIR of a specific method
  */
@@ -1,5 +1,6 @@
 #include "jit.h"
 #include "dotnet/monitor.h"
+#include "dotnet/activator.h"
 #include "thread/scheduler.h"
 #include "internal_calls.h"
 
@@ -13,13 +14,20 @@
 
 #include <util/except.h>
 #include <util/stb_ds.h>
+#include <util/trace_event.h>
 #include <time/tsc.h>
+#include <sync/conditional.h>
+#include <sync/spinlock.h>
+#include <thread/waitable.h>
 
 #include <mir/mir-gen.h>
 #include <mir/mir.h>
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
 
 // TODO: we need a mir try-catch so we can recover from mir errors
 
@@ -49,6 +57,133 @@
     } while (0);
 #endif
 
+/**
+ * The most MIR generators to run in parallel
+ */
+#define JIT_MAX_GENERATORS 16
+
+/**
+ * With tiered compilation methods are first generated with a cheap optimization
+ * level, and regenerated fully optimized once they were called enough times
+ */
+#define JIT_TIER0_OPTIMIZE_LEVEL    1
+#define JIT_TIER1_OPTIMIZE_LEVEL    3
+#define JIT_TIER_UP_CALL_COUNT      30
+
+static bool m_jit_tiered = true;
+
+/**
+ * Callees with at most this many bytes of IL are inlined into their callers,
+ * this is about the size of a property getter or a span indexer
+ */
+#define JIT_INLINE_IL_SIZE          32
+
+void jit_set_tiered_compilation(bool enabled) {
+    m_jit_tiered = enabled;
+}
+
+/**
+ * With lazy compilation the machine code of a method is only generated
+ * the first time it is called
+ */
+static bool m_jit_lazy = true;
+
+void jit_set_lazy_compilation(bool enabled) {
+    m_jit_lazy = enabled;
+}
+
+/**
+ * Set on a call site once it has seen more than one vtable
+ */
+#define JIT_CALL_SITE_MEGAMORPHIC ((void**)UINTPTR_MAX)
+
+/**
+ * The receiver profile of a virtual call site in a tier-0 method
+ */
+typedef struct jit_call_site {
+    // the vtable seen at the call site, NULL if none was seen yet
+    void** vtable;
+
+    // the register holding the vtable, and the
+    // index of the called method inside of it
+    MIR_reg_t vtable_reg;
+    int vtable_index;
+
+    // loads the target from the vtable, and the call itself
+    MIR_insn_t target_load;
+    MIR_insn_t call;
+
+    // the profiling code, removed before regenerating
+    MIR_insn_t insns[9];
+} jit_call_site_t;
+
+/**
+ * The initialization state of a type with a static constructor
+ */
+typedef struct jit_cctor {
+    // set once the cctor ran successfully, read by the guards without any
+    // lock, never set for a failed cctor so its guards keep going to the
+    // slow path
+    _Atomic(uint8_t) done;
+
+    // if the cctor is running right now and the thread running
+    // it, protected by the cctor mutex
+    bool running;
+    thread_t* thread;
+
+    // the cctor threw, protected by the cctor mutex
+    bool failed;
+
+    System_Type type;
+
+    // the TypeInitializationException thrown by every access
+    // to the type if the cctor failed
+    System_Exception exception;
+} jit_cctor_t;
+
+/**
+ * A cctor check in a tier-0 method, turned into a jump over the
+ * slow path once the method is regenerated after the cctor ran
+ */
+typedef struct jit_cctor_guard {
+    jit_cctor_t* cctor;
+
+    // the load of the flag and the branch on it
+    MIR_insn_t check[3];
+
+    // the label right after the slow path
+    MIR_label_t done;
+} jit_cctor_guard_t;
+
+/**
+ * The call counter of a tier-0 method
+ */
+typedef struct jit_tier {
+    // calls left until the method is promoted, decremented
+    // without atomics so it is only a rough count
+    int64_t counter;
+
+    // the method to regenerate
+    System_Reflection_MethodInfo method;
+
+    // the counting code, removed before regenerating
+    MIR_insn_t insns[7];
+
+    // the profiled virtual call sites
+    jit_call_site_t** sites;
+
+    // the cctor checks of the method
+    jit_cctor_guard_t* cctor_guards;
+
+    // link in the tier-up queue
+    struct jit_tier* next;
+} jit_tier_t;
+
+static void jit_tier_up(jit_tier_t* tier);
+
+static jit_cctor_t* jit_get_cctor(System_Type type);
+static System_Exception jit_run_cctor(jit_cctor_t* cctor);
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // functions we need for the runtime
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -62,12 +197,32 @@ static MIR_item_t m_is_instance_func = NULL;
 static MIR_item_t m_gc_new_proto = NULL;
 static MIR_item_t m_gc_new_func = NULL;
 
+static MIR_item_t m_gc_new_fixed_proto = NULL;
+static MIR_item_t m_gc_new_fixed_func = NULL;
+
 static MIR_item_t m_gc_update_proto = NULL;
 static MIR_item_t m_gc_update_func = NULL;
 
 static MIR_item_t m_gc_update_ref_proto = NULL;
 static MIR_item_t m_gc_update_ref_func = NULL;
 
+static MIR_item_t m_gc_safepoint_proto = NULL;
+static MIR_item_t m_gc_safepoint_func = NULL;
+
+static MIR_item_t m_jit_tier_up_proto = NULL;
+static MIR_item_t m_jit_tier_up_func = NULL;
+
+static MIR_item_t m_jit_run_cctor_proto = NULL;
+static MIR_item_t m_jit_run_cctor_func = NULL;
+
+static MIR_item_t m_scheduler_get_preempt_flag_proto = NULL;
+static MIR_item_t m_scheduler_get_preempt_flag_func = NULL;
+
+// runtime globals are referenced by name and not by address, so the
+// generated modules don't depend on where the runtime was loaded
+static MIR_item_t m_gc_safepoint_pending_var = NULL;
+static MIR_item_t m_gc_barrier_fast_color_var = NULL;
+
 static MIR_item_t m_managed_memcpy_proto = NULL;
 static MIR_item_t m_managed_memcpy_func = NULL;
 
@@ -297,6 +452,9 @@ err_t init_jit() {
     m_gc_new_proto = MIR_new_proto(m_mir_context, "gc_new$proto", 1, &res_type, 2, MIR_T_P, "type", MIR_T_U64, "size");
     m_gc_new_func = MIR_new_import(m_mir_context, "gc_new");
 
+    m_gc_new_fixed_proto = MIR_new_proto(m_mir_context, "gc_new_fixed$proto", 1, &res_type, 1, MIR_T_P, "type");
+    m_gc_new_fixed_func = MIR_new_import(m_mir_context, "gc_new_fixed");
+
     m_get_array_type_proto = MIR_new_proto(m_mir_context, "get_array_type$proto", 1, &res_type, 1, MIR_T_P, "type");
     m_get_array_type_func = MIR_new_import(m_mir_context, "get_array_type");
 
@@ -306,6 +464,21 @@ err_t init_jit() {
     m_gc_update_ref_proto = MIR_new_proto(m_mir_context, "gc_update_ref$proto", 0, NULL, 2, MIR_T_P, "o", MIR_T_P, "new");
     m_gc_update_ref_func = MIR_new_import(m_mir_context, "gc_update_ref");
 
+    m_gc_safepoint_proto = MIR_new_proto(m_mir_context, "gc_safepoint$proto", 0, NULL, 0);
+    m_gc_safepoint_func = MIR_new_import(m_mir_context, "gc_safepoint");
+
+    m_jit_tier_up_proto = MIR_new_proto(m_mir_context, "jit_tier_up$proto", 0, NULL, 1, MIR_T_P, "tier");
+    m_jit_tier_up_func = MIR_new_import(m_mir_context, "jit_tier_up");
+
+    m_jit_run_cctor_proto = MIR_new_proto(m_mir_context, "jit_run_cctor$proto", 1, &res_type, 1, MIR_T_P, "cctor");
+    m_jit_run_cctor_func = MIR_new_import(m_mir_context, "jit_run_cctor");
+
+    m_scheduler_get_preempt_flag_proto = MIR_new_proto(m_mir_context, "scheduler_get_preempt_flag$proto", 1, &res_type, 0);
+    m_scheduler_get_preempt_flag_func = MIR_new_import(m_mir_context, "scheduler_get_preempt_flag");
+
+    m_gc_safepoint_pending_var = MIR_new_import(m_mir_context, "g_gc_safepoint_pending");
+    m_gc_barrier_fast_color_var = MIR_new_import(m_mir_context, "g_gc_barrier_fast_color");
+
     m_managed_memcpy_proto = MIR_new_proto(m_mir_context, "managed_memcpy$proto", 0, NULL, 4, MIR_T_P, "this", MIR_T_P, "struct_type", MIR_T_I64, "offset", MIR_T_P, "from");
     m_managed_memcpy_func = MIR_new_import(m_mir_context, "managed_memcpy");
 
@@ -348,8 +521,15 @@ err_t init_jit() {
     MIR_load_external(m_mir_context, "dynamic_cast_obj_to_interface", dynamic_cast_obj_to_interface);
     MIR_load_external(m_mir_context, "isinstance", isinstance);
     MIR_load_external(m_mir_context, "gc_new", gc_new);
+    MIR_load_external(m_mir_context, "gc_new_fixed", gc_new_fixed);
     MIR_load_external(m_mir_context, "gc_update", gc_update);
     MIR_load_external(m_mir_context, "gc_update_ref", gc_update_ref);
+    MIR_load_external(m_mir_context, "gc_safepoint", gc_safepoint);
+    MIR_load_external(m_mir_context, "jit_tier_up", jit_tier_up);
+    MIR_load_external(m_mir_context, "jit_run_cctor", jit_run_cctor);
+    MIR_load_external(m_mir_context, "scheduler_get_preempt_flag", scheduler_get_preempt_flag);
+    MIR_load_external(m_mir_context, "g_gc_safepoint_pending", (void*)&g_gc_safepoint_pending);
+    MIR_load_external(m_mir_context, "g_gc_barrier_fast_color", (void*)&g_gc_barrier_fast_color);
     MIR_load_external(m_mir_context, "get_array_type", get_array_type);
     MIR_load_external(m_mir_context, "memcpy", memcpy_wrapper);
     MIR_load_external(m_mir_context, "memset", memset_wrapper);
@@ -361,16 +541,13 @@ err_t init_jit() {
         MIR_load_external(m_mir_context, g_internal_calls[i].target, g_internal_calls[i].impl);
     }
 
-    // init the code gen
-    // FIXME: BUG IN MIR?
-    // lazy jit on multiple threads hits some race condition when two threads are jitting at once
-    // even on hosted TDN
-    // TODO: run valgrind helgrind+drd and fix everythign
-
-    int count = 1;
+    // init the code gen, lazy generation always uses the first generator so it can't
+    // be used from multiple threads, instead every module is generated fully when it
+    // is linked, spread over all the generators
+    int count = MIN(MAX(get_cpu_count(), 1), JIT_MAX_GENERATORS);
     MIR_gen_init(m_mir_context, count);
     for (int i = 0; i < count; i++) {
-        MIR_gen_set_optimize_level(m_mir_context, i, 3);
+        MIR_gen_set_optimize_level(m_mir_context, i, m_jit_tiered ? JIT_TIER0_OPTIMIZE_LEVEL : JIT_TIER1_OPTIMIZE_LEVEL);
     }
 
 #if 0
@@ -460,8 +637,62 @@ typedef struct stack_entry {
      * Is this a readonly reference, meaning it can't be set
      */
     bool readonly_ref;
+
+    /**
+     * Is this value known to not be null
+     */
+    bool non_null;
+
+    /**
+     * The variable this value was loaded from as is, see JIT_SOURCE_LOCAL
+     * and JIT_SOURCE_ARG, zero if it was computed. Only kept until the next
+     * branch target, since other paths may push something else
+     */
+    int source;
 } stack_entry_t;
 
+#define JIT_SOURCE_LOCAL(index)   ((index) + 1)
+#define JIT_SOURCE_ARG(index)     (-((index) + 1))
+
+/**
+ * A loop in the form of `for (i = 0; i < arr.Length; i++)`, in which
+ * arr[i] is always in range
+ */
+typedef struct jit_range_loop {
+    // the il range of the loop body, the increment and the condition
+    // come right after it
+    int start;
+    int end;
+
+    // the index local and the array variable, as sources
+    int index_source;
+    int array_source;
+} jit_range_loop_t;
+
+typedef enum jit_box_use_kind {
+    // box; brtrue/brfalse
+    JIT_BOX_BRANCH,
+
+    // box; [isinst]; unbox.any
+    JIT_BOX_UNBOX,
+
+    // box; callvirt
+    JIT_BOX_CALL,
+} jit_box_use_kind_t;
+
+/**
+ * A box whose object is used right away by the next instructions, and never
+ * escapes, the tokens are resolved when the box is reached
+ */
+typedef struct jit_box_use {
+    jit_box_use_kind_t kind;
+
+    // the instructions that use the object, with their tokens
+    int count;
+    int offsets[2];
+    token_t tokens[2];
+} jit_box_use_t;
+
 typedef struct stack {
     // the stack entries
     stack_entry_t* entries;
@@ -537,9 +768,71 @@ typedef struct jit_method_context {
     // used to store the exception between catch-clauses
     MIR_reg_t exception_reg;
 
+    // the preemption flag of the thread running the method, loaded on entry
+    MIR_reg_t preempt_flag_reg;
+
     // transform a clause to a label
     exception_handling_t* clause_to_label;
 
+    /***************************/
+    /* bounds check elimination */
+    /***************************/
+
+    // the loops in which indexing is known to be in range
+    jit_range_loop_t* range_loops;
+
+    // all the places that can be reached not only from the previous instruction
+    struct {
+        int key;
+        bool value;
+    }* branch_targets;
+
+    /*************************/
+    /* null check elimination */
+    /*************************/
+
+    // set if the il was analyzed, the facts below are not used otherwise
+    bool il_analyzed;
+
+    // variables whose address is taken, we can't know anything about them
+    int* address_taken;
+
+    // the `this` is never null, and is never changed
+    bool this_non_null;
+
+    // the variables known to be non-null since the last branch target
+    int* non_null_sources;
+
+    /********************/
+    /* frame allocation */
+    /********************/
+
+    // the il offsets of the newobj whose object can live in the frame
+    int* frame_objects;
+
+    /*****************************/
+    /* delegate devirtualization */
+    /*****************************/
+
+    // the locals that only ever hold a delegate to a known method
+    struct {
+        int key;
+        System_Reflection_MethodInfo value;
+    }* delegate_locals;
+
+    /*******************/
+    /* box elimination */
+    /*******************/
+
+    // the box instructions that are only used by the next instructions
+    struct {
+        int key;
+        jit_box_use_t value;
+    }* box_uses;
+
+    // the isinst and unbox.any that were left out along with their box
+    int* elided_unboxes;
+
     /*******************/
     /* jitting context */
     /*******************/
@@ -549,6 +842,9 @@ typedef struct jit_method_context {
 
     // the method we are dealing with
     System_Reflection_MethodInfo method;
+
+    // the tiering info of the method, NULL if not tiered
+    jit_tier_t* tier;
 } jit_method_context_t;
 
 // helper
@@ -961,6 +1257,356 @@ void jit_emit_zerofill(jit_method_context_t* ctx, MIR_reg_t dest, size_t count)
     }
 }
 
+/**
+ * Emit a store of a reference into a field of an object on the heap, objects which
+ * have the barrier fast color are stored to directly, otherwise gc_update is called.
+ */
+static void jit_emit_gc_update(jit_method_context_t* ctx, MIR_reg_t object, MIR_op_t offset, MIR_reg_t value) {
+    MIR_label_t slow_path = MIR_new_label(mir_ctx);
+    MIR_label_t done = MIR_new_label(mir_ctx);
+    MIR_reg_t color_reg = new_temp_reg(ctx, tSystem_UInt64);
+    MIR_reg_t fast_color_reg = new_temp_reg(ctx, tSystem_UInt64);
+    MIR_reg_t addr_reg = new_temp_reg(ctx, tSystem_UIntPtr);
+
+    // get the color of the object, which is right after the type
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                 MIR_new_reg_op(mir_ctx, color_reg),
+                                 MIR_new_mem_op(mir_ctx, MIR_T_U64, sizeof(void*), object, 0, 1)));
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_URSH,
+                                 MIR_new_reg_op(mir_ctx, color_reg),
+                                 MIR_new_reg_op(mir_ctx, color_reg),
+                                 MIR_new_int_op(mir_ctx, 48)));
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_AND,
+                                 MIR_new_reg_op(mir_ctx, color_reg),
+                                 MIR_new_reg_op(mir_ctx, color_reg),
+                                 MIR_new_int_op(mir_ctx, 0b111)));
+
+    // get the current fast color and compare
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                 MIR_new_reg_op(mir_ctx, addr_reg),
+                                 MIR_new_ref_op(mir_ctx, m_gc_barrier_fast_color_var)));
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                 MIR_new_reg_op(mir_ctx, fast_color_reg),
+                                 MIR_new_mem_op(mir_ctx, MIR_T_U8, 0, addr_reg, 0, 1)));
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_BNE,
+                                 MIR_new_label_op(mir_ctx, slow_path),
+                                 MIR_new_reg_op(mir_ctx, color_reg),
+                                 MIR_new_reg_op(mir_ctx, fast_color_reg)));
+
+    // fast path, store directly
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_ADD,
+                                 MIR_new_reg_op(mir_ctx, addr_reg),
+                                 MIR_new_reg_op(mir_ctx, object),
+                                 offset));
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                 MIR_new_mem_op(mir_ctx, MIR_T_P, 0, addr_reg, 0, 1),
+                                 MIR_new_reg_op(mir_ctx, value)));
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_JMP,
+                                 MIR_new_label_op(mir_ctx, done)));
+
+    // slow path, call the gc_update write barrier
+    MIR_append_insn(mir_ctx, mir_func, slow_path);
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_call_insn(mir_ctx, 5,
+                                      MIR_new_ref_op(mir_ctx, m_gc_update_proto),
+                                      MIR_new_ref_op(mir_ctx, m_gc_update_func),
+                                      MIR_new_reg_op(mir_ctx, object),
+                                      offset,
+                                      MIR_new_reg_op(mir_ctx, value)));
+    MIR_append_insn(mir_ctx, mir_func, done);
+}
+
+/**
+ * Load the address of the preemption flag of the current thread, the method
+ * keeps it for all of its safepoint polls
+ */
+static void jit_emit_load_preempt_flag(jit_method_context_t* ctx) {
+    ctx->preempt_flag_reg = MIR_new_func_reg(mir_ctx, mir_func->u.func, MIR_T_I64, "preempt_flag");
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_call_insn(mir_ctx, 3,
+                                      MIR_new_ref_op(mir_ctx, m_scheduler_get_preempt_flag_proto),
+                                      MIR_new_ref_op(mir_ctx, m_scheduler_get_preempt_flag_func),
+                                      MIR_new_reg_op(mir_ctx, ctx->preempt_flag_reg)));
+}
+
+/**
+ * Emit a safepoint poll, the gc sets its flag while it waits for the mutators
+ * to handshake with it, and the scheduler sets the flag of a thread when it
+ * should yield, so the common case is two loads and a branch.
+ */
+static void jit_emit_safepoint_poll(jit_method_context_t* ctx) {
+    MIR_label_t done = MIR_new_label(mir_ctx);
+    MIR_reg_t pending_reg = new_temp_reg(ctx, tSystem_UInt64);
+    MIR_reg_t preempt_reg = new_temp_reg(ctx, tSystem_UInt64);
+
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                 MIR_new_reg_op(mir_ctx, pending_reg),
+                                 MIR_new_ref_op(mir_ctx, m_gc_safepoint_pending_var)));
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                 MIR_new_reg_op(mir_ctx, pending_reg),
+                                 MIR_new_mem_op(mir_ctx, MIR_T_U8, 0, pending_reg, 0, 1)));
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                 MIR_new_reg_op(mir_ctx, preempt_reg),
+                                 MIR_new_mem_op(mir_ctx, MIR_T_U8, 0, ctx->preempt_flag_reg, 0, 1)));
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_OR,
+                                 MIR_new_reg_op(mir_ctx, pending_reg),
+                                 MIR_new_reg_op(mir_ctx, pending_reg),
+                                 MIR_new_reg_op(mir_ctx, preempt_reg)));
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_BF,
+                                 MIR_new_label_op(mir_ctx, done),
+                                 MIR_new_reg_op(mir_ctx, pending_reg)));
+
+    // slow path, let the gc know where we are
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_call_insn(mir_ctx, 2,
+                                      MIR_new_ref_op(mir_ctx, m_gc_safepoint_proto),
+                                      MIR_new_ref_op(mir_ctx, m_gc_safepoint_func)));
+    MIR_append_insn(mir_ctx, mir_func, done);
+}
+
+/**
+ * Emit the call counter of tiered compilation, once it reaches zero the method
+ * is queued to be regenerated with full optimizations.
+ */
+static err_t jit_emit_tier_counter(jit_method_context_t* ctx) {
+    err_t err = NO_ERROR;
+
+    jit_tier_t* tier = malloc(sizeof(jit_tier_t));
+    CHECK_ERROR(tier != NULL, ERROR_OUT_OF_MEMORY);
+    tier->counter = JIT_TIER_UP_CALL_COUNT;
+    tier->method = ctx->method;
+    tier->sites = NULL;
+    tier->cctor_guards = NULL;
+    tier->next = NULL;
+    ctx->tier = tier;
+
+    MIR_label_t done = MIR_new_label(mir_ctx);
+    MIR_reg_t addr_reg = new_temp_reg(ctx, tSystem_UInt64);
+    MIR_reg_t counter_reg = new_temp_reg(ctx, tSystem_Int64);
+
+    tier->insns[0] = MIR_new_insn(mir_ctx, MIR_MOV,
+                                  MIR_new_reg_op(mir_ctx, addr_reg),
+                                  MIR_new_uint_op(mir_ctx, (uintptr_t)&tier->counter));
+    tier->insns[1] = MIR_new_insn(mir_ctx, MIR_MOV,
+                                  MIR_new_reg_op(mir_ctx, counter_reg),
+                                  MIR_new_mem_op(mir_ctx, MIR_T_I64, 0, addr_reg, 0, 1));
+    tier->insns[2] = MIR_new_insn(mir_ctx, MIR_SUB,
+                                  MIR_new_reg_op(mir_ctx, counter_reg),
+                                  MIR_new_reg_op(mir_ctx, counter_reg),
+                                  MIR_new_int_op(mir_ctx, 1));
+    tier->insns[3] = MIR_new_insn(mir_ctx, MIR_MOV,
+                                  MIR_new_mem_op(mir_ctx, MIR_T_I64, 0, addr_reg, 0, 1),
+                                  MIR_new_reg_op(mir_ctx, counter_reg));
+
+    // only the call that hits zero queues the method
+    tier->insns[4] = MIR_new_insn(mir_ctx, MIR_BNE,
+                                  MIR_new_label_op(mir_ctx, done),
+                                  MIR_new_reg_op(mir_ctx, counter_reg),
+                                  MIR_new_int_op(mir_ctx, 0));
+    tier->insns[5] = MIR_new_call_insn(mir_ctx, 3,
+                                       MIR_new_ref_op(mir_ctx, m_jit_tier_up_proto),
+                                       MIR_new_ref_op(mir_ctx, m_jit_tier_up_func),
+                                       MIR_new_uint_op(mir_ctx, (uintptr_t)tier));
+    tier->insns[6] = done;
+
+    for (int i = 0; i < ARRAY_LEN(tier->insns); i++) {
+        MIR_append_insn(mir_ctx, mir_func, tier->insns[i]);
+    }
+
+cleanup:
+    return err;
+}
+
+/**
+ * Emit the receiver profiling of a virtual call site, the site remembers the first vtable
+ * it sees, and is marked as megamorphic once it sees another one. Nothing is emitted if
+ * the method is not tiered.
+ */
+static err_t jit_emit_call_site_profile(jit_method_context_t* ctx, MIR_reg_t vtable_reg, int vtable_index, jit_call_site_t** out_site) {
+    err_t err = NO_ERROR;
+
+    *out_site = NULL;
+    if (ctx->tier == NULL) {
+        goto cleanup;
+    }
+
+    jit_call_site_t* site = malloc(sizeof(jit_call_site_t));
+    CHECK_ERROR(site != NULL, ERROR_OUT_OF_MEMORY);
+    site->vtable = NULL;
+    site->vtable_reg = vtable_reg;
+    site->vtable_index = vtable_index;
+    site->target_load = NULL;
+    site->call = NULL;
+
+    MIR_label_t first = MIR_new_label(mir_ctx);
+    MIR_label_t done = MIR_new_label(mir_ctx);
+    MIR_reg_t cell_reg = new_temp_reg(ctx, tSystem_UInt64);
+    MIR_reg_t seen_reg = new_temp_reg(ctx, tSystem_UInt64);
+
+    site->insns[0] = MIR_new_insn(mir_ctx, MIR_MOV,
+                                  MIR_new_reg_op(mir_ctx, cell_reg),
+                                  MIR_new_uint_op(mir_ctx, (uintptr_t)&site->vtable));
+    site->insns[1] = MIR_new_insn(mir_ctx, MIR_MOV,
+                                  MIR_new_reg_op(mir_ctx, seen_reg),
+                                  MIR_new_mem_op(mir_ctx, MIR_T_P, 0, cell_reg, 0, 1));
+
+    // same as before, nothing to update
+    site->insns[2] = MIR_new_insn(mir_ctx, MIR_BEQ,
+                                  MIR_new_label_op(mir_ctx, done),
+                                  MIR_new_reg_op(mir_ctx, seen_reg),
+                                  MIR_new_reg_op(mir_ctx, vtable_reg));
+    site->insns[3] = MIR_new_insn(mir_ctx, MIR_BEQ,
+                                  MIR_new_label_op(mir_ctx, first),
+                                  MIR_new_reg_op(mir_ctx, seen_reg),
+                                  MIR_new_int_op(mir_ctx, 0));
+
+    // seen another vtable already
+    site->insns[4] = MIR_new_insn(mir_ctx, MIR_MOV,
+                                  MIR_new_mem_op(mir_ctx, MIR_T_P, 0, cell_reg, 0, 1),
+                                  MIR_new_uint_op(mir_ctx, (uintptr_t)JIT_CALL_SITE_MEGAMORPHIC));
+    site->insns[5] = MIR_new_insn(mir_ctx, MIR_JMP,
+                                  MIR_new_label_op(mir_ctx, done));
+
+    // first call, remember the vtable
+    site->insns[6] = first;
+    site->insns[7] = MIR_new_insn(mir_ctx, MIR_MOV,
+                                  MIR_new_mem_op(mir_ctx, MIR_T_P, 0, cell_reg, 0, 1),
+                                  MIR_new_reg_op(mir_ctx, vtable_reg));
+    site->insns[8] = done;
+
+    for (int i = 0; i < ARRAY_LEN(site->insns); i++) {
+        MIR_append_insn(mir_ctx, mir_func, site->insns[i]);
+    }
+
+    arrpush(ctx->tier->sites, site);
+    *out_site = site;
+
+cleanup:
+    return err;
+}
+
+/**
+ * Check if code of the method that accesses the type must make sure the cctor of the type ran, static
+ * fields always need it, calls and object creation only for types without beforefieldinit
+ */
+static bool jit_needs_cctor_guard(System_Reflection_MethodInfo method, System_Type type, bool is_call) {
+    if (type->StaticCtor == NULL || method == type->StaticCtor) {
+        return false;
+    }
+
+    // the methods of the type itself are only reached once it was triggered
+    if (is_call && (type_is_before_field_init(type) || method->DeclaringType == type)) {
+        return false;
+    }
+
+    // nothing to check if it already ran, a failed cctor is never done
+    // since every access has to throw
+    jit_cctor_t* cctor = jit_get_cctor(type);
+    return cctor == NULL || !atomic_load(&cctor->done);
+}
+
+/**
+ * Make sure the cctor of the type ran before the code that follows, the slow path
+ * runs it or waits for it, and throws whatever the cctor threw
+ */
+static err_t jit_emit_cctor_guard(jit_method_context_t* ctx, System_Type type, bool is_call) {
+    err_t err = NO_ERROR;
+
+    if (!jit_needs_cctor_guard(ctx->method, type, is_call)) {
+        goto cleanup;
+    }
+
+    jit_cctor_t* cctor = jit_get_cctor(type);
+    CHECK_ERROR(cctor != NULL, ERROR_OUT_OF_MEMORY);
+
+    jit_cctor_guard_t guard = {
+        .cctor = cctor,
+        .done = MIR_new_label(mir_ctx),
+    };
+
+    MIR_reg_t done_reg = new_temp_reg(ctx, tSystem_UInt64);
+    guard.check[0] = MIR_new_insn(mir_ctx, MIR_MOV,
+                                  MIR_new_reg_op(mir_ctx, done_reg),
+                                  MIR_new_uint_op(mir_ctx, (uintptr_t)&cctor->done));
+    guard.check[1] = MIR_new_insn(mir_ctx, MIR_MOV,
+                                  MIR_new_reg_op(mir_ctx, done_reg),
+                                  MIR_new_mem_op(mir_ctx, MIR_T_U8, 0, done_reg, 0, 1));
+    guard.check[2] = MIR_new_insn(mir_ctx, MIR_BT,
+                                  MIR_new_label_op(mir_ctx, guard.done),
+                                  MIR_new_reg_op(mir_ctx, done_reg));
+
+    for (int i = 0; i < ARRAY_LEN(guard.check); i++) {
+        MIR_append_insn(mir_ctx, mir_func, guard.check[i]);
+    }
+
+    // slow path, run the cctor
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_call_insn(mir_ctx, 4,
+                                      MIR_new_ref_op(mir_ctx, m_jit_run_cctor_proto),
+                                      MIR_new_ref_op(mir_ctx, m_jit_run_cctor_func),
+                                      MIR_new_reg_op(mir_ctx, ctx->exception_reg),
+                                      MIR_new_uint_op(mir_ctx, (uintptr_t)cctor)));
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_BF,
+                                 MIR_new_label_op(mir_ctx, guard.done),
+                                 MIR_new_reg_op(mir_ctx, ctx->exception_reg)));
+    CHECK_AND_RETHROW(jit_throw(ctx, NULL));
+    MIR_append_insn(mir_ctx, mir_func, guard.done);
+
+    // can be patched out when regenerating
+    if (ctx->tier != NULL) {
+        arrpush(ctx->tier->cctor_guards, guard);
+    }
+
+cleanup:
+    return err;
+}
+
+/**
+ * Check if a directly called method is small and simple enough to be inlined into the
+ * caller, MIR does the actual inlining and folds the exception check after it when the
+ * callee can't throw
+ */
+static bool jit_should_inline(jit_method_context_t* ctx, System_Reflection_MethodInfo callee) {
+    if (method_is_aggressive_inlining(callee)) {
+        return true;
+    }
+
+    if (method_is_no_inlining(callee) || callee == ctx->method) {
+        return false;
+    }
+
+    // only methods we have jitted from il, anything else does not have mir to inline
+    if (IS_ERROR(loader_fill_method_body(callee))) {
+        return false;
+    }
+    System_Reflection_MethodBody body = callee->MethodBody;
+    if (body == NULL || body->Il == NULL) {
+        return false;
+    }
+
+    // exception handling in the callee needs its own frame
+    if (body->ExceptionHandlingClauses != NULL && body->ExceptionHandlingClauses->Length != 0) {
+        return false;
+    }
+
+    return body->Il->Length <= JIT_INLINE_IL_SIZE;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Jit span functions
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1010,6 +1656,14 @@ static void jit_generate_Unsafe_SizeOf(jit_context_t* ctx, System_Reflection_Met
 /**
  * Generated code is essentially
  *
+ *   if (this->Next == NULL) {
+ *        if (this->Target != NULL) {
+ *            return this->Fnptr(this->Target, ...);
+ *        } else {
+ *            return this->Fnptr(...);
+ *        }
+ *   }
+ *
  *   var return_value;
  *   do {
  *        if (this->Target != NULL) {
@@ -1113,53 +1767,91 @@ static err_t jit_multicast_delegate_invoke(jit_context_t* ctx, System_Reflection
         arg_ops[3] = MIR_new_reg_op(ctx->ctx, return_reg);
     }
 
+    // the same call without the this, for static targets
+    size_t static_other_args = other_args - 1;
+    MIR_op_t static_arg_ops[static_other_args + arg_count];
+    memcpy(static_arg_ops, arg_ops, static_other_args * sizeof(MIR_op_t));
+    memcpy(&static_arg_ops[static_other_args], &arg_ops[other_args], arg_count * sizeof(MIR_op_t));
+    static_arg_ops[0] = MIR_new_ref_op(ctx->ctx, proto_static);
+
     //
-    // Start the call loop
+    // A single target, which is the common case, return whatever it returned as is
     //
 
     MIR_insn_t label_do_next_call = MIR_new_label(ctx->ctx);
-    MIR_append_insn(ctx->ctx, func, label_do_next_call);
+    MIR_insn_t label_single_static_call = MIR_new_label(ctx->ctx);
 
-    MIR_insn_t label_static_call = MIR_new_label(ctx->ctx);
-    MIR_insn_t label_check_exception = MIR_new_label(ctx->ctx);
+    MIR_append_insn(ctx->ctx, func,
+                    MIR_new_insn(ctx->ctx, MIR_BT,
+                                 MIR_new_label_op(ctx->ctx, label_do_next_call),
+                                 next_op));
 
-    // check if we have a this parameter
     MIR_append_insn(ctx->ctx, func,
                     MIR_new_insn(ctx->ctx, MIR_BF,
-                                 MIR_new_label_op(ctx->ctx, label_static_call),
+                                 MIR_new_label_op(ctx->ctx, label_single_static_call),
                                  target_op));
 
-    /************************************/
-    /*** Call with a `this` parameter ***/
-    /************************************/
-
     MIR_append_insn(ctx->ctx, func,
                     MIR_new_insn_arr(ctx->ctx, MIR_CALL,
                                      other_args + arg_count,
                                      arg_ops));
 
     MIR_append_insn(ctx->ctx, func,
-                    MIR_new_insn(ctx->ctx, MIR_JMP,
-                                 MIR_new_label_op(ctx->ctx, label_check_exception)));
-
-    /***************************************/
-    /*** Call without a `this` parameter ***/
-    /***************************************/
-
-    MIR_append_insn(ctx->ctx, func, label_static_call);
-
-    // need to move the arguments one over so we won't pass the this register
-    other_args--;
-    memmove(&arg_ops[i], &arg_ops[i + 1], arg_count * sizeof(MIR_op_t));
+                    MIR_new_ret_insn(ctx->ctx, nres,
+                                     MIR_new_reg_op(ctx->ctx, exception_reg),
+                                     MIR_new_reg_op(ctx->ctx, return_reg)));
 
-    // setup the static prototype signature
-    arg_ops[0] = MIR_new_ref_op(ctx->ctx, proto_static);
+    MIR_append_insn(ctx->ctx, func, label_single_static_call);
 
     MIR_append_insn(ctx->ctx, func,
                     MIR_new_insn_arr(ctx->ctx, MIR_CALL,
-                                     other_args + arg_count,
+                                     static_other_args + arg_count,
+                                     static_arg_ops));
+
+    MIR_append_insn(ctx->ctx, func,
+                    MIR_new_ret_insn(ctx->ctx, nres,
+                                     MIR_new_reg_op(ctx->ctx, exception_reg),
+                                     MIR_new_reg_op(ctx->ctx, return_reg)));
+
+    //
+    // Start the call loop
+    //
+
+    MIR_append_insn(ctx->ctx, func, label_do_next_call);
+
+    MIR_insn_t label_static_call = MIR_new_label(ctx->ctx);
+    MIR_insn_t label_check_exception = MIR_new_label(ctx->ctx);
+
+    // check if we have a this parameter
+    MIR_append_insn(ctx->ctx, func,
+                    MIR_new_insn(ctx->ctx, MIR_BF,
+                                 MIR_new_label_op(ctx->ctx, label_static_call),
+                                 target_op));
+
+    /************************************/
+    /*** Call with a `this` parameter ***/
+    /************************************/
+
+    MIR_append_insn(ctx->ctx, func,
+                    MIR_new_insn_arr(ctx->ctx, MIR_CALL,
+                                     other_args + arg_count,
                                      arg_ops));
 
+    MIR_append_insn(ctx->ctx, func,
+                    MIR_new_insn(ctx->ctx, MIR_JMP,
+                                 MIR_new_label_op(ctx->ctx, label_check_exception)));
+
+    /***************************************/
+    /*** Call without a `this` parameter ***/
+    /***************************************/
+
+    MIR_append_insn(ctx->ctx, func, label_static_call);
+
+    MIR_append_insn(ctx->ctx, func,
+                    MIR_new_insn_arr(ctx->ctx, MIR_CALL,
+                                     static_other_args + arg_count,
+                                     static_arg_ops));
+
     //
     // Check for exception from the delegate's call
     //
@@ -1235,15 +1927,14 @@ static err_t jit_prepare_method(jit_context_t* ctx, System_Reflection_MethodInfo
         goto cleanup;
     }
 
-    // generate the method name
-    proto_name = strbuilder_new();
-    method_print_full_name(method, &proto_name);
-    strbuilder_cstr(&proto_name, "$proto");
-
-    // generate the function name
+    // generate the function name, the protos are named after it
     func_name = strbuilder_new();
     method_print_full_name(method, &func_name);
 
+    proto_name = strbuilder_new();
+    strbuilder_cstr(&proto_name, strbuilder_get(&func_name));
+    strbuilder_cstr(&proto_name, "$proto");
+
     size_t nres = 1;
     MIR_type_t res_type[2] = {
         MIR_T_P, // exception
@@ -1341,7 +2032,7 @@ static err_t jit_prepare_method(jit_context_t* ctx, System_Reflection_MethodInfo
 
             // prepare the signature for the non-
             proto_static_name = strbuilder_new();
-            method_print_full_name(method, &proto_static_name);
+            strbuilder_cstr(&proto_static_name, strbuilder_get(&func_name));
             strbuilder_cstr(&proto_static_name, "$proto_static");
             MIR_item_t static_invoke_proto = MIR_new_proto_arr(ctx->ctx, strbuilder_get(&proto_static_name), nres, res_type, arrlen(vars), vars);
 
@@ -1429,6 +2120,9 @@ static err_t jit_prepare_method(jit_context_t* ctx, System_Reflection_MethodInfo
                 }
             }
         } else {
+            // the body is only parsed once the method is needed
+            CHECK_AND_RETHROW(loader_fill_method_body(method));
+
             // create a function, we will finish it right away and append to it in the future
             method->MirFunc = MIR_new_func_arr(ctx->ctx, strbuilder_get(&func_name), nres, res_type, arrlen(vars), vars);
             MIR_finish_func(ctx->ctx);
@@ -1442,6 +2136,7 @@ static err_t jit_prepare_method(jit_context_t* ctx, System_Reflection_MethodInfo
 
 cleanup:
     arrfree(vars);
+    strbuilder_free(&proto_static_name);
     strbuilder_free(&proto_name);
     strbuilder_free(&func_name);
 
@@ -1617,6 +2312,11 @@ static err_t jit_branch_point(jit_method_context_t* ctx, int il_target, MIR_labe
         }
     }
 
+    // backward branches are loops, poll so long running loops don't hold up the gc
+    if (il_target <= ctx->il_offset) {
+        jit_emit_safepoint_poll(ctx);
+    }
+
     // now we can do the actual branch resolving
     CHECK_AND_RETHROW(jit_resolve_branch(ctx, il_target, label));
 
@@ -1644,14 +2344,24 @@ static err_t jit_new(jit_method_context_t* ctx, MIR_reg_t result, System_Type ty
     // added properly
     CHECK_AND_RETHROW(jit_prepare_type(ctx->ctx, type));
 
-    // allocate the new object
-    MIR_append_insn(mir_ctx, mir_func,
-                    MIR_new_call_insn(mir_ctx, 5,
-                                      MIR_new_ref_op(mir_ctx, m_gc_new_proto),
-                                      MIR_new_ref_op(mir_ctx, m_gc_new_func),
-                                      MIR_new_reg_op(mir_ctx, result),
-                                      MIR_new_ref_op(mir_ctx, type->MirType),
-                                      size));
+    // allocate the new object, objects of a constant size and without a finalizer
+    // take the fast path which skips all the finalizer and immortal handling
+    if (size.mode == MIR_OP_INT && size.u.i == (int64_t)type->ManagedSize && type->Finalize == NULL) {
+        MIR_append_insn(mir_ctx, mir_func,
+                        MIR_new_call_insn(mir_ctx, 4,
+                                          MIR_new_ref_op(mir_ctx, m_gc_new_fixed_proto),
+                                          MIR_new_ref_op(mir_ctx, m_gc_new_fixed_func),
+                                          MIR_new_reg_op(mir_ctx, result),
+                                          MIR_new_ref_op(mir_ctx, type->MirType)));
+    } else {
+        MIR_append_insn(mir_ctx, mir_func,
+                        MIR_new_call_insn(mir_ctx, 5,
+                                          MIR_new_ref_op(mir_ctx, m_gc_new_proto),
+                                          MIR_new_ref_op(mir_ctx, m_gc_new_func),
+                                          MIR_new_reg_op(mir_ctx, result),
+                                          MIR_new_ref_op(mir_ctx, type->MirType),
+                                          size));
+    }
 
 #ifdef READABLE_JIT
     goto cleanup;
@@ -1685,6 +2395,10 @@ cleanup:
 // Excpetion jitting helpers
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// forward decls
+static bool jit_can_inline_class_check(System_Type type);
+static void jit_emit_class_check(jit_method_context_t* ctx, MIR_reg_t result_reg, MIR_reg_t obj_reg, System_Type type);
+
 /**
  * Given the dotnet clause, will generate a jump to it and setup the stack for it accordingly
  */
@@ -1784,13 +2498,17 @@ static err_t jit_throw(jit_method_context_t* ctx, System_Type type) {
                 MIR_label_t skip = MIR_new_label(mir_ctx);
 
                 // check if the current instance is dervied
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_call_insn(mir_ctx, 5,
-                                                  MIR_new_ref_op(mir_ctx, m_is_instance_proto),
-                                                  MIR_new_ref_op(mir_ctx, m_is_instance_func),
-                                                  MIR_new_reg_op(mir_ctx, temp_reg),
-                                                  MIR_new_reg_op(mir_ctx, ctx->exception_reg),
-                                                  MIR_new_ref_op(mir_ctx, clause->CatchType->MirType)));
+                if (jit_can_inline_class_check(clause->CatchType)) {
+                    jit_emit_class_check(ctx, temp_reg, ctx->exception_reg, clause->CatchType);
+                } else {
+                    MIR_append_insn(mir_ctx, mir_func,
+                                    MIR_new_call_insn(mir_ctx, 5,
+                                                      MIR_new_ref_op(mir_ctx, m_is_instance_proto),
+                                                      MIR_new_ref_op(mir_ctx, m_is_instance_func),
+                                                      MIR_new_reg_op(mir_ctx, temp_reg),
+                                                      MIR_new_reg_op(mir_ctx, ctx->exception_reg),
+                                                      MIR_new_ref_op(mir_ctx, clause->CatchType->MirType)));
+                }
 
                 // check the result, if it was false then skip the jump to the exception handler
                 MIR_append_insn(mir_ctx, mir_func,
@@ -1896,6 +2614,63 @@ cleanup:
     return err;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Null check elimination
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//
+// Values are marked as non-null when they come from newobj or ldstr, or from a variable
+// known to be non-null. A variable becomes known to be non-null once a value loaded from
+// it was null checked, or a non-null value was stored to it, and that lasts until the next
+// branch target, where other paths may have left anything in it. Variables whose address
+// is taken are never tracked.
+//
+
+static bool jit_is_address_taken(jit_method_context_t* ctx, int source) {
+    for (int i = 0; i < arrlen(ctx->address_taken); i++) {
+        if (ctx->address_taken[i] == source) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool jit_source_is_non_null(jit_method_context_t* ctx, int source) {
+    if (source == 0 || !ctx->il_analyzed) {
+        return false;
+    }
+
+    if (source == JIT_SOURCE_ARG(0) && ctx->this_non_null) {
+        return true;
+    }
+
+    for (int i = 0; i < arrlen(ctx->non_null_sources); i++) {
+        if (ctx->non_null_sources[i] == source) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void jit_mark_non_null(jit_method_context_t* ctx, int source) {
+    if (source == 0 || !ctx->il_analyzed || jit_is_address_taken(ctx, source)) {
+        return;
+    }
+
+    if (!jit_source_is_non_null(ctx, source)) {
+        arrpush(ctx->non_null_sources, source);
+    }
+}
+
+static void jit_forget_non_null(jit_method_context_t* ctx, int source) {
+    for (int i = 0; i < arrlen(ctx->non_null_sources); i++) {
+        if (ctx->non_null_sources[i] == source) {
+            arrdelswap(ctx->non_null_sources, i);
+            break;
+        }
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Checking for stuff
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1903,13 +2678,19 @@ cleanup:
 /**
  * Emit a null check, throwing System.NullReferenceException if the value at reg is null
  */
-static err_t jit_null_check(jit_method_context_t* ctx, MIR_reg_t reg, System_Type type) {
+static err_t jit_null_check(jit_method_context_t* ctx, MIR_reg_t reg, System_Type type, stack_entry_t* entry) {
     err_t err = NO_ERROR;
 
 #ifdef READABLE_JIT
     goto cleanup;
 #endif
 
+    // already known to not be null, without the analysis we can't
+    // know if another path merged a null into it
+    if (entry != NULL && entry->non_null && ctx->il_analyzed) {
+        goto cleanup;
+    }
+
     if (type == NULL) {
         // this is a null type, just throw it
         CHECK_AND_RETHROW(jit_throw_new(ctx, tSystem_NullReferenceException));
@@ -1939,6 +2720,11 @@ static err_t jit_null_check(jit_method_context_t* ctx, MIR_reg_t reg, System_Typ
         CHECK_AND_RETHROW(jit_throw_new(ctx, tSystem_NullReferenceException));
 
         MIR_append_insn(mir_ctx, mir_func, not_null);
+
+        // from now on the variable it came from is not null either
+        if (entry != NULL) {
+            jit_mark_non_null(ctx, entry->source);
+        }
     }
 
 cleanup:
@@ -1972,3224 +2758,4558 @@ cleanup:
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Casting helpers
+// Bounds check elimination
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+//
+// Before translating a method we look for loops shaped like the C# compiler emits them for
+// `for (int i = 0; i < arr.Length; i++)`:
+//
+//          ldc.i4 k (k >= 0)
+//          stloc i
+//          br COND
+//   BODY:  ...
+//          ldloc i
+//          ldc.i4.1
+//          add
+//          stloc i
+//   COND:  ldloc i
+//          ldloc/ldarg arr
+//          ldlen
+//          conv.i4
+//          blt BODY
+//
+// If the body never writes to i or arr, neither has its address taken, and nothing outside
+// the loop jumps into it other than to COND, then i is always in range of arr in the body.
+// The translator tracks which variable a stack value was loaded from, and skips the range
+// check of arr[i] when both come straight from the loop variables.
+//
+
+typedef struct il_insn {
+    int offset;
+    opcode_t opcode;
+
+    // the variable index, constant, field or method token or branch target
+    int32_t operand;
+} il_insn_t;
+
+typedef struct il_branch {
+    int from;
+    int to;
+} il_branch_t;
+
 /**
- * Emit a cast between an object to an interface, this is not always the most trivial
- * thing but it is needed
+ * Decode the il into a simple form, the short and macro forms of the opcodes we care about
+ * are turned into their long form, returns false if the il could not be decoded, in which
+ * case the translation will fail on it anyways
  */
-static err_t jit_cast_obj_to_interface(jit_method_context_t* ctx,
-                                       MIR_reg_t result_reg, MIR_reg_t from_reg,
-                                       System_Type from_type, System_Type to_type
-) {
-    err_t err = NO_ERROR;
+static bool jit_decode_il(System_Reflection_MethodBody body, il_insn_t** out_insns, il_branch_t** out_branches) {
+    System_Byte_Array il = body->Il;
+    int ptr = 0;
+    while (ptr < il->Length) {
+        il_insn_t insn = { .offset = ptr };
 
-    // temp register to use for stuff
-    MIR_reg_t vtable_reg = new_temp_reg(ctx, tSystem_IntPtr);
+        uint16_t opcode_value = (REFPRE << 8) | il->Data[ptr++];
+        opcode_t opcode = g_dotnet_opcode_lookup[opcode_value];
+        if (opcode == CEE_INVALID) return false;
+        if (
+            opcode == CEE_PREFIX1 ||
+            opcode == CEE_PREFIX2 ||
+            opcode == CEE_PREFIX3 ||
+            opcode == CEE_PREFIX4 ||
+            opcode == CEE_PREFIX5 ||
+            opcode == CEE_PREFIX6 ||
+            opcode == CEE_PREFIX7
+        ) {
+            if (ptr >= il->Length) return false;
+            opcode_value = (opcode_value << 8) | il->Data[ptr++];
+            opcode = g_dotnet_opcode_lookup[opcode_value];
+            if (opcode == CEE_INVALID) return false;
+        }
 
-    MIR_op_t vtable_op;
-    if (from_type != NULL) {
-        TinyDotNet_Reflection_InterfaceImpl interface = type_get_interface_impl(from_type, to_type);
-        CHECK(interface != NULL);
+        opcode_info_t* opcode_info = &g_dotnet_opcodes[opcode];
 
-        MIR_insn_t skip_vtable = MIR_new_label(mir_ctx);
+        int size;
+        switch (opcode_info->operand) {
+            case OPCODE_OPERAND_InlineNone: size = 0; break;
+            case OPCODE_OPERAND_ShortInlineBrTarget:
+            case OPCODE_OPERAND_ShortInlineI:
+            case OPCODE_OPERAND_ShortInlineVar: size = 1; break;
+            case OPCODE_OPERAND_InlineVar: size = 2; break;
+            case OPCODE_OPERAND_InlineI8:
+            case OPCODE_OPERAND_InlineR: size = 8; break;
+            case OPCODE_OPERAND_InlineSwitch: {
+                if (ptr + 4 > il->Length) return false;
+                size = 4 + *(uint32_t*)&il->Data[ptr] * 4;
+            } break;
+            default: size = 4; break;
+        }
+        if (ptr + size > il->Length) return false;
 
-        // start with a null vtalbe
-        MIR_append_insn(mir_ctx, mir_func,
-                        MIR_new_insn(mir_ctx, MIR_MOV,
-                                     MIR_new_reg_op(mir_ctx, vtable_reg),
-                                     MIR_new_int_op(mir_ctx, 0)));
+        switch (opcode_info->operand) {
+            case OPCODE_OPERAND_ShortInlineBrTarget: insn.operand = *(int8_t*)&il->Data[ptr] + ptr + size; break;
+            case OPCODE_OPERAND_InlineBrTarget: insn.operand = *(int32_t*)&il->Data[ptr] + ptr + size; break;
+            case OPCODE_OPERAND_ShortInlineI: insn.operand = *(int8_t*)&il->Data[ptr]; break;
+            case OPCODE_OPERAND_ShortInlineVar: insn.operand = *(uint8_t*)&il->Data[ptr]; break;
+            case OPCODE_OPERAND_InlineVar: insn.operand = *(uint16_t*)&il->Data[ptr]; break;
+            case OPCODE_OPERAND_InlineI: insn.operand = *(int32_t*)&il->Data[ptr]; break;
+            case OPCODE_OPERAND_InlineField:
+            case OPCODE_OPERAND_InlineMethod:
+            case OPCODE_OPERAND_InlineType: insn.operand = *(int32_t*)&il->Data[ptr]; break;
+            case OPCODE_OPERAND_InlineSwitch: {
+                uint32_t count = *(uint32_t*)&il->Data[ptr];
+                int32_t* dests = (int32_t*)&il->Data[ptr + 4];
+                for (uint32_t i = 0; i < count; i++) {
+                    arrpush(*out_branches, ((il_branch_t){ insn.offset, dests[i] + ptr + size }));
+                }
+            } break;
+            default: break;
+        }
 
-        // if the object is null, then skip the vtable and leave it as null
-        MIR_append_insn(mir_ctx, mir_func,
-                        MIR_new_insn(mir_ctx, MIR_BF,
-                                     MIR_new_label_op(mir_ctx, skip_vtable),
-                                     MIR_new_reg_op(mir_ctx, from_reg)));
+        if (
+            opcode_info->operand == OPCODE_OPERAND_ShortInlineBrTarget ||
+            opcode_info->operand == OPCODE_OPERAND_InlineBrTarget
+        ) {
+            arrpush(*out_branches, ((il_branch_t){ insn.offset, insn.operand }));
+        }
 
-        // &object->vtable[vtable_offset]
-        MIR_append_insn(mir_ctx, mir_func,
-                        MIR_new_insn(mir_ctx, MIR_ADD,
-                                     MIR_new_reg_op(mir_ctx, vtable_reg),
-                                     MIR_new_mem_op(mir_ctx, MIR_T_P,
-                                                    offsetof(struct System_Object, vtable),
-                                                    from_reg, 0, 1),
-                                     MIR_new_int_op(mir_ctx, interface->VTableOffset * sizeof(void *))));
+        ptr += size;
 
-        MIR_append_insn(mir_ctx, mir_func, skip_vtable);
+        // normalize the forms we look at
+        switch (opcode) {
+            case CEE_LDLOC_0: case CEE_LDLOC_1: case CEE_LDLOC_2: case CEE_LDLOC_3:
+                insn.operand = opcode - CEE_LDLOC_0;
+            case CEE_LDLOC_S: opcode = CEE_LDLOC; break;
+            case CEE_STLOC_0: case CEE_STLOC_1: case CEE_STLOC_2: case CEE_STLOC_3:
+                insn.operand = opcode - CEE_STLOC_0;
+            case CEE_STLOC_S: opcode = CEE_STLOC; break;
+            case CEE_LDARG_0: case CEE_LDARG_1: case CEE_LDARG_2: case CEE_LDARG_3:
+                insn.operand = opcode - CEE_LDARG_0;
+            case CEE_LDARG_S: opcode = CEE_LDARG; break;
+            case CEE_LDC_I4_M1: case CEE_LDC_I4_0: case CEE_LDC_I4_1: case CEE_LDC_I4_2: case CEE_LDC_I4_3:
+            case CEE_LDC_I4_4: case CEE_LDC_I4_5: case CEE_LDC_I4_6: case CEE_LDC_I4_7: case CEE_LDC_I4_8:
+                insn.operand = (int32_t)opcode - CEE_LDC_I4_0;
+            case CEE_LDC_I4_S: opcode = CEE_LDC_I4; break;
+            case CEE_STARG_S: opcode = CEE_STARG; break;
+            case CEE_LDLOCA_S: opcode = CEE_LDLOCA; break;
+            case CEE_LDARGA_S: opcode = CEE_LDARGA; break;
+            case CEE_BR_S: opcode = CEE_BR; break;
+            case CEE_BLT_S: opcode = CEE_BLT; break;
+            default: break;
+        }
+        insn.opcode = opcode;
 
-        vtable_op = MIR_new_reg_op(mir_ctx, vtable_reg);
-    } else {
-        // cast a known null, just emit it nicely
-        vtable_op = MIR_new_int_op(mir_ctx, 0);
+        arrpush(*out_insns, insn);
     }
 
-    MIR_append_insn(mir_ctx, mir_func,
-                    MIR_new_insn(mir_ctx, MIR_MOV,
-                                 MIR_new_mem_op(mir_ctx, MIR_T_P, 0, result_reg, 0, 1),
-                                 vtable_op));
+    return true;
+}
 
-    // TODO: figure a way to optimize this better, update the object reference
-    //       using a gc_update_ref call, this would be better if we can know from
-    //       the caller if this is needed or not
-    // we are going to store the result in the vtable_reg so we won't override the result
-    // register, as it may still be used by the caller to do stuff
-    MIR_append_insn(mir_ctx, mir_func,
-                    MIR_new_insn(mir_ctx, MIR_ADD,
-                                 MIR_new_reg_op(mir_ctx, vtable_reg),
-                                 MIR_new_reg_op(mir_ctx, result_reg),
-                                 MIR_new_int_op(mir_ctx, sizeof(void*))));
-    MIR_append_insn(mir_ctx, mir_func,
-                    MIR_new_call_insn(mir_ctx, 4,
-                                      MIR_new_ref_op(mir_ctx, m_gc_update_ref_proto),
-                                      MIR_new_ref_op(mir_ctx, m_gc_update_ref_func),
-                                      MIR_new_reg_op(mir_ctx, vtable_reg),
-                                      MIR_new_reg_op(mir_ctx, from_reg)));
+/**
+ * Get the source of an instruction that loads a variable as is, zero if it is anything else
+ */
+static int jit_il_insn_source(il_insn_t* insn) {
+    switch (insn->opcode) {
+        case CEE_LDLOC: return JIT_SOURCE_LOCAL(insn->operand);
+        case CEE_LDARG: return JIT_SOURCE_ARG(insn->operand);
+        default: return 0;
+    }
+}
 
-cleanup:
-    return err;
+/**
+ * Check if an instruction can modify the variable, either by
+ * writing to it or by taking its address
+ */
+static bool jit_il_insn_writes(il_insn_t* insn, int source) {
+    switch (insn->opcode) {
+        case CEE_STLOC:
+        case CEE_LDLOCA: return source == JIT_SOURCE_LOCAL(insn->operand);
+        case CEE_STARG:
+        case CEE_LDARGA: return source == JIT_SOURCE_ARG(insn->operand);
+        default: return false;
+    }
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Generic opcode jitting
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+static int jit_il_find_insn(il_insn_t* insns, int offset) {
+    for (int i = 0; i < arrlen(insns); i++) {
+        if (insns[i].offset == offset) return i;
+        if (insns[i].offset > offset) break;
+    }
+    return -1;
+}
 
 /**
- * Jit both compare and compare-branch operations, will do so based on the passed
- * MIR instruction code.
- *
- * Handles implicit floating point casting as well as int32<->intptr handling
+ * Check if the backwards branch at the given index closes a loop we can
+ * eliminate the range checks of, and add it if so
  */
-static err_t jit_compare_branch(jit_method_context_t* ctx, int il_target, MIR_insn_code_t code) {
-    err_t err = NO_ERROR;
+static void jit_match_range_loop(jit_method_context_t* ctx, System_Reflection_MethodBody body,
+                                 il_insn_t* insns, il_branch_t* branches, int branch) {
+    // the condition, going backwards from the branch
+    int k = branch - 1;
+    if (k >= 0 && insns[k].opcode == CEE_CONV_I4) k--;
+    if (k < 0 || insns[k].opcode != CEE_LDLEN) return;
+    k--;
+    if (k < 0) return;
+    int array_source = jit_il_insn_source(&insns[k]);
+    if (array_source == 0) return;
+    k--;
+    if (k < 0 || insns[k].opcode != CEE_LDLOC) return;
+    int index = insns[k].operand;
+    int index_source = JIT_SOURCE_LOCAL(index);
+    int cond = k;
+
+    // must be an int32, otherwise the increment might not be what we think
+    if (index >= body->LocalVariables->Length) return;
+    if (body->LocalVariables->Data[index]->LocalType != tSystem_Int32) return;
+
+    // the increment right before the condition
+    if (cond < 4) return;
+    if (insns[cond - 4].opcode != CEE_LDLOC || insns[cond - 4].operand != index) return;
+    if (insns[cond - 3].opcode != CEE_LDC_I4 || insns[cond - 3].operand != 1) return;
+    if (insns[cond - 2].opcode != CEE_ADD) return;
+    if (insns[cond - 1].opcode != CEE_STLOC || insns[cond - 1].operand != index) return;
+
+    // the initialization and the jump to the condition right before the body
+    int start = jit_il_find_insn(insns, insns[branch].operand);
+    if (start < 3 || start >= cond - 4) return;
+    if (insns[start - 1].opcode != CEE_BR || insns[start - 1].operand != insns[cond].offset) return;
+    if (insns[start - 2].opcode != CEE_STLOC || insns[start - 2].operand != index) return;
+    if (insns[start - 3].opcode != CEE_LDC_I4 || insns[start - 3].operand < 0) return;
+
+    // nothing in the loop changes the array, nothing anywhere other than the
+    // initialization and the increment changes the index, and nothing anywhere
+    // takes the address of either
+    for (int i = 0; i < arrlen(insns); i++) {
+        if (i == cond - 1 || i == start - 2) continue;
+
+        bool in_loop = i >= start && i <= branch;
+        if (jit_il_insn_writes(&insns[i], array_source)) {
+            if (in_loop || (insns[i].opcode != CEE_STLOC && insns[i].opcode != CEE_STARG)) return;
+        }
+        if (jit_il_insn_writes(&insns[i], index_source)) return;
+    }
 
-    MIR_reg_t value2_reg;
-    MIR_reg_t value1_reg;
-    System_Type value2_type;
-    System_Type value1_type;
-    CHECK_AND_RETHROW(stack_pop(ctx, &value2_type, &value2_reg, NULL));
-    CHECK_AND_RETHROW(stack_pop(ctx, &value1_type, &value1_reg, NULL));
+    // the only way into the loop from the outside is the jump to the condition
+    // that follows the initialization, and nothing skips the initialization
+    int loop_start = insns[start].offset;
+    int loop_end = insns[branch].offset;
+    for (int i = 0; i < arrlen(branches); i++) {
+        if (branches[i].from == insns[start - 1].offset) continue;
+
+        bool from_loop = branches[i].from >= loop_start && branches[i].from <= loop_end;
+        bool to_loop = branches[i].to >= loop_start && branches[i].to <= loop_end;
+        if (to_loop && !from_loop) return;
+        if (branches[i].to == insns[start - 2].offset || branches[i].to == insns[start - 1].offset) return;
+    }
 
-    MIR_reg_t result_reg = 0;
-    MIR_label_t label = NULL;
-    if (MIR_branch_code_p(code)) {
-        CHECK(il_target >= 0);
-        CHECK_AND_RETHROW(jit_branch_point(ctx, il_target, &label));
-    } else {
-        CHECK_AND_RETHROW(stack_push(ctx, tSystem_Int32, &result_reg));
+    // keep it simple with exception handling around
+    for (int i = 0; i < body->ExceptionHandlingClauses->Length; i++) {
+        System_Reflection_ExceptionHandlingClause clause = body->ExceptionHandlingClauses->Data[i];
+        if (clause->TryOffset <= loop_end && clause->TryOffset + clause->TryLength > loop_start) return;
+        if (clause->HandlerOffset <= loop_end && clause->HandlerOffset + clause->HandlerLength > loop_start) return;
     }
 
-    switch (type_get_stack_type(value1_type)) {
-        case STACK_TYPE_INT32: {
-            if (type_get_stack_type(value2_type) == STACK_TYPE_INT32) {
-                code += 1;
-            } else {
-                CHECK(type_get_stack_type(value2_type) == STACK_TYPE_INTPTR);
+    arrpush(ctx->range_loops, ((jit_range_loop_t){
+        .start = loop_start,
+        .end = insns[cond - 4].offset,
+        .index_source = index_source,
+        .array_source = array_source,
+    }));
+}
 
-                // sign extend to intptr
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_UEXT32,
-                                             MIR_new_reg_op(mir_ctx, value1_reg),
-                                             MIR_new_reg_op(mir_ctx, value1_reg)));
-            }
-        } break;
+// forward decl
+static void jit_find_frame_objects(jit_method_context_t* ctx, il_insn_t* insns);
+static void jit_find_delegate_locals(jit_method_context_t* ctx, il_insn_t* insns);
+static void jit_find_box_uses(jit_method_context_t* ctx, il_insn_t* insns);
 
-        case STACK_TYPE_INT64: {
-            CHECK(type_get_stack_type(value2_type) == STACK_TYPE_INT64);
-        } break;
+/**
+ * Analyze the il before translating it, finds all the branch targets, the variables
+ * whose address is taken, the loops we can eliminate range checks in, the objects
+ * that can be allocated in the frame, the locals holding known delegates and the
+ * boxes that don't need an object
+ */
+static void jit_analyze_il(jit_method_context_t* ctx, System_Reflection_MethodBody body) {
+    il_insn_t* insns = NULL;
+    il_branch_t* branches = NULL;
 
-        case STACK_TYPE_INTPTR: {
-            if (type_get_stack_type(value2_type) == STACK_TYPE_INT32) {
-                // sign extend to intptr
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_UEXT32,
-                                             MIR_new_reg_op(mir_ctx, value2_reg),
-                                             MIR_new_reg_op(mir_ctx, value2_reg)));
-            } else {
-                CHECK(type_get_stack_type(value2_type) == STACK_TYPE_INTPTR);
-            }
-        } break;
-
-        case STACK_TYPE_FLOAT: {
-            CHECK(value2_type == tSystem_Double || value2_type == tSystem_Single);
-
-            if (value1_type == tSystem_Single) {
-                if (value2_type == tSystem_Single) {
-                    // need to do float math
-                    code += 2;
-                } else if (value2_type == tSystem_Double) {
-                    // need to do double math
-                    code += 3;
-
-                    // implicit conversion float->double
-                    MIR_reg_t value1_double_reg = new_temp_reg(ctx, tSystem_Double);
-                    MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_insn(mir_ctx, MIR_F2D,
-                                                 MIR_new_reg_op(mir_ctx, value1_double_reg),
-                                                 MIR_new_reg_op(mir_ctx, value1_reg)));
-                    value1_reg = value1_double_reg;
-                }
-            } else if (value1_type == tSystem_Double) {
-                // always double math
-                code += 3;
-
-                if (value2_type == tSystem_Single) {
-                    // implicit conversion float->double
-                    MIR_reg_t value2_double_reg = new_temp_reg(ctx, tSystem_Double);
-                    MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_insn(mir_ctx, MIR_F2D,
-                                                 MIR_new_reg_op(mir_ctx, value2_double_reg),
-                                                 MIR_new_reg_op(mir_ctx, value2_reg)));
-                    value2_reg = value2_double_reg;
-                }
-            }
-        } break;
+    if (!jit_decode_il(body, &insns, &branches)) {
+        goto cleanup;
+    }
+    ctx->il_analyzed = true;
+
+    bool this_written = false;
+    for (int i = 0; i < arrlen(insns); i++) {
+        switch (insns[i].opcode) {
+            case CEE_LDLOCA: arrpush(ctx->address_taken, JIT_SOURCE_LOCAL(insns[i].operand)); break;
+            case CEE_LDARGA: arrpush(ctx->address_taken, JIT_SOURCE_ARG(insns[i].operand)); break;
+            default: break;
+        }
+        if (jit_il_insn_writes(&insns[i], JIT_SOURCE_ARG(0))) {
+            this_written = true;
+        }
+    }
 
-        case STACK_TYPE_O: {
-            CHECK(type_get_stack_type(value2_type) == STACK_TYPE_O);
+    // the callers make sure the this is not null, for value types it is a reference
+    // which are not checked anyways
+    ctx->this_non_null = !method_is_static(ctx->method) && !this_written;
 
-            CHECK(
-                code == MIR_EQ ||
-                code == MIR_BEQ ||
-                code == MIR_BNE
-            );
+    for (int i = 0; i < arrlen(branches); i++) {
+        hmput(ctx->branch_targets, branches[i].to, true);
+    }
+    for (int i = 0; i < body->ExceptionHandlingClauses->Length; i++) {
+        System_Reflection_ExceptionHandlingClause clause = body->ExceptionHandlingClauses->Data[i];
+        hmput(ctx->branch_targets, clause->HandlerOffset, true);
+    }
 
-            // for interfaces convert them to the object pointer
-            if (type_is_interface(value1_type)) {
-                MIR_reg_t value1_ptr_reg = new_temp_reg(ctx, tSystem_Object);
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                             MIR_new_reg_op(mir_ctx, value1_ptr_reg),
-                                             MIR_new_mem_op(mir_ctx, MIR_T_P, 8, value1_reg, 0, 1)));
-                value1_reg = value1_ptr_reg;
-            }
+    for (int i = 0; i < arrlen(insns); i++) {
+        if (insns[i].opcode == CEE_BLT && insns[i].operand < insns[i].offset) {
+            jit_match_range_loop(ctx, body, insns, branches, i);
+        }
+    }
 
-            if (type_is_interface(value2_type)) {
-                MIR_reg_t value2_ptr_reg = new_temp_reg(ctx, tSystem_Object);
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                             MIR_new_reg_op(mir_ctx, value2_ptr_reg),
-                                             MIR_new_mem_op(mir_ctx, MIR_T_P, 8, value2_reg, 0, 1)));
-                value2_reg = value2_ptr_reg;
-            }
-        } break;
+    jit_find_frame_objects(ctx, insns);
+    jit_find_delegate_locals(ctx, insns);
+    jit_find_box_uses(ctx, insns);
 
-        case STACK_TYPE_REF: {
-            CHECK(type_get_stack_type(value2_type) == STACK_TYPE_REF);
-        } break;
+cleanup:
+    arrfree(insns);
+    arrfree(branches);
+}
 
-        // invalid comparisons
-        case STACK_TYPE_VALUE_TYPE:
-            CHECK_FAIL();
+/**
+ * Check if indexing the array with the index is known to be in range, so the range
+ * check can be skipped
+ */
+static bool jit_index_in_range(jit_method_context_t* ctx, stack_entry_t* array, stack_entry_t* index) {
+    if (array->source == 0 || index->source == 0) {
+        return false;
     }
 
-    // emit common code
-    if (MIR_branch_code_p(code)) {
-        MIR_append_insn(mir_ctx, mir_func,
-                        MIR_new_insn(mir_ctx, code,
-                                     MIR_new_label_op(mir_ctx, label),
-                                     MIR_new_reg_op(mir_ctx, value1_reg),
-                                     MIR_new_reg_op(mir_ctx, value2_reg)));
-    } else {
-        MIR_append_insn(mir_ctx, mir_func,
-                        MIR_new_insn(mir_ctx, code,
-                                     MIR_new_reg_op(mir_ctx, result_reg),
-                                     MIR_new_reg_op(mir_ctx, value1_reg),
-                                     MIR_new_reg_op(mir_ctx, value2_reg)));
+    for (int i = 0; i < arrlen(ctx->range_loops); i++) {
+        jit_range_loop_t* loop = &ctx->range_loops[i];
+        if (
+            ctx->il_offset >= loop->start && ctx->il_offset < loop->end &&
+            loop->array_source == array->source &&
+            loop->index_source == index->source
+        ) {
+            return true;
+        }
     }
 
-cleanup:
-    return err;
+    return false;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// No-throw analysis
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//
+// A method which can't throw always returns a null exception, so a direct call to it doesn't
+// need the exception test after it. A method can't throw if its il only uses opcodes that never
+// throw, only accesses fields through this or the address of a local, and only calls methods
+// that can't throw either. Inside the method this is assumed to be non-null, so a call site only
+// relies on the result when the this was null checked by the caller, or there is no this at all.
+//
+
+// how deep to follow calls before giving up
+#define JIT_NO_THROW_DEPTH 4
+
 /**
- * Emit a binary operation, taking care of all the implicit casting that is needed to be done, and
- * checking for specific edge cases on others.
- *
- * This also emits a divide by zero check if needed.
- *
- * If the operation is only allowed for integers then make sure to mark it as such
+ * Cache of the methods we already looked at, protected by the jit mutex
  */
-static err_t jit_binary_numeric_operation(jit_method_context_t* ctx, MIR_insn_code_t code, bool integer_only) {
-    err_t err = NO_ERROR;
+static struct {
+    System_Reflection_MethodInfo key;
+    bool value;
+}* m_jit_no_throw = NULL;
 
-    MIR_reg_t value2_reg;
-    MIR_reg_t value1_reg;
-    MIR_reg_t result_reg;
-    System_Type value2_type;
-    System_Type value1_type;
-    CHECK_AND_RETHROW(stack_pop(ctx, &value2_type, &value2_reg, NULL));
-    CHECK_AND_RETHROW(stack_pop(ctx, &value1_type, &value1_reg, NULL));
+// forward decl
+static bool jit_method_cannot_throw(System_Reflection_MethodInfo method, int depth);
 
-    stack_type_t value1_stacktype = type_get_stack_type(value1_type);
-    stack_type_t value2_stacktype = type_get_stack_type(value2_type);
+/**
+ * Check if the value pushed by the given instruction can be used as the object of a field
+ * access without a null check
+ */
+static bool jit_il_is_non_null_object(il_insn_t* insn, bool this_valid) {
+    switch (insn->opcode) {
+        case CEE_LDARG: return this_valid && insn->operand == 0;
+        case CEE_LDLOCA:
+        case CEE_LDARGA: return true;
+        default: return false;
+    }
+}
 
-    if (code == MIR_LSH || code == MIR_RSH || code == MIR_URSH) {
-        // check the types are valid
-        CHECK(value1_stacktype == STACK_TYPE_INT32 || value1_stacktype == STACK_TYPE_INT64 || value1_stacktype == STACK_TYPE_INTPTR);
-        CHECK(value2_stacktype == STACK_TYPE_INT32 || value2_stacktype == STACK_TYPE_INTPTR);
+/**
+ * Check if the instruction just pushes a value without any side effects
+ */
+static bool jit_il_is_simple_load(il_insn_t* insn) {
+    switch (insn->opcode) {
+        case CEE_LDARG:
+        case CEE_LDLOC:
+        case CEE_LDC_I4:
+        case CEE_LDC_I8:
+        case CEE_LDC_R4:
+        case CEE_LDC_R8:
+        case CEE_LDNULL: return true;
+        default: return false;
+    }
+}
 
-        // we are doing a 32bit operation
-        if (value1_stacktype == STACK_TYPE_INT32) {
-            code += 1;
-        }
+/**
+ * Can the call target be called without a null check on its this
+ */
+static bool jit_call_has_valid_this(System_Reflection_MethodInfo callee) {
+    return method_is_static(callee) || callee->DeclaringType->IsValueType;
+}
 
-        // push the result
-        CHECK_AND_RETHROW(stack_push(ctx, value1_type, &result_reg));
-    } else {
-        if (code == MIR_DIV || code == MIR_UDIV || code == MIR_MOD || code == MIR_UMOD) {
-            MIR_insn_t label = MIR_new_label(mir_ctx);
+static bool jit_il_cannot_throw(System_Reflection_MethodInfo method, int depth) {
+    if (IS_ERROR(loader_fill_method_body(method))) {
+        return false;
+    }
 
-            // these need to check that value2 is not zero
-            // if we have a non-zero value then skip the throw
-            MIR_append_insn(mir_ctx, mir_func,
-                            MIR_new_insn(mir_ctx, MIR_BT,
-                                         MIR_new_label_op(mir_ctx, label),
-                                         MIR_new_reg_op(mir_ctx, value2_reg)));
+    System_Reflection_MethodBody body = method->MethodBody;
+    if (body == NULL || body->Il == NULL) {
+        return false;
+    }
 
-            // throw the error, it has an unknown type
-            CHECK_AND_RETHROW(jit_throw_new(ctx, tSystem_DivideByZeroException));
+    if (body->ExceptionHandlingClauses != NULL && body->ExceptionHandlingClauses->Length != 0) {
+        return false;
+    }
 
-            // insert the skip label
-            MIR_append_insn(mir_ctx, mir_func, label);
+    bool result = false;
+    il_insn_t* insns = NULL;
+    il_branch_t* branches = NULL;
+    if (!jit_decode_il(body, &insns, &branches)) {
+        goto cleanup;
+    }
+
+    // this can only be trusted if it is never overwritten
+    bool this_valid = !method_is_static(method);
+    for (int i = 0; i < arrlen(insns) && this_valid; i++) {
+        if (jit_il_insn_writes(&insns[i], JIT_SOURCE_ARG(0))) {
+            this_valid = false;
         }
+    }
 
-        switch (type_get_stack_type(value1_type)) {
-            case STACK_TYPE_INT32: {
-                if (type_get_stack_type(value2_type) == STACK_TYPE_INT32) {
-                    // int32 x int32
-                    CHECK_AND_RETHROW(stack_push(ctx, tSystem_Int32, &result_reg));
-                    code += 1;
-                } else {
-                    // int32 x intptr
-                    CHECK(type_get_stack_type(value2_type) == STACK_TYPE_INTPTR);
-                    CHECK_AND_RETHROW(stack_push(ctx, tSystem_IntPtr, &result_reg));
+    for (int i = 0; i < arrlen(insns); i++) {
+        il_insn_t* insn = &insns[i];
+        switch (insn->opcode) {
+            // loads and stores of variables and constants
+            case CEE_NOP:
+            case CEE_LDARG:
+            case CEE_LDARGA:
+            case CEE_STARG:
+            case CEE_LDLOC:
+            case CEE_LDLOCA:
+            case CEE_STLOC:
+            case CEE_LDC_I4:
+            case CEE_LDC_I8:
+            case CEE_LDC_R4:
+            case CEE_LDC_R8:
+            case CEE_LDNULL:
+            case CEE_DUP:
+            case CEE_POP:
+
+            // arithmetic without division or overflow checks
+            case CEE_ADD:
+            case CEE_SUB:
+            case CEE_MUL:
+            case CEE_AND:
+            case CEE_OR:
+            case CEE_XOR:
+            case CEE_SHL:
+            case CEE_SHR:
+            case CEE_SHR_UN:
+            case CEE_NEG:
+            case CEE_NOT:
+            case CEE_CEQ:
+            case CEE_CGT:
+            case CEE_CGT_UN:
+            case CEE_CLT:
+            case CEE_CLT_UN:
+            case CEE_CONV_I1:
+            case CEE_CONV_I2:
+            case CEE_CONV_I4:
+            case CEE_CONV_I8:
+            case CEE_CONV_U1:
+            case CEE_CONV_U2:
+            case CEE_CONV_U4:
+            case CEE_CONV_U8:
+            case CEE_CONV_I:
+            case CEE_CONV_U:
+            case CEE_CONV_R4:
+            case CEE_CONV_R8:
+            case CEE_CONV_R_UN:
 
-                    // sign extend the int32 to intptr
-                    MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_insn(mir_ctx, MIR_UEXT32,
-                                                 MIR_new_reg_op(mir_ctx, value1_reg),
-                                                 MIR_new_reg_op(mir_ctx, value1_reg)));
+            // control flow
+            case CEE_BR:
+            case CEE_BRTRUE:
+            case CEE_BRTRUE_S:
+            case CEE_BRFALSE:
+            case CEE_BRFALSE_S:
+            case CEE_BEQ:
+            case CEE_BEQ_S:
+            case CEE_BGE:
+            case CEE_BGE_S:
+            case CEE_BGE_UN:
+            case CEE_BGE_UN_S:
+            case CEE_BGT:
+            case CEE_BGT_S:
+            case CEE_BGT_UN:
+            case CEE_BGT_UN_S:
+            case CEE_BLE:
+            case CEE_BLE_S:
+            case CEE_BLE_UN:
+            case CEE_BLE_UN_S:
+            case CEE_BLT:
+            case CEE_BLT_UN:
+            case CEE_BLT_UN_S:
+            case CEE_BNE_UN:
+            case CEE_BNE_UN_S:
+            case CEE_RET:
+                break;
+
+            case CEE_LDFLD:
+            case CEE_LDFLDA: {
+                if (i < 1 || !jit_il_is_non_null_object(&insns[i - 1], this_valid)) {
+                    goto cleanup;
                 }
             } break;
 
-            case STACK_TYPE_INT64: {
-                // int64 x int64
-                CHECK(type_get_stack_type(value2_type) == STACK_TYPE_INT64);
-                CHECK_AND_RETHROW(stack_push(ctx, tSystem_Int64, &result_reg));
+            case CEE_STFLD: {
+                if (
+                    i < 2 ||
+                    !jit_il_is_simple_load(&insns[i - 1]) ||
+                    !jit_il_is_non_null_object(&insns[i - 2], this_valid)
+                ) {
+                    goto cleanup;
+                }
             } break;
 
-            case STACK_TYPE_INTPTR: {
-                CHECK_AND_RETHROW(stack_push(ctx, tSystem_IntPtr, &result_reg));
+            // statics can only throw from their cctor
+            case CEE_LDSFLD:
+            case CEE_LDSFLDA:
+            case CEE_STSFLD: {
+                System_Reflection_FieldInfo field = NULL;
+                token_t token = *(token_t*)&insn->operand;
+                if (IS_ERROR(assembly_get_field_by_token(method->Module->Assembly, token,
+                                                         method->DeclaringType->GenericArguments,
+                                                         method->GenericArguments, &field))) {
+                    goto cleanup;
+                }
 
-                if (type_get_stack_type(value2_type) == STACK_TYPE_INT32) {
-                    // intptr x int32
-                    // sign extend
-                    MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_insn(mir_ctx, MIR_UEXT32,
-                                                 MIR_new_reg_op(mir_ctx, value2_reg),
-                                                 MIR_new_reg_op(mir_ctx, value2_reg)));
-                } else {
-                    // intptr x intptr
-                    CHECK(type_get_stack_type(value2_type) == STACK_TYPE_INTPTR);
+                if (field == NULL || jit_needs_cctor_guard(method, field->DeclaringType, false)) {
+                    goto cleanup;
                 }
             } break;
 
-            case STACK_TYPE_FLOAT: {
-                // make sure this is not an integer only operation
-                CHECK(!integer_only);
+            case CEE_CALL: {
+                System_Reflection_MethodInfo callee = NULL;
+                token_t token = *(token_t*)&insn->operand;
+                if (IS_ERROR(assembly_get_method_by_token(method->Module->Assembly, token,
+                                                          method->DeclaringType->GenericArguments,
+                                                          method->GenericArguments, &callee))) {
+                    goto cleanup;
+                }
 
-                if (value1_type == tSystem_Single) {
-                    if (value2_type == tSystem_Single) {
-                        // float x float -> float
-                        CHECK_AND_RETHROW(stack_push(ctx, tSystem_Single, &result_reg));
-                        code += 2;
-                    } else {
-                        CHECK(value2_type == tSystem_Double);
-
-                        // float x double
-                        // convert the float to a double
-                        CHECK_AND_RETHROW(stack_push(ctx, tSystem_Double, &result_reg));
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_F2D,
-                                                     MIR_new_reg_op(mir_ctx, result_reg),
-                                                     MIR_new_reg_op(mir_ctx, value1_reg)));
-                        value1_reg = result_reg;
-                        code += 3;
-                    }
-                } else {
-                    CHECK(value1_type == tSystem_Double);
-
-                    // this always results in a double math
-                    CHECK_AND_RETHROW(stack_push(ctx, tSystem_Double, &result_reg));
-                    code += 3;
-
-                    if (value2_type == tSystem_Single) {
-                        // double x float
-                        // convert the float to a double
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_F2D,
-                                                     MIR_new_reg_op(mir_ctx, result_reg),
-                                                     MIR_new_reg_op(mir_ctx, value2_reg)));
-                        value2_reg = result_reg;
-                    } else {
-                        CHECK(value2_type == tSystem_Double);
-                    }
+                if (
+                    callee == NULL ||
+                    !jit_call_has_valid_this(callee) ||
+                    (method_is_static(callee) && jit_needs_cctor_guard(method, callee->DeclaringType, true)) ||
+                    !jit_method_cannot_throw(callee, depth + 1)
+                ) {
+                    goto cleanup;
                 }
             } break;
 
-                // not allowed to do math on these
-            case STACK_TYPE_VALUE_TYPE:
-            case STACK_TYPE_O:
-            case STACK_TYPE_REF:
-                CHECK_FAIL();
+            default:
+                goto cleanup;
         }
     }
 
-    MIR_append_insn(mir_ctx, mir_func,
-                    MIR_new_insn(mir_ctx, code,
-                                 MIR_new_reg_op(mir_ctx, result_reg),
-                                 MIR_new_reg_op(mir_ctx, value1_reg),
-                                 MIR_new_reg_op(mir_ctx, value2_reg)));
+    result = true;
 
 cleanup:
-    return err;
+    arrfree(insns);
+    arrfree(branches);
+    return result;
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Main jitter code
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
 /**
- * This is the main jitting function, it takes a method and jits it completely
+ * Check if the method is known to never throw, false means it might
  */
-err_t jit_method(jit_context_t* jctx, System_Reflection_MethodInfo method) {
-    err_t err = NO_ERROR;
-
-    // setup the context for this method
-    jit_method_context_t _ctx = {
-        .ctx = jctx,
-        .method = method
-    };
-    jit_method_context_t* ctx = &_ctx;
+static bool jit_method_cannot_throw(System_Reflection_MethodInfo method, int depth) {
+    int index = hmgeti(m_jit_no_throw, method);
+    if (index != -1) {
+        return m_jit_no_throw[index].value;
+    }
 
-    System_Reflection_MethodBody body = method->MethodBody;
-    System_Reflection_Assembly assembly = method->Module->Assembly;
+    // too deep, don't cache it since it might be fine from a different path
+    if (depth > JIT_NO_THROW_DEPTH) {
+        return false;
+    }
 
-    strbuilder_t method_name = strbuilder_new();
-    method_print_full_name(method, &method_name);
+    // recursion ends here as a might throw
+    hmput(m_jit_no_throw, method, false);
 
-#ifdef JIT_TRACE
-    strbuilder_t ret_type_name = strbuilder_new();
-    type_print_full_name(method->ReturnType, &ret_type_name);
+    bool result = jit_il_cannot_throw(method, depth);
+    hmput(m_jit_no_throw, method, result);
+    return result;
+}
 
-    TRACE(".method %s %s %s %s",
-          method_access_str(method_get_access(method)),
-          method_is_static(method) ? "static" : "instance",
-          strbuilder_get(&ret_type_name),
-          strbuilder_get(&method_name));
-    strbuilder_free(&ret_type_name);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Frame allocation
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-    TRACE("{");
-    TRACE("\t.maxstack %d", body->MaxStackSize);
-#endif
+//
+// An object created with newobj that is stored straight into a local, and whose local is only
+// ever used to read or write its fields, can't be seen by anyone else once the method returns,
+// so it is allocated in the frame instead of the heap:
+//
+//          newobj T::.ctor
+//          stloc N
+//          ...
+//          ldloc N
+//          ldfld T::f
+//          ...
+//          ldloc N
+//          ldc.i4 1
+//          stfld T::f
+//
+// The ctor must not let the this out either. Only types without any references are allowed,
+// the stack is scanned conservatively so the gc would find references by itself, but stores
+// to the fields would go through the write barrier which only works with heap objects.
+//
 
-    // variables
-    MIR_op_t* locals = NULL;
+// the largest object we are going to put in the frame
+#define JIT_FRAME_OBJECT_MAX_SIZE   256
 
-    // jump table dynamic array
-    MIR_op_t *switch_ops = NULL;
+// how deep to follow base ctors
+#define JIT_FRAME_CTOR_DEPTH        4
 
-    // Create the exception handling reg
-    ctx->exception_reg = MIR_new_func_reg(mir_ctx, mir_func->u.func, MIR_T_I64, "exception");
+/**
+ * Check that the ctor only uses the this to access fields and call a base
+ * ctor that does the same
+ */
+static bool jit_ctor_keeps_this(System_Reflection_MethodInfo ctor, int depth) {
+    if (IS_ERROR(loader_fill_method_body(ctor))) {
+        return false;
+    }
 
-    // get the return block register, if any
-    MIR_reg_t return_block_reg = 0;
-    if (method->ReturnType != NULL && get_mir_type(method->ReturnType) == MIR_T_BLK) {
-        return_block_reg = MIR_reg(mir_ctx, "return_block", mir_func->u.func);
+    System_Reflection_MethodBody body = ctor->MethodBody;
+    if (depth > JIT_FRAME_CTOR_DEPTH || body == NULL || body->Il == NULL) {
+        return false;
     }
 
-#ifdef JIT_TRACE
-    if (body->LocalVariables->Length > 0) {
-        TRACE("\t.locals %s(", body->InitLocals ? "init " : "");
+    bool result = false;
+    il_insn_t* insns = NULL;
+    il_branch_t* branches = NULL;
+    if (!jit_decode_il(body, &insns, &branches)) {
+        goto cleanup;
     }
-#endif
 
-    // actually create locals
-    for (int i = 0; i < body->LocalVariables->Length; i++) {
-        System_Reflection_LocalVariableInfo variable = body->LocalVariables->Data[i];
-        CHECK(variable->LocalIndex == i);
+    for (int i = 0; i < arrlen(insns); i++) {
+        il_insn_t* insn = &insns[i];
+        if (insn->opcode == CEE_STARG || insn->opcode == CEE_LDARGA) {
+            if (insn->operand == 0) goto cleanup;
+            continue;
+        }
 
-#ifdef JIT_TRACE
-        strbuilder_t local_type_name = strbuilder_new();
-        type_print_full_name(variable->LocalType, &local_type_name);
-        TRACE("\t\t[%d] %s%s", i, strbuilder_get(&local_type_name), i == body->LocalVariables->Length - 1 ? "" : ",");
-        strbuilder_free(&local_type_name);
-#endif
+        if (insn->opcode != CEE_LDARG || insn->operand != 0) {
+            continue;
+        }
 
-        // prepare the variable type
-        CHECK_AND_RETHROW(jit_prepare_type(ctx->ctx, variable->LocalType));
+        // ldarg.0; ldfld
+        if (i + 1 < arrlen(insns) && insns[i + 1].opcode == CEE_LDFLD) {
+            continue;
+        }
 
-        // we are going to initialize all of the variables
-        char name[64] = { 0 };
-        snprintf(name, sizeof(name), "var%d", i);
-        MIR_reg_t reg = MIR_new_func_reg(mir_ctx, mir_func->u.func, MIR_T_I64, name);
-        arrpush(locals, MIR_new_reg_op(mir_ctx, reg));
+        // ldarg.0; <load>; stfld
+        if (
+            i + 2 < arrlen(insns) &&
+            jit_il_is_simple_load(&insns[i + 1]) &&
+            !(insns[i + 1].opcode == CEE_LDARG && insns[i + 1].operand == 0) &&
+            insns[i + 2].opcode == CEE_STFLD
+        ) {
+            continue;
+        }
 
-        // allocate the stack memory
-        MIR_append_insn(mir_ctx, mir_func,
-                        MIR_new_insn(mir_ctx, MIR_ALLOCA,
-                                     MIR_new_reg_op(mir_ctx, reg),
-                                     MIR_new_int_op(mir_ctx, variable->LocalType->StackSize)));
+        // ldarg.0; call base::.ctor()
+        if (i + 1 < arrlen(insns) && insns[i + 1].opcode == CEE_CALL) {
+            System_Reflection_MethodInfo callee = NULL;
+            token_t token = *(token_t*)&insns[i + 1].operand;
+            if (IS_ERROR(assembly_get_method_by_token(ctor->Module->Assembly, token,
+                                                      ctor->DeclaringType->GenericArguments,
+                                                      ctor->GenericArguments, &callee))) {
+                goto cleanup;
+            }
 
-        switch (variable->LocalType->StackType) {
-            case STACK_TYPE_O:
-            case STACK_TYPE_INT32:
-            case STACK_TYPE_INT64:
-            case STACK_TYPE_REF:
-            case STACK_TYPE_INTPTR: {
-                // interface is a fat pointer, so treat it like a value type
-                if (type_is_interface(variable->LocalType)) {
-                    goto init_local_value_type;
-                }
-                locals[i] = MIR_new_mem_op(mir_ctx, get_mir_type(variable->LocalType), 0, reg, 0, 1);
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                             locals[i],
-                                             MIR_new_int_op(mir_ctx, 0)));
-            } break;
+            if (
+                callee != NULL &&
+                callee->DeclaringType == ctor->DeclaringType->BaseType &&
+                callee->Parameters->Length == 0 &&
+                string_equals_cstr(callee->Name, ".ctor") &&
+                jit_ctor_keeps_this(callee, depth + 1)
+            ) {
+                continue;
+            }
+        }
 
-            case STACK_TYPE_FLOAT: {
-                locals[i] = MIR_new_mem_op(mir_ctx, get_mir_type(variable->LocalType), 0, reg, 0, 1);
-                if (variable->LocalType == tSystem_Single) {
-                    MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_insn(mir_ctx, MIR_FMOV,
-                                                 locals[i],
-                                                 MIR_new_float_op(mir_ctx, 0.0f)));
-                } else {
-                    ASSERT(variable->LocalType == tSystem_Double);
-                    MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_insn(mir_ctx, MIR_DMOV,
-                                                 locals[i],
-                                                 MIR_new_double_op(mir_ctx, 0.0)));
-                }
-            } break;
+        // anything else lets the this out
+        goto cleanup;
+    }
 
-            init_local_value_type:
-            case STACK_TYPE_VALUE_TYPE: {
-                jit_emit_zerofill(ctx, reg, variable->LocalType->StackSize);
-            } break;
-        }
+    result = true;
+
+cleanup:
+    arrfree(insns);
+    arrfree(branches);
+    return result;
+}
+
+/**
+ * Check if the newobj at the given index creates an object that can live in the frame
+ */
+static bool jit_newobj_can_use_frame(jit_method_context_t* ctx, il_insn_t* insns, int index) {
+    if (index + 1 >= arrlen(insns) || insns[index + 1].opcode != CEE_STLOC) {
+        return false;
     }
+    int local = insns[index + 1].operand;
 
-#ifdef JIT_TRACE
-    if (body->LocalVariables->Length > 0) {
-        TRACE("\t)");
+    System_Reflection_MethodInfo ctor = NULL;
+    token_t token = *(token_t*)&insns[index].operand;
+    if (IS_ERROR(assembly_get_method_by_token(ctx->method->Module->Assembly, token,
+                                              ctx->method->DeclaringType->GenericArguments,
+                                              ctx->method->GenericArguments, &ctor))) {
+        return false;
+    }
+    if (ctor == NULL) {
+        return false;
     }
-#endif
 
-    // TODO: we need to validate that all branch targets and that all the
-    //       try and handler offsets are actually in valid instructions and
-    //       not in the middle of instructions
+    // a plain object without references and without a finalizer
+    System_Type type = ctor->DeclaringType;
+    if (
+        !type->IsFilled ||
+        type->IsValueType ||
+        type->IsArray ||
+        type == tSystem_String ||
+        type->DelegateSignature != NULL ||
+        type->Finalize != NULL ||
+        arrlen(type->ManagedPointersOffsets) != 0 ||
+        type->ManagedSize > JIT_FRAME_OBJECT_MAX_SIZE
+    ) {
+        return false;
+    }
 
-    // prepare the stacks at certain points for exception handling
-    bool created_first_entry = false;
-    for (int i = 0; i < body->ExceptionHandlingClauses->Length; i++) {
-        System_Reflection_ExceptionHandlingClause clause = body->ExceptionHandlingClauses->Data[i];
+    // the local is only stored to here and never has its address taken
+    if (jit_is_address_taken(ctx, JIT_SOURCE_LOCAL(local))) {
+        return false;
+    }
 
-        // create the stack location
-        MIR_label_t label = MIR_new_label(mir_ctx);
-        stack_snapshot_t snapshot = {
-            .key = clause->HandlerOffset,
-            .label = label,
-            .stack = { .entries = NULL },
-            .ireg_depth = 0,
-            .freg_depth = 0,
-            .dreg_depth = 0,
-        };
+    for (int i = 0; i < arrlen(insns); i++) {
+        il_insn_t* insn = &insns[i];
+        if (insn->opcode == CEE_STLOC && insn->operand == local && i != index + 1) {
+            return false;
+        }
 
-        if (clause->Flags == COR_ILEXCEPTION_CLAUSE_EXCEPTION) {
-            CHECK_AND_RETHROW(jit_prepare_type(ctx->ctx, clause->CatchType));
+        if (insn->opcode != CEE_LDLOC || insn->operand != local) {
+            continue;
+        }
 
-            // this is an exception caluse, we need to have the exception pushed on the stack
-            // prepare it
-            arrpush(snapshot.stack.entries, (stack_entry_t) { .type = clause->CatchType });
-            snapshot.ireg_depth++;
-            if (!created_first_entry) {
-                // create the first stack entry just in case, we are going to create a reg
-                // and pop it right away since we don't actually want to have it pushed
-                // right now, we just wanna make sure that the stack location exists
-                push_new_reg(ctx, tSystem_Object, false);
-                ctx->ireg.depth--;
-                created_first_entry = true;
-            }
+        // ldloc N; ldfld
+        if (i + 1 < arrlen(insns) && insns[i + 1].opcode == CEE_LDFLD) {
+            continue;
         }
 
-        // now put it in
-        hmputs(ctx->pc_to_stack_snapshot, snapshot);
+        // ldloc N; <load>; stfld
+        if (
+            i + 2 < arrlen(insns) &&
+            jit_il_is_simple_load(&insns[i + 1]) &&
+            !(insns[i + 1].opcode == CEE_LDLOC && insns[i + 1].operand == local) &&
+            insns[i + 2].opcode == CEE_STFLD
+        ) {
+            continue;
+        }
 
-        // add to label lookup
-        hmput(ctx->clause_to_label, clause, label);
+        return false;
     }
 
-#ifdef JIT_TRACE
-    int jit_trace_indent = 4;
-#endif
+    return jit_ctor_keeps_this(ctor, 0);
+}
 
-    //
-    // The main loop for decoding and jitting opcodes
-    //
-    opcode_control_flow_t last_cf = OPCODE_CONTROL_FLOW_INVALID;
-    opcode_t last_opcode = CEE_INVALID;
-    System_Reflection_MethodInfo ftnMethod = NULL;
-    System_Type constrainedType = NULL;
-    int il_ptr = 0;
-    while (il_ptr < body->Il->Length) {
-
-        //--------------------------------------------------------------------------------------------------------------
-        // Control flow and stack verification
-        //--------------------------------------------------------------------------------------------------------------
-
-        // store the start of the instruction for others to use
-        ctx->il_offset = il_ptr;
-
-        // create a snapshot of the stack, if we already have a snapshot
-        // of this verify it is the same (we will get a snapshot if we have
-        // a forward jump)
-        MIR_insn_t cur_label;
-        int stacki = hmgeti(ctx->pc_to_stack_snapshot, ctx->il_offset);
-
-        if (
-            last_cf == OPCODE_CONTROL_FLOW_BRANCH ||
-            last_cf == OPCODE_CONTROL_FLOW_THROW
-        ) {
-            // control changed by a jump or an exception, this stack can not be full, but rather must
-            // be empty or be whatever the stack is already set to be at this point
-            if (stacki == -1) {
-                // create a new empty stack
-                arrfree(ctx->stack.entries);
-                ctx->ireg.depth = 0;
-                ctx->freg.depth = 0;
-                ctx->dreg.depth = 0;
-            } else {
-                // copy the stack to the current stack
-                stack_copy(ctx, &ctx->pc_to_stack_snapshot[stacki].stack);
-                ctx->ireg.depth = ctx->pc_to_stack_snapshot[stacki].ireg_depth;
-                ctx->freg.depth = ctx->pc_to_stack_snapshot[stacki].freg_depth;
-                ctx->dreg.depth = ctx->pc_to_stack_snapshot[stacki].dreg_depth;
-            }
+static void jit_find_frame_objects(jit_method_context_t* ctx, il_insn_t* insns) {
+    for (int i = 0; i < arrlen(insns); i++) {
+        if (insns[i].opcode == CEE_NEWOBJ && jit_newobj_can_use_frame(ctx, insns, i)) {
+            arrpush(ctx->frame_objects, insns[i].offset);
         }
+    }
+}
 
-        if (stacki != -1) {
-            // verify it is the same
-            stack_t snapshot = ctx->pc_to_stack_snapshot[stacki].stack;
-            cur_label = ctx->pc_to_stack_snapshot[stacki].label;
-            CHECK_AND_RETHROW(stack_merge(ctx, &snapshot, true));
-        } else {
-            // take snapshot
-            cur_label = MIR_new_label(mir_ctx);
-            stack_snapshot_t snapshot = {
-                .key = ctx->il_offset,
-                .label = cur_label,
-                .stack = stack_snapshot(ctx),
-                .ireg_depth = ctx->ireg.depth,
-                .freg_depth = ctx->freg.depth,
-                .dreg_depth = ctx->dreg.depth
-            };
-            hmputs(ctx->pc_to_stack_snapshot, snapshot);
+static bool jit_is_frame_object(jit_method_context_t* ctx) {
+    for (int i = 0; i < arrlen(ctx->frame_objects); i++) {
+        if (ctx->frame_objects[i] == ctx->il_offset) {
+            return true;
         }
-        MIR_append_insn(mir_ctx, mir_func, cur_label);
+    }
+    return false;
+}
 
-        // validate the control flow from the previous instruction, we can not have anything that
-        // continues to enter a handler block
-        for (int i = 0; i < body->ExceptionHandlingClauses->Length; i++) {
-            System_Reflection_ExceptionHandlingClause clause = body->ExceptionHandlingClauses->Data[i];
+/**
+ * Allocate an object in the frame, the space is allocated once on entry and is
+ * cleared and given a header every time the newobj runs
+ */
+static void jit_new_in_frame(jit_method_context_t* ctx, MIR_reg_t result, System_Type type) {
+    MIR_reg_t type_reg = new_temp_reg(ctx, tSystem_Type);
+
+    // the space gets its own register that is never changed
+    char name[64] = { 0 };
+    snprintf(name, sizeof(name), "fo%d", ctx->value_type_name_gen++);
+    MIR_reg_t frame_reg = MIR_new_func_reg(mir_ctx, mir_func->u.func, MIR_T_I64, name);
+    MIR_prepend_insn(mir_ctx, mir_func,
+                     MIR_new_insn(mir_ctx, MIR_ALLOCA,
+                                  MIR_new_reg_op(mir_ctx, frame_reg),
+                                  MIR_new_int_op(mir_ctx, type->ManagedSize)));
 
-#ifdef JIT_TRACE
-            if (clause->TryOffset == ctx->il_offset) {
-                TRACE("%*s.try %d", jit_trace_indent, "", i);
-                TRACE("%*s{", jit_trace_indent, "");
-                jit_trace_indent += 4;
-            } else if (clause->TryOffset + clause->TryLength == ctx->il_offset) {
-                jit_trace_indent -= 4;
-                TRACE("%*s} // end .try", jit_trace_indent, "");
-            }
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                 MIR_new_reg_op(mir_ctx, result),
+                                 MIR_new_reg_op(mir_ctx, frame_reg)));
+    jit_emit_zerofill(ctx, result, type->ManagedSize);
 
-            if (clause->HandlerOffset == ctx->il_offset) {
-                if (clause->Flags == COR_ILEXCEPTION_CLAUSE_EXCEPTION) {
-                    TRACE("%*scatch %U.%U", jit_trace_indent, "", clause->CatchType->Namespace, clause->CatchType->Name);
-                } else if (clause->Flags == COR_ILEXCEPTION_CLAUSE_FINALLY) {
-                    TRACE("%*sfinally", jit_trace_indent, "");
-                } else if (clause->Flags == COR_ILEXCEPTION_CLAUSE_FAULT) {
-                    TRACE("%*sfault", jit_trace_indent, "");
-                } else if (clause->Flags == COR_ILEXCEPTION_CLAUSE_FAULT) {
-                    TRACE("%*sfilter", jit_trace_indent, "");
-                }
-                TRACE("%*s{", jit_trace_indent, "");
-                jit_trace_indent += 4;
-            } else if (clause->HandlerOffset + clause->HandlerLength == ctx->il_offset) {
-                jit_trace_indent -= 4;
-                TRACE("%*s} // end handler", jit_trace_indent, "");
-            }
-#endif
+    // the vtable
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                 MIR_new_reg_op(mir_ctx, type_reg),
+                                 MIR_new_ref_op(mir_ctx, type->MirType)));
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                 MIR_new_mem_op(mir_ctx, MIR_T_P, offsetof(struct System_Object, vtable), result, 0, 1),
+                                 MIR_new_mem_op(mir_ctx, MIR_T_P, offsetof(struct System_Type, VTable), type_reg, 0, 1)));
 
-            if (
-                clause->HandlerOffset == ctx->il_offset ||
-                clause->HandlerOffset + clause->HandlerLength == ctx->il_offset ||
-                clause->TryOffset + clause->TryLength == ctx->il_offset
-            ) {
-                // entry to handler can only happen from exception, so
-                // we can't have any instruction that goes next, that is
-                // the same for exiting from handler or protected block
-                CHECK(
-                    last_cf == OPCODE_CONTROL_FLOW_BRANCH ||
-                    last_cf == OPCODE_CONTROL_FLOW_THROW ||
-                    last_cf == OPCODE_CONTROL_FLOW_RETURN
-                );
-            }
-        }
+    // the type, the rest of the header is left as zero
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_AND,
+                                 MIR_new_reg_op(mir_ctx, type_reg),
+                                 MIR_new_reg_op(mir_ctx, type_reg),
+                                 MIR_new_uint_op(mir_ctx, 0x0000FFFFFFFFFFFF)));
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                 MIR_new_mem_op(mir_ctx, MIR_T_U64, sizeof(void*), result, 0, 1),
+                                 MIR_new_reg_op(mir_ctx, type_reg)));
+}
 
-        //--------------------------------------------------------------------------------------------------------------
-        // Opcode decoding
-        //--------------------------------------------------------------------------------------------------------------
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Delegate devirtualization
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-        // get the opcode value
-        uint16_t opcode_value = (REFPRE << 8) | body->Il->Data[il_ptr++];
+//
+// A local that is only ever written by
+//
+//      ldftn M
+//      newobj D::.ctor
+//      stloc N
+//
+// can only be null or a single target delegate to M, so invoking it is turned into a direct call
+// to M with the target of the delegate, which MIR may also inline. The delegate object itself is
+// still created, it might be used for anything else.
+//
 
-        // get the actual opcode
-        opcode_t opcode = g_dotnet_opcode_lookup[opcode_value];
-        CHECK_ERROR(opcode != CEE_INVALID, ERROR_INVALID_OPCODE);
+static void jit_find_delegate_locals(jit_method_context_t* ctx, il_insn_t* insns) {
+    System_Reflection_MethodInfo method = ctx->method;
 
-        // handle opcodes with special prefix
+    for (int i = 0; i + 2 < arrlen(insns); i++) {
         if (
-            opcode == CEE_PREFIX1 ||
-            opcode == CEE_PREFIX2 ||
-            opcode == CEE_PREFIX3 ||
-            opcode == CEE_PREFIX4 ||
-            opcode == CEE_PREFIX5 ||
-            opcode == CEE_PREFIX6 ||
-            opcode == CEE_PREFIX7
+            insns[i].opcode != CEE_LDFTN ||
+            insns[i + 1].opcode != CEE_NEWOBJ ||
+            insns[i + 2].opcode != CEE_STLOC
         ) {
-            CHECK(il_ptr + 1 <= body->Il->Length);
+            continue;
+        }
 
-            // setup the new prefix
-            opcode_value <<= 8;
-            opcode_value |= body->Il->Data[il_ptr++];
-            opcode = g_dotnet_opcode_lookup[opcode_value];
-            CHECK_ERROR(opcode != CEE_INVALID, ERROR_INVALID_OPCODE);
+        // must be the only write of the local
+        int source = JIT_SOURCE_LOCAL(insns[i + 2].operand);
+        bool single_write = true;
+        for (int j = 0; j < arrlen(insns) && single_write; j++) {
+            if (j != i + 2 && jit_il_insn_writes(&insns[j], source)) {
+                single_write = false;
+            }
+        }
+        if (!single_write) {
+            continue;
         }
 
-        // get the opcode info
-        opcode_info_t* opcode_info = &g_dotnet_opcodes[opcode];
+        System_Reflection_MethodInfo target = NULL;
+        System_Reflection_MethodInfo ctor = NULL;
+        if (
+            IS_ERROR(assembly_get_method_by_token(method->Module->Assembly, *(token_t*)&insns[i].operand,
+                                                  method->DeclaringType->GenericArguments,
+                                                  method->GenericArguments, &target)) ||
+            IS_ERROR(assembly_get_method_by_token(method->Module->Assembly, *(token_t*)&insns[i + 1].operand,
+                                                  method->DeclaringType->GenericArguments,
+                                                  method->GenericArguments, &ctor))
+        ) {
+            continue;
+        }
 
-#ifdef JIT_TRACE
-        printf("[*] %*sIL_%04x: %s ", jit_trace_indent, "", ctx->il_offset, opcode_info->name);
-#endif
+        // the invoke is matched against the delegate type, the signature
+        // itself is verified when the delegate is created
+        if (target == NULL || ctor == NULL || ctor->DeclaringType->BaseType != tSystem_MulticastDelegate) {
+            continue;
+        }
 
-        // set the last control flow to this one
-        last_cf = opcode_info->control_flow;
+        hmput(ctx->delegate_locals, source, target);
+    }
+}
 
-        //--------------------------------------------------------------------------------------------------------------
-        // Handle operands of the opcode
-        //--------------------------------------------------------------------------------------------------------------
+/**
+ * Get the method the delegate on the stack is known to call, NULL if not known
+ */
+static System_Reflection_MethodInfo jit_get_delegate_target(jit_method_context_t* ctx, stack_entry_t* entry, System_Reflection_MethodInfo invoke) {
+    if (entry->source == 0 || invoke->DeclaringType->DelegateSignature != invoke) {
+        return NULL;
+    }
 
-        token_t operand_token = { 0 };
-        int32_t operand_i32 = 0;
-        int64_t operand_i64 = 0;
-        System_Reflection_FieldInfo operand_field = NULL;
-        System_Reflection_MethodInfo operand_method = NULL;
-        float operand_f32 = 0;
-        double operand_f64 = 0;
-        System_Type operand_type = NULL;
-        System_String operand_string = NULL;
-        uint32_t operand_switch_n = 0;
-        int32_t* operand_switch_dests = NULL;
+    int index = hmgeti(ctx->delegate_locals, entry->source);
+    if (index < 0) {
+        return NULL;
+    }
 
-        switch (opcode_info->operand) {
-            case OPCODE_OPERAND_InlineBrTarget: {
-                operand_i32 = *(int32_t*)&body->Il->Data[il_ptr];
-                il_ptr += sizeof(int32_t);
-                operand_i32 += il_ptr;
+    // delegates are sealed, so a local of the invoked type holds that exact type, the
+    // method itself might not be ready if we did not get to the ldftn yet
+    System_Reflection_MethodInfo target = ctx->delegate_locals[index].value;
+    if (entry->type != invoke->DeclaringType || target->MirFunc == NULL || target->MirProto == NULL) {
+        return NULL;
+    }
 
-#ifdef JIT_TRACE
-                printf("IL_%04x", operand_i32);
-#endif
-            } break;
+    return target;
+}
 
-            case OPCODE_OPERAND_InlineField: {
-                // fetch it
-                token_t value = *(token_t*)&body->Il->Data[il_ptr];
-                il_ptr += sizeof(token_t);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Box elimination
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-                // resolve it
-                CHECK_AND_RETHROW(assembly_get_field_by_token(assembly, value, method->DeclaringType->GenericArguments,
-                                                              method->GenericArguments, &operand_field));
-                CHECK(operand_field != NULL);
+//
+// Boxing a value type allocates an object every time, but generic code quite often boxes
+// only to look at the object right away:
+//
+//      box T; brtrue               the null check of `value != null`, only an empty nullable is null
+//      box T; [isinst T]; unbox.any T      the `(T)(object)value` cast, gives the same value back
+//      box T; callvirt M           calling a method of the value through the object, like
+//                                  `value.GetHashCode()` with no constrained prefix
+//
+// None of these let the object escape, so the object is never created. The call is turned into
+// a constrained call, which calls the method of the value type directly with a reference to a
+// copy of the value.
+//
 
-#ifdef JIT_TRACE
-                strbuilder_t type_name = strbuilder_new();
-                type_print_full_name(operand_field->DeclaringType, &type_name);
-                printf("%s::%U", strbuilder_get(&type_name), operand_field->Name);
-                strbuilder_free(&type_name);
-#endif
+static void jit_find_box_uses(jit_method_context_t* ctx, il_insn_t* insns) {
+    for (int i = 0; i + 1 < arrlen(insns); i++) {
+        if (insns[i].opcode != CEE_BOX) {
+            continue;
+        }
 
-                // check we can access it
-                CHECK(check_field_accessibility(method, operand_field));
+        // the object must go straight to the next instruction
+        il_insn_t* next = &insns[i + 1];
+        if (hmgeti(ctx->branch_targets, next->offset) >= 0) {
+            continue;
+        }
 
-                // make sure we initialized its type
-                CHECK_AND_RETHROW(jit_prepare_type(ctx->ctx, operand_field->DeclaringType));
+        jit_box_use_t use = { 0 };
+        switch (next->opcode) {
+            case CEE_BRTRUE:
+            case CEE_BRTRUE_S:
+            case CEE_BRFALSE:
+            case CEE_BRFALSE_S: {
+                use.kind = JIT_BOX_BRANCH;
             } break;
 
-            case OPCODE_OPERAND_InlineI: {
-                operand_i32 = *(int32_t*)&body->Il->Data[il_ptr];
-                il_ptr += sizeof(int32_t);
-
-#ifdef JIT_TRACE
-                printf("%d", operand_i32);
-#endif
+            case CEE_CALLVIRT: {
+                use.kind = JIT_BOX_CALL;
+                use.tokens[use.count] = *(token_t*)&next->operand;
+                use.offsets[use.count++] = next->offset;
             } break;
 
-            case OPCODE_OPERAND_InlineI8: {
-                operand_i64 = *(int64_t*)&body->Il->Data[il_ptr];
-                il_ptr += sizeof(int64_t);
+            case CEE_ISINST: {
+                if (
+                    i + 2 >= arrlen(insns) ||
+                    insns[i + 2].opcode != CEE_UNBOX_ANY ||
+                    hmgeti(ctx->branch_targets, insns[i + 2].offset) >= 0
+                ) {
+                    continue;
+                }
+                use.tokens[use.count] = *(token_t*)&next->operand;
+                use.offsets[use.count++] = next->offset;
+                next = &insns[i + 2];
+            } // fallthrough
 
-#ifdef JIT_TRACE
-                printf("%ld", operand_i64);
-#endif
+            case CEE_UNBOX_ANY: {
+                use.kind = JIT_BOX_UNBOX;
+                use.tokens[use.count] = *(token_t*)&next->operand;
+                use.offsets[use.count++] = next->offset;
             } break;
 
-            case OPCODE_OPERAND_InlineMethod: {
-                // fetch it
-                token_t value = *(token_t*)&body->Il->Data[il_ptr];
-                il_ptr += sizeof(token_t);
-
-                // resolve it
-                CHECK_AND_RETHROW(assembly_get_method_by_token(assembly, value, method->DeclaringType->GenericArguments,
-                                                               method->GenericArguments, &operand_method));
-                CHECK(operand_method != NULL);
+            default:
+                continue;
+        }
 
-#ifdef JIT_TRACE
-                strbuilder_t type_name = strbuilder_new();
-                method_print_full_name(operand_method, &type_name);
-                printf("%s", strbuilder_get(&type_name));
-                strbuilder_free(&type_name);
-#endif
+        hmput(ctx->box_uses, insns[i].offset, use);
+    }
+}
 
-                // check we can access it
-                CHECK(check_method_accessibility(method, operand_method),
-                      "from %U to %U", method->Name, operand_method->Name);
-
-                // prepare the owning type
-                CHECK_AND_RETHROW(jit_prepare_type(ctx->ctx, operand_method->DeclaringType));
+/**
+ * Get the method a callvirt on a boxed value type ends up calling, if it is
+ * one of the methods of the value type itself, NULL otherwise
+ */
+static System_Reflection_MethodInfo jit_get_box_call_target(System_Type type, System_Reflection_MethodInfo method) {
+    if (!method_is_virtual(method) || method->Parameters->Length != 0 || type->VirtualMethods == NULL) {
+        return NULL;
+    }
 
-                // if the method is a generic instance then we need to handle it separately
-                if (operand_method->GenericArguments != NULL) {
-                    CHECK_AND_RETHROW(jit_prepare_method(ctx->ctx, operand_method));
-                }
-            } break;
+    System_Reflection_MethodInfo impl = NULL;
+    if (type_is_interface(method->DeclaringType)) {
+        impl = type_get_interface_method_impl(type, method);
+    } else if (method->VTableOffset < type->VirtualMethods->Length) {
+        impl = type->VirtualMethods->Data[method->VTableOffset];
+    }
 
-            case OPCODE_OPERAND_InlineR: {
-                operand_f64 = *(double*)&body->Il->Data[il_ptr];
-                il_ptr += sizeof(double);
+    // inherited methods of object and valuetype really need the object
+    if (impl == NULL || impl->DeclaringType != type) {
+        return NULL;
+    }
 
-#ifdef JIT_TRACE
-                printf("<InlineR>");
-#endif
-            } break;
+    return impl;
+}
 
-            case OPCODE_OPERAND_InlineSig: CHECK_FAIL("TODO: sig support"); break;
+/**
+ * Check that the use of the box is really what we expect with the types known,
+ * the value boxed as a nullable behaves differently so only the check is elided
+ */
+static bool jit_can_elide_box(jit_method_context_t* ctx, jit_box_use_t* use, System_Type type) {
+    System_Reflection_MethodInfo method = ctx->method;
 
-            case OPCODE_OPERAND_InlineString: {
-                token_t value = *(token_t*)&body->Il->Data[il_ptr];
-                il_ptr += sizeof(token_t);
-                operand_string = assembly_get_string_by_token(assembly, value);
-                CHECK(operand_string != NULL);
+    if (!type->IsValueType) {
+        return false;
+    }
 
-#ifdef JIT_TRACE
-                printf("\"%U\"", operand_string);
-#endif
-            } break;
+    if (use->kind == JIT_BOX_BRANCH) {
+        return true;
+    }
 
-            case OPCODE_OPERAND_InlineSwitch: {
-                operand_switch_n = *(uint32_t*)&body->Il->Data[il_ptr];
-                il_ptr += 4;
-                operand_switch_dests = (int32_t*)&body->Il->Data[il_ptr];
-                il_ptr += operand_switch_n * 4;
+    if (type->GenericTypeDefinition == tSystem_Nullable) {
+        return false;
+    }
 
-#ifdef JIT_TRACE
-                printf("<InlineSwitch>");
-#endif
-            } break;
+    if (use->kind == JIT_BOX_CALL) {
+        System_Reflection_MethodInfo target = NULL;
+        if (IS_ERROR(assembly_get_method_by_token(method->Module->Assembly, use->tokens[0],
+                                                  method->DeclaringType->GenericArguments,
+                                                  method->GenericArguments, &target))) {
+            return false;
+        }
+        return target != NULL && jit_get_box_call_target(type, target) != NULL;
+    }
 
-            case OPCODE_OPERAND_InlineTok: {
-                // fetch it
-                operand_token = *(token_t*)&body->Il->Data[il_ptr];
-                il_ptr += sizeof(token_t);
+    // the casts must all be to the boxed type
+    for (int i = 0; i < use->count; i++) {
+        System_Type cast_type = NULL;
+        if (IS_ERROR(assembly_get_type_by_token(method->Module->Assembly, use->tokens[i],
+                                                method->DeclaringType->GenericArguments,
+                                                method->GenericArguments, &cast_type))) {
+            return false;
+        }
+        if (cast_type != type) {
+            return false;
+        }
+    }
 
-#ifdef JIT_TRACE
-                printf("<InlineTok>");
-#endif
-            } break;
+    return true;
+}
 
-            case OPCODE_OPERAND_InlineType: {
-                // fetch it
-                token_t value = *(token_t*)&body->Il->Data[il_ptr];
-                il_ptr += sizeof(token_t);
+/**
+ * Emit the box of the value on the stack without creating the object, for a call this
+ * sets the constrained type for the callvirt that comes next
+ */
+static err_t jit_emit_elided_box(jit_method_context_t* ctx, jit_box_use_t* use, System_Type type, System_Type* constrained) {
+    err_t err = NO_ERROR;
 
-                // resolve it
-                CHECK_AND_RETHROW(assembly_get_type_by_token(assembly, value, method->DeclaringType->GenericArguments
-                        , method->GenericArguments, &operand_type));
-                CHECK(operand_type != NULL);
+    CHECK(arrlen(ctx->stack.entries) > 0);
+    CHECK(type_is_verifier_assignable_to(STACK_TOP.type, type));
 
-#ifdef JIT_TRACE
-                strbuilder_t type_name = strbuilder_new();
-                type_print_full_name(operand_type, &type_name);
-                printf("%s", strbuilder_get(&type_name));
-                strbuilder_free(&type_name);
-#endif
+    switch (use->kind) {
+        case JIT_BOX_BRANCH: {
+            System_Type val_type;
+            MIR_reg_t val_reg;
+            CHECK_AND_RETHROW(stack_pop(ctx, &val_type, &val_reg, NULL));
 
-                // check it is visible
-                CHECK(check_type_visibility(method, operand_type));
+            MIR_reg_t obj_reg;
+            CHECK_AND_RETHROW(stack_push(ctx, get_boxed_type(val_type), &obj_reg));
 
-                // init it
-                CHECK_AND_RETHROW(jit_prepare_type(ctx->ctx, operand_type));
-            } break;
+            if (type->GenericTypeDefinition == tSystem_Nullable) {
+                // null exactly when there is no value
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                             MIR_new_reg_op(mir_ctx, obj_reg),
+                                             MIR_new_mem_op(mir_ctx, MIR_T_U8,
+                                                            offsetof(System_Nullable, HasValue),
+                                                            val_reg, 0, 1)));
+            } else {
+                // never null, anything that is not zero will do
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                             MIR_new_reg_op(mir_ctx, obj_reg),
+                                             MIR_new_int_op(mir_ctx, 1)));
+                STACK_TOP.non_null = true;
+            }
+        } break;
 
-            case OPCODE_OPERAND_InlineVar: {
-                operand_i32 = *(uint16_t*)&body->Il->Data[il_ptr];
-                il_ptr += sizeof(uint16_t);
+        case JIT_BOX_UNBOX: {
+            // the value stays on the stack as is
+            for (int i = 0; i < use->count; i++) {
+                arrpush(ctx->elided_unboxes, use->offsets[i]);
+            }
+        } break;
 
-#ifdef JIT_TRACE
-                printf("%d", operand_i32);
-#endif
-            } break;
+        case JIT_BOX_CALL: {
+            System_Type val_type;
+            MIR_reg_t val_reg;
+            CHECK_AND_RETHROW(stack_pop(ctx, &val_type, &val_reg, NULL));
+
+            // struct values on the stack are already a copy in the frame, anything
+            // else gets its own space, the callee may change it through the reference
+            MIR_reg_t ref_value_reg = val_reg;
+            if (type_get_stack_type(val_type) != STACK_TYPE_VALUE_TYPE) {
+                char name[64] = { 0 };
+                snprintf(name, sizeof(name), "bv%d", ctx->value_type_name_gen++);
+                ref_value_reg = MIR_new_func_reg(mir_ctx, mir_func->u.func, MIR_T_I64, name);
+                MIR_prepend_insn(mir_ctx, mir_func,
+                                 MIR_new_insn(mir_ctx, MIR_ALLOCA,
+                                              MIR_new_reg_op(mir_ctx, ref_value_reg),
+                                              MIR_new_int_op(mir_ctx, type->StackSize)));
 
-            case OPCODE_OPERAND_ShortInlineBrTarget: {
-                operand_i32 = *(int8_t*)&body->Il->Data[il_ptr];
-                il_ptr += sizeof(int8_t);
-                operand_i32 += il_ptr;
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, jit_number_inscode(type),
+                                             MIR_new_mem_op(mir_ctx, get_mir_type(type), 0, ref_value_reg, 0, 1),
+                                             MIR_new_reg_op(mir_ctx, val_reg)));
+            }
 
-#ifdef JIT_TRACE
-                printf("IL_%04x", operand_i32);
-#endif
-            } break;
+            MIR_reg_t ref_reg;
+            CHECK_AND_RETHROW(stack_push(ctx, get_by_ref_type(type), &ref_reg));
+            MIR_append_insn(mir_ctx, mir_func,
+                            MIR_new_insn(mir_ctx, MIR_MOV,
+                                         MIR_new_reg_op(mir_ctx, ref_reg),
+                                         MIR_new_reg_op(mir_ctx, ref_value_reg)));
 
-            case OPCODE_OPERAND_ShortInlineI: {
-                operand_i32 = *(int8_t*)&body->Il->Data[il_ptr];
-                il_ptr += sizeof(int8_t);
+            *constrained = type;
+        } break;
+    }
 
-#ifdef JIT_TRACE
-                printf("%d", operand_i32);
-#endif
-            } break;
+cleanup:
+    return err;
+}
 
-            case OPCODE_OPERAND_ShortInlineR: {
-                operand_f32 = *(float*)&body->Il->Data[il_ptr];
-                il_ptr += sizeof(float);
+static bool jit_is_elided_unbox(jit_method_context_t* ctx) {
+    for (int i = 0; i < arrlen(ctx->elided_unboxes); i++) {
+        if (ctx->elided_unboxes[i] == ctx->il_offset) {
+            return true;
+        }
+    }
+    return false;
+}
 
-#ifdef JIT_TRACE
-                printf("<ShortInlineR>");
-#endif
-            } break;
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Casting helpers
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-            case OPCODE_OPERAND_ShortInlineVar: {
-                operand_i32 = *(uint8_t*)&body->Il->Data[il_ptr];
-                il_ptr += sizeof(uint8_t);
+/**
+ * Emit a cast between an object to an interface, this is not always the most trivial
+ * thing but it is needed
+ */
+static err_t jit_cast_obj_to_interface(jit_method_context_t* ctx,
+                                       MIR_reg_t result_reg, MIR_reg_t from_reg,
+                                       System_Type from_type, System_Type to_type
+) {
+    err_t err = NO_ERROR;
 
-#ifdef JIT_TRACE
-                printf("%d", operand_i32);
-#endif
-            } break;
+    // temp register to use for stuff
+    MIR_reg_t vtable_reg = new_temp_reg(ctx, tSystem_IntPtr);
 
-            case OPCODE_OPERAND_InlineNone:
-                break;
+    MIR_op_t vtable_op;
+    if (from_type != NULL) {
+        TinyDotNet_Reflection_InterfaceImpl interface = type_get_interface_impl(from_type, to_type);
+        CHECK(interface != NULL);
 
-            default:
-                CHECK_FAIL();
-        }
+        MIR_insn_t skip_vtable = MIR_new_label(mir_ctx);
 
-#ifdef JIT_TRACE
-        printf("\r\n");
-#endif
+        // start with a null vtalbe
+        MIR_append_insn(mir_ctx, mir_func,
+                        MIR_new_insn(mir_ctx, MIR_MOV,
+                                     MIR_new_reg_op(mir_ctx, vtable_reg),
+                                     MIR_new_int_op(mir_ctx, 0)));
 
-        //--------------------------------------------------------------------------------------------------------------
-        // Handle the opcode
-        //--------------------------------------------------------------------------------------------------------------
+        // if the object is null, then skip the vtable and leave it as null
+        MIR_append_insn(mir_ctx, mir_func,
+                        MIR_new_insn(mir_ctx, MIR_BF,
+                                     MIR_new_label_op(mir_ctx, skip_vtable),
+                                     MIR_new_reg_op(mir_ctx, from_reg)));
 
-        // constrained prefix should appear
-        // before callvirt opcode only
-        if (constrainedType != NULL) {
-            CHECK(opcode == CEE_CALLVIRT);
-        }
+        // &object->vtable[vtable_offset]
+        MIR_append_insn(mir_ctx, mir_func,
+                        MIR_new_insn(mir_ctx, MIR_ADD,
+                                     MIR_new_reg_op(mir_ctx, vtable_reg),
+                                     MIR_new_mem_op(mir_ctx, MIR_T_P,
+                                                    offsetof(struct System_Object, vtable),
+                                                    from_reg, 0, 1),
+                                     MIR_new_int_op(mir_ctx, interface->VTableOffset * sizeof(void *))));
 
-        // after ldftn/ldvirtftn there must be a newobj
-        if (ftnMethod != NULL) {
-            CHECK(opcode == CEE_NEWOBJ);
-        }
+        MIR_append_insn(mir_ctx, mir_func, skip_vtable);
 
-        switch (opcode) {
+        vtable_op = MIR_new_reg_op(mir_ctx, vtable_reg);
+    } else {
+        // cast a known null, just emit it nicely
+        vtable_op = MIR_new_int_op(mir_ctx, 0);
+    }
 
-            //----------------------------------------------------------------------------------------------------------
-            // Prefixes
-            //----------------------------------------------------------------------------------------------------------
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                 MIR_new_mem_op(mir_ctx, MIR_T_P, 0, result_reg, 0, 1),
+                                 vtable_op));
 
-            // save the constrained type for use in the next instruction
-            case CEE_CONSTRAINED: {
-                constrainedType = operand_type;
-            } break;
+    // TODO: figure a way to optimize this better, update the object reference
+    //       using a gc_update_ref call, this would be better if we can know from
+    //       the caller if this is needed or not
+    // we are going to store the result in the vtable_reg so we won't override the result
+    // register, as it may still be used by the caller to do stuff
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_ADD,
+                                 MIR_new_reg_op(mir_ctx, vtable_reg),
+                                 MIR_new_reg_op(mir_ctx, result_reg),
+                                 MIR_new_int_op(mir_ctx, sizeof(void*))));
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_call_insn(mir_ctx, 4,
+                                      MIR_new_ref_op(mir_ctx, m_gc_update_ref_proto),
+                                      MIR_new_ref_op(mir_ctx, m_gc_update_ref_func),
+                                      MIR_new_reg_op(mir_ctx, vtable_reg),
+                                      MIR_new_reg_op(mir_ctx, from_reg)));
 
-            case CEE_READONLY: {
-                // TODO: this should turn into a controlled mutability by-ref, otherwise
-                //       we can have a bad time
-            } break;
+cleanup:
+    return err;
+}
 
-            // ignore for now, tell MIR that this can be turned into a tailcall
-            case CEE_TAILCALL: break;
+/**
+ * Can a cast to the given type be checked inline, true for plain classes where being an
+ * instance only means having the type somewhere in the base chain, variance, arrays and
+ * value types are left to the runtime
+ */
+static bool jit_can_inline_class_check(System_Type type) {
+    if (type_is_interface(type) || type->IsArray || type->IsValueType || type->IsBoxed) {
+        return false;
+    }
 
-            // ignored for now, tell MIR everything is aligned except instructions
-            // like these
-            case CEE_UNALIGNED: break;
+    if (type_is_generic_parameter(type)) {
+        return false;
+    }
 
-            // ignored for now, tell MIR that this access is volatile
-            case CEE_VOLATILE: break;
-
-            //----------------------------------------------------------------------------------------------------------
-            // Base Instructions
-            //----------------------------------------------------------------------------------------------------------
+    // generic delegates may be variant
+    if (type->DelegateSignature != NULL && type_is_generic_type(type)) {
+        return false;
+    }
 
-            // nothing to do with nop
-            case CEE_NOP: break;
+    return true;
+}
 
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            // Arithmetic
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Emit an inline version of isinstance for a class, the type is taken from the object
+ * header, sealed classes need a single compare, others walk the base chain
+ */
+static void jit_emit_class_check(jit_method_context_t* ctx, MIR_reg_t result_reg, MIR_reg_t obj_reg, System_Type type) {
+    MIR_label_t done = MIR_new_label(mir_ctx);
+    MIR_reg_t type_reg = new_temp_reg(ctx, tSystem_Type);
+    MIR_reg_t target_reg = new_temp_reg(ctx, tSystem_Type);
 
-            // binary operations
-            case CEE_ADD:       CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_ADD, false)); break;
-            case CEE_DIV:       CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_DIV, false)); break;
-            case CEE_DIV_UN:    CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_UDIV, true)); break;
-            case CEE_MUL:       CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_MUL, false)); break;
-            case CEE_REM:       CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_MOD, false)); break;
-            case CEE_REM_UN:    CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_UMOD, true)); break;
-            case CEE_SUB:       CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_SUB, false)); break;
-            // bitwise binary operations
-            case CEE_AND:       CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_AND, true)); break;
-            case CEE_OR:        CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_OR, true)); break;
-            case CEE_XOR:       CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_XOR, true)); break;
-            // bit shifts
-            case CEE_SHL:       CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_LSH, true)); break;
-            case CEE_SHR:       CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_RSH, true)); break;
-            case CEE_SHR_UN:    CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_URSH, true)); break;
+    // null is an instance of anything
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                 MIR_new_reg_op(mir_ctx, result_reg),
+                                 MIR_new_int_op(mir_ctx, 1)));
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_BF,
+                                 MIR_new_label_op(mir_ctx, done),
+                                 MIR_new_reg_op(mir_ctx, obj_reg)));
 
-            // unary operations
-            case CEE_NEG: {
-                MIR_reg_t value_reg;
-                System_Type value_type;
-                CHECK_AND_RETHROW(stack_pop(ctx, &value_type, &value_reg, NULL));
+    // the type is the low bits of the word right after the vtable, same as OBJECT_TYPE
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                 MIR_new_reg_op(mir_ctx, type_reg),
+                                 MIR_new_mem_op(mir_ctx, MIR_T_U64, sizeof(void*), obj_reg, 0, 1)));
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_AND,
+                                 MIR_new_reg_op(mir_ctx, type_reg),
+                                 MIR_new_reg_op(mir_ctx, type_reg),
+                                 MIR_new_uint_op(mir_ctx, 0x0000FFFFFFFFFFFF)));
+#ifndef PENTAGON_HOSTED
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_OR,
+                                 MIR_new_reg_op(mir_ctx, type_reg),
+                                 MIR_new_reg_op(mir_ctx, type_reg),
+                                 MIR_new_uint_op(mir_ctx, 0xFFFF000000000000)));
+#endif
 
-                MIR_reg_t result_reg;
-                CHECK_AND_RETHROW(stack_push(ctx, value_type, &result_reg));
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                 MIR_new_reg_op(mir_ctx, target_reg),
+                                 MIR_new_ref_op(mir_ctx, type->MirType)));
 
-                MIR_insn_code_t code;
-                switch (type_get_stack_type(value_type)) {
-                    case STACK_TYPE_INT32: {
-                        code = MIR_NEGS;
-                    } break;
+    if (type_is_sealed(type)) {
+        // nothing can inherit from it, so it must be the exact type
+        MIR_append_insn(mir_ctx, mir_func,
+                        MIR_new_insn(mir_ctx, MIR_EQ,
+                                     MIR_new_reg_op(mir_ctx, result_reg),
+                                     MIR_new_reg_op(mir_ctx, type_reg),
+                                     MIR_new_reg_op(mir_ctx, target_reg)));
+    } else {
+        MIR_label_t loop = MIR_new_label(mir_ctx);
+        MIR_append_insn(mir_ctx, mir_func, loop);
 
-                    case STACK_TYPE_INT64:
-                    case STACK_TYPE_INTPTR: {
-                        code = MIR_NEG;
-                    } break;
+        MIR_append_insn(mir_ctx, mir_func,
+                        MIR_new_insn(mir_ctx, MIR_BEQ,
+                                     MIR_new_label_op(mir_ctx, done),
+                                     MIR_new_reg_op(mir_ctx, type_reg),
+                                     MIR_new_reg_op(mir_ctx, target_reg)));
 
-                    case STACK_TYPE_FLOAT: {
-                        if (value_type == tSystem_Single) {
-                            code = MIR_FNEG;
-                        } else if (value_type == tSystem_Double) {
-                            code = MIR_DNEG;
-                        } else {
-                            CHECK_FAIL();
-                        }
-                    } break;
+        // go to the base, until we run out of them
+        MIR_append_insn(mir_ctx, mir_func,
+                        MIR_new_insn(mir_ctx, MIR_MOV,
+                                     MIR_new_reg_op(mir_ctx, type_reg),
+                                     MIR_new_mem_op(mir_ctx, MIR_T_P,
+                                                    offsetof(struct System_Type, BaseType),
+                                                    type_reg, 0, 1)));
+        MIR_append_insn(mir_ctx, mir_func,
+                        MIR_new_insn(mir_ctx, MIR_BT,
+                                     MIR_new_label_op(mir_ctx, loop),
+                                     MIR_new_reg_op(mir_ctx, type_reg)));
 
-                    case STACK_TYPE_O:
-                    case STACK_TYPE_REF:
-                    case STACK_TYPE_VALUE_TYPE:
-                        CHECK_FAIL();
-                }
+        MIR_append_insn(mir_ctx, mir_func,
+                        MIR_new_insn(mir_ctx, MIR_MOV,
+                                     MIR_new_reg_op(mir_ctx, result_reg),
+                                     MIR_new_int_op(mir_ctx, 0)));
+    }
 
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, code,
-                                             MIR_new_reg_op(mir_ctx, result_reg),
-                                             MIR_new_reg_op(mir_ctx, value_reg)));
-            } break;
+    MIR_append_insn(mir_ctx, mir_func, done);
+}
 
-            case CEE_NOT: {
-                MIR_reg_t value_reg;
-                System_Type value_type;
-                CHECK_AND_RETHROW(stack_pop(ctx, &value_type, &value_reg, NULL));
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Generic opcode jitting
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-                MIR_reg_t result_reg;
-                CHECK_AND_RETHROW(stack_push(ctx, value_type, &result_reg));
+/**
+ * Jit both compare and compare-branch operations, will do so based on the passed
+ * MIR instruction code.
+ *
+ * Handles implicit floating point casting as well as int32<->intptr handling
+ */
+static err_t jit_compare_branch(jit_method_context_t* ctx, int il_target, MIR_insn_code_t code) {
+    err_t err = NO_ERROR;
 
-                MIR_insn_code_t code;
-                switch (type_get_stack_type(value_type)) {
-                    case STACK_TYPE_INT32: {
-                        code = MIR_XORS;
-                    } break;
+    MIR_reg_t value2_reg;
+    MIR_reg_t value1_reg;
+    System_Type value2_type;
+    System_Type value1_type;
+    CHECK_AND_RETHROW(stack_pop(ctx, &value2_type, &value2_reg, NULL));
+    CHECK_AND_RETHROW(stack_pop(ctx, &value1_type, &value1_reg, NULL));
 
-                    case STACK_TYPE_INT64:
-                    case STACK_TYPE_INTPTR: {
-                        code = MIR_XOR;
-                    } break;
+    MIR_reg_t result_reg = 0;
+    MIR_label_t label = NULL;
+    if (MIR_branch_code_p(code)) {
+        CHECK(il_target >= 0);
+        CHECK_AND_RETHROW(jit_branch_point(ctx, il_target, &label));
+    } else {
+        CHECK_AND_RETHROW(stack_push(ctx, tSystem_Int32, &result_reg));
+    }
 
-                    case STACK_TYPE_FLOAT:
-                    case STACK_TYPE_O:
-                    case STACK_TYPE_REF:
-                    case STACK_TYPE_VALUE_TYPE:
-                        CHECK_FAIL();
-                }
+    switch (type_get_stack_type(value1_type)) {
+        case STACK_TYPE_INT32: {
+            if (type_get_stack_type(value2_type) == STACK_TYPE_INT32) {
+                code += 1;
+            } else {
+                CHECK(type_get_stack_type(value2_type) == STACK_TYPE_INTPTR);
 
-                // ~value == value ^ -1
+                // sign extend to intptr
                 MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, code,
-                                             MIR_new_reg_op(mir_ctx, result_reg),
-                                             MIR_new_reg_op(mir_ctx, value_reg),
-                                             MIR_new_int_op(mir_ctx, -1)));
-            } break;
+                                MIR_new_insn(mir_ctx, MIR_UEXT32,
+                                             MIR_new_reg_op(mir_ctx, value1_reg),
+                                             MIR_new_reg_op(mir_ctx, value1_reg)));
+            }
+        } break;
 
-            // TODO: shift operations
+        case STACK_TYPE_INT64: {
+            CHECK(type_get_stack_type(value2_type) == STACK_TYPE_INT64);
+        } break;
 
-            // TODO: checked arithmetic
+        case STACK_TYPE_INTPTR: {
+            if (type_get_stack_type(value2_type) == STACK_TYPE_INT32) {
+                // sign extend to intptr
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_UEXT32,
+                                             MIR_new_reg_op(mir_ctx, value2_reg),
+                                             MIR_new_reg_op(mir_ctx, value2_reg)));
+            } else {
+                CHECK(type_get_stack_type(value2_type) == STACK_TYPE_INTPTR);
+            }
+        } break;
 
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            // Casting and boxing
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+        case STACK_TYPE_FLOAT: {
+            CHECK(value2_type == tSystem_Double || value2_type == tSystem_Single);
 
-            case CEE_CONV_I1:
-            case CEE_CONV_I2:
-            case CEE_CONV_I4:
-            case CEE_CONV_I8:
-            case CEE_CONV_R4:
-            case CEE_CONV_R8:
-            case CEE_CONV_U1:
-            case CEE_CONV_U2:
-            case CEE_CONV_U4:
-            case CEE_CONV_U8:
-            case CEE_CONV_I:
-            case CEE_CONV_U:
-            case CEE_CONV_R_UN: {
-                MIR_reg_t reg;
-                System_Type type;
-                CHECK_AND_RETHROW(stack_pop(ctx, &type, &reg, NULL));
+            if (value1_type == tSystem_Single) {
+                if (value2_type == tSystem_Single) {
+                    // need to do float math
+                    code += 2;
+                } else if (value2_type == tSystem_Double) {
+                    // need to do double math
+                    code += 3;
 
-                MIR_reg_t result_reg;
-                System_Type result_type;
-                switch (opcode) {
-                    case CEE_CONV_I1: result_type = tSystem_Int32; break;
-                    case CEE_CONV_U1: result_type = tSystem_Int32; break;
-                    case CEE_CONV_I2: result_type = tSystem_Int32; break;
-                    case CEE_CONV_U2: result_type = tSystem_Int32; break;
-                    case CEE_CONV_I4: result_type = tSystem_Int32; break;
-                    case CEE_CONV_U4: result_type = tSystem_Int32; break;
-                    case CEE_CONV_I8: result_type = tSystem_Int64; break;
-                    case CEE_CONV_U8: result_type = tSystem_Int64; break;
-                    case CEE_CONV_I: result_type = tSystem_IntPtr; break;
-                    case CEE_CONV_U: result_type = tSystem_IntPtr; break;
-                    case CEE_CONV_R4: result_type = tSystem_Single; break;
-                    case CEE_CONV_R8: result_type = tSystem_Double; break;
-                    default: CHECK_FAIL();
+                    // implicit conversion float->double
+                    MIR_reg_t value1_double_reg = new_temp_reg(ctx, tSystem_Double);
+                    MIR_append_insn(mir_ctx, mir_func,
+                                    MIR_new_insn(mir_ctx, MIR_F2D,
+                                                 MIR_new_reg_op(mir_ctx, value1_double_reg),
+                                                 MIR_new_reg_op(mir_ctx, value1_reg)));
+                    value1_reg = value1_double_reg;
                 }
-                CHECK_AND_RETHROW(stack_push(ctx, result_type, &result_reg));
-
-                MIR_insn_code_t code = MIR_INVALID_INSN;
-                switch (type_get_stack_type(type)) {
-                    case STACK_TYPE_INT32: {
-                        switch (opcode) {
-                            case CEE_CONV_I1: code = MIR_EXT8; break;
-                            case CEE_CONV_U1: code = MIR_UEXT8; break;
-                            case CEE_CONV_I2: code = MIR_EXT16; break;
-                            case CEE_CONV_U2: code = MIR_UEXT16; break;
-                            case CEE_CONV_I4: code = MIR_MOV; break;
-                            case CEE_CONV_U4: code = MIR_MOV; break;
-                            case CEE_CONV_I8: code = MIR_EXT32; break;
-                            case CEE_CONV_U8: code = MIR_UEXT32; break;
-                            case CEE_CONV_I: code = MIR_EXT32; break;
-                            case CEE_CONV_U: code = MIR_UEXT32; break;
-                            case CEE_CONV_R4: code = MIR_I2F; break;
-                            case CEE_CONV_R8: code = MIR_I2D; break;
-                            default: CHECK_FAIL();
-                        }
-                    } break;
+            } else if (value1_type == tSystem_Double) {
+                // always double math
+                code += 3;
 
-                    case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_INT64: {
-                        switch (opcode) {
-                            case CEE_CONV_I1: code = MIR_EXT8; break;
-                            case CEE_CONV_U1: code = MIR_UEXT8; break;
-                            case CEE_CONV_I2: code = MIR_EXT16; break;
-                            case CEE_CONV_U2: code = MIR_UEXT16; break;
-                            case CEE_CONV_I4: code = MIR_EXT32; break;
-                            case CEE_CONV_U4: code = MIR_UEXT32; break;
-                            case CEE_CONV_I8: code = MIR_MOV; break;
-                            case CEE_CONV_U8: code = MIR_MOV; break;
-                            case CEE_CONV_I: code = MIR_MOV; break;
-                            case CEE_CONV_U: code = MIR_MOV; break;
-                            case CEE_CONV_R4: code = MIR_I2F; break;
-                            case CEE_CONV_R8: code = MIR_I2D; break;
-                            default: CHECK_FAIL();
-                        }
-                    } break;
+                if (value2_type == tSystem_Single) {
+                    // implicit conversion float->double
+                    MIR_reg_t value2_double_reg = new_temp_reg(ctx, tSystem_Double);
+                    MIR_append_insn(mir_ctx, mir_func,
+                                    MIR_new_insn(mir_ctx, MIR_F2D,
+                                                 MIR_new_reg_op(mir_ctx, value2_double_reg),
+                                                 MIR_new_reg_op(mir_ctx, value2_reg)));
+                    value2_reg = value2_double_reg;
+                }
+            }
+        } break;
 
-                    case STACK_TYPE_FLOAT: {
-                        if (type_get_stack_type(result_type) == STACK_TYPE_INT32) {
-                            // we are converting from float to small
-                            // type, first convert to native int and
-                            // only then do a truncation
-                            MIR_append_insn(mir_ctx, mir_func,
-                                            MIR_new_insn(mir_ctx, type == tSystem_Single ? MIR_F2I : MIR_D2I,
-                                                         MIR_new_reg_op(mir_ctx, result_reg),
-                                                         MIR_new_reg_op(mir_ctx, reg)));
+        case STACK_TYPE_O: {
+            CHECK(type_get_stack_type(value2_type) == STACK_TYPE_O);
 
-                            // now our input is the result reg as well
-                            reg = result_reg;
-                        }
-                        switch (opcode) {
-                            case CEE_CONV_I1: code = MIR_EXT8; break;
-                            case CEE_CONV_U1: code = MIR_UEXT8; break;
-                            case CEE_CONV_I2: code = MIR_EXT16; break;
-                            case CEE_CONV_U2: code = MIR_UEXT16; break;
-                            case CEE_CONV_I4: code = MIR_EXT32; break;
-                            case CEE_CONV_U4: code = MIR_UEXT32; break;
-                            case CEE_CONV_I8: code = MIR_F2I; break;
-                            case CEE_CONV_U8: code = MIR_F2I; break;
-                            case CEE_CONV_I: code = MIR_F2I; break;
-                            case CEE_CONV_U: code = MIR_F2I; break;
-                            case CEE_CONV_R4: code = type == tSystem_Single ? MIR_FMOV : MIR_D2F; break;
-                            case CEE_CONV_R8: code = type == tSystem_Single ? MIR_F2D : MIR_DMOV; break;
-                            default: CHECK_FAIL();
-                        }
-                    } break;
+            CHECK(
+                code == MIR_EQ ||
+                code == MIR_BEQ ||
+                code == MIR_BNE
+            );
 
-                    case STACK_TYPE_O:
-                    case STACK_TYPE_VALUE_TYPE:
-                    case STACK_TYPE_REF:
-                        CHECK_FAIL();
-                }
+            // for interfaces convert them to the object pointer
+            if (type_is_interface(value1_type)) {
+                MIR_reg_t value1_ptr_reg = new_temp_reg(ctx, tSystem_Object);
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                             MIR_new_reg_op(mir_ctx, value1_ptr_reg),
+                                             MIR_new_mem_op(mir_ctx, MIR_T_P, 8, value1_reg, 0, 1)));
+                value1_reg = value1_ptr_reg;
+            }
 
+            if (type_is_interface(value2_type)) {
+                MIR_reg_t value2_ptr_reg = new_temp_reg(ctx, tSystem_Object);
                 MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, code,
-                                             MIR_new_reg_op(mir_ctx, result_reg),
-                                             MIR_new_reg_op(mir_ctx, reg)));
-            } break;
+                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                             MIR_new_reg_op(mir_ctx, value2_ptr_reg),
+                                             MIR_new_mem_op(mir_ctx, MIR_T_P, 8, value2_reg, 0, 1)));
+                value2_reg = value2_ptr_reg;
+            }
+        } break;
 
-            // TODO: if at jit time we know it is true/false then
-            //       we can remove the check, useful especially for
-            //       generic instances
-            case CEE_ISINST:
-            case CEE_CASTCLASS:
-            case CEE_UNBOX_ANY: {
-                MIR_reg_t obj_reg;
-                System_Type obj_type;
-                CHECK_AND_RETHROW(stack_pop(ctx, &obj_type, &obj_reg, NULL));
+        case STACK_TYPE_REF: {
+            CHECK(type_get_stack_type(value2_type) == STACK_TYPE_REF);
+        } break;
 
-                // the object type must always be a ref type for unboxing
-                CHECK(obj_type->StackType == STACK_TYPE_O);
+        // invalid comparisons
+        case STACK_TYPE_VALUE_TYPE:
+            CHECK_FAIL();
+    }
 
-                System_Type check_type = operand_type;
-                if (opcode != CEE_UNBOX_ANY) {
-                    // figure the result type, not needed for unbox
-                    if (operand_type->IsValueType) {
-                        // get it as a boxed type
-                        operand_type = get_boxed_type(operand_type);
-                    }
-                }
+    // emit common code
+    if (MIR_branch_code_p(code)) {
+        MIR_append_insn(mir_ctx, mir_func,
+                        MIR_new_insn(mir_ctx, code,
+                                     MIR_new_label_op(mir_ctx, label),
+                                     MIR_new_reg_op(mir_ctx, value1_reg),
+                                     MIR_new_reg_op(mir_ctx, value2_reg)));
+    } else {
+        MIR_append_insn(mir_ctx, mir_func,
+                        MIR_new_insn(mir_ctx, code,
+                                     MIR_new_reg_op(mir_ctx, result_reg),
+                                     MIR_new_reg_op(mir_ctx, value1_reg),
+                                     MIR_new_reg_op(mir_ctx, value2_reg)));
+    }
 
-                // push it, but now as the new type
-                MIR_reg_t obj2_reg;
-                CHECK_AND_RETHROW(stack_push(ctx, operand_type, &obj2_reg));
+cleanup:
+    return err;
+}
 
-                // temp for the cast result
-                MIR_reg_t cast_result_reg = new_temp_reg(ctx, tSystem_Boolean);
+/**
+ * Emit a binary operation, taking care of all the implicit casting that is needed to be done, and
+ * checking for specific edge cases on others.
+ *
+ * This also emits a divide by zero check if needed.
+ *
+ * If the operation is only allowed for integers then make sure to mark it as such
+ */
+static err_t jit_binary_numeric_operation(jit_method_context_t* ctx, MIR_insn_code_t code, bool integer_only) {
+    err_t err = NO_ERROR;
 
-                MIR_insn_t cast_success = MIR_new_label(mir_ctx);
+    MIR_reg_t value2_reg;
+    MIR_reg_t value1_reg;
+    MIR_reg_t result_reg;
+    System_Type value2_type;
+    System_Type value1_type;
+    CHECK_AND_RETHROW(stack_pop(ctx, &value2_type, &value2_reg, NULL));
+    CHECK_AND_RETHROW(stack_pop(ctx, &value1_type, &value1_reg, NULL));
 
-                // if this is an interface get the type instance itself
-                if (type_is_interface(obj_type)) {
+    stack_type_t value1_stacktype = type_get_stack_type(value1_type);
+    stack_type_t value2_stacktype = type_get_stack_type(value2_type);
+
+    if (code == MIR_LSH || code == MIR_RSH || code == MIR_URSH) {
+        // check the types are valid
+        CHECK(value1_stacktype == STACK_TYPE_INT32 || value1_stacktype == STACK_TYPE_INT64 || value1_stacktype == STACK_TYPE_INTPTR);
+        CHECK(value2_stacktype == STACK_TYPE_INT32 || value2_stacktype == STACK_TYPE_INTPTR);
+
+        // we are doing a 32bit operation
+        if (value1_stacktype == STACK_TYPE_INT32) {
+            code += 1;
+        }
+
+        // push the result
+        CHECK_AND_RETHROW(stack_push(ctx, value1_type, &result_reg));
+    } else {
+        if (code == MIR_DIV || code == MIR_UDIV || code == MIR_MOD || code == MIR_UMOD) {
+            MIR_insn_t label = MIR_new_label(mir_ctx);
+
+            // these need to check that value2 is not zero
+            // if we have a non-zero value then skip the throw
+            MIR_append_insn(mir_ctx, mir_func,
+                            MIR_new_insn(mir_ctx, MIR_BT,
+                                         MIR_new_label_op(mir_ctx, label),
+                                         MIR_new_reg_op(mir_ctx, value2_reg)));
+
+            // throw the error, it has an unknown type
+            CHECK_AND_RETHROW(jit_throw_new(ctx, tSystem_DivideByZeroException));
+
+            // insert the skip label
+            MIR_append_insn(mir_ctx, mir_func, label);
+        }
+
+        switch (type_get_stack_type(value1_type)) {
+            case STACK_TYPE_INT32: {
+                if (type_get_stack_type(value2_type) == STACK_TYPE_INT32) {
+                    // int32 x int32
+                    CHECK_AND_RETHROW(stack_push(ctx, tSystem_Int32, &result_reg));
+                    code += 1;
+                } else {
+                    // int32 x intptr
+                    CHECK(type_get_stack_type(value2_type) == STACK_TYPE_INTPTR);
+                    CHECK_AND_RETHROW(stack_push(ctx, tSystem_IntPtr, &result_reg));
+
+                    // sign extend the int32 to intptr
                     MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_insn(mir_ctx, MIR_MOV,
-                                                 MIR_new_reg_op(mir_ctx, obj_reg),
-                                                 MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*),
-                                                                obj_reg, 0, 1)));
+                                    MIR_new_insn(mir_ctx, MIR_UEXT32,
+                                                 MIR_new_reg_op(mir_ctx, value1_reg),
+                                                 MIR_new_reg_op(mir_ctx, value1_reg)));
                 }
+            } break;
 
-                // call the isinstance method to dynamically check the cast is valid
-                if (type_is_interface(check_type)) {
-                    // casting to an interface, use the dynamic_cast_obj_to_interface to do the cast
+            case STACK_TYPE_INT64: {
+                // int64 x int64
+                CHECK(type_get_stack_type(value2_type) == STACK_TYPE_INT64);
+                CHECK_AND_RETHROW(stack_push(ctx, tSystem_Int64, &result_reg));
+            } break;
+
+            case STACK_TYPE_INTPTR: {
+                CHECK_AND_RETHROW(stack_push(ctx, tSystem_IntPtr, &result_reg));
+
+                if (type_get_stack_type(value2_type) == STACK_TYPE_INT32) {
+                    // intptr x int32
+                    // sign extend
                     MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_call_insn(mir_ctx, 6,
-                                                      MIR_new_ref_op(mir_ctx, m_dynamic_cast_obj_to_interface_proto),
-                                                      MIR_new_ref_op(mir_ctx, m_dynamic_cast_obj_to_interface_func),
-                                                      MIR_new_reg_op(mir_ctx, cast_result_reg),
-                                                      MIR_new_reg_op(mir_ctx, obj2_reg),
-                                                      MIR_new_reg_op(mir_ctx, obj_reg),
-                                                      MIR_new_ref_op(mir_ctx, check_type->MirType)));
+                                    MIR_new_insn(mir_ctx, MIR_UEXT32,
+                                                 MIR_new_reg_op(mir_ctx, value2_reg),
+                                                 MIR_new_reg_op(mir_ctx, value2_reg)));
                 } else {
-                    // casting to an object, so everything is fine
-                    MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_call_insn(mir_ctx, 5,
-                                                      MIR_new_ref_op(mir_ctx, m_is_instance_proto),
-                                                      MIR_new_ref_op(mir_ctx, m_is_instance_func),
-                                                      MIR_new_reg_op(mir_ctx, cast_result_reg),
-                                                      MIR_new_reg_op(mir_ctx, obj_reg),
-                                                      MIR_new_ref_op(mir_ctx, check_type->MirType)));
+                    // intptr x intptr
+                    CHECK(type_get_stack_type(value2_type) == STACK_TYPE_INTPTR);
                 }
+            } break;
 
-                // check that it was a success
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_BT,
-                                             MIR_new_label_op(mir_ctx, cast_success),
-                                             MIR_new_reg_op(mir_ctx, cast_result_reg)));
+            case STACK_TYPE_FLOAT: {
+                // make sure this is not an integer only operation
+                CHECK(!integer_only);
 
-                // cast has failed
-                if (opcode == CEE_ISINST) {
-                    // for ISINST just return null, the dynamic cast already handles that
-                    // case for interfaces
-                    if (!type_is_interface(operand_type)) {
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_MOV,
-                                                     MIR_new_reg_op(mir_ctx, obj_reg),
-                                                     MIR_new_int_op(mir_ctx, 0)));
-                    }
-                } else {
-                    // for CLASSCAST throw an exception
-                    CHECK(opcode == CEE_CASTCLASS || opcode == CEE_UNBOX_ANY);
-                    CHECK_AND_RETHROW(jit_throw_new(ctx, tSystem_InvalidCastException));
-                }
-
-                MIR_append_insn(mir_ctx, mir_func, cast_success);
-
-                switch (type_get_stack_type(operand_type)) {
-                    case STACK_TYPE_O: {
-                        // interfaces are handled by the dynamic cast object to interface function so there
-                        // is nothing to do for them, for normal objects just move them to the obj2
-                        if (!type_is_interface(operand_type)) {
-                            MIR_append_insn(mir_ctx, mir_func,
-                                            MIR_new_insn(mir_ctx, MIR_MOV,
-                                                         MIR_new_reg_op(mir_ctx, obj2_reg),
-                                                         MIR_new_reg_op(mir_ctx, obj_reg)));
-                        }
-                    } break;
+                if (value1_type == tSystem_Single) {
+                    if (value2_type == tSystem_Single) {
+                        // float x float -> float
+                        CHECK_AND_RETHROW(stack_push(ctx, tSystem_Single, &result_reg));
+                        code += 2;
+                    } else {
+                        CHECK(value2_type == tSystem_Double);
 
-                    case STACK_TYPE_INT32:
-                    case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_INT64:
-                    case STACK_TYPE_FLOAT: {
-                        // store the item in the type
+                        // float x double
+                        // convert the float to a double
+                        CHECK_AND_RETHROW(stack_push(ctx, tSystem_Double, &result_reg));
                         MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, jit_number_inscode(operand_type),
-                                                     MIR_new_reg_op(mir_ctx, obj2_reg),
-                                                     MIR_new_mem_op(mir_ctx, get_mir_type(operand_type),
-                                                                    tSystem_Object->ManagedSize, obj_reg, 0, 1)));
-
-                    } break;
+                                        MIR_new_insn(mir_ctx, MIR_F2D,
+                                                     MIR_new_reg_op(mir_ctx, result_reg),
+                                                     MIR_new_reg_op(mir_ctx, value1_reg)));
+                        value1_reg = result_reg;
+                        code += 3;
+                    }
+                } else {
+                    CHECK(value1_type == tSystem_Double);
 
-                    case STACK_TYPE_VALUE_TYPE: {
-                        // memcpy it
+                    // this always results in a double math
+                    CHECK_AND_RETHROW(stack_push(ctx, tSystem_Double, &result_reg));
+                    code += 3;
 
-                        // first get the base for memcpy
+                    if (value2_type == tSystem_Single) {
+                        // double x float
+                        // convert the float to a double
                         MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_ADD,
-                                                     MIR_new_reg_op(mir_ctx, obj_reg),
-                                                     MIR_new_reg_op(mir_ctx, obj_reg),
-                                                     MIR_new_int_op(mir_ctx, tSystem_Object->ManagedSize)));
-
-                        // now emit the memcpy
-                        jit_emit_memcpy(ctx, obj2_reg, obj_reg, operand_type->ManagedSize);
-                    } break;
-
-                        // already handled in the castclass case
-                    case STACK_TYPE_REF:
-                        CHECK_FAIL();
+                                        MIR_new_insn(mir_ctx, MIR_F2D,
+                                                     MIR_new_reg_op(mir_ctx, result_reg),
+                                                     MIR_new_reg_op(mir_ctx, value2_reg)));
+                        value2_reg = result_reg;
+                    } else {
+                        CHECK(value2_type == tSystem_Double);
+                    }
                 }
             } break;
 
-            case CEE_BOX: {
-                System_Type val_type;
-                MIR_reg_t val_reg;
-                CHECK_AND_RETHROW(stack_pop(ctx, &val_type, &val_reg, NULL));
-
-                // make sure that this is fine
-                CHECK(type_is_verifier_assignable_to(val_type, operand_type));
+                // not allowed to do math on these
+            case STACK_TYPE_VALUE_TYPE:
+            case STACK_TYPE_O:
+            case STACK_TYPE_REF:
+                CHECK_FAIL();
+        }
+    }
 
-                System_Type boxed_type = get_boxed_type(val_type);
+    MIR_append_insn(mir_ctx, mir_func,
+                    MIR_new_insn(mir_ctx, code,
+                                 MIR_new_reg_op(mir_ctx, result_reg),
+                                 MIR_new_reg_op(mir_ctx, value1_reg),
+                                 MIR_new_reg_op(mir_ctx, value2_reg)));
 
-                // we track this as an object now
-                MIR_reg_t obj_reg;
-                CHECK_AND_RETHROW(stack_push(ctx, boxed_type, &obj_reg));
+cleanup:
+    return err;
+}
 
-                MIR_insn_t has_null_value = NULL;
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main jitter code
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-                // check if we need to allocate memory for this
-                if (operand_type->IsValueType) {
+/**
+ * This is the main jitting function, it takes a method and jits it completely
+ */
+err_t jit_method(jit_context_t* jctx, System_Reflection_MethodInfo method) {
+    err_t err = NO_ERROR;
 
-                    // if this is a nullable we need to check the HasValue field before
-                    // we actually try and box the value, since otherwise we return null
-                    if (operand_type->GenericTypeDefinition == tSystem_Nullable) {
-                        has_null_value = MIR_new_label(mir_ctx);
+    // setup the context for this method
+    jit_method_context_t _ctx = {
+        .ctx = jctx,
+        .method = method
+    };
+    jit_method_context_t* ctx = &_ctx;
 
-                        // zero out the obj_reg, so we can just skip the allocation if its null
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_MOV,
-                                                     MIR_new_reg_op(mir_ctx, obj_reg),
-                                                     MIR_new_int_op(mir_ctx, 0)));
+    System_Reflection_MethodBody body = method->MethodBody;
+    System_Reflection_Assembly assembly = method->Module->Assembly;
 
-                        // check if the HasValue is zero, if so then jump over
-                        // the allocation and the value copy
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_BF,
-                                                     MIR_new_label_op(mir_ctx, has_null_value),
-                                                     MIR_new_mem_op(mir_ctx, MIR_T_I8,
-                                                                    offsetof(System_Nullable, HasValue),
-                                                                    val_reg, 0, 1)));
-                    }
+    strbuilder_t method_name = strbuilder_new();
+    method_print_full_name(method, &method_name);
 
-                    // allocate it
-                    CHECK_AND_RETHROW(jit_new(ctx, obj_reg, operand_type,
-                                              MIR_new_int_op(mir_ctx, tSystem_Object->ManagedSize + val_type->ManagedSize)));
-                }
+#ifdef JIT_TRACE
+    strbuilder_t ret_type_name = strbuilder_new();
+    type_print_full_name(method->ReturnType, &ret_type_name);
 
-                // must be a value type
-                switch (type_get_stack_type(operand_type)) {
-                    case STACK_TYPE_O: {
-                        // return unchanged
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_MOV,
-                                                     MIR_new_reg_op(mir_ctx, obj_reg),
-                                                     MIR_new_reg_op(mir_ctx, val_reg)));
-                    } break;
+    TRACE(".method %s %s %s %s",
+          method_access_str(method_get_access(method)),
+          method_is_static(method) ? "static" : "instance",
+          strbuilder_get(&ret_type_name),
+          strbuilder_get(&method_name));
+    strbuilder_free(&ret_type_name);
 
-                    case STACK_TYPE_INT32:
-                    case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_INT64:
-                    case STACK_TYPE_FLOAT: {
-                        // store the item in the type
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, jit_number_inscode(operand_type),
-                                                     MIR_new_mem_op(mir_ctx, get_mir_type(operand_type),
-                                                                    tSystem_Object->ManagedSize, obj_reg, 0, 1),
-                                                     MIR_new_reg_op(mir_ctx, val_reg)));
+    TRACE("{");
+    TRACE("\t.maxstack %d", body->MaxStackSize);
+#endif
 
-                    } break;
+    // variables
+    MIR_op_t* locals = NULL;
 
-                    case STACK_TYPE_VALUE_TYPE: {
-                        // memcpy it
-                        MIR_reg_t memcpy_base_reg = new_temp_reg(ctx, tSystem_Object);
+    // jump table dynamic array
+    MIR_op_t *switch_ops = NULL;
 
-                        // first get the base for memcpy
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_ADD,
-                                                     MIR_new_reg_op(mir_ctx, memcpy_base_reg),
-                                                     MIR_new_reg_op(mir_ctx, obj_reg),
-                                                     MIR_new_int_op(mir_ctx, tSystem_Object->ManagedSize)));
+    // Create the exception handling reg
+    ctx->exception_reg = MIR_new_func_reg(mir_ctx, mir_func->u.func, MIR_T_I64, "exception");
 
-                        int offset = -1;
-                        if (has_null_value != NULL) {
-                            // find the offset of the Value field inside the Nullable instance
-                            for (int i = 0; i < val_type->Fields->Length; i++) {
-                                System_Reflection_FieldInfo field = val_type->Fields->Data[i];
-                                if (string_equals_cstr(field->Name, "_value")) {
-                                    offset = field->MemoryOffset;
-                                }
-                            }
-                            CHECK(offset != -1);
+    // get the return block register, if any
+    MIR_reg_t return_block_reg = 0;
+    if (method->ReturnType != NULL && get_mir_type(method->ReturnType) == MIR_T_BLK) {
+        return_block_reg = MIR_reg(mir_ctx, "return_block", mir_func->u.func);
+    }
 
-                            // this is a nullable, we need to skip the first
-                            // element when copying over
-                            MIR_append_insn(mir_ctx, mir_func,
-                                            MIR_new_insn(mir_ctx, MIR_ADD,
-                                                         MIR_new_reg_op(mir_ctx, val_reg),
-                                                         MIR_new_reg_op(mir_ctx, val_reg),
-                                                         MIR_new_int_op(mir_ctx, offset)));
-                        } else {
-                            offset = 0;
-                        }
+#ifdef JIT_TRACE
+    if (body->LocalVariables->Length > 0) {
+        TRACE("\t.locals %s(", body->InitLocals ? "init " : "");
+    }
+#endif
 
-                        // now emit the memcpy
-                        jit_emit_memcpy(ctx, memcpy_base_reg, val_reg, operand_type->ManagedSize - offset);
-                    } break;
+    // actually create locals
+    for (int i = 0; i < body->LocalVariables->Length; i++) {
+        System_Reflection_LocalVariableInfo variable = body->LocalVariables->Data[i];
+        CHECK(variable->LocalIndex == i);
 
-                    case STACK_TYPE_REF:
-                        CHECK_FAIL();
-                }
+#ifdef JIT_TRACE
+        strbuilder_t local_type_name = strbuilder_new();
+        type_print_full_name(variable->LocalType, &local_type_name);
+        TRACE("\t\t[%d] %s%s", i, strbuilder_get(&local_type_name), i == body->LocalVariables->Length - 1 ? "" : ",");
+        strbuilder_free(&local_type_name);
+#endif
 
-                if (has_null_value != NULL) {
-                    // we had a null value, went to here
-                    MIR_append_insn(mir_ctx, mir_func, has_null_value);
-                }
-            } break;
+        // prepare the variable type
+        CHECK_AND_RETHROW(jit_prepare_type(ctx->ctx, variable->LocalType));
 
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            // Indirect reference access
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+        // we are going to initialize all of the variables
+        char name[64] = { 0 };
+        snprintf(name, sizeof(name), "var%d", i);
+        MIR_reg_t reg = MIR_new_func_reg(mir_ctx, mir_func->u.func, MIR_T_I64, name);
+        arrpush(locals, MIR_new_reg_op(mir_ctx, reg));
 
-            case CEE_LDIND_I1: operand_type = tSystem_SByte; goto cee_ldind;
-            case CEE_LDIND_U1: operand_type = tSystem_Byte; goto cee_ldind;
-            case CEE_LDIND_I2: operand_type = tSystem_Int16; goto cee_ldind;
-            case CEE_LDIND_U2: operand_type = tSystem_UInt16; goto cee_ldind;
-            case CEE_LDIND_I4: operand_type = tSystem_Int32; goto cee_ldind;
-            case CEE_LDIND_U4: operand_type = tSystem_UInt32; goto cee_ldind;
-            case CEE_LDIND_I8: operand_type = tSystem_Int64; goto cee_ldind;
-            case CEE_LDIND_I: operand_type = tSystem_IntPtr; goto cee_ldind;
-            case CEE_LDIND_R4: operand_type = tSystem_Single; goto cee_ldind;
-            case CEE_LDIND_R8: operand_type = tSystem_Double; goto cee_ldind;
-            case CEE_LDIND_REF: operand_type = NULL; goto cee_ldind;
-            case CEE_LDOBJ: goto cee_ldind;
-            cee_ldind: {
-                // pop all the values from the stack
-                MIR_reg_t addr_reg;
-                System_Type addr_type;
-                CHECK_AND_RETHROW(stack_pop(ctx, &addr_type, &addr_reg, NULL));
-
-                // this must be an array
-                CHECK(addr_type->IsByRef);
+        // allocate the stack memory
+        MIR_append_insn(mir_ctx, mir_func,
+                        MIR_new_insn(mir_ctx, MIR_ALLOCA,
+                                     MIR_new_reg_op(mir_ctx, reg),
+                                     MIR_new_int_op(mir_ctx, variable->LocalType->StackSize)));
 
-                MIR_reg_t value_reg;
+        switch (variable->LocalType->StackType) {
+            case STACK_TYPE_O:
+            case STACK_TYPE_INT32:
+            case STACK_TYPE_INT64:
+            case STACK_TYPE_REF:
+            case STACK_TYPE_INTPTR: {
+                // interface is a fat pointer, so treat it like a value type
+                if (type_is_interface(variable->LocalType)) {
+                    goto init_local_value_type;
+                }
+                locals[i] = MIR_new_mem_op(mir_ctx, get_mir_type(variable->LocalType), 0, reg, 0, 1);
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                             locals[i],
+                                             MIR_new_int_op(mir_ctx, 0)));
+            } break;
 
-                // for anything which is not ldelem.ref we know the operand_type
-                // from the array
-                if (operand_type != NULL) {
-                    CHECK(type_is_verifier_assignable_to(addr_type->BaseType, operand_type));
-                    CHECK_AND_RETHROW(stack_push(ctx, type_get_intermediate_type(operand_type), &value_reg));
+            case STACK_TYPE_FLOAT: {
+                locals[i] = MIR_new_mem_op(mir_ctx, get_mir_type(variable->LocalType), 0, reg, 0, 1);
+                if (variable->LocalType == tSystem_Single) {
+                    MIR_append_insn(mir_ctx, mir_func,
+                                    MIR_new_insn(mir_ctx, MIR_FMOV,
+                                                 locals[i],
+                                                 MIR_new_float_op(mir_ctx, 0.0f)));
                 } else {
-                    // the type is gotten from the array
-                    operand_type = addr_type->BaseType;
-                    CHECK_AND_RETHROW(stack_push(ctx, type_get_verification_type(operand_type), &value_reg));
+                    ASSERT(variable->LocalType == tSystem_Double);
+                    MIR_append_insn(mir_ctx, mir_func,
+                                    MIR_new_insn(mir_ctx, MIR_DMOV,
+                                                 locals[i],
+                                                 MIR_new_double_op(mir_ctx, 0.0)));
                 }
+            } break;
 
-                switch (type_get_stack_type(operand_type)) {
-                    case STACK_TYPE_O: {
-                        if (type_is_interface(operand_type)) {
-                            goto ldind_value_type;
-                        } else {
-                            goto ldind_primitive_type;
-                        }
-                    } break;
-
-                    ldind_primitive_type:
-                    case STACK_TYPE_INT32:
-                    case STACK_TYPE_INT64:
-                    case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_FLOAT: {
-                        // we need to extend this properly if the field is smaller
-                        // than an int32 (because we are going to load into an int32
-                        // essentially)
-                        MIR_insn_code_t code = MIR_MOV;
-                        if (operand_type == tSystem_SByte || operand_type == tSystem_Boolean) {
-                            code = MIR_EXT8;
-                        } else if (operand_type == tSystem_Byte) {
-                            code = MIR_UEXT8;
-                        } else if (operand_type == tSystem_Int16) {
-                            code = MIR_EXT16;
-                        } else if (operand_type == tSystem_UInt16 || operand_type == tSystem_Char) {
-                            code = MIR_UEXT16;
-                        } else if (operand_type == tSystem_Single) {
-                            code = MIR_FMOV;
-                        } else if (operand_type == tSystem_Single) {
-                            code = MIR_DMOV;
-                        }
-
-                        // we can copy this in a single mov
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, code,
-                                                     MIR_new_reg_op(mir_ctx, value_reg),
-                                                     MIR_new_mem_op(mir_ctx, get_mir_type(operand_type),
-                                                                    0, addr_reg, 0, 1)));
-                    } break;
-
-                    ldind_value_type:
-                    case STACK_TYPE_VALUE_TYPE: {
-                        jit_emit_memcpy(ctx, value_reg, addr_reg, operand_type->StackSize);
-                    } break;
-
-                    case STACK_TYPE_REF:
-                        CHECK_FAIL();
-                }
+            init_local_value_type:
+            case STACK_TYPE_VALUE_TYPE: {
+                jit_emit_zerofill(ctx, reg, variable->LocalType->StackSize);
             } break;
+        }
+    }
 
-            case CEE_STIND_REF: operand_type = NULL; goto cee_stind;
-            case CEE_STIND_I1: operand_type = tSystem_SByte; goto cee_stind;
-            case CEE_STIND_I2: operand_type = tSystem_Int16; goto cee_stind;
-            case CEE_STIND_I4: operand_type = tSystem_Int32; goto cee_stind;
-            case CEE_STIND_I8: operand_type = tSystem_Int64; goto cee_stind;
-            case CEE_STIND_R4: operand_type = tSystem_Single; goto cee_stind;
-            case CEE_STIND_R8: operand_type = tSystem_Double; goto cee_stind;
-            case CEE_STOBJ: goto cee_stind;
-            cee_stind: {
-                // pop all the values from the stack
-                stack_entry_t addr_entry;
-                MIR_reg_t value_reg;
-                MIR_reg_t addr_reg;
-                System_Type value_type;
-                System_Type addr_type;
-                CHECK_AND_RETHROW(stack_pop(ctx, &value_type, &value_reg, NULL));
-                CHECK_AND_RETHROW(stack_pop(ctx, &addr_type, &addr_reg, &addr_entry));
+#ifdef JIT_TRACE
+    if (body->LocalVariables->Length > 0) {
+        TRACE("\t)");
+    }
+#endif
 
-                // this must be an array
-                CHECK(addr_type->IsByRef);
-                CHECK(!addr_entry.readonly_ref);
+    // TODO: we need to validate that all branch targets and that all the
+    //       try and handler offsets are actually in valid instructions and
+    //       not in the middle of instructions
 
-                // for stind.ref the operand type is the same as the
-                // byref itself
-                if (operand_type == NULL) {
-                    operand_type = addr_type->BaseType;
-                }
+    // prepare the stacks at certain points for exception handling
+    bool created_first_entry = false;
+    for (int i = 0; i < body->ExceptionHandlingClauses->Length; i++) {
+        System_Reflection_ExceptionHandlingClause clause = body->ExceptionHandlingClauses->Data[i];
 
-                // validate all the type stuff
-                CHECK(type_is_verifier_assignable_to(value_type, operand_type));
+        // create the stack location
+        MIR_label_t label = MIR_new_label(mir_ctx);
+        stack_snapshot_t snapshot = {
+            .key = clause->HandlerOffset,
+            .label = label,
+            .stack = { .entries = NULL },
+            .ireg_depth = 0,
+            .freg_depth = 0,
+            .dreg_depth = 0,
+        };
 
-                switch (type_get_stack_type(value_type)) {
-                    case STACK_TYPE_O: {
-                        if (type_is_interface(operand_type)) {
-                            if (type_is_interface(value_type)) {
-                                // interface -> interface
-                                goto stind_value_type;
-                            } else {
-                                // object -> interface
+        if (clause->Flags == COR_ILEXCEPTION_CLAUSE_EXCEPTION) {
+            CHECK_AND_RETHROW(jit_prepare_type(ctx->ctx, clause->CatchType));
 
-                                // from an object, cast required, need a write barrier
-                                CHECK_AND_RETHROW(jit_cast_obj_to_interface(ctx,
-                                                                            addr_reg, value_reg,
-                                                                            value_type, operand_type));
-                            }
-                        } else {
-                            // check if we need to cast to an object from an interface
-                            if (type_is_interface(value_type)) {
-                                MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                                             MIR_new_reg_op(mir_ctx, value_reg),
-                                                             MIR_new_mem_op(mir_ctx, MIR_T_P,
-                                                                            sizeof(void*), value_reg,
-                                                                            0, 1)));
-                            }
+            // this is an exception caluse, we need to have the exception pushed on the stack
+            // prepare it
+            arrpush(snapshot.stack.entries, (stack_entry_t) { .type = clause->CatchType });
+            snapshot.ireg_depth++;
+            if (!created_first_entry) {
+                // create the first stack entry just in case, we are going to create a reg
+                // and pop it right away since we don't actually want to have it pushed
+                // right now, we just wanna make sure that the stack location exists
+                push_new_reg(ctx, tSystem_Object, false);
+                ctx->ireg.depth--;
+                created_first_entry = true;
+            }
+        }
 
-                            // storing to an object from an object
-                            MIR_append_insn(mir_ctx, mir_func,
-                                            MIR_new_call_insn(mir_ctx, 4,
-                                                              MIR_new_ref_op(mir_ctx, m_gc_update_ref_proto),
-                                                              MIR_new_ref_op(mir_ctx, m_gc_update_ref_func),
-                                                              MIR_new_reg_op(mir_ctx, addr_reg),
-                                                              MIR_new_reg_op(mir_ctx, value_reg)));
-                        }
-                    } break;
+        // now put it in
+        hmputs(ctx->pc_to_stack_snapshot, snapshot);
 
-                    case STACK_TYPE_INT32:
-                    case STACK_TYPE_INT64:
-                    case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_FLOAT: {
-                        MIR_insn_code_t code = jit_number_cast_inscode(value_type, operand_type);
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, code,
-                                                     MIR_new_mem_op(mir_ctx, get_mir_type(operand_type),
-                                                                    0, addr_reg, 0, 1),
-                                                     MIR_new_reg_op(mir_ctx, value_reg)));
-                    } break;
+        // add to label lookup
+        hmput(ctx->clause_to_label, clause, label);
+    }
 
-                    stind_value_type:
-                    case STACK_TYPE_VALUE_TYPE: {
-                        // copying into a managed pointer, use the managed ref memcpy
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_call_insn(mir_ctx, 5,
-                                                          MIR_new_ref_op(mir_ctx, m_managed_ref_memcpy_proto),
-                                                          MIR_new_ref_op(mir_ctx, m_managed_ref_memcpy_func),
-                                                          MIR_new_reg_op(mir_ctx, addr_reg),
-                                                          MIR_new_ref_op(mir_ctx, operand_type->MirType),
-                                                          MIR_new_reg_op(mir_ctx, value_reg)));
-                    } break;
+    // poll on entry, so deep recursion without loops still gets to a safepoint
+    jit_emit_load_preempt_flag(ctx);
+    jit_emit_safepoint_poll(ctx);
 
-                    case STACK_TYPE_REF:
-                        CHECK_FAIL("wtf");
-                }
-            } break;
+    // count the calls so hot methods get promoted
+    if (m_jit_tiered) {
+        CHECK_AND_RETHROW(jit_emit_tier_counter(ctx));
+    }
 
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            // Comparison and branching
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // find where we can skip range and null checks
+    jit_analyze_il(ctx, body);
 
-            case CEE_CEQ: CHECK_AND_RETHROW(jit_compare_branch(ctx, -1, MIR_EQ)); break;
-            case CEE_CGT: CHECK_AND_RETHROW(jit_compare_branch(ctx, -1, MIR_GT)); break;
-            case CEE_CGT_UN: CHECK_AND_RETHROW(jit_compare_branch(ctx, -1, MIR_UGT)); break;
-            case CEE_CLT: CHECK_AND_RETHROW(jit_compare_branch(ctx, -1, MIR_LT)); break;
-            case CEE_CLT_UN: CHECK_AND_RETHROW(jit_compare_branch(ctx, -1, MIR_ULT)); break;
+#ifdef JIT_TRACE
+    int jit_trace_indent = 4;
+#endif
 
-            // unconditional branch
-            case CEE_BR:
-            case CEE_BR_S: {
-                // get the label
-                MIR_label_t label;
-                CHECK_AND_RETHROW(jit_branch_point(ctx, operand_i32, &label));
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_JMP,
-                                             MIR_new_label_op(mir_ctx, label)));
-            } break;
-
-            // branch false/true
-            case CEE_BRFALSE:
-            case CEE_BRFALSE_S:
-            case CEE_BRTRUE:
-            case CEE_BRTRUE_S: {
-                // get the value
-                MIR_reg_t value_reg;
-                System_Type value_type;
-                CHECK_AND_RETHROW(stack_pop(ctx, &value_type, &value_reg, NULL));
-
-                // get the label
-                MIR_label_t label;
-                CHECK_AND_RETHROW(jit_branch_point(ctx, operand_i32, &label));
+    //
+    // The main loop for decoding and jitting opcodes
+    //
+    opcode_control_flow_t last_cf = OPCODE_CONTROL_FLOW_INVALID;
+    opcode_t last_opcode = CEE_INVALID;
+    System_Reflection_MethodInfo ftnMethod = NULL;
+    System_Type constrainedType = NULL;
+    int il_ptr = 0;
+    while (il_ptr < body->Il->Length) {
 
-                // emit it properly
-                MIR_insn_code_t code;
-                if (opcode == CEE_BRFALSE || opcode == CEE_BRFALSE_S) {
-                    code = MIR_BF;
-                } else {
-                    code = MIR_BT;
-                }
+        //--------------------------------------------------------------------------------------------------------------
+        // Control flow and stack verification
+        //--------------------------------------------------------------------------------------------------------------
 
-                switch (type_get_stack_type(value_type)) {
-                    // for 32bit we want the 32bit op
-                    case STACK_TYPE_INT32:
-                        code += 1;
+        // store the start of the instruction for others to use
+        ctx->il_offset = il_ptr;
 
-                    case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_INT64:
-                    case STACK_TYPE_REF:
-                    case STACK_TYPE_O: {
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, code,
-                                                     MIR_new_label_op(mir_ctx, label),
-                                                     MIR_new_reg_op(mir_ctx, value_reg)));
-                    } break;
+        // create a snapshot of the stack, if we already have a snapshot
+        // of this verify it is the same (we will get a snapshot if we have
+        // a forward jump)
+        MIR_insn_t cur_label;
+        int stacki = hmgeti(ctx->pc_to_stack_snapshot, ctx->il_offset);
 
-                    case STACK_TYPE_VALUE_TYPE:
-                    case STACK_TYPE_FLOAT:
-                        CHECK_FAIL();
-                }
-            } break;
+        if (
+            last_cf == OPCODE_CONTROL_FLOW_BRANCH ||
+            last_cf == OPCODE_CONTROL_FLOW_THROW
+        ) {
+            // control changed by a jump or an exception, this stack can not be full, but rather must
+            // be empty or be whatever the stack is already set to be at this point
+            if (stacki == -1) {
+                // create a new empty stack
+                arrfree(ctx->stack.entries);
+                ctx->ireg.depth = 0;
+                ctx->freg.depth = 0;
+                ctx->dreg.depth = 0;
+            } else {
+                // copy the stack to the current stack
+                stack_copy(ctx, &ctx->pc_to_stack_snapshot[stacki].stack);
+                ctx->ireg.depth = ctx->pc_to_stack_snapshot[stacki].ireg_depth;
+                ctx->freg.depth = ctx->pc_to_stack_snapshot[stacki].freg_depth;
+                ctx->dreg.depth = ctx->pc_to_stack_snapshot[stacki].dreg_depth;
+            }
+        }
 
-            // all the different compare and branch instructions
-            case CEE_BEQ:
-            case CEE_BEQ_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_BEQ)); break;
-            case CEE_BGE:
-            case CEE_BGE_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_BGE)); break;
-            case CEE_BGT:
-            case CEE_BGT_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_BGT)); break;
-            case CEE_BLE:
-            case CEE_BLE_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_BLE)); break;
-            case CEE_BLT:
-            case CEE_BLT_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_BLT)); break;
-            case CEE_BNE_UN:
-            case CEE_BNE_UN_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_BNE)); break;
-            case CEE_BGE_UN:
-            case CEE_BGE_UN_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_UBGE)); break;
-            case CEE_BGT_UN:
-            case CEE_BGT_UN_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_UBGT)); break;
-            case CEE_BLE_UN:
-            case CEE_BLE_UN_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_UBLE)); break;
-            case CEE_BLT_UN:
-            case CEE_BLT_UN_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_UBLT)); break;
+        if (stacki != -1) {
+            // verify it is the same
+            stack_t snapshot = ctx->pc_to_stack_snapshot[stacki].stack;
+            cur_label = ctx->pc_to_stack_snapshot[stacki].label;
+            CHECK_AND_RETHROW(stack_merge(ctx, &snapshot, true));
+        } else {
+            // take snapshot
+            cur_label = MIR_new_label(mir_ctx);
+            stack_snapshot_t snapshot = {
+                .key = ctx->il_offset,
+                .label = cur_label,
+                .stack = stack_snapshot(ctx),
+                .ireg_depth = ctx->ireg.depth,
+                .freg_depth = ctx->freg.depth,
+                .dreg_depth = ctx->dreg.depth
+            };
+            hmputs(ctx->pc_to_stack_snapshot, snapshot);
+        }
+        MIR_append_insn(mir_ctx, mir_func, cur_label);
 
-            // switch
-            case CEE_SWITCH: {
-                MIR_reg_t value_reg;
-                System_Type value_type;
-                CHECK_AND_RETHROW(stack_pop(ctx, &value_type, &value_reg, NULL));
+        // other paths may have pushed anything, so forget where the values came from,
+        // and anything we knew about the variables
+        if (
+            hmgeti(ctx->branch_targets, ctx->il_offset) != -1 ||
+            last_cf == OPCODE_CONTROL_FLOW_BRANCH ||
+            last_cf == OPCODE_CONTROL_FLOW_THROW ||
+            last_cf == OPCODE_CONTROL_FLOW_RETURN
+        ) {
+            for (int i = 0; i < arrlen(ctx->stack.entries); i++) {
+                ctx->stack.entries[i].source = 0;
+                ctx->stack.entries[i].non_null = false;
+            }
+            arrsetlen(ctx->non_null_sources, 0);
+        }
 
-                // allocate enough space for the ops
-                switch_ops = realloc(switch_ops, (operand_switch_n + 1) * sizeof(MIR_op_t));
+        // validate the control flow from the previous instruction, we can not have anything that
+        // continues to enter a handler block
+        for (int i = 0; i < body->ExceptionHandlingClauses->Length; i++) {
+            System_Reflection_ExceptionHandlingClause clause = body->ExceptionHandlingClauses->Data[i];
 
-                // branch selector
-                switch_ops[0] = MIR_new_reg_op(mir_ctx, value_reg);
+#ifdef JIT_TRACE
+            if (clause->TryOffset == ctx->il_offset) {
+                TRACE("%*s.try %d", jit_trace_indent, "", i);
+                TRACE("%*s{", jit_trace_indent, "");
+                jit_trace_indent += 4;
+            } else if (clause->TryOffset + clause->TryLength == ctx->il_offset) {
+                jit_trace_indent -= 4;
+                TRACE("%*s} // end .try", jit_trace_indent, "");
+            }
 
-                // all the locations
-                for (int i = 0; i < operand_switch_n; i++) {
-                    MIR_label_t label;
-                    CHECK_AND_RETHROW(jit_branch_point(ctx, il_ptr + operand_switch_dests[i], &label));
-                    switch_ops[i + 1] = MIR_new_label_op(mir_ctx, label);
+            if (clause->HandlerOffset == ctx->il_offset) {
+                if (clause->Flags == COR_ILEXCEPTION_CLAUSE_EXCEPTION) {
+                    TRACE("%*scatch %U.%U", jit_trace_indent, "", clause->CatchType->Namespace, clause->CatchType->Name);
+                } else if (clause->Flags == COR_ILEXCEPTION_CLAUSE_FINALLY) {
+                    TRACE("%*sfinally", jit_trace_indent, "");
+                } else if (clause->Flags == COR_ILEXCEPTION_CLAUSE_FAULT) {
+                    TRACE("%*sfault", jit_trace_indent, "");
+                } else if (clause->Flags == COR_ILEXCEPTION_CLAUSE_FAULT) {
+                    TRACE("%*sfilter", jit_trace_indent, "");
                 }
+                TRACE("%*s{", jit_trace_indent, "");
+                jit_trace_indent += 4;
+            } else if (clause->HandlerOffset + clause->HandlerLength == ctx->il_offset) {
+                jit_trace_indent -= 4;
+                TRACE("%*s} // end handler", jit_trace_indent, "");
+            }
+#endif
 
-                // setup the not taken label
-                MIR_label_t not_taken = MIR_new_label(mir_ctx);
+            if (
+                clause->HandlerOffset == ctx->il_offset ||
+                clause->HandlerOffset + clause->HandlerLength == ctx->il_offset ||
+                clause->TryOffset + clause->TryLength == ctx->il_offset
+            ) {
+                // entry to handler can only happen from exception, so
+                // we can't have any instruction that goes next, that is
+                // the same for exiting from handler or protected block
+                CHECK(
+                    last_cf == OPCODE_CONTROL_FLOW_BRANCH ||
+                    last_cf == OPCODE_CONTROL_FLOW_THROW ||
+                    last_cf == OPCODE_CONTROL_FLOW_RETURN
+                );
+            }
+        }
 
-                // if the value is invalid then don't take the route and
-                // go to the default case
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_BGE,
-                                             MIR_new_label_op(mir_ctx, not_taken),
-                                             MIR_new_reg_op(mir_ctx, value_reg),
-                                             MIR_new_int_op(mir_ctx, operand_switch_n)));
+        //--------------------------------------------------------------------------------------------------------------
+        // Opcode decoding
+        //--------------------------------------------------------------------------------------------------------------
 
-                // do the switch itself
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn_arr(mir_ctx, MIR_SWITCH,
-                                                 operand_switch_n + 1, switch_ops));
+        // get the opcode value
+        uint16_t opcode_value = (REFPRE << 8) | body->Il->Data[il_ptr++];
 
-                MIR_append_insn(mir_ctx, mir_func, not_taken);
-            } break;
+        // get the actual opcode
+        opcode_t opcode = g_dotnet_opcode_lookup[opcode_value];
+        CHECK_ERROR(opcode != CEE_INVALID, ERROR_INVALID_OPCODE);
 
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            // Exception control flow
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+        // handle opcodes with special prefix
+        if (
+            opcode == CEE_PREFIX1 ||
+            opcode == CEE_PREFIX2 ||
+            opcode == CEE_PREFIX3 ||
+            opcode == CEE_PREFIX4 ||
+            opcode == CEE_PREFIX5 ||
+            opcode == CEE_PREFIX6 ||
+            opcode == CEE_PREFIX7
+        ) {
+            CHECK(il_ptr + 1 <= body->Il->Length);
 
-            case CEE_THROW: {
-                // get the return argument
-                MIR_reg_t obj_reg;
-                System_Type obj_type;
-                CHECK_AND_RETHROW(stack_pop(ctx, &obj_type, &obj_reg, NULL));
+            // setup the new prefix
+            opcode_value <<= 8;
+            opcode_value |= body->Il->Data[il_ptr++];
+            opcode = g_dotnet_opcode_lookup[opcode_value];
+            CHECK_ERROR(opcode != CEE_INVALID, ERROR_INVALID_OPCODE);
+        }
 
-                // free this entirely
-                arrfree(ctx->stack.entries);
-                ctx->ireg.depth = 0;
-                ctx->freg.depth = 0;
-                ctx->dreg.depth = 0;
+        // get the opcode info
+        opcode_info_t* opcode_info = &g_dotnet_opcodes[opcode];
 
-                // check the object is not null
-                CHECK_AND_RETHROW(jit_null_check(ctx, obj_reg, obj_type));
+#ifdef JIT_TRACE
+        printf("[*] %*sIL_%04x: %s ", jit_trace_indent, "", ctx->il_offset, opcode_info->name);
+#endif
 
-                // append the instruction itself
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                             MIR_new_reg_op(mir_ctx, ctx->exception_reg),
-                                             MIR_new_reg_op(mir_ctx, obj_reg)));
+        // set the last control flow to this one
+        last_cf = opcode_info->control_flow;
 
-                // throw it
-                CHECK_AND_RETHROW(jit_throw(ctx, obj_type));
+        //--------------------------------------------------------------------------------------------------------------
+        // Handle operands of the opcode
+        //--------------------------------------------------------------------------------------------------------------
+
+        token_t operand_token = { 0 };
+        int32_t operand_i32 = 0;
+        int64_t operand_i64 = 0;
+        System_Reflection_FieldInfo operand_field = NULL;
+        System_Reflection_MethodInfo operand_method = NULL;
+        float operand_f32 = 0;
+        double operand_f64 = 0;
+        System_Type operand_type = NULL;
+        System_String operand_string = NULL;
+        uint32_t operand_switch_n = 0;
+        int32_t* operand_switch_dests = NULL;
+
+        switch (opcode_info->operand) {
+            case OPCODE_OPERAND_InlineBrTarget: {
+                operand_i32 = *(int32_t*)&body->Il->Data[il_ptr];
+                il_ptr += sizeof(int32_t);
+                operand_i32 += il_ptr;
+
+#ifdef JIT_TRACE
+                printf("IL_%04x", operand_i32);
+#endif
             } break;
 
-            case CEE_LEAVE:
-            case CEE_LEAVE_S: {
-                // resolve the label
-                MIR_label_t target_label;
-                CHECK_AND_RETHROW(jit_resolve_branch(ctx, operand_i32, &target_label));
+            case OPCODE_OPERAND_InlineField: {
+                // fetch it
+                token_t value = *(token_t*)&body->Il->Data[il_ptr];
+                il_ptr += sizeof(token_t);
 
-                int last_clausi = -1;
+                // resolve it
+                CHECK_AND_RETHROW(assembly_get_field_by_token(assembly, value, method->DeclaringType->GenericArguments,
+                                                              method->GenericArguments, &operand_field));
+                CHECK(operand_field != NULL);
 
-                // we found a leave, we are going to find every finally clause that we are in, and build
-                // up a chain of where to go next, if we already have a clause with an entry to go to, we
-                // are going to make sure it goes to the same place
-                bool in_a_protected_block = false;
-                System_Reflection_ExceptionHandlingClause_Array exceptions = body->ExceptionHandlingClauses;
-                for (int i = 0; i < exceptions->Length; i++) {
-                    System_Reflection_ExceptionHandlingClause clause = exceptions->Data[i];
+#ifdef JIT_TRACE
+                strbuilder_t type_name = strbuilder_new();
+                type_print_full_name(operand_field->DeclaringType, &type_name);
+                printf("%s::%U", strbuilder_get(&type_name), operand_field->Name);
+                strbuilder_free(&type_name);
+#endif
 
-                    if (clause->HandlerOffset <= ctx->il_offset && ctx->il_offset < clause->HandlerOffset + clause->HandlerLength) {
-                        // we are in a handler region, this means that the exception has been dealt with and
-                        // we should clear it out so the finally nodes won't think that it might need to do
-                        // something with it
-                        in_a_protected_block = true;
+                // check we can access it
+                CHECK(check_field_accessibility(method, operand_field));
 
-                        // reset the exception value
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_MOV,
-                                                     MIR_new_reg_op(mir_ctx, ctx->exception_reg),
-                                                     MIR_new_int_op(mir_ctx, 0)));
-                    }
+                // make sure we initialized its type
+                CHECK_AND_RETHROW(jit_prepare_type(ctx->ctx, operand_field->DeclaringType));
+            } break;
 
-                    // make sure we are in this try
-                    if (clause->TryOffset > ctx->il_offset || ctx->il_offset >= clause->TryOffset + clause->TryLength)
-                        continue;
+            case OPCODE_OPERAND_InlineI: {
+                operand_i32 = *(int32_t*)&body->Il->Data[il_ptr];
+                il_ptr += sizeof(int32_t);
 
-                    // we are in a try block
-                    in_a_protected_block = true;
+#ifdef JIT_TRACE
+                printf("%d", operand_i32);
+#endif
+            } break;
 
-                    // make sure we are getting a final block
-                    if (clause->Flags != COR_ILEXCEPTION_CLAUSE_FINALLY)
-                        continue;
+            case OPCODE_OPERAND_InlineI8: {
+                operand_i64 = *(int64_t*)&body->Il->Data[il_ptr];
+                il_ptr += sizeof(int64_t);
 
-                    // lets get the clause label and offset
-                    int clausei = hmgeti(ctx->clause_to_label, clause);
-                    CHECK(clausei != -1);
-                    MIR_label_t finally_label = ctx->clause_to_label[clausei].value;
+#ifdef JIT_TRACE
+                printf("%ld", operand_i64);
+#endif
+            } break;
 
-                    // the current finally clause is going to jump into the target label
-                    // (unless it is nested in someone else)
-                    ctx->clause_to_label[clausei].next_clause = target_label;
-                    ctx->clause_to_label[clausei].last_in_chain = true;
+            case OPCODE_OPERAND_InlineMethod: {
+                // fetch it
+                token_t value = *(token_t*)&body->Il->Data[il_ptr];
+                il_ptr += sizeof(token_t);
 
-                    if (last_clausi == -1) {
-                        // jump to the first finally we see
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_JMP,
-                                                     MIR_new_label_op(mir_ctx, finally_label)));
-                    } else {
-                        // the last clause is going to actually jump to us
-                        ctx->clause_to_label[last_clausi].next_clause = finally_label;
-                        ctx->clause_to_label[last_clausi].last_in_chain = false;
-                    }
+                // resolve it
+                CHECK_AND_RETHROW(assembly_get_method_by_token(assembly, value, method->DeclaringType->GenericArguments,
+                                                               method->GenericArguments, &operand_method));
+                CHECK(operand_method != NULL);
 
-                    last_clausi = clausei;
-                }
+#ifdef JIT_TRACE
+                strbuilder_t type_name = strbuilder_new();
+                method_print_full_name(operand_method, &type_name);
+                printf("%s", strbuilder_get(&type_name));
+                strbuilder_free(&type_name);
+#endif
 
-                // make sure we are in a try region
-                CHECK(in_a_protected_block);
+                // check we can access it
+                CHECK(check_method_accessibility(method, operand_method),
+                      "from %U to %U", method->Name, operand_method->Name);
 
-                if (last_clausi == -1) {
-                    // there is no finally around us, we can
-                    // safely jump to the target
-                    MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_insn(mir_ctx, MIR_JMP,
-                                                 MIR_new_label_op(mir_ctx, target_label)));
+                // prepare the owning type
+                CHECK_AND_RETHROW(jit_prepare_type(ctx->ctx, operand_method->DeclaringType));
 
+                // if the method is a generic instance then we need to handle it separately
+                if (operand_method->GenericArguments != NULL) {
+                    CHECK_AND_RETHROW(jit_prepare_method(ctx->ctx, operand_method));
                 }
             } break;
 
-            case CEE_ENDFINALLY: {
-                // find the finally block we are in
-                bool found = false;
-                System_Reflection_ExceptionHandlingClause_Array exceptions = body->ExceptionHandlingClauses;
-                for (int i = exceptions->Length - 1; i >= 0; i--) {
-                    System_Reflection_ExceptionHandlingClause clause = exceptions->Data[i];
+            case OPCODE_OPERAND_InlineR: {
+                operand_f64 = *(double*)&body->Il->Data[il_ptr];
+                il_ptr += sizeof(double);
 
-                    // make sure we are in this try
-                    if (clause->HandlerOffset > ctx->il_offset || ctx->il_offset >= clause->HandlerOffset + clause->HandlerLength)
-                        continue;
+#ifdef JIT_TRACE
+                printf("<InlineR>");
+#endif
+            } break;
 
-                    // make sure we are getting a final block
-                    CHECK (clause->Flags == COR_ILEXCEPTION_CLAUSE_FINALLY);
+            case OPCODE_OPERAND_InlineSig: CHECK_FAIL("TODO: sig support"); break;
 
-                    // lets get the clause label and offset
-                    int clausei = hmgeti(ctx->clause_to_label, clause);
-                    CHECK(clausei != -1);
-                    MIR_label_t next_clause = ctx->clause_to_label[clausei].next_clause;
-                    CHECK(next_clause != NULL);
+            case OPCODE_OPERAND_InlineString: {
+                token_t value = *(token_t*)&body->Il->Data[il_ptr];
+                il_ptr += sizeof(token_t);
+                operand_string = assembly_get_string_by_token(assembly, value);
+                CHECK(operand_string != NULL);
 
-                    // next_clause will either continue to the next finally if there was an exception, or it will
-                    // continue to the next instruction if there was no exception
-                    MIR_label_t skip = MIR_new_label(mir_ctx);
+#ifdef JIT_TRACE
+                printf("\"%U\"", operand_string);
+#endif
+            } break;
 
-                    MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_insn(mir_ctx, MIR_BF,
-                                                 MIR_new_label_op(mir_ctx, skip),
-                                                 MIR_new_reg_op(mir_ctx, ctx->exception_reg)));
+            case OPCODE_OPERAND_InlineSwitch: {
+                operand_switch_n = *(uint32_t*)&body->Il->Data[il_ptr];
+                il_ptr += 4;
+                operand_switch_dests = (int32_t*)&body->Il->Data[il_ptr];
+                il_ptr += operand_switch_n * 4;
 
-                    if (ctx->clause_to_label[clausei].last_in_chain) {
-                        //
-                        // This is the last finally in the function and in the chain, so we can return
-                        // right away from this function with the error.
-                        //
+#ifdef JIT_TRACE
+                printf("<InlineSwitch>");
+#endif
+            } break;
 
-                        // figure how many we need
-                        size_t nres = 1;
-                        if (ctx->method->ReturnType != NULL) {
-                            MIR_type_t mtype = get_mir_type(ctx->method->ReturnType);
-                            if (mtype != MIR_T_BLK) {
-                                nres = 2;
-                            }
-                        }
+            case OPCODE_OPERAND_InlineTok: {
+                // fetch it
+                operand_token = *(token_t*)&body->Il->Data[il_ptr];
+                il_ptr += sizeof(token_t);
 
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_ret_insn(mir_ctx, nres,
-                                                         MIR_new_reg_op(mir_ctx, ctx->exception_reg),
-                                                         MIR_new_int_op(mir_ctx, 0)));
+#ifdef JIT_TRACE
+                printf("<InlineTok>");
+#endif
+            } break;
 
-                    } else {
-                        // The function has another clause in the
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_JMP,
-                                                     MIR_new_label_op(mir_ctx, next_clause)));
-                    }
+            case OPCODE_OPERAND_InlineType: {
+                // fetch it
+                token_t value = *(token_t*)&body->Il->Data[il_ptr];
+                il_ptr += sizeof(token_t);
 
-                    // insert the skip label
-                    MIR_append_insn(mir_ctx, mir_func, skip);
+                // resolve it
+                CHECK_AND_RETHROW(assembly_get_type_by_token(assembly, value, method->DeclaringType->GenericArguments
+                        , method->GenericArguments, &operand_type));
+                CHECK(operand_type != NULL);
 
-                    found = true;
-                    break;
-                }
+#ifdef JIT_TRACE
+                strbuilder_t type_name = strbuilder_new();
+                type_print_full_name(operand_type, &type_name);
+                printf("%s", strbuilder_get(&type_name));
+                strbuilder_free(&type_name);
+#endif
 
-                CHECK(found);
+                // check it is visible
+                CHECK(check_type_visibility(method, operand_type));
+
+                // init it
+                CHECK_AND_RETHROW(jit_prepare_type(ctx->ctx, operand_type));
             } break;
 
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            // Variables
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            case OPCODE_OPERAND_InlineVar: {
+                operand_i32 = *(uint16_t*)&body->Il->Data[il_ptr];
+                il_ptr += sizeof(uint16_t);
 
-            case CEE_STLOC_0:
-            case CEE_STLOC_1:
-            case CEE_STLOC_2:
-            case CEE_STLOC_3: operand_i32 = opcode - CEE_STLOC_0;
-            case CEE_STLOC_S:
-            case CEE_STLOC: {
-                // get the top value
-                MIR_reg_t value_reg;
-                System_Type value_type;
-                CHECK_AND_RETHROW(stack_pop(ctx, &value_type, &value_reg, NULL));
+#ifdef JIT_TRACE
+                printf("%d", operand_i32);
+#endif
+            } break;
 
-                // get the variable
-                CHECK(operand_i32 < body->LocalVariables->Length);
-                System_Reflection_LocalVariableInfo variable = body->LocalVariables->Data[operand_i32];
-                System_Type variable_type = type_get_intermediate_type(variable->LocalType);
+            case OPCODE_OPERAND_ShortInlineBrTarget: {
+                operand_i32 = *(int8_t*)&body->Il->Data[il_ptr];
+                il_ptr += sizeof(int8_t);
+                operand_i32 += il_ptr;
 
-                // check the type is valid
-                CHECK(type_is_verifier_assignable_to(value_type, variable_type));
+#ifdef JIT_TRACE
+                printf("IL_%04x", operand_i32);
+#endif
+            } break;
 
-                switch (type_get_stack_type(value_type)) {
-                    case STACK_TYPE_O: {
-                        if (type_is_interface(variable_type)) {
-                            if (type_is_interface(value_type)) {
-                                // interface -> interface
-                                goto stloc_value_type;
-                            } else {
-                                // object -> interface
-                                CHECK(locals[operand_i32].mode == MIR_OP_REG);
-                                CHECK_AND_RETHROW(jit_cast_obj_to_interface(ctx,
-                                                                            locals[operand_i32].u.reg, value_reg,
-                                                                            value_type, variable_type));
-                            }
-                        } else {
-                            if (type_is_interface(value_type)) {
-                                // interface -> object
-                                MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                                             locals[operand_i32],
-                                                             MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*), value_reg, 0, 1)));
-                            } else {
-                                // object -> object
-                                goto stloc_primitive_type;
-                            }
-                        }
-                    } break;
+            case OPCODE_OPERAND_ShortInlineI: {
+                operand_i32 = *(int8_t*)&body->Il->Data[il_ptr];
+                il_ptr += sizeof(int8_t);
 
-                    stloc_primitive_type:
-                    case STACK_TYPE_INT32:
-                    case STACK_TYPE_INT64:
-                    case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_FLOAT:
-                    case STACK_TYPE_REF: {
-                        MIR_insn_code_t code = jit_number_cast_inscode(value_type, variable_type);
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, code,
-                                                     locals[operand_i32],
-                                                     MIR_new_reg_op(mir_ctx, value_reg)));
-                    } break;
+#ifdef JIT_TRACE
+                printf("%d", operand_i32);
+#endif
+            } break;
 
-                    stloc_value_type:
-                    case STACK_TYPE_VALUE_TYPE: {
-                        CHECK(locals[operand_i32].mode == MIR_OP_REG);
-                        jit_emit_memcpy(ctx, locals[operand_i32].u.reg, value_reg, value_type->StackSize);
-                    } break;
-                }
+            case OPCODE_OPERAND_ShortInlineR: {
+                operand_f32 = *(float*)&body->Il->Data[il_ptr];
+                il_ptr += sizeof(float);
+
+#ifdef JIT_TRACE
+                printf("<ShortInlineR>");
+#endif
             } break;
 
-            case CEE_LDLOC_0:
-            case CEE_LDLOC_1:
-            case CEE_LDLOC_2:
-            case CEE_LDLOC_3: operand_i32 = opcode - CEE_LDLOC_0;
-            case CEE_LDLOC_S:
-            case CEE_LDLOC: {
-                // get the variable
-                CHECK(operand_i32 < body->LocalVariables->Length);
-                System_Reflection_LocalVariableInfo variable = body->LocalVariables->Data[operand_i32];
-                System_Type value_type = type_get_intermediate_type(variable->LocalType);
+            case OPCODE_OPERAND_ShortInlineVar: {
+                operand_i32 = *(uint8_t*)&body->Il->Data[il_ptr];
+                il_ptr += sizeof(uint8_t);
 
-                // push it
-                MIR_reg_t value_reg;
-                CHECK_AND_RETHROW(stack_push(ctx, value_type, &value_reg));
+#ifdef JIT_TRACE
+                printf("%d", operand_i32);
+#endif
+            } break;
 
-                switch (type_get_stack_type(value_type)) {
-                    case STACK_TYPE_O: {
-                        if (type_is_interface(value_type)) {
-                            // interface type, copy it
-                            goto ldloc_value_type;
-                        } else {
-                            // primitive type, move it
-                            goto ldloc_primitive_type;
-                        }
-                    } break;
+            case OPCODE_OPERAND_InlineNone:
+                break;
 
-                    ldloc_primitive_type:
-                    case STACK_TYPE_INT32:
-                    case STACK_TYPE_INT64:
-                    case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_FLOAT:
-                    case STACK_TYPE_REF: {
-                        MIR_insn_code_t code = jit_number_inscode(value_type);
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, code,
-                                                     MIR_new_reg_op(mir_ctx, value_reg),
-                                                     locals[operand_i32]));
-                    } break;
+            default:
+                CHECK_FAIL();
+        }
 
-                    ldloc_value_type:
-                    case STACK_TYPE_VALUE_TYPE: {
-                        CHECK(locals[operand_i32].mode == MIR_OP_REG);
-                        jit_emit_memcpy(ctx, value_reg, locals[operand_i32].u.reg, value_type->StackSize);
-                    } break;
-                }
-            } break;
+#ifdef JIT_TRACE
+        printf("\r\n");
+#endif
 
-            case CEE_LDLOCA:
-            case CEE_LDLOCA_S: {
-                // get the variable
-                CHECK(operand_i32 < body->LocalVariables->Length);
-                System_Reflection_LocalVariableInfo variable = body->LocalVariables->Data[operand_i32];
-                System_Type value_type = get_by_ref_type(type_get_verification_type(variable->LocalType));
+        //--------------------------------------------------------------------------------------------------------------
+        // Handle the opcode
+        //--------------------------------------------------------------------------------------------------------------
 
-                // push it
-                MIR_reg_t value_reg;
-                CHECK_AND_RETHROW(stack_push(ctx, value_type, &value_reg));
+        // constrained prefix should appear
+        // before callvirt opcode only
+        if (constrainedType != NULL) {
+            CHECK(opcode == CEE_CALLVIRT);
+        }
 
-                switch (type_get_stack_type(variable->LocalType)) {
-                    case STACK_TYPE_O: {
-                        if (type_is_interface(variable->LocalType)) {
-                            goto ldloca_value_type;
-                        } else {
-                            goto ldloca_primitive_type;
-                        }
-                    } break;
+        // after ldftn/ldvirtftn there must be a newobj
+        if (ftnMethod != NULL) {
+            CHECK(opcode == CEE_NEWOBJ);
+        }
 
-                    ldloca_primitive_type:
-                    case STACK_TYPE_INT32:
-                    case STACK_TYPE_INT64:
-                    case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_FLOAT:
-                    case STACK_TYPE_REF: {
-                        CHECK(locals[operand_i32].mode == MIR_OP_MEM);
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_MOV,
-                                                     MIR_new_reg_op(mir_ctx, value_reg),
-                                                     MIR_new_reg_op(mir_ctx, locals[operand_i32].u.mem.base)));
-                    } break;
+        switch (opcode) {
 
-                    ldloca_value_type:
-                    case STACK_TYPE_VALUE_TYPE: {
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_MOV,
-                                                     MIR_new_reg_op(mir_ctx, value_reg),
-                                                     locals[operand_i32]));
-                    } break;
-                }
+            //----------------------------------------------------------------------------------------------------------
+            // Prefixes
+            //----------------------------------------------------------------------------------------------------------
+
+            // save the constrained type for use in the next instruction
+            case CEE_CONSTRAINED: {
+                constrainedType = operand_type;
+            } break;
+
+            case CEE_READONLY: {
+                // TODO: this should turn into a controlled mutability by-ref, otherwise
+                //       we can have a bad time
             } break;
 
+            // ignore for now, tell MIR that this can be turned into a tailcall
+            case CEE_TAILCALL: break;
+
+            // ignored for now, tell MIR everything is aligned except instructions
+            // like these
+            case CEE_UNALIGNED: break;
+
+            // ignored for now, tell MIR that this access is volatile
+            case CEE_VOLATILE: break;
+
+            //----------------------------------------------------------------------------------------------------------
+            // Base Instructions
+            //----------------------------------------------------------------------------------------------------------
+
+            // nothing to do with nop
+            case CEE_NOP: break;
+
             ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            // Arguments
+            // Arithmetic
             ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-            case CEE_STARG_S:
-            case CEE_STARG: {
-                // get the top value
+            // binary operations
+            case CEE_ADD:       CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_ADD, false)); break;
+            case CEE_DIV:       CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_DIV, false)); break;
+            case CEE_DIV_UN:    CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_UDIV, true)); break;
+            case CEE_MUL:       CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_MUL, false)); break;
+            case CEE_REM:       CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_MOD, false)); break;
+            case CEE_REM_UN:    CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_UMOD, true)); break;
+            case CEE_SUB:       CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_SUB, false)); break;
+            // bitwise binary operations
+            case CEE_AND:       CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_AND, true)); break;
+            case CEE_OR:        CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_OR, true)); break;
+            case CEE_XOR:       CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_XOR, true)); break;
+            // bit shifts
+            case CEE_SHL:       CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_LSH, true)); break;
+            case CEE_SHR:       CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_RSH, true)); break;
+            case CEE_SHR_UN:    CHECK_AND_RETHROW(jit_binary_numeric_operation(ctx, MIR_URSH, true)); break;
+
+            // unary operations
+            case CEE_NEG: {
                 MIR_reg_t value_reg;
                 System_Type value_type;
                 CHECK_AND_RETHROW(stack_pop(ctx, &value_type, &value_reg, NULL));
 
-                // get the argument
-                char arg_name_buf[64];
-                const char* arg_name = NULL;
+                MIR_reg_t result_reg;
+                CHECK_AND_RETHROW(stack_push(ctx, value_type, &result_reg));
 
-                // resolve the type
-                System_Type arg_type = NULL;
-                if (!method_is_static(method)) {
-                    if (operand_i32 == 0) {
-                        arg_name = "this";
-                        arg_type = method->DeclaringType;
-                        if (arg_type->IsValueType) {
-                            // value types turn into a by-ref when using this
-                            arg_type = get_by_ref_type(arg_type);
+                MIR_insn_code_t code;
+                switch (type_get_stack_type(value_type)) {
+                    case STACK_TYPE_INT32: {
+                        code = MIR_NEGS;
+                    } break;
+
+                    case STACK_TYPE_INT64:
+                    case STACK_TYPE_INTPTR: {
+                        code = MIR_NEG;
+                    } break;
+
+                    case STACK_TYPE_FLOAT: {
+                        if (value_type == tSystem_Single) {
+                            code = MIR_FNEG;
+                        } else if (value_type == tSystem_Double) {
+                            code = MIR_DNEG;
+                        } else {
+                            CHECK_FAIL();
                         }
-                    }
-                    operand_i32--;
-                }
+                    } break;
 
-                // if this is not `this` then get the name
-                if (arg_name == NULL) {
-                    snprintf(arg_name_buf, sizeof(arg_name_buf), "arg%d", operand_i32);
-                    arg_name = arg_name_buf;
+                    case STACK_TYPE_O:
+                    case STACK_TYPE_REF:
+                    case STACK_TYPE_VALUE_TYPE:
+                        CHECK_FAIL();
                 }
 
-                if (arg_type == NULL) {
-                    CHECK(operand_i32 < method->Parameters->Length);
-                    System_Reflection_ParameterInfo parameter = method->Parameters->Data[operand_i32];
-                    arg_type = parameter->ParameterType;
-                }
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, code,
+                                             MIR_new_reg_op(mir_ctx, result_reg),
+                                             MIR_new_reg_op(mir_ctx, value_reg)));
+            } break;
 
-                // the register containing the value
-                MIR_reg_t arg_reg = MIR_reg(mir_ctx, arg_name, mir_func->u.func);
+            case CEE_NOT: {
+                MIR_reg_t value_reg;
+                System_Type value_type;
+                CHECK_AND_RETHROW(stack_pop(ctx, &value_type, &value_reg, NULL));
 
-                // check the type is valid
-                CHECK(type_is_verifier_assignable_to(value_type, arg_type));
+                MIR_reg_t result_reg;
+                CHECK_AND_RETHROW(stack_push(ctx, value_type, &result_reg));
 
+                MIR_insn_code_t code;
                 switch (type_get_stack_type(value_type)) {
-                    case STACK_TYPE_O: {
-                        if (type_is_interface(arg_type)) {
-                            if (type_is_interface(value_type)) {
-                                // interface -> interface
-                                goto starg_value_type;
-                            } else {
-                                // object -> interface
-                                CHECK_AND_RETHROW(jit_cast_obj_to_interface(ctx,
-                                                                            arg_reg, value_reg,
-                                                                            value_type, arg_type));
-                            }
-                        } else {
-                            if (type_is_interface(value_type)) {
-                                // interface -> object
-                                MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                                             MIR_new_reg_op(mir_ctx, arg_reg),
-                                                             MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*), value_reg, 0, 1)));
-                            } else {
-                                // object -> object
-                                goto starg_primitive_type;
-                            }
-                        }
+                    case STACK_TYPE_INT32: {
+                        code = MIR_XORS;
                     } break;
 
-                    starg_primitive_type:
-                    case STACK_TYPE_INT32:
                     case STACK_TYPE_INT64:
-                    case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_FLOAT:
-                    case STACK_TYPE_REF: {
-                        MIR_insn_code_t code = jit_number_cast_inscode(value_type, arg_type);
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, code,
-                                                     MIR_new_reg_op(mir_ctx, arg_reg),
-                                                     MIR_new_reg_op(mir_ctx, value_reg)));
+                    case STACK_TYPE_INTPTR: {
+                        code = MIR_XOR;
                     } break;
 
-                    starg_value_type:
-                    case STACK_TYPE_VALUE_TYPE: {
-                        jit_emit_memcpy(ctx, arg_reg, value_reg, value_type->StackSize);
-                    } break;
+                    case STACK_TYPE_FLOAT:
+                    case STACK_TYPE_O:
+                    case STACK_TYPE_REF:
+                    case STACK_TYPE_VALUE_TYPE:
+                        CHECK_FAIL();
                 }
-            } break;
-
-            case CEE_LDARG_0:
-            case CEE_LDARG_1:
-            case CEE_LDARG_2:
-            case CEE_LDARG_3: operand_i32 = opcode - CEE_LDARG_0;
-            case CEE_LDARG_S:
-            case CEE_LDARG: {
-                char arg_name_buf[64];
-                const char* arg_name = NULL;
-                bool readonly_ref = false;
 
-                // resolve the type
-                System_Type arg_type = NULL;
-                if (!method_is_static(method)) {
-                    if (operand_i32 == 0) {
-                        arg_name = "this";
-                        arg_type = method->DeclaringType;
-                        if (arg_type->IsValueType) {
-                            // value types turn into a by-ref when using this
-                            arg_type = get_by_ref_type(arg_type);
-                        }
-                    }
-                    operand_i32--;
-                }
+                // ~value == value ^ -1
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, code,
+                                             MIR_new_reg_op(mir_ctx, result_reg),
+                                             MIR_new_reg_op(mir_ctx, value_reg),
+                                             MIR_new_int_op(mir_ctx, -1)));
+            } break;
 
-                // if this is not `this` then get the name
-                if (arg_name == NULL) {
-                    snprintf(arg_name_buf, sizeof(arg_name_buf), "arg%d", operand_i32);
-                    arg_name = arg_name_buf;
-                }
+            // TODO: shift operations
 
-                if (arg_type == NULL) {
-                    CHECK(operand_i32 < method->Parameters->Length);
-                    System_Reflection_ParameterInfo parameter = method->Parameters->Data[operand_i32];
-                    arg_type = parameter->ParameterType;
-                    readonly_ref = parameter_is_in(parameter);
-                }
+            // TODO: checked arithmetic
 
-                // the register containing the value
-                MIR_reg_t arg_reg = MIR_reg(mir_ctx, arg_name, mir_func->u.func);
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            // Casting and boxing
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-                // Get the stack type of the arg
-                System_Type arg_stack_type = type_get_intermediate_type(arg_type);
+            case CEE_CONV_I1:
+            case CEE_CONV_I2:
+            case CEE_CONV_I4:
+            case CEE_CONV_I8:
+            case CEE_CONV_R4:
+            case CEE_CONV_R8:
+            case CEE_CONV_U1:
+            case CEE_CONV_U2:
+            case CEE_CONV_U4:
+            case CEE_CONV_U8:
+            case CEE_CONV_I:
+            case CEE_CONV_U:
+            case CEE_CONV_R_UN: {
+                MIR_reg_t reg;
+                System_Type type;
+                CHECK_AND_RETHROW(stack_pop(ctx, &type, &reg, NULL));
 
-                // push it
-                MIR_reg_t value_reg;
-                CHECK_AND_RETHROW(stack_push(ctx, arg_stack_type, &value_reg));
+                MIR_reg_t result_reg;
+                System_Type result_type;
+                switch (opcode) {
+                    case CEE_CONV_I1: result_type = tSystem_Int32; break;
+                    case CEE_CONV_U1: result_type = tSystem_Int32; break;
+                    case CEE_CONV_I2: result_type = tSystem_Int32; break;
+                    case CEE_CONV_U2: result_type = tSystem_Int32; break;
+                    case CEE_CONV_I4: result_type = tSystem_Int32; break;
+                    case CEE_CONV_U4: result_type = tSystem_Int32; break;
+                    case CEE_CONV_I8: result_type = tSystem_Int64; break;
+                    case CEE_CONV_U8: result_type = tSystem_Int64; break;
+                    case CEE_CONV_I: result_type = tSystem_IntPtr; break;
+                    case CEE_CONV_U: result_type = tSystem_IntPtr; break;
+                    case CEE_CONV_R4: result_type = tSystem_Single; break;
+                    case CEE_CONV_R8: result_type = tSystem_Double; break;
+                    default: CHECK_FAIL();
+                }
+                CHECK_AND_RETHROW(stack_push(ctx, result_type, &result_reg));
 
-                switch (type_get_stack_type(arg_stack_type)) {
-                    case STACK_TYPE_O: {
-                        if (type_is_interface(arg_stack_type)) {
-                            // interface type, copy it
-                            goto ldarg_value_type;
-                        } else {
-                            // primitive type, move it
-                            goto ldarg_primitive_type;
+                MIR_insn_code_t code = MIR_INVALID_INSN;
+                switch (type_get_stack_type(type)) {
+                    case STACK_TYPE_INT32: {
+                        switch (opcode) {
+                            case CEE_CONV_I1: code = MIR_EXT8; break;
+                            case CEE_CONV_U1: code = MIR_UEXT8; break;
+                            case CEE_CONV_I2: code = MIR_EXT16; break;
+                            case CEE_CONV_U2: code = MIR_UEXT16; break;
+                            case CEE_CONV_I4: code = MIR_MOV; break;
+                            case CEE_CONV_U4: code = MIR_MOV; break;
+                            case CEE_CONV_I8: code = MIR_EXT32; break;
+                            case CEE_CONV_U8: code = MIR_UEXT32; break;
+                            case CEE_CONV_I: code = MIR_EXT32; break;
+                            case CEE_CONV_U: code = MIR_UEXT32; break;
+                            case CEE_CONV_R4: code = MIR_I2F; break;
+                            case CEE_CONV_R8: code = MIR_I2D; break;
+                            default: CHECK_FAIL();
                         }
                     } break;
 
-                    ldarg_primitive_type:
-                    case STACK_TYPE_INT32:
-                    case STACK_TYPE_INT64:
                     case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_FLOAT: {
-                        MIR_insn_code_t code = jit_number_inscode(arg_stack_type);
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, code,
-                                                     MIR_new_reg_op(mir_ctx, value_reg),
-                                                     MIR_new_reg_op(mir_ctx, arg_reg)));
+                    case STACK_TYPE_INT64: {
+                        switch (opcode) {
+                            case CEE_CONV_I1: code = MIR_EXT8; break;
+                            case CEE_CONV_U1: code = MIR_UEXT8; break;
+                            case CEE_CONV_I2: code = MIR_EXT16; break;
+                            case CEE_CONV_U2: code = MIR_UEXT16; break;
+                            case CEE_CONV_I4: code = MIR_EXT32; break;
+                            case CEE_CONV_U4: code = MIR_UEXT32; break;
+                            case CEE_CONV_I8: code = MIR_MOV; break;
+                            case CEE_CONV_U8: code = MIR_MOV; break;
+                            case CEE_CONV_I: code = MIR_MOV; break;
+                            case CEE_CONV_U: code = MIR_MOV; break;
+                            case CEE_CONV_R4: code = MIR_I2F; break;
+                            case CEE_CONV_R8: code = MIR_I2D; break;
+                            default: CHECK_FAIL();
+                        }
                     } break;
 
-                    ldarg_value_type:
-                    case STACK_TYPE_VALUE_TYPE: {
-                        jit_emit_memcpy(ctx, value_reg, arg_reg, arg_stack_type->StackSize);
-                    } break;
+                    case STACK_TYPE_FLOAT: {
+                        if (type_get_stack_type(result_type) == STACK_TYPE_INT32) {
+                            // we are converting from float to small
+                            // type, first convert to native int and
+                            // only then do a truncation
+                            MIR_append_insn(mir_ctx, mir_func,
+                                            MIR_new_insn(mir_ctx, type == tSystem_Single ? MIR_F2I : MIR_D2I,
+                                                         MIR_new_reg_op(mir_ctx, result_reg),
+                                                         MIR_new_reg_op(mir_ctx, reg)));
 
-                    case STACK_TYPE_REF:
-                        // mark that this is a non-local ref type, as it comes from the outside
-                        // and depending on `in` it might be a readonly ref
-                        STACK_TOP.non_local_ref = true;
-                        STACK_TOP.readonly_ref = readonly_ref;
-                        goto ldarg_primitive_type;
-                }
+                            // now our input is the result reg as well
+                            reg = result_reg;
+                        }
+                        switch (opcode) {
+                            case CEE_CONV_I1: code = MIR_EXT8; break;
+                            case CEE_CONV_U1: code = MIR_UEXT8; break;
+                            case CEE_CONV_I2: code = MIR_EXT16; break;
+                            case CEE_CONV_U2: code = MIR_UEXT16; break;
+                            case CEE_CONV_I4: code = MIR_EXT32; break;
+                            case CEE_CONV_U4: code = MIR_UEXT32; break;
+                            case CEE_CONV_I8: code = MIR_F2I; break;
+                            case CEE_CONV_U8: code = MIR_F2I; break;
+                            case CEE_CONV_I: code = MIR_F2I; break;
+                            case CEE_CONV_U: code = MIR_F2I; break;
+                            case CEE_CONV_R4: code = type == tSystem_Single ? MIR_FMOV : MIR_D2F; break;
+                            case CEE_CONV_R8: code = type == tSystem_Single ? MIR_F2D : MIR_DMOV; break;
+                            default: CHECK_FAIL();
+                        }
+                    } break;
+
+                    case STACK_TYPE_O:
+                    case STACK_TYPE_VALUE_TYPE:
+                    case STACK_TYPE_REF:
+                        CHECK_FAIL();
+                }
+
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, code,
+                                             MIR_new_reg_op(mir_ctx, result_reg),
+                                             MIR_new_reg_op(mir_ctx, reg)));
             } break;
 
-            case CEE_LDARGA:
-            case CEE_LDARGA_S: {
-                char arg_name_buf[64];
-                const char* arg_name = NULL;
+            // TODO: if at jit time we know it is true/false then
+            //       we can remove the check, useful especially for
+            //       generic instances
+            case CEE_ISINST:
+            case CEE_CASTCLASS:
+            case CEE_UNBOX_ANY: {
+                // the box before it was elided, the value is already on the stack
+                if (jit_is_elided_unbox(ctx)) {
+                    break;
+                }
 
-                // resolve the type
-                System_Type arg_type = NULL;
-                if (!method_is_static(method)) {
-                    if (operand_i32 == 0) {
-                        arg_name = "this";
-                        arg_type = method->DeclaringType;
-                        if (arg_type->IsValueType) {
-                            // value types turn into a by-ref when using this
-                            arg_type = get_by_ref_type(arg_type);
-                        }
+                MIR_reg_t obj_reg;
+                System_Type obj_type;
+                CHECK_AND_RETHROW(stack_pop(ctx, &obj_type, &obj_reg, NULL));
+
+                // the object type must always be a ref type for unboxing
+                CHECK(obj_type->StackType == STACK_TYPE_O);
+
+                System_Type check_type = operand_type;
+                if (opcode != CEE_UNBOX_ANY) {
+                    // figure the result type, not needed for unbox
+                    if (operand_type->IsValueType) {
+                        // get it as a boxed type
+                        operand_type = get_boxed_type(operand_type);
                     }
-                    operand_i32--;
                 }
 
-                // if this is not `this` then get the name
-                if (arg_name == NULL) {
-                    snprintf(arg_name_buf, sizeof(arg_name_buf), "arg%d", operand_i32);
-                    arg_name = arg_name_buf;
+                // push it, but now as the new type
+                MIR_reg_t obj2_reg;
+                CHECK_AND_RETHROW(stack_push(ctx, operand_type, &obj2_reg));
+
+                // temp for the cast result
+                MIR_reg_t cast_result_reg = new_temp_reg(ctx, tSystem_Boolean);
+
+                MIR_insn_t cast_success = MIR_new_label(mir_ctx);
+
+                // if this is an interface get the type instance itself
+                if (type_is_interface(obj_type)) {
+                    MIR_append_insn(mir_ctx, mir_func,
+                                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                                 MIR_new_reg_op(mir_ctx, obj_reg),
+                                                 MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*),
+                                                                obj_reg, 0, 1)));
                 }
 
-                if (arg_type == NULL) {
-                    CHECK(operand_i32 < method->Parameters->Length);
-                    arg_type = method->Parameters->Data[operand_i32]->ParameterType;
+                // call the isinstance method to dynamically check the cast is valid
+                if (type_is_interface(check_type)) {
+                    // casting to an interface, use the dynamic_cast_obj_to_interface to do the cast
+                    MIR_append_insn(mir_ctx, mir_func,
+                                    MIR_new_call_insn(mir_ctx, 6,
+                                                      MIR_new_ref_op(mir_ctx, m_dynamic_cast_obj_to_interface_proto),
+                                                      MIR_new_ref_op(mir_ctx, m_dynamic_cast_obj_to_interface_func),
+                                                      MIR_new_reg_op(mir_ctx, cast_result_reg),
+                                                      MIR_new_reg_op(mir_ctx, obj2_reg),
+                                                      MIR_new_reg_op(mir_ctx, obj_reg),
+                                                      MIR_new_ref_op(mir_ctx, check_type->MirType)));
+                } else if (jit_can_inline_class_check(check_type)) {
+                    // plain class, check the base chain inline
+                    jit_emit_class_check(ctx, cast_result_reg, obj_reg, check_type);
+                } else {
+                    // casting to an object, so everything is fine
+                    MIR_append_insn(mir_ctx, mir_func,
+                                    MIR_new_call_insn(mir_ctx, 5,
+                                                      MIR_new_ref_op(mir_ctx, m_is_instance_proto),
+                                                      MIR_new_ref_op(mir_ctx, m_is_instance_func),
+                                                      MIR_new_reg_op(mir_ctx, cast_result_reg),
+                                                      MIR_new_reg_op(mir_ctx, obj_reg),
+                                                      MIR_new_ref_op(mir_ctx, check_type->MirType)));
                 }
 
-                // the register containing the value
-                MIR_reg_t arg_reg = MIR_reg(mir_ctx, arg_name, mir_func->u.func);
+                // check that it was a success
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_BT,
+                                             MIR_new_label_op(mir_ctx, cast_success),
+                                             MIR_new_reg_op(mir_ctx, cast_result_reg)));
 
-                // Get the value type
-                System_Type value_type = get_by_ref_type(type_get_verification_type(arg_type));
+                // cast has failed
+                if (opcode == CEE_ISINST) {
+                    // for ISINST just return null, the dynamic cast already handles that
+                    // case for interfaces
+                    if (!type_is_interface(operand_type)) {
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_MOV,
+                                                     MIR_new_reg_op(mir_ctx, obj_reg),
+                                                     MIR_new_int_op(mir_ctx, 0)));
+                    }
+                } else {
+                    // for CLASSCAST throw an exception
+                    CHECK(opcode == CEE_CASTCLASS || opcode == CEE_UNBOX_ANY);
+                    CHECK_AND_RETHROW(jit_throw_new(ctx, tSystem_InvalidCastException));
+                }
 
-                // push it
-                MIR_reg_t value_reg;
-                CHECK_AND_RETHROW(stack_push(ctx, value_type, &value_reg));
+                MIR_append_insn(mir_ctx, mir_func, cast_success);
 
-                switch (type_get_stack_type(arg_type)) {
+                switch (type_get_stack_type(operand_type)) {
                     case STACK_TYPE_O: {
-                        if (type_is_interface(arg_type)) {
-                            // interface type, copy it
-                            goto ldarga_value_type;
-                        } else {
-                            // primitive type, move it
-                            goto ldarga_primitive_type;
+                        // interfaces are handled by the dynamic cast object to interface function so there
+                        // is nothing to do for them, for normal objects just move them to the obj2
+                        if (!type_is_interface(operand_type)) {
+                            MIR_append_insn(mir_ctx, mir_func,
+                                            MIR_new_insn(mir_ctx, MIR_MOV,
+                                                         MIR_new_reg_op(mir_ctx, obj2_reg),
+                                                         MIR_new_reg_op(mir_ctx, obj_reg)));
                         }
                     } break;
 
-                    ldarga_primitive_type:
                     case STACK_TYPE_INT32:
-                    case STACK_TYPE_INT64:
                     case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_FLOAT:
-                    case STACK_TYPE_REF: {
-                        CHECK_FAIL("TODO: spill arguments from registers");
+                    case STACK_TYPE_INT64:
+                    case STACK_TYPE_FLOAT: {
+                        // store the item in the type
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, jit_number_inscode(operand_type),
+                                                     MIR_new_reg_op(mir_ctx, obj2_reg),
+                                                     MIR_new_mem_op(mir_ctx, get_mir_type(operand_type),
+                                                                    tSystem_Object->ManagedSize, obj_reg, 0, 1)));
+
                     } break;
 
-                    ldarga_value_type:
                     case STACK_TYPE_VALUE_TYPE: {
+                        // memcpy it
+
+                        // first get the base for memcpy
                         MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_MOV,
-                                                     MIR_new_reg_op(mir_ctx, value_reg),
-                                                     MIR_new_reg_op(mir_ctx, arg_reg)));
+                                        MIR_new_insn(mir_ctx, MIR_ADD,
+                                                     MIR_new_reg_op(mir_ctx, obj_reg),
+                                                     MIR_new_reg_op(mir_ctx, obj_reg),
+                                                     MIR_new_int_op(mir_ctx, tSystem_Object->ManagedSize)));
+
+                        // now emit the memcpy
+                        jit_emit_memcpy(ctx, obj2_reg, obj_reg, operand_type->ManagedSize);
                     } break;
+
+                        // already handled in the castclass case
+                    case STACK_TYPE_REF:
+                        CHECK_FAIL();
                 }
             } break;
 
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            // Basic stack manipulation
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            case CEE_BOX: {
+                // the object might not be needed at all
+                int box_use = hmgeti(ctx->box_uses, ctx->il_offset);
+                if (box_use >= 0 && jit_can_elide_box(ctx, &ctx->box_uses[box_use].value, operand_type)) {
+                    CHECK_AND_RETHROW(jit_emit_elided_box(ctx, &ctx->box_uses[box_use].value, operand_type, &constrainedType));
+                    break;
+                }
 
-            case CEE_LDC_I4_M1:
-            case CEE_LDC_I4_0:
-            case CEE_LDC_I4_1:
-            case CEE_LDC_I4_2:
-            case CEE_LDC_I4_3:
-            case CEE_LDC_I4_4:
-            case CEE_LDC_I4_5:
-            case CEE_LDC_I4_6:
-            case CEE_LDC_I4_7:
-            case CEE_LDC_I4_8: operand_i32 = (int32_t)opcode - CEE_LDC_I4_0;
-            case CEE_LDC_I4_S:
-            case CEE_LDC_I4: {
-                MIR_reg_t sr;
-                CHECK_AND_RETHROW(stack_push(ctx, tSystem_Int32, &sr));
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                             MIR_new_reg_op(mir_ctx, sr),
-                                             MIR_new_int_op(mir_ctx, operand_i32)));
-            } break;
+                System_Type val_type;
+                MIR_reg_t val_reg;
+                CHECK_AND_RETHROW(stack_pop(ctx, &val_type, &val_reg, NULL));
 
-            case CEE_LDC_I8: {
-                MIR_reg_t reg;
-                CHECK_AND_RETHROW(stack_push(ctx, tSystem_Int64, &reg));
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                             MIR_new_reg_op(mir_ctx, reg),
-                                             MIR_new_int_op(mir_ctx, operand_i64)));
-            } break;
+                // make sure that this is fine
+                CHECK(type_is_verifier_assignable_to(val_type, operand_type));
 
-            case CEE_LDC_R4: {
-                MIR_reg_t reg;
-                CHECK_AND_RETHROW(stack_push(ctx, tSystem_Single, &reg));
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_FMOV,
-                                             MIR_new_reg_op(mir_ctx, reg),
-                                             MIR_new_float_op(mir_ctx, operand_f32)));
-            } break;
+                System_Type boxed_type = get_boxed_type(val_type);
 
-            case CEE_LDC_R8: {
-                MIR_reg_t reg;
-                CHECK_AND_RETHROW(stack_push(ctx, tSystem_Double, &reg));
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_DMOV,
-                                             MIR_new_reg_op(mir_ctx, reg),
-                                             MIR_new_double_op(mir_ctx, operand_f64)));
-            } break;
+                // we track this as an object now
+                MIR_reg_t obj_reg;
+                CHECK_AND_RETHROW(stack_push(ctx, boxed_type, &obj_reg));
 
-            case CEE_LDSTR: {
-                // push a string type
-                MIR_reg_t string_reg;
-                CHECK_AND_RETHROW(stack_push(ctx, tSystem_String, &string_reg));
+                MIR_insn_t has_null_value = NULL;
 
-                // move it to the register
-                // TODO: better way to do this?
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                             MIR_new_reg_op(mir_ctx, string_reg),
-                                             MIR_new_uint_op(mir_ctx, (uintptr_t)operand_string)));
-            } break;
+                // check if we need to allocate memory for this
+                if (operand_type->IsValueType) {
 
-            case CEE_LDNULL: {
-                // push a null type
-                MIR_reg_t null_reg;
-                CHECK_AND_RETHROW(stack_push(ctx, NULL, &null_reg));
+                    // if this is a nullable we need to check the HasValue field before
+                    // we actually try and box the value, since otherwise we return null
+                    if (operand_type->GenericTypeDefinition == tSystem_Nullable) {
+                        has_null_value = MIR_new_label(mir_ctx);
 
-                // load a null value
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                             MIR_new_reg_op(mir_ctx, null_reg),
-                                             MIR_new_int_op(mir_ctx, 0)));
-            } break;
+                        // zero out the obj_reg, so we can just skip the allocation if its null
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_MOV,
+                                                     MIR_new_reg_op(mir_ctx, obj_reg),
+                                                     MIR_new_int_op(mir_ctx, 0)));
 
-            case CEE_LDTOKEN: {
-                // all of them are about the same, they have a single pointer of this
-                MIR_item_t runtime_handle_item = NULL;
-                MIR_reg_t runtime_handle_reg = 0;
+                        // check if the HasValue is zero, if so then jump over
+                        // the allocation and the value copy
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_BF,
+                                                     MIR_new_label_op(mir_ctx, has_null_value),
+                                                     MIR_new_mem_op(mir_ctx, MIR_T_I8,
+                                                                    offsetof(System_Nullable, HasValue),
+                                                                    val_reg, 0, 1)));
+                    }
 
-                // first resolve what we are going to even be pushing
-                switch (operand_token.table) {
-                    case METADATA_METHOD_DEF:
-                    case METADATA_METHOD_SPEC: {
-                        CHECK_FAIL("TODO: RuntimeMethodHandle");
+                    // allocate it
+                    CHECK_AND_RETHROW(jit_new(ctx, obj_reg, operand_type,
+                                              MIR_new_int_op(mir_ctx, tSystem_Object->ManagedSize + val_type->ManagedSize)));
+                }
+
+                // must be a value type
+                switch (type_get_stack_type(operand_type)) {
+                    case STACK_TYPE_O: {
+                        // return unchanged
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_MOV,
+                                                     MIR_new_reg_op(mir_ctx, obj_reg),
+                                                     MIR_new_reg_op(mir_ctx, val_reg)));
                     } break;
 
-                    case METADATA_TYPE_DEF:
-                    case METADATA_TYPE_REF:
-                    case METADATA_TYPE_SPEC: {
-                        // get the value
-                        System_Type type;
-                        CHECK_AND_RETHROW(assembly_get_type_by_token(assembly, operand_token,
-                                                                     method->DeclaringType->GenericArguments,
-                                                                     method->GenericArguments,
-                                                                     &type));
+                    case STACK_TYPE_INT32:
+                    case STACK_TYPE_INTPTR:
+                    case STACK_TYPE_INT64:
+                    case STACK_TYPE_FLOAT: {
+                        // store the item in the type
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, jit_number_inscode(operand_type),
+                                                     MIR_new_mem_op(mir_ctx, get_mir_type(operand_type),
+                                                                    tSystem_Object->ManagedSize, obj_reg, 0, 1),
+                                                     MIR_new_reg_op(mir_ctx, val_reg)));
 
-                        // make sure the type is prepared
-                        CHECK_AND_RETHROW(jit_prepare_type(ctx->ctx, type));
+                    } break;
 
-                        // push it
-                        CHECK_AND_RETHROW(stack_push(ctx, tSystem_RuntimeTypeHandle, &runtime_handle_reg));
+                    case STACK_TYPE_VALUE_TYPE: {
+                        // memcpy it
+                        MIR_reg_t memcpy_base_reg = new_temp_reg(ctx, tSystem_Object);
 
-                        // the ptr is the type
-                        runtime_handle_item = type->MirType;
-                    } break;
+                        // first get the base for memcpy
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_ADD,
+                                                     MIR_new_reg_op(mir_ctx, memcpy_base_reg),
+                                                     MIR_new_reg_op(mir_ctx, obj_reg),
+                                                     MIR_new_int_op(mir_ctx, tSystem_Object->ManagedSize)));
 
-                    case METADATA_FIELD: {
-                        CHECK_FAIL("TODO: RuntimeFieldHandle");
-                    } break;
+                        int offset = -1;
+                        if (has_null_value != NULL) {
+                            // find the offset of the Value field inside the Nullable instance
+                            for (int i = 0; i < val_type->Fields->Length; i++) {
+                                System_Reflection_FieldInfo field = val_type->Fields->Data[i];
+                                if (string_equals_cstr(field->Name, "_value")) {
+                                    offset = field->MemoryOffset;
+                                }
+                            }
+                            CHECK(offset != -1);
 
-                    case METADATA_MEMBER_REF: {
-                        CHECK_FAIL("TODO: figure method or field");
+                            // this is a nullable, we need to skip the first
+                            // element when copying over
+                            MIR_append_insn(mir_ctx, mir_func,
+                                            MIR_new_insn(mir_ctx, MIR_ADD,
+                                                         MIR_new_reg_op(mir_ctx, val_reg),
+                                                         MIR_new_reg_op(mir_ctx, val_reg),
+                                                         MIR_new_int_op(mir_ctx, offset)));
+                        } else {
+                            offset = 0;
+                        }
+
+                        // now emit the memcpy
+                        jit_emit_memcpy(ctx, memcpy_base_reg, val_reg, operand_type->ManagedSize - offset);
                     } break;
 
-                    default:
+                    case STACK_TYPE_REF:
                         CHECK_FAIL();
                 }
 
-                // move it
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                             MIR_new_mem_op(mir_ctx, MIR_T_P, 0, runtime_handle_reg, 0, 1),
-                                             MIR_new_ref_op(mir_ctx, runtime_handle_item)));
+                if (has_null_value != NULL) {
+                    // we had a null value, went to here
+                    MIR_append_insn(mir_ctx, mir_func, has_null_value);
+                }
             } break;
 
-            case CEE_DUP: {
-                // get the top value
-                MIR_reg_t top_reg;
-                System_Type top_type;
-                CHECK_AND_RETHROW(stack_pop(ctx, &top_type, &top_reg, NULL));
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            // Indirect reference access
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-                // create new two values
-                MIR_reg_t value_1;
-                MIR_reg_t value_2;
-                CHECK_AND_RETHROW(stack_push(ctx, top_type, &value_1));
-                CHECK_AND_RETHROW(stack_push(ctx, top_type, &value_2));
+            case CEE_LDIND_I1: operand_type = tSystem_SByte; goto cee_ldind;
+            case CEE_LDIND_U1: operand_type = tSystem_Byte; goto cee_ldind;
+            case CEE_LDIND_I2: operand_type = tSystem_Int16; goto cee_ldind;
+            case CEE_LDIND_U2: operand_type = tSystem_UInt16; goto cee_ldind;
+            case CEE_LDIND_I4: operand_type = tSystem_Int32; goto cee_ldind;
+            case CEE_LDIND_U4: operand_type = tSystem_UInt32; goto cee_ldind;
+            case CEE_LDIND_I8: operand_type = tSystem_Int64; goto cee_ldind;
+            case CEE_LDIND_I: operand_type = tSystem_IntPtr; goto cee_ldind;
+            case CEE_LDIND_R4: operand_type = tSystem_Single; goto cee_ldind;
+            case CEE_LDIND_R8: operand_type = tSystem_Double; goto cee_ldind;
+            case CEE_LDIND_REF: operand_type = NULL; goto cee_ldind;
+            case CEE_LDOBJ: goto cee_ldind;
+            cee_ldind: {
+                // pop all the values from the stack
+                MIR_reg_t addr_reg;
+                System_Type addr_type;
+                CHECK_AND_RETHROW(stack_pop(ctx, &addr_type, &addr_reg, NULL));
 
-                switch (type_get_stack_type(top_type)) {
+                // this must be an array
+                CHECK(addr_type->IsByRef);
+
+                MIR_reg_t value_reg;
+
+                // for anything which is not ldelem.ref we know the operand_type
+                // from the array
+                if (operand_type != NULL) {
+                    CHECK(type_is_verifier_assignable_to(addr_type->BaseType, operand_type));
+                    CHECK_AND_RETHROW(stack_push(ctx, type_get_intermediate_type(operand_type), &value_reg));
+                } else {
+                    // the type is gotten from the array
+                    operand_type = addr_type->BaseType;
+                    CHECK_AND_RETHROW(stack_push(ctx, type_get_verification_type(operand_type), &value_reg));
+                }
+
+                switch (type_get_stack_type(operand_type)) {
                     case STACK_TYPE_O: {
-                        if (type_is_interface(top_type)) {
-                            goto dup_value_type;
+                        if (type_is_interface(operand_type)) {
+                            goto ldind_value_type;
                         } else {
-                            goto dup_primitive_type;
+                            goto ldind_primitive_type;
                         }
                     } break;
 
-                    dup_primitive_type:
+                    ldind_primitive_type:
                     case STACK_TYPE_INT32:
                     case STACK_TYPE_INT64:
                     case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_FLOAT:
-                    case STACK_TYPE_REF: {
-                        MIR_insn_code_t code = jit_number_inscode(top_type);
-                        // normal value, copy the two regs
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, code,
-                                                     MIR_new_reg_op(mir_ctx, value_1),
-                                                     MIR_new_reg_op(mir_ctx, top_reg)));
+                    case STACK_TYPE_FLOAT: {
+                        // we need to extend this properly if the field is smaller
+                        // than an int32 (because we are going to load into an int32
+                        // essentially)
+                        MIR_insn_code_t code = MIR_MOV;
+                        if (operand_type == tSystem_SByte || operand_type == tSystem_Boolean) {
+                            code = MIR_EXT8;
+                        } else if (operand_type == tSystem_Byte) {
+                            code = MIR_UEXT8;
+                        } else if (operand_type == tSystem_Int16) {
+                            code = MIR_EXT16;
+                        } else if (operand_type == tSystem_UInt16 || operand_type == tSystem_Char) {
+                            code = MIR_UEXT16;
+                        } else if (operand_type == tSystem_Single) {
+                            code = MIR_FMOV;
+                        } else if (operand_type == tSystem_Single) {
+                            code = MIR_DMOV;
+                        }
+
+                        // we can copy this in a single mov
                         MIR_append_insn(mir_ctx, mir_func,
                                         MIR_new_insn(mir_ctx, code,
-                                                     MIR_new_reg_op(mir_ctx, value_2),
-                                                     MIR_new_reg_op(mir_ctx, top_reg)));
+                                                     MIR_new_reg_op(mir_ctx, value_reg),
+                                                     MIR_new_mem_op(mir_ctx, get_mir_type(operand_type),
+                                                                    0, addr_reg, 0, 1)));
                     } break;
 
-                    dup_value_type:
+                    ldind_value_type:
                     case STACK_TYPE_VALUE_TYPE: {
-                        // only copy the second value, we can move the pointer
-                        // to the second one because we are essentially SSA
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_MOV,
-                                                     MIR_new_reg_op(mir_ctx, value_1),
-                                                     MIR_new_reg_op(mir_ctx, top_reg)));
-
-                        jit_emit_memcpy(ctx, value_2, value_1, top_type->StackSize);
+                        jit_emit_memcpy(ctx, value_reg, addr_reg, operand_type->StackSize);
                     } break;
-                }
-            } break;
 
-            case CEE_POP: {
-                CHECK_AND_RETHROW(stack_pop(ctx, NULL, NULL, NULL));
+                    case STACK_TYPE_REF:
+                        CHECK_FAIL();
+                }
             } break;
 
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            // Field access
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-            case CEE_STSFLD: {
-                // get the top value
+            case CEE_STIND_REF: operand_type = NULL; goto cee_stind;
+            case CEE_STIND_I1: operand_type = tSystem_SByte; goto cee_stind;
+            case CEE_STIND_I2: operand_type = tSystem_Int16; goto cee_stind;
+            case CEE_STIND_I4: operand_type = tSystem_Int32; goto cee_stind;
+            case CEE_STIND_I8: operand_type = tSystem_Int64; goto cee_stind;
+            case CEE_STIND_R4: operand_type = tSystem_Single; goto cee_stind;
+            case CEE_STIND_R8: operand_type = tSystem_Double; goto cee_stind;
+            case CEE_STOBJ: goto cee_stind;
+            cee_stind: {
+                // pop all the values from the stack
+                stack_entry_t addr_entry;
                 MIR_reg_t value_reg;
+                MIR_reg_t addr_reg;
                 System_Type value_type;
+                System_Type addr_type;
                 CHECK_AND_RETHROW(stack_pop(ctx, &value_type, &value_reg, NULL));
+                CHECK_AND_RETHROW(stack_pop(ctx, &addr_type, &addr_reg, &addr_entry));
 
-                // get the field type, ignoring stuff like enums
-                System_Type field_type = type_get_underlying_type(operand_field->FieldType);
+                // this must be an array
+                CHECK(addr_type->IsByRef);
+                CHECK(!addr_entry.readonly_ref);
 
-                // make sure the field is static
-                CHECK(field_is_static(operand_field));
-
-                // if this is an init-only field then make sure that
-                // only rtspecialname can access it (.ctor and .cctor)
-                if (field_is_init_only(operand_field)) {
-                    CHECK(
-                        method->DeclaringType == operand_field->DeclaringType &&
-                        method_is_rt_special_name(method) &&
-                        string_equals_cstr(method->Name, ".cctor")
-                    );
+                // for stind.ref the operand type is the same as the
+                // byref itself
+                if (operand_type == NULL) {
+                    operand_type = addr_type->BaseType;
                 }
 
-                // validate the assignability
-                CHECK(type_is_verifier_assignable_to(value_type, operand_field->FieldType));
-
-                // have the reference in a register for easy access
-                MIR_reg_t field_reg = new_temp_reg(ctx, tSystem_IntPtr);
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                             MIR_new_reg_op(mir_ctx, field_reg),
-                                             MIR_new_ref_op(mir_ctx, operand_field->MirField)));
-                MIR_op_t field_op = MIR_new_mem_op(mir_ctx, get_mir_type(field_type), 0, field_reg, 0, 1);
+                // validate all the type stuff
+                CHECK(type_is_verifier_assignable_to(value_type, operand_type));
 
                 switch (type_get_stack_type(value_type)) {
                     case STACK_TYPE_O: {
-                        if (type_is_interface(field_type)) {
+                        if (type_is_interface(operand_type)) {
                             if (type_is_interface(value_type)) {
                                 // interface -> interface
-                                goto stsfld_value_type;
+                                goto stind_value_type;
                             } else {
                                 // object -> interface
+
+                                // from an object, cast required, need a write barrier
                                 CHECK_AND_RETHROW(jit_cast_obj_to_interface(ctx,
-                                                                            field_reg, value_reg,
-                                                                            value_type, field_type));
+                                                                            addr_reg, value_reg,
+                                                                            value_type, operand_type));
                             }
                         } else {
+                            // check if we need to cast to an object from an interface
                             if (type_is_interface(value_type)) {
-                                // interface -> object
                                 MIR_append_insn(mir_ctx, mir_func,
                                                 MIR_new_insn(mir_ctx, MIR_MOV,
-                                                             field_op,
-                                                             MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*), value_reg, 0, 1)));
-                            } else {
-                                // object -> object
-                                goto stsfld_primitive_type;
+                                                             MIR_new_reg_op(mir_ctx, value_reg),
+                                                             MIR_new_mem_op(mir_ctx, MIR_T_P,
+                                                                            sizeof(void*), value_reg,
+                                                                            0, 1)));
                             }
+
+                            // storing to an object from an object
+                            MIR_append_insn(mir_ctx, mir_func,
+                                            MIR_new_call_insn(mir_ctx, 4,
+                                                              MIR_new_ref_op(mir_ctx, m_gc_update_ref_proto),
+                                                              MIR_new_ref_op(mir_ctx, m_gc_update_ref_func),
+                                                              MIR_new_reg_op(mir_ctx, addr_reg),
+                                                              MIR_new_reg_op(mir_ctx, value_reg)));
                         }
                     } break;
 
-                    stsfld_primitive_type:
                     case STACK_TYPE_INT32:
                     case STACK_TYPE_INT64:
                     case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_FLOAT:
-                    case STACK_TYPE_REF: {
-                        MIR_insn_code_t code = jit_number_cast_inscode(value_type, field_type);
+                    case STACK_TYPE_FLOAT: {
+                        MIR_insn_code_t code = jit_number_cast_inscode(value_type, operand_type);
                         MIR_append_insn(mir_ctx, mir_func,
                                         MIR_new_insn(mir_ctx, code,
-                                                     field_op,
+                                                     MIR_new_mem_op(mir_ctx, get_mir_type(operand_type),
+                                                                    0, addr_reg, 0, 1),
                                                      MIR_new_reg_op(mir_ctx, value_reg)));
                     } break;
 
-                    stsfld_value_type:
+                    stind_value_type:
                     case STACK_TYPE_VALUE_TYPE: {
-                        jit_emit_memcpy(ctx, field_reg, value_reg, value_type->StackSize);
+                        // copying into a managed pointer, use the managed ref memcpy
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_call_insn(mir_ctx, 5,
+                                                          MIR_new_ref_op(mir_ctx, m_managed_ref_memcpy_proto),
+                                                          MIR_new_ref_op(mir_ctx, m_managed_ref_memcpy_func),
+                                                          MIR_new_reg_op(mir_ctx, addr_reg),
+                                                          MIR_new_ref_op(mir_ctx, operand_type->MirType),
+                                                          MIR_new_reg_op(mir_ctx, value_reg)));
                     } break;
+
+                    case STACK_TYPE_REF:
+                        CHECK_FAIL("wtf");
                 }
             } break;
 
-            case CEE_LDSFLD: {
-                // only static fields
-                CHECK(field_is_static(operand_field));
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            // Comparison and branching
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-                // Get the field type
-                System_Type field_stack_type = type_get_intermediate_type(operand_field->FieldType);
-                System_Type field_type = type_get_underlying_type(operand_field->FieldType);
+            case CEE_CEQ: CHECK_AND_RETHROW(jit_compare_branch(ctx, -1, MIR_EQ)); break;
+            case CEE_CGT: CHECK_AND_RETHROW(jit_compare_branch(ctx, -1, MIR_GT)); break;
+            case CEE_CGT_UN: CHECK_AND_RETHROW(jit_compare_branch(ctx, -1, MIR_UGT)); break;
+            case CEE_CLT: CHECK_AND_RETHROW(jit_compare_branch(ctx, -1, MIR_LT)); break;
+            case CEE_CLT_UN: CHECK_AND_RETHROW(jit_compare_branch(ctx, -1, MIR_ULT)); break;
 
-                // push it
+            // unconditional branch
+            case CEE_BR:
+            case CEE_BR_S: {
+                // get the label
+                MIR_label_t label;
+                CHECK_AND_RETHROW(jit_branch_point(ctx, operand_i32, &label));
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_JMP,
+                                             MIR_new_label_op(mir_ctx, label)));
+            } break;
+
+            // branch false/true
+            case CEE_BRFALSE:
+            case CEE_BRFALSE_S:
+            case CEE_BRTRUE:
+            case CEE_BRTRUE_S: {
+                // get the value
                 MIR_reg_t value_reg;
-                CHECK_AND_RETHROW(stack_push(ctx, field_stack_type, &value_reg));
+                System_Type value_type;
+                CHECK_AND_RETHROW(stack_pop(ctx, &value_type, &value_reg, NULL));
 
-                // have the reference in a register for easy access
-                MIR_reg_t field_reg = new_temp_reg(ctx, tSystem_IntPtr);
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                             MIR_new_reg_op(mir_ctx, field_reg),
-                                             MIR_new_ref_op(mir_ctx, operand_field->MirField)));
-                MIR_op_t field_op = MIR_new_mem_op(mir_ctx, get_mir_type(field_type), 0, field_reg, 0, 1);
+                // get the label
+                MIR_label_t label;
+                CHECK_AND_RETHROW(jit_branch_point(ctx, operand_i32, &label));
 
-                switch (type_get_stack_type(field_type)) {
-                    case STACK_TYPE_O: {
-                        if (type_is_interface(field_type)) {
-                            goto ldsfld_value_type;
-                        } else {
-                            goto ldsfld_primitive_type;
-                        }
-                    } break;
+                // emit it properly
+                MIR_insn_code_t code;
+                if (opcode == CEE_BRFALSE || opcode == CEE_BRFALSE_S) {
+                    code = MIR_BF;
+                } else {
+                    code = MIR_BT;
+                }
 
-                    ldsfld_primitive_type:
+                switch (type_get_stack_type(value_type)) {
+                    // for 32bit we want the 32bit op
                     case STACK_TYPE_INT32:
-                    case STACK_TYPE_INT64:
-                    case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_FLOAT: {
-                        // we need to extend this properly if the field is smaller
-                        // than an int32 (because we are going to load into an int32
-                        // essentially)
-                        MIR_insn_code_t insn = MIR_MOV;
-                        if (field_type == tSystem_SByte || field_type == tSystem_Boolean) {
-                            insn = MIR_EXT8;
-                        } else if (field_type == tSystem_Byte) {
-                            insn = MIR_UEXT8;
-                        } else if (field_type == tSystem_Int16) {
-                            insn = MIR_EXT16;
-                        } else if (field_type == tSystem_UInt16 || field_type == tSystem_Char) {
-                            insn = MIR_UEXT16;
-                        } else if (field_type == tSystem_Single) {
-                            insn = MIR_FMOV;
-                        } else if (field_type == tSystem_Single) {
-                            insn = MIR_DMOV;
-                        }
+                        code += 1;
 
+                    case STACK_TYPE_INTPTR:
+                    case STACK_TYPE_INT64:
+                    case STACK_TYPE_REF:
+                    case STACK_TYPE_O: {
                         MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, insn,
-                                                     MIR_new_reg_op(mir_ctx, value_reg),
-                                                     field_op));
-                    } break;
-
-                    ldsfld_value_type:
-                    case STACK_TYPE_VALUE_TYPE: {
-                        // take the offset and copy it
-                        jit_emit_memcpy(ctx, value_reg, field_reg, field_type->StackSize);
+                                        MIR_new_insn(mir_ctx, code,
+                                                     MIR_new_label_op(mir_ctx, label),
+                                                     MIR_new_reg_op(mir_ctx, value_reg)));
                     } break;
 
-                    case STACK_TYPE_REF:
-                        CHECK_FAIL("wtf");
+                    case STACK_TYPE_VALUE_TYPE:
+                    case STACK_TYPE_FLOAT:
+                        CHECK_FAIL();
                 }
             } break;
 
-            case CEE_LDSFLDA: {
-                // only static fields
-                CHECK(field_is_static(operand_field));
-
-                // Get the field type
-                System_Type field_stack_type = get_by_ref_type(type_get_verification_type(operand_field->FieldType));
-
-                // push it
-                MIR_reg_t value_reg;
-                CHECK_AND_RETHROW(stack_push(ctx, field_stack_type, &value_reg));
-                STACK_TOP.non_local_ref = true; // static field, not local
-                STACK_TOP.readonly_ref = field_is_init_only(operand_field);
-
-                // very simple, just move the reference to the value field
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                             MIR_new_reg_op(mir_ctx, value_reg),
-                                             MIR_new_ref_op(mir_ctx, operand_field->MirField)));
-            } break;
+            // all the different compare and branch instructions
+            case CEE_BEQ:
+            case CEE_BEQ_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_BEQ)); break;
+            case CEE_BGE:
+            case CEE_BGE_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_BGE)); break;
+            case CEE_BGT:
+            case CEE_BGT_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_BGT)); break;
+            case CEE_BLE:
+            case CEE_BLE_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_BLE)); break;
+            case CEE_BLT:
+            case CEE_BLT_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_BLT)); break;
+            case CEE_BNE_UN:
+            case CEE_BNE_UN_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_BNE)); break;
+            case CEE_BGE_UN:
+            case CEE_BGE_UN_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_UBGE)); break;
+            case CEE_BGT_UN:
+            case CEE_BGT_UN_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_UBGT)); break;
+            case CEE_BLE_UN:
+            case CEE_BLE_UN_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_UBLE)); break;
+            case CEE_BLT_UN:
+            case CEE_BLT_UN_S: CHECK_AND_RETHROW(jit_compare_branch(ctx, operand_i32, MIR_UBLT)); break;
 
-            case CEE_STFLD: {
-                // get the values
-                stack_entry_t obj_entry;
-                MIR_reg_t obj_reg;
+            // switch
+            case CEE_SWITCH: {
                 MIR_reg_t value_reg;
-                System_Type obj_type;
                 System_Type value_type;
                 CHECK_AND_RETHROW(stack_pop(ctx, &value_type, &value_reg, NULL));
-                CHECK_AND_RETHROW(stack_pop(ctx, &obj_type, &obj_reg, &obj_entry));
 
-                // validate that the object type is a valid one for stfld
-                if (type_get_stack_type(obj_type) == STACK_TYPE_REF) {
-                    // this is a reference, so it has to be a reference to a value type
-                    // note that we can't know if the value type is part of another class
-                    // or not so we have to use gc_update_ref
-                    CHECK(obj_type->BaseType->IsValueType);
+                // allocate enough space for the ops
+                switch_ops = realloc(switch_ops, (operand_switch_n + 1) * sizeof(MIR_op_t));
 
-                    // must be a non-readonly reference
-                    CHECK(!obj_entry.readonly_ref);
-                } else {
-                    CHECK(type_get_stack_type(obj_type) == STACK_TYPE_O);
-                }
+                // branch selector
+                switch_ops[0] = MIR_new_reg_op(mir_ctx, value_reg);
 
-                // validate the field is part of the object
-                System_Type target = type_get_intermediate_type(operand_field->DeclaringType);
-                System_Type base = obj_type;
-                while (base != NULL && base != target) {
-                    base = base->BaseType;
+                // all the locations
+                for (int i = 0; i < operand_switch_n; i++) {
+                    MIR_label_t label;
+                    CHECK_AND_RETHROW(jit_branch_point(ctx, il_ptr + operand_switch_dests[i], &label));
+                    switch_ops[i + 1] = MIR_new_label_op(mir_ctx, label);
                 }
-                CHECK(base != NULL);
 
-                // make sure the field is compatible
-                CHECK(type_is_verifier_assignable_to(value_type, operand_field->FieldType));
+                // setup the not taken label
+                MIR_label_t not_taken = MIR_new_label(mir_ctx);
 
-                // TODO: does the runtime actually use ldfld for static fields?
-                //       in theory CIL allows that, but I think I won't for simplicity
-                CHECK(!field_is_static(operand_field));
+                // if the value is invalid then don't take the route and
+                // go to the default case
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_BGE,
+                                             MIR_new_label_op(mir_ctx, not_taken),
+                                             MIR_new_reg_op(mir_ctx, value_reg),
+                                             MIR_new_int_op(mir_ctx, operand_switch_n)));
 
-                // if this is an init-only field then make sure that
-                // only rtspecialname can access it (.ctor and .cctor)
-                if (field_is_init_only(operand_field)) {
-                    CHECK(
-                        method->DeclaringType == operand_field->DeclaringType &&
-                        method_is_rt_special_name(method) &&
-                        string_equals_cstr(method->Name, ".ctor")
-                    );
-                }
+                // do the switch itself
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn_arr(mir_ctx, MIR_SWITCH,
+                                                 operand_switch_n + 1, switch_ops));
 
-                // check the object is not null
-                if (type_get_stack_type(obj_type) == STACK_TYPE_O) {
-                    CHECK_AND_RETHROW(jit_null_check(ctx, obj_reg, obj_type));
-                }
+                MIR_append_insn(mir_ctx, mir_func, not_taken);
+            } break;
 
-                // validate the assignability
-                CHECK(type_is_verifier_assignable_to(value_type, operand_field->FieldType));
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            // Exception control flow
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-                // get the field type, ignoring stuff like enums
-                System_Type field_type = type_get_underlying_type(operand_field->FieldType);
+            case CEE_THROW: {
+                // get the return argument
+                MIR_reg_t obj_reg;
+                System_Type obj_type;
+                CHECK_AND_RETHROW(stack_pop(ctx, &obj_type, &obj_reg, NULL));
 
-                // check how we should assign the given item
-                switch (type_get_stack_type(value_type)) {
-                    case STACK_TYPE_O: {
-                        if (type_is_interface(field_type)) {
-                            if (type_is_interface(value_type)) {
-                                // interface -> interface
-                                goto stfld_value_type;
-                            } else {
-                                // object -> interface
+                // free this entirely
+                arrfree(ctx->stack.entries);
+                ctx->ireg.depth = 0;
+                ctx->freg.depth = 0;
+                ctx->dreg.depth = 0;
 
-                                // get the result, which is the object base plus the offset
-                                MIR_reg_t field_addr_reg = new_temp_reg(ctx, tSystem_UIntPtr);
-                                MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_insn(mir_ctx, MIR_ADD,
-                                                             MIR_new_reg_op(mir_ctx, field_addr_reg),
-                                                             MIR_new_reg_op(mir_ctx, obj_reg),
-                                                             MIR_new_int_op(mir_ctx, (int)operand_field->MemoryOffset)));
+                // check the object is not null
+                CHECK_AND_RETHROW(jit_null_check(ctx, obj_reg, obj_type, NULL));
 
-                                // emit the cast
-                                CHECK_AND_RETHROW(jit_cast_obj_to_interface(ctx,
-                                                                            field_addr_reg, value_reg,
-                                                                            value_type, field_type));
-                            }
-                        } else {
-                            // storing to an object from an object, use a write-barrier
-                            if (type_get_stack_type(obj_type) == STACK_TYPE_O) {
+                // append the instruction itself
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                             MIR_new_reg_op(mir_ctx, ctx->exception_reg),
+                                             MIR_new_reg_op(mir_ctx, obj_reg)));
 
-                                // check for interface -> object casting
-                                if (type_is_interface(value_type)) {
-                                    MIR_append_insn(mir_ctx, mir_func,
-                                                    MIR_new_insn(mir_ctx, MIR_MOV,
-                                                                 MIR_new_reg_op(mir_ctx, value_reg),
-                                                                 MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*), value_reg, 0, 1)));
-                                }
+                // throw it
+                CHECK_AND_RETHROW(jit_throw(ctx, obj_type));
+            } break;
 
-                                // the base is an object, call the gc_update write barrier
-                                MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_call_insn(mir_ctx, 5,
-                                                                  MIR_new_ref_op(mir_ctx, m_gc_update_proto),
-                                                                  MIR_new_ref_op(mir_ctx, m_gc_update_func),
-                                                                  MIR_new_reg_op(mir_ctx, obj_reg),
-                                                                  MIR_new_int_op(mir_ctx, (int)operand_field->MemoryOffset),
-                                                                  MIR_new_reg_op(mir_ctx, value_reg)));
-                            } else {
-                                // the base is a struct
+            case CEE_LEAVE:
+            case CEE_LEAVE_S: {
+                // resolve the label
+                MIR_label_t target_label;
+                CHECK_AND_RETHROW(jit_resolve_branch(ctx, operand_i32, &target_label));
 
-                                // add the offset to the object base
-                                MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_insn(mir_ctx, MIR_ADD,
-                                                             MIR_new_reg_op(mir_ctx, obj_reg),
-                                                             MIR_new_reg_op(mir_ctx, obj_reg),
-                                                             MIR_new_int_op(mir_ctx, (int)operand_field->MemoryOffset)));
+                int last_clausi = -1;
 
-                                // call the gc_update_ref write-barrier
-                                MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_call_insn(mir_ctx, 4,
-                                                                  MIR_new_ref_op(mir_ctx, m_gc_update_ref_proto),
-                                                                  MIR_new_ref_op(mir_ctx, m_gc_update_ref_func),
-                                                                  MIR_new_reg_op(mir_ctx, obj_reg),
-                                                                  MIR_new_reg_op(mir_ctx, value_reg)));
-                            }
-                        }
-                    } break;
+                // we found a leave, we are going to find every finally clause that we are in, and build
+                // up a chain of where to go next, if we already have a clause with an entry to go to, we
+                // are going to make sure it goes to the same place
+                bool in_a_protected_block = false;
+                System_Reflection_ExceptionHandlingClause_Array exceptions = body->ExceptionHandlingClauses;
+                for (int i = 0; i < exceptions->Length; i++) {
+                    System_Reflection_ExceptionHandlingClause clause = exceptions->Data[i];
 
-                    case STACK_TYPE_INT32:
-                    case STACK_TYPE_INT64:
-                    case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_FLOAT: {
-                        MIR_insn_code_t code = jit_number_cast_inscode(value_type, field_type);
+                    if (clause->HandlerOffset <= ctx->il_offset && ctx->il_offset < clause->HandlerOffset + clause->HandlerLength) {
+                        // we are in a handler region, this means that the exception has been dealt with and
+                        // we should clear it out so the finally nodes won't think that it might need to do
+                        // something with it
+                        in_a_protected_block = true;
+
+                        // reset the exception value
                         MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, code,
-                                                     MIR_new_mem_op(mir_ctx,
-                                                                    get_mir_type(operand_field->FieldType),
-                                                                    (int)operand_field->MemoryOffset,
-                                                                    obj_reg, 0, 1),
-                                                     MIR_new_reg_op(mir_ctx, value_reg)));
-                    } break;
+                                        MIR_new_insn(mir_ctx, MIR_MOV,
+                                                     MIR_new_reg_op(mir_ctx, ctx->exception_reg),
+                                                     MIR_new_int_op(mir_ctx, 0)));
+                    }
 
-                    stfld_value_type:
-                    case STACK_TYPE_VALUE_TYPE: {
-                        if (arrlen(value_type->ManagedPointersOffsets) == 0) {
-                            // there are no managed pointers in the value type we are storing, so
-                            // we can do a normal memcpy no matter what
+                    // make sure we are in this try
+                    if (clause->TryOffset > ctx->il_offset || ctx->il_offset >= clause->TryOffset + clause->TryLength)
+                        continue;
 
-                            // add the offset to the object base
-                            MIR_append_insn(mir_ctx, mir_func,
-                                            MIR_new_insn(mir_ctx, MIR_ADD,
-                                                         MIR_new_reg_op(mir_ctx, obj_reg),
-                                                         MIR_new_reg_op(mir_ctx, obj_reg),
-                                                         MIR_new_int_op(mir_ctx, (int)operand_field->MemoryOffset)));
+                    // we are in a try block
+                    in_a_protected_block = true;
 
-                            // emit a memcpy
-                            jit_emit_memcpy(ctx, obj_reg, value_reg, value_type->StackSize);
-                        } else {
-                            if (type_get_stack_type(obj_type) == STACK_TYPE_O) {
-                                // copying into a class, use the managed memcpy
-                                MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_call_insn(mir_ctx, 6,
-                                                                  MIR_new_ref_op(mir_ctx, m_managed_memcpy_proto),
-                                                                  MIR_new_ref_op(mir_ctx, m_managed_memcpy_func),
-                                                                  MIR_new_reg_op(mir_ctx, obj_reg),
-                                                                  MIR_new_ref_op(mir_ctx, field_type->MirType),
-                                                                  MIR_new_int_op(mir_ctx, (int)operand_field->MemoryOffset),
-                                                                  MIR_new_reg_op(mir_ctx, value_reg)));
-                            } else {
-                                // add the offset to the object base
-                                MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_insn(mir_ctx, MIR_ADD,
-                                                             MIR_new_reg_op(mir_ctx, obj_reg),
-                                                             MIR_new_reg_op(mir_ctx, obj_reg),
-                                                             MIR_new_int_op(mir_ctx, (int)operand_field->MemoryOffset)));
+                    // make sure we are getting a final block
+                    if (clause->Flags != COR_ILEXCEPTION_CLAUSE_FINALLY)
+                        continue;
 
-                                // copying into a managed pointer, use the managed ref memcpy
-                                MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_call_insn(mir_ctx, 5,
-                                                                  MIR_new_ref_op(mir_ctx, m_managed_ref_memcpy_proto),
-                                                                  MIR_new_ref_op(mir_ctx, m_managed_ref_memcpy_func),
-                                                                  MIR_new_reg_op(mir_ctx, obj_reg),
-                                                                  MIR_new_ref_op(mir_ctx, field_type->MirType),
-                                                                  MIR_new_reg_op(mir_ctx, value_reg)));
-                            }
-                        }
-                    } break;
+                    // lets get the clause label and offset
+                    int clausei = hmgeti(ctx->clause_to_label, clause);
+                    CHECK(clausei != -1);
+                    MIR_label_t finally_label = ctx->clause_to_label[clausei].value;
 
-                    case STACK_TYPE_REF: {
-                        CHECK_FAIL("There is no such thing as a ref-field");
-                    } break;
-                }
-            } break;
+                    // the current finally clause is going to jump into the target label
+                    // (unless it is nested in someone else)
+                    ctx->clause_to_label[clausei].next_clause = target_label;
+                    ctx->clause_to_label[clausei].last_in_chain = true;
 
-            case CEE_LDFLD: {
-                // get the object instance
-                System_Type obj_type;
-                MIR_reg_t obj_reg;
-                CHECK_AND_RETHROW(stack_pop(ctx, &obj_type, &obj_reg, NULL));
+                    if (last_clausi == -1) {
+                        // jump to the first finally we see
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_JMP,
+                                                     MIR_new_label_op(mir_ctx, finally_label)));
+                    } else {
+                        // the last clause is going to actually jump to us
+                        ctx->clause_to_label[last_clausi].next_clause = finally_label;
+                        ctx->clause_to_label[last_clausi].last_in_chain = false;
+                    }
 
-                // validate that the object type is a valid one for stfld
-                if (type_get_stack_type(obj_type) == STACK_TYPE_REF) {
-                    // this is a reference, so it has to be a reference to a value type
-                    CHECK(obj_type->BaseType->IsValueType);
-                } else {
-                    CHECK(type_get_stack_type(obj_type) == STACK_TYPE_O || type_get_stack_type(obj_type) == STACK_TYPE_VALUE_TYPE);
+                    last_clausi = clausei;
                 }
 
-                // validate the field is part of the object
-                System_Type target = type_get_intermediate_type(operand_field->DeclaringType);
-                System_Type base = obj_type;
-                while (base != NULL && base != target) {
-                    base = base->BaseType;
-                }
-                CHECK(base != NULL);
+                // make sure we are in a try region
+                CHECK(in_a_protected_block);
 
-                // TODO: does the runtime actually use ldfld for static fields?
-                CHECK(!field_is_static(operand_field));
+                if (last_clausi == -1) {
+                    // there is no finally around us, we can
+                    // safely jump to the target
+                    MIR_append_insn(mir_ctx, mir_func,
+                                    MIR_new_insn(mir_ctx, MIR_JMP,
+                                                 MIR_new_label_op(mir_ctx, target_label)));
 
-                // Get the field type
-                System_Type field_stack_type = type_get_intermediate_type(operand_field->FieldType);
-                System_Type field_type = type_get_underlying_type(operand_field->FieldType);
+                }
+            } break;
 
-                // push it
+            case CEE_ENDFINALLY: {
+                // find the finally block we are in
+                bool found = false;
+                System_Reflection_ExceptionHandlingClause_Array exceptions = body->ExceptionHandlingClauses;
+                for (int i = exceptions->Length - 1; i >= 0; i--) {
+                    System_Reflection_ExceptionHandlingClause clause = exceptions->Data[i];
+
+                    // make sure we are in this try
+                    if (clause->HandlerOffset > ctx->il_offset || ctx->il_offset >= clause->HandlerOffset + clause->HandlerLength)
+                        continue;
+
+                    // make sure we are getting a final block
+                    CHECK (clause->Flags == COR_ILEXCEPTION_CLAUSE_FINALLY);
+
+                    // lets get the clause label and offset
+                    int clausei = hmgeti(ctx->clause_to_label, clause);
+                    CHECK(clausei != -1);
+                    MIR_label_t next_clause = ctx->clause_to_label[clausei].next_clause;
+                    CHECK(next_clause != NULL);
+
+                    // next_clause will either continue to the next finally if there was an exception, or it will
+                    // continue to the next instruction if there was no exception
+                    MIR_label_t skip = MIR_new_label(mir_ctx);
+
+                    MIR_append_insn(mir_ctx, mir_func,
+                                    MIR_new_insn(mir_ctx, MIR_BF,
+                                                 MIR_new_label_op(mir_ctx, skip),
+                                                 MIR_new_reg_op(mir_ctx, ctx->exception_reg)));
+
+                    if (ctx->clause_to_label[clausei].last_in_chain) {
+                        //
+                        // This is the last finally in the function and in the chain, so we can return
+                        // right away from this function with the error.
+                        //
+
+                        // figure how many we need
+                        size_t nres = 1;
+                        if (ctx->method->ReturnType != NULL) {
+                            MIR_type_t mtype = get_mir_type(ctx->method->ReturnType);
+                            if (mtype != MIR_T_BLK) {
+                                nres = 2;
+                            }
+                        }
+
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_ret_insn(mir_ctx, nres,
+                                                         MIR_new_reg_op(mir_ctx, ctx->exception_reg),
+                                                         MIR_new_int_op(mir_ctx, 0)));
+
+                    } else {
+                        // The function has another clause in the
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_JMP,
+                                                     MIR_new_label_op(mir_ctx, next_clause)));
+                    }
+
+                    // insert the skip label
+                    MIR_append_insn(mir_ctx, mir_func, skip);
+
+                    found = true;
+                    break;
+                }
+
+                CHECK(found);
+            } break;
+
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            // Variables
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+            case CEE_STLOC_0:
+            case CEE_STLOC_1:
+            case CEE_STLOC_2:
+            case CEE_STLOC_3: operand_i32 = opcode - CEE_STLOC_0;
+            case CEE_STLOC_S:
+            case CEE_STLOC: {
+                // get the top value
                 MIR_reg_t value_reg;
-                CHECK_AND_RETHROW(stack_push(ctx, field_stack_type, &value_reg));
+                System_Type value_type;
+                stack_entry_t value_entry;
+                CHECK_AND_RETHROW(stack_pop(ctx, &value_type, &value_reg, &value_entry));
 
-                // check the object is not null
-                if (type_get_stack_type(obj_type) == STACK_TYPE_O) {
-                    CHECK_AND_RETHROW(jit_null_check(ctx, obj_reg, obj_type));
+                // the variable now has whatever we store in it
+                jit_forget_non_null(ctx, JIT_SOURCE_LOCAL(operand_i32));
+                if (value_entry.non_null) {
+                    jit_mark_non_null(ctx, JIT_SOURCE_LOCAL(operand_i32));
                 }
 
-                switch (type_get_stack_type(field_type)) {
+                // get the variable
+                CHECK(operand_i32 < body->LocalVariables->Length);
+                System_Reflection_LocalVariableInfo variable = body->LocalVariables->Data[operand_i32];
+                System_Type variable_type = type_get_intermediate_type(variable->LocalType);
+
+                // check the type is valid
+                CHECK(type_is_verifier_assignable_to(value_type, variable_type));
+
+                switch (type_get_stack_type(value_type)) {
                     case STACK_TYPE_O: {
-                        if (type_is_interface(field_type)) {
-                            goto ldfld_value_type;
+                        if (type_is_interface(variable_type)) {
+                            if (type_is_interface(value_type)) {
+                                // interface -> interface
+                                goto stloc_value_type;
+                            } else {
+                                // object -> interface
+                                CHECK(locals[operand_i32].mode == MIR_OP_REG);
+                                CHECK_AND_RETHROW(jit_cast_obj_to_interface(ctx,
+                                                                            locals[operand_i32].u.reg, value_reg,
+                                                                            value_type, variable_type));
+                            }
                         } else {
-                            goto ldfld_primitive_type;
+                            if (type_is_interface(value_type)) {
+                                // interface -> object
+                                MIR_append_insn(mir_ctx, mir_func,
+                                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                                             locals[operand_i32],
+                                                             MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*), value_reg, 0, 1)));
+                            } else {
+                                // object -> object
+                                goto stloc_primitive_type;
+                            }
                         }
                     } break;
 
-                    ldfld_primitive_type:
+                    stloc_primitive_type:
                     case STACK_TYPE_INT32:
                     case STACK_TYPE_INT64:
                     case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_FLOAT: {
-                        // we need to extend this properly if the field is smaller
-                        // than an int32 (because we are going to load into an int32
-                        // essentially)
-                        MIR_insn_code_t insn = MIR_MOV;
-                        if (field_type == tSystem_SByte || field_type == tSystem_Boolean) {
-                            insn = MIR_EXT8;
-                        } else if (field_type == tSystem_Byte) {
-                            insn = MIR_UEXT8;
-                        } else if (field_type == tSystem_Int16) {
-                            insn = MIR_EXT16;
-                        } else if (field_type == tSystem_UInt16 || field_type == tSystem_Char) {
-                            insn = MIR_UEXT16;
-                        } else if (field_type == tSystem_Single) {
-                            insn = MIR_FMOV;
-                        } else if (field_type == tSystem_Single) {
-                            insn = MIR_DMOV;
-                        }
-
+                    case STACK_TYPE_FLOAT:
+                    case STACK_TYPE_REF: {
+                        MIR_insn_code_t code = jit_number_cast_inscode(value_type, variable_type);
                         MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, insn,
-                                                     MIR_new_reg_op(mir_ctx, value_reg),
-                                                     MIR_new_mem_op(mir_ctx,
-                                                                    get_mir_type(operand_field->FieldType),
-                                                                    (int)operand_field->MemoryOffset,
-                                                                    obj_reg, 0, 1)));
+                                        MIR_new_insn(mir_ctx, code,
+                                                     locals[operand_i32],
+                                                     MIR_new_reg_op(mir_ctx, value_reg)));
                     } break;
 
-                    ldfld_value_type:
+                    stloc_value_type:
                     case STACK_TYPE_VALUE_TYPE: {
-                        // take the offset and copy it
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_ADD,
-                                                     MIR_new_reg_op(mir_ctx, obj_reg),
-                                                     MIR_new_reg_op(mir_ctx, obj_reg),
-                                                     MIR_new_int_op(mir_ctx, (int)operand_field->MemoryOffset)));
-                        jit_emit_memcpy(ctx, value_reg, obj_reg, field_type->StackSize);
+                        CHECK(locals[operand_i32].mode == MIR_OP_REG);
+                        jit_emit_memcpy(ctx, locals[operand_i32].u.reg, value_reg, value_type->StackSize);
                     } break;
-
-                    case STACK_TYPE_REF:
-                        CHECK_FAIL("wtf");
                 }
             } break;
 
-            case CEE_LDFLDA: {
-                // get the object instance
-                stack_entry_t obj_entry;
-                System_Type obj_type;
-                MIR_reg_t obj_reg;
-                CHECK_AND_RETHROW(stack_pop(ctx, &obj_type, &obj_reg, &obj_entry));
+            case CEE_LDLOC_0:
+            case CEE_LDLOC_1:
+            case CEE_LDLOC_2:
+            case CEE_LDLOC_3: operand_i32 = opcode - CEE_LDLOC_0;
+            case CEE_LDLOC_S:
+            case CEE_LDLOC: {
+                // get the variable
+                CHECK(operand_i32 < body->LocalVariables->Length);
+                System_Reflection_LocalVariableInfo variable = body->LocalVariables->Data[operand_i32];
+                System_Type value_type = type_get_intermediate_type(variable->LocalType);
 
-                // validate that the object type is a valid one for ldfld
-                CHECK(type_get_stack_type(obj_type) == STACK_TYPE_O || type_get_stack_type(obj_type) == STACK_TYPE_REF);
+                // push it
+                MIR_reg_t value_reg;
+                CHECK_AND_RETHROW(stack_push(ctx, value_type, &value_reg));
+                STACK_TOP.source = JIT_SOURCE_LOCAL(operand_i32);
+                STACK_TOP.non_null = jit_source_is_non_null(ctx, STACK_TOP.source);
 
-                // validate the field is part of the object
-                System_Type target = type_get_intermediate_type(operand_field->DeclaringType);
-                System_Type base = obj_type;
-                while (base != NULL && base != target) {
-                    base = base->BaseType;
-                }
-                CHECK(base != NULL);
+                switch (type_get_stack_type(value_type)) {
+                    case STACK_TYPE_O: {
+                        if (type_is_interface(value_type)) {
+                            // interface type, copy it
+                            goto ldloc_value_type;
+                        } else {
+                            // primitive type, move it
+                            goto ldloc_primitive_type;
+                        }
+                    } break;
 
-                // TODO: does the runtime actually use ldfld for static fields?
-                CHECK(!field_is_static(operand_field));
+                    ldloc_primitive_type:
+                    case STACK_TYPE_INT32:
+                    case STACK_TYPE_INT64:
+                    case STACK_TYPE_INTPTR:
+                    case STACK_TYPE_FLOAT:
+                    case STACK_TYPE_REF: {
+                        MIR_insn_code_t code = jit_number_inscode(value_type);
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, code,
+                                                     MIR_new_reg_op(mir_ctx, value_reg),
+                                                     locals[operand_i32]));
+                    } break;
 
-                // Get the field type
-                System_Type field_stack_type = get_by_ref_type(type_get_verification_type(operand_field->FieldType));
+                    ldloc_value_type:
+                    case STACK_TYPE_VALUE_TYPE: {
+                        CHECK(locals[operand_i32].mode == MIR_OP_REG);
+                        jit_emit_memcpy(ctx, value_reg, locals[operand_i32].u.reg, value_type->StackSize);
+                    } break;
+                }
+            } break;
+
+            case CEE_LDLOCA:
+            case CEE_LDLOCA_S: {
+                // get the variable
+                CHECK(operand_i32 < body->LocalVariables->Length);
+                System_Reflection_LocalVariableInfo variable = body->LocalVariables->Data[operand_i32];
+                System_Type value_type = get_by_ref_type(type_get_verification_type(variable->LocalType));
 
                 // push it
                 MIR_reg_t value_reg;
-                CHECK_AND_RETHROW(stack_push(ctx, field_stack_type, &value_reg));
+                CHECK_AND_RETHROW(stack_push(ctx, value_type, &value_reg));
 
-                // check if this comes as an outside reference
-                bool non_stack_local = false;
-                bool readonly = field_is_init_only(operand_field);
-                if (type_get_stack_type(obj_type) == STACK_TYPE_O) {
-                    // heap object
-                    non_stack_local = true;
-                } else if (type_get_stack_type(obj_type) == STACK_TYPE_REF) {
-                    // check if the reference is a non-value type
-                    CHECK(type_is_value_type(obj_type->BaseType));
-                    non_stack_local = obj_entry.non_local_ref;
-                    readonly = readonly || obj_entry.readonly_ref;
-                }
-                STACK_TOP.non_local_ref = non_stack_local;
-                STACK_TOP.readonly_ref = readonly;
+                switch (type_get_stack_type(variable->LocalType)) {
+                    case STACK_TYPE_O: {
+                        if (type_is_interface(variable->LocalType)) {
+                            goto ldloca_value_type;
+                        } else {
+                            goto ldloca_primitive_type;
+                        }
+                    } break;
 
-                // check the object is not null
-                if (type_get_stack_type(obj_type) == STACK_TYPE_O) {
-                    CHECK_AND_RETHROW(jit_null_check(ctx, obj_reg, obj_type));
-                }
+                    ldloca_primitive_type:
+                    case STACK_TYPE_INT32:
+                    case STACK_TYPE_INT64:
+                    case STACK_TYPE_INTPTR:
+                    case STACK_TYPE_FLOAT:
+                    case STACK_TYPE_REF: {
+                        CHECK(locals[operand_i32].mode == MIR_OP_MEM);
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_MOV,
+                                                     MIR_new_reg_op(mir_ctx, value_reg),
+                                                     MIR_new_reg_op(mir_ctx, locals[operand_i32].u.mem.base)));
+                    } break;
 
-                // very simple, just add to the object the field offset
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_ADD,
-                                             MIR_new_reg_op(mir_ctx, value_reg),
-                                             MIR_new_reg_op(mir_ctx, obj_reg),
-                                             MIR_new_int_op(mir_ctx, (int)operand_field->MemoryOffset)));
+                    ldloca_value_type:
+                    case STACK_TYPE_VALUE_TYPE: {
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_MOV,
+                                                     MIR_new_reg_op(mir_ctx, value_reg),
+                                                     locals[operand_i32]));
+                    } break;
+                }
             } break;
 
             ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            // Calls and Returns
+            // Arguments
             ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-            //
-            // we are going to do NEWOBJ in here as well, because it is essentially like a call
-            // but we create the object right now instead of getting it from the stack, so I
-            // think this will remove alot of duplicate code if we just handle it in here
-            //
-
-            case CEE_NEWOBJ:
-            case CEE_CALLVIRT:
-            case CEE_CALL: {
-                System_Type ret_type = type_get_underlying_type(operand_method->ReturnType);
-
-                // count the amount of arguments, +1 if we have a this
-                int arg_count = operand_method->Parameters->Length;
-                bool aggressive_inlining = method_is_aggressive_inlining(operand_method);
+            case CEE_STARG_S:
+            case CEE_STARG: {
+                // get the top value
+                MIR_reg_t value_reg;
+                System_Type value_type;
+                stack_entry_t value_entry;
+                CHECK_AND_RETHROW(stack_pop(ctx, &value_type, &value_reg, &value_entry));
 
-                if (opcode == CEE_NEWOBJ) {
-                    // newobj must call a ctor, we verify that ctors are good
-                    // in the loader
-                    CHECK(method_is_rt_special_name(operand_method));
-                    CHECK(string_equals_cstr(operand_method->Name, ".ctor"));
+                // the argument now has whatever we store in it
+                jit_forget_non_null(ctx, JIT_SOURCE_ARG(operand_i32));
+                if (value_entry.non_null) {
+                    jit_mark_non_null(ctx, JIT_SOURCE_ARG(operand_i32));
+                }
 
-                    if (ftnMethod != NULL) {
-                        // we had an ldftn/ldvirtftb, meaning that we are going to
-                        // create a delegate now, make sure of that
-                        CHECK(operand_method->DeclaringType->BaseType == tSystem_MulticastDelegate);
-                        CHECK(operand_method->Parameters->Length == 2);
-                        CHECK(operand_method->Parameters->Data[0]->ParameterType == tSystem_Object);
-                        CHECK(operand_method->Parameters->Data[1]->ParameterType == tSystem_IntPtr);
+                // get the argument
+                char arg_name_buf[64];
+                const char* arg_name = NULL;
 
-                        // verify that the method signature matches the delegate we
-                        // want to create
-                        System_Reflection_MethodInfo signature = operand_method->DeclaringType->DelegateSignature;
-                        CHECK(signature != NULL);
-                        CHECK(signature->ReturnType == ftnMethod->ReturnType);
-                        CHECK(signature->Parameters->Length == ftnMethod->Parameters->Length);
-                        for (int i = 0; i < signature->Parameters->Length; i++) {
-                            CHECK(signature->Parameters->Data[i]->ParameterType == ftnMethod->Parameters->Data[i]->ParameterType);
+                // resolve the type
+                System_Type arg_type = NULL;
+                if (!method_is_static(method)) {
+                    if (operand_i32 == 0) {
+                        arg_name = "this";
+                        arg_type = method->DeclaringType;
+                        if (arg_type->IsValueType) {
+                            // value types turn into a by-ref when using this
+                            arg_type = get_by_ref_type(arg_type);
                         }
-                    } else {
-                        // make sure that this is *NOT* a delegate
-                        CHECK(operand_method->DeclaringType->BaseType != tSystem_MulticastDelegate);
                     }
-                } else if (opcode == CEE_CALLVIRT) {
-                    // callvirt must call an instance methods
-                    CHECK(!method_is_static(operand_method));
-                } else {
-                    // call must call a method with a body
-                    CHECK(!method_is_abstract(operand_method));
+                    operand_i32--;
                 }
 
-                // prepare array of all the operands
-                // 1st is the prototype
-                // 2nd is the reference
-                // 3rd is exception return
-                // 4rd is return type (optionally)
-                // 5th is this type (optionally)
-                // Rest are the arguments
-                size_t other_args = 3;
-                if (ret_type != NULL) other_args++;
-                if (!method_is_static(operand_method)) other_args++;
-                MIR_op_t arg_ops[other_args + arg_count];
-
-                // to track if we passed local refs
-                bool ret_is_non_local_ref = true;
-
-                // pop all the arguments from the stack
-                int i;
-                for (i = arg_count + other_args - 1; i >= other_args; i--) {
-                    System_Reflection_ParameterInfo parameter_info = operand_method->Parameters->Data[i - other_args];
-                    System_Type signature_type = parameter_info->ParameterType;
+                // if this is not `this` then get the name
+                if (arg_name == NULL) {
+                    snprintf(arg_name_buf, sizeof(arg_name_buf), "arg%d", operand_i32);
+                    arg_name = arg_name_buf;
+                }
 
-                    // get the argument value
-                    stack_entry_t arg_entry;
-                    MIR_reg_t arg_reg;
-                    System_Type arg_type;
-                    CHECK_AND_RETHROW(stack_pop(ctx, &arg_type, &arg_reg, &arg_entry));
+                if (arg_type == NULL) {
+                    CHECK(operand_i32 < method->Parameters->Length);
+                    System_Reflection_ParameterInfo parameter = method->Parameters->Data[operand_i32];
+                    arg_type = parameter->ParameterType;
+                }
 
-                    // do implicit conversion as needed
-                    bool mem_op = false;
-                    switch (type_get_stack_type(arg_type)) {
-                        case STACK_TYPE_O: {
-                            if (type_is_interface(signature_type)) {
-                                if (!type_is_interface(arg_type)) {
-                                    // object --> interface
-                                    MIR_reg_t int_reg = new_temp_reg(ctx, signature_type);
-                                    CHECK_AND_RETHROW(jit_cast_obj_to_interface(ctx, int_reg, arg_reg, arg_type, signature_type));
+                // the register containing the value
+                MIR_reg_t arg_reg = MIR_reg(mir_ctx, arg_name, mir_func->u.func);
 
-                                    // we now have that class
-                                    arg_reg = int_reg;
-                                    arg_type = signature_type;
-                                }
+                // check the type is valid
+                CHECK(type_is_verifier_assignable_to(value_type, arg_type));
 
-                                // pass by value
-                                mem_op = true;
+                switch (type_get_stack_type(value_type)) {
+                    case STACK_TYPE_O: {
+                        if (type_is_interface(arg_type)) {
+                            if (type_is_interface(value_type)) {
+                                // interface -> interface
+                                goto starg_value_type;
                             } else {
-                                if (type_is_interface(arg_type)) {
-                                    // interface --> object
-                                    MIR_append_insn(mir_ctx, mir_func,
-                                                    MIR_new_insn(mir_ctx, MIR_MOV,
-                                                                     MIR_new_reg_op(mir_ctx, arg_reg),
-                                                                     MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*), arg_reg, 0, 1)));
-                                }
+                                // object -> interface
+                                CHECK_AND_RETHROW(jit_cast_obj_to_interface(ctx,
+                                                                            arg_reg, value_reg,
+                                                                            value_type, arg_type));
                             }
-                        } break;
-
-                        case STACK_TYPE_INT32: {
-                            if (
-                                signature_type == tSystem_SByte ||
-                                signature_type == tSystem_Byte ||
-                                signature_type == tSystem_Boolean ||
-                                signature_type == tSystem_Int16 ||
-                                signature_type == tSystem_UInt16 ||
-                                signature_type == tSystem_Char
-                            ) {
-                                // truncate, going to be done implicitly by mir
-                                arg_type = signature_type;
-                            } else if (signature_type == tSystem_IntPtr) {
-                                // sign extend
-                                MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_insn(mir_ctx, MIR_EXT32,
-                                                             MIR_new_reg_op(mir_ctx, arg_reg),
-                                                             MIR_new_reg_op(mir_ctx, arg_reg)));
-                                arg_type = signature_type;
-                            } else if (signature_type == tSystem_UIntPtr) {
-                                // zero extend
+                        } else {
+                            if (type_is_interface(value_type)) {
+                                // interface -> object
                                 MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_insn(mir_ctx, MIR_UEXT32,
+                                                MIR_new_insn(mir_ctx, MIR_MOV,
                                                              MIR_new_reg_op(mir_ctx, arg_reg),
-                                                             MIR_new_reg_op(mir_ctx, arg_reg)));
-                                arg_type = signature_type;
-                            }
-                        } break;
-
-                        case STACK_TYPE_INTPTR: {
-                            if (type_is_integer(signature_type)) {
-                                // truncate or nop, we don't really care
-                                arg_type = signature_type;
+                                                             MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*), value_reg, 0, 1)));
+                            } else {
+                                // object -> object
+                                goto starg_primitive_type;
                             }
-                        } break;
+                        }
+                    } break;
 
-                        case STACK_TYPE_FLOAT: {
-                            // handle implicit float casting
-                            if (arg_type == tSystem_Single) {
-                                if (signature_type == tSystem_Double) {
-                                    // float->double conversion
-                                    MIR_reg_t real_arg_reg = new_temp_reg(ctx, tSystem_Double);
-                                    MIR_append_insn(mir_ctx, mir_func,
-                                                    MIR_new_insn(mir_ctx, MIR_F2D,
-                                                                 MIR_new_reg_op(mir_ctx, real_arg_reg),
-                                                                 MIR_new_reg_op(mir_ctx, arg_reg)));
-                                    arg_reg = real_arg_reg;
-                                    arg_type = signature_type;
-                                }
-                            } else if (arg_type == tSystem_Double) {
-                                if (signature_type == tSystem_Single) {
-                                    // double->float conversion
-                                    MIR_reg_t real_arg_reg = new_temp_reg(ctx, tSystem_Single);
-                                    MIR_append_insn(mir_ctx, mir_func,
-                                                    MIR_new_insn(mir_ctx, MIR_D2F,
-                                                                 MIR_new_reg_op(mir_ctx, real_arg_reg),
-                                                                 MIR_new_reg_op(mir_ctx, arg_reg)));
-                                    arg_reg = real_arg_reg;
-                                    arg_type = signature_type;
-                                }
-                            }
-                        } break;
+                    starg_primitive_type:
+                    case STACK_TYPE_INT32:
+                    case STACK_TYPE_INT64:
+                    case STACK_TYPE_INTPTR:
+                    case STACK_TYPE_FLOAT:
+                    case STACK_TYPE_REF: {
+                        MIR_insn_code_t code = jit_number_cast_inscode(value_type, arg_type);
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, code,
+                                                     MIR_new_reg_op(mir_ctx, arg_reg),
+                                                     MIR_new_reg_op(mir_ctx, value_reg)));
+                    } break;
 
-                        case STACK_TYPE_REF: {
-                            // if this is a readonly reference, then we are only allowed
-                            // to pass it to parameters marked as in
-                            if (arg_entry.readonly_ref) {
-                                CHECK(parameter_is_in(parameter_info));
-                            }
+                    starg_value_type:
+                    case STACK_TYPE_VALUE_TYPE: {
+                        jit_emit_memcpy(ctx, arg_reg, value_reg, value_type->StackSize);
+                    } break;
+                }
+            } break;
 
-                            // if this is a reference that might be returned from the method we are calling
+            case CEE_LDARG_0:
+            case CEE_LDARG_1:
+            case CEE_LDARG_2:
+            case CEE_LDARG_3: operand_i32 = opcode - CEE_LDARG_0;
+            case CEE_LDARG_S:
+            case CEE_LDARG: {
+                char arg_name_buf[64];
+                const char* arg_name = NULL;
+                bool readonly_ref = false;
+
+                // resolve the type
+                System_Type arg_type = NULL;
+                if (!method_is_static(method)) {
+                    if (operand_i32 == 0) {
+                        arg_name = "this";
+                        arg_type = method->DeclaringType;
+                        if (arg_type->IsValueType) {
+                            // value types turn into a by-ref when using this
+                            arg_type = get_by_ref_type(arg_type);
+                        }
+                    }
+                    operand_i32--;
+                }
+
+                // if this is not `this` then get the name
+                if (arg_name == NULL) {
+                    snprintf(arg_name_buf, sizeof(arg_name_buf), "arg%d", operand_i32);
+                    arg_name = arg_name_buf;
+                }
+
+                if (arg_type == NULL) {
+                    CHECK(operand_i32 < method->Parameters->Length);
+                    System_Reflection_ParameterInfo parameter = method->Parameters->Data[operand_i32];
+                    arg_type = parameter->ParameterType;
+                    readonly_ref = parameter_is_in(parameter);
+                }
+
+                // the register containing the value
+                MIR_reg_t arg_reg = MIR_reg(mir_ctx, arg_name, mir_func->u.func);
+
+                // Get the stack type of the arg
+                System_Type arg_stack_type = type_get_intermediate_type(arg_type);
+
+                // push it, the source is by the il index which counts the this
+                MIR_reg_t value_reg;
+                CHECK_AND_RETHROW(stack_push(ctx, arg_stack_type, &value_reg));
+                STACK_TOP.source = JIT_SOURCE_ARG(method_is_static(method) ? operand_i32 : operand_i32 + 1);
+                STACK_TOP.non_null = jit_source_is_non_null(ctx, STACK_TOP.source);
+
+                switch (type_get_stack_type(arg_stack_type)) {
+                    case STACK_TYPE_O: {
+                        if (type_is_interface(arg_stack_type)) {
+                            // interface type, copy it
+                            goto ldarg_value_type;
+                        } else {
+                            // primitive type, move it
+                            goto ldarg_primitive_type;
+                        }
+                    } break;
+
+                    ldarg_primitive_type:
+                    case STACK_TYPE_INT32:
+                    case STACK_TYPE_INT64:
+                    case STACK_TYPE_INTPTR:
+                    case STACK_TYPE_FLOAT: {
+                        MIR_insn_code_t code = jit_number_inscode(arg_stack_type);
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, code,
+                                                     MIR_new_reg_op(mir_ctx, value_reg),
+                                                     MIR_new_reg_op(mir_ctx, arg_reg)));
+                    } break;
+
+                    ldarg_value_type:
+                    case STACK_TYPE_VALUE_TYPE: {
+                        jit_emit_memcpy(ctx, value_reg, arg_reg, arg_stack_type->StackSize);
+                    } break;
+
+                    case STACK_TYPE_REF:
+                        // mark that this is a non-local ref type, as it comes from the outside
+                        // and depending on `in` it might be a readonly ref
+                        STACK_TOP.non_local_ref = true;
+                        STACK_TOP.readonly_ref = readonly_ref;
+                        goto ldarg_primitive_type;
+                }
+            } break;
+
+            case CEE_LDARGA:
+            case CEE_LDARGA_S: {
+                char arg_name_buf[64];
+                const char* arg_name = NULL;
+
+                // resolve the type
+                System_Type arg_type = NULL;
+                if (!method_is_static(method)) {
+                    if (operand_i32 == 0) {
+                        arg_name = "this";
+                        arg_type = method->DeclaringType;
+                        if (arg_type->IsValueType) {
+                            // value types turn into a by-ref when using this
+                            arg_type = get_by_ref_type(arg_type);
+                        }
+                    }
+                    operand_i32--;
+                }
+
+                // if this is not `this` then get the name
+                if (arg_name == NULL) {
+                    snprintf(arg_name_buf, sizeof(arg_name_buf), "arg%d", operand_i32);
+                    arg_name = arg_name_buf;
+                }
+
+                if (arg_type == NULL) {
+                    CHECK(operand_i32 < method->Parameters->Length);
+                    arg_type = method->Parameters->Data[operand_i32]->ParameterType;
+                }
+
+                // the register containing the value
+                MIR_reg_t arg_reg = MIR_reg(mir_ctx, arg_name, mir_func->u.func);
+
+                // Get the value type
+                System_Type value_type = get_by_ref_type(type_get_verification_type(arg_type));
+
+                // push it
+                MIR_reg_t value_reg;
+                CHECK_AND_RETHROW(stack_push(ctx, value_type, &value_reg));
+
+                switch (type_get_stack_type(arg_type)) {
+                    case STACK_TYPE_O: {
+                        if (type_is_interface(arg_type)) {
+                            // interface type, copy it
+                            goto ldarga_value_type;
+                        } else {
+                            // primitive type, move it
+                            goto ldarga_primitive_type;
+                        }
+                    } break;
+
+                    ldarga_primitive_type:
+                    case STACK_TYPE_INT32:
+                    case STACK_TYPE_INT64:
+                    case STACK_TYPE_INTPTR:
+                    case STACK_TYPE_FLOAT:
+                    case STACK_TYPE_REF: {
+                        CHECK_FAIL("TODO: spill arguments from registers");
+                    } break;
+
+                    ldarga_value_type:
+                    case STACK_TYPE_VALUE_TYPE: {
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_MOV,
+                                                     MIR_new_reg_op(mir_ctx, value_reg),
+                                                     MIR_new_reg_op(mir_ctx, arg_reg)));
+                    } break;
+                }
+            } break;
+
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            // Basic stack manipulation
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+            case CEE_LDC_I4_M1:
+            case CEE_LDC_I4_0:
+            case CEE_LDC_I4_1:
+            case CEE_LDC_I4_2:
+            case CEE_LDC_I4_3:
+            case CEE_LDC_I4_4:
+            case CEE_LDC_I4_5:
+            case CEE_LDC_I4_6:
+            case CEE_LDC_I4_7:
+            case CEE_LDC_I4_8: operand_i32 = (int32_t)opcode - CEE_LDC_I4_0;
+            case CEE_LDC_I4_S:
+            case CEE_LDC_I4: {
+                MIR_reg_t sr;
+                CHECK_AND_RETHROW(stack_push(ctx, tSystem_Int32, &sr));
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                             MIR_new_reg_op(mir_ctx, sr),
+                                             MIR_new_int_op(mir_ctx, operand_i32)));
+            } break;
+
+            case CEE_LDC_I8: {
+                MIR_reg_t reg;
+                CHECK_AND_RETHROW(stack_push(ctx, tSystem_Int64, &reg));
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                             MIR_new_reg_op(mir_ctx, reg),
+                                             MIR_new_int_op(mir_ctx, operand_i64)));
+            } break;
+
+            case CEE_LDC_R4: {
+                MIR_reg_t reg;
+                CHECK_AND_RETHROW(stack_push(ctx, tSystem_Single, &reg));
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_FMOV,
+                                             MIR_new_reg_op(mir_ctx, reg),
+                                             MIR_new_float_op(mir_ctx, operand_f32)));
+            } break;
+
+            case CEE_LDC_R8: {
+                MIR_reg_t reg;
+                CHECK_AND_RETHROW(stack_push(ctx, tSystem_Double, &reg));
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_DMOV,
+                                             MIR_new_reg_op(mir_ctx, reg),
+                                             MIR_new_double_op(mir_ctx, operand_f64)));
+            } break;
+
+            case CEE_LDSTR: {
+                // push a string type
+                MIR_reg_t string_reg;
+                CHECK_AND_RETHROW(stack_push(ctx, tSystem_String, &string_reg));
+                STACK_TOP.non_null = true;
+
+                // move it to the register
+                // TODO: better way to do this?
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                             MIR_new_reg_op(mir_ctx, string_reg),
+                                             MIR_new_uint_op(mir_ctx, (uintptr_t)operand_string)));
+            } break;
+
+            case CEE_LDNULL: {
+                // push a null type
+                MIR_reg_t null_reg;
+                CHECK_AND_RETHROW(stack_push(ctx, NULL, &null_reg));
+
+                // load a null value
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                             MIR_new_reg_op(mir_ctx, null_reg),
+                                             MIR_new_int_op(mir_ctx, 0)));
+            } break;
+
+            case CEE_LDTOKEN: {
+                // all of them are about the same, they have a single pointer of this
+                MIR_item_t runtime_handle_item = NULL;
+                MIR_reg_t runtime_handle_reg = 0;
+
+                // first resolve what we are going to even be pushing
+                switch (operand_token.table) {
+                    case METADATA_METHOD_DEF:
+                    case METADATA_METHOD_SPEC: {
+                        CHECK_FAIL("TODO: RuntimeMethodHandle");
+                    } break;
+
+                    case METADATA_TYPE_DEF:
+                    case METADATA_TYPE_REF:
+                    case METADATA_TYPE_SPEC: {
+                        // get the value
+                        System_Type type;
+                        CHECK_AND_RETHROW(assembly_get_type_by_token(assembly, operand_token,
+                                                                     method->DeclaringType->GenericArguments,
+                                                                     method->GenericArguments,
+                                                                     &type));
+
+                        // make sure the type is prepared
+                        CHECK_AND_RETHROW(jit_prepare_type(ctx->ctx, type));
+
+                        // push it
+                        CHECK_AND_RETHROW(stack_push(ctx, tSystem_RuntimeTypeHandle, &runtime_handle_reg));
+
+                        // the ptr is the type
+                        runtime_handle_item = type->MirType;
+                    } break;
+
+                    case METADATA_FIELD: {
+                        CHECK_FAIL("TODO: RuntimeFieldHandle");
+                    } break;
+
+                    case METADATA_MEMBER_REF: {
+                        CHECK_FAIL("TODO: figure method or field");
+                    } break;
+
+                    default:
+                        CHECK_FAIL();
+                }
+
+                // move it
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                             MIR_new_mem_op(mir_ctx, MIR_T_P, 0, runtime_handle_reg, 0, 1),
+                                             MIR_new_ref_op(mir_ctx, runtime_handle_item)));
+            } break;
+
+            case CEE_DUP: {
+                // get the top value
+                MIR_reg_t top_reg;
+                System_Type top_type;
+                stack_entry_t top_entry;
+                CHECK_AND_RETHROW(stack_pop(ctx, &top_type, &top_reg, &top_entry));
+
+                // create new two values, both are the same value as before
+                MIR_reg_t value_1;
+                MIR_reg_t value_2;
+                CHECK_AND_RETHROW(stack_push(ctx, top_type, &value_1));
+                STACK_TOP.source = top_entry.source;
+                STACK_TOP.non_null = top_entry.non_null;
+                CHECK_AND_RETHROW(stack_push(ctx, top_type, &value_2));
+                STACK_TOP.source = top_entry.source;
+                STACK_TOP.non_null = top_entry.non_null;
+
+                switch (type_get_stack_type(top_type)) {
+                    case STACK_TYPE_O: {
+                        if (type_is_interface(top_type)) {
+                            goto dup_value_type;
+                        } else {
+                            goto dup_primitive_type;
+                        }
+                    } break;
+
+                    dup_primitive_type:
+                    case STACK_TYPE_INT32:
+                    case STACK_TYPE_INT64:
+                    case STACK_TYPE_INTPTR:
+                    case STACK_TYPE_FLOAT:
+                    case STACK_TYPE_REF: {
+                        MIR_insn_code_t code = jit_number_inscode(top_type);
+                        // normal value, copy the two regs
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, code,
+                                                     MIR_new_reg_op(mir_ctx, value_1),
+                                                     MIR_new_reg_op(mir_ctx, top_reg)));
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, code,
+                                                     MIR_new_reg_op(mir_ctx, value_2),
+                                                     MIR_new_reg_op(mir_ctx, top_reg)));
+                    } break;
+
+                    dup_value_type:
+                    case STACK_TYPE_VALUE_TYPE: {
+                        // only copy the second value, we can move the pointer
+                        // to the second one because we are essentially SSA
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_MOV,
+                                                     MIR_new_reg_op(mir_ctx, value_1),
+                                                     MIR_new_reg_op(mir_ctx, top_reg)));
+
+                        jit_emit_memcpy(ctx, value_2, value_1, top_type->StackSize);
+                    } break;
+                }
+            } break;
+
+            case CEE_POP: {
+                CHECK_AND_RETHROW(stack_pop(ctx, NULL, NULL, NULL));
+            } break;
+
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            // Field access
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+            case CEE_STSFLD: {
+                // get the top value
+                MIR_reg_t value_reg;
+                System_Type value_type;
+                CHECK_AND_RETHROW(stack_pop(ctx, &value_type, &value_reg, NULL));
+
+                // get the field type, ignoring stuff like enums
+                System_Type field_type = type_get_underlying_type(operand_field->FieldType);
+
+                // make sure the field is static
+                CHECK(field_is_static(operand_field));
+
+                CHECK_AND_RETHROW(jit_emit_cctor_guard(ctx, operand_field->DeclaringType, false));
+
+                // if this is an init-only field then make sure that
+                // only rtspecialname can access it (.ctor and .cctor)
+                if (field_is_init_only(operand_field)) {
+                    CHECK(
+                        method->DeclaringType == operand_field->DeclaringType &&
+                        method_is_rt_special_name(method) &&
+                        string_equals_cstr(method->Name, ".cctor")
+                    );
+                }
+
+                // validate the assignability
+                CHECK(type_is_verifier_assignable_to(value_type, operand_field->FieldType));
+
+                // have the reference in a register for easy access
+                MIR_reg_t field_reg = new_temp_reg(ctx, tSystem_IntPtr);
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                             MIR_new_reg_op(mir_ctx, field_reg),
+                                             MIR_new_ref_op(mir_ctx, operand_field->MirField)));
+                MIR_op_t field_op = MIR_new_mem_op(mir_ctx, get_mir_type(field_type), 0, field_reg, 0, 1);
+
+                switch (type_get_stack_type(value_type)) {
+                    case STACK_TYPE_O: {
+                        if (type_is_interface(field_type)) {
+                            if (type_is_interface(value_type)) {
+                                // interface -> interface
+                                goto stsfld_value_type;
+                            } else {
+                                // object -> interface
+                                CHECK_AND_RETHROW(jit_cast_obj_to_interface(ctx,
+                                                                            field_reg, value_reg,
+                                                                            value_type, field_type));
+                            }
+                        } else {
+                            if (type_is_interface(value_type)) {
+                                // interface -> object
+                                MIR_append_insn(mir_ctx, mir_func,
+                                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                                             field_op,
+                                                             MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*), value_reg, 0, 1)));
+                            } else {
+                                // object -> object
+                                goto stsfld_primitive_type;
+                            }
+                        }
+                    } break;
+
+                    stsfld_primitive_type:
+                    case STACK_TYPE_INT32:
+                    case STACK_TYPE_INT64:
+                    case STACK_TYPE_INTPTR:
+                    case STACK_TYPE_FLOAT:
+                    case STACK_TYPE_REF: {
+                        MIR_insn_code_t code = jit_number_cast_inscode(value_type, field_type);
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, code,
+                                                     field_op,
+                                                     MIR_new_reg_op(mir_ctx, value_reg)));
+                    } break;
+
+                    stsfld_value_type:
+                    case STACK_TYPE_VALUE_TYPE: {
+                        jit_emit_memcpy(ctx, field_reg, value_reg, value_type->StackSize);
+                    } break;
+                }
+            } break;
+
+            case CEE_LDSFLD: {
+                // only static fields
+                CHECK(field_is_static(operand_field));
+
+                CHECK_AND_RETHROW(jit_emit_cctor_guard(ctx, operand_field->DeclaringType, false));
+
+                // Get the field type
+                System_Type field_stack_type = type_get_intermediate_type(operand_field->FieldType);
+                System_Type field_type = type_get_underlying_type(operand_field->FieldType);
+
+                // push it
+                MIR_reg_t value_reg;
+                CHECK_AND_RETHROW(stack_push(ctx, field_stack_type, &value_reg));
+
+                // have the reference in a register for easy access
+                MIR_reg_t field_reg = new_temp_reg(ctx, tSystem_IntPtr);
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                             MIR_new_reg_op(mir_ctx, field_reg),
+                                             MIR_new_ref_op(mir_ctx, operand_field->MirField)));
+                MIR_op_t field_op = MIR_new_mem_op(mir_ctx, get_mir_type(field_type), 0, field_reg, 0, 1);
+
+                switch (type_get_stack_type(field_type)) {
+                    case STACK_TYPE_O: {
+                        if (type_is_interface(field_type)) {
+                            goto ldsfld_value_type;
+                        } else {
+                            goto ldsfld_primitive_type;
+                        }
+                    } break;
+
+                    ldsfld_primitive_type:
+                    case STACK_TYPE_INT32:
+                    case STACK_TYPE_INT64:
+                    case STACK_TYPE_INTPTR:
+                    case STACK_TYPE_FLOAT: {
+                        // we need to extend this properly if the field is smaller
+                        // than an int32 (because we are going to load into an int32
+                        // essentially)
+                        MIR_insn_code_t insn = MIR_MOV;
+                        if (field_type == tSystem_SByte || field_type == tSystem_Boolean) {
+                            insn = MIR_EXT8;
+                        } else if (field_type == tSystem_Byte) {
+                            insn = MIR_UEXT8;
+                        } else if (field_type == tSystem_Int16) {
+                            insn = MIR_EXT16;
+                        } else if (field_type == tSystem_UInt16 || field_type == tSystem_Char) {
+                            insn = MIR_UEXT16;
+                        } else if (field_type == tSystem_Single) {
+                            insn = MIR_FMOV;
+                        } else if (field_type == tSystem_Single) {
+                            insn = MIR_DMOV;
+                        }
+
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, insn,
+                                                     MIR_new_reg_op(mir_ctx, value_reg),
+                                                     field_op));
+                    } break;
+
+                    ldsfld_value_type:
+                    case STACK_TYPE_VALUE_TYPE: {
+                        // take the offset and copy it
+                        jit_emit_memcpy(ctx, value_reg, field_reg, field_type->StackSize);
+                    } break;
+
+                    case STACK_TYPE_REF:
+                        CHECK_FAIL("wtf");
+                }
+            } break;
+
+            case CEE_LDSFLDA: {
+                // only static fields
+                CHECK(field_is_static(operand_field));
+
+                CHECK_AND_RETHROW(jit_emit_cctor_guard(ctx, operand_field->DeclaringType, false));
+
+                // Get the field type
+                System_Type field_stack_type = get_by_ref_type(type_get_verification_type(operand_field->FieldType));
+
+                // push it
+                MIR_reg_t value_reg;
+                CHECK_AND_RETHROW(stack_push(ctx, field_stack_type, &value_reg));
+                STACK_TOP.non_local_ref = true; // static field, not local
+                STACK_TOP.readonly_ref = field_is_init_only(operand_field);
+
+                // very simple, just move the reference to the value field
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                             MIR_new_reg_op(mir_ctx, value_reg),
+                                             MIR_new_ref_op(mir_ctx, operand_field->MirField)));
+            } break;
+
+            case CEE_STFLD: {
+                // get the values
+                stack_entry_t obj_entry;
+                MIR_reg_t obj_reg;
+                MIR_reg_t value_reg;
+                System_Type obj_type;
+                System_Type value_type;
+                CHECK_AND_RETHROW(stack_pop(ctx, &value_type, &value_reg, NULL));
+                CHECK_AND_RETHROW(stack_pop(ctx, &obj_type, &obj_reg, &obj_entry));
+
+                // validate that the object type is a valid one for stfld
+                if (type_get_stack_type(obj_type) == STACK_TYPE_REF) {
+                    // this is a reference, so it has to be a reference to a value type
+                    // note that we can't know if the value type is part of another class
+                    // or not so we have to use gc_update_ref
+                    CHECK(obj_type->BaseType->IsValueType);
+
+                    // must be a non-readonly reference
+                    CHECK(!obj_entry.readonly_ref);
+                } else {
+                    CHECK(type_get_stack_type(obj_type) == STACK_TYPE_O);
+                }
+
+                // validate the field is part of the object
+                System_Type target = type_get_intermediate_type(operand_field->DeclaringType);
+                System_Type base = obj_type;
+                while (base != NULL && base != target) {
+                    base = base->BaseType;
+                }
+                CHECK(base != NULL);
+
+                // make sure the field is compatible
+                CHECK(type_is_verifier_assignable_to(value_type, operand_field->FieldType));
+
+                // TODO: does the runtime actually use ldfld for static fields?
+                //       in theory CIL allows that, but I think I won't for simplicity
+                CHECK(!field_is_static(operand_field));
+
+                // if this is an init-only field then make sure that
+                // only rtspecialname can access it (.ctor and .cctor)
+                if (field_is_init_only(operand_field)) {
+                    CHECK(
+                        method->DeclaringType == operand_field->DeclaringType &&
+                        method_is_rt_special_name(method) &&
+                        string_equals_cstr(method->Name, ".ctor")
+                    );
+                }
+
+                // check the object is not null
+                if (type_get_stack_type(obj_type) == STACK_TYPE_O) {
+                    CHECK_AND_RETHROW(jit_null_check(ctx, obj_reg, obj_type, &obj_entry));
+                }
+
+                // validate the assignability
+                CHECK(type_is_verifier_assignable_to(value_type, operand_field->FieldType));
+
+                // get the field type, ignoring stuff like enums
+                System_Type field_type = type_get_underlying_type(operand_field->FieldType);
+
+                // check how we should assign the given item
+                switch (type_get_stack_type(value_type)) {
+                    case STACK_TYPE_O: {
+                        if (type_is_interface(field_type)) {
+                            if (type_is_interface(value_type)) {
+                                // interface -> interface
+                                goto stfld_value_type;
+                            } else {
+                                // object -> interface
+
+                                // get the result, which is the object base plus the offset
+                                MIR_reg_t field_addr_reg = new_temp_reg(ctx, tSystem_UIntPtr);
+                                MIR_append_insn(mir_ctx, mir_func,
+                                                MIR_new_insn(mir_ctx, MIR_ADD,
+                                                             MIR_new_reg_op(mir_ctx, field_addr_reg),
+                                                             MIR_new_reg_op(mir_ctx, obj_reg),
+                                                             MIR_new_int_op(mir_ctx, (int)operand_field->MemoryOffset)));
+
+                                // emit the cast
+                                CHECK_AND_RETHROW(jit_cast_obj_to_interface(ctx,
+                                                                            field_addr_reg, value_reg,
+                                                                            value_type, field_type));
+                            }
+                        } else {
+                            // storing to an object from an object, use a write-barrier
+                            if (type_get_stack_type(obj_type) == STACK_TYPE_O) {
+
+                                // check for interface -> object casting
+                                if (type_is_interface(value_type)) {
+                                    MIR_append_insn(mir_ctx, mir_func,
+                                                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                                                 MIR_new_reg_op(mir_ctx, value_reg),
+                                                                 MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*), value_reg, 0, 1)));
+                                }
+
+                                // the base is an object, use the gc_update write barrier
+                                jit_emit_gc_update(ctx, obj_reg,
+                                                   MIR_new_int_op(mir_ctx, (int)operand_field->MemoryOffset),
+                                                   value_reg);
+                            } else {
+                                // the base is a struct
+
+                                // add the offset to the object base
+                                MIR_append_insn(mir_ctx, mir_func,
+                                                MIR_new_insn(mir_ctx, MIR_ADD,
+                                                             MIR_new_reg_op(mir_ctx, obj_reg),
+                                                             MIR_new_reg_op(mir_ctx, obj_reg),
+                                                             MIR_new_int_op(mir_ctx, (int)operand_field->MemoryOffset)));
+
+                                // call the gc_update_ref write-barrier
+                                MIR_append_insn(mir_ctx, mir_func,
+                                                MIR_new_call_insn(mir_ctx, 4,
+                                                                  MIR_new_ref_op(mir_ctx, m_gc_update_ref_proto),
+                                                                  MIR_new_ref_op(mir_ctx, m_gc_update_ref_func),
+                                                                  MIR_new_reg_op(mir_ctx, obj_reg),
+                                                                  MIR_new_reg_op(mir_ctx, value_reg)));
+                            }
+                        }
+                    } break;
+
+                    case STACK_TYPE_INT32:
+                    case STACK_TYPE_INT64:
+                    case STACK_TYPE_INTPTR:
+                    case STACK_TYPE_FLOAT: {
+                        MIR_insn_code_t code = jit_number_cast_inscode(value_type, field_type);
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, code,
+                                                     MIR_new_mem_op(mir_ctx,
+                                                                    get_mir_type(operand_field->FieldType),
+                                                                    (int)operand_field->MemoryOffset,
+                                                                    obj_reg, 0, 1),
+                                                     MIR_new_reg_op(mir_ctx, value_reg)));
+                    } break;
+
+                    stfld_value_type:
+                    case STACK_TYPE_VALUE_TYPE: {
+                        if (arrlen(value_type->ManagedPointersOffsets) == 0) {
+                            // there are no managed pointers in the value type we are storing, so
+                            // we can do a normal memcpy no matter what
+
+                            // add the offset to the object base
+                            MIR_append_insn(mir_ctx, mir_func,
+                                            MIR_new_insn(mir_ctx, MIR_ADD,
+                                                         MIR_new_reg_op(mir_ctx, obj_reg),
+                                                         MIR_new_reg_op(mir_ctx, obj_reg),
+                                                         MIR_new_int_op(mir_ctx, (int)operand_field->MemoryOffset)));
+
+                            // emit a memcpy
+                            jit_emit_memcpy(ctx, obj_reg, value_reg, value_type->StackSize);
+                        } else {
+                            if (type_get_stack_type(obj_type) == STACK_TYPE_O) {
+                                // copying into a class, use the managed memcpy
+                                MIR_append_insn(mir_ctx, mir_func,
+                                                MIR_new_call_insn(mir_ctx, 6,
+                                                                  MIR_new_ref_op(mir_ctx, m_managed_memcpy_proto),
+                                                                  MIR_new_ref_op(mir_ctx, m_managed_memcpy_func),
+                                                                  MIR_new_reg_op(mir_ctx, obj_reg),
+                                                                  MIR_new_ref_op(mir_ctx, field_type->MirType),
+                                                                  MIR_new_int_op(mir_ctx, (int)operand_field->MemoryOffset),
+                                                                  MIR_new_reg_op(mir_ctx, value_reg)));
+                            } else {
+                                // add the offset to the object base
+                                MIR_append_insn(mir_ctx, mir_func,
+                                                MIR_new_insn(mir_ctx, MIR_ADD,
+                                                             MIR_new_reg_op(mir_ctx, obj_reg),
+                                                             MIR_new_reg_op(mir_ctx, obj_reg),
+                                                             MIR_new_int_op(mir_ctx, (int)operand_field->MemoryOffset)));
+
+                                // copying into a managed pointer, use the managed ref memcpy
+                                MIR_append_insn(mir_ctx, mir_func,
+                                                MIR_new_call_insn(mir_ctx, 5,
+                                                                  MIR_new_ref_op(mir_ctx, m_managed_ref_memcpy_proto),
+                                                                  MIR_new_ref_op(mir_ctx, m_managed_ref_memcpy_func),
+                                                                  MIR_new_reg_op(mir_ctx, obj_reg),
+                                                                  MIR_new_ref_op(mir_ctx, field_type->MirType),
+                                                                  MIR_new_reg_op(mir_ctx, value_reg)));
+                            }
+                        }
+                    } break;
+
+                    case STACK_TYPE_REF: {
+                        CHECK_FAIL("There is no such thing as a ref-field");
+                    } break;
+                }
+            } break;
+
+            case CEE_LDFLD: {
+                // get the object instance
+                System_Type obj_type;
+                MIR_reg_t obj_reg;
+                stack_entry_t obj_entry;
+                CHECK_AND_RETHROW(stack_pop(ctx, &obj_type, &obj_reg, &obj_entry));
+
+                // validate that the object type is a valid one for stfld
+                if (type_get_stack_type(obj_type) == STACK_TYPE_REF) {
+                    // this is a reference, so it has to be a reference to a value type
+                    CHECK(obj_type->BaseType->IsValueType);
+                } else {
+                    CHECK(type_get_stack_type(obj_type) == STACK_TYPE_O || type_get_stack_type(obj_type) == STACK_TYPE_VALUE_TYPE);
+                }
+
+                // validate the field is part of the object
+                System_Type target = type_get_intermediate_type(operand_field->DeclaringType);
+                System_Type base = obj_type;
+                while (base != NULL && base != target) {
+                    base = base->BaseType;
+                }
+                CHECK(base != NULL);
+
+                // TODO: does the runtime actually use ldfld for static fields?
+                CHECK(!field_is_static(operand_field));
+
+                // Get the field type
+                System_Type field_stack_type = type_get_intermediate_type(operand_field->FieldType);
+                System_Type field_type = type_get_underlying_type(operand_field->FieldType);
+
+                // push it
+                MIR_reg_t value_reg;
+                CHECK_AND_RETHROW(stack_push(ctx, field_stack_type, &value_reg));
+
+                // check the object is not null
+                if (type_get_stack_type(obj_type) == STACK_TYPE_O) {
+                    CHECK_AND_RETHROW(jit_null_check(ctx, obj_reg, obj_type, &obj_entry));
+                }
+
+                switch (type_get_stack_type(field_type)) {
+                    case STACK_TYPE_O: {
+                        if (type_is_interface(field_type)) {
+                            goto ldfld_value_type;
+                        } else {
+                            goto ldfld_primitive_type;
+                        }
+                    } break;
+
+                    ldfld_primitive_type:
+                    case STACK_TYPE_INT32:
+                    case STACK_TYPE_INT64:
+                    case STACK_TYPE_INTPTR:
+                    case STACK_TYPE_FLOAT: {
+                        // we need to extend this properly if the field is smaller
+                        // than an int32 (because we are going to load into an int32
+                        // essentially)
+                        MIR_insn_code_t insn = MIR_MOV;
+                        if (field_type == tSystem_SByte || field_type == tSystem_Boolean) {
+                            insn = MIR_EXT8;
+                        } else if (field_type == tSystem_Byte) {
+                            insn = MIR_UEXT8;
+                        } else if (field_type == tSystem_Int16) {
+                            insn = MIR_EXT16;
+                        } else if (field_type == tSystem_UInt16 || field_type == tSystem_Char) {
+                            insn = MIR_UEXT16;
+                        } else if (field_type == tSystem_Single) {
+                            insn = MIR_FMOV;
+                        } else if (field_type == tSystem_Single) {
+                            insn = MIR_DMOV;
+                        }
+
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, insn,
+                                                     MIR_new_reg_op(mir_ctx, value_reg),
+                                                     MIR_new_mem_op(mir_ctx,
+                                                                    get_mir_type(operand_field->FieldType),
+                                                                    (int)operand_field->MemoryOffset,
+                                                                    obj_reg, 0, 1)));
+                    } break;
+
+                    ldfld_value_type:
+                    case STACK_TYPE_VALUE_TYPE: {
+                        // take the offset and copy it
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_ADD,
+                                                     MIR_new_reg_op(mir_ctx, obj_reg),
+                                                     MIR_new_reg_op(mir_ctx, obj_reg),
+                                                     MIR_new_int_op(mir_ctx, (int)operand_field->MemoryOffset)));
+                        jit_emit_memcpy(ctx, value_reg, obj_reg, field_type->StackSize);
+                    } break;
+
+                    case STACK_TYPE_REF:
+                        CHECK_FAIL("wtf");
+                }
+            } break;
+
+            case CEE_LDFLDA: {
+                // get the object instance
+                stack_entry_t obj_entry;
+                System_Type obj_type;
+                MIR_reg_t obj_reg;
+                CHECK_AND_RETHROW(stack_pop(ctx, &obj_type, &obj_reg, &obj_entry));
+
+                // validate that the object type is a valid one for ldfld
+                CHECK(type_get_stack_type(obj_type) == STACK_TYPE_O || type_get_stack_type(obj_type) == STACK_TYPE_REF);
+
+                // validate the field is part of the object
+                System_Type target = type_get_intermediate_type(operand_field->DeclaringType);
+                System_Type base = obj_type;
+                while (base != NULL && base != target) {
+                    base = base->BaseType;
+                }
+                CHECK(base != NULL);
+
+                // TODO: does the runtime actually use ldfld for static fields?
+                CHECK(!field_is_static(operand_field));
+
+                // Get the field type
+                System_Type field_stack_type = get_by_ref_type(type_get_verification_type(operand_field->FieldType));
+
+                // push it
+                MIR_reg_t value_reg;
+                CHECK_AND_RETHROW(stack_push(ctx, field_stack_type, &value_reg));
+
+                // check if this comes as an outside reference
+                bool non_stack_local = false;
+                bool readonly = field_is_init_only(operand_field);
+                if (type_get_stack_type(obj_type) == STACK_TYPE_O) {
+                    // heap object
+                    non_stack_local = true;
+                } else if (type_get_stack_type(obj_type) == STACK_TYPE_REF) {
+                    // check if the reference is a non-value type
+                    CHECK(type_is_value_type(obj_type->BaseType));
+                    non_stack_local = obj_entry.non_local_ref;
+                    readonly = readonly || obj_entry.readonly_ref;
+                }
+                STACK_TOP.non_local_ref = non_stack_local;
+                STACK_TOP.readonly_ref = readonly;
+
+                // check the object is not null
+                if (type_get_stack_type(obj_type) == STACK_TYPE_O) {
+                    CHECK_AND_RETHROW(jit_null_check(ctx, obj_reg, obj_type, &obj_entry));
+                }
+
+                // very simple, just add to the object the field offset
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_ADD,
+                                             MIR_new_reg_op(mir_ctx, value_reg),
+                                             MIR_new_reg_op(mir_ctx, obj_reg),
+                                             MIR_new_int_op(mir_ctx, (int)operand_field->MemoryOffset)));
+            } break;
+
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            // Calls and Returns
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+            //
+            // we are going to do NEWOBJ in here as well, because it is essentially like a call
+            // but we create the object right now instead of getting it from the stack, so I
+            // think this will remove alot of duplicate code if we just handle it in here
+            //
+
+            case CEE_NEWOBJ:
+            case CEE_CALLVIRT:
+            case CEE_CALL: {
+                System_Type ret_type = type_get_underlying_type(operand_method->ReturnType);
+
+                // count the amount of arguments, +1 if we have a this
+                int arg_count = operand_method->Parameters->Length;
+
+                if (opcode == CEE_NEWOBJ) {
+                    // newobj must call a ctor, we verify that ctors are good
+                    // in the loader
+                    CHECK(method_is_rt_special_name(operand_method));
+                    CHECK(string_equals_cstr(operand_method->Name, ".ctor"));
+
+                    if (ftnMethod != NULL) {
+                        // we had an ldftn/ldvirtftb, meaning that we are going to
+                        // create a delegate now, make sure of that
+                        CHECK(operand_method->DeclaringType->BaseType == tSystem_MulticastDelegate);
+                        CHECK(operand_method->Parameters->Length == 2);
+                        CHECK(operand_method->Parameters->Data[0]->ParameterType == tSystem_Object);
+                        CHECK(operand_method->Parameters->Data[1]->ParameterType == tSystem_IntPtr);
+
+                        // verify that the method signature matches the delegate we
+                        // want to create
+                        System_Reflection_MethodInfo signature = operand_method->DeclaringType->DelegateSignature;
+                        CHECK(signature != NULL);
+                        CHECK(signature->ReturnType == ftnMethod->ReturnType);
+                        CHECK(signature->Parameters->Length == ftnMethod->Parameters->Length);
+                        for (int i = 0; i < signature->Parameters->Length; i++) {
+                            CHECK(signature->Parameters->Data[i]->ParameterType == ftnMethod->Parameters->Data[i]->ParameterType);
+                        }
+                    } else {
+                        // make sure that this is *NOT* a delegate
+                        CHECK(operand_method->DeclaringType->BaseType != tSystem_MulticastDelegate);
+                    }
+                } else if (opcode == CEE_CALLVIRT) {
+                    // callvirt must call an instance methods
+                    CHECK(!method_is_static(operand_method));
+                } else {
+                    // call must call a method with a body
+                    CHECK(!method_is_abstract(operand_method));
+                }
+
+                // creating an object or calling a static method might trigger the cctor
+                if (opcode == CEE_NEWOBJ || method_is_static(operand_method)) {
+                    CHECK_AND_RETHROW(jit_emit_cctor_guard(ctx, operand_method->DeclaringType, true));
+                }
+
+                // prepare array of all the operands
+                // 1st is the prototype
+                // 2nd is the reference
+                // 3rd is exception return
+                // 4rd is return type (optionally)
+                // 5th is this type (optionally)
+                // Rest are the arguments
+                size_t other_args = 3;
+                if (ret_type != NULL) other_args++;
+                if (!method_is_static(operand_method)) other_args++;
+                MIR_op_t arg_ops[other_args + arg_count];
+
+                // to track if we passed local refs
+                bool ret_is_non_local_ref = true;
+
+                // pop all the arguments from the stack
+                int i;
+                for (i = arg_count + other_args - 1; i >= other_args; i--) {
+                    System_Reflection_ParameterInfo parameter_info = operand_method->Parameters->Data[i - other_args];
+                    System_Type signature_type = parameter_info->ParameterType;
+
+                    // get the argument value
+                    stack_entry_t arg_entry;
+                    MIR_reg_t arg_reg;
+                    System_Type arg_type;
+                    CHECK_AND_RETHROW(stack_pop(ctx, &arg_type, &arg_reg, &arg_entry));
+
+                    // do implicit conversion as needed
+                    bool mem_op = false;
+                    switch (type_get_stack_type(arg_type)) {
+                        case STACK_TYPE_O: {
+                            if (type_is_interface(signature_type)) {
+                                if (!type_is_interface(arg_type)) {
+                                    // object --> interface
+                                    MIR_reg_t int_reg = new_temp_reg(ctx, signature_type);
+                                    CHECK_AND_RETHROW(jit_cast_obj_to_interface(ctx, int_reg, arg_reg, arg_type, signature_type));
+
+                                    // we now have that class
+                                    arg_reg = int_reg;
+                                    arg_type = signature_type;
+                                }
+
+                                // pass by value
+                                mem_op = true;
+                            } else {
+                                if (type_is_interface(arg_type)) {
+                                    // interface --> object
+                                    MIR_append_insn(mir_ctx, mir_func,
+                                                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                                                     MIR_new_reg_op(mir_ctx, arg_reg),
+                                                                     MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*), arg_reg, 0, 1)));
+                                }
+                            }
+                        } break;
+
+                        case STACK_TYPE_INT32: {
+                            if (
+                                signature_type == tSystem_SByte ||
+                                signature_type == tSystem_Byte ||
+                                signature_type == tSystem_Boolean ||
+                                signature_type == tSystem_Int16 ||
+                                signature_type == tSystem_UInt16 ||
+                                signature_type == tSystem_Char
+                            ) {
+                                // truncate, going to be done implicitly by mir
+                                arg_type = signature_type;
+                            } else if (signature_type == tSystem_IntPtr) {
+                                // sign extend
+                                MIR_append_insn(mir_ctx, mir_func,
+                                                MIR_new_insn(mir_ctx, MIR_EXT32,
+                                                             MIR_new_reg_op(mir_ctx, arg_reg),
+                                                             MIR_new_reg_op(mir_ctx, arg_reg)));
+                                arg_type = signature_type;
+                            } else if (signature_type == tSystem_UIntPtr) {
+                                // zero extend
+                                MIR_append_insn(mir_ctx, mir_func,
+                                                MIR_new_insn(mir_ctx, MIR_UEXT32,
+                                                             MIR_new_reg_op(mir_ctx, arg_reg),
+                                                             MIR_new_reg_op(mir_ctx, arg_reg)));
+                                arg_type = signature_type;
+                            }
+                        } break;
+
+                        case STACK_TYPE_INTPTR: {
+                            if (type_is_integer(signature_type)) {
+                                // truncate or nop, we don't really care
+                                arg_type = signature_type;
+                            }
+                        } break;
+
+                        case STACK_TYPE_FLOAT: {
+                            // handle implicit float casting
+                            if (arg_type == tSystem_Single) {
+                                if (signature_type == tSystem_Double) {
+                                    // float->double conversion
+                                    MIR_reg_t real_arg_reg = new_temp_reg(ctx, tSystem_Double);
+                                    MIR_append_insn(mir_ctx, mir_func,
+                                                    MIR_new_insn(mir_ctx, MIR_F2D,
+                                                                 MIR_new_reg_op(mir_ctx, real_arg_reg),
+                                                                 MIR_new_reg_op(mir_ctx, arg_reg)));
+                                    arg_reg = real_arg_reg;
+                                    arg_type = signature_type;
+                                }
+                            } else if (arg_type == tSystem_Double) {
+                                if (signature_type == tSystem_Single) {
+                                    // double->float conversion
+                                    MIR_reg_t real_arg_reg = new_temp_reg(ctx, tSystem_Single);
+                                    MIR_append_insn(mir_ctx, mir_func,
+                                                    MIR_new_insn(mir_ctx, MIR_D2F,
+                                                                 MIR_new_reg_op(mir_ctx, real_arg_reg),
+                                                                 MIR_new_reg_op(mir_ctx, arg_reg)));
+                                    arg_reg = real_arg_reg;
+                                    arg_type = signature_type;
+                                }
+                            }
+                        } break;
+
+                        case STACK_TYPE_REF: {
+                            // if this is a readonly reference, then we are only allowed
+                            // to pass it to parameters marked as in
+                            if (arg_entry.readonly_ref) {
+                                CHECK(parameter_is_in(parameter_info));
+                            }
+
+                            // if this is a reference that might be returned from the method we are calling
                             // to, and the argument is a local reference on its own, then we need to mark
                             // that the  reference type can't be trusted
                             if (!arg_entry.non_local_ref && type_is_verifier_assignable_to(arg_type, method->ReturnType)) {
@@ -5197,1113 +7317,1935 @@ err_t jit_method(jit_context_t* jctx, System_Reflection_MethodInfo method) {
                             }
                         } break;
 
-                        // nothing to do
-                        case STACK_TYPE_INT64: break;
+                        // nothing to do
+                        case STACK_TYPE_INT64: break;
+
+                        // in mir when calling
+                        case STACK_TYPE_VALUE_TYPE: {
+                            mem_op = true;
+                        } break;
+
+                        default:
+                            CHECK_FAIL();
+                    }
+
+                    // we are creating a new delegate and this is the target parameter
+                    if (i - other_args == 0 && ftnMethod != NULL) {
+                        if (!method_is_static(ftnMethod)) {
+                            // this is an instance method, emit a null check on the target
+                            // to make sure that it is not null
+                            CHECK_AND_RETHROW(jit_null_check(ctx, arg_reg, arg_type, &arg_entry));
+                        } else {
+                            // this is a static method, we need a null target, if already null
+                            // ignore it, otherwise just zero the reg
+                            if (arg_type != NULL) {
+                                MIR_append_insn(mir_ctx, mir_func,
+                                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                                             MIR_new_reg_op(mir_ctx, arg_reg),
+                                                             MIR_new_int_op(mir_ctx, 0)));
+                            }
+                        }
+
+                        // make sure to reset it now
+                        ftnMethod = NULL;
+                    }
+
+                    // set the op, for anything passed by value we need to use MIR_T_BLK with the disp
+                    // being the size instead of the displacement
+                    if (mem_op) {
+                        arg_ops[i] = MIR_new_mem_op(mir_ctx, MIR_T_BLK, arg_type->StackSize, arg_reg, 0, 1);
+                    } else {
+                        arg_ops[i] = MIR_new_reg_op(mir_ctx, arg_reg);
+                    }
+
+                    // verify a normal argument
+                    CHECK(type_is_verifier_assignable_to(arg_type, signature_type));
+                }
+
+                // handle the `this` argument
+                MIR_reg_t number_reg;
+                MIR_reg_t this_reg;
+                System_Type this_type;
+                System_Reflection_MethodInfo delegate_target = NULL;
+                if (!method_is_static(operand_method)) {
+                    if (opcode == CEE_NEWOBJ) {
+                        // this is the this_type
+                        this_type = operand_method->DeclaringType;
+
+                        // make sure this is a type we can actually create
+                        CHECK(!type_is_abstract(this_type));
+                        CHECK(!type_is_interface(this_type));
+
+                        CHECK_AND_RETHROW(stack_push(ctx, operand_method->DeclaringType, &this_reg));
+
+                        // a failed allocation throws, other than for the out of memory exception itself
+                        STACK_TOP.non_null = !this_type->IsValueType && this_type != tSystem_OutOfMemoryException;
+
+                        if (this_type->IsValueType) {
+                            if (type_get_stack_type(this_type) != STACK_TYPE_VALUE_TYPE) {
+                                // this is an integer/float type, so allocate it on the stack
+                                // so we can pass it as a reference and then just copy it into
+                                // the eval stack as a normal variable
+
+                                // save the position on the eval stack
+                                number_reg = this_reg;
+
+                                // set a temp new location
+                                this_reg = new_temp_reg(ctx, tSystem_IntPtr);
+                                MIR_prepend_insn(mir_ctx, mir_func,
+                                                 MIR_new_insn(mir_ctx, MIR_ALLOCA,
+                                                              MIR_new_reg_op(mir_ctx, this_reg),
+                                                              MIR_new_int_op(mir_ctx, operand_method->DeclaringType->StackSize)));
+                            }
+
+                            // For a value type we just need to zero it out before calling the ctor
+                            jit_emit_zerofill(ctx, this_reg, this_type->StackSize);
+                        } else {
+                            MIR_op_t size_op;
+                            if (this_type == tSystem_String) {
+                                // special handling for string
+                                MIR_reg_t size_reg = new_temp_reg(ctx, tSystem_Int64);
+
+                                // we need to figure what the length is from the ctor, the ctor will
+                                // handle actually copying the data nicely
+                                if (operand_method->Parameters->Length == 3) {
+                                    // String(char[] args, startIndex, length), the size is
+                                    // the last argument times two....
+                                    MIR_append_insn(mir_ctx, mir_func,
+                                                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                                                 MIR_new_reg_op(mir_ctx, size_reg),
+                                                                 arg_ops[other_args + 3]));
+
+                                } else {
+                                    ASSERT(operand_method->Parameters->Length == 1);
+                                    System_Type arg0_type = operand_method->Parameters->Data[0]->ParameterType;
+
+                                    if (arg0_type->IsArray) {
+                                        // String(char[] chars), the size is the array length
+                                        ASSERT(arg_ops[other_args].mode == MIR_OP_REG);
+                                        MIR_append_insn(mir_ctx, mir_func,
+                                                        MIR_new_insn(mir_ctx, MIR_MOV,
+                                                                     MIR_new_reg_op(mir_ctx, size_reg),
+                                                                     MIR_new_mem_op(mir_ctx, MIR_T_I32,
+                                                                                    offsetof(struct System_Array, Length),
+                                                                                    arg_ops[other_args].u.reg, 0, 1)));
+                                    } else {
+                                        // String(int length), the size is length
+                                        MIR_append_insn(mir_ctx, mir_func,
+                                                        MIR_new_insn(mir_ctx, MIR_MOV,
+                                                                     MIR_new_reg_op(mir_ctx, size_reg),
+                                                                     arg_ops[other_args]));
+                                    }
+                                }
+
+                                // multiply by char size
+                                MIR_append_insn(mir_ctx, mir_func,
+                                                MIR_new_insn(mir_ctx, MIR_MUL,
+                                                             MIR_new_reg_op(mir_ctx, size_reg),
+                                                             MIR_new_reg_op(mir_ctx, size_reg),
+                                                             MIR_new_int_op(mir_ctx, sizeof(System_Char))));
+
+                                // add the header size
+                                MIR_append_insn(mir_ctx, mir_func,
+                                                MIR_new_insn(mir_ctx, MIR_ADD,
+                                                             MIR_new_reg_op(mir_ctx, size_reg),
+                                                             MIR_new_reg_op(mir_ctx, size_reg),
+                                                             MIR_new_int_op(mir_ctx, tSystem_String->ManagedSize)));
+
+                                // create the op
+                                size_op = MIR_new_reg_op(mir_ctx, size_reg);
+                            } else {
+                                // Normal object
+                                size_op = MIR_new_int_op(mir_ctx, operand_method->DeclaringType->ManagedSize);
+                            }
+
+                            // allocate the new object
+                            if (jit_is_frame_object(ctx)) {
+                                CHECK_AND_RETHROW(jit_prepare_type(ctx->ctx, operand_method->DeclaringType));
+                                jit_new_in_frame(ctx, this_reg, operand_method->DeclaringType);
+                            } else {
+                                CHECK_AND_RETHROW(jit_new(ctx, this_reg,
+                                                          operand_method->DeclaringType, size_op));
+                            }
+                        }
+                    } else {
+                        // this is a call, get it from the stack
+                        stack_entry_t this_entry;
+                        CHECK_AND_RETHROW(stack_pop(ctx, &this_type, &this_reg, &this_entry));
+
+                        // Value types have their this as a by-ref
+                        System_Type signature_this_type = operand_method->DeclaringType;
+                        if (signature_this_type->IsValueType) {
+                            signature_this_type = get_by_ref_type(signature_this_type);
+                        }
+
+                        // NOTE: for interfaces the `this` is unpacked properly at a later stage since
+                        //       we also need the vtable from the original `this`
+
+                        if (constrainedType != NULL) {
+                            CHECK(this_type->IsByRef);
+                            CHECK(this_type->BaseType == constrainedType);
+
+                            // If this_type is a reference type (as opposed to a value type)
+                            if (type_is_object_ref(constrainedType)) {
+                                // ptr is dereferenced and passed as the ‘this’ pointer to the callvirt of method,
+                                // which is a whole other value than what we popped
+                                this_type = constrainedType;
+                                this_entry = (stack_entry_t){ .type = this_type };
+                                MIR_append_insn(mir_ctx, mir_func,
+                                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                                                MIR_new_reg_op(mir_ctx, this_reg),
+                                                                MIR_new_mem_op(mir_ctx, MIR_T_P, 0, this_reg, 0, 1)));
+                            } else {
+                                // this is a value type, the signature this is a reference
+                                signature_this_type = get_by_ref_type(constrainedType);
+                            }
+
+                            // get the static dispatch, the call later will
+                            // actually handle making sure this is correct
+                            CHECK(operand_method->VTableOffset < constrainedType->VirtualMethods->Length);
+
+                            // figure the real method for this dispatch
+                            int vtable_offset = operand_method->VTableOffset;
+                            if (type_is_interface(operand_method->DeclaringType)) {
+                                // comes from interface, need to give a static offset
+                                TinyDotNet_Reflection_InterfaceImpl impl = type_get_interface_impl(constrainedType, operand_method->DeclaringType);
+                                CHECK(impl != NULL);
+                                vtable_offset += impl->VTableOffset;
+                            } else if (type_is_interface(constrainedType)) {
+                                // I think this is the only case
+                                CHECK(operand_method->DeclaringType == tSystem_Object);
+
+                                // we need to essentially cast to an object
+                                this_type = tSystem_Object;
+                                constrainedType = tSystem_Object;
+
+                                // upack the this so it will be a simple object
+                                MIR_append_insn(mir_ctx, mir_func,
+                                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                                             MIR_new_reg_op(mir_ctx, this_reg),
+                                                             MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*), this_reg, 0, 1)));
+                            }
+                            operand_method = constrainedType->VirtualMethods->Data[vtable_offset];
+
+                            // clear the type
+                            constrainedType = NULL;
+                        }
+
+                        // verify a normal argument
+                        if (signature_this_type == tSystem_Object && this_type->BaseType == tSystem_ValueType) {
+                            // this is an edge case, we are going to politely ignore it
+                            // in short, for whatever reason the compiler generates a ctor in System.ValueType
+                            // that calls the ctor of System.Object ????
+                        } else {
+                            CHECK(type_is_verifier_assignable_to(this_type, signature_this_type));
+                        }
+
+                        // make sure that the object is not null, only if not a byref
+                        if (!this_type->IsByRef) {
+                            CHECK_AND_RETHROW(jit_null_check(ctx, this_reg, this_type, &this_entry));
+                        }
+
+                        delegate_target = jit_get_delegate_target(ctx, &this_entry, operand_method);
+                    }
+
+                    arg_ops[i] = MIR_new_reg_op(mir_ctx, this_reg);
+                }
+
+                // get the MIR signature and address
+                arg_ops[0] = MIR_new_ref_op(mir_ctx, operand_method->MirProto);
+
+                // set for profiled virtual calls
+                jit_call_site_t* call_site = NULL;
+
+                // the method that is actually called when the call is direct
+                System_Reflection_MethodInfo direct_target = operand_method;
+
+                // byref uses static dispatch since we know the exact type always
+                if (
+                    opcode == CEE_CALLVIRT &&
+                    method_is_virtual(operand_method)
+                ) {
+                    // we are using callvirt and this is a virtual method, so we have to
+                    // use a dynamic dispatch
+
+                    MIR_reg_t temp_reg = new_temp_reg(ctx, tSystem_Type);
+
+                    // get the vtable pointer from the object, it is at the first
+                    // item for both an interface and an object
+                    MIR_append_insn(mir_ctx, mir_func,
+                                    MIR_new_insn(mir_ctx, MIR_MOV,
+                                                 MIR_new_reg_op(mir_ctx, temp_reg),
+                                                 MIR_new_mem_op(mir_ctx, MIR_T_P, 0, this_reg, 0, 1)));
+
+                    // figure offset and the actual method
+                    int vtable_index;
+                    if (type_is_interface(this_type)) {
+                        // we have an interface on the stack, the vtable is the first element
+                        // and the vtable index is exactly as given in the operand
+                        vtable_index = operand_method->VTableOffset;
+
+                        // read the actual instance pointer of the interface, so we can use it
+                        // when calling the function
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_MOV,
+                                                     MIR_new_reg_op(mir_ctx, this_reg),
+                                                     MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*), this_reg, 0, 1)));
+                    } else {
+                        if (type_is_interface(operand_method->DeclaringType)) {
+                            // we want to call an interface method on the object, so resolve it and get the
+                            // object inside the object's vtable instead
+                            vtable_index = type_get_interface_method_impl(this_type, operand_method)->VTableOffset;
+                        } else {
+                            // this is a normal virtual method, nothing to resolve
+                            vtable_index = operand_method->VTableOffset;
+                        }
+                    }
+
+                    if (this_type->IsByRef) {
+                        // we have a ref on the stack, which means it must be a value type, so we can call the actual
+                        // method directly since all value types are sealed by default
+                        CHECK(type_is_sealed(this_type->BaseType));
+                        direct_target = this_type->BaseType->VirtualMethods->Data[vtable_index];
+                        arg_ops[1] = MIR_new_ref_op(mir_ctx, direct_target->MirFunc);
+                    } else if (type_is_sealed(this_type)) {
+                        // this is an instance class which is a sealed class, choose the unboxer form if exists and the
+                        // normal one otherwise
+                        System_Reflection_MethodInfo m = this_type->VirtualMethods->Data[vtable_index];
+                        direct_target = m;
+                        arg_ops[1] = MIR_new_ref_op(mir_ctx, m->MirUnboxerFunc ?: m->MirFunc);
+                    } else if (!type_is_interface(this_type) && method_is_final(this_type->VirtualMethods->Data[vtable_index])) {
+                        // a final method can't be overridden by any subclass, so we know the exact
+                        // method that is going to be called
+                        System_Reflection_MethodInfo m = this_type->VirtualMethods->Data[vtable_index];
+                        direct_target = m;
+                        arg_ops[1] = MIR_new_ref_op(mir_ctx, m->MirUnboxerFunc ?: m->MirFunc);
+                    } else {
+                        // remember the receivers, so the optimized tier can guess the target
+                        CHECK_AND_RETHROW(jit_emit_call_site_profile(ctx, temp_reg, vtable_index, &call_site));
+
+                        // get the address of the function from the vtable
+                        MIR_insn_t target_load = MIR_new_insn(mir_ctx, MIR_MOV,
+                                                              MIR_new_reg_op(mir_ctx, temp_reg),
+                                                              MIR_new_mem_op(mir_ctx, MIR_T_P,
+                                                                             vtable_index * sizeof(void*),
+                                                                             temp_reg, 0, 1));
+                        MIR_append_insn(mir_ctx, mir_func, target_load);
+                        if (call_site != NULL) {
+                            call_site->target_load = target_load;
+                        }
+
+                        // indirect call
+                        arg_ops[1] = MIR_new_reg_op(mir_ctx, temp_reg);
+                    }
+                } else {
+                    // static dispatch
+                    arg_ops[1] = MIR_new_ref_op(mir_ctx, operand_method->MirFunc);
+                }
+
+                // invoking a delegate that is known to have a single target, call the target directly
+                if (delegate_target != NULL) {
+                    direct_target = delegate_target;
+                    arg_ops[0] = MIR_new_ref_op(mir_ctx, delegate_target->MirProto);
+                    arg_ops[1] = MIR_new_ref_op(mir_ctx, delegate_target->MirFunc);
+                    if (method_is_static(delegate_target)) {
+                        // drop the this, the arguments are the same otherwise
+                        other_args--;
+                        memmove(&arg_ops[other_args], &arg_ops[other_args + 1], arg_count * sizeof(MIR_op_t));
+                    } else {
+                        // the target of the delegate is the this, it was checked when the delegate was created
+                        MIR_reg_t target_reg = new_temp_reg(ctx, tSystem_Object);
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_MOV,
+                                                     MIR_new_reg_op(mir_ctx, target_reg),
+                                                     MIR_new_mem_op(mir_ctx, MIR_T_P,
+                                                                    offsetof(struct System_Delegate, Target),
+                                                                    this_reg, 0, 1)));
+                        arg_ops[other_args - 1] = MIR_new_reg_op(mir_ctx, target_reg);
+                    }
+                }
+
+                // get it to the exception register
+                arg_ops[2] = MIR_new_reg_op(mir_ctx, ctx->exception_reg);
+
+                // push the return value
+                if (operand_method->ReturnType != NULL) {
+                    MIR_reg_t ret_reg;
+                    CHECK_AND_RETHROW(stack_push(ctx, type_get_intermediate_type(operand_method->ReturnType), &ret_reg));
+
+                    if (type_get_stack_type(operand_method->ReturnType) == STACK_TYPE_REF) {
+                        // we did not pass any local references to this, so we know for sure it can't be a local address
+                        // being returned from the method
+                        STACK_TOP.non_local_ref = ret_is_non_local_ref;
+                    }
+
+                    // this should just work, because if the value is a struct it is going to be allocated properly
+                    // in the stack push, and it is going to be passed by a pointer that we give, and everything will
+                    // just work out because of how we have the order of everything :)
+                    arg_ops[3] = MIR_new_reg_op(mir_ctx, ret_reg);
+                }
+
+                // the call itself, with or without a return value
+                // only a direct call can be inlined
+                bool inline_call = arg_ops[1].mode == MIR_OP_REF && jit_should_inline(ctx, direct_target);
+                MIR_insn_t call_insn = MIR_new_insn_arr(mir_ctx, inline_call ? MIR_INLINE : MIR_CALL,
+                                                        other_args + arg_count,
+                                                        arg_ops);
+                MIR_append_insn(mir_ctx, mir_func, call_insn);
+                if (call_site != NULL) {
+                    call_site->call = call_insn;
+                }
+
+                // a direct call to a method that can't throw doesn't need the check, callvirt
+                // and newobj always have a valid this by the time we get here
+                bool cannot_throw = arg_ops[1].mode == MIR_OP_REF &&
+                                    (opcode != CEE_CALL || jit_call_has_valid_this(direct_target)) &&
+                                    jit_method_cannot_throw(direct_target, 0);
+
+                if (!cannot_throw) {
+                    // handle any exception which might have been thrown
+                    MIR_insn_t label = MIR_new_label(mir_ctx);
+
+                    // if we have a zero value skip the return
+                    MIR_append_insn(mir_ctx, mir_func,
+                                    MIR_new_insn(mir_ctx, MIR_BF,
+                                                 MIR_new_label_op(mir_ctx, label),
+                                                 MIR_new_reg_op(mir_ctx, ctx->exception_reg)));
+
+                    // throw the error, it has an unknown type
+                    CHECK_AND_RETHROW(jit_throw(ctx, NULL));
+
+                    // insert the skip label
+                    MIR_append_insn(mir_ctx, mir_func, label);
+                }
+
+                // check if we need to copy the left out value from the stack
+                // to the eval stack
+                if (
+                    opcode == CEE_NEWOBJ &&
+                    operand_method->DeclaringType->IsValueType &&
+                    type_get_stack_type(operand_method->DeclaringType) != STACK_TYPE_VALUE_TYPE
+                ) {
+                    MIR_append_insn(mir_ctx, mir_func,
+                                    MIR_new_insn(mir_ctx, jit_number_inscode(operand_method->DeclaringType),
+                                                 MIR_new_reg_op(mir_ctx, number_reg),
+                                                 MIR_new_mem_op(mir_ctx, get_mir_type(operand_method->DeclaringType), 0, this_reg, 0, 1)));
+                }
+            } break;
+
+            case CEE_INITOBJ: {
+                System_Type dest_type;
+                MIR_reg_t dest_reg;
+                CHECK_AND_RETHROW(stack_pop(ctx, &dest_type, &dest_reg, NULL));
+
+                CHECK(dest_type->IsByRef);
+                CHECK(type_is_verifier_assignable_to(operand_type, dest_type->BaseType));
+
+                jit_emit_zerofill(ctx, dest_reg, operand_type->StackSize);
+            } break;
+
+            case CEE_RET: {
+                System_Type method_ret_type = type_get_underlying_type(method->ReturnType);
+
+                if (method_ret_type == NULL) {
+                    // must be an empty stack, since we have no return value
+                    CHECK(arrlen(ctx->stack.entries) == 0);
+
+                    // there is no return value, just add a ret
+                    MIR_append_insn(mir_ctx, mir_func,
+                                    MIR_new_ret_insn(mir_ctx, 1,
+                                                     MIR_new_int_op(mir_ctx, 0)));
+                } else {
+                    // pop the return from the stack
+                    MIR_reg_t ret_arg;
+                    System_Type ret_type;
+                    CHECK_AND_RETHROW(stack_pop(ctx, &ret_type, &ret_arg, NULL));
+
+                    // verify the stack is empty
+                    CHECK(arrlen(ctx->stack.entries) == 0);
+
+                    // verify the IL
+                    CHECK(type_is_verifier_assignable_to(ret_type, method->ReturnType));
+
+                    switch (type_get_stack_type(ret_type)) {
+                        case STACK_TYPE_O: {
+                            if (type_is_interface(method_ret_type)) {
+                                if (type_is_interface(ret_type)) {
+                                    // interface -> interface
+                                    goto ret_value_type;
+                                } else {
+                                    // object -> interface
+                                    CHECK_AND_RETHROW(jit_cast_obj_to_interface(ctx,
+                                                                                return_block_reg, ret_arg,
+                                                                                ret_type, method_ret_type));
+
+                                    // return no exception
+                                    MIR_append_insn(mir_ctx, mir_func,
+                                                    MIR_new_ret_insn(mir_ctx, 1,
+                                                                     MIR_new_int_op(mir_ctx, 0)));
+                                }
+                            } else {
+                                if (type_is_interface(ret_type)) {
+                                    // interface -> object
+                                    MIR_append_insn(mir_ctx, mir_func,
+                                                    MIR_new_ret_insn(mir_ctx, 2,
+                                                                     MIR_new_int_op(mir_ctx, 0),
+                                                                     MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*), ret_arg, 0, 1)));
+                                } else {
+                                    // object -> object
+                                    goto ret_primitive_type;
+
+                                }
+                            }
+                        } break;
+
+                        ret_primitive_type:
+                        case STACK_TYPE_INT32:
+                        case STACK_TYPE_INT64:
+                        case STACK_TYPE_INTPTR:
+                        case STACK_TYPE_FLOAT: {
+                            // TODO: do we need to do float conversion in this case?
+
+                            // it is stored in a register directly, just return it
+                            MIR_append_insn(mir_ctx, mir_func,
+                                            MIR_new_ret_insn(mir_ctx, 2,
+                                                             MIR_new_int_op(mir_ctx, 0),
+                                                             MIR_new_reg_op(mir_ctx, ret_arg)));
+                        } break;
+
+                        ret_value_type:
+                        case STACK_TYPE_VALUE_TYPE: {
+                            // this is a big struct, copy it to the return block
+                            jit_emit_memcpy(ctx, return_block_reg, ret_arg, ret_type->StackSize);
+
+                            // return no exception
+                            MIR_append_insn(mir_ctx, mir_func,
+                                            MIR_new_ret_insn(mir_ctx, 1,
+                                                             MIR_new_int_op(mir_ctx, 0)));
+                        } break;
+
+                        case STACK_TYPE_REF:
+                            stack_entry_t entry = ctx->stack.entries[arrlen(ctx->stack.entries)];
+
+                            // make sure that the return value is a non-local reference
+                            CHECK(entry.non_local_ref);
+
+                            // TODO: methods that do allow to return readonly refs
+                            // make sure that the return value is a non-readonly reference
+                            CHECK(!entry.readonly_ref);
+
+                            // it is, then return it like we return any other primitive
+                            goto ret_primitive_type;
+                    }
+                }
+            } break;
+
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            // Array handling
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+            case CEE_NEWARR: {
+                // get the number of elements
+                MIR_reg_t num_elems_reg;
+                System_Type num_elems_type;
+                CHECK_AND_RETHROW(stack_pop(ctx, &num_elems_type, &num_elems_reg, NULL));
+
+                // make sure it has a valid type
+                CHECK(num_elems_type == tSystem_Int32);
+
+                // push the array type
+                MIR_reg_t array_reg;
+                CHECK_AND_RETHROW(stack_push(ctx, get_array_type(operand_type), &array_reg));
+
+                // calculate the size we are going to need:
+                //  num_elems * sizeof(value_type) + sizeof(System.Array)
+                MIR_reg_t size_reg = new_temp_reg(ctx, tSystem_Int64);
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_MUL,
+                                             MIR_new_reg_op(mir_ctx, size_reg),
+                                             MIR_new_reg_op(mir_ctx, num_elems_reg),
+                                             MIR_new_int_op(mir_ctx, operand_type->StackSize)));
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_ADD,
+                                             MIR_new_reg_op(mir_ctx, size_reg),
+                                             MIR_new_reg_op(mir_ctx, size_reg),
+                                             MIR_new_int_op(mir_ctx, tSystem_Array->ManagedSize)));
+
+                // actually allocate it now
+                // allocate the new object
+                CHECK_AND_RETHROW(jit_new(ctx,
+                                          array_reg, get_array_type(operand_type),
+                                          MIR_new_reg_op(mir_ctx, size_reg)));
+
+                // Set the length of the array
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                             MIR_new_mem_op(mir_ctx,
+                                                            MIR_T_I32,
+                                                            offsetof(struct System_Array, Length),
+                                                            array_reg,
+                                                            0, 1),
+                                             MIR_new_reg_op(mir_ctx, num_elems_reg)));
+            } break;
+
+            case CEE_LDLEN: {
+                // get the number of elements
+                MIR_reg_t array_reg;
+                System_Type array_type;
+                stack_entry_t array_entry;
+                CHECK_AND_RETHROW(stack_pop(ctx, &array_type, &array_reg, &array_entry));
+
+                // this must be an array
+                CHECK(array_type->IsArray);
+
+                // check the object is not null
+                CHECK_AND_RETHROW(jit_null_check(ctx, array_reg, array_type, &array_entry));
+
+                // push the length
+                MIR_reg_t length_reg;
+                CHECK_AND_RETHROW(stack_push(ctx, tSystem_IntPtr, &length_reg));
+
+                // simply read the array's length
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                             MIR_new_reg_op(mir_ctx, length_reg),
+                                             MIR_new_mem_op(mir_ctx, MIR_T_I32,
+                                                            offsetof(struct System_Array, Length),
+                                                            array_reg, 0, 1)));
+            } break;
+
+            case CEE_STELEM_I1: operand_type = tSystem_SByte; goto cee_stelem;
+            case CEE_STELEM_I2: operand_type = tSystem_Int16; goto cee_stelem;
+            case CEE_STELEM_I4: operand_type = tSystem_Int32; goto cee_stelem;
+            case CEE_STELEM_I8: operand_type = tSystem_Int64; goto cee_stelem;
+            case CEE_STELEM_R4: operand_type = tSystem_Single; goto cee_stelem;
+            case CEE_STELEM_R8: operand_type = tSystem_Double; goto cee_stelem;
+            case CEE_STELEM_I: operand_type = tSystem_IntPtr; goto cee_stelem;
+            case CEE_STELEM_REF:
+            case CEE_STELEM:
+            cee_stelem: {
+                // pop all the values from the stack
+                MIR_reg_t value_reg;
+                MIR_reg_t index_reg;
+                MIR_reg_t array_reg;
+                System_Type value_type;
+                System_Type index_type;
+                System_Type array_type;
+                stack_entry_t index_entry;
+                stack_entry_t array_entry;
+                CHECK_AND_RETHROW(stack_pop(ctx, &value_type, &value_reg, NULL));
+                CHECK_AND_RETHROW(stack_pop(ctx, &index_type, &index_reg, &index_entry));
+                CHECK_AND_RETHROW(stack_pop(ctx, &array_type, &array_reg, &array_entry));
+
+                // this must be an array
+                CHECK(array_type->IsArray);
+
+                // for stelem.ref the operand type is the same as the
+                // array itself
+                if (operand_type == NULL) {
+                    operand_type = array_type->ElementType;
+                }
+
+                // validate all the type stuff
+                CHECK(type_is_array_element_compatible_with(value_type, type_get_intermediate_type(operand_type)));
+                CHECK(type_is_array_element_compatible_with(operand_type, array_type->ElementType));
+
+                // only int32 and intptr are allowed
+                if (type_get_stack_type(index_type) == STACK_TYPE_INT32) {
+                    // sign extend to int64
+                    MIR_append_insn(mir_ctx, mir_func,
+                                    MIR_new_insn(mir_ctx, MIR_EXT32,
+                                                 MIR_new_reg_op(mir_ctx, index_reg),
+                                                 MIR_new_reg_op(mir_ctx, index_reg)));
+                } else {
+                    CHECK(type_get_stack_type(index_type) == STACK_TYPE_INTPTR);
+                }
+
+                // check the object is not null
+                CHECK_AND_RETHROW(jit_null_check(ctx, array_reg, array_type, &array_entry));
 
-                        // in mir when calling
-                        case STACK_TYPE_VALUE_TYPE: {
-                            mem_op = true;
-                        } break;
+                // check the array indexes
+                if (!jit_index_in_range(ctx, &array_entry, &index_entry)) {
+                    CHECK_AND_RETHROW(jit_oob_check(ctx, array_reg, index_reg));
+                }
 
-                        default:
-                            CHECK_FAIL();
-                    }
+                switch (type_get_stack_type(value_type)) {
+                    case STACK_TYPE_O: {
+                        if (type_is_interface(operand_type)) {
+                            if (type_is_interface(value_type)) {
+                                // interface -> interface
+                                goto stelem_value_type;
+                            } else {
+                                // object -> interface
 
-                    // we are creating a new delegate and this is the target parameter
-                    if (i - other_args == 0 && ftnMethod != NULL) {
-                        if (!method_is_static(ftnMethod)) {
-                            // this is an instance method, emit a null check on the target
-                            // to make sure that it is not null
-                            CHECK_AND_RETHROW(jit_null_check(ctx, arg_reg, arg_type));
+                                // calculate the offset as `index_reg * sizeof(operand_type) + sizeof(System.Array)`
+                                MIR_append_insn(mir_ctx, mir_func,
+                                                MIR_new_insn(mir_ctx, MIR_MUL,
+                                                             MIR_new_reg_op(mir_ctx, index_reg),
+                                                             MIR_new_reg_op(mir_ctx, index_reg),
+                                                             MIR_new_int_op(mir_ctx, operand_type->StackSize)));
+                                MIR_append_insn(mir_ctx, mir_func,
+                                                MIR_new_insn(mir_ctx, MIR_ADD,
+                                                             MIR_new_reg_op(mir_ctx, index_reg),
+                                                             MIR_new_reg_op(mir_ctx, index_reg),
+                                                             MIR_new_int_op(mir_ctx, tSystem_Array->ManagedSize)));
+
+
+                                // from an object, cast required, need a write barrier
+                                CHECK_AND_RETHROW(jit_cast_obj_to_interface(ctx,
+                                                                            index_reg, value_reg,
+                                                                            value_type, operand_type));
+                            }
                         } else {
-                            // this is a static method, we need a null target, if already null
-                            // ignore it, otherwise just zero the reg
-                            if (arg_type != NULL) {
+                            // check if we need to cast to an object from an interface
+                            if (type_is_interface(value_type)) {
                                 MIR_append_insn(mir_ctx, mir_func,
                                                 MIR_new_insn(mir_ctx, MIR_MOV,
-                                                             MIR_new_reg_op(mir_ctx, arg_reg),
-                                                             MIR_new_int_op(mir_ctx, 0)));
+                                                             MIR_new_reg_op(mir_ctx, value_reg),
+                                                             MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*), value_reg, 0, 1)));
                             }
+
+                            // calculate the offset as `index_reg * sizeof(operand_type) + sizeof(System.Array)`
+                            MIR_append_insn(mir_ctx, mir_func,
+                                            MIR_new_insn(mir_ctx, MIR_MUL,
+                                                         MIR_new_reg_op(mir_ctx, index_reg),
+                                                         MIR_new_reg_op(mir_ctx, index_reg),
+                                                         MIR_new_int_op(mir_ctx, operand_type->StackSize)));
+                            MIR_append_insn(mir_ctx, mir_func,
+                                            MIR_new_insn(mir_ctx, MIR_ADD,
+                                                         MIR_new_reg_op(mir_ctx, index_reg),
+                                                         MIR_new_reg_op(mir_ctx, index_reg),
+                                                         MIR_new_int_op(mir_ctx, tSystem_Array->ManagedSize)));
+
+                            // storing to an object from an object
+                            jit_emit_gc_update(ctx, array_reg, MIR_new_reg_op(mir_ctx, index_reg), value_reg);
                         }
+                    } break;
 
-                        // make sure to reset it now
-                        ftnMethod = NULL;
-                    }
+                    case STACK_TYPE_INT32:
+                    case STACK_TYPE_INT64:
+                    case STACK_TYPE_INTPTR:
+                    case STACK_TYPE_FLOAT: {
+                        MIR_insn_code_t code = jit_number_cast_inscode(value_type, operand_type);
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, code,
+                                                     MIR_new_mem_op(mir_ctx, get_mir_type(operand_type),
+                                                                    tSystem_Array->ManagedSize,
+                                                                    array_reg, index_reg, operand_type->StackSize),
+                                                     MIR_new_reg_op(mir_ctx, value_reg)));
+                    } break;
 
-                    // set the op, for anything passed by value we need to use MIR_T_BLK with the disp
-                    // being the size instead of the displacement
-                    if (mem_op) {
-                        arg_ops[i] = MIR_new_mem_op(mir_ctx, MIR_T_BLK, arg_type->StackSize, arg_reg, 0, 1);
-                    } else {
-                        arg_ops[i] = MIR_new_reg_op(mir_ctx, arg_reg);
-                    }
+                    stelem_value_type:
+                    case STACK_TYPE_VALUE_TYPE: {
+                        // calculate the offset as `array + index_reg * sizeof(operand_type) + sizeof(System.Array)`
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_MUL,
+                                                     MIR_new_reg_op(mir_ctx, index_reg),
+                                                     MIR_new_reg_op(mir_ctx, index_reg),
+                                                     MIR_new_int_op(mir_ctx, operand_type->StackSize)));
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_ADD,
+                                                     MIR_new_reg_op(mir_ctx, index_reg),
+                                                     MIR_new_reg_op(mir_ctx, index_reg),
+                                                     MIR_new_int_op(mir_ctx, tSystem_Array->ManagedSize)));
 
-                    // verify a normal argument
-                    CHECK(type_is_verifier_assignable_to(arg_type, signature_type));
+                        if (arrlen(value_type->ManagedPointersOffsets) == 0) {
+                            // add the base, so we have an abs address
+                            MIR_append_insn(mir_ctx, mir_func,
+                                            MIR_new_insn(mir_ctx, MIR_ADD,
+                                                         MIR_new_reg_op(mir_ctx, array_reg),
+                                                         MIR_new_reg_op(mir_ctx, index_reg),
+                                                         MIR_new_reg_op(mir_ctx, array_reg)));
+
+                            // can use a simple memcpy
+                            jit_emit_memcpy(ctx, array_reg, value_reg, operand_type->StackSize);
+                        } else {
+                            // has pointers, use managed memcpy
+                            MIR_append_insn(mir_ctx, mir_func,
+                                            MIR_new_call_insn(mir_ctx, 6,
+                                                              MIR_new_ref_op(mir_ctx, m_managed_memcpy_proto),
+                                                              MIR_new_ref_op(mir_ctx, m_managed_memcpy_func),
+                                                              MIR_new_reg_op(mir_ctx, array_reg),
+                                                              MIR_new_ref_op(mir_ctx, operand_type->MirType),
+                                                              MIR_new_reg_op(mir_ctx, index_reg),
+                                                              MIR_new_reg_op(mir_ctx, value_reg)));
+                        }
+                    } break;
+
+                    case STACK_TYPE_REF:
+                        CHECK_FAIL("wtf");
                 }
+            } break;
 
-                // handle the `this` argument
-                MIR_reg_t number_reg;
-                MIR_reg_t this_reg;
-                System_Type this_type;
-                if (!method_is_static(operand_method)) {
-                    if (opcode == CEE_NEWOBJ) {
-                        // this is the this_type
-                        this_type = operand_method->DeclaringType;
+            case CEE_LDELEM_I1: operand_type = tSystem_SByte; goto cee_ldelem;
+            case CEE_LDELEM_I2: operand_type = tSystem_Int16; goto cee_ldelem;
+            case CEE_LDELEM_I4: operand_type = tSystem_Int32; goto cee_ldelem;
+            case CEE_LDELEM_I8: operand_type = tSystem_Int64; goto cee_ldelem;
+            case CEE_LDELEM_U1: operand_type = tSystem_Byte; goto cee_ldelem;
+            case CEE_LDELEM_U2: operand_type = tSystem_UInt16; goto cee_ldelem;
+            case CEE_LDELEM_U4: operand_type = tSystem_UInt32; goto cee_ldelem;
+            case CEE_LDELEM_R4: operand_type = tSystem_Single; goto cee_ldelem;
+            case CEE_LDELEM_R8: operand_type = tSystem_Double; goto cee_ldelem;
+            case CEE_LDELEM_I: operand_type = tSystem_IntPtr; goto cee_ldelem;
+            case CEE_LDELEM_REF:    // implicit from array type
+            case CEE_LDELEM:        // operand type is loaded
+            cee_ldelem: {
+                // pop all the values from the stack
+                MIR_reg_t index_reg;
+                MIR_reg_t array_reg;
+                System_Type index_type;
+                System_Type array_type;
+                stack_entry_t index_entry;
+                stack_entry_t array_entry;
+                CHECK_AND_RETHROW(stack_pop(ctx, &index_type, &index_reg, &index_entry));
+                CHECK_AND_RETHROW(stack_pop(ctx, &array_type, &array_reg, &array_entry));
 
-                        // make sure this is a type we can actually create
-                        CHECK(!type_is_abstract(this_type));
-                        CHECK(!type_is_interface(this_type));
+                // this must be an array
+                CHECK(array_type->IsArray);
 
-                        CHECK_AND_RETHROW(stack_push(ctx, operand_method->DeclaringType, &this_reg));
+                // for anything which is not ldelem.ref we know the operand_type
+                // from the array
+                if (operand_type != NULL) {
+                    CHECK(type_is_array_element_compatible_with(array_type->ElementType, operand_type));
+                } else {
+                    // the type is gotten from the array
+                    operand_type = array_type->ElementType;
+                }
 
-                        if (this_type->IsValueType) {
-                            if (type_get_stack_type(this_type) != STACK_TYPE_VALUE_TYPE) {
-                                // this is an integer/float type, so allocate it on the stack
-                                // so we can pass it as a reference and then just copy it into
-                                // the eval stack as a normal variable
+                // only int32 and intptr are allowed
+                if (type_get_stack_type(index_type) == STACK_TYPE_INT32) {
+                    // sign extend to int64
+                    MIR_append_insn(mir_ctx, mir_func,
+                                    MIR_new_insn(mir_ctx, MIR_EXT32,
+                                                 MIR_new_reg_op(mir_ctx, index_reg),
+                                                 MIR_new_reg_op(mir_ctx, index_reg)));
+                } else {
+                    CHECK(type_get_stack_type(index_type) == STACK_TYPE_INTPTR);
+                }
 
-                                // save the position on the eval stack
-                                number_reg = this_reg;
+                // check the object is not null
+                CHECK_AND_RETHROW(jit_null_check(ctx, array_reg, array_type, &array_entry));
 
-                                // set a temp new location
-                                this_reg = new_temp_reg(ctx, tSystem_IntPtr);
-                                MIR_prepend_insn(mir_ctx, mir_func,
-                                                 MIR_new_insn(mir_ctx, MIR_ALLOCA,
-                                                              MIR_new_reg_op(mir_ctx, this_reg),
-                                                              MIR_new_int_op(mir_ctx, operand_method->DeclaringType->StackSize)));
-                            }
+                // check the array indexes
+                if (!jit_index_in_range(ctx, &array_entry, &index_entry)) {
+                    CHECK_AND_RETHROW(jit_oob_check(ctx, array_reg, index_reg));
+                }
 
-                            // For a value type we just need to zero it out before calling the ctor
-                            jit_emit_zerofill(ctx, this_reg, this_type->StackSize);
+                // push to the stack
+                MIR_reg_t value_reg;
+                CHECK_AND_RETHROW(stack_push(ctx, type_get_intermediate_type(operand_type), &value_reg));
+
+                switch (type_get_stack_type(operand_type)) {
+                    case STACK_TYPE_O: {
+                        if (type_is_interface(operand_type)) {
+                            goto ldelem_value_type;
                         } else {
-                            MIR_op_t size_op;
-                            if (this_type == tSystem_String) {
-                                // special handling for string
-                                MIR_reg_t size_reg = new_temp_reg(ctx, tSystem_Int64);
+                            goto ldelem_primitive_type;
+                        }
+                    } break;
 
-                                // we need to figure what the length is from the ctor, the ctor will
-                                // handle actually copying the data nicely
-                                if (operand_method->Parameters->Length == 3) {
-                                    // String(char[] args, startIndex, length), the size is
-                                    // the last argument times two....
-                                    MIR_append_insn(mir_ctx, mir_func,
-                                                    MIR_new_insn(mir_ctx, MIR_MOV,
-                                                                 MIR_new_reg_op(mir_ctx, size_reg),
-                                                                 arg_ops[other_args + 3]));
+                    ldelem_primitive_type:
+                    case STACK_TYPE_INT32:
+                    case STACK_TYPE_INT64:
+                    case STACK_TYPE_INTPTR:
+                    case STACK_TYPE_FLOAT: {
+                        // we need to extend this properly if the field is smaller
+                        // than an int32 (because we are going to load into an int32
+                        // essentially)
+                        MIR_insn_code_t code = MIR_MOV;
+                        if (operand_type == tSystem_SByte || operand_type == tSystem_Boolean) {
+                            code = MIR_EXT8;
+                        } else if (operand_type == tSystem_Byte) {
+                            code = MIR_UEXT8;
+                        } else if (operand_type == tSystem_Int16) {
+                            code = MIR_EXT16;
+                        } else if (operand_type == tSystem_UInt16 || operand_type == tSystem_Char) {
+                            code = MIR_UEXT16;
+                        } else if (operand_type == tSystem_Single) {
+                            code = MIR_FMOV;
+                        } else if (operand_type == tSystem_Single) {
+                            code = MIR_DMOV;
+                        }
+
+                        // we can copy this in a single mov
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, code,
+                                                     MIR_new_reg_op(mir_ctx, value_reg),
+                                                     MIR_new_mem_op(mir_ctx, get_mir_type(operand_type),
+                                                                    tSystem_Array->ManagedSize,
+                                                                    array_reg, index_reg, operand_type->StackSize)));
+                    } break;
 
-                                } else {
-                                    ASSERT(operand_method->Parameters->Length == 1);
-                                    System_Type arg0_type = operand_method->Parameters->Data[0]->ParameterType;
+                    ldelem_value_type:
+                    case STACK_TYPE_VALUE_TYPE: {
+                        // just emit a memcpy
+                        // calculate the offset as `array + index_reg * sizeof(operand_type) + sizeof(System.Array)`
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_MUL,
+                                                     MIR_new_reg_op(mir_ctx, index_reg),
+                                                     MIR_new_reg_op(mir_ctx, index_reg),
+                                                     MIR_new_int_op(mir_ctx, operand_type->StackSize)));
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_ADD,
+                                                     MIR_new_reg_op(mir_ctx, index_reg),
+                                                     MIR_new_reg_op(mir_ctx, index_reg),
+                                                     MIR_new_int_op(mir_ctx, tSystem_Array->ManagedSize)));
+                        MIR_append_insn(mir_ctx, mir_func,
+                                        MIR_new_insn(mir_ctx, MIR_ADD,
+                                                     MIR_new_reg_op(mir_ctx, array_reg),
+                                                     MIR_new_reg_op(mir_ctx, index_reg),
+                                                     MIR_new_reg_op(mir_ctx, array_reg)));
 
-                                    if (arg0_type->IsArray) {
-                                        // String(char[] chars), the size is the array length
-                                        ASSERT(arg_ops[other_args].mode == MIR_OP_REG);
-                                        MIR_append_insn(mir_ctx, mir_func,
-                                                        MIR_new_insn(mir_ctx, MIR_MOV,
-                                                                     MIR_new_reg_op(mir_ctx, size_reg),
-                                                                     MIR_new_mem_op(mir_ctx, MIR_T_I32,
-                                                                                    offsetof(struct System_Array, Length),
-                                                                                    arg_ops[other_args].u.reg, 0, 1)));
-                                    } else {
-                                        // String(int length), the size is length
-                                        MIR_append_insn(mir_ctx, mir_func,
-                                                        MIR_new_insn(mir_ctx, MIR_MOV,
-                                                                     MIR_new_reg_op(mir_ctx, size_reg),
-                                                                     arg_ops[other_args]));
-                                    }
-                                }
+                        // can use a simple memcpy
+                        jit_emit_memcpy(ctx, value_reg, array_reg, operand_type->StackSize);
+                    } break;
 
-                                // multiply by char size
-                                MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_insn(mir_ctx, MIR_MUL,
-                                                             MIR_new_reg_op(mir_ctx, size_reg),
-                                                             MIR_new_reg_op(mir_ctx, size_reg),
-                                                             MIR_new_int_op(mir_ctx, sizeof(System_Char))));
+                    case STACK_TYPE_REF:
+                        CHECK_FAIL();
+                }
+            } break;
 
-                                // add the header size
-                                MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_insn(mir_ctx, MIR_ADD,
-                                                             MIR_new_reg_op(mir_ctx, size_reg),
-                                                             MIR_new_reg_op(mir_ctx, size_reg),
-                                                             MIR_new_int_op(mir_ctx, tSystem_String->ManagedSize)));
+            case CEE_LDELEMA: {
+                // pop all the values from the stack
+                MIR_reg_t value_reg;
+                MIR_reg_t index_reg;
+                MIR_reg_t array_reg;
+                System_Type index_type;
+                System_Type array_type;
+                stack_entry_t index_entry;
+                stack_entry_t array_entry;
+                CHECK_AND_RETHROW(stack_pop(ctx, &index_type, &index_reg, &index_entry));
+                CHECK_AND_RETHROW(stack_pop(ctx, &array_type, &array_reg, &array_entry));
 
-                                // create the op
-                                size_op = MIR_new_reg_op(mir_ctx, size_reg);
-                            } else {
-                                // Normal object
-                                size_op = MIR_new_int_op(mir_ctx, operand_method->DeclaringType->ManagedSize);
-                            }
+                // this must be an array
+                CHECK(array_type->IsArray);
 
-                            // allocate the new object
-                            CHECK_AND_RETHROW(jit_new(ctx, this_reg,
-                                                      operand_method->DeclaringType, size_op));
-                        }
-                    } else {
-                        // this is a call, get it from the stack
-                        CHECK_AND_RETHROW(stack_pop(ctx, &this_type, &this_reg, NULL));
+                // for anything which is not ldelem.ref we know the operand_type
+                // from the array
+                CHECK(type_is_array_element_compatible_with(array_type->ElementType, operand_type));
 
-                        // Value types have their this as a by-ref
-                        System_Type signature_this_type = operand_method->DeclaringType;
-                        if (signature_this_type->IsValueType) {
-                            signature_this_type = get_by_ref_type(signature_this_type);
-                        }
+                // only int32 and intptr are allowed
+                if (type_get_stack_type(index_type) == STACK_TYPE_INT32) {
+                    // sign extend to int64
+                    MIR_append_insn(mir_ctx, mir_func,
+                                    MIR_new_insn(mir_ctx, MIR_EXT32,
+                                                 MIR_new_reg_op(mir_ctx, index_reg),
+                                                 MIR_new_reg_op(mir_ctx, index_reg)));
+                } else {
+                    CHECK(type_get_stack_type(index_type) == STACK_TYPE_INTPTR);
+                }
 
-                        // NOTE: for interfaces the `this` is unpacked properly at a later stage since
-                        //       we also need the vtable from the original `this`
+                // check the object is not null
+                CHECK_AND_RETHROW(jit_null_check(ctx, array_reg, array_type, &array_entry));
 
-                        if (constrainedType != NULL) {
-                            CHECK(this_type->IsByRef);
-                            CHECK(this_type->BaseType == constrainedType);
+                // check the array indexes
+                if (!jit_index_in_range(ctx, &array_entry, &index_entry)) {
+                    CHECK_AND_RETHROW(jit_oob_check(ctx, array_reg, index_reg));
+                }
 
-                            // If this_type is a reference type (as opposed to a value type)
-                            if (type_is_object_ref(constrainedType)) {
-                                // ptr is dereferenced and passed as the ‘this’ pointer to the callvirt of method
-                                this_type = constrainedType;
-                                MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                                                MIR_new_reg_op(mir_ctx, this_reg),
-                                                                MIR_new_mem_op(mir_ctx, MIR_T_P, 0, this_reg, 0, 1)));
-                            } else {
-                                // this is a value type, the signature this is a reference
-                                signature_this_type = get_by_ref_type(constrainedType);
-                            }
+                // push to the stack
+                CHECK_AND_RETHROW(stack_push(ctx, get_by_ref_type(type_get_intermediate_type(operand_type)), &value_reg));
+                STACK_TOP.non_local_ref = true;
 
-                            // get the static dispatch, the call later will
-                            // actually handle making sure this is correct
-                            CHECK(operand_method->VTableOffset < constrainedType->VirtualMethods->Length);
+                // calculate the element reference offset
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_MUL,
+                                             MIR_new_reg_op(mir_ctx, value_reg),
+                                             MIR_new_reg_op(mir_ctx, index_reg),
+                                             MIR_new_int_op(mir_ctx, operand_type->StackSize)));
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_ADD,
+                                             MIR_new_reg_op(mir_ctx, value_reg),
+                                             MIR_new_reg_op(mir_ctx, value_reg),
+                                             MIR_new_int_op(mir_ctx, tSystem_Array->ManagedSize)));
 
-                            // figure the real method for this dispatch
-                            int vtable_offset = operand_method->VTableOffset;
-                            if (type_is_interface(operand_method->DeclaringType)) {
-                                // comes from interface, need to give a static offset
-                                TinyDotNet_Reflection_InterfaceImpl impl = type_get_interface_impl(constrainedType, operand_method->DeclaringType);
-                                CHECK(impl != NULL);
-                                vtable_offset += impl->VTableOffset;
-                            } else if (type_is_interface(constrainedType)) {
-                                // I think this is the only case
-                                CHECK(operand_method->DeclaringType == tSystem_Object);
+                // add the object base to the offset
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_ADD,
+                                             MIR_new_reg_op(mir_ctx, value_reg),
+                                             MIR_new_reg_op(mir_ctx, value_reg),
+                                             MIR_new_reg_op(mir_ctx, array_reg)));
+            } break;
 
-                                // we need to essentially cast to an object
-                                this_type = tSystem_Object;
-                                constrainedType = tSystem_Object;
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            // Delegate
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-                                // upack the this so it will be a simple object
-                                MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                                             MIR_new_reg_op(mir_ctx, this_reg),
-                                                             MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*), this_reg, 0, 1)));
-                            }
-                            operand_method = constrainedType->VirtualMethods->Data[vtable_offset];
+            case CEE_LDFTN:
+            case CEE_LDVIRTFTN:
+            {
 
-                            // clear the type
-                            constrainedType = NULL;
-                        }
+                if (opcode == CEE_LDVIRTFTN) {
+                    // according to the ECMA spec it should always be
+                    //
+                    //  DUP
+                    //  LDVIRTFTN method
+                    //  NEWOBJ delegate_ctor
+                    //
+                    // the reason is that this makes sure that the method and the type we are
+                    // creating the delegate on are def the same type
+                    //
+                    CHECK(last_opcode == CEE_DUP);
 
-                        // verify a normal argument
-                        if (signature_this_type == tSystem_Object && this_type->BaseType == tSystem_ValueType) {
-                            // this is an edge case, we are going to politely ignore it
-                            // in short, for whatever reason the compiler generates a ctor in System.ValueType
-                            // that calls the ctor of System.Object ????
-                        } else {
-                            CHECK(type_is_verifier_assignable_to(this_type, signature_this_type));
-                        }
+                    // pop the object
+                    MIR_reg_t object_reg;
+                    System_Type object_type;
+                    CHECK_AND_RETHROW(stack_pop(ctx, &object_type, &object_reg, NULL));
 
-                        // make sure that the object is not null, only if not a byref
-                        if (!this_type->IsByRef) {
-                            CHECK_AND_RETHROW(jit_null_check(ctx, this_reg, this_type));
-                        }
-                    }
+                    // check that the method matches the object
+                    CHECK(type_is_verifier_assignable_to(object_type, operand_method->DeclaringType));
 
-                    arg_ops[i] = MIR_new_reg_op(mir_ctx, this_reg);
+                    // resolve it
+                    CHECK(method_is_virtual(operand_method));
+                    operand_method = object_type->VirtualMethods->Data[operand_method->VTableOffset];
+                    CHECK(method_is_final(operand_method));
                 }
 
-                // get the MIR signature and address
-                arg_ops[0] = MIR_new_ref_op(mir_ctx, operand_method->MirProto);
-
-                // byref uses static dispatch since we know the exact type always
-                if (
-                    opcode == CEE_CALLVIRT &&
-                    method_is_virtual(operand_method)
-                ) {
-                    // we are using callvirt and this is a virtual method, so we have to
-                    // use a dynamic dispatch
+                // push the reference to the function
+                MIR_reg_t ftn_reg;
+                CHECK_AND_RETHROW(stack_push(ctx, tSystem_UIntPtr, &ftn_reg));
+                MIR_append_insn(mir_ctx, mir_func,
+                                MIR_new_insn(mir_ctx, MIR_MOV,
+                                             MIR_new_reg_op(mir_ctx, ftn_reg),
+                                             MIR_new_ref_op(mir_ctx, operand_method->MirFunc)));
 
-                    MIR_reg_t temp_reg = new_temp_reg(ctx, tSystem_Type);
 
-                    // get the vtable pointer from the object, it is at the first
-                    // item for both an interface and an object
-                    MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_insn(mir_ctx, MIR_MOV,
-                                                 MIR_new_reg_op(mir_ctx, temp_reg),
-                                                 MIR_new_mem_op(mir_ctx, MIR_T_P, 0, this_reg, 0, 1)));
+                // save the method that we are pushing
+                ftnMethod = operand_method;
+            } break;
 
-                    // figure offset and the actual method
-                    int vtable_index;
-                    if (type_is_interface(this_type)) {
-                        // we have an interface on the stack, the vtable is the first element
-                        // and the vtable index is exactly as given in the operand
-                        vtable_index = operand_method->VTableOffset;
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+            // Unknown opcode
+            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-                        // read the actual instance pointer of the interface, so we can use it
-                        // when calling the function
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_MOV,
-                                                     MIR_new_reg_op(mir_ctx, this_reg),
-                                                     MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*), this_reg, 0, 1)));
-                    } else {
-                        if (type_is_interface(operand_method->DeclaringType)) {
-                            // we want to call an interface method on the object, so resolve it and get the
-                            // object inside the object's vtable instead
-                            vtable_index = type_get_interface_method_impl(this_type, operand_method)->VTableOffset;
-                        } else {
-                            // this is a normal virtual method, nothing to resolve
-                            vtable_index = operand_method->VTableOffset;
-                        }
-                    }
+            default: {
+                CHECK_FAIL("TODO: opcode %s", opcode_info->name);
+            } break;
+        }
 
-                    if (this_type->IsByRef) {
-                        // we have a ref on the stack, which means it must be a value type, so we can call the actual
-                        // method directly since all value types are sealed by default
-                        CHECK(type_is_sealed(this_type->BaseType));
-                        arg_ops[1] = MIR_new_ref_op(mir_ctx, this_type->BaseType->VirtualMethods->Data[vtable_index]->MirFunc);
-                    } else if (type_is_sealed(this_type)) {
-                        // this is an instance class which is a sealed class, choose the unboxer form if exists and the
-                        // normal one otherwise
-                        System_Reflection_MethodInfo m = this_type->VirtualMethods->Data[vtable_index];
-                        arg_ops[1] = MIR_new_ref_op(mir_ctx, m->MirUnboxerFunc ?: m->MirFunc);
-                    } else {
-                        // get the address of the function from the vtable
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_MOV,
-                                                     MIR_new_reg_op(mir_ctx, temp_reg),
-                                                     MIR_new_mem_op(mir_ctx, MIR_T_P,
-                                                                    vtable_index * sizeof(void*),
-                                                                    temp_reg, 0, 1)));
+        // reset the temp registers
+        ctx->itmp.depth = 0;
+        ctx->ftmp.depth = 0;
+        ctx->dtmp.depth = 0;
 
-                        // indirect call
-                        arg_ops[1] = MIR_new_reg_op(mir_ctx, temp_reg);
-                    }
-                } else {
-                    // static dispatch
-                    arg_ops[1] = MIR_new_ref_op(mir_ctx, operand_method->MirFunc);
-                }
+        // store the last opcode
+        last_opcode = opcode;
+    }
 
-                // get it to the exception register
-                arg_ops[2] = MIR_new_reg_op(mir_ctx, ctx->exception_reg);
+    // make sure that the last instruction is either
+    // a return or a branch or a throw
+    CHECK(
+        last_cf == OPCODE_CONTROL_FLOW_THROW ||
+        last_cf == OPCODE_CONTROL_FLOW_BRANCH ||
+        last_cf == OPCODE_CONTROL_FLOW_RETURN
+    );
 
-                // emit the IR
-                if (operand_method->ReturnType != NULL) {
-                    MIR_reg_t ret_reg;
-                    CHECK_AND_RETHROW(stack_push(ctx, type_get_intermediate_type(operand_method->ReturnType), &ret_reg));
+#ifdef JIT_TRACE
+    TRACE("}");
+    TRACE();
+#endif
 
-                    if (type_get_stack_type(operand_method->ReturnType) == STACK_TYPE_REF) {
-                        // we did not pass any local references to this, so we know for sure it can't be a local address
-                        // being returned from the method
-                        STACK_TOP.non_local_ref = ret_is_non_local_ref;
-                    }
+cleanup:
+    if (IS_ERROR(err)) {
+        MIR_output_item(mir_ctx, stdout, mir_func);
+    }
 
-                    // this should just work, because if the value is a struct it is going to be allocated properly
-                    // in the stack push, and it is going to be passed by a pointer that we give, and everything will
-                    // just work out because of how we have the order of everything :)
-                    arg_ops[3] = MIR_new_reg_op(mir_ctx, ret_reg);
-                    MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_insn_arr(mir_ctx, aggressive_inlining ? MIR_INLINE : MIR_CALL,
-                                                     other_args + arg_count,
-                                                     arg_ops));
-                } else {
-                    // Does not have a return argument, no need to handle
-                    MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_insn_arr(mir_ctx, aggressive_inlining ? MIR_INLINE : MIR_CALL,
-                                                     other_args + arg_count,
-                                                     arg_ops));
-                }
+    // free all the memory used for jitting the method
+    SAFE_FREE(switch_ops);
+    strbuilder_free(&method_name);
+    arrfree(locals);
+    for (int i = 0; i < hmlen(ctx->pc_to_stack_snapshot); i++) {
+        arrfree(ctx->pc_to_stack_snapshot[i].stack.entries);
+    }
+    arrfree(ctx->stack.entries);
+    arrfree(ctx->ireg.regs);
+    arrfree(ctx->dreg.regs);
+    arrfree(ctx->freg.regs);
+    arrfree(ctx->itmp.regs);
+    arrfree(ctx->dtmp.regs);
+    arrfree(ctx->ftmp.regs);
+    hmfree(ctx->pc_to_stack_snapshot);
+    hmfree(ctx->clause_to_label);
+    hmfree(ctx->branch_targets);
+    arrfree(ctx->range_loops);
+    arrfree(ctx->address_taken);
+    arrfree(ctx->non_null_sources);
+    arrfree(ctx->frame_objects);
+    hmfree(ctx->delegate_locals);
+    hmfree(ctx->box_uses);
+    arrfree(ctx->elided_unboxes);
 
-                // handle any exception which might have been thrown
-                MIR_insn_t label = MIR_new_label(mir_ctx);
+    return err;
+}
 
-                // if we have a zero value skip the return
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_BF,
-                                             MIR_new_label_op(mir_ctx, label),
-                                             MIR_new_reg_op(mir_ctx, ctx->exception_reg)));
+//
+// TODO: this can be much cheaper if we just have a
+//
+//  add rdi, sizeof(struct System_Object)
+//  jmp <original method>
+//
+// but idk if we have a good way to do it in MIR
+//
+static err_t jit_generate_unboxer(jit_context_t* ctx, System_Reflection_MethodInfo method) {
+    err_t err = NO_ERROR;
+    MIR_var_t* vars = NULL;
+    MIR_op_t* ops = NULL;
 
-                // throw the error, it has an unknown type
-                CHECK_AND_RETHROW(jit_throw(ctx, NULL));
+    // generate the function name
+    strbuilder_t func_name = strbuilder_new();
+    method_print_full_name(method, &func_name);
+    strbuilder_cstr(&func_name, "$unboxer");
 
-                // insert the skip label
-                MIR_append_insn(mir_ctx, mir_func, label);
+    size_t nres = 1;
+    MIR_type_t res_type[2] = {
+        MIR_T_P, // exception
+        MIR_T_UNDEF, // return value if any
+    };
 
-                // check if we need to copy the left out value from the stack
-                // to the eval stack
-                if (
-                    opcode == CEE_NEWOBJ &&
-                    operand_method->DeclaringType->IsValueType &&
-                    type_get_stack_type(operand_method->DeclaringType) != STACK_TYPE_VALUE_TYPE
-                ) {
-                    MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_insn(mir_ctx, jit_number_inscode(operand_method->DeclaringType),
-                                                 MIR_new_reg_op(mir_ctx, number_reg),
-                                                 MIR_new_mem_op(mir_ctx, get_mir_type(operand_method->DeclaringType), 0, this_reg, 0, 1)));
-                }
-            } break;
+    // handle the return value
+    if (method->ReturnType != NULL) {
+        CHECK_AND_RETHROW(jit_prepare_type(ctx, method->ReturnType));
 
-            case CEE_INITOBJ: {
-                System_Type dest_type;
-                MIR_reg_t dest_reg;
-                CHECK_AND_RETHROW(stack_pop(ctx, &dest_type, &dest_reg, NULL));
+        res_type[1] = get_mir_type(method->ReturnType);
+        if (res_type[1] == MIR_T_BLK) {
+            // value type return
+            MIR_var_t var = {
+                .name = "return_block",
+                .type = MIR_T_P, // TODO: do we want to use rblk along size a normal return value
+                .size = method->ReturnType->StackSize
+            };
+            arrpush(vars, var);
+        } else {
+            // we can use normal return
+            nres = 2;
+        }
+    }
 
-                CHECK(dest_type->IsByRef);
-                CHECK(type_is_verifier_assignable_to(operand_type, dest_type->BaseType));
+    // the this is always going to be boxed
+    MIR_var_t var = {
+        .name = "this",
+        .type = MIR_T_P,
+    };
+    arrpush(vars, var);
 
-                jit_emit_zerofill(ctx, dest_reg, operand_type->StackSize);
-            } break;
+    for (int i = 0; i < method->Parameters->Length; i++) {
+        CHECK_AND_RETHROW(jit_prepare_type(ctx, method->Parameters->Data[i]->ParameterType));
 
-            case CEE_RET: {
-                System_Type method_ret_type = type_get_underlying_type(method->ReturnType);
+        char name[64];
+        snprintf(name, sizeof(name), "arg%d", i);
+        MIR_var_t var = {
+            .name = _MIR_uniq_string(ctx->ctx, name),
+            .type = get_mir_type(method->Parameters->Data[i]->ParameterType),
+        };
+        if (var.type == MIR_T_BLK) {
+            var.size = method->Parameters->Data[i]->ParameterType->StackSize;
+        }
+        arrpush(vars, var);
+    }
 
-                if (method_ret_type == NULL) {
-                    // must be an empty stack, since we have no return value
-                    CHECK(arrlen(ctx->stack.entries) == 0);
+    method->MirUnboxerFunc = MIR_new_func_arr(ctx->ctx, strbuilder_get(&func_name), nres, res_type, arrlen(vars), vars);
 
-                    // there is no return value, just add a ret
-                    MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_ret_insn(mir_ctx, 1,
-                                                     MIR_new_int_op(mir_ctx, 0)));
-                } else {
-                    // pop the return from the stack
-                    MIR_reg_t ret_arg;
-                    System_Type ret_type;
-                    CHECK_AND_RETHROW(stack_pop(ctx, &ret_type, &ret_arg, NULL));
+    // push the prototype and the address
+    arrpush(ops, MIR_new_ref_op(ctx->ctx, method->MirProto));
+    arrpush(ops, MIR_new_ref_op(ctx->ctx, method->MirFunc));
 
-                    // verify the stack is empty
-                    CHECK(arrlen(ctx->stack.entries) == 0);
+    // the exception return register
+    MIR_reg_t exception_reg = MIR_new_func_reg(ctx->ctx, method->MirUnboxerFunc->u.func, MIR_T_I64, "exception");
+    arrpush(ops, MIR_new_reg_op(ctx->ctx, exception_reg));
 
-                    // verify the IL
-                    CHECK(type_is_verifier_assignable_to(ret_type, method->ReturnType));
+    // the return value
+    MIR_reg_t return_reg = 0;
+    if (method->ReturnType != NULL) {
+        if (res_type[1] == MIR_T_BLK) {
+            // uses an implicit pointer, get it
+            MIR_reg_t return_block = MIR_reg(ctx->ctx, "return_block", method->MirUnboxerFunc->u.func);
+            arrpush(ops, MIR_new_reg_op(ctx->ctx, return_block));
+        } else {
+            // uses another thing, get it
+            return_reg = MIR_new_func_reg(ctx->ctx, method->MirUnboxerFunc->u.func, MIR_T_I64, "return");
+            arrpush(ops, MIR_new_reg_op(ctx->ctx, return_reg));
+        }
+    }
 
-                    switch (type_get_stack_type(ret_type)) {
-                        case STACK_TYPE_O: {
-                            if (type_is_interface(method_ret_type)) {
-                                if (type_is_interface(ret_type)) {
-                                    // interface -> interface
-                                    goto ret_value_type;
-                                } else {
-                                    // object -> interface
-                                    CHECK_AND_RETHROW(jit_cast_obj_to_interface(ctx,
-                                                                                return_block_reg, ret_arg,
-                                                                                ret_type, method_ret_type));
+    // the this argument, increment after the object header to unbox it
+    MIR_reg_t this_reg = MIR_reg(ctx->ctx, "this", method->MirUnboxerFunc->u.func);
+    MIR_append_insn(ctx->ctx, method->MirUnboxerFunc,
+                    MIR_new_insn(ctx->ctx, MIR_ADD,
+                                 MIR_new_reg_op(ctx->ctx, this_reg),
+                                 MIR_new_reg_op(ctx->ctx, this_reg),
+                                 MIR_new_int_op(ctx->ctx, sizeof(struct System_Object))));
+    arrpush(ops, MIR_new_reg_op(ctx->ctx, this_reg));
 
-                                    // return no exception
-                                    MIR_append_insn(mir_ctx, mir_func,
-                                                    MIR_new_ret_insn(mir_ctx, 1,
-                                                                     MIR_new_int_op(mir_ctx, 0)));
-                                }
-                            } else {
-                                if (type_is_interface(ret_type)) {
-                                    // interface -> object
-                                    MIR_append_insn(mir_ctx, mir_func,
-                                                    MIR_new_ret_insn(mir_ctx, 2,
-                                                                     MIR_new_int_op(mir_ctx, 0),
-                                                                     MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*), ret_arg, 0, 1)));
-                                } else {
-                                    // object -> object
-                                    goto ret_primitive_type;
+    // parameters
+    for (int i = 0; i < method->Parameters->Length; i++) {
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "arg%d", i);
+        MIR_reg_t arg_reg = MIR_reg(ctx->ctx, buffer, method->MirUnboxerFunc->u.func);
+        System_Type parameter_type = method->Parameters->Data[i]->ParameterType;
+        if (type_get_stack_type(parameter_type) == STACK_TYPE_VALUE_TYPE || type_is_interface(parameter_type)) {
+            // pass struct by-value
+            arrpush(ops, MIR_new_mem_op(ctx->ctx, MIR_T_BLK, method->Parameters->Data[i]->ParameterType->StackSize, arg_reg, 0, 1));
+        } else {
+            // pass as a register
+            arrpush(ops, MIR_new_reg_op(ctx->ctx, arg_reg));
+        }
+    }
+
+    // actually call the real method now that we have unboxed the this parameter
+    MIR_append_insn(ctx->ctx, method->MirUnboxerFunc,
+                    MIR_new_insn_arr(ctx->ctx, MIR_CALL, arrlen(ops), ops));
+
+    // return the exception and value
+    MIR_append_insn(ctx->ctx, method->MirUnboxerFunc,
+                    MIR_new_ret_insn(ctx->ctx, nres,
+                                     MIR_new_reg_op(ctx->ctx, exception_reg),
+                                     MIR_new_reg_op(ctx->ctx, return_reg)));
 
-                                }
-                            }
-                        } break;
+    MIR_finish_func(ctx->ctx);
 
-                        ret_primitive_type:
-                        case STACK_TYPE_INT32:
-                        case STACK_TYPE_INT64:
-                        case STACK_TYPE_INTPTR:
-                        case STACK_TYPE_FLOAT: {
-                            // TODO: do we need to do float conversion in this case?
+cleanup:
+    strbuilder_free(&func_name);
+    arrfree(vars);
+    arrfree(ops);
 
-                            // it is stored in a register directly, just return it
-                            MIR_append_insn(mir_ctx, mir_func,
-                                            MIR_new_ret_insn(mir_ctx, 2,
-                                                             MIR_new_int_op(mir_ctx, 0),
-                                                             MIR_new_reg_op(mir_ctx, ret_arg)));
-                        } break;
+    return err;
+}
 
-                        ret_value_type:
-                        case STACK_TYPE_VALUE_TYPE: {
-                            // this is a big struct, copy it to the return block
-                            jit_emit_memcpy(ctx, return_block_reg, ret_arg, ret_type->StackSize);
+/**
+ * Mutex guarding so there won't be multiple jitting at the same time
+ */
+static mutex_t m_jit_mutex = INIT_MUTEX();
 
-                            // return no exception
-                            MIR_append_insn(mir_ctx, mir_func,
-                                            MIR_new_ret_insn(mir_ctx, 1,
-                                                             MIR_new_int_op(mir_ctx, 0)));
-                        } break;
+/**
+ * For generating mir module names
+ */
+static int m_mir_module_gen = 0;
 
-                        case STACK_TYPE_REF:
-                            stack_entry_t entry = ctx->stack.entries[arrlen(ctx->stack.entries)];
+MIR_context_t jit_get_mir_context() {
+    mutex_lock(&m_jit_mutex);
+    return m_mir_context;
+}
 
-                            // make sure that the return value is a non-local reference
-                            CHECK(entry.non_local_ref);
+void jit_release_mir_context() {
+    mutex_unlock(&m_jit_mutex);
+}
 
-                            // TODO: methods that do allow to return readonly refs
-                            // make sure that the return value is a non-readonly reference
-                            CHECK(!entry.readonly_ref);
+//----------------------------------------------------------------------------------------------------------------------
+// Profiler support
+//----------------------------------------------------------------------------------------------------------------------
 
-                            // it is, then return it like we return any other primitive
-                            goto ret_primitive_type;
-                    }
-                }
-            } break;
+/*
+ * The generated code is written to /tmp/perf-<pid>.map, which perf and other sampling profilers
+ * read to symbolize jitted code. The func names are already the full names of the methods.
+ *
+ * MIR does not tell us the size of the code it generates, but it places the code of functions one
+ * after the other, so the size of a function is taken as the distance to the next function. The
+ * function with the highest address is held back until more code is generated, and is written with
+ * a default size if it does not end up being followed by anything close.
+ */
 
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            // Array handling
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// the size we write when we can't figure the real one
+#define JIT_PERF_MAP_DEFAULT_SIZE   256
 
-            case CEE_NEWARR: {
-                // get the number of elements
-                MIR_reg_t num_elems_reg;
-                System_Type num_elems_type;
-                CHECK_AND_RETHROW(stack_pop(ctx, &num_elems_type, &num_elems_reg, NULL));
+// the largest gap we still consider to be a single function
+#define JIT_PERF_MAP_MAX_SIZE       (64 * 1024)
 
-                // make sure it has a valid type
-                CHECK(num_elems_type == tSystem_Int32);
+typedef struct jit_perf_map_entry {
+    uintptr_t addr;
+    const char* name;
+} jit_perf_map_entry_t;
 
-                // push the array type
-                MIR_reg_t array_reg;
-                CHECK_AND_RETHROW(stack_push(ctx, get_array_type(operand_type), &array_reg));
+static bool m_jit_perf_map_enabled = false;
 
-                // calculate the size we are going to need:
-                //  num_elems * sizeof(value_type) + sizeof(System.Array)
-                MIR_reg_t size_reg = new_temp_reg(ctx, tSystem_Int64);
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_MUL,
-                                             MIR_new_reg_op(mir_ctx, size_reg),
-                                             MIR_new_reg_op(mir_ctx, num_elems_reg),
-                                             MIR_new_int_op(mir_ctx, operand_type->StackSize)));
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_ADD,
-                                             MIR_new_reg_op(mir_ctx, size_reg),
-                                             MIR_new_reg_op(mir_ctx, size_reg),
-                                             MIR_new_int_op(mir_ctx, tSystem_Array->ManagedSize)));
+/**
+ * All the generated code sorted by address, used to symbolize the samples of the builtin
+ * profiler, it has its own lock since lookups come from outside of the jit
+ */
+static spinlock_t m_jit_code_map_lock;
+static jit_perf_map_entry_t* m_jit_code_map = NULL;
 
-                // actually allocate it now
-                // allocate the new object
-                CHECK_AND_RETHROW(jit_new(ctx,
-                                          array_reg, get_array_type(operand_type),
-                                          MIR_new_reg_op(mir_ctx, size_reg)));
+static FILE* m_jit_perf_map = NULL;
 
-                // Set the length of the array
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                             MIR_new_mem_op(mir_ctx,
-                                                            MIR_T_I32,
-                                                            offsetof(struct System_Array, Length),
-                                                            array_reg,
-                                                            0, 1),
-                                             MIR_new_reg_op(mir_ctx, num_elems_reg)));
-            } break;
+/**
+ * The functions that were not written yet, protected by the jit mutex
+ */
+static jit_perf_map_entry_t* m_jit_perf_map_pending = NULL;
 
-            case CEE_LDLEN: {
-                // get the number of elements
-                MIR_reg_t array_reg;
-                System_Type array_type;
-                CHECK_AND_RETHROW(stack_pop(ctx, &array_type, &array_reg, NULL));
+void jit_set_perf_map(bool enabled) {
+    m_jit_perf_map_enabled = enabled;
+}
 
-                // this must be an array
-                CHECK(array_type->IsArray);
+static int jit_perf_map_compare(const void* a, const void* b) {
+    const jit_perf_map_entry_t* ea = a;
+    const jit_perf_map_entry_t* eb = b;
+    return ea->addr < eb->addr ? -1 : ea->addr > eb->addr;
+}
 
-                // check the object is not null
-                CHECK_AND_RETHROW(jit_null_check(ctx, array_reg, array_type));
+/**
+ * Write the pending functions, all but the last one unless requested
+ */
+static void jit_perf_map_flush(bool all) {
+    int count = arrlen(m_jit_perf_map_pending);
+    if (m_jit_perf_map == NULL || count == 0) {
+        return;
+    }
 
-                // push the length
-                MIR_reg_t length_reg;
-                CHECK_AND_RETHROW(stack_push(ctx, tSystem_IntPtr, &length_reg));
+    qsort(m_jit_perf_map_pending, count, sizeof(jit_perf_map_entry_t), jit_perf_map_compare);
 
-                // simply read the array's length
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                             MIR_new_reg_op(mir_ctx, length_reg),
-                                             MIR_new_mem_op(mir_ctx, MIR_T_I32,
-                                                            offsetof(struct System_Array, Length),
-                                                            array_reg, 0, 1)));
-            } break;
+    int write_count = all ? count : count - 1;
+    for (int i = 0; i < write_count; i++) {
+        jit_perf_map_entry_t* entry = &m_jit_perf_map_pending[i];
 
-            case CEE_STELEM_I1: operand_type = tSystem_SByte; goto cee_stelem;
-            case CEE_STELEM_I2: operand_type = tSystem_Int16; goto cee_stelem;
-            case CEE_STELEM_I4: operand_type = tSystem_Int32; goto cee_stelem;
-            case CEE_STELEM_I8: operand_type = tSystem_Int64; goto cee_stelem;
-            case CEE_STELEM_R4: operand_type = tSystem_Single; goto cee_stelem;
-            case CEE_STELEM_R8: operand_type = tSystem_Double; goto cee_stelem;
-            case CEE_STELEM_I: operand_type = tSystem_IntPtr; goto cee_stelem;
-            case CEE_STELEM_REF:
-            case CEE_STELEM:
-            cee_stelem: {
-                // pop all the values from the stack
-                MIR_reg_t value_reg;
-                MIR_reg_t index_reg;
-                MIR_reg_t array_reg;
-                System_Type value_type;
-                System_Type index_type;
-                System_Type array_type;
-                CHECK_AND_RETHROW(stack_pop(ctx, &value_type, &value_reg, NULL));
-                CHECK_AND_RETHROW(stack_pop(ctx, &index_type, &index_reg, NULL));
-                CHECK_AND_RETHROW(stack_pop(ctx, &array_type, &array_reg, NULL));
+        size_t size = JIT_PERF_MAP_DEFAULT_SIZE;
+        if (i + 1 < count && m_jit_perf_map_pending[i + 1].addr - entry->addr <= JIT_PERF_MAP_MAX_SIZE) {
+            size = m_jit_perf_map_pending[i + 1].addr - entry->addr;
+        }
 
-                // this must be an array
-                CHECK(array_type->IsArray);
+        fprintf(m_jit_perf_map, "%lx %zx %s\n", entry->addr, size, entry->name);
+    }
 
-                // for stelem.ref the operand type is the same as the
-                // array itself
-                if (operand_type == NULL) {
-                    operand_type = array_type->ElementType;
-                }
+    arrdeln(m_jit_perf_map_pending, 0, write_count);
+    fflush(m_jit_perf_map);
+}
 
-                // validate all the type stuff
-                CHECK(type_is_array_element_compatible_with(value_type, type_get_intermediate_type(operand_type)));
-                CHECK(type_is_array_element_compatible_with(operand_type, array_type->ElementType));
+static void jit_perf_map_close() {
+    jit_perf_map_flush(true);
+    fclose(m_jit_perf_map);
+    m_jit_perf_map = NULL;
+}
 
-                // only int32 and intptr are allowed
-                if (type_get_stack_type(index_type) == STACK_TYPE_INT32) {
-                    // sign extend to int64
-                    MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_insn(mir_ctx, MIR_EXT32,
-                                                 MIR_new_reg_op(mir_ctx, index_reg),
-                                                 MIR_new_reg_op(mir_ctx, index_reg)));
-                } else {
-                    CHECK(type_get_stack_type(index_type) == STACK_TYPE_INTPTR);
-                }
+/**
+ * Find the first entry of the code map which starts after the given address
+ */
+static int jit_code_map_upper_bound(uintptr_t addr) {
+    int low = 0;
+    int high = arrlen(m_jit_code_map);
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (m_jit_code_map[mid].addr <= addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
 
-                // check the object is not null
-                CHECK_AND_RETHROW(jit_null_check(ctx, array_reg, array_type));
+const char* jit_get_code_name(uintptr_t pc) {
+    const char* name = NULL;
 
-                // check the array indexes
-                CHECK_AND_RETHROW(jit_oob_check(ctx, array_reg, index_reg));
+    spinlock_lock(&m_jit_code_map_lock);
 
-                switch (type_get_stack_type(value_type)) {
-                    case STACK_TYPE_O: {
-                        if (type_is_interface(operand_type)) {
-                            if (type_is_interface(value_type)) {
-                                // interface -> interface
-                                goto stelem_value_type;
-                            } else {
-                                // object -> interface
+    int index = jit_code_map_upper_bound(pc) - 1;
+    if (index >= 0) {
+        jit_perf_map_entry_t* entry = &m_jit_code_map[index];
+        uintptr_t end = entry->addr + JIT_PERF_MAP_MAX_SIZE;
+        if (index + 1 < arrlen(m_jit_code_map) && m_jit_code_map[index + 1].addr < end) {
+            end = m_jit_code_map[index + 1].addr;
+        }
+        if (pc < end) {
+            name = entry->name;
+        }
+    }
 
-                                // calculate the offset as `index_reg * sizeof(operand_type) + sizeof(System.Array)`
-                                MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_insn(mir_ctx, MIR_MUL,
-                                                             MIR_new_reg_op(mir_ctx, index_reg),
-                                                             MIR_new_reg_op(mir_ctx, index_reg),
-                                                             MIR_new_int_op(mir_ctx, operand_type->StackSize)));
-                                MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_insn(mir_ctx, MIR_ADD,
-                                                             MIR_new_reg_op(mir_ctx, index_reg),
-                                                             MIR_new_reg_op(mir_ctx, index_reg),
-                                                             MIR_new_int_op(mir_ctx, tSystem_Array->ManagedSize)));
+    spinlock_unlock(&m_jit_code_map_lock);
 
+    return name;
+}
 
-                                // from an object, cast required, need a write barrier
-                                CHECK_AND_RETHROW(jit_cast_obj_to_interface(ctx,
-                                                                            index_reg, value_reg,
-                                                                            value_type, operand_type));
-                            }
-                        } else {
-                            // check if we need to cast to an object from an interface
-                            if (type_is_interface(value_type)) {
-                                MIR_append_insn(mir_ctx, mir_func,
-                                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                                             MIR_new_reg_op(mir_ctx, value_reg),
-                                                             MIR_new_mem_op(mir_ctx, MIR_T_P, sizeof(void*), value_reg, 0, 1)));
-                            }
+/**
+ * Remember the code of a function that was just generated, called with the jit mutex held
+ */
+static void jit_perf_map_add(MIR_item_t func) {
+    if (func->item_type != MIR_func_item || func->u.func->machine_code == NULL) {
+        return;
+    }
 
-                            // calculate the offset as `index_reg * sizeof(operand_type) + sizeof(System.Array)`
-                            MIR_append_insn(mir_ctx, mir_func,
-                                            MIR_new_insn(mir_ctx, MIR_MUL,
-                                                         MIR_new_reg_op(mir_ctx, index_reg),
-                                                         MIR_new_reg_op(mir_ctx, index_reg),
-                                                         MIR_new_int_op(mir_ctx, operand_type->StackSize)));
-                            MIR_append_insn(mir_ctx, mir_func,
-                                            MIR_new_insn(mir_ctx, MIR_ADD,
-                                                         MIR_new_reg_op(mir_ctx, index_reg),
-                                                         MIR_new_reg_op(mir_ctx, index_reg),
-                                                         MIR_new_int_op(mir_ctx, tSystem_Array->ManagedSize)));
+    jit_perf_map_entry_t code = {
+        .addr = (uintptr_t)func->u.func->machine_code,
+        .name = func->u.func->name,
+    };
 
-                            // storing to an object from an object
-                            MIR_append_insn(mir_ctx, mir_func,
-                                            MIR_new_call_insn(mir_ctx, 5,
-                                                              MIR_new_ref_op(mir_ctx, m_gc_update_proto),
-                                                              MIR_new_ref_op(mir_ctx, m_gc_update_func),
-                                                              MIR_new_reg_op(mir_ctx, array_reg),
-                                                              MIR_new_reg_op(mir_ctx, index_reg),
-                                                              MIR_new_reg_op(mir_ctx, value_reg)));
-                        }
-                    } break;
+    // the code map is always kept, so the profiler can be turned on at any point
+    spinlock_lock(&m_jit_code_map_lock);
+    arrins(m_jit_code_map, jit_code_map_upper_bound(code.addr), code);
+    spinlock_unlock(&m_jit_code_map_lock);
 
-                    case STACK_TYPE_INT32:
-                    case STACK_TYPE_INT64:
-                    case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_FLOAT: {
-                        MIR_insn_code_t code = jit_number_cast_inscode(value_type, operand_type);
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, code,
-                                                     MIR_new_mem_op(mir_ctx, get_mir_type(operand_type),
-                                                                    tSystem_Array->ManagedSize,
-                                                                    array_reg, index_reg, operand_type->StackSize),
-                                                     MIR_new_reg_op(mir_ctx, value_reg)));
-                    } break;
+    if (!m_jit_perf_map_enabled) {
+        return;
+    }
+
+    if (m_jit_perf_map == NULL) {
+        char path[64];
+        snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+        m_jit_perf_map = fopen(path, "w");
+        if (m_jit_perf_map == NULL) {
+            WARN("jit: failed to open %s, not writing the perf map", path);
+            m_jit_perf_map_enabled = false;
+            return;
+        }
+        atexit(jit_perf_map_close);
+    }
+
+    arrpush(m_jit_perf_map_pending, code);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Tiered compilation
+//----------------------------------------------------------------------------------------------------------------------
 
-                    stelem_value_type:
-                    case STACK_TYPE_VALUE_TYPE: {
-                        // calculate the offset as `array + index_reg * sizeof(operand_type) + sizeof(System.Array)`
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_MUL,
-                                                     MIR_new_reg_op(mir_ctx, index_reg),
-                                                     MIR_new_reg_op(mir_ctx, index_reg),
-                                                     MIR_new_int_op(mir_ctx, operand_type->StackSize)));
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_ADD,
-                                                     MIR_new_reg_op(mir_ctx, index_reg),
-                                                     MIR_new_reg_op(mir_ctx, index_reg),
-                                                     MIR_new_int_op(mir_ctx, tSystem_Array->ManagedSize)));
+/*
+ * Methods are first generated with a cheap optimization level. Once a method was called
+ * enough times it is queued to a background thread which removes the call counter and
+ * generates it again fully optimized. Everything calls the method through its thunk, so
+ * redirecting the thunk switches all the callers at once, the old code is never freed
+ * since another thread may still be running it.
+ *
+ * Virtual call sites in tier-0 code also remember the vtables they were called with, a
+ * site that only ever saw one is turned into a guarded direct call which MIR can inline.
+ */
 
-                        if (arrlen(value_type->ManagedPointersOffsets) == 0) {
-                            // add the base, so we have an abs address
-                            MIR_append_insn(mir_ctx, mir_func,
-                                            MIR_new_insn(mir_ctx, MIR_ADD,
-                                                         MIR_new_reg_op(mir_ctx, array_reg),
-                                                         MIR_new_reg_op(mir_ctx, index_reg),
-                                                         MIR_new_reg_op(mir_ctx, array_reg)));
+static spinlock_t m_jit_tier_lock;
+static jit_tier_t* m_jit_tier_queue = NULL;
 
-                            // can use a simple memcpy
-                            jit_emit_memcpy(ctx, array_reg, value_reg, operand_type->StackSize);
-                        } else {
-                            // has pointers, use managed memcpy
-                            MIR_append_insn(mir_ctx, mir_func,
-                                            MIR_new_call_insn(mir_ctx, 6,
-                                                              MIR_new_ref_op(mir_ctx, m_managed_memcpy_proto),
-                                                              MIR_new_ref_op(mir_ctx, m_managed_memcpy_func),
-                                                              MIR_new_reg_op(mir_ctx, array_reg),
-                                                              MIR_new_ref_op(mir_ctx, operand_type->MirType),
-                                                              MIR_new_reg_op(mir_ctx, index_reg),
-                                                              MIR_new_reg_op(mir_ctx, value_reg)));
-                        }
-                    } break;
+/**
+ * Maps the entries of all the vtables back to their functions, so a profiled
+ * call site can be turned into a direct call, guarded by the jit lock
+ */
+static struct {
+    void* key;
+    MIR_item_t value;
+}* m_jit_vtable_targets = NULL;
 
-                    case STACK_TYPE_REF:
-                        CHECK_FAIL("wtf");
-                }
-            } break;
+/**
+ * Turn a call site that only ever saw a single vtable into a direct call guarded by a
+ * vtable check, any other vtable still goes through the indirect call
+ */
+static void jit_guard_call_site(MIR_item_t func, jit_call_site_t* site) {
+    void** vtable = site->vtable;
+    if (vtable == NULL || vtable == JIT_CALL_SITE_MEGAMORPHIC) {
+        return;
+    }
 
-            case CEE_LDELEM_I1: operand_type = tSystem_SByte; goto cee_ldelem;
-            case CEE_LDELEM_I2: operand_type = tSystem_Int16; goto cee_ldelem;
-            case CEE_LDELEM_I4: operand_type = tSystem_Int32; goto cee_ldelem;
-            case CEE_LDELEM_I8: operand_type = tSystem_Int64; goto cee_ldelem;
-            case CEE_LDELEM_U1: operand_type = tSystem_Byte; goto cee_ldelem;
-            case CEE_LDELEM_U2: operand_type = tSystem_UInt16; goto cee_ldelem;
-            case CEE_LDELEM_U4: operand_type = tSystem_UInt32; goto cee_ldelem;
-            case CEE_LDELEM_R4: operand_type = tSystem_Single; goto cee_ldelem;
-            case CEE_LDELEM_R8: operand_type = tSystem_Double; goto cee_ldelem;
-            case CEE_LDELEM_I: operand_type = tSystem_IntPtr; goto cee_ldelem;
-            case CEE_LDELEM_REF:    // implicit from array type
-            case CEE_LDELEM:        // operand type is loaded
-            cee_ldelem: {
-                // pop all the values from the stack
-                MIR_reg_t index_reg;
-                MIR_reg_t array_reg;
-                System_Type index_type;
-                System_Type array_type;
-                CHECK_AND_RETHROW(stack_pop(ctx, &index_type, &index_reg, NULL));
-                CHECK_AND_RETHROW(stack_pop(ctx, &array_type, &array_reg, NULL));
+    int index = hmgeti(m_jit_vtable_targets, vtable[site->vtable_index]);
+    if (index < 0) {
+        return;
+    }
+    MIR_item_t target = m_jit_vtable_targets[index].value;
+
+    MIR_label_t indirect = MIR_new_label(m_mir_context);
+    MIR_label_t done = MIR_new_label(m_mir_context);
+
+    // the call is copied as is, only the target is different
+    MIR_insn_t direct = MIR_copy_insn(m_mir_context, site->call);
+    direct->ops[1] = MIR_new_ref_op(m_mir_context, target);
+
+    MIR_insert_insn_before(m_mir_context, func, site->target_load,
+                           MIR_new_insn(m_mir_context, MIR_BNE,
+                                        MIR_new_label_op(m_mir_context, indirect),
+                                        MIR_new_reg_op(m_mir_context, site->vtable_reg),
+                                        MIR_new_uint_op(m_mir_context, (uintptr_t)vtable)));
+    MIR_insert_insn_before(m_mir_context, func, site->target_load, direct);
+    MIR_insert_insn_before(m_mir_context, func, site->target_load,
+                           MIR_new_insn(m_mir_context, MIR_JMP,
+                                        MIR_new_label_op(m_mir_context, done)));
+    MIR_insert_insn_before(m_mir_context, func, site->target_load, indirect);
+    MIR_insert_insn_after(m_mir_context, func, site->call, done);
+}
 
-                // this must be an array
-                CHECK(array_type->IsArray);
+/**
+ * A token for every queued method
+ */
+static waitable_t* m_jit_tier_work = NULL;
 
-                // for anything which is not ldelem.ref we know the operand_type
-                // from the array
-                if (operand_type != NULL) {
-                    CHECK(type_is_array_element_compatible_with(array_type->ElementType, operand_type));
-                } else {
-                    // the type is gotten from the array
-                    operand_type = array_type->ElementType;
-                }
+static void jit_tier_up_thread(void* arg) {
+    while (waitable_wait(m_jit_tier_work, true) == WAITABLE_SUCCESS) {
+        spinlock_lock(&m_jit_tier_lock);
+        jit_tier_t* tier = m_jit_tier_queue;
+        m_jit_tier_queue = tier->next;
+        spinlock_unlock(&m_jit_tier_lock);
 
-                // only int32 and intptr are allowed
-                if (type_get_stack_type(index_type) == STACK_TYPE_INT32) {
-                    // sign extend to int64
-                    MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_insn(mir_ctx, MIR_EXT32,
-                                                 MIR_new_reg_op(mir_ctx, index_reg),
-                                                 MIR_new_reg_op(mir_ctx, index_reg)));
-                } else {
-                    CHECK(type_get_stack_type(index_type) == STACK_TYPE_INTPTR);
-                }
+        MIR_item_t func = tier->method->MirFunc;
 
-                // check the object is not null
-                CHECK_AND_RETHROW(jit_null_check(ctx, array_reg, array_type));
+        mutex_lock(&m_jit_mutex);
 
-                // check the array indexes
-                CHECK_AND_RETHROW(jit_oob_check(ctx, array_reg, index_reg));
+        for (int i = 0; i < ARRAY_LEN(tier->insns); i++) {
+            MIR_remove_insn(m_mir_context, func, tier->insns[i]);
+        }
 
-                // push to the stack
-                MIR_reg_t value_reg;
-                CHECK_AND_RETHROW(stack_push(ctx, type_get_intermediate_type(operand_type), &value_reg));
+        // replace the profiling with the guesses it led to
+        for (int i = 0; i < arrlen(tier->sites); i++) {
+            jit_call_site_t* site = tier->sites[i];
+            for (int j = 0; j < ARRAY_LEN(site->insns); j++) {
+                MIR_remove_insn(m_mir_context, func, site->insns[j]);
+            }
+            jit_guard_call_site(func, site);
+        }
 
-                switch (type_get_stack_type(operand_type)) {
-                    case STACK_TYPE_O: {
-                        if (type_is_interface(operand_type)) {
-                            goto ldelem_value_type;
-                        } else {
-                            goto ldelem_primitive_type;
-                        }
-                    } break;
+        // the cctors that already ran don't need to be checked anymore, failed
+        // ones are not done and keep their guard so every access throws
+        for (int i = 0; i < arrlen(tier->cctor_guards); i++) {
+            jit_cctor_guard_t* guard = &tier->cctor_guards[i];
+            if (!atomic_load(&guard->cctor->done)) {
+                continue;
+            }
 
-                    ldelem_primitive_type:
-                    case STACK_TYPE_INT32:
-                    case STACK_TYPE_INT64:
-                    case STACK_TYPE_INTPTR:
-                    case STACK_TYPE_FLOAT: {
-                        // we need to extend this properly if the field is smaller
-                        // than an int32 (because we are going to load into an int32
-                        // essentially)
-                        MIR_insn_code_t code = MIR_MOV;
-                        if (operand_type == tSystem_SByte || operand_type == tSystem_Boolean) {
-                            code = MIR_EXT8;
-                        } else if (operand_type == tSystem_Byte) {
-                            code = MIR_UEXT8;
-                        } else if (operand_type == tSystem_Int16) {
-                            code = MIR_EXT16;
-                        } else if (operand_type == tSystem_UInt16 || operand_type == tSystem_Char) {
-                            code = MIR_UEXT16;
-                        } else if (operand_type == tSystem_Single) {
-                            code = MIR_FMOV;
-                        } else if (operand_type == tSystem_Single) {
-                            code = MIR_DMOV;
-                        }
+            MIR_insert_insn_before(m_mir_context, func, guard->check[0],
+                                   MIR_new_insn(m_mir_context, MIR_JMP,
+                                                MIR_new_label_op(m_mir_context, guard->done)));
+            for (int j = 0; j < ARRAY_LEN(guard->check); j++) {
+                MIR_remove_insn(m_mir_context, func, guard->check[j]);
+            }
+        }
 
-                        // we can copy this in a single mov
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, code,
-                                                     MIR_new_reg_op(mir_ctx, value_reg),
-                                                     MIR_new_mem_op(mir_ctx, get_mir_type(operand_type),
-                                                                    tSystem_Array->ManagedSize,
-                                                                    array_reg, index_reg, operand_type->StackSize)));
-                    } break;
+        // forget the tier-0 code so the generator won't skip the function,
+        // generating redirects the thunk to the new code
+        func->u.func->machine_code = NULL;
+        TRACE_EVENT(TRACE_CATEGORY_JIT, "jit: tier-up %s", func->u.func->name);
+        MIR_gen_set_optimize_level(m_mir_context, 0, JIT_TIER1_OPTIMIZE_LEVEL);
+        MIR_gen(m_mir_context, 0, func);
+        MIR_gen_set_optimize_level(m_mir_context, 0, JIT_TIER0_OPTIMIZE_LEVEL);
+        TRACE_EVENT(TRACE_CATEGORY_JIT, "jit: tier-up %s done", func->u.func->name);
 
-                    ldelem_value_type:
-                    case STACK_TYPE_VALUE_TYPE: {
-                        // just emit a memcpy
-                        // calculate the offset as `array + index_reg * sizeof(operand_type) + sizeof(System.Array)`
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_MUL,
-                                                     MIR_new_reg_op(mir_ctx, index_reg),
-                                                     MIR_new_reg_op(mir_ctx, index_reg),
-                                                     MIR_new_int_op(mir_ctx, operand_type->StackSize)));
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_ADD,
-                                                     MIR_new_reg_op(mir_ctx, index_reg),
-                                                     MIR_new_reg_op(mir_ctx, index_reg),
-                                                     MIR_new_int_op(mir_ctx, tSystem_Array->ManagedSize)));
-                        MIR_append_insn(mir_ctx, mir_func,
-                                        MIR_new_insn(mir_ctx, MIR_ADD,
-                                                     MIR_new_reg_op(mir_ctx, array_reg),
-                                                     MIR_new_reg_op(mir_ctx, index_reg),
-                                                     MIR_new_reg_op(mir_ctx, array_reg)));
+        jit_perf_map_add(func);
+        jit_perf_map_flush(false);
 
-                        // can use a simple memcpy
-                        jit_emit_memcpy(ctx, value_reg, array_reg, operand_type->StackSize);
-                    } break;
+        mutex_unlock(&m_jit_mutex);
 
-                    case STACK_TYPE_REF:
-                        CHECK_FAIL();
-                }
-            } break;
+        // the records are kept along with the old code, which may still be
+        // running and updating the counter and the profiles
+    }
+}
 
-            case CEE_LDELEMA: {
-                // pop all the values from the stack
-                MIR_reg_t value_reg;
-                MIR_reg_t index_reg;
-                MIR_reg_t array_reg;
-                System_Type index_type;
-                System_Type array_type;
-                CHECK_AND_RETHROW(stack_pop(ctx, &index_type, &index_reg, NULL));
-                CHECK_AND_RETHROW(stack_pop(ctx, &array_type, &array_reg, NULL));
+/**
+ * Called from the tier-0 code once the counter hits zero
+ */
+static void jit_tier_up(jit_tier_t* tier) {
+    spinlock_lock(&m_jit_tier_lock);
+
+    // start the thread on the first promotion
+    if (m_jit_tier_work == NULL) {
+        m_jit_tier_work = create_waitable(INT32_MAX);
+        thread_t* thread = create_thread(jit_tier_up_thread, NULL, "dotnet/tier-up");
+        if (m_jit_tier_work == NULL || thread == NULL) {
+            // can't promote, the method simply stays in tier-0
+            WARN("jit: failed to start the tier-up thread");
+            if (m_jit_tier_work != NULL) {
+                release_waitable(m_jit_tier_work);
+                m_jit_tier_work = NULL;
+            }
+            spinlock_unlock(&m_jit_tier_lock);
+            return;
+        }
+        scheduler_ready_thread(thread);
+    }
 
-                // this must be an array
-                CHECK(array_type->IsArray);
+    tier->next = m_jit_tier_queue;
+    m_jit_tier_queue = tier;
 
-                // for anything which is not ldelem.ref we know the operand_type
-                // from the array
-                CHECK(type_is_array_element_compatible_with(array_type->ElementType, operand_type));
+    spinlock_unlock(&m_jit_tier_lock);
 
-                // only int32 and intptr are allowed
-                if (type_get_stack_type(index_type) == STACK_TYPE_INT32) {
-                    // sign extend to int64
-                    MIR_append_insn(mir_ctx, mir_func,
-                                    MIR_new_insn(mir_ctx, MIR_EXT32,
-                                                 MIR_new_reg_op(mir_ctx, index_reg),
-                                                 MIR_new_reg_op(mir_ctx, index_reg)));
-                } else {
-                    CHECK(type_get_stack_type(index_type) == STACK_TYPE_INTPTR);
-                }
+    waitable_send(m_jit_tier_work, false);
+}
 
-                // check the object is not null
-                CHECK_AND_RETHROW(jit_null_check(ctx, array_reg, array_type));
+//----------------------------------------------------------------------------------------------------------------------
+// Lazy generation
+//----------------------------------------------------------------------------------------------------------------------
 
-                // check the array indexes
-                CHECK_AND_RETHROW(jit_oob_check(ctx, array_reg, index_reg));
+/*
+ * The thunk of every function initially jumps to a wrapper which generates the function
+ * and then continues into it with the original arguments, generating redirects the thunk
+ * so the wrapper only runs on the first calls. The wrapper is the same one MIR uses for its
+ * own lazy interface, but we generate under the jit lock since the main context is shared.
+ */
 
-                // push to the stack
-                CHECK_AND_RETHROW(stack_push(ctx, get_by_ref_type(type_get_intermediate_type(operand_type)), &value_reg));
-                STACK_TOP.non_local_ref = true;
+static void* jit_lazy_generate(MIR_item_t func) {
+    mutex_lock(&m_jit_mutex);
 
-                // calculate the element reference offset
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_MUL,
-                                             MIR_new_reg_op(mir_ctx, value_reg),
-                                             MIR_new_reg_op(mir_ctx, index_reg),
-                                             MIR_new_int_op(mir_ctx, operand_type->StackSize)));
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_ADD,
-                                             MIR_new_reg_op(mir_ctx, value_reg),
-                                             MIR_new_reg_op(mir_ctx, value_reg),
-                                             MIR_new_int_op(mir_ctx, tSystem_Array->ManagedSize)));
+    // someone else might have generated it while we waited
+    if (func->u.func->machine_code == NULL) {
+        TRACE_EVENT(TRACE_CATEGORY_JIT, "jit: lazy generate %s", func->u.func->name);
+        MIR_gen(m_mir_context, 0, func);
+        TRACE_EVENT(TRACE_CATEGORY_JIT, "jit: lazy generate %s done", func->u.func->name);
+        jit_perf_map_add(func);
+        jit_perf_map_flush(false);
+    }
 
-                // add the object base to the offset
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_ADD,
-                                             MIR_new_reg_op(mir_ctx, value_reg),
-                                             MIR_new_reg_op(mir_ctx, value_reg),
-                                             MIR_new_reg_op(mir_ctx, array_reg)));
-            } break;
+    mutex_unlock(&m_jit_mutex);
 
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            // Delegate
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    return func->u.func->machine_code;
+}
 
-            case CEE_LDFTN:
-            case CEE_LDVIRTFTN:
-            {
+static void jit_set_lazy_interface(MIR_context_t ctx, MIR_item_t item) {
+    if (item == NULL || item->item_type != MIR_func_item) {
+        return;
+    }
 
-                if (opcode == CEE_LDVIRTFTN) {
-                    // according to the ECMA spec it should always be
-                    //
-                    //  DUP
-                    //  LDVIRTFTN method
-                    //  NEWOBJ delegate_ctor
-                    //
-                    // the reason is that this makes sure that the method and the type we are
-                    // creating the delegate on are def the same type
-                    //
-                    CHECK(last_opcode == CEE_DUP);
+    _MIR_redirect_thunk(ctx, item->addr, _MIR_get_wrapper(ctx, item, jit_lazy_generate));
+}
 
-                    // pop the object
-                    MIR_reg_t object_reg;
-                    System_Type object_type;
-                    CHECK_AND_RETHROW(stack_pop(ctx, &object_type, &object_reg, NULL));
+//----------------------------------------------------------------------------------------------------------------------
+// Static constructors
+//----------------------------------------------------------------------------------------------------------------------
 
-                    // check that the method matches the object
-                    CHECK(type_is_verifier_assignable_to(object_type, operand_method->DeclaringType));
+/*
+ * Static constructors run lazily, on the first access to a static field of the type, and for
+ * types without beforefieldinit also on the first call to a static method or constructor. Every
+ * such access checks a flag that is set once the constructor ran. The check is left out when the
+ * constructor already ran by the time the access is jitted, and patched out when a tiered method
+ * is regenerated.
+ *
+ * The first thread to get to a type runs its constructor without any of the jit locks, the rest
+ * wait for it to finish. The thread running it sees the type as is if it gets back to it, same
+ * as the runtime does for recursive type initialization. A thread that would wait on a chain of
+ * constructors that ends up waiting on itself sees the type as is as well, instead of deadlocking.
+ *
+ * A constructor that throws leaves the type failed, its checks are never removed and every
+ * access throws the same TypeInitializationException wrapping what the constructor threw.
+ */
 
-                    // resolve it
-                    CHECK(method_is_virtual(operand_method));
-                    operand_method = object_type->VirtualMethods->Data[operand_method->VTableOffset];
-                    CHECK(method_is_final(operand_method));
-                }
+static mutex_t m_jit_cctor_mutex = INIT_MUTEX();
+static conditional_t m_jit_cctor_done = INIT_CONDITIONAL();
+
+/**
+ * The cctor every thread is waiting for, used to find wait
+ * cycles, protected by the cctor mutex
+ */
+static struct {
+    thread_t* key;
+    jit_cctor_t* value;
+}* m_jit_cctor_waits = NULL;
 
-                // push the reference to the function
-                MIR_reg_t ftn_reg;
-                CHECK_AND_RETHROW(stack_push(ctx, tSystem_UIntPtr, &ftn_reg));
-                MIR_append_insn(mir_ctx, mir_func,
-                                MIR_new_insn(mir_ctx, MIR_MOV,
-                                             MIR_new_reg_op(mir_ctx, ftn_reg),
-                                             MIR_new_ref_op(mir_ctx, operand_method->MirFunc)));
+/**
+ * The initialization state of the types, created when the first access to
+ * a type is jitted, protected by the jit mutex
+ */
+static struct {
+    System_Type key;
+    jit_cctor_t* value;
+}* m_jit_cctors = NULL;
+
+static jit_cctor_t* jit_get_cctor(System_Type type) {
+    int index = hmgeti(m_jit_cctors, type);
+    if (index >= 0) {
+        return m_jit_cctors[index].value;
+    }
 
+    jit_cctor_t* cctor = malloc(sizeof(jit_cctor_t));
+    if (cctor == NULL) {
+        return NULL;
+    }
+    cctor->done = false;
+    cctor->running = false;
+    cctor->thread = NULL;
+    cctor->failed = false;
+    cctor->type = type;
+    cctor->exception = NULL;
+
+    hmput(m_jit_cctors, type, cctor);
+    return cctor;
+}
 
-                // save the method that we are pushing
-                ftnMethod = operand_method;
-            } break;
+/**
+ * Check if waiting for the cctor would end up waiting for the current thread, called
+ * with the cctor mutex held
+ */
+static bool jit_cctor_wait_cycles(jit_cctor_t* cctor, thread_t* current) {
+    // every thread waits for at most one cctor, so the chain can't be
+    // longer than the amount of waiting threads
+    for (int i = 0; i <= hmlen(m_jit_cctor_waits); i++) {
+        thread_t* runner = cctor->thread;
+        if (runner == current) {
+            return true;
+        }
 
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-            // Unknown opcode
-            ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+        int index = hmgeti(m_jit_cctor_waits, runner);
+        if (index < 0) {
+            return false;
+        }
+        cctor = m_jit_cctor_waits[index].value;
+    }
+    return false;
+}
 
-            default: {
-                CHECK_FAIL("TODO: opcode %s", opcode_info->name);
-            } break;
+/**
+ * Called from the guards when the cctor did not finish yet, returns the
+ * exception to throw if the cctor failed
+ */
+static System_Exception jit_run_cctor(jit_cctor_t* cctor) {
+    thread_t* current = get_current_thread();
+    System_Exception exception = NULL;
+
+    mutex_lock(&m_jit_cctor_mutex);
+
+    while (!atomic_load(&cctor->done) && !cctor->failed) {
+        if (!cctor->running) {
+            // we are the first, run it
+            cctor->running = true;
+            cctor->thread = current;
+            mutex_unlock(&m_jit_cctor_mutex);
+
+            System_Exception(*func)() = cctor->type->StaticCtor->MirFunc->addr;
+            exception = func();
+
+            // wrap it before taking the lock, creating it runs managed code
+            System_Exception wrapped = NULL;
+            if (exception != NULL) {
+                WARN("Type initializer for %U: `%U`", cctor->type->Name, exception->Message);
+                wrapped = activator_create_exception(tSystem_TypeInitializationException);
+                GC_UPDATE(wrapped, InnerException, exception);
+            }
+
+            mutex_lock(&m_jit_cctor_mutex);
+            if (wrapped != NULL) {
+                cctor->exception = wrapped;
+                gc_add_root(&cctor->exception);
+                cctor->failed = true;
+            } else {
+                atomic_store(&cctor->done, true);
+            }
+            cctor->running = false;
+            cctor->thread = NULL;
+            conditional_broadcast(&m_jit_cctor_done);
+            break;
         }
 
-        // reset the temp registers
-        ctx->itmp.depth = 0;
-        ctx->ftmp.depth = 0;
-        ctx->dtmp.depth = 0;
+        // we got back to it from the cctor itself, or the thread running
+        // it waits for us through other cctors
+        if (jit_cctor_wait_cycles(cctor, current)) {
+            goto cleanup;
+        }
 
-        // store the last opcode
-        last_opcode = opcode;
+        hmput(m_jit_cctor_waits, current, cctor);
+        conditional_wait(&m_jit_cctor_done, &m_jit_cctor_mutex);
+        (void)hmdel(m_jit_cctor_waits, current);
     }
 
-    // make sure that the last instruction is either
-    // a return or a branch or a throw
-    CHECK(
-        last_cf == OPCODE_CONTROL_FLOW_THROW ||
-        last_cf == OPCODE_CONTROL_FLOW_BRANCH ||
-        last_cf == OPCODE_CONTROL_FLOW_RETURN
-    );
-
-#ifdef JIT_TRACE
-    TRACE("}");
-    TRACE();
-#endif
+    exception = cctor->exception;
 
 cleanup:
-    if (IS_ERROR(err)) {
-        MIR_output_item(mir_ctx, stdout, mir_func);
+    mutex_unlock(&m_jit_cctor_mutex);
+    return exception;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Invoke thunks
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * The thunks by their signature key, protected by the jit mutex
+ */
+static struct {
+    char* key;
+    jit_invoke_thunk_t value;
+}* m_jit_invoke_thunks = NULL;
+
+/**
+ * The key of the signature as far as calling goes, which is only the mir types
+ */
+static void jit_invoke_thunk_key(System_Reflection_MethodInfo method, strbuilder_t* key) {
+    strbuilder_char(key, method_is_static(method) ? 's' : 'i');
+
+    if (method->ReturnType != NULL) {
+        strbuilder_char(key, 'r');
+        strbuilder_uint(key, get_mir_type(method->ReturnType));
+        if (get_mir_type(method->ReturnType) == MIR_T_BLK) {
+            strbuilder_char(key, 'b');
+            strbuilder_uint(key, method->ReturnType->StackSize);
+        }
     }
 
-    // free all the memory used for jitting the method
-    SAFE_FREE(switch_ops);
-    strbuilder_free(&method_name);
-    arrfree(locals);
-    for (int i = 0; i < hmlen(ctx->pc_to_stack_snapshot); i++) {
-        arrfree(ctx->pc_to_stack_snapshot[i].stack.entries);
+    for (int i = 0; i < method->Parameters->Length; i++) {
+        System_Type type = method->Parameters->Data[i]->ParameterType;
+        strbuilder_char(key, '_');
+        strbuilder_uint(key, get_mir_type(type));
+        if (get_mir_type(type) == MIR_T_BLK) {
+            strbuilder_char(key, 'b');
+            strbuilder_uint(key, type->StackSize);
+        }
     }
-    arrfree(ctx->stack.entries);
-    arrfree(ctx->ireg.regs);
-    arrfree(ctx->dreg.regs);
-    arrfree(ctx->freg.regs);
-    arrfree(ctx->itmp.regs);
-    arrfree(ctx->dtmp.regs);
-    arrfree(ctx->ftmp.regs);
-    hmfree(ctx->pc_to_stack_snapshot);
-    hmfree(ctx->clause_to_label);
+}
 
-    return err;
+static MIR_reg_t jit_invoke_thunk_reg(MIR_context_t ctx, MIR_item_t func, System_Type type, const char* name) {
+    MIR_type_t reg_type = MIR_T_I64;
+    if (type == tSystem_Single) {
+        reg_type = MIR_T_F;
+    } else if (type == tSystem_Double) {
+        reg_type = MIR_T_D;
+    }
+    return MIR_new_func_reg(ctx, func->u.func, reg_type, name);
 }
 
-//
-// TODO: this can be much cheaper if we just have a
-//
-//  add rdi, sizeof(struct System_Object)
-//  jmp <original method>
-//
-// but idk if we have a good way to do it in MIR
-//
-static err_t jit_generate_unboxer(jit_context_t* ctx, System_Reflection_MethodInfo method) {
+/**
+ * Generate the thunk, it is in the form of
+ *
+ *      exception invoke(func, this, args, result)
+ *
+ * and it loads or unboxes every argument and calls the func with the signature of the method
+ */
+static err_t jit_generate_invoke_thunk(MIR_context_t ctx, System_Reflection_MethodInfo method, const char* key, MIR_item_t* out_func) {
     err_t err = NO_ERROR;
     MIR_var_t* vars = NULL;
     MIR_op_t* ops = NULL;
 
-    // generate the function name
+    strbuilder_t proto_name = strbuilder_new();
+    strbuilder_cstr(&proto_name, "invoke$");
+    strbuilder_cstr(&proto_name, key);
+    strbuilder_cstr(&proto_name, "$proto");
+
     strbuilder_t func_name = strbuilder_new();
-    method_print_full_name(method, &func_name);
-    strbuilder_cstr(&func_name, "$unboxer");
+    strbuilder_cstr(&func_name, "invoke$");
+    strbuilder_cstr(&func_name, key);
 
+    // the signature of the target, same as its own prototype
     size_t nres = 1;
     MIR_type_t res_type[2] = {
         MIR_T_P, // exception
         MIR_T_UNDEF, // return value if any
     };
 
-    // handle the return value
+    bool return_block = false;
     if (method->ReturnType != NULL) {
-        CHECK_AND_RETHROW(jit_prepare_type(ctx, method->ReturnType));
-
         res_type[1] = get_mir_type(method->ReturnType);
         if (res_type[1] == MIR_T_BLK) {
-            // value type return
             MIR_var_t var = {
                 .name = "return_block",
-                .type = MIR_T_P, // TODO: do we want to use rblk along size a normal return value
+                .type = MIR_T_P,
                 .size = method->ReturnType->StackSize
             };
             arrpush(vars, var);
+            return_block = true;
         } else {
-            // we can use normal return
             nres = 2;
         }
     }
 
-    // the this is always going to be boxed
-    MIR_var_t var = {
-        .name = "this",
-        .type = MIR_T_P,
-    };
-    arrpush(vars, var);
+    if (!method_is_static(method)) {
+        MIR_var_t var = {
+            .name = "this",
+            .type = MIR_T_P,
+        };
+        arrpush(vars, var);
+    }
 
     for (int i = 0; i < method->Parameters->Length; i++) {
-        CHECK_AND_RETHROW(jit_prepare_type(ctx, method->Parameters->Data[i]->ParameterType));
+        System_Type type = method->Parameters->Data[i]->ParameterType;
+
+        // can't come out of an object array as is
+        CHECK(!type->IsByRef && !type_is_interface(type));
 
         char name[64];
         snprintf(name, sizeof(name), "arg%d", i);
         MIR_var_t var = {
-            .name = _MIR_uniq_string(ctx->ctx, name),
-            .type = get_mir_type(method->Parameters->Data[i]->ParameterType),
+            .name = _MIR_uniq_string(ctx, name),
+            .type = get_mir_type(type),
         };
         if (var.type == MIR_T_BLK) {
-            var.size = method->Parameters->Data[i]->ParameterType->StackSize;
+            var.size = type->StackSize;
         }
         arrpush(vars, var);
     }
 
-    method->MirUnboxerFunc = MIR_new_func_arr(ctx->ctx, strbuilder_get(&func_name), nres, res_type, arrlen(vars), vars);
-
-    // push the prototype and the address
-    arrpush(ops, MIR_new_ref_op(ctx->ctx, method->MirProto));
-    arrpush(ops, MIR_new_ref_op(ctx->ctx, method->MirFunc));
+    MIR_item_t proto = MIR_new_proto_arr(ctx, strbuilder_get(&proto_name), nres, res_type, arrlen(vars), vars);
 
-    // the exception return register
-    MIR_reg_t exception_reg = MIR_new_func_reg(ctx->ctx, method->MirUnboxerFunc->u.func, MIR_T_I64, "exception");
-    arrpush(ops, MIR_new_reg_op(ctx->ctx, exception_reg));
+    // the thunk itself
+    MIR_type_t thunk_res_type = MIR_T_P;
+    MIR_var_t thunk_vars[] = {
+        { .name = "func", .type = MIR_T_P },
+        { .name = "this", .type = MIR_T_P },
+        { .name = "args", .type = MIR_T_P },
+        { .name = "result", .type = MIR_T_P },
+    };
+    MIR_item_t func = MIR_new_func_arr(ctx, strbuilder_get(&func_name), 1, &thunk_res_type, ARRAY_LEN(thunk_vars), thunk_vars);
+    MIR_reg_t func_reg = MIR_reg(ctx, "func", func->u.func);
+    MIR_reg_t this_reg = MIR_reg(ctx, "this", func->u.func);
+    MIR_reg_t args_reg = MIR_reg(ctx, "args", func->u.func);
+    MIR_reg_t result_reg = MIR_reg(ctx, "result", func->u.func);
 
-    // the return value
+    MIR_reg_t exception_reg = MIR_new_func_reg(ctx, func->u.func, MIR_T_I64, "exception");
     MIR_reg_t return_reg = 0;
-    if (method->ReturnType != NULL) {
-        if (res_type[1] == MIR_T_BLK) {
-            // uses an implicit pointer, get it
-            MIR_reg_t return_block = MIR_reg(ctx->ctx, "return_block", method->MirUnboxerFunc->u.func);
-            arrpush(ops, MIR_new_reg_op(ctx->ctx, return_block));
-        } else {
-            // uses another thing, get it
-            return_reg = MIR_new_func_reg(ctx->ctx, method->MirUnboxerFunc->u.func, MIR_T_I64, "return");
-            arrpush(ops, MIR_new_reg_op(ctx->ctx, return_reg));
-        }
+
+    arrpush(ops, MIR_new_ref_op(ctx, proto));
+    arrpush(ops, MIR_new_reg_op(ctx, func_reg));
+    arrpush(ops, MIR_new_reg_op(ctx, exception_reg));
+    if (nres == 2) {
+        return_reg = jit_invoke_thunk_reg(ctx, func, method->ReturnType, "return");
+        arrpush(ops, MIR_new_reg_op(ctx, return_reg));
+    } else if (return_block) {
+        // written straight to the result
+        arrpush(ops, MIR_new_reg_op(ctx, result_reg));
     }
 
-    // the this argument, increment after the object header to unbox it
-    MIR_reg_t this_reg = MIR_reg(ctx->ctx, "this", method->MirUnboxerFunc->u.func);
-    MIR_append_insn(ctx->ctx, method->MirUnboxerFunc,
-                    MIR_new_insn(ctx->ctx, MIR_ADD,
-                                 MIR_new_reg_op(ctx->ctx, this_reg),
-                                 MIR_new_reg_op(ctx->ctx, this_reg),
-                                 MIR_new_int_op(ctx->ctx, sizeof(struct System_Object))));
-    arrpush(ops, MIR_new_reg_op(ctx->ctx, this_reg));
+    if (!method_is_static(method)) {
+        arrpush(ops, MIR_new_reg_op(ctx, this_reg));
+    }
 
-    // parameters
     for (int i = 0; i < method->Parameters->Length; i++) {
-        char buffer[64];
-        snprintf(buffer, sizeof(buffer), "arg%d", i);
-        MIR_reg_t arg_reg = MIR_reg(ctx->ctx, buffer, method->MirUnboxerFunc->u.func);
-        System_Type parameter_type = method->Parameters->Data[i]->ParameterType;
-        if (type_get_stack_type(parameter_type) == STACK_TYPE_VALUE_TYPE || type_is_interface(parameter_type)) {
-            // pass struct by-value
-            arrpush(ops, MIR_new_mem_op(ctx->ctx, MIR_T_BLK, method->Parameters->Data[i]->ParameterType->StackSize, arg_reg, 0, 1));
-        } else {
-            // pass as a register
-            arrpush(ops, MIR_new_reg_op(ctx->ctx, arg_reg));
+        System_Type type = method->Parameters->Data[i]->ParameterType;
+
+        // the object of the argument
+        char name[64];
+        snprintf(name, sizeof(name), "obj%d", i);
+        MIR_reg_t obj_reg = MIR_new_func_reg(ctx, func->u.func, MIR_T_I64, name);
+        MIR_append_insn(ctx, func,
+                        MIR_new_insn(ctx, MIR_MOV,
+                                     MIR_new_reg_op(ctx, obj_reg),
+                                     MIR_new_mem_op(ctx, MIR_T_P, i * sizeof(System_Object), args_reg, 0, 1)));
+
+        switch (type_get_stack_type(type)) {
+            case STACK_TYPE_O: {
+                // passed as is
+                arrpush(ops, MIR_new_reg_op(ctx, obj_reg));
+            } break;
+
+            case STACK_TYPE_INT32:
+            case STACK_TYPE_INT64:
+            case STACK_TYPE_INTPTR:
+            case STACK_TYPE_FLOAT: {
+                // load the value from the box, the mir type takes care of the extension
+                snprintf(name, sizeof(name), "arg%d", i);
+                MIR_reg_t arg_reg = jit_invoke_thunk_reg(ctx, func, type, name);
+                MIR_append_insn(ctx, func,
+                                MIR_new_insn(ctx, jit_number_inscode(type),
+                                             MIR_new_reg_op(ctx, arg_reg),
+                                             MIR_new_mem_op(ctx, get_mir_type(type), sizeof(struct System_Object), obj_reg, 0, 1)));
+                arrpush(ops, MIR_new_reg_op(ctx, arg_reg));
+            } break;
+
+            case STACK_TYPE_VALUE_TYPE: {
+                // pass the data of the box by value
+                MIR_append_insn(ctx, func,
+                                MIR_new_insn(ctx, MIR_ADD,
+                                             MIR_new_reg_op(ctx, obj_reg),
+                                             MIR_new_reg_op(ctx, obj_reg),
+                                             MIR_new_int_op(ctx, sizeof(struct System_Object))));
+                arrpush(ops, MIR_new_mem_op(ctx, MIR_T_BLK, type->StackSize, obj_reg, 0, 1));
+            } break;
+
+            default:
+                CHECK_FAIL();
         }
     }
 
-    // actually call the real method now that we have unboxed the this parameter
-    MIR_append_insn(ctx->ctx, method->MirUnboxerFunc,
-                    MIR_new_insn_arr(ctx->ctx, MIR_CALL, arrlen(ops), ops));
+    MIR_append_insn(ctx, func, MIR_new_insn_arr(ctx, MIR_CALL, arrlen(ops), ops));
 
-    // return the exception and value
-    MIR_append_insn(ctx->ctx, method->MirUnboxerFunc,
-                    MIR_new_ret_insn(ctx->ctx, nres,
-                                     MIR_new_reg_op(ctx->ctx, exception_reg),
-                                     MIR_new_reg_op(ctx->ctx, return_reg)));
+    if (nres == 2) {
+        MIR_append_insn(ctx, func,
+                        MIR_new_insn(ctx, jit_number_inscode(method->ReturnType),
+                                     MIR_new_mem_op(ctx, get_mir_type(method->ReturnType), 0, result_reg, 0, 1),
+                                     MIR_new_reg_op(ctx, return_reg)));
+    }
 
-    MIR_finish_func(ctx->ctx);
+    MIR_append_insn(ctx, func,
+                    MIR_new_ret_insn(ctx, 1,
+                                     MIR_new_reg_op(ctx, exception_reg)));
+
+    MIR_finish_func(ctx);
+
+    *out_func = func;
 
 cleanup:
+    strbuilder_free(&proto_name);
     strbuilder_free(&func_name);
     arrfree(vars);
     arrfree(ops);
@@ -6311,39 +9253,91 @@ cleanup:
     return err;
 }
 
-/**
- * Mutex guarding so there won't be multiple jitting at the same time
- */
-static mutex_t m_jit_mutex = INIT_MUTEX();
+err_t jit_get_invoke_thunk(System_Reflection_MethodInfo method, jit_invoke_thunk_t* out_thunk) {
+    err_t err = NO_ERROR;
+    MIR_context_t ctx = NULL;
+    bool module_open = false;
 
-/**
- * For generating mir module names
- */
-static int m_mir_module_gen = 0;
+    strbuilder_t key = strbuilder_new();
+    jit_invoke_thunk_key(method, &key);
 
-MIR_context_t jit_get_mir_context() {
     mutex_lock(&m_jit_mutex);
-    return m_mir_context;
-}
 
-void jit_release_mir_context() {
+    if (m_jit_invoke_thunks == NULL) {
+        sh_new_strdup(m_jit_invoke_thunks);
+    }
+
+    int index = shgeti(m_jit_invoke_thunks, strbuilder_get(&key));
+    if (index >= 0) {
+        *out_thunk = m_jit_invoke_thunks[index].value;
+        goto cleanup;
+    }
+
+    // generate it in its own module, same as a type
+    ctx = MIR_init();
+
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "m%d", m_mir_module_gen++);
+    MIR_module_t module = MIR_new_module(ctx, buffer);
+    module_open = true;
+
+    MIR_item_t func = NULL;
+    CHECK_AND_RETHROW(jit_generate_invoke_thunk(ctx, method, strbuilder_get(&key), &func));
+
+    MIR_finish_module(ctx);
+    module_open = false;
+
+    MIR_change_module_ctx(ctx, module, m_mir_context);
+    MIR_load_module(m_mir_context, module);
+    MIR_link(m_mir_context, m_jit_lazy ? jit_set_lazy_interface : MIR_set_parallel_gen_interface, NULL);
+
+    if (!m_jit_lazy) {
+        jit_perf_map_add(func);
+        jit_perf_map_flush(false);
+    }
+
+    *out_thunk = func->addr;
+    shput(m_jit_invoke_thunks, strbuilder_get(&key), *out_thunk);
+
+cleanup:
+    if (ctx != NULL) {
+        if (module_open) {
+            MIR_finish_module(ctx);
+        }
+        MIR_finish(ctx);
+    }
+
     mutex_unlock(&m_jit_mutex);
+
+    strbuilder_free(&key);
+
+    return err;
 }
 
+//----------------------------------------------------------------------------------------------------------------------
+// Type jitting
+//----------------------------------------------------------------------------------------------------------------------
+
 err_t jit_type(System_Type type) {
     err_t err = NO_ERROR;
 
-    // TODO: figure if we can move this lock from here or not
-    mutex_lock(&m_jit_mutex);
-
+    // the context is private to us, so no need to create it under the lock
     jit_context_t ctx = {
         .ctx = MIR_init(),
     };
 
+    // the static roots of all the types of this module
+    void** roots = NULL;
+
+    // guards the type state and the main mir context
+    mutex_lock(&m_jit_mutex);
+
     if (type->MirType != NULL) {
         goto cleanup;
     }
 
+    TRACE_EVENT(TRACE_CATEGORY_JIT, "jit: type %U.%U", type->Namespace, type->Name);
+
     // prepare the module
     char buffer[64];
     snprintf(buffer, sizeof(buffer), "m%d", m_mir_module_gen++);
@@ -6365,15 +9359,30 @@ err_t jit_type(System_Type type) {
 
     // we are done with the module
     MIR_finish_module(ctx.ctx);
+    TRACE_EVENT(TRACE_CATEGORY_JIT, "jit: type %U.%U emitted, linking", type->Namespace, type->Name);
 
-    // move the module to the main context
+    // move the module to the main context, it stays there for good.
+    // assemblies are not collectible:
+    //  - mir can only free a whole context, not a single module or its machine code
+    //  - the loader allocates the assembly metadata as immortal objects
+    //  - the generic instance and type name caches never drop types
     MIR_change_module_ctx(ctx.ctx, module, m_mir_context);
 
     // load the module
     MIR_load_module(m_mir_context, module);
 
-    // link it
-    MIR_link(m_mir_context, MIR_set_lazy_gen_interface, NULL);
+    // link it, either leaving the functions to be generated on their
+    // first call or generating all of them using all the generators
+    MIR_link(m_mir_context, m_jit_lazy ? jit_set_lazy_interface : MIR_set_parallel_gen_interface, NULL);
+    TRACE_EVENT(TRACE_CATEGORY_JIT, "jit: type %U.%U linked", type->Namespace, type->Name);
+
+    // when generated right away, tell the profilers about the code
+    if (!m_jit_lazy) {
+        for (MIR_item_t item = DLIST_HEAD(MIR_item_t, module->items); item != NULL; item = DLIST_NEXT(MIR_item_t, item)) {
+            jit_perf_map_add(item);
+        }
+        jit_perf_map_flush(false);
+    }
 
     // now that everything is linked prepare all the types we have created
     for (int i = 0; i < arrlen(ctx.created_types); i++) {
@@ -6384,12 +9393,14 @@ err_t jit_type(System_Type type) {
             for (int vi = 0; vi < created_type->VirtualMethods->Length; vi++) {
                 // if this has an unboxer use the unboxer instead of the actual method
                 System_Reflection_MethodInfo method = created_type->VirtualMethods->Data[vi];
-                if (method->MirUnboxerFunc != NULL) {
-                    created_type->VTable[vi] = method->MirUnboxerFunc->addr;
-                } else {
-                    created_type->VTable[vi] = method->MirFunc->addr;
-                }
+                MIR_item_t target = method->MirUnboxerFunc ?: method->MirFunc;
+                created_type->VTable[vi] = target->addr;
                 ASSERT(created_type->VTable[vi] != NULL);
+
+                // for turning profiled call sites into direct calls
+                if (m_jit_tiered) {
+                    hmput(m_jit_vtable_targets, target->addr, target);
+                }
             }
         }
 
@@ -6402,12 +9413,12 @@ err_t jit_type(System_Type type) {
 
                 switch (type_get_stack_type(fieldInfo->FieldType)) {
                     case STACK_TYPE_O: {
-                        gc_add_root(fieldInfo->MirField->addr);
+                        arrpush(roots, fieldInfo->MirField->addr);
                     } break;
 
                     case STACK_TYPE_VALUE_TYPE: {
                         for (int j = 0; j < arrlen(fieldInfo->FieldType->ManagedPointersOffsets); j++) {
-                            gc_add_root(fieldInfo->MirField->addr + fieldInfo->FieldType->ManagedPointersOffsets[j]);
+                            arrpush(roots, fieldInfo->MirField->addr + fieldInfo->FieldType->ManagedPointersOffsets[j]);
                         }
                     } break;
 
@@ -6426,18 +9437,9 @@ err_t jit_type(System_Type type) {
         }
     }
 
-    // and finally, we can run all the ctors that should run from this
-    for (int i = arrlen(ctx.created_types) - 1; i >= 0; i--) {
-        System_Type created_type = ctx.created_types[i];
-
-        // call the ctor
-        if (created_type->StaticCtor != NULL) {
-            System_Exception(*cctor)() = created_type->StaticCtor->MirFunc->addr;
-            System_Exception exception = cctor();
-            CHECK(exception == NULL, "Type initializer for %U: `%U`",
-                  created_type->Name, exception->Message);
-        }
-    }
+    // register all the static roots of the module at once, the cctors
+    // run lazily once the types are first used
+    CHECK_AND_RETHROW(gc_add_root_segment(roots, arrlen(roots)));
 
 cleanup:
     if (IS_ERROR(err)) {
@@ -6480,9 +9482,9 @@ cleanup:
     // unlock the mutex
     mutex_unlock(&m_jit_mutex);
 
-
-        // free all the arrays we need
+    // free all the arrays we need
     arrfree(ctx.created_types);
+    arrfree(roots);
 
     return err;
 }
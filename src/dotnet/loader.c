@@ -1,4 +1,4 @@
-
+#define _GNU_SOURCE
 #include "metadata/sig_spec.h"
 #include "metadata/sig.h"
 #include "jit/jit.h"
@@ -15,6 +15,7 @@
 #include "thread/scheduler.h"
 
 #include <stdalign.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -26,7 +27,7 @@ static err_t validate_token(token_t* token, metadata_t* metadata, bool allow_nul
     err_t err = NO_ERROR;
 
     CHECK(token->table <= ARRAY_LEN(metadata->tables));
-    CHECK(metadata->tables[token->table].table != NULL);
+    CHECK(metadata->tables[token->table].data != NULL);
     CHECK(token->index <= metadata->tables[token->table].rows);
 
     if (!allow_null) {
@@ -42,7 +43,9 @@ static err_t validate_metadata_assembly(pe_file_t* ctx, metadata_t* metadata) {
 
     CHECK(metadata->tables[METADATA_ASSEMBLY].rows == 1);
 
-    metadata_assembly_t* assembly = metadata->tables[METADATA_ASSEMBLY].table;
+    metadata_assembly_t* assembly;
+
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_ASSEMBLY, &assembly));
     CHECK(assembly->name[0] != '\0');
 
 cleanup:
@@ -54,7 +57,9 @@ static err_t validate_metadata_module(pe_file_t* ctx, metadata_t* metadata) {
 
     CHECK(metadata->tables[METADATA_MODULE].rows == 1);
 
-    metadata_module_t* module = metadata->tables[METADATA_MODULE].table;
+    metadata_module_t* module;
+
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_MODULE, &module));
     CHECK(module->name[0] != '\0');
 
 cleanup:
@@ -75,11 +80,12 @@ cleanup:
 
 static err_t decode_metadata(pe_file_t* ctx, metadata_t* metadata) {
     err_t err = NO_ERROR;
-    void* metadata_root = NULL;
 
-    // get the metadata
-    metadata_root = pe_get_rva_data(ctx, ctx->cli_header->metadata);
+    // get the metadata, straight from the image
+    pe_directory_t directory = ctx->cli_header->metadata;
+    const void* metadata_root = pe_get_rva_ptr(ctx, &directory);
     CHECK_ERROR(metadata_root != NULL, ERROR_NOT_FOUND);
+    CHECK(ctx->cli_header->metadata.size <= directory.size);
 
     // parse it
     CHECK_AND_RETHROW(metadata_parse(ctx, metadata_root, ctx->cli_header->metadata.size, metadata));
@@ -88,8 +94,6 @@ static err_t decode_metadata(pe_file_t* ctx, metadata_t* metadata) {
     CHECK_AND_RETHROW(validate_metadata(ctx, metadata));
 
 cleanup:
-    // we no longer need this
-    free(metadata_root);
     return err;
 }
 
@@ -100,13 +104,13 @@ cleanup:
 static err_t parse_method_cil(System_Reflection_MethodInfo method, blob_entry_t sig, pe_file_t* file, metadata_t* metadata) {
     err_t err = NO_ERROR;
 
-    System_Reflection_MethodBody body = UNSAFE_GC_NEW(tSystem_Reflection_MethodBody);
-
-    // set it
-    GC_UPDATE(method, MethodBody, body);
+    // created when the type was setup
+    System_Reflection_MethodBody body = method->MethodBody;
+    CHECK(body != NULL);
 
     // get the signature table
-    metadata_stand_alone_sig_t* standalone_sigs = metadata->tables[METADATA_STAND_ALONE_SIG].table;
+    metadata_stand_alone_sig_t* standalone_sigs;
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_STAND_ALONE_SIG, &standalone_sigs));
     int standalone_sigs_count = metadata->tables[METADATA_STAND_ALONE_SIG].rows;
 
     // get the header type
@@ -139,7 +143,7 @@ static err_t parse_method_cil(System_Reflection_MethodInfo method, blob_entry_t
             CHECK_AND_RETHROW(parse_local_var_sig(signature, method, file, metadata));
         } else {
             // empty array for ease of use
-            GC_UPDATE(body, LocalVariables, GC_NEW_ARRAY(tSystem_Reflection_LocalVariableInfo, 0));
+            GC_UPDATE(body, LocalVariables, GC_NEW_METADATA_ARRAY(tSystem_Reflection_LocalVariableInfo, 0));
         }
 
         // copy some info
@@ -202,7 +206,7 @@ static err_t parse_method_cil(System_Reflection_MethodInfo method, blob_entry_t
                     }
 
                     // allocate it
-                    GC_UPDATE(body, ExceptionHandlingClauses, GC_NEW_ARRAY(tSystem_Reflection_ExceptionHandlingClause, count));
+                    GC_UPDATE(body, ExceptionHandlingClauses, GC_NEW_METADATA_ARRAY(tSystem_Reflection_ExceptionHandlingClause, count));
 
                     // parse it
                     for (int i = 0; i < count; i++) {
@@ -282,7 +286,7 @@ static err_t parse_method_cil(System_Reflection_MethodInfo method, blob_entry_t
 
         // an empty arrays if there are no exceptions
         if (body->ExceptionHandlingClauses == NULL) {
-            GC_UPDATE(body, ExceptionHandlingClauses, GC_NEW_ARRAY(tSystem_Reflection_ExceptionHandlingClause, 0));
+            GC_UPDATE(body, ExceptionHandlingClauses, GC_NEW_METADATA_ARRAY(tSystem_Reflection_ExceptionHandlingClause, 0));
         }
     } else if ((header_type & 0b11) == CorILMethod_TinyFormat) {
         ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -297,10 +301,10 @@ static err_t parse_method_cil(System_Reflection_MethodInfo method, blob_entry_t
         sig.data++;
 
         // no local variables
-        GC_UPDATE(body, LocalVariables, GC_NEW_ARRAY(tSystem_Reflection_LocalVariableInfo, 0));
+        GC_UPDATE(body, LocalVariables, GC_NEW_METADATA_ARRAY(tSystem_Reflection_LocalVariableInfo, 0));
 
         // no exceptions
-        GC_UPDATE(body, ExceptionHandlingClauses, GC_NEW_ARRAY(tSystem_Reflection_ExceptionHandlingClause, 0));
+        GC_UPDATE(body, ExceptionHandlingClauses, GC_NEW_METADATA_ARRAY(tSystem_Reflection_ExceptionHandlingClause, 0));
 
         // set the default options
         body->MaxStackSize = 8;
@@ -320,7 +324,9 @@ cleanup:
 static err_t set_class_layout(System_Reflection_Assembly assembly, metadata_t* metadata) {
     err_t err = NO_ERROR;
 
-    metadata_class_layout_t* class_layouts = metadata->tables[METADATA_CLASS_LAYOUT].table;
+    metadata_class_layout_t* class_layouts;
+
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_CLASS_LAYOUT, &class_layouts));
     for (int i = 0; i < metadata->tables[METADATA_CLASS_LAYOUT].rows; i++) {
         metadata_class_layout_t* class_layout = &class_layouts[i];
         System_Type type;
@@ -365,7 +371,10 @@ static err_t loader_load_type_refs(System_Reflection_Assembly assembly, metadata
     err_t err = NO_ERROR;
 
 
-    metadata_assembly_ref_t* assembly_refs = metadata->tables[METADATA_ASSEMBLY_REF].table;
+    metadata_assembly_ref_t* assembly_refs;
+
+
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_ASSEMBLY_REF, &assembly_refs));
     size_t assembly_refs_count = metadata->tables[METADATA_ASSEMBLY_REF].rows;
 
     //
@@ -373,7 +382,9 @@ static err_t loader_load_type_refs(System_Reflection_Assembly assembly, metadata
     // for resolving other stuff later on
     //
 
-    metadata_type_ref_t* type_refs = metadata->tables[METADATA_TYPE_REF].table;
+    metadata_type_ref_t* type_refs;
+
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_TYPE_REF, &type_refs));
     size_t type_refs_count = metadata->tables[METADATA_TYPE_REF].rows;
 
     GC_UPDATE(assembly, ImportedTypes, GC_NEW_ARRAY(tSystem_Type, type_refs_count));
@@ -460,6 +471,112 @@ cleanup:
     return err;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Lazy method bodies
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//
+// Most of the methods of an assembly, and especially of the corelib, are never called, so their
+// bodies are only parsed once they are needed. The body object itself is still created when the
+// type is setup, so it can be checked for and shared by generic instances, and it is filled in
+// place on the first use. This is why the metadata of an assembly is kept for as long as the
+// assembly lives, which is forever.
+//
+
+typedef struct loader_assembly {
+    pe_file_t file;
+    metadata_t metadata;
+} loader_assembly_t;
+
+typedef struct loader_pending_body {
+    loader_assembly_t* assembly;
+    System_Reflection_MethodInfo method;
+    blob_entry_t il;
+} loader_pending_body_t;
+
+/**
+ * The bodies that were not parsed yet, parsing a body may need other bodies
+ * when it creates generic instances, so the lock is recursive
+ */
+static struct {
+    System_Reflection_MethodBody key;
+    loader_pending_body_t value;
+}* m_loader_pending_bodies = NULL;
+static pthread_mutex_t m_loader_bodies_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+/**
+ * The file given to the setup is always the one in the state of the assembly
+ */
+static loader_assembly_t* loader_get_assembly(pe_file_t* file) {
+    return (loader_assembly_t*)((uint8_t*)file - offsetof(loader_assembly_t, file));
+}
+
+static void loader_defer_method_body(loader_assembly_t* assembly, System_Reflection_MethodInfo method, blob_entry_t il) {
+    System_Reflection_MethodBody body = UNSAFE_GC_NEW(tSystem_Reflection_MethodBody);
+    GC_UPDATE(method, MethodBody, body);
+
+    pthread_mutex_lock(&m_loader_bodies_lock);
+    hmput(m_loader_pending_bodies, body, ((loader_pending_body_t){
+        .assembly = assembly,
+        .method = method,
+        .il = il
+    }));
+    pthread_mutex_unlock(&m_loader_bodies_lock);
+}
+
+err_t loader_fill_method_body(System_Reflection_MethodInfo method) {
+    err_t err = NO_ERROR;
+
+    if (method->MethodBody == NULL) {
+        return NO_ERROR;
+    }
+
+    pthread_mutex_lock(&m_loader_bodies_lock);
+
+    int index = hmgeti(m_loader_pending_bodies, method->MethodBody);
+    if (index < 0) {
+        goto cleanup;
+    }
+
+    // take it out first, anything that gets to it again while we are
+    // parsing it is going to see it as it is, same as with the types
+    loader_pending_body_t pending = m_loader_pending_bodies[index].value;
+    hmdel(m_loader_pending_bodies, method->MethodBody);
+
+    // the body lives as long as the method, same as the rest of the metadata, which also
+    // keeps everything we create here alive while the collector runs alongside us
+    gc_immortal_begin();
+    err = parse_method_cil(pending.method, pending.il, &pending.assembly->file, &pending.assembly->metadata);
+    gc_immortal_end();
+    CHECK_AND_RETHROW(err);
+
+cleanup:
+    pthread_mutex_unlock(&m_loader_bodies_lock);
+    return err;
+}
+
+/**
+ * Free the state of an assembly that failed to load, along with the bodies
+ * that were waiting on it
+ */
+static void loader_free_assembly(loader_assembly_t* assembly) {
+    if (assembly == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&m_loader_bodies_lock);
+    for (int i = hmlen(m_loader_pending_bodies) - 1; i >= 0; i--) {
+        if (m_loader_pending_bodies[i].value.assembly == assembly) {
+            hmdel(m_loader_pending_bodies, m_loader_pending_bodies[i].key);
+        }
+    }
+    pthread_mutex_unlock(&m_loader_bodies_lock);
+
+    free_metadata(&assembly->metadata);
+    free_pe_file(&assembly->file);
+    free(assembly);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Setup type information, before feeling everything
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -502,11 +619,11 @@ err_t loader_setup_type(pe_file_t* file, metadata_t* metadata, System_Type type)
             const void* rva_base = pe_get_rva_ptr(file, &directory);
             CHECK(rva_base != NULL);
 
-            // parse the method info
-            CHECK_AND_RETHROW(parse_method_cil(methodInfo, (blob_entry_t){
+            // the body is parsed on first use
+            loader_defer_method_body(loader_get_assembly(file), methodInfo, (blob_entry_t){
                 .size = directory.size,
                 .data= rva_base
-            }, file, metadata));
+            });
         }
 
         CHECK_AND_RETHROW(parse_method_def_sig(method_def->signature, methodInfo, file, metadata));
@@ -597,7 +714,7 @@ static err_t setup_type_info(pe_file_t* file, metadata_t* metadata, System_Refle
                        type_def[1].method_list.index - 1;
         CHECK(last_idx <= methods_count);
 
-        type->Methods = GC_NEW_ARRAY(tSystem_Reflection_MethodInfo, last_idx - type_def->method_list.index + 1);
+        type->Methods = GC_NEW_METADATA_ARRAY(tSystem_Reflection_MethodInfo, last_idx - type_def->method_list.index + 1);
         for (int mi = 0; mi < type->Methods->Length; mi++) {
             int index = type_def->method_list.index + mi - 1;
             metadata_method_def_t* method_def = metadata_get_method_def(metadata, index);
@@ -608,7 +725,7 @@ static err_t setup_type_info(pe_file_t* file, metadata_t* metadata, System_Refle
 
             GC_UPDATE(methodInfo, DeclaringType, type);
             GC_UPDATE(methodInfo, Module, type->Module);
-            GC_UPDATE(methodInfo, Name, new_string_from_utf8(method_def->name, strlen(method_def->name)));
+            GC_UPDATE(methodInfo, Name, string_intern_utf8(method_def->name, strlen(method_def->name)));
             methodInfo->Attributes = method_def->flags;
             methodInfo->ImplAttributes = method_def->impl_flags;
         }
@@ -619,7 +736,7 @@ static err_t setup_type_info(pe_file_t* file, metadata_t* metadata, System_Refle
                        type_def[1].field_list.index - 1;
         CHECK(last_idx <= fields_count);
 
-        type->Fields = GC_NEW_ARRAY(tSystem_Reflection_FieldInfo, last_idx - type_def->field_list.index + 1);
+        type->Fields = GC_NEW_METADATA_ARRAY(tSystem_Reflection_FieldInfo, last_idx - type_def->field_list.index + 1);
         for (int fi = 0; fi < type->Fields->Length; fi++) {
             size_t index = type_def->field_list.index + fi - 1;
             metadata_field_t* field = metadata_get_field(metadata, index);
@@ -629,7 +746,7 @@ static err_t setup_type_info(pe_file_t* file, metadata_t* metadata, System_Refle
 
             GC_UPDATE(fieldInfo, DeclaringType, type);
             GC_UPDATE(fieldInfo, Module, type->Module);
-            GC_UPDATE(fieldInfo, Name, new_string_from_utf8(field->name, strlen(field->name)));
+            GC_UPDATE(fieldInfo, Name, string_intern_utf8(field->name, strlen(field->name)));
             fieldInfo->Attributes = field->flags;
         }
 
@@ -650,7 +767,8 @@ static err_t setup_type_info(pe_file_t* file, metadata_t* metadata, System_Refle
     //
 
     int type_specs_count = metadata->tables[METADATA_TYPE_SPEC].rows;
-    metadata_type_spec_t* type_specs = metadata->tables[METADATA_TYPE_SPEC].table;
+    metadata_type_spec_t* type_specs;
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_TYPE_SPEC, &type_specs));
     GC_UPDATE(assembly, DefinedTypeSpecs, GC_NEW_ARRAY(get_array_type(tSystem_Byte), type_specs_count));
     for (int i = 0; i < type_specs_count; i++) {
         metadata_type_spec_t* spec = &type_specs[i];
@@ -664,12 +782,13 @@ static err_t setup_type_info(pe_file_t* file, metadata_t* metadata, System_Refle
     //
 
     int member_refs_count = metadata->tables[METADATA_MEMBER_REF].rows;
-    metadata_member_ref_t* member_refs = metadata->tables[METADATA_MEMBER_REF].table;
+    metadata_member_ref_t* member_refs;
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_MEMBER_REF, &member_refs));
     GC_UPDATE(assembly, DefinedMemberRefs, GC_NEW_ARRAY(get_array_type(tSystem_Byte), member_refs_count));
     for (int i = 0; i < member_refs_count; i++) {
         metadata_member_ref_t* ref = &member_refs[i];
         TinyDotNet_Reflection_MemberReference member = UNSAFE_GC_NEW(tTinyDotNet_Reflection_MemberReference);
-        GC_UPDATE(member, Name, new_string_from_utf8(ref->name, strlen(ref->name)));
+        GC_UPDATE(member, Name, string_intern_utf8(ref->name, strlen(ref->name)));
         System_Byte_Array blob = GC_NEW_ARRAY(tSystem_Byte, ref->signature.size);
         memcpy(blob->Data, ref->signature.data, ref->signature.size);
         GC_UPDATE(member, Signature, blob);
@@ -682,7 +801,8 @@ static err_t setup_type_info(pe_file_t* file, metadata_t* metadata, System_Refle
     //------------------------------------------------------------------------------------------------------------------
 
     int generic_params_count = metadata->tables[METADATA_GENERIC_PARAM].rows;
-    metadata_generic_param_t* generic_params = metadata->tables[METADATA_GENERIC_PARAM].table;
+    metadata_generic_param_t* generic_params;
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_GENERIC_PARAM, &generic_params));
 
     //
     // Start with accumulating the parameters
@@ -771,7 +891,8 @@ static err_t setup_type_info(pe_file_t* file, metadata_t* metadata, System_Refle
     //
 
     int method_spec_count = metadata->tables[METADATA_METHOD_SPEC].rows;
-    metadata_method_spec_t* method_spec = metadata->tables[METADATA_METHOD_SPEC].table;
+    metadata_method_spec_t* method_spec;
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_METHOD_SPEC, &method_spec));
     GC_UPDATE(assembly, DefinedMethodSpecs, GC_NEW_ARRAY(get_array_type(tTinyDotNet_Reflection_MethodSpec), method_spec_count));
     for (int i = 0; i < method_spec_count; i++) {
         System_Reflection_MethodInfo method = NULL;
@@ -789,7 +910,9 @@ static err_t setup_type_info(pe_file_t* file, metadata_t* metadata, System_Refle
     // Take care of all the interface implementations
     //------------------------------------------------------------------------------------------------------------------
 
-    metadata_interface_impl_t* interface_impls = metadata->tables[METADATA_INTERFACE_IMPL].table;
+    metadata_interface_impl_t* interface_impls;
+
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_INTERFACE_IMPL, &interface_impls));
     int interface_impls_count = metadata->tables[METADATA_INTERFACE_IMPL].rows;
 
     // count interfaces for each type, use stack size as a temp while we do the counting
@@ -813,7 +936,7 @@ static err_t setup_type_info(pe_file_t* file, metadata_t* metadata, System_Refle
     // Allocate all the arrays nicely
     for (int i = 0; i < hmlen(interfaces); i++) {
         System_Type type = interfaces[i].key;
-        GC_UPDATE(type, InterfaceImpls, GC_NEW_ARRAY(tTinyDotNet_Reflection_InterfaceImpl, arrlen(interfaces[i].value)));
+        GC_UPDATE(type, InterfaceImpls, GC_NEW_METADATA_ARRAY(tTinyDotNet_Reflection_InterfaceImpl, arrlen(interfaces[i].value)));
         for (int j = 0; j < arrlen(interfaces[i].value); j++) {
             TinyDotNet_Reflection_InterfaceImpl interfaceImpl = UNSAFE_GC_NEW(tTinyDotNet_Reflection_InterfaceImpl);
             GC_UPDATE(interfaceImpl, InterfaceType, interfaces[i].value[j]);
@@ -832,7 +955,9 @@ static err_t setup_type_info(pe_file_t* file, metadata_t* metadata, System_Refle
     // Take care of all the method impls
     //------------------------------------------------------------------------------------------------------------------
 
-    metadata_method_impl_t* method_impls = metadata->tables[METADATA_METHOD_IMPL].table;
+    metadata_method_impl_t* method_impls;
+
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_METHOD_IMPL, &method_impls));
     int method_impls_count = metadata->tables[METADATA_METHOD_IMPL].rows;
 
     for (int i = 0; i < method_impls_count; i++) {
@@ -879,7 +1004,7 @@ static err_t setup_type_info(pe_file_t* file, metadata_t* metadata, System_Refle
     // Allocate all the arrays nicely
     for (int i = 0; i < hmlen(method_impls_table); i++) {
         System_Type type = method_impls_table[i].key;
-        GC_UPDATE(type, MethodImpls, GC_NEW_ARRAY(tTinyDotNet_Reflection_MethodImpl, arrlen(method_impls_table[i].value)));
+        GC_UPDATE(type, MethodImpls, GC_NEW_METADATA_ARRAY(tTinyDotNet_Reflection_MethodImpl, arrlen(method_impls_table[i].value)));
         for (int j = 0; j < arrlen(method_impls_table[i].value); j++) {
             GC_UPDATE_ARRAY(type->MethodImpls, j, method_impls_table[i].value[j]);
         }
@@ -1047,6 +1172,7 @@ cleanup:
 
 err_t loader_fill_type(System_Type type) {
     err_t err = NO_ERROR;
+    gc_immortal_begin();
     static int depth = 0;
     TRACE_FILL_TYPE("%*s%U.%U", depth * 4, "", type->Namespace, type->Name);
     depth++;
@@ -1238,7 +1364,7 @@ err_t loader_fill_type(System_Type type) {
         }
 
         // now we know the exact amount of virtual methods that we have for this type
-        GC_UPDATE(type, VirtualMethods, GC_NEW_ARRAY(tSystem_Reflection_MethodInfo, virtual_count));
+        GC_UPDATE(type, VirtualMethods, GC_NEW_METADATA_ARRAY(tSystem_Reflection_MethodInfo, virtual_count));
         if (virtual_count != 0) {
             type->VTable = malloc(sizeof(void*) * virtual_count);
             CHECK_ERROR(type->VTable != NULL, ERROR_OUT_OF_MEMORY);
@@ -1539,73 +1665,83 @@ cleanup:
         PANIC_ON(monitor_exit(type));
     }
 
+    gc_immortal_end();
     depth--;
     TRACE_FILL_TYPE("%*s%U.%U - %d, %d", depth * 4, "", type->Namespace, type->Name, type->ManagedSize, type->StackSize);
     return err;
 }
 
+//
+// The user strings are only created once an ldstr needs them, most of the literals of an
+// assembly are never used by a given run. The #US heap of the file is kept as is, which
+// is fine since the file itself lives as long as the assembly, and the strings are made
+// immortal since the assembly keeps them forever anyways.
+//
+
+/**
+ * The #US heap of every loaded assembly
+ */
+static struct {
+    System_Reflection_Assembly key;
+    blob_entry_t value;
+}* m_loader_user_strings = NULL;
+static pthread_mutex_t m_loader_user_strings_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static err_t parse_user_strings(System_Reflection_Assembly assembly, pe_file_t* file) {
     err_t err = NO_ERROR;
 
-    int string_count = 0;
-
-    // count how many strings we have
-    blob_entry_t us = {
+    pthread_mutex_lock(&m_loader_user_strings_lock);
+    hmput(m_loader_user_strings, assembly, ((blob_entry_t){
         .data = file->us,
         .size = file->us_size
-    };
-    while (us.size != 0) {
-        // get the size
-        uint32_t string_size;
-        CHECK_AND_RETHROW(parse_compressed_integer(&us, &string_size));
-
-        // we got another string
-        string_count++;
-
-        // skip this string entry
-        CHECK(string_size <= us.size);
-        us.size -= string_size;
-        us.data += string_size;
-    }
+    }));
+    pthread_mutex_unlock(&m_loader_user_strings_lock);
+
+    return err;
+}
+
+System_String loader_get_user_string(System_Reflection_Assembly assembly, int offset) {
+    err_t err = NO_ERROR;
+    System_String string = NULL;
 
-    assembly->UserStrings = GC_NEW_ARRAY(tSystem_String, string_count);
+    pthread_mutex_lock(&m_loader_user_strings_lock);
 
-    // now create all the strings
-    string_count = 0;
-    us.data = file->us;
-    us.size = file->us_size;
-    while (us.size != 0) {
-        int offset = file->us_size - us.size;
+    int index = hmgeti(assembly->UserStringsTable, offset);
+    if (index >= 0) {
+        string = assembly->UserStringsTable[index].value;
+        goto cleanup;
+    }
 
-        // get the size
-        uint32_t string_size;
-        CHECK_AND_RETHROW(parse_compressed_integer(&us, &string_size));
-        CHECK(string_size <= us.size);
+    index = hmgeti(m_loader_user_strings, assembly);
+    CHECK(index >= 0);
 
-        // create the string and store it
-        System_String string = GC_NEW_STRING(string_size / 2);
-        memcpy(string->Chars, us.data, (string_size / 2) * 2);
+    blob_entry_t us = m_loader_user_strings[index].value;
+    CHECK(offset >= 0 && offset < us.size);
+    us.data += offset;
+    us.size -= offset;
 
-        // set the entries in the table and array
-        GC_UPDATE_ARRAY(assembly->UserStrings, string_count, string);
-        hmput(assembly->UserStringsTable, offset, string);
+    // get the size
+    uint32_t string_size;
+    CHECK_AND_RETHROW(parse_compressed_integer(&us, &string_size));
+    CHECK(string_size <= us.size);
 
-        // we got another string
-        string_count++;
+    // get the interned string and store it, the last byte is only a flag
+    string = string_intern_chars((const System_Char*)us.data, string_size / 2);
+    CHECK(string != NULL);
 
-        // skip this string entry
-        us.size -= string_size;
-        us.data += string_size;
-    }
+    hmput(assembly->UserStringsTable, offset, string);
 
 cleanup:
-    return err;
+    pthread_mutex_unlock(&m_loader_user_strings_lock);
+    return IS_ERROR(err) ? NULL : string;
 }
 
 static err_t parse_custom_attributes(System_Reflection_Assembly assembly, metadata_t* metadata) {
     err_t err = NO_ERROR;
 
-    metadata_custom_attribute_t* attribs = metadata->tables[METADATA_CUSTOM_ATTRIBUTE].table;
+    metadata_custom_attribute_t* attribs;
+
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_CUSTOM_ATTRIBUTE, &attribs));
     int attribs_count = metadata->tables[METADATA_CUSTOM_ATTRIBUTE].rows;
 
     for (int i = 0; i < attribs_count; i++) {
@@ -1662,7 +1798,9 @@ cleanup:
 static err_t connect_nested_types(System_Reflection_Assembly assembly, metadata_t* metadata) {
     err_t err = NO_ERROR;
 
-    metadata_nested_class_t* nested_classes = metadata->tables[METADATA_NESTED_CLASS].table;
+    metadata_nested_class_t* nested_classes;
+
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_NESTED_CLASS, &nested_classes));
     for (int i = 0; i < metadata->tables[METADATA_NESTED_CLASS].rows; i++) {
         metadata_nested_class_t* nested_class = &nested_classes[i];
         System_Type enclosing;
@@ -1792,6 +1930,10 @@ static type_init_t m_type_init[] = {
 
     TYPE_LOOKUP("System.Runtime.CompilerServices", "Unsafe", tSystem_Runtime_CompilerServices_Unsafe),
     TYPE_LOOKUP("System.Runtime.CompilerServices", "IsVolatile", tSystem_Runtime_CompilerServices_IsVolatile),
+
+    // exceptions with fields of their own, the layout comes from the corelib
+    TYPE_LOOKUP("System", "ArgumentNullException", tSystem_ArgumentNullException),
+    TYPE_LOOKUP("System", "TypeInitializationException", tSystem_TypeInitializationException),
 };
 
 static void init_type(metadata_type_def_t* type_def, System_Type type) {
@@ -1802,7 +1944,7 @@ static void init_type(metadata_type_def_t* type_def, System_Type type) {
             strcmp(type_def->type_namespace, bt->namespace) == 0 &&
             strcmp(type_def->type_name, bt->name) == 0
         ) {
-            if (type->StackSize >= 0) {
+            if (bt->stack_size >= 0) {
                 type->ManagedSize = bt->managed_size;
                 type->StackSize = bt->stack_size;
                 type->ManagedAlignment = bt->managed_alignment;
@@ -1840,7 +1982,8 @@ static err_t loader_setup_module(System_Reflection_Assembly assembly, metadata_t
     err_t err = NO_ERROR;
 
     // setup the assembly
-    metadata_assembly_t* mt_assembly = metadata->tables[METADATA_ASSEMBLY].table;
+    metadata_assembly_t* mt_assembly;
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_ASSEMBLY, &mt_assembly));
     GC_UPDATE(assembly, Name, new_string_from_cstr(mt_assembly->name));
     assembly->MajorVersion = mt_assembly->major_version;
     assembly->MinorVersion = mt_assembly->minor_version;
@@ -1848,7 +1991,8 @@ static err_t loader_setup_module(System_Reflection_Assembly assembly, metadata_t
     assembly->RevisionNumber = mt_assembly->revision_number;
 
     // create the module
-    metadata_module_t* module = metadata->tables[METADATA_MODULE].table;
+    metadata_module_t* module;
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_MODULE, &module));
     GC_UPDATE(assembly, Module, UNSAFE_GC_NEW(tSystem_Reflection_Module));
     GC_UPDATE(assembly->Module, Name, new_string_from_cstr(module->name));
     GC_UPDATE(assembly->Module, Assembly, assembly);
@@ -1867,22 +2011,37 @@ cleanup:
         instance->vtable = __type->VTable; \
     } while (0);
 
+//
+// Startup snapshots (mapping a saved image of the set up type system) are not supported:
+//  - types, methods and fields are gc heap objects, an image would need the heap to be relocatable
+//  - every type and method owns mir items in the shared context, which can't be saved and mapped back
+//  - vtables and thunks point at machine code jitted by this process
+// Instead loading is kept lazy, startup only walks the type, method and field tables, and the
+// method bodies, the other tables, user strings, type filling and jitting happen on first use.
+//
 
 err_t loader_load_corelib(void* buffer, size_t buffer_size) {
     err_t err = NO_ERROR;
-    metadata_t metadata = { 0 };
+    loader_assembly_t* state = NULL;
+
+    // all the metadata lives as long as the assembly, which is forever
+    gc_immortal_begin();
 
     uint64_t start = microtime();
 
     // Start by loading the PE file for the corelib
-    pe_file_t file = {
-        .file = buffer,
-        .file_size = buffer_size
-    };
-    CHECK_AND_RETHROW(pe_parse(&file));
+    // kept around for parsing the method bodies later on
+    state = calloc(1, sizeof(loader_assembly_t));
+    CHECK_ERROR(state != NULL, ERROR_OUT_OF_MEMORY);
+    pe_file_t* file = &state->file;
+    metadata_t* metadata = &state->metadata;
+
+    file->file = buffer;
+    file->file_size = buffer_size;
+    CHECK_AND_RETHROW(pe_parse(file));
 
     // decode the dotnet metadata
-    CHECK_AND_RETHROW(decode_metadata(&file, &metadata));
+    CHECK_AND_RETHROW(decode_metadata(file, metadata));
 
     // allocate the corelib on the kernel heap and not the object heap, just because
     // it is always going to be allocated anyways
@@ -1890,11 +2049,11 @@ err_t loader_load_corelib(void* buffer, size_t buffer_size) {
     CHECK(assembly != NULL);
 
     // setup the basic type system
-    int types_count = metadata.tables[METADATA_TYPE_DEF].rows;
-    metadata_type_def_t* type_defs = metadata.tables[METADATA_TYPE_DEF].table;
+    int types_count = metadata->tables[METADATA_TYPE_DEF].rows;
+    metadata_type_def_t* type_defs = metadata->tables[METADATA_TYPE_DEF].table;
 
-    int method_count = metadata.tables[METADATA_METHOD_DEF].rows;
-    int field_count = metadata.tables[METADATA_FIELD].rows;
+    int method_count = metadata->tables[METADATA_METHOD_DEF].rows;
+    int field_count = metadata->tables[METADATA_FIELD].rows;
 
     // do first time allocation and init
     assembly->DefinedTypes = gc_new(NULL, sizeof(struct System_Array) + types_count * sizeof(System_Type));
@@ -1910,7 +2069,7 @@ err_t loader_load_corelib(void* buffer, size_t buffer_size) {
     CHECK_AND_RETHROW(validate_have_init_types());
 
     // create the module
-    CHECK_AND_RETHROW(loader_setup_module(assembly, &metadata));
+    CHECK_AND_RETHROW(loader_setup_module(assembly, metadata));
 
     assembly->DefinedMethods = gc_new(NULL, sizeof(struct System_Array) + method_count * sizeof(System_Reflection_MethodInfo));
     assembly->DefinedMethods->Length = method_count;
@@ -1918,10 +2077,10 @@ err_t loader_load_corelib(void* buffer, size_t buffer_size) {
     assembly->DefinedFields->Length = field_count;
 
     // we need the nested types before we finish up the setup type info
-    CHECK_AND_RETHROW(connect_nested_types(assembly, &metadata));
+    CHECK_AND_RETHROW(connect_nested_types(assembly, metadata));
 
     // do first time type init
-    CHECK_AND_RETHROW(setup_type_info(&file, &metadata, assembly));
+    CHECK_AND_RETHROW(setup_type_info(file, metadata, assembly));
 
     // initialize all the runtime required types
     for (int i = 0; i < ARRAY_LEN(m_type_init); i++) {
@@ -1945,16 +2104,18 @@ err_t loader_load_corelib(void* buffer, size_t buffer_size) {
     }
 
     // get the user strings for the runtime
-    CHECK_AND_RETHROW(parse_user_strings(assembly, &file));
-//    CHECK_AND_RETHROW(parse_custom_attributes(assembly, &metadata));
+    CHECK_AND_RETHROW(parse_user_strings(assembly, file));
+//    CHECK_AND_RETHROW(parse_custom_attributes(assembly, metadata));
 
     // save this
     g_corelib = assembly;
     gc_add_root(&g_corelib);
 
 cleanup:
-    free_metadata(&metadata);
-    free_pe_file(&file);
+    gc_immortal_end();
+    if (IS_ERROR(err)) {
+        loader_free_assembly(state);
+    }
 
     if (!IS_ERROR(err)) {
         TRACE("loading assembly `%U` (v%d.%d.%d.%d) took %dms",
@@ -1970,28 +2131,52 @@ cleanup:
 // this is the normal parsing and initialization
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-err_t loader_load_assembly(void* buffer, size_t buffer_size, System_Reflection_Assembly* out_assembly) {
+/**
+ * Parse the PE and the metadata of an assembly, this does not touch any runtime
+ * state so it can run on any thread, in parallel to other assemblies
+ */
+static err_t loader_prepare_assembly(void* buffer, size_t buffer_size, loader_assembly_t** out_state) {
     err_t err = NO_ERROR;
-    metadata_t metadata = { 0 };
-    uint64_t start = microtime();
 
-    // Start by loading the PE file for the corelib
-    pe_file_t file = {
-        .file = buffer,
-        .file_size = buffer_size
-    };
-    CHECK_AND_RETHROW(pe_parse(&file));
+    // kept around for parsing the method bodies later on
+    loader_assembly_t* state = calloc(1, sizeof(loader_assembly_t));
+    CHECK_ERROR(state != NULL, ERROR_OUT_OF_MEMORY);
+    pe_file_t* file = &state->file;
+    metadata_t* metadata = &state->metadata;
+
+    file->file = buffer;
+    file->file_size = buffer_size;
+    CHECK_AND_RETHROW(pe_parse(file));
 
     // decode the dotnet metadata
-    CHECK_AND_RETHROW(decode_metadata(&file, &metadata));
+    CHECK_AND_RETHROW(decode_metadata(file, metadata));
+
+    *out_state = state;
+    state = NULL;
+
+cleanup:
+    loader_free_assembly(state);
+    return err;
+}
+
+/**
+ * Create the runtime objects of a prepared assembly, takes ownership of the state
+ */
+static err_t loader_setup_assembly(loader_assembly_t* state, System_Reflection_Assembly* out_assembly) {
+    err_t err = NO_ERROR;
+    pe_file_t* file = &state->file;
+    metadata_t* metadata = &state->metadata;
+
+    // all the metadata lives as long as the assembly, which is forever
+    gc_immortal_begin();
 
     // allocate the new assembly
     System_Reflection_Assembly assembly = UNSAFE_GC_NEW(tSystem_Reflection_Assembly);
 
     // load all the types and stuff
-    int types_count = metadata.tables[METADATA_TYPE_DEF].rows;
-    int method_count = metadata.tables[METADATA_METHOD_DEF].rows;
-    int field_count = metadata.tables[METADATA_FIELD].rows;
+    int types_count = metadata->tables[METADATA_TYPE_DEF].rows;
+    int method_count = metadata->tables[METADATA_METHOD_DEF].rows;
+    int field_count = metadata->tables[METADATA_FIELD].rows;
 
     // create all the types
     GC_UPDATE(assembly, DefinedTypes, GC_NEW_ARRAY(tSystem_Type, types_count));
@@ -1999,40 +2184,115 @@ err_t loader_load_assembly(void* buffer, size_t buffer_size, System_Reflection_A
         GC_UPDATE_ARRAY(assembly->DefinedTypes, i, UNSAFE_GC_NEW(tSystem_Type));
     }
 
-    CHECK_AND_RETHROW(loader_setup_module(assembly, &metadata));
+    CHECK_AND_RETHROW(loader_setup_module(assembly, metadata));
 
     // create all the methods and fields
     GC_UPDATE(assembly, DefinedMethods, GC_NEW_ARRAY(tSystem_Reflection_MethodInfo, method_count));
     GC_UPDATE(assembly, DefinedFields, GC_NEW_ARRAY(tSystem_Reflection_FieldInfo, field_count));
 
     // we need the nested types before we finish up the setup type info
-    CHECK_AND_RETHROW(connect_nested_types(assembly, &metadata));
+    CHECK_AND_RETHROW(connect_nested_types(assembly, metadata));
 
     // do first time type init
-    CHECK_AND_RETHROW(setup_type_info(&file, &metadata, assembly));
+    CHECK_AND_RETHROW(setup_type_info(file, metadata, assembly));
 
     // get the user strings for the runtime
-    CHECK_AND_RETHROW(parse_user_strings(assembly, &file));
-//    CHECK_AND_RETHROW(parse_custom_attributes(assembly, &metadata));
+    CHECK_AND_RETHROW(parse_user_strings(assembly, file));
+//    CHECK_AND_RETHROW(parse_custom_attributes(assembly, metadata));
 
     // get the entry point
     System_Reflection_MethodInfo entryPoint = NULL;
-    CHECK_AND_RETHROW(assembly_get_method_by_token(assembly, file.cli_header->entry_point_token, NULL, NULL, &entryPoint));
+    CHECK_AND_RETHROW(assembly_get_method_by_token(assembly, file->cli_header->entry_point_token, NULL, NULL, &entryPoint));
     GC_UPDATE(assembly, EntryPoint, entryPoint);
 
     // give out the assembly
     *out_assembly = assembly;
 
 cleanup:
-    free_metadata(&metadata);
-    free_pe_file(&file);
+    gc_immortal_end();
+    if (IS_ERROR(err)) {
+        loader_free_assembly(state);
+    }
 
-    if (!IS_ERROR(err)) {
-        TRACE("loading assembly `%U` (v%d.%d.%d.%d) took %dms",
+    return err;
+}
+
+err_t loader_load_assembly(void* buffer, size_t buffer_size, System_Reflection_Assembly* out_assembly) {
+    // a single one is prepared right on our thread
+    return loader_load_assemblies(&buffer, &buffer_size, 1, out_assembly);
+}
+
+//
+// Loading many assemblies at once parses all of their PE files and metadata in parallel, on plain
+// threads since that part touches nothing in the runtime. Creating the runtime objects is then
+// done in the order the assemblies were given, on the calling thread, the type setup is recursive
+// across types and creates objects with preemption disabled, so it is not something that can be
+// spread across threads, and this keeps the result the same as loading them one by one.
+//
+
+typedef struct loader_prepare_job {
+    void* buffer;
+    size_t buffer_size;
+    loader_assembly_t* state;
+    err_t err;
+    pthread_t thread;
+    bool started;
+} loader_prepare_job_t;
+
+static void* loader_prepare_thread(void* arg) {
+    loader_prepare_job_t* job = arg;
+    job->err = loader_prepare_assembly(job->buffer, job->buffer_size, &job->state);
+    return NULL;
+}
+
+err_t loader_load_assemblies(void** buffers, size_t* buffer_sizes, int count, System_Reflection_Assembly* out_assemblies) {
+    err_t err = NO_ERROR;
+    uint64_t start = microtime();
+
+    loader_prepare_job_t* jobs = calloc(count, sizeof(loader_prepare_job_t));
+    CHECK_ERROR(jobs != NULL || count == 0, ERROR_OUT_OF_MEMORY);
+
+    // the first one is done by us, so we have something to do while waiting
+    for (int i = 0; i < count; i++) {
+        jobs[i].buffer = buffers[i];
+        jobs[i].buffer_size = buffer_sizes[i];
+        if (i != 0) {
+            jobs[i].started = pthread_create(&jobs[i].thread, NULL, loader_prepare_thread, &jobs[i]) == 0;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].started) {
+            bool released = scheduler_block_enter();
+            pthread_join(jobs[i].thread, NULL);
+            scheduler_block_exit(released);
+        } else {
+            loader_prepare_thread(&jobs[i]);
+        }
+    }
+
+    // now create them in order
+    for (int i = 0; i < count; i++) {
+        CHECK_AND_RETHROW(jobs[i].err);
+
+        loader_assembly_t* state = jobs[i].state;
+        jobs[i].state = NULL;
+        CHECK_AND_RETHROW(loader_setup_assembly(state, &out_assemblies[i]));
+
+        System_Reflection_Assembly assembly = out_assemblies[i];
+        TRACE("loaded assembly `%U` (v%d.%d.%d.%d)",
               assembly->Name,
-              assembly->MajorVersion, assembly->MinorVersion, assembly->BuildNumber, assembly->RevisionNumber,
-              (microtime() - start) / 1000);
+              assembly->MajorVersion, assembly->MinorVersion, assembly->BuildNumber, assembly->RevisionNumber);
     }
 
+    TRACE("loading %d assemblies took %dms", count, (microtime() - start) / 1000);
+
+cleanup:
+    if (jobs != NULL) {
+        for (int i = 0; i < count; i++) {
+            loader_free_assembly(jobs[i].state);
+        }
+        free(jobs);
+    }
     return err;
 }
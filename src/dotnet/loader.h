@@ -17,8 +17,28 @@ extern System_Reflection_Assembly g_corelib;
  */
 err_t loader_load_corelib(void* buffer, size_t buffer_size);
 
+/**
+ * Load an assembly, the buffer must stay valid for as long as the assembly
+ * lives, the method bodies are only parsed out of it on their first use
+ *
+ * @param buffer        [IN] The assembly binary
+ * @param buffer_size   [IN] The assembly binary size
+ * @param assembly      [OUT] The loaded assembly
+ */
 err_t loader_load_assembly(void* buffer, size_t buffer_size, System_Reflection_Assembly* assembly);
 
+/**
+ * Load a set of assemblies, the files are parsed in parallel and the assemblies are then
+ * created in order, so an assembly may only reference the ones before it, same rules as
+ * with loader_load_assembly for the buffers
+ *
+ * @param buffers           [IN] The assembly binaries
+ * @param buffer_sizes      [IN] The assembly binary sizes
+ * @param count             [IN] The amount of assemblies
+ * @param out_assemblies    [OUT] The loaded assemblies, in the same order
+ */
+err_t loader_load_assemblies(void** buffers, size_t* buffer_sizes, int count, System_Reflection_Assembly* out_assemblies);
+
 /**
  * Fill the type information of the given type
  */
@@ -29,6 +49,18 @@ err_t loader_fill_type(System_Type type);
  */
 err_t loader_fill_method(System_Type type, System_Reflection_MethodInfo method);
 
+/**
+ * Parse the body of the method if it was not parsed yet, must be called
+ * before anything looks inside of the body
+ */
+err_t loader_fill_method_body(System_Reflection_MethodInfo method);
+
+/**
+ * Get the user string at the given offset of the #US heap of the assembly,
+ * creating it on the first use, NULL if the offset is invalid
+ */
+System_String loader_get_user_string(System_Reflection_Assembly assembly, int offset);
+
 /**
  * Setup a type, this is done before we fill the type information and
  * only takes care of matching everything
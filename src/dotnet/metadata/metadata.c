@@ -4,6 +4,7 @@
 #include "sig.h"
 
 #include <util/defs.h>
+#include <sync/spinlock.h>
 
 #include <string.h>
 #include <stdint.h>
@@ -78,20 +79,14 @@ typedef enum coded_index {
     CODED_INDEX_MAX,
 } coded_index_t;
 
-typedef struct metadata_parse_ctx {
-    // the tables
-    bool long_string_index;
-    bool long_guid_index;
-    bool long_blob_index;
-
-    // the amount of items in each of the tables
-    bool long_coded_index[CODED_INDEX_MAX];
+STATIC_ASSERT(CODED_INDEX_MAX <= ARRAY_LEN(((metadata_t*)NULL)->long_coded_index));
 
-    // the metadata
+typedef struct metadata_parse_ctx {
+    // the metadata, with the index sizes
     metadata_t* metadata;
 
-    // the size of the tables stream
-    uint8_t* table;
+    // the rows we are decoding
+    const uint8_t* table;
     size_t size;
 
     // the assembly we are parsing for
@@ -311,7 +306,7 @@ static table_parse_op_t* m_table_ops[] = {
  */
 #define FETCH_UINT16() \
     ({ \
-        uint16_t __value = *(uint16_t*)ctx->table; \
+        uint16_t __value = *(const uint16_t*)ctx->table; \
         ctx->table += 2; \
         __value; \
     })
@@ -321,12 +316,15 @@ static table_parse_op_t* m_table_ops[] = {
  */
 #define FETCH_UINT32() \
     ({ \
-        uint32_t __value = *(uint32_t*)ctx->table; \
+        uint32_t __value = *(const uint32_t*)ctx->table; \
         ctx->table += 4; \
         __value; \
     })
 
-static err_t parse_single_table(metadata_parse_ctx_t* ctx, int table_id) {
+/**
+ * Figure the size of a row in the image and once decoded
+ */
+static err_t get_table_row_size(metadata_parse_ctx_t* ctx, int table_id, size_t* out_row_size, size_t* out_in_memory_size) {
     err_t err = NO_ERROR;
 
     // get the correct thing
@@ -334,10 +332,6 @@ static err_t parse_single_table(metadata_parse_ctx_t* ctx, int table_id) {
     table_parse_op_t* ops = m_table_ops[table_id];
     CHECK(ops != NULL, "unknown table id %x", table_id);
 
-    // get the amount of rows
-    size_t rows = ctx->metadata->tables[table_id].rows;
-
-    // figure the row size for allocation
     size_t row_size = 0;
     size_t in_memory_size = 0;
     table_parse_op_t* cur_op = ops;
@@ -346,10 +340,10 @@ static err_t parse_single_table(metadata_parse_ctx_t* ctx, int table_id) {
             case GET_RVA: row_size += 4; in_memory_size += 4; break;
             case GET_UINT16: row_size += 2; in_memory_size += 2; break;
             case GET_UINT32: row_size += 4; in_memory_size += 4; break;
-            case GET_BLOB: row_size += ctx->long_blob_index ? 4 : 2; in_memory_size += sizeof(blob_entry_t); break;
-            case GET_GUID: row_size += ctx->long_guid_index ? 4 : 2; in_memory_size += sizeof(void*); break;
-            case GET_STRING: row_size += ctx->long_string_index ? 4 : 2; in_memory_size += sizeof(void*); break;
-            case GET_CODED_INDEX_BASE ... GET_CODED_INDEX_MAX: row_size += ctx->long_coded_index[*cur_op - GET_CODED_INDEX_BASE] ? 4 : 2; in_memory_size += sizeof(token_t); break;
+            case GET_BLOB: row_size += ctx->metadata->long_blob_index ? 4 : 2; in_memory_size += sizeof(blob_entry_t); break;
+            case GET_GUID: row_size += ctx->metadata->long_guid_index ? 4 : 2; in_memory_size += sizeof(void*); break;
+            case GET_STRING: row_size += ctx->metadata->long_string_index ? 4 : 2; in_memory_size += sizeof(void*); break;
+            case GET_CODED_INDEX_BASE ... GET_CODED_INDEX_MAX: row_size += ctx->metadata->long_coded_index[*cur_op - GET_CODED_INDEX_BASE] ? 4 : 2; in_memory_size += sizeof(token_t); break;
             case GET_TABLE_BASE ... GET_TABLE_MAX: row_size += ctx->metadata->tables[*cur_op - GET_TABLE_BASE].rows > UINT16_MAX ? 4 : 2; in_memory_size += sizeof(token_t); break;
             case DONE: break;
             default: CHECK_FAIL("Invalid opcode_info");
@@ -357,13 +351,33 @@ static err_t parse_single_table(metadata_parse_ctx_t* ctx, int table_id) {
         cur_op++;
     }
 
-    // make sure the table is big enough
+    *out_row_size = row_size;
+    *out_in_memory_size = in_memory_size;
+
+cleanup:
+    return err;
+}
+
+/**
+ * Decode all the rows of a table into their structs, the ctx points to the rows
+ */
+static err_t decode_table(metadata_parse_ctx_t* ctx, int table_id) {
+    err_t err = NO_ERROR;
+    uint8_t* table = NULL;
+
+    size_t row_size, in_memory_size;
+    CHECK_AND_RETHROW(get_table_row_size(ctx, table_id, &row_size, &in_memory_size));
+    table_parse_op_t* ops = m_table_ops[table_id];
+    table_parse_op_t* cur_op;
+
+    // get the amount of rows
+    size_t rows = ctx->metadata->tables[table_id].rows;
     CHECK(row_size * rows <= ctx->size);
 
     // allocate the table itself
-    uint8_t* table = malloc(in_memory_size * rows);
-    CHECK_ERROR(table != NULL, ERROR_OUT_OF_MEMORY);
-    ctx->metadata->tables[table_id].table = table;
+    uint8_t* decoded = malloc(in_memory_size * rows);
+    CHECK_ERROR(decoded != NULL || rows == 0, ERROR_OUT_OF_MEMORY);
+    table = decoded;
 
     // now parse it
     for (int i = 0; i < rows; i++) {
@@ -387,7 +401,7 @@ static err_t parse_single_table(metadata_parse_ctx_t* ctx, int table_id) {
 
                 case GET_BLOB: {
                     // get the entry
-                    uint32_t idx = ctx->long_blob_index ? FETCH_UINT32() : FETCH_UINT16();
+                    uint32_t idx = ctx->metadata->long_blob_index ? FETCH_UINT32() : FETCH_UINT16();
                     CHECK(idx < ctx->file->blob_size);
 
                     // parse the compressed length
@@ -408,14 +422,14 @@ static err_t parse_single_table(metadata_parse_ctx_t* ctx, int table_id) {
                 } break;
 
                 case GET_GUID: {
-                    uint32_t idx = ctx->long_guid_index ? FETCH_UINT32() : FETCH_UINT16();
+                    uint32_t idx = ctx->metadata->long_guid_index ? FETCH_UINT32() : FETCH_UINT16();
                     CHECK(idx == 0 || idx - 1 < ctx->file->guids_count);
                     *(guid_t**)table = idx == 0 ? NULL : &ctx->file->guids[idx - 1];
                     table += sizeof(guid_t*);
                 } break;
 
                 case GET_STRING: {
-                    uint32_t idx = ctx->long_string_index ? FETCH_UINT32() : FETCH_UINT16();
+                    uint32_t idx = ctx->metadata->long_string_index ? FETCH_UINT32() : FETCH_UINT16();
                     CHECK(idx < ctx->file->strings_size);
                     *(const char**)table = &ctx->file->strings[idx];
                     table += sizeof(const char*);
@@ -430,7 +444,7 @@ static err_t parse_single_table(metadata_parse_ctx_t* ctx, int table_id) {
                     uint8_t tag = *ctx->table & ((1 << tag_bits) - 1);
                     uint8_t cur_table_id = m_coded_index_tags[offset][tag];
                     CHECK(cur_table_id < ARRAY_LEN(ctx->metadata->tables));
-                    uint32_t table_index = ctx->long_coded_index[offset] ? FETCH_UINT32() : FETCH_UINT16();
+                    uint32_t table_index = ctx->metadata->long_coded_index[offset] ? FETCH_UINT32() : FETCH_UINT16();
                     table_index >>= tag_bits;
                     CHECK(table_index == 0 || table_index - 1 <= ctx->metadata->tables[cur_table_id].rows);
                     *(token_t*)table = (token_t){ .table = cur_table_id, .index = table_index };
@@ -455,18 +469,16 @@ static err_t parse_single_table(metadata_parse_ctx_t* ctx, int table_id) {
         }
     }
 
-    // remove the size of it
-    ctx->size -= rows * row_size;
+    ctx->metadata->tables[table_id].table = decoded;
+    decoded = NULL;
 
 cleanup:
-    if (IS_ERROR(err)) {
-        (void)0;
-    }
+    free(decoded);
     return err;
 }
 
 static void resolve_coded_index_sizes(metadata_parse_ctx_t* ctx) {
-    for (int i = 0; i < ARRAY_LEN(ctx->long_coded_index); i++) {
+    for (int i = 0; i < CODED_INDEX_MAX; i++) {
         const uint8_t* coding = m_coded_index_tags[i];
         int tag_bits = m_coded_index_bits[i];
 
@@ -482,7 +494,7 @@ static void resolve_coded_index_sizes(metadata_parse_ctx_t* ctx) {
         }
 
         // if it is larger than 16bit we use 32bit indexes
-        ctx->long_coded_index[i] = max_table_len < (1 << (16 - tag_bits)) ? false : true;
+        ctx->metadata->long_coded_index[i] = max_table_len < (1 << (16 - tag_bits)) ? false : true;
     }
 }
 
@@ -490,57 +502,53 @@ static void resolve_coded_index_sizes(metadata_parse_ctx_t* ctx) {
 // Metadata parsing
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-err_t metadata_parse(pe_file_t* file, void* stream, size_t size, metadata_t* metadata) {
+//
+// Nothing is copied out of the image, the heaps point straight into it and the tables are only
+// located when parsing, each table is decoded into its structs the first time it is asked for.
+// Most assemblies have big tables the runtime never looks at (custom attributes, params,
+// properties and so on), which are now never decoded at all.
+//
+
+err_t metadata_parse(pe_file_t* file, const void* stream, size_t size, metadata_t* metadata) {
     err_t err = NO_ERROR;
-    cli_metadata_root_t* metadata_root = stream;
+    const cli_metadata_root_t* metadata_root = stream;
 
     CHECK(sizeof(cli_metadata_root_t) <= size);
     CHECK(metadata_root->signature == CLI_METADATA_ROOT_SIGNATURE);
-    CHECK(sizeof(cli_metadata_root_t) + metadata_root->length + 4);
+    CHECK(sizeof(cli_metadata_root_t) + metadata_root->length + 4 <= size);
 
     // get the streams
     uint16_t streams = CLI_METADATA_ROOT_STREAMS(metadata_root);
     cli_stream_header_t* stream_header = CLI_METADATA_ROOT_STREAM_HEADERS(metadata_root);
 
     // get all the streams we want
-    cli_metadata_stream_t* metadata_stream = NULL;
+    const cli_metadata_stream_t* metadata_stream = NULL;
     size_t metadata_stream_size = 0;
     for (int i = 0; i < streams; i++) {
         // verify the entry
         CHECK(stream_header->offset + stream_header->size <= size);
         void* data = (void*)metadata_root + stream_header->offset;
 
-        // set the target in the assembly
+        // set the target in the assembly, the image outlives the assembly
+        // so we can simply point into it
         if (strcmp("#~", stream_header->name) == 0) {
             CHECK(sizeof(cli_metadata_stream_t) < stream_header->size);
             metadata_stream = data;
             metadata_stream_size = stream_header->size;
+        } else if (strcmp("#Strings", stream_header->name) == 0) {
+            file->strings = data;
+            file->strings_size = stream_header->size;
+        } else if (strcmp("#US", stream_header->name) == 0) {
+            file->us = data;
+            file->us_size = stream_header->size;
+        } else if (strcmp("#GUID", stream_header->name) == 0) {
+            file->guids = data;
+            file->guids_count = stream_header->size / 16;
+        } else if (strcmp("#Blob", stream_header->name) == 0) {
+            file->blob = data;
+            file->blob_size = stream_header->size;
         } else {
-            // allocate the target
-            void* target = malloc(stream_header->size);
-            CHECK_ERROR(target != NULL, ERROR_OUT_OF_MEMORY);
-
-            // figure which stream we wanna set
-            if (strcmp("#Strings", stream_header->name) == 0) {
-                file->strings = target;
-                file->strings_size = stream_header->size;
-            } else if (strcmp("#US", stream_header->name) == 0) {
-                file->us = target;
-                file->us_size = stream_header->size;
-            } else if (strcmp("#GUID", stream_header->name) == 0) {
-                file->guids = target;
-                file->guids_count = stream_header->size / 16;
-            } else if (strcmp("#Blob", stream_header->name) == 0) {
-                file->blob = target;
-                file->blob_size = stream_header->size;
-            } else {
-                // make sure to free the target before we fail
-                free(target);
-                CHECK_FAIL_ERROR(ERROR_BAD_FORMAT, "%s", stream_header->name);
-            }
-
-            // copy the data
-            memcpy(target, data, stream_header->size);
+            CHECK_FAIL_ERROR(ERROR_BAD_FORMAT, "%s", stream_header->name);
         }
 
         // get the next entry
@@ -548,6 +556,9 @@ err_t metadata_parse(pe_file_t* file, void* stream, size_t size, metadata_t* met
     }
     CHECK(metadata_stream != NULL);
 
+    // the strings are used as c strings, so make sure we can't run off the heap
+    CHECK(file->strings_size != 0 && file->strings[file->strings_size - 1] == '\0');
+
     // now we can parse metadata
     CHECK(metadata_stream->major_version == 2);
     CHECK(metadata_stream->minor_version == 0);
@@ -556,16 +567,17 @@ err_t metadata_parse(pe_file_t* file, void* stream, size_t size, metadata_t* met
     metadata_stream_size -= sizeof(cli_metadata_stream_t);
 
     // parse all the metadata tables
+    metadata->file = file;
+    metadata->long_string_index = metadata_stream->heap_sizes & 0x1 ? true : false;
+    metadata->long_guid_index = metadata_stream->heap_sizes & 0x2 ? true : false;
+    metadata->long_blob_index = metadata_stream->heap_sizes & 0x4 ? true : false;
     metadata_parse_ctx_t ctx = {
         .metadata = metadata,
-        .long_string_index = metadata_stream->heap_sizes & 0x1 ? true : false,
-        .long_guid_index = metadata_stream->heap_sizes & 0x2 ? true : false,
-        .long_blob_index = metadata_stream->heap_sizes & 0x4 ? true : false,
         .file = file,
     };
 
     // set the rows
-    uint32_t* rows = (uint32_t*)metadata_stream->rows;
+    const uint32_t* rows = metadata_stream->rows;
     for (int i = 0; i < ARRAY_LEN(ctx.metadata->tables); i++) {
         if (metadata_stream->valid & (1ull << i)) {
             // check we have enough bytes
@@ -581,17 +593,56 @@ err_t metadata_parse(pe_file_t* file, void* stream, size_t size, metadata_t* met
     // resolve the coded index sizes
     resolve_coded_index_sizes(&ctx);
 
-    // we can set the table and left size for parsing
-    ctx.table = (uint8_t*)rows;
-    ctx.size = metadata_stream_size;
-
+    // find where each of the tables is
+    const uint8_t* table = (const uint8_t*)rows;
     for (int i = 0; i < ARRAY_LEN(ctx.metadata->tables); i++) {
         if (metadata_stream->valid & (1ull << i)) {
-            CHECK_AND_RETHROW(parse_single_table(&ctx, i));
+            size_t row_size, in_memory_size;
+            CHECK_AND_RETHROW(get_table_row_size(&ctx, i, &row_size, &in_memory_size));
+
+            size_t table_size = row_size * ctx.metadata->tables[i].rows;
+            CHECK(table_size <= metadata_stream_size);
+            ctx.metadata->tables[i].data = table;
+            ctx.metadata->tables[i].row_size = row_size;
+
+            table += table_size;
+            metadata_stream_size -= table_size;
         }
     }
 
+    // the loader goes over these right away, and they are accessed directly
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_TYPE_DEF, NULL));
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_METHOD_DEF, NULL));
+    CHECK_AND_RETHROW(metadata_get_table(metadata, METADATA_FIELD, NULL));
+
+cleanup:
+    return err;
+}
+
+err_t metadata_get_table(metadata_t* metadata, int table_id, void* out_table) {
+    err_t err = NO_ERROR;
+
+    CHECK(table_id < ARRAY_LEN(metadata->tables));
+    metadata_table_t* table = &metadata->tables[table_id];
+
+    spinlock_lock(&metadata->lock);
+
+    if (table->table == NULL && table->data != NULL && table->rows != 0) {
+        metadata_parse_ctx_t ctx = {
+            .metadata = metadata,
+            .table = table->data,
+            .size = table->row_size * table->rows,
+            .file = metadata->file,
+        };
+        CHECK_AND_RETHROW(decode_table(&ctx, table_id));
+    }
+
+    if (out_table != NULL) {
+        *(void**)out_table = table->table;
+    }
+
 cleanup:
+    spinlock_unlock(&metadata->lock);
     return err;
 }
 
@@ -599,4 +650,5 @@ void free_metadata(metadata_t* metadata) {
     for (int i = 0; i < ARRAY_LEN(metadata->tables); i++) {
         free(metadata->tables[i].table);
     }
+    memset(metadata, 0, sizeof(*metadata));
 }
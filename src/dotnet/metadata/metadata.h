@@ -3,16 +3,33 @@
 #include "pe.h"
 
 #include <util/except.h>
+#include <sync/spinlock.h>
 
+#include <stdbool.h>
 #include <stdint.h>
 
 typedef struct metadata_table {
+    // the decoded rows, only there once the table was asked for
     void* table;
     int rows;
+
+    // the rows as they are in the image
+    const uint8_t* data;
+    size_t row_size;
 } metadata_table_t;
 
 typedef struct metadata {
     metadata_table_t tables[64];
+
+    // everything needed to decode the tables
+    pe_file_t* file;
+    bool long_string_index;
+    bool long_guid_index;
+    bool long_blob_index;
+    bool long_coded_index[16];
+
+    // protects the decoding of the tables
+    spinlock_t lock;
 } metadata_t;
 
 static inline metadata_type_def_t* metadata_get_type_def(metadata_t* metadata, int index) {
@@ -31,7 +48,9 @@ static inline metadata_field_t* metadata_get_field(metadata_t* metadata, int ind
 }
 
 /**
- * Parse all the metadata stream into the metadata structure organized in nice addressable tables
+ * Parse the metadata stream into the metadata structure organized in nice addressable tables,
+ * the heaps and tables point into the stream so it must stay valid as long as the metadata does.
+ * Only the type def, method def and field tables are decoded right away.
  *
  * @param file      [IN]    The assembly the metadata is related to
  * @param stream    [IN]    The stream to parse
@@ -39,7 +58,16 @@ static inline metadata_field_t* metadata_get_field(metadata_t* metadata, int ind
  * @param metadata  [OUT]   The metadata output
  * @return
  */
-err_t metadata_parse(pe_file_t* file, void* stream, size_t size, metadata_t* metadata);
+err_t metadata_parse(pe_file_t* file, const void* stream, size_t size, metadata_t* metadata);
+
+/**
+ * Get the decoded rows of a table, decoding it on the first use
+ *
+ * @param metadata  [IN]    The metadata
+ * @param table_id  [IN]    The table to get
+ * @param out_table [OUT]   Pointer to the table struct pointer, NULL if the table has no rows, may be NULL
+ */
+err_t metadata_get_table(metadata_t* metadata, int table_id, void* out_table);
 
 /**
  * Free all the allocated metadata
@@ -16,7 +16,7 @@ typedef struct pe_file {
     pe_section_header_t* section_headers;
     size_t section_header_count;
 
-    // specific parts in the loaded assembly
+    // specific parts in the loaded assembly, these point into the file
     char* strings;
     size_t strings_size;
     uint8_t* us;
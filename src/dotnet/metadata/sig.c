@@ -394,7 +394,7 @@ err_t parse_method_def_sig(blob_entry_t _sig, System_Reflection_MethodInfo metho
     GC_UPDATE(method, ReturnType, retType);
 
     // allocate the parameters and update it
-    GC_UPDATE(method, Parameters, GC_NEW_ARRAY(tSystem_Reflection_ParameterInfo, param_count));
+    GC_UPDATE(method, Parameters, GC_NEW_METADATA_ARRAY(tSystem_Reflection_ParameterInfo, param_count));
     for (int i = 0; i < param_count; i++) {
         System_Reflection_ParameterInfo parameter = GC_NEW(tSystem_Reflection_ParameterInfo);
         CHECK_AND_RETHROW(parse_param(
@@ -467,7 +467,7 @@ err_t parse_method_ref_sig(blob_entry_t _sig, System_Reflection_Assembly assembl
     GC_UPDATE(mi, ReturnType, retType);
 
     // allocate the parameters and update it
-    GC_UPDATE(mi, Parameters, GC_NEW_ARRAY(tSystem_Reflection_ParameterInfo, param_count));
+    GC_UPDATE(mi, Parameters, GC_NEW_METADATA_ARRAY(tSystem_Reflection_ParameterInfo, param_count));
     for (int i = 0; i < param_count; i++) {
         System_Reflection_ParameterInfo parameter = GC_NEW(tSystem_Reflection_ParameterInfo);
         CHECK_AND_RETHROW(parse_param(assembly, sig, mi, parameter,
@@ -544,7 +544,7 @@ err_t parse_local_var_sig(blob_entry_t _sig, System_Reflection_MethodInfo method
     CHECK_AND_RETHROW(parse_compressed_integer(sig, &count));
 
     // create the array of local variables and set all their types
-    GC_UPDATE(method->MethodBody, LocalVariables, GC_NEW_ARRAY(tSystem_Reflection_LocalVariableInfo, count));
+    GC_UPDATE(method->MethodBody, LocalVariables, GC_NEW_METADATA_ARRAY(tSystem_Reflection_LocalVariableInfo, count));
     for (int i = 0; i < count; i++) {
         System_Reflection_LocalVariableInfo variable = GC_NEW(tSystem_Reflection_LocalVariableInfo);
         GC_UPDATE_ARRAY(method->MethodBody->LocalVariables, i, variable);
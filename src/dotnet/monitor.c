@@ -1,13 +1,25 @@
 #include "monitor.h"
+#include "types.h"
 #include "util/fastrand.h"
 #include "sync/conditional.h"
 
 #include <thread/scheduler.h>
 #include <sync/mutex.h>
+#include <time/tsc.h>
+#include <time/timer.h>
 
+#include <stdatomic.h>
 #include <stdalign.h>
 #include <stdlib.h>
 
+#ifdef TDN_LOCK_STATS
+#include "jit/jit.h"
+
+#include <util/stb_ds.h>
+
+#include <stdio.h>
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Object -> pointer management
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -25,11 +37,27 @@ typedef struct monitor {
     // the thread that locked the mutex
     thread_t* locker;
 
+    // how many times the locker entered the monitor
+    int recursion;
+
+    // running average of spins needed to take the mutex
+    int spin_estimate;
+
     // the mutex for Enter+Exit
     mutex_t mutex;
 
     // the conditional for Pulse+PulseAll+Wait
     conditional_t cond;
+
+    // the threads that wait for the owner of the thin lock to inflate it
+    mutex_t inflate_mutex;
+    conditional_t inflated;
+
+#ifdef TDN_LOCK_STATS
+    // where the owner entered from and when, for the hold time
+    struct monitor_site* site;
+    uint64_t acquired;
+#endif
 } monitor_t;
 
 typedef struct monitor_root {
@@ -48,6 +76,10 @@ typedef struct monitor_table {
 
 static monitor_table_t m_monitor_table[MONITOR_TABLE_SIZE];
 
+// the bounds of the adaptive spinning before parking on a monitor
+#define MONITOR_MIN_SPINS   10
+#define MONITOR_MAX_SPINS   1000
+
 static monitor_root_t* get_monitor_root(void* addr) {
     return &m_monitor_table[((uintptr_t)addr >> 3) % MONITOR_TABLE_SIZE].root;
 }
@@ -136,7 +168,15 @@ static monitor_t* get_monitor(monitor_root_t* root, void* addr) {
     }
     monitor->cond = INIT_CONDITIONAL();
     monitor->locker = NULL;
+    monitor->recursion = 0;
+    monitor->spin_estimate = 0;
     monitor->mutex = INIT_MUTEX();
+    monitor->inflate_mutex = INIT_MUTEX();
+    monitor->inflated = INIT_CONDITIONAL();
+#ifdef TDN_LOCK_STATS
+    monitor->site = NULL;
+    monitor->acquired = 0;
+#endif
     monitor->next = NULL;
     monitor->prev = NULL;
     
@@ -159,7 +199,224 @@ static monitor_t* get_monitor(monitor_root_t* root, void* addr) {
 }
 
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Contention tracking
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifdef TDN_LOCK_STATS
+
+//
+// The mutexes of the monitors are already tracked like any other lock, but that only tells
+// that monitors are contended, here the enters that go through an inflated monitor are
+// attributed to the first jitted method up the stack, which is the one that called
+// Monitor.Enter or has the lock statement.
+//
+
+// the managed callers we can tell apart, must be a power of two
+#define MONITOR_SITES_COUNT         1024
+
+// how far up the stack to look for the managed caller
+#define MONITOR_SITE_MAX_FRAMES     8
+
+typedef struct monitor_site {
+    // the return address into the caller, zero while free
+    _Atomic(uintptr_t) pc;
+
+    _Atomic(uint64_t) enters;
+    _Atomic(uint64_t) contended;
+    _Atomic(uint64_t) wait_time;
+    _Atomic(uint64_t) max_wait_time;
+    _Atomic(uint64_t) hold_time;
+} monitor_site_t;
+
+static monitor_site_t m_monitor_sites[MONITOR_SITES_COUNT];
+static _Atomic(uint64_t) m_monitor_sites_lost = 0;
+
+static uintptr_t monitor_managed_caller() {
+    thread_t* thread = get_current_thread();
+    uintptr_t first = (uintptr_t)__builtin_return_address(0);
+    if (thread == NULL) {
+        return first;
+    }
+
+    uintptr_t frame = (uintptr_t)__builtin_frame_address(0);
+    uintptr_t low = frame;
+    for (int i = 0; i < MONITOR_SITE_MAX_FRAMES && frame >= low && frame + 16 <= thread->stack_top && (frame & 7) == 0; i++) {
+        uintptr_t* words = (uintptr_t*)frame;
+        if (words[1] == 0) {
+            break;
+        }
+        if (jit_get_code_name(words[1] - 1) != NULL) {
+            return words[1];
+        }
+        low = frame + 16;
+        frame = words[0];
+    }
+
+    return first;
+}
+
+static monitor_site_t* monitor_get_site(uintptr_t pc) {
+    size_t hash = stbds_hash_bytes(&pc, sizeof(pc), 0);
+    for (int i = 0; i < MONITOR_SITES_COUNT; i++) {
+        monitor_site_t* site = &m_monitor_sites[(hash + i) & (MONITOR_SITES_COUNT - 1)];
+        uintptr_t current = atomic_load_explicit(&site->pc, memory_order_relaxed);
+        if (current == 0) {
+            // take the free slot, unless someone beat us to it
+            if (atomic_compare_exchange_strong(&site->pc, &current, pc)) {
+                return site;
+            }
+        }
+        if (current == pc) {
+            return site;
+        }
+    }
+
+    atomic_fetch_add_explicit(&m_monitor_sites_lost, 1, memory_order_relaxed);
+    return NULL;
+}
+
+/**
+ * Called once an enter that went through the monitor took it
+ */
+static void monitor_stats_entered(monitor_t* monitor, uint64_t wait_start, bool contended) {
+    monitor_site_t* site = monitor_get_site(monitor_managed_caller());
+    monitor->site = site;
+    monitor->acquired = get_tsc();
+    if (site == NULL) {
+        return;
+    }
+
+    atomic_fetch_add_explicit(&site->enters, 1, memory_order_relaxed);
+    if (contended) {
+        uint64_t wait_time = monitor->acquired - wait_start;
+        atomic_fetch_add_explicit(&site->contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&site->wait_time, wait_time, memory_order_relaxed);
+
+        uint64_t max = atomic_load_explicit(&site->max_wait_time, memory_order_relaxed);
+        while (wait_time > max && !atomic_compare_exchange_weak_explicit(&site->max_wait_time, &max, wait_time,
+                                                                           memory_order_relaxed, memory_order_relaxed));
+    }
+}
+
+/**
+ * Called right before the owner lets go of the monitor
+ */
+static void monitor_stats_exiting(monitor_t* monitor) {
+    if (monitor->site != NULL) {
+        atomic_fetch_add_explicit(&monitor->site->hold_time, get_tsc() - monitor->acquired, memory_order_relaxed);
+        monitor->site = NULL;
+    }
+}
+
+static int monitor_site_compare(const void* a, const void* b) {
+    uint64_t wa = atomic_load((*(monitor_site_t**)a)->wait_time);
+    uint64_t wb = atomic_load((*(monitor_site_t**)b)->wait_time);
+    return wa < wb ? 1 : wa > wb ? -1 : 0;
+}
+
+void monitor_dump_stats() {
+    monitor_site_t** sites = NULL;
+    for (int i = 0; i < MONITOR_SITES_COUNT; i++) {
+        if (atomic_load(&m_monitor_sites[i].pc) != 0) {
+            arrpush(sites, &m_monitor_sites[i]);
+        }
+    }
+    qsort(sites, arrlen(sites), sizeof(monitor_site_t*), monitor_site_compare);
+
+    printf("%12s %12s %14s %12s %12s  %s\n", "enters", "contended", "wait(us)", "max(us)", "avg hold(us)", "caller");
+    for (int i = 0; i < arrlen(sites); i++) {
+        monitor_site_t* site = sites[i];
+        uintptr_t pc = atomic_load(&site->pc);
+        uint64_t enters = atomic_load(&site->enters);
+        const char* name = jit_get_code_name(pc - 1);
+        printf("%12lu %12lu %14.0f %12.0f %12.2f  ",
+               enters, atomic_load(&site->contended),
+               tsc_to_us(atomic_load(&site->wait_time)), tsc_to_us(atomic_load(&site->max_wait_time)),
+               enters == 0 ? 0.0 : tsc_to_us(atomic_load(&site->hold_time)) / (double)enters);
+        if (name != NULL) {
+            printf("%s\n", name);
+        } else {
+            printf("[native %p]\n", (void*)pc);
+        }
+    }
+    printf("%lu enters from callers that did not fit\n", atomic_load(&m_monitor_sites_lost));
+
+    arrfree(sites);
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Thin locks
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//
+// The thin lock is a single byte in the object header, it is either free, inflated
+// (in which case the monitor from the treap is used), or it holds the thin lock id
+// of the owner in the upper 6 bits, the contended bit and the recursion count minus
+// one in the lowest bit.
+//
+// Only the owner changes the owner and recursion of a held thin lock, other threads
+// can only move it from free to inflated, or set the contended bit. The owner moves
+// a contended lock to the monitor on its next enter or exit, and the contenders park
+// until it did. Once a lock is inflated it stays inflated until the object is freed.
+//
+#define THIN_LOCK_FREE              0x00
+#define THIN_LOCK_INFLATED          0xFF
+#define THIN_LOCK_CONTENDED         0x02
+#define THIN_LOCK_MAX_ID            62
+#define THIN_LOCK_MAX_RECURSION     2
+
+#define THIN_LOCK_OWNER(value)      ((value) >> 2)
+#define THIN_LOCK_RECURSION(value)  (((value) & 1) + 1)
+#define THIN_LOCK_MAKE(id, count)   (uint8_t)(((id) << 2) | ((count) - 1))
+
+// the thin lock id of the current thread, zero if not allocated yet
+static THREAD_LOCAL uint8_t m_thin_lock_id = 0;
+
+// the thin lock ids that are not used by any thread, one bit per id
+static _Atomic(uint64_t) m_thin_lock_free_ids = ((1ull << (THIN_LOCK_MAX_ID + 1)) - 1) & ~1ull;
+
+/**
+ * Get the thin lock id of the current thread, THIN_LOCK_INFLATED if we ran
+ * out of ids, in which case the thread always uses the inflated monitors
+ */
+static uint8_t get_thin_lock_id() {
+    if (m_thin_lock_id == 0) {
+        uint64_t free_ids = atomic_load(&m_thin_lock_free_ids);
+        uint8_t id = THIN_LOCK_INFLATED;
+        while (free_ids != 0) {
+            int lowest = __builtin_ctzll(free_ids);
+            if (atomic_compare_exchange_weak(&m_thin_lock_free_ids, &free_ids, free_ids & ~(1ull << lowest))) {
+                id = lowest;
+                break;
+            }
+        }
+        m_thin_lock_id = id;
+    }
+    return m_thin_lock_id;
+}
+
+void monitor_thread_exit() {
+    // a thread that exits while holding a thin lock leaves it held for good
+    // either way, so the id can be given to the next thread
+    if (m_thin_lock_id != 0 && m_thin_lock_id != THIN_LOCK_INFLATED) {
+        atomic_fetch_or(&m_thin_lock_free_ids, 1ull << m_thin_lock_id);
+    }
+    m_thin_lock_id = 0;
+}
+
+static uint8_t* get_thin_lock(void* object) {
+    return &((System_Object)object)->thin_lock;
+}
+
 void free_monitor(void* object) {
+    // only inflated locks have a monitor
+    if (__atomic_load_n(get_thin_lock(object), __ATOMIC_RELAXED) != THIN_LOCK_INFLATED) {
+        return;
+    }
+
     monitor_root_t* root = get_monitor_root(object);
 
     spinlock_lock(&root->lock);
@@ -229,49 +486,286 @@ static void release_lock(monitor_t* monitor) {
     monitor->locker = NULL;
 }
 
-err_t monitor_enter(void* object) {
+/**
+ * Inflate a thin lock that is owned by the current thread, the monitor takes over
+ * the ownership and the recursion count of the thin lock
+ */
+static err_t inflate_owned(void* object, uint8_t value, monitor_t** out_monitor) {
     err_t err = NO_ERROR;
 
     // get the monitor object
     monitor_t* monitor = get_monitor(get_monitor_root(object), object);
     CHECK_ERROR(monitor != NULL, ERROR_OUT_OF_MEMORY);
 
-    // lock it
+    // nobody else can hold the monitor while we own the thin lock, so
+    // this will not block
     mutex_lock(&monitor->mutex);
     take_lock(monitor);
+    monitor->recursion = THIN_LOCK_RECURSION(value);
+
+    // from now on everyone goes through the monitor
+    __atomic_store_n(get_thin_lock(object), THIN_LOCK_INFLATED, __ATOMIC_RELEASE);
+
+    // wake the contenders, they will park on the mutex
+    mutex_lock(&monitor->inflate_mutex);
+    conditional_broadcast(&monitor->inflated);
+    mutex_unlock(&monitor->inflate_mutex);
+
+    *out_monitor = monitor;
 
 cleanup:
     return err;
 }
 
-err_t monitor_exit(void* object) {
+/**
+ * Get the monitor of a lock owned by the current thread, inflating it if needed
+ */
+static err_t get_owned_monitor(void* object, monitor_t** out_monitor) {
     err_t err = NO_ERROR;
 
+    uint8_t id = get_thin_lock_id();
+    uint8_t value = __atomic_load_n(get_thin_lock(object), __ATOMIC_RELAXED);
+    if (value != THIN_LOCK_INFLATED) {
+        CHECK_ERROR(value != THIN_LOCK_FREE && THIN_LOCK_OWNER(value) == id, ERROR_SYNCHRONIZATION_LOCK);
+        CHECK_AND_RETHROW(inflate_owned(object, value, out_monitor));
+        goto cleanup;
+    }
+
     // get the monitor object
     monitor_t* monitor = get_monitor(get_monitor_root(object), object);
     CHECK_ERROR(monitor != NULL, ERROR_OUT_OF_MEMORY);
 
-    // make sure the locked thread also frees this
+    // make sure the locked thread is the one using it
     CHECK_ERROR(monitor->locker == get_current_thread(), ERROR_SYNCHRONIZATION_LOCK);
 
-    // unlock the mutex
-    mutex_unlock(&monitor->mutex);
-    release_lock(monitor);
+    *out_monitor = monitor;
 
 cleanup:
     return err;
 }
 
-err_t monitor_pulse(void* object) {
+/**
+ * Turn a timeout in milliseconds into a deadline in microtime() units, a
+ * negative timeout means to wait forever
+ */
+static uint64_t get_deadline(int32_t timeout) {
+    if (timeout < 0) {
+        return UINT64_MAX;
+    }
+    return microtime() + (uint64_t)timeout * 1000;
+}
+
+/**
+ * Park until the owner of the contended thin lock inflated it, the caller
+ * already set the contended bit
+ */
+static bool wait_inflated(monitor_t* monitor, uint8_t* thin_lock, uint64_t deadline) {
+    bool inflated = true;
+
+    mutex_lock(&monitor->inflate_mutex);
+    while (__atomic_load_n(thin_lock, __ATOMIC_ACQUIRE) != THIN_LOCK_INFLATED) {
+        if (deadline == UINT64_MAX) {
+            conditional_wait(&monitor->inflated, &monitor->inflate_mutex);
+        } else if (!conditional_wait_until(&monitor->inflated, &monitor->inflate_mutex, deadline)) {
+            inflated = __atomic_load_n(thin_lock, __ATOMIC_ACQUIRE) == THIN_LOCK_INFLATED;
+            break;
+        }
+    }
+    mutex_unlock(&monitor->inflate_mutex);
+
+    return inflated;
+}
+
+/**
+ * Lock the mutex of the monitor, spinning for a bit before parking since
+ * most critical sections are short. The spin budget adapts to how long it
+ * took the previous acquires to succeed, so monitors that are held for long
+ * stop burning cycles and short ones rarely park.
+ */
+static bool lock_monitor(monitor_t* monitor, uint64_t deadline) {
+    int max_spins = MIN(monitor->spin_estimate * 2 + MONITOR_MIN_SPINS, MONITOR_MAX_SPINS);
+
+    int spins = 0;
+    while (!mutex_try_lock(&monitor->mutex)) {
+        if (spins++ >= max_spins) {
+            // spinning did not help, park until we get it
+            if (deadline == UINT64_MAX) {
+                mutex_lock(&monitor->mutex);
+            } else if (!mutex_lock_until(&monitor->mutex, deadline)) {
+                return false;
+            }
+            break;
+        }
+        __builtin_ia32_pause();
+    }
+
+    // we hold the mutex, so we can update the estimate safely
+    monitor->spin_estimate += (spins - monitor->spin_estimate) / 8;
+    return true;
+}
+
+err_t monitor_try_enter(void* object, int32_t timeout, bool* lock_taken) {
     err_t err = NO_ERROR;
+    uint8_t* thin_lock = get_thin_lock(object);
+    uint8_t id = get_thin_lock_id();
+
+    *lock_taken = false;
+
+    if (id != THIN_LOCK_INFLATED) {
+        // fast path, the lock is free
+        uint8_t value = THIN_LOCK_FREE;
+        if (__atomic_compare_exchange_n(thin_lock, &value, THIN_LOCK_MAKE(id, 1),
+                                        false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            *lock_taken = true;
+            goto cleanup;
+        }
+
+        // recursive enter, a contender may set the contended bit meanwhile,
+        // in which case we move the lock to the monitor
+        if (value != THIN_LOCK_INFLATED && THIN_LOCK_OWNER(value) == id) {
+            int count = THIN_LOCK_RECURSION(value);
+            if (
+                count >= THIN_LOCK_MAX_RECURSION || (value & THIN_LOCK_CONTENDED) ||
+                !__atomic_compare_exchange_n(thin_lock, &value, THIN_LOCK_MAKE(id, count + 1),
+                                             false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+            ) {
+                monitor_t* monitor = NULL;
+                CHECK_AND_RETHROW(inflate_owned(object, value, &monitor));
+                monitor->recursion++;
+            }
+            *lock_taken = true;
+            goto cleanup;
+        }
+    }
+
+    uint64_t deadline = get_deadline(timeout);
+#ifdef TDN_LOCK_STATS
+    uint64_t wait_start = get_tsc();
+#endif
+
+    // contended, spin for a bit in case the owner lets go soon, then ask
+    // the owner to inflate the lock and park until it did
+    int spins = 0;
+    uint8_t value = __atomic_load_n(thin_lock, __ATOMIC_RELAXED);
+    while (value != THIN_LOCK_INFLATED) {
+        if (value == THIN_LOCK_FREE) {
+            if (__atomic_compare_exchange_n(thin_lock, &value, THIN_LOCK_INFLATED,
+                                            false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (deadline != UINT64_MAX && microtime() >= deadline) {
+            goto cleanup;
+
+        } else if (spins++ < MONITOR_MAX_SPINS) {
+            __builtin_ia32_pause();
+            value = __atomic_load_n(thin_lock, __ATOMIC_RELAXED);
+
+        } else if (!(value & THIN_LOCK_CONTENDED)) {
+            // on failure value is updated, so just try again
+            __atomic_compare_exchange_n(thin_lock, &value, value | THIN_LOCK_CONTENDED,
+                                        false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+        } else {
+            // the owner is going to inflate it, so it gets a monitor anyways
+            monitor_t* monitor = get_monitor(get_monitor_root(object), object);
+            CHECK_ERROR(monitor != NULL, ERROR_OUT_OF_MEMORY);
+            if (!wait_inflated(monitor, thin_lock, deadline)) {
+                goto cleanup;
+            }
+            break;
+        }
+    }
 
     // get the monitor object
     monitor_t* monitor = get_monitor(get_monitor_root(object), object);
     CHECK_ERROR(monitor != NULL, ERROR_OUT_OF_MEMORY);
 
+    // recursive enter on an inflated lock
+    if (monitor->locker == get_current_thread()) {
+        monitor->recursion++;
+        *lock_taken = true;
+        goto cleanup;
+    }
+
+    // lock it
+#ifdef TDN_LOCK_STATS
+    bool contended = spins != 0 || monitor->locker != NULL;
+#endif
+    if (!lock_monitor(monitor, deadline)) {
+        goto cleanup;
+    }
+    take_lock(monitor);
+    monitor->recursion = 1;
+    *lock_taken = true;
+#ifdef TDN_LOCK_STATS
+    monitor_stats_entered(monitor, wait_start, contended);
+#endif
+
+cleanup:
+    return err;
+}
+
+err_t monitor_enter(void* object) {
+    bool lock_taken;
+    return monitor_try_enter(object, -1, &lock_taken);
+}
+
+err_t monitor_exit(void* object) {
+    err_t err = NO_ERROR;
+    uint8_t* thin_lock = get_thin_lock(object);
+    monitor_t* monitor = NULL;
+
+    uint8_t value = __atomic_load_n(thin_lock, __ATOMIC_RELAXED);
+    if (value != THIN_LOCK_INFLATED) {
+        // make sure the locked thread also frees this
+        uint8_t id = get_thin_lock_id();
+        CHECK_ERROR(value != THIN_LOCK_FREE && THIN_LOCK_OWNER(value) == id, ERROR_SYNCHRONIZATION_LOCK);
+
+        // on failure a contender set the contended bit
+        int count = THIN_LOCK_RECURSION(value);
+        uint8_t new_value = count > 1 ? THIN_LOCK_MAKE(id, count - 1) : THIN_LOCK_FREE;
+        if (
+            !(value & THIN_LOCK_CONTENDED) &&
+            __atomic_compare_exchange_n(thin_lock, &value, new_value,
+                                        false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)
+        ) {
+            goto cleanup;
+        }
+
+        // someone waits for it, hand it over to the monitor and exit through it
+        CHECK_AND_RETHROW(inflate_owned(object, value, &monitor));
+    } else {
+        // get the monitor object
+        monitor = get_monitor(get_monitor_root(object), object);
+        CHECK_ERROR(monitor != NULL, ERROR_OUT_OF_MEMORY);
+    }
+
     // make sure the locked thread also frees this
     CHECK_ERROR(monitor->locker == get_current_thread(), ERROR_SYNCHRONIZATION_LOCK);
 
+    // still held by an outer enter
+    if (--monitor->recursion > 0) {
+        goto cleanup;
+    }
+
+    // release the ownership and unlock the mutex
+#ifdef TDN_LOCK_STATS
+    monitor_stats_exiting(monitor);
+#endif
+    release_lock(monitor);
+    mutex_unlock(&monitor->mutex);
+
+cleanup:
+    return err;
+}
+
+err_t monitor_pulse(void* object) {
+    err_t err = NO_ERROR;
+
+    // get the monitor object, inflating if needed
+    monitor_t* monitor = NULL;
+    CHECK_AND_RETHROW(get_owned_monitor(object, &monitor));
+
     // pulse it
     conditional_signal(&monitor->cond);
 
@@ -282,12 +776,9 @@ cleanup:
 err_t monitor_pulse_all(void* object) {
     err_t err = NO_ERROR;
 
-    // get the monitor object
-    monitor_t* monitor = get_monitor(get_monitor_root(object), object);
-    CHECK_ERROR(monitor != NULL, ERROR_OUT_OF_MEMORY);
-
-    // make sure the locked thread also frees this
-    CHECK_ERROR(monitor->locker == get_current_thread(), ERROR_SYNCHRONIZATION_LOCK);
+    // get the monitor object, inflating if needed
+    monitor_t* monitor = NULL;
+    CHECK_AND_RETHROW(get_owned_monitor(object, &monitor));
 
     // pulse all
     conditional_broadcast(&monitor->cond);
@@ -296,25 +787,66 @@ cleanup:
     return err;
 }
 
-err_t monitor_wait(void* object) {
-    err_t err = NO_ERROR;
+typedef struct monitor_timeout {
+    wheel_timer_t timer;
+    monitor_t* monitor;
+    bool fired;
+} monitor_timeout_t;
 
-    // get the monitor object
-    monitor_t* monitor = get_monitor(get_monitor_root(object), object);
-    CHECK_ERROR(monitor != NULL, ERROR_OUT_OF_MEMORY);
+/**
+ * Wakes the waiters of the monitor once a timed wait expires
+ */
+static void monitor_timeout_fire(void* arg) {
+    monitor_timeout_t* ctx = arg;
+    mutex_lock(&ctx->monitor->mutex);
+    ctx->fired = true;
+    conditional_broadcast(&ctx->monitor->cond);
+    mutex_unlock(&ctx->monitor->mutex);
+}
 
-    // make sure the locked thread also frees this
-    CHECK_ERROR(monitor->locker == get_current_thread(), ERROR_SYNCHRONIZATION_LOCK);
+err_t monitor_wait_timeout(void* object, int32_t timeout, bool* signaled) {
+    err_t err = NO_ERROR;
+
+    // get the monitor object, inflating if needed
+    monitor_t* monitor = NULL;
+    CHECK_AND_RETHROW(get_owned_monitor(object, &monitor));
 
     // we are going to unlock, so remove our ownership
+    int recursion = monitor->recursion;
+#ifdef TDN_LOCK_STATS
+    monitor_stats_exiting(monitor);
+#endif
     release_lock(monitor);
 
     // wait for it
-    conditional_wait(&monitor->cond, &monitor->mutex);
+    if (timeout < 0) {
+        conditional_wait(&monitor->cond, &monitor->mutex);
+        *signaled = true;
+    } else {
+        monitor_timeout_t ctx = { .monitor = monitor, .fired = false };
+        timer_arm(&ctx.timer, get_deadline(timeout), monitor_timeout_fire, &ctx);
+
+        conditional_wait(&monitor->cond, &monitor->mutex);
+        *signaled = !ctx.fired;
+
+        // the timer is on our stack, if it is already firing wait for
+        // it to finish, it needs the mutex to do so
+        if (!ctx.fired && !timer_cancel(&ctx.timer)) {
+            while (!ctx.fired) {
+                conditional_wait(&monitor->cond, &monitor->mutex);
+            }
+        }
+    }
 
     // we are again the owners of the lock
     take_lock(monitor);
+    monitor->recursion = recursion;
 
 cleanup:
     return err;
 }
+
+err_t monitor_wait(void* object) {
+    bool signaled;
+    return monitor_wait_timeout(object, -1, &signaled);
+}
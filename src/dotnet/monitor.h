@@ -6,8 +6,22 @@
 
 void free_monitor(void* object);
 
+/**
+ * Called once the entry of the current thread returned, gives
+ * its thin lock id to the threads that start later
+ */
+void monitor_thread_exit();
+
 err_t monitor_enter(void* object);
 
+/**
+ * Try to enter the monitor, giving up after the timeout
+ *
+ * @param timeout       timeout in milliseconds, negative to wait forever
+ * @param lock_taken    [OUT] set to true if the lock was taken
+ */
+err_t monitor_try_enter(void* object, int32_t timeout, bool* lock_taken);
+
 err_t monitor_exit(void* object);
 
 err_t monitor_pulse(void* object);
@@ -15,3 +29,22 @@ err_t monitor_pulse(void* object);
 err_t monitor_pulse_all(void* object);
 
 err_t monitor_wait(void* object);
+
+/**
+ * Wait on the monitor, giving up after the timeout, the lock is
+ * taken again in either case
+ *
+ * @param timeout       timeout in milliseconds, negative to wait forever
+ * @param signaled      [OUT] set to false if the wait timed out
+ */
+err_t monitor_wait_timeout(void* object, int32_t timeout, bool* signaled);
+
+#ifdef TDN_LOCK_STATS
+
+/**
+ * Print the enters that went through an inflated monitor by their managed
+ * caller, the ones that waited the longest first
+ */
+void monitor_dump_stats();
+
+#endif
@@ -0,0 +1,263 @@
+#include "thread_pool.h"
+
+#include "gc/gc.h"
+
+#include <thread/scheduler.h>
+#include <thread/waitable.h>
+#include <sync/spinlock.h>
+#include <util/fastrand.h>
+#include <util/trace.h>
+#include <util/defs.h>
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+//
+// Every worker has its own queue, work queued from a worker goes to its own queue and
+// is taken from the end, so continuations run while their data is still in the cache,
+// everything else goes to the global queue. An idle worker looks at its own queue, then
+// the global one, and then steals from the start of the queue of another worker.
+//
+// The waitable holds a token for every queued item, so the workers simply block on it
+// while there is nothing to do.
+//
+// The queues are managed arrays of delegate and state pairs which are rooted in the gc,
+// so queued items stay alive.
+//
+
+// the initial amount of items a queue can hold, grows as needed
+#define THREAD_POOL_QUEUE_INITIAL_SIZE  64
+
+// the most workers we are going to have
+#define THREAD_POOL_MAX_WORKERS         256
+
+typedef struct thread_pool_queue {
+    spinlock_t lock;
+
+    // pairs of delegate and state
+    System_Object_Array items;
+
+    // ever growing indexes, wrapped around the array
+    size_t head;
+    size_t tail;
+} thread_pool_queue_t;
+
+typedef struct thread_pool_worker {
+    thread_pool_queue_t queue;
+    thread_t* thread;
+} thread_pool_worker_t;
+
+static thread_pool_queue_t m_thread_pool_global_queue = { 0 };
+
+static thread_pool_worker_t m_thread_pool_workers[THREAD_POOL_MAX_WORKERS];
+static int m_thread_pool_worker_count = 0;
+
+/**
+ * A token for every queued item
+ */
+static waitable_t* m_thread_pool_work = NULL;
+
+/**
+ * The worker the current thread is, NULL if not part of the pool
+ */
+static THREAD_LOCAL thread_pool_worker_t* m_thread_pool_worker = NULL;
+
+static spinlock_t m_thread_pool_init_lock;
+static _Atomic(bool) m_thread_pool_started = false;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Queues
+//----------------------------------------------------------------------------------------------------------------------
+
+static size_t queue_capacity(thread_pool_queue_t* queue) {
+    return queue->items == NULL ? 0 : queue->items->Length / 2;
+}
+
+static err_t queue_push(thread_pool_queue_t* queue, System_Delegate delegate, System_Object state) {
+    err_t err = NO_ERROR;
+
+    spinlock_lock(&queue->lock);
+
+    size_t capacity;
+    while (queue->tail - queue->head == (capacity = queue_capacity(queue))) {
+        // full, the allocation might wait for the gc so do it without
+        // the lock, and only switch if no one grew it meanwhile
+        spinlock_unlock(&queue->lock);
+        size_t new_capacity = capacity == 0 ? THREAD_POOL_QUEUE_INITIAL_SIZE : capacity * 2;
+        System_Object_Array items = gc_new_array(tSystem_Object, new_capacity * 2);
+        CHECK_ERROR(items != NULL, ERROR_OUT_OF_MEMORY);
+        spinlock_lock(&queue->lock);
+
+        if (queue_capacity(queue) != capacity || queue->tail - queue->head != capacity) {
+            continue;
+        }
+
+        // move everything to the bigger array
+        for (size_t i = 0; i < capacity; i++) {
+            size_t from = ((queue->head + i) % capacity) * 2;
+            GC_UPDATE_ARRAY(items, i * 2, queue->items->Data[from]);
+            GC_UPDATE_ARRAY(items, i * 2 + 1, queue->items->Data[from + 1]);
+        }
+
+        queue->items = items;
+        queue->head = 0;
+        queue->tail = capacity;
+    }
+
+    size_t index = (queue->tail % capacity) * 2;
+    GC_UPDATE_ARRAY(queue->items, index, delegate);
+    GC_UPDATE_ARRAY(queue->items, index + 1, state);
+    queue->tail++;
+
+    spinlock_unlock(&queue->lock);
+
+cleanup:
+    return err;
+}
+
+/**
+ * Take an item out of the queue, either from the start or the end, the
+ * slots are cleared so the queue won't keep the item alive
+ */
+static bool queue_pop(thread_pool_queue_t* queue, bool from_tail, System_Delegate* delegate, System_Object* state) {
+    // quick check without the lock, for the steal path
+    if (queue->tail == queue->head) {
+        return false;
+    }
+
+    spinlock_lock(&queue->lock);
+
+    bool found = queue->tail != queue->head;
+    if (found) {
+        size_t position = from_tail ? --queue->tail : queue->head++;
+        size_t index = (position % queue_capacity(queue)) * 2;
+
+        *delegate = (System_Delegate)queue->items->Data[index];
+        *state = queue->items->Data[index + 1];
+        GC_UPDATE_ARRAY(queue->items, index, NULL);
+        GC_UPDATE_ARRAY(queue->items, index + 1, NULL);
+    }
+
+    spinlock_unlock(&queue->lock);
+    return found;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Workers
+//----------------------------------------------------------------------------------------------------------------------
+
+static bool thread_pool_find_work(thread_pool_worker_t* worker, System_Delegate* delegate, System_Object* state) {
+    // our own work first, newest first
+    if (queue_pop(&worker->queue, true, delegate, state)) {
+        return true;
+    }
+
+    // then the global work
+    if (queue_pop(&m_thread_pool_global_queue, false, delegate, state)) {
+        return true;
+    }
+
+    // and finally steal the oldest work of someone else
+    int start = fastrandn(m_thread_pool_worker_count);
+    for (int i = 0; i < m_thread_pool_worker_count; i++) {
+        thread_pool_worker_t* victim = &m_thread_pool_workers[(start + i) % m_thread_pool_worker_count];
+        if (victim != worker && queue_pop(&victim->queue, false, delegate, state)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void thread_pool_worker(void* arg) {
+    thread_pool_worker_t* worker = arg;
+    m_thread_pool_worker = worker;
+
+    while (true) {
+        // wait until there is something queued
+        if (waitable_wait(m_thread_pool_work, true) != WAITABLE_SUCCESS) {
+            break;
+        }
+
+        // the token is sent only after the item is queued, so it must be
+        // somewhere, but another worker might still be holding it
+        System_Delegate delegate = NULL;
+        System_Object state = NULL;
+        while (!thread_pool_find_work(worker, &delegate, &state)) {
+            scheduler_yield();
+        }
+
+        System_Reflection_MethodInfo invoke = OBJECT_TYPE(delegate)->DelegateSignature;
+        System_Exception exception = ((System_Exception(*)(System_Delegate, System_Object))invoke->MirFunc->addr)(delegate, state);
+        if (exception != NULL) {
+            // nothing is there to catch it, so tear down the process like .NET does
+            System_Type type = OBJECT_TYPE(exception);
+            ERROR("Unhandled exception in thread pool work item: %U.%U: %U",
+                  type->Namespace, type->Name, exception->Message);
+            fflush(stdout);
+            abort();
+        }
+    }
+}
+
+static err_t thread_pool_start() {
+    err_t err = NO_ERROR;
+
+    spinlock_lock(&m_thread_pool_init_lock);
+
+    if (atomic_load(&m_thread_pool_started)) {
+        goto cleanup;
+    }
+
+    m_thread_pool_work = create_waitable(INT32_MAX);
+    CHECK_ERROR(m_thread_pool_work != NULL, ERROR_OUT_OF_MEMORY);
+
+    // the queues are never freed, so root them once
+    int count = MIN(MAX(get_cpu_count(), 1), THREAD_POOL_MAX_WORKERS);
+    gc_add_root(&m_thread_pool_global_queue.items);
+    for (int i = 0; i < count; i++) {
+        gc_add_root(&m_thread_pool_workers[i].queue.items);
+    }
+
+    for (int i = 0; i < count; i++) {
+        thread_pool_worker_t* worker = &m_thread_pool_workers[i];
+        worker->thread = create_thread(thread_pool_worker, worker, "dotnet/pool[%d]", i);
+        CHECK_ERROR(worker->thread != NULL, ERROR_OUT_OF_MEMORY);
+        m_thread_pool_worker_count++;
+        scheduler_ready_thread(worker->thread);
+    }
+
+    atomic_store(&m_thread_pool_started, true);
+
+cleanup:
+    spinlock_unlock(&m_thread_pool_init_lock);
+    return err;
+}
+
+err_t thread_pool_queue(System_Delegate delegate, System_Object state, bool prefer_local) {
+    err_t err = NO_ERROR;
+
+    CHECK(delegate != NULL);
+
+    if (!atomic_load(&m_thread_pool_started)) {
+        CHECK_AND_RETHROW(thread_pool_start());
+    }
+
+    thread_pool_queue_t* queue = &m_thread_pool_global_queue;
+    if (prefer_local && m_thread_pool_worker != NULL) {
+        queue = &m_thread_pool_worker->queue;
+    }
+
+    CHECK_AND_RETHROW(queue_push(queue, delegate, state));
+
+    // let a worker know, never blocks since the buffer is practically unlimited
+    waitable_send(m_thread_pool_work, false);
+
+cleanup:
+    return err;
+}
+
+int thread_pool_get_worker_count() {
+    return m_thread_pool_worker_count;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "types.h"
+
+#include "util/except.h"
+
+/**
+ * Queue a work item to the runtime thread pool, the delegate is invoked
+ * with the state as its only argument on one of the pool workers
+ *
+ * @param delegate      [IN] The delegate to invoke, must take a single object
+ * @param state         [IN] The argument to the delegate
+ * @param prefer_local  [IN] Queue to the current worker if called from the pool, this
+ *                           is meant for continuations which are likely to touch the
+ *                           same data as the work item that queued them
+ */
+err_t thread_pool_queue(System_Delegate delegate, System_Object state, bool prefer_local);
+
+/**
+ * Get the amount of workers in the pool
+ */
+int thread_pool_get_worker_count();
@@ -9,6 +9,7 @@
 
 #include <util/strbuilder.h>
 #include <util/stb_ds.h>
+#include <sync/spinlock.h>
 
 #include <stdalign.h>
 #include <stdlib.h>
@@ -55,6 +56,8 @@ System_Type tSystem_NullReferenceException = NULL;
 System_Type tSystem_InvalidCastException = NULL;
 System_Type tSystem_OutOfMemoryException = NULL;
 System_Type tSystem_OverflowException = NULL;
+System_Type tSystem_ArgumentNullException = NULL;
+System_Type tSystem_TypeInitializationException = NULL;
 System_Type tSystem_RuntimeTypeHandle = NULL;
 System_Type tSystem_Nullable = NULL;
 System_Type tSystem_Span = NULL;
@@ -90,13 +93,8 @@ bool string_equals(System_String a, System_String b) {
         return false;
     }
 
-    for (int i = 0; i < a->Length; i++) {
-        if (a->Chars[i] != b->Chars[i]) {
-            return false;
-        }
-    }
-
-    return true;
+    // the libc memcmp is picked for the cpu we run on
+    return memcmp(a->Chars, b->Chars, a->Length * sizeof(System_Char)) == 0;
 }
 
 System_String string_append_cstr(System_String old, const char* str) {
@@ -114,6 +112,246 @@ System_String string_append_cstr(System_String old, const char* str) {
     return new;
 }
 
+//
+// The intern table, interned strings are immortal, same as in .NET where they live as long
+// as the domain does. The literals of all the assemblies and the names of the members go
+// through it, so equal names are usually the same object and compare by reference.
+//
+
+static struct {
+    size_t key;
+    System_String* value;
+}* m_interned_strings = NULL;
+
+static mutex_t m_interned_strings_lock = INIT_MUTEX();
+
+/**
+ * Find the interned string with the given chars, if not found and insert is set then
+ * a new immortal copy is interned, called with the intern lock
+ */
+static System_String string_intern_locked(const System_Char* chars, int length, bool insert) {
+    size_t hash = stbds_hash_bytes(chars, length * sizeof(System_Char), length);
+
+    int index = hmgeti(m_interned_strings, hash);
+    if (index >= 0) {
+        System_String* bucket = m_interned_strings[index].value;
+        for (int i = 0; i < arrlen(bucket); i++) {
+            if (bucket[i]->Length == length && memcmp(bucket[i]->Chars, chars, length * sizeof(System_Char)) == 0) {
+                return bucket[i];
+            }
+        }
+    }
+
+    if (!insert) {
+        return NULL;
+    }
+
+    gc_immortal_begin();
+    System_String string = GC_NEW_STRING(length);
+    gc_immortal_end();
+    if (string == NULL) {
+        return NULL;
+    }
+    memcpy(string->Chars, chars, length * sizeof(System_Char));
+
+    if (index >= 0) {
+        arrpush(m_interned_strings[index].value, string);
+    } else {
+        System_String* bucket = NULL;
+        arrpush(bucket, string);
+        hmput(m_interned_strings, hash, bucket);
+    }
+
+    return string;
+}
+
+System_String string_intern_chars(const System_Char* chars, int length) {
+    mutex_lock(&m_interned_strings_lock);
+    System_String string = string_intern_locked(chars, length, true);
+    mutex_unlock(&m_interned_strings_lock);
+    return string;
+}
+
+System_String string_intern(System_String str) {
+    return string_intern_chars(str->Chars, str->Length);
+}
+
+System_String string_is_interned(System_String str) {
+    mutex_lock(&m_interned_strings_lock);
+    System_String string = string_intern_locked(str->Chars, str->Length, false);
+    mutex_unlock(&m_interned_strings_lock);
+    return string;
+}
+
+//
+// Lookups by name and by token are cached in hash tables, so loading assemblies and jitting
+// code with many references does not walk the type and member tables every time:
+//  - types by namespace and name, built for all the types of an assembly on the first lookup
+//  - members by name, built for a whole methods or fields array on the first lookup, the
+//    arrays never change once filled so they are used as the key
+//  - the result of resolving a MemberRef, MethodSpec or TypeSpec, along with the generic
+//    context it was resolved in
+//
+// All the tables are keyed by a hash and the entries are checked against what we looked for,
+// on a collision the first entry stays and the others are found the slow way.
+//
+
+static struct {
+    size_t key;
+    System_Type value;
+}* m_type_names = NULL;
+
+static struct {
+    size_t key;
+    int* value;
+}* m_member_names = NULL;
+
+/**
+ * The assemblies and member arrays that are already in the tables
+ */
+static struct {
+    void* key;
+    bool value;
+}* m_indexed = NULL;
+
+typedef struct token_cache_entry {
+    System_Reflection_Assembly assembly;
+    token_t token;
+
+    // copy of the type arguments followed by the method arguments, a
+    // count of -1 means there were none
+    System_Type* arguments;
+    int type_args_count;
+    int method_args_count;
+
+    void* value;
+} token_cache_entry_t;
+
+static struct {
+    size_t key;
+    token_cache_entry_t value;
+}* m_token_cache = NULL;
+
+static spinlock_t m_lookup_lock;
+
+static size_t name_hash_cstr(const char* str, size_t hash) {
+    hash ^= 0xcbf29ce484222325;
+    for (; *str != '\0'; str++) {
+        hash = (hash ^ (uint8_t)*str) * 0x100000001b3;
+    }
+    return hash;
+}
+
+/**
+ * Same as the cstr version for ascii names, anything else never matches a cstr anyway
+ */
+static size_t name_hash_string(System_String str, size_t hash) {
+    hash ^= 0xcbf29ce484222325;
+    for (int i = 0; i < str->Length; i++) {
+        hash = (hash ^ str->Chars[i]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+/**
+ * Get the indexes of all the members with the given name, in order, called with the lookup lock
+ */
+static int* member_names_lookup(System_Reflection_MemberInfo_Array members, size_t hash) {
+    if (hmgeti(m_indexed, members) < 0) {
+        for (int i = 0; i < members->Length; i++) {
+            size_t member_hash = name_hash_string(members->Data[i]->Name, (size_t)members);
+            int index = hmgeti(m_member_names, member_hash);
+            if (index < 0) {
+                int* indexes = NULL;
+                arrpush(indexes, i);
+                hmput(m_member_names, member_hash, indexes);
+            } else if (string_equals(members->Data[m_member_names[index].value[0]]->Name, members->Data[i]->Name)) {
+                arrpush(m_member_names[index].value, i);
+            }
+        }
+        hmput(m_indexed, members, true);
+    }
+
+    int index = hmgeti(m_member_names, hash);
+    return index < 0 ? NULL : m_member_names[index].value;
+}
+
+static size_t token_cache_hash(System_Reflection_Assembly assembly, token_t token, System_Type_Array typeArgs, System_Type_Array methodArgs) {
+    size_t hash = (size_t)assembly ^ ((size_t)token.token * 0x9E3779B97F4A7C15ull);
+    if (typeArgs != NULL) {
+        hash = stbds_hash_bytes(typeArgs->Data, typeArgs->Length * sizeof(System_Type), hash);
+    }
+    if (methodArgs != NULL) {
+        hash = stbds_hash_bytes(methodArgs->Data, methodArgs->Length * sizeof(System_Type), hash + 1);
+    }
+    return hash;
+}
+
+static bool token_cache_args_equal(System_Type* cached, int count, System_Type_Array args) {
+    if (args == NULL) {
+        return count == -1;
+    }
+    return count == args->Length && memcmp(cached, args->Data, count * sizeof(System_Type)) == 0;
+}
+
+static void* token_cache_get(System_Reflection_Assembly assembly, token_t token, System_Type_Array typeArgs, System_Type_Array methodArgs) {
+    size_t hash = token_cache_hash(assembly, token, typeArgs, methodArgs);
+    void* value = NULL;
+
+    spinlock_lock(&m_lookup_lock);
+    int index = hmgeti(m_token_cache, hash);
+    if (index >= 0) {
+        token_cache_entry_t* entry = &m_token_cache[index].value;
+        int type_args_count = entry->type_args_count < 0 ? 0 : entry->type_args_count;
+        if (
+            entry->assembly == assembly &&
+            entry->token.token == token.token &&
+            token_cache_args_equal(entry->arguments, entry->type_args_count, typeArgs) &&
+            token_cache_args_equal(entry->arguments + type_args_count, entry->method_args_count, methodArgs)
+        ) {
+            value = entry->value;
+        }
+    }
+    spinlock_unlock(&m_lookup_lock);
+
+    return value;
+}
+
+static void token_cache_put(System_Reflection_Assembly assembly, token_t token, System_Type_Array typeArgs, System_Type_Array methodArgs, void* value) {
+    size_t hash = token_cache_hash(assembly, token, typeArgs, methodArgs);
+
+    int type_args_count = typeArgs == NULL ? 0 : typeArgs->Length;
+    int method_args_count = methodArgs == NULL ? 0 : methodArgs->Length;
+    System_Type* arguments = NULL;
+    if (type_args_count + method_args_count != 0) {
+        arguments = malloc((type_args_count + method_args_count) * sizeof(System_Type));
+        if (arguments == NULL) {
+            return;
+        }
+        if (typeArgs != NULL) memcpy(arguments, typeArgs->Data, type_args_count * sizeof(System_Type));
+        if (methodArgs != NULL) memcpy(arguments + type_args_count, methodArgs->Data, method_args_count * sizeof(System_Type));
+    }
+
+    token_cache_entry_t entry = {
+        .assembly = assembly,
+        .token = token,
+        .arguments = arguments,
+        .type_args_count = typeArgs == NULL ? -1 : type_args_count,
+        .method_args_count = methodArgs == NULL ? -1 : method_args_count,
+        .value = value
+    };
+
+    spinlock_lock(&m_lookup_lock);
+    int index = hmgeti(m_token_cache, hash);
+    if (index < 0) {
+        hmput(m_token_cache, hash, entry);
+        arguments = NULL;
+    }
+    spinlock_unlock(&m_lookup_lock);
+
+    free(arguments);
+}
+
 err_t assembly_get_type_by_token(System_Reflection_Assembly assembly, token_t token, System_Type_Array typeArgs, System_Type_Array methodArgs, System_Type* out_type) {
     err_t err = NO_ERROR;
     System_Type type = NULL;
@@ -133,6 +371,11 @@ err_t assembly_get_type_by_token(System_Reflection_Assembly assembly, token_t to
             case METADATA_TYPE_SPEC: {
                 CHECK(token.index - 1 < assembly->DefinedTypeSpecs->Length);
 
+                type = token_cache_get(assembly, token, typeArgs, methodArgs);
+                if (type != NULL) {
+                    break;
+                }
+
                 // not found, so parse it
                 System_Byte_Array blob = assembly->DefinedTypeSpecs->Data[token.index - 1];
                 blob_entry_t entry = {
@@ -140,6 +383,7 @@ err_t assembly_get_type_by_token(System_Reflection_Assembly assembly, token_t to
                     .size = blob->Length
                 };
                 CHECK_AND_RETHROW(parse_type_spec(entry, assembly, &type, typeArgs, methodArgs));
+                token_cache_put(assembly, token, typeArgs, methodArgs, type);
             } break;
 
             default:
@@ -208,6 +452,11 @@ err_t assembly_get_method_by_token(System_Reflection_Assembly assembly, token_t
         case METADATA_METHOD_SPEC: {
             CHECK(token.index - 1 < assembly->DefinedMethodSpecs->Length);
 
+            *out_method = token_cache_get(assembly, token, typeArgs, methodArgs);
+            if (*out_method != NULL) {
+                break;
+            }
+
             // not found, so parse it
             TinyDotNet_Reflection_MethodSpec spec = assembly->DefinedMethodSpecs->Data[token.index - 1];
 
@@ -218,12 +467,18 @@ err_t assembly_get_method_by_token(System_Reflection_Assembly assembly, token_t
                 .size = spec->Instantiation->Length
             };
             CHECK_AND_RETHROW(parse_method_spec(entry, assembly, out_method, typeArgs, methodArgs));
+            token_cache_put(assembly, token, typeArgs, methodArgs, *out_method);
         } break;
 
         case METADATA_MEMBER_REF: {
             CHECK(token.index - 1 < assembly->DefinedMemberRefs->Length);
             TinyDotNet_Reflection_MemberReference ref = assembly->DefinedMemberRefs->Data[token.index - 1];
 
+            *out_method = token_cache_get(assembly, token, typeArgs, methodArgs);
+            if (*out_method != NULL) {
+                break;
+            }
+
             // get the enclosing type
             System_Type type;
             CHECK_AND_RETHROW(assembly_get_type_by_token(assembly, ref->Class, typeArgs, methodArgs, &type));
@@ -237,9 +492,12 @@ err_t assembly_get_method_by_token(System_Reflection_Assembly assembly, token_t
             CHECK_AND_RETHROW(parse_method_ref_sig(blob, assembly, &wantedInfo, type->GenericArguments));
 
             // if this is null it means that this is a generic definition that is not complete, so we are
-            // going to look at the declaration instead
+            // going to look at the declaration instead, don't cache that since it won't be true once
+            // the type is complete
+            bool cacheable = true;
             if (type->Methods == NULL) {
                 type = type->GenericTypeDefinition;
+                cacheable = false;
             }
 
             // find a method with that type
@@ -279,6 +537,9 @@ err_t assembly_get_method_by_token(System_Reflection_Assembly assembly, token_t
             // found it
             CHECK(methodInfo != NULL);
             *out_method = methodInfo;
+            if (cacheable) {
+                token_cache_put(assembly, token, typeArgs, methodArgs, methodInfo);
+            }
         } break;
 
         default:
@@ -309,6 +570,11 @@ err_t assembly_get_field_by_token(System_Reflection_Assembly assembly, token_t t
             CHECK(token.index - 1 < assembly->DefinedMemberRefs->Length);
             TinyDotNet_Reflection_MemberReference ref = assembly->DefinedMemberRefs->Data[token.index - 1];
 
+            *out_field = token_cache_get(assembly, token, typeArgs, methodArgs);
+            if (*out_field != NULL) {
+                break;
+            }
+
             // get the enclosing type
             System_Type type;
             CHECK_AND_RETHROW(assembly_get_type_by_token(assembly, ref->Class, typeArgs, methodArgs, &type));
@@ -327,10 +593,12 @@ err_t assembly_get_field_by_token(System_Reflection_Assembly assembly, token_t t
             System_Reflection_FieldInfo fieldInfo = type_get_field(type, ref->Name);
 
             // check we got what we wanted
+            CHECK(fieldInfo != NULL);
             CHECK(fieldInfo->FieldType == wantedInfo->FieldType);
 
             // out it
             *out_field = fieldInfo;
+            token_cache_put(assembly, token, typeArgs, methodArgs, fieldInfo);
         } break;
 
         default:
@@ -343,6 +611,33 @@ cleanup:
 }
 
 System_Type assembly_get_type_by_name(System_Reflection_Assembly assembly, const char* name, const char* namespace) {
+    size_t hash = name_hash_cstr(name, name_hash_cstr(namespace, (size_t)assembly));
+
+    spinlock_lock(&m_lookup_lock);
+    if (hmgeti(m_indexed, assembly) < 0) {
+        for (int i = 0; i < assembly->DefinedTypes->Length; i++) {
+            System_Type type = assembly->DefinedTypes->Data[i];
+            size_t type_hash = name_hash_string(type->Name, name_hash_string(type->Namespace, (size_t)assembly));
+            if (hmgeti(m_type_names, type_hash) < 0) {
+                hmput(m_type_names, type_hash, type);
+            }
+        }
+        hmput(m_indexed, assembly, true);
+    }
+    int index = hmgeti(m_type_names, hash);
+    System_Type found = index < 0 ? NULL : m_type_names[index].value;
+    spinlock_unlock(&m_lookup_lock);
+
+    // nothing has that hash
+    if (found == NULL) {
+        return NULL;
+    }
+
+    if (string_equals_cstr(found->Namespace, namespace) && string_equals_cstr(found->Name, name)) {
+        return found;
+    }
+
+    // a collision, look for it the slow way
     for (int i = 0; i < assembly->DefinedTypes->Length; i++) {
         System_Type type = assembly->DefinedTypes->Data[i];
         if (string_equals_cstr(type->Namespace, namespace) && string_equals_cstr(type->Name, name)) {
@@ -357,7 +652,7 @@ System_String assembly_get_string_by_token(System_Reflection_Assembly assembly,
         ASSERT(!"assembly_get_string_by_token: invalid table for type");
         return NULL;
     }
-    return hmget(assembly->UserStringsTable, token.index);
+    return loader_get_user_string(assembly, token.index);
 }
 
 System_Type get_array_type(System_Type type) {
@@ -373,9 +668,11 @@ System_Type get_array_type(System_Type type) {
         return type->ArrayType;
     }
 
-    // allocate the new type
+    // allocate the new type, types live forever
+    gc_immortal_begin();
     System_Type ArrayType = UNSAFE_GC_NEW(tSystem_Type);
     if (ArrayType == NULL) {
+        gc_immortal_end();
         return ArrayType;
     }
 
@@ -414,6 +711,7 @@ System_Type get_array_type(System_Type type) {
     GC_UPDATE(ArrayType, ElementType, type);
 
     // Set the array type
+    gc_immortal_end();
     GC_UPDATE(type, ArrayType, ArrayType);
     PANIC_ON(monitor_exit(type));
 
@@ -435,9 +733,11 @@ System_Type get_by_ref_type(System_Type type) {
     // must not be a byref
     ASSERT(!type->IsByRef);
 
-    // allocate the new ref type
+    // allocate the new ref type, types live forever
+    gc_immortal_begin();
     System_Type ByRefType = UNSAFE_GC_NEW(tSystem_Type);
     if (ByRefType == NULL) {
+        gc_immortal_end();
         return NULL;
     }
 
@@ -461,6 +761,7 @@ System_Type get_by_ref_type(System_Type type) {
     ByRefType->ManagedAlignment = type->StackAlignment;
 
     // Set the array type
+    gc_immortal_end();
     GC_UPDATE(type, ByRefType, ByRefType);
     PANIC_ON(monitor_exit(type));
 
@@ -485,9 +786,11 @@ System_Type get_boxed_type(System_Type type) {
     // TODO: error handling?
     loader_fill_type(type);
 
-    // allocate the new ref type
+    // allocate the new ref type, types live forever
+    gc_immortal_begin();
     System_Type BoxedType = UNSAFE_GC_NEW(tSystem_Type);
     if (BoxedType == NULL) {
+        gc_immortal_end();
         return BoxedType;
     }
 
@@ -511,6 +814,7 @@ System_Type get_boxed_type(System_Type type) {
     GC_UPDATE(BoxedType, VirtualMethods, type->VirtualMethods);
 
     // Set the array type
+    gc_immortal_end();
     GC_UPDATE(type, BoxedType, BoxedType);
     PANIC_ON(monitor_exit(type));
 
@@ -889,6 +1193,19 @@ void type_print_name(System_Type type, strbuilder_t* builder) {
 }
 
 
+static void type_print_full_name_uncached(System_Type type, strbuilder_t* builder);
+
+/**
+ * The full names of filled types, the jit names every method by the types of its
+ * parameters, so the same names are printed over and over again
+ */
+static struct {
+    System_Type key;
+    char* value;
+}* m_type_full_names = NULL;
+
+static spinlock_t m_type_full_names_lock = INIT_SPINLOCK();
+
 void type_print_full_name(System_Type type, strbuilder_t* builder) {
     const char* builtin = handle_builtin(type);
     if (builtin != NULL) {
@@ -896,6 +1213,45 @@ void type_print_full_name(System_Type type, strbuilder_t* builder) {
         return;
     }
 
+    // the name of a type that is still being setup might change, so only
+    // remember the names of filled types
+    char* name = NULL;
+    if (type->IsFilled) {
+        spinlock_lock(&m_type_full_names_lock);
+        int index = hmgeti(m_type_full_names, type);
+        if (index >= 0) {
+            name = m_type_full_names[index].value;
+        }
+        spinlock_unlock(&m_type_full_names_lock);
+
+        if (name == NULL) {
+            strbuilder_t type_name = strbuilder_new();
+            type_print_full_name_uncached(type, &type_name);
+            name = strdup(strbuilder_get(&type_name));
+            strbuilder_free(&type_name);
+
+            if (name != NULL) {
+                spinlock_lock(&m_type_full_names_lock);
+                int index = hmgeti(m_type_full_names, type);
+                if (index >= 0) {
+                    free(name);
+                    name = m_type_full_names[index].value;
+                } else {
+                    hmput(m_type_full_names, type, name);
+                }
+                spinlock_unlock(&m_type_full_names_lock);
+            }
+        }
+    }
+
+    if (name != NULL) {
+        strbuilder_cstr(builder, name);
+    } else {
+        type_print_full_name_uncached(type, builder);
+    }
+}
+
+static void type_print_full_name_uncached(System_Type type, strbuilder_t* builder) {
     if (type_is_generic_parameter(type)) {
         strbuilder_utf16(builder, type->Name->Chars, type->Name->Length);
     } else {
@@ -929,6 +1285,20 @@ void method_print_full_name(System_Reflection_MethodInfo method, strbuilder_t* b
 }
 
 System_Reflection_FieldInfo type_get_field(System_Type type, System_String name) {
+    System_Reflection_MemberInfo_Array members = (System_Reflection_MemberInfo_Array)type->Fields;
+    spinlock_lock(&m_lookup_lock);
+    int* indexes = member_names_lookup(members, name_hash_string(name, (size_t)members));
+    int first = arrlen(indexes) == 0 ? -1 : indexes[0];
+    spinlock_unlock(&m_lookup_lock);
+
+    if (first < 0) {
+        return NULL;
+    }
+    if (string_equals(type->Fields->Data[first]->Name, name)) {
+        return type->Fields->Data[first];
+    }
+
+    // a collision, look for it the slow way
     for (int i = 0; i < type->Fields->Length; i++) {
         if (string_equals(type->Fields->Data[i]->Name, name)) {
             return type->Fields->Data[i];
@@ -937,7 +1307,43 @@ System_Reflection_FieldInfo type_get_field(System_Type type, System_String name)
     return NULL;
 }
 
+/**
+ * Get the index of the next method with the name hash starting from the given index, -1 if
+ * there is none, the name of the first method with that hash is returned for verification
+ */
+static int type_next_method_by_hash(System_Type type, size_t hash, int index, System_String* out_first_name) {
+    System_Reflection_MemberInfo_Array members = (System_Reflection_MemberInfo_Array)type->Methods;
+    int next = -1;
+
+    spinlock_lock(&m_lookup_lock);
+    int* indexes = member_names_lookup(members, hash);
+    *out_first_name = arrlen(indexes) == 0 ? NULL : members->Data[indexes[0]]->Name;
+    for (int i = 0; i < arrlen(indexes); i++) {
+        if (indexes[i] >= index) {
+            next = indexes[i];
+            break;
+        }
+    }
+    spinlock_unlock(&m_lookup_lock);
+
+    return next;
+}
+
 System_Reflection_MethodInfo type_iterate_methods(System_Type type, System_String name, int* index) {
+    System_String first_name;
+    int next = type_next_method_by_hash(type, name_hash_string(name, (size_t)type->Methods), *index, &first_name);
+    if (first_name == NULL) {
+        return NULL;
+    }
+    if (string_equals(first_name, name)) {
+        if (next < 0) {
+            return NULL;
+        }
+        *index = next + 1;
+        return type->Methods->Data[next];
+    }
+
+    // a collision, look for it the slow way
     for (int i = *index; i < type->Methods->Length; i++) {
         if (string_equals(type->Methods->Data[i]->Name, name)) {
             *index = i + 1;
@@ -948,6 +1354,20 @@ System_Reflection_MethodInfo type_iterate_methods(System_Type type, System_Strin
 }
 
 System_Reflection_MethodInfo type_iterate_methods_cstr(System_Type type, const char* name, int* index) {
+    System_String first_name;
+    int next = type_next_method_by_hash(type, name_hash_cstr(name, (size_t)type->Methods), *index, &first_name);
+    if (first_name == NULL) {
+        return NULL;
+    }
+    if (string_equals_cstr(first_name, name)) {
+        if (next < 0) {
+            return NULL;
+        }
+        *index = next + 1;
+        return type->Methods->Data[next];
+    }
+
+    // a collision, look for it the slow way
     for (int i = *index; i < type->Methods->Length; i++) {
         if (string_equals_cstr(type->Methods->Data[i]->Name, name)) {
             *index = i + 1;
@@ -1129,6 +1549,7 @@ void assembly_dump(System_Reflection_Assembly assembly) {
                 !method_is_internal_call(mi)
             ) {
                 // handle locals
+                if (IS_ERROR(loader_fill_method_body(mi))) continue;
                 for (int li = 0; li < mi->MethodBody->LocalVariables->Length; li++) {
                     printf("[*] \t\t\t");
                     strbuilder_t local = strbuilder_new();
@@ -1386,7 +1807,8 @@ static err_t expand_method(System_Type type, System_Reflection_MethodInfo method
     instance->Attributes = method->Attributes;
     instance->ImplAttributes = method->ImplAttributes;
 
-    // expand body
+    // expand body, the original must be parsed for that
+    CHECK_AND_RETHROW(loader_fill_method_body(method));
     if (method->MethodBody != NULL) {
         System_Reflection_MethodBody methodBody = method->MethodBody;
 
@@ -1418,7 +1840,7 @@ static err_t expand_method(System_Type type, System_Reflection_MethodInfo method
             new_body->MaxStackSize = methodBody->MaxStackSize;
 
             if (expand_locals) {
-                GC_UPDATE(new_body, LocalVariables, GC_NEW_ARRAY(tSystem_Reflection_LocalVariableInfo, methodBody->LocalVariables->Length));
+                GC_UPDATE(new_body, LocalVariables, GC_NEW_METADATA_ARRAY(tSystem_Reflection_LocalVariableInfo, methodBody->LocalVariables->Length));
                 for (int i = 0; i < new_body->LocalVariables->Length; i++) {
                     if (type_is_generic_parameter(methodBody->LocalVariables->Data[i]->LocalType)) {
                         // expand
@@ -1437,7 +1859,7 @@ static err_t expand_method(System_Type type, System_Reflection_MethodInfo method
             }
 
             if (expand_exceptions) {
-                GC_UPDATE(new_body, ExceptionHandlingClauses, GC_NEW_ARRAY(tSystem_Reflection_ExceptionHandlingClause, methodBody->ExceptionHandlingClauses->Length));
+                GC_UPDATE(new_body, ExceptionHandlingClauses, GC_NEW_METADATA_ARRAY(tSystem_Reflection_ExceptionHandlingClause, methodBody->ExceptionHandlingClauses->Length));
                 for (int i = 0; i < new_body->ExceptionHandlingClauses->Length; i++) {
                     System_Reflection_ExceptionHandlingClause clause = methodBody->ExceptionHandlingClauses->Data[i];
                     if (clause->CatchType != NULL && type_is_generic_parameter(clause->CatchType)) {
@@ -1470,7 +1892,7 @@ static err_t expand_method(System_Type type, System_Reflection_MethodInfo method
 
 
     // method parameters
-    GC_UPDATE(instance, Parameters, GC_NEW_ARRAY(tSystem_Reflection_ParameterInfo, method->Parameters->Length));
+    GC_UPDATE(instance, Parameters, GC_NEW_METADATA_ARRAY(tSystem_Reflection_ParameterInfo, method->Parameters->Length));
     for (int i = 0; i < instance->Parameters->Length; i++) {
         System_Reflection_ParameterInfo parameter = GC_NEW(tSystem_Reflection_ParameterInfo);
         System_Reflection_ParameterInfo fieldParameter = method->Parameters->Data[i];
@@ -1604,7 +2026,7 @@ cleanup:
 err_t type_expand_interface_impls(System_Type instance, TinyDotNet_Reflection_InterfaceImpl_Array interfaceImpls) {
     err_t err = NO_ERROR;
 
-    GC_UPDATE(instance, InterfaceImpls, GC_NEW_ARRAY(tTinyDotNet_Reflection_InterfaceImpl, interfaceImpls->Length));
+    GC_UPDATE(instance, InterfaceImpls, GC_NEW_METADATA_ARRAY(tTinyDotNet_Reflection_InterfaceImpl, interfaceImpls->Length));
     for (int i = 0; i < instance->InterfaceImpls->Length; i++) {
         TinyDotNet_Reflection_InterfaceImpl impl = GC_NEW(tTinyDotNet_Reflection_InterfaceImpl);
         System_Type interfaceType;
@@ -1620,7 +2042,7 @@ cleanup:
 err_t type_expand_method_impls(System_Type instance, TinyDotNet_Reflection_MethodImpl_Array impls) {
     err_t err = NO_ERROR;
 
-    GC_UPDATE(instance, MethodImpls, GC_NEW_ARRAY(tTinyDotNet_Reflection_MethodImpl, impls->Length));
+    GC_UPDATE(instance, MethodImpls, GC_NEW_METADATA_ARRAY(tTinyDotNet_Reflection_MethodImpl, impls->Length));
     for (int i = 0; i < instance->MethodImpls->Length; i++) {
         TinyDotNet_Reflection_MethodImpl impl = GC_NEW(tTinyDotNet_Reflection_MethodImpl);
 
@@ -1652,7 +2074,7 @@ err_t type_expand_generic(System_Type instance) {
     GC_UPDATE(instance, BaseType, baseType);
 
     // fields
-    GC_UPDATE(instance, Fields, GC_NEW_ARRAY(tSystem_Reflection_FieldInfo, type->Fields->Length));
+    GC_UPDATE(instance, Fields, GC_NEW_METADATA_ARRAY(tSystem_Reflection_FieldInfo, type->Fields->Length));
     for (int i = 0; i < instance->Fields->Length; i++) {
         System_Reflection_FieldInfo field;
         CHECK_AND_RETHROW(expand_field(instance, type->Fields->Data[i], arguments, &field));
@@ -1660,7 +2082,7 @@ err_t type_expand_generic(System_Type instance) {
     }
 
     // methods
-    GC_UPDATE(instance, Methods, GC_NEW_ARRAY(tSystem_Reflection_MethodInfo, type->Methods->Length));
+    GC_UPDATE(instance, Methods, GC_NEW_METADATA_ARRAY(tSystem_Reflection_MethodInfo, type->Methods->Length));
     for (int i = 0; i < instance->Methods->Length; i++) {
         System_Reflection_MethodInfo method;
         CHECK_AND_RETHROW(expand_method(instance, type->Methods->Data[i], arguments, false, &method));
@@ -1681,10 +2103,69 @@ cleanup:
     return err;
 }
 
+//
+// Full instantiations are also kept in a hash table keyed by the definition and the arguments,
+// so finding an existing one does not need to walk the instance list of the definition. On a
+// hash collision only the first instance is in the table, the others are still found by the
+// walk.
+//
+
+static struct {
+    size_t key;
+    System_Type value;
+}* m_generic_type_instances = NULL;
+
+static struct {
+    size_t key;
+    System_Reflection_MethodInfo value;
+}* m_generic_method_instances = NULL;
+
+static spinlock_t m_generic_instances_lock = INIT_SPINLOCK();
+
+static size_t generic_instance_hash(void* definition, System_Type_Array arguments) {
+    return stbds_hash_bytes(arguments->Data, arguments->Length * sizeof(System_Type), (size_t)definition);
+}
+
+static bool generic_arguments_equal(System_Type_Array a, System_Type_Array b) {
+    for (int i = 0; i < a->Length; i++) {
+        if (a->Data[i] != b->Data[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static System_Type generic_type_instance_lookup(System_Type type, System_Type_Array arguments, size_t hash) {
+    spinlock_lock(&m_generic_instances_lock);
+    int index = hmgeti(m_generic_type_instances, hash);
+    System_Type inst = index == -1 ? NULL : m_generic_type_instances[index].value;
+    spinlock_unlock(&m_generic_instances_lock);
+
+    if (inst != NULL && inst->GenericTypeDefinition == type && generic_arguments_equal(arguments, inst->GenericArguments)) {
+        return inst;
+    }
+    return NULL;
+}
+
+static System_Reflection_MethodInfo generic_method_instance_lookup(System_Reflection_MethodInfo method, System_Type_Array arguments, size_t hash) {
+    spinlock_lock(&m_generic_instances_lock);
+    int index = hmgeti(m_generic_method_instances, hash);
+    System_Reflection_MethodInfo inst = index == -1 ? NULL : m_generic_method_instances[index].value;
+    spinlock_unlock(&m_generic_instances_lock);
+
+    if (inst != NULL && inst->GenericMethodDefinition == method && generic_arguments_equal(arguments, inst->GenericArguments)) {
+        return inst;
+    }
+    return NULL;
+}
+
 err_t type_make_generic(System_Type type, System_Type_Array arguments, System_Type* out_type) {
     err_t err = NO_ERROR;
     bool locked = false;
 
+    // generic instances are never unloaded
+    gc_immortal_begin();
+
     monitor_enter(type);
     locked = true;
 
@@ -1700,9 +2181,18 @@ err_t type_make_generic(System_Type type, System_Type_Array arguments, System_Ty
         }
     }
 
+    size_t hash = generic_instance_hash(type, arguments);
+
     if (is_full_instantiation) {
+        // check the cache first
+        System_Type inst = generic_type_instance_lookup(type, arguments, hash);
+        if (inst != NULL) {
+            *out_type = inst;
+            goto cleanup;
+        }
+
         // check for an existing instance
-        System_Type inst = type->NextGenericInstance;
+        inst = type->NextGenericInstance;
         bool found = false;
         while (inst != NULL) {
             found = true;
@@ -1797,6 +2287,12 @@ err_t type_make_generic(System_Type type, System_Type_Array arguments, System_Ty
         GC_UPDATE(instance, NextGenericInstance, type->NextGenericInstance);
         GC_UPDATE(type, NextGenericInstance, instance);
 
+        spinlock_lock(&m_generic_instances_lock);
+        if (hmgeti(m_generic_type_instances, hash) == -1) {
+            hmput(m_generic_type_instances, hash, instance);
+        }
+        spinlock_unlock(&m_generic_instances_lock);
+
         locked = false;
         monitor_exit(type);
     }
@@ -1814,18 +2310,31 @@ cleanup:
         monitor_exit(type);
     }
 
+    gc_immortal_end();
+
     return err;
 }
 
 err_t method_make_generic(System_Reflection_MethodInfo method, System_Type_Array arguments, System_Reflection_MethodInfo* out_method) {
     err_t err = NO_ERROR;
 
+    // generic instances are never unloaded
+    gc_immortal_begin();
+
     monitor_enter(method);
 
     CHECK(!type_is_generic_definition(method->DeclaringType));
 
+    // check the cache first
+    size_t hash = generic_instance_hash(method, arguments);
+    System_Reflection_MethodInfo inst = generic_method_instance_lookup(method, arguments, hash);
+    if (inst != NULL) {
+        *out_method = inst;
+        goto cleanup;
+    }
+
     // check for an existing instance
-    System_Reflection_MethodInfo inst = method->NextGenericInstance;
+    inst = method->NextGenericInstance;
     bool found = false;
     while (inst != NULL) {
         found = true;
@@ -1873,10 +2382,17 @@ err_t method_make_generic(System_Reflection_MethodInfo method, System_Type_Array
     GC_UPDATE(instance, NextGenericInstance, method->NextGenericInstance);
     GC_UPDATE(method, NextGenericInstance, instance);
 
+    spinlock_lock(&m_generic_instances_lock);
+    if (hmgeti(m_generic_method_instances, hash) == -1) {
+        hmput(m_generic_method_instances, hash, instance);
+    }
+    spinlock_unlock(&m_generic_instances_lock);
+
     *out_method = instance;
 
 cleanup:
     monitor_exit(method);
+    gc_immortal_end();
 
     return err;
 }
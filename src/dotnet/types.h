@@ -105,16 +105,21 @@ struct System_Object {
 #define COLOR_BLACK     3   /* object that has been traced, and its children have been traced as well */
 #define COLOR_YELLOW    4   /* object that has not been traced (for color switching) */
 #define COLOR_GREEN     5   /* object that should be finalized */
-#define COLOR_RESERVED0 6   /* reserved for future use */
+#define COLOR_IMMORTAL  6   /* object that is never freed, like the loader metadata */
 #define COLOR_RESERVED1 7   /* reserved for future use */
 
     // should finalizer be called or not
     uint64_t suppress_finalizer : 1;
 
     // unused for now
-    uint64_t _reserved : 12;
+    uint64_t _reserved : 4;
+
+    // the thin lock of the object, kept as its own byte so color updates
+    // from the collector never race with it, see monitor.c
+    uint8_t thin_lock;
 };
 STATIC_ASSERT(sizeof(struct System_Object) == sizeof(void*) * 2);
+STATIC_ASSERT(offsetof(struct System_Object, thin_lock) == 15);
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -170,6 +175,25 @@ bool string_equals(System_String a, System_String b);
  */
 System_String string_append_cstr(System_String old, const char* str);
 
+/**
+ * Get the interned string with the given chars, interning an immortal
+ * copy of them if there is none yet, NULL if out of memory
+ *
+ * @remark
+ * The chars don't have to be aligned, they are only compared and copied
+ */
+System_String string_intern_chars(const System_Char* chars, int length);
+
+/**
+ * Get the interned string equal to the given one, interning a copy of it if there is none
+ */
+System_String string_intern(System_String str);
+
+/**
+ * Get the interned string equal to the given one, NULL if there is none
+ */
+System_String string_is_interned(System_String str);
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 typedef struct System_Reflection_Module *System_Reflection_Module;
@@ -226,8 +250,8 @@ struct System_Reflection_Assembly {
     // types imported from other assemblies, for easy lookup whenever needed
     System_Type_Array ImportedTypes;
 
-    // we have two entries, one for GC tracking (the array)
-    // and one for internally looking up the string entries
+    // the strings are immortal and created on first use, so the
+    // array is no longer used, the table has the created strings
     // TODO: turn into a Dictionary for easy management
     System_String_Array UserStrings;
     struct {
@@ -636,6 +660,7 @@ static inline type_visibility_t type_visibility(System_Type type) { return type-
 static inline type_layout_t type_layout(System_Type type) { return (type->Attributes >> 3) & 0b11; }
 static inline bool type_is_abstract(System_Type type) { return type->Attributes & 0x00000080; }
 static inline bool type_is_sealed(System_Type type) { return type->Attributes & 0x00000100; }
+static inline bool type_is_before_field_init(System_Type type) { return type->Attributes & 0x00100000; }
 static inline bool type_is_interface(System_Type type) { return type != NULL && type->Attributes & 0x00000020; }
 
 const char* type_visibility_str(type_visibility_t visibility);
@@ -737,6 +762,8 @@ extern System_Type tSystem_NullReferenceException;
 extern System_Type tSystem_InvalidCastException;
 extern System_Type tSystem_OutOfMemoryException;
 extern System_Type tSystem_OverflowException;
+extern System_Type tSystem_ArgumentNullException;
+extern System_Type tSystem_TypeInitializationException;
 extern System_Type tSystem_RuntimeTypeHandle;
 extern System_Type tSystem_Nullable;
 extern System_Type tSystem_Span;
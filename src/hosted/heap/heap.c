@@ -3,34 +3,401 @@
 #include <mimalloc-internal.h>
 #include "mimalloc_region.h"
 #include <dotnet/gc/heap.h>
+#include <sync/spinlock.h>
+#include <thread/scheduler.h>
+#include <util/defs.h>
+
+#include <sys/mman.h>
+#include <stdatomic.h>
 
 extern mem_region_t mi_regions[MI_REGION_MAX];
 extern _Atomic(size_t) mi_regions_count;
 
-void heap_reclaim() {}
+STATIC_ASSERT(MI_SMALL_PAGES_PER_SEGMENT <= 64);
 
-System_Object heap_find_fast(void *ptr) {
-    mi_segment_t* segment = _mi_ptr_segment(ptr);
+/**
+ * The card table, we have a single card per mimalloc page, and a single
+ * bitmap per segment, indexed by the segment's memid (region * 64 + block)
+ */
+static _Atomic(uint64_t) m_cards[MI_REGION_MAX * MI_BITMAP_FIELD_BITS];
+
+//----------------------------------------------------------------------------------------------------------------------
+// Memory reclaiming
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * The amount of committed memory in free segments that we keep around
+ * when reclaiming, so we won't have to recommit it on the next allocations
+ */
+static size_t m_heap_retention_target = 64 * MI_MiB;
+
+err_t init_heap() {
+    // let mimalloc reset pages as they become free, the free segments
+    // are handled by heap_reclaim
+    mi_option_enable(mi_option_page_reset);
+
+    // use the same topology as the scheduler for mimalloc's own arenas, the
+    // regions are tagged with the online node of the thread that claims them
+    // and bound to that node
+    mi_option_set(mi_option_use_numa_nodes, get_numa_node_count());
+    _mi_mem_numa_init();
+    return NO_ERROR;
+}
+
+void heap_set_retention_target(size_t bytes) {
+    m_heap_retention_target = bytes;
+}
+
+size_t heap_get_max_size() {
+    return (size_t)MI_REGION_MAX * MI_REGION_SIZE;
+}
+
+/**
+ * Bumped by every reclaim, a thread collects its own heap once it sees it changed
+ */
+static _Atomic(uint32_t) m_heap_reclaim_epoch = 0;
+static THREAD_LOCAL uint32_t m_heap_collected_epoch = 0;
+
+/**
+ * Give the empty pages and segments of the heap of the current thread back to
+ * the regions, only the thread that owns a mimalloc heap may collect it
+ */
+static void heap_collect_local() {
+    m_heap_collected_epoch = atomic_load_explicit(&m_heap_reclaim_epoch, memory_order_relaxed);
+    mi_collect(true);
+}
+
+void heap_reclaim() {
+    // the sweep freed objects into the heaps of all the threads, the pages that
+    // became empty only go back once their thread collects, on its next allocation
+    atomic_fetch_add_explicit(&m_heap_reclaim_epoch, 1, memory_order_relaxed);
+
+    // adopt the segments of the threads that exited, the same as mimalloc does on the
+    // main thread once it exits, so the ones that are empty by now are freed as well
+    mi_heap_t* heap = mi_heap_get_backing();
+    _mi_abandoned_reclaim_all(heap, &heap->tld->segments);
+    heap_collect_local();
+
+    // decommit all the free segments, including the ones the threads gave back since
+    // the previous reclaim
+    _mi_mem_decommit_free(m_heap_retention_target);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Large object space
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Any object that is too big for a small mimalloc page is a large object, these
+ * are allocated with a header that links them into a list which is iterated
+ * instead of the pages, since medium to huge pages can't be walked slot by slot
+ */
+typedef struct heap_large_object {
+    struct heap_large_object* prev;
+    struct heap_large_object* next;
+    _Atomic(bool) dirty;
+    char _padding[15];
+} heap_large_object_t;
+STATIC_ASSERT(sizeof(heap_large_object_t) % 16 == 0);
+
+static heap_large_object_t* m_large_objects = NULL;
+static spinlock_t m_large_objects_lock;
+
+/**
+ * The amount of bytes taken by large objects, some of which may be outside of the regions
+ */
+static atomic_size_t m_large_objects_bytes = 0;
+
+#define LARGE_OBJECT_HEADER(o) ((heap_large_object_t*)((uintptr_t)(o) - sizeof(heap_large_object_t)))
+#define LARGE_OBJECT(header) ((System_Object)((uintptr_t)(header) + sizeof(heap_large_object_t)))
+
+static bool heap_is_large_segment(mi_segment_t* segment) {
+    return segment->page_kind != MI_PAGE_SMALL;
+}
+
+static System_Object heap_alloc_large(size_t size) {
+    heap_large_object_t* header = mi_zalloc(sizeof(heap_large_object_t) + size);
+    if (header == NULL) return NULL;
+    m_large_objects_bytes += mi_usable_size(header);
+
+    spinlock_lock(&m_large_objects_lock);
+    header->next = m_large_objects;
+    if (m_large_objects != NULL) {
+        m_large_objects->prev = header;
+    }
+    m_large_objects = header;
+    spinlock_unlock(&m_large_objects_lock);
+
+    return LARGE_OBJECT(header);
+}
+
+static void heap_free_large(System_Object object) {
+    heap_large_object_t* header = LARGE_OBJECT_HEADER(object);
+
+    spinlock_lock(&m_large_objects_lock);
+    if (header->prev != NULL) {
+        header->prev->next = header->next;
+    } else {
+        m_large_objects = header->next;
+    }
+    if (header->next != NULL) {
+        header->next->prev = header->prev;
+    }
+    spinlock_unlock(&m_large_objects_lock);
+
+    // large objects go back to mimalloc right away, which will
+    // release their pages and segments eagerly
+    m_large_objects_bytes -= mi_usable_size(header);
+    mi_free(header);
+}
+
+void heap_iterate_large_objects(object_callback_t callback) {
+    spinlock_lock(&m_large_objects_lock);
+    heap_large_object_t* header = m_large_objects;
+    spinlock_unlock(&m_large_objects_lock);
+
+    while (header != NULL) {
+        // get the next one before the callback, since it might free the object
+        spinlock_lock(&m_large_objects_lock);
+        heap_large_object_t* next = header->next;
+        spinlock_unlock(&m_large_objects_lock);
+
+        callback(LARGE_OBJECT(header));
+        header = next;
+    }
+}
+
+static void heap_iterate_dirty_large_objects(object_callback_t callback) {
+    spinlock_lock(&m_large_objects_lock);
+    heap_large_object_t* header = m_large_objects;
+    spinlock_unlock(&m_large_objects_lock);
+
+    while (header != NULL) {
+        spinlock_lock(&m_large_objects_lock);
+        heap_large_object_t* next = header->next;
+        spinlock_unlock(&m_large_objects_lock);
+
+        if (atomic_exchange(&header->dirty, false) && callback != NULL) {
+            callback(LARGE_OBJECT(header));
+        }
+        header = next;
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Side colors
+//----------------------------------------------------------------------------------------------------------------------
+
+#ifdef TDN_GC_SIDE_COLORS
+
+/**
+ * Every small object is at least as big as an object header, so at most
+ * a single object starts in each granule of the side color table
+ */
+#define HEAP_COLOR_GRANULE      sizeof(struct System_Object)
+#define HEAP_COLORS_SIZE        (MI_SEGMENT_SIZE / HEAP_COLOR_GRANULE)
+#define HEAP_COLOR_INDEX(segment, object) (((uintptr_t)(object) - (uintptr_t)(segment)) / HEAP_COLOR_GRANULE)
+
+/**
+ * The side color tables, indexed like the card table. We use a byte and not a nibble per
+ * granule so the collector and the mutators never race on the same byte. A table is made
+ * on the first allocation from a segment, and is kept around for when it is reused.
+ */
+static _Atomic(uint8_t*) m_colors[MI_REGION_MAX * MI_BITMAP_FIELD_BITS];
+
+/**
+ * Large objects and segments that come from an arena keep the color in the header
+ */
+static bool heap_has_side_color(mi_segment_t* segment) {
+    return !heap_is_large_segment(segment) && !(segment->memid & 1);
+}
+
+static uint8_t* heap_side_colors(mi_segment_t* segment) {
+    if (!heap_has_side_color(segment)) return NULL;
+    return atomic_load_explicit(&m_colors[segment->memid >> 1], memory_order_acquire);
+}
+
+static bool heap_prepare_side_colors(mi_segment_t* segment) {
+    if (!heap_has_side_color(segment)) return true;
+
+    _Atomic(uint8_t*)* slot = &m_colors[segment->memid >> 1];
+    uint8_t* colors = atomic_load_explicit(slot, memory_order_acquire);
+    if (colors != NULL) return true;
+
+    // fresh mappings are zeroed, so everything starts as blue
+    uint8_t* new_colors = mmap(NULL, HEAP_COLORS_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (new_colors == MAP_FAILED) return false;
+
+    // someone else might have made it in the meanwhile
+    if (!atomic_compare_exchange_strong(slot, &colors, new_colors)) {
+        munmap(new_colors, HEAP_COLORS_SIZE);
+    }
+    return true;
+}
+
+int heap_get_color(System_Object object) {
+    mi_segment_t* segment = _mi_ptr_segment(object);
+    if (!heap_has_side_color(segment)) return object->color;
+
+    uint8_t* colors = heap_side_colors(segment);
+    if (colors == NULL) return COLOR_BLUE;
+    return colors[HEAP_COLOR_INDEX(segment, object)];
+}
+
+void heap_set_color(System_Object object, int color) {
+    mi_segment_t* segment = _mi_ptr_segment(object);
+    if (!heap_has_side_color(segment)) {
+        object->color = color;
+        return;
+    }
+
+    // the table exists since the object was allocated
+    uint8_t* colors = heap_side_colors(segment);
+    colors[HEAP_COLOR_INDEX(segment, object)] = color;
+}
+
+#endif
+
+//----------------------------------------------------------------------------------------------------------------------
+// Object lookup and iteration
+//----------------------------------------------------------------------------------------------------------------------
+
+static System_Object heap_find_in_segment(mi_segment_t* segment, void* ptr) {
     mi_page_t* page = _mi_segment_page_of(segment, ptr);
+    if (segment->page_kind == MI_PAGE_LARGE || segment->page_kind == MI_PAGE_HUGE) {
+        // these pages only have a single block
+        return LARGE_OBJECT(_mi_page_start(segment, page, NULL));
+    }
+
     uintptr_t page_start = (uintptr_t)_mi_segment_page_start(segment, page, page->xblock_size, NULL, NULL);
     uintptr_t diff = ((uintptr_t)ptr - page_start) % page->xblock_size;
     uintptr_t start = (uintptr_t)ptr - diff;
+    if (segment->page_kind == MI_PAGE_MEDIUM) {
+        return LARGE_OBJECT(start);
+    }
     return (void*)start;
 }
 
+System_Object heap_find_fast(void *ptr) {
+    mi_segment_t* segment = _mi_ptr_segment(ptr);
+    return heap_find_in_segment(segment, ptr);
+}
+
+/**
+ * The bounds of all the regions, these only ever grow, and are used to quickly
+ * drop most of the values found when scanning the stacks
+ */
+static _Atomic(uintptr_t) m_heap_low = UINTPTR_MAX;
+static _Atomic(uintptr_t) m_heap_high = 0;
+static _Atomic(size_t) m_heap_bounds_regions = 0;
+
+/**
+ * Regions are allocated aligned to their size, so the region of an address is
+ * found by indexing this with the address, it holds the region index plus one,
+ * zero for addresses that are not in any region
+ */
+#define HEAP_REGION_SHIFT       (MI_SEGMENT_SHIFT + 6)
+#define HEAP_ADDRESS_BITS       47
+#define HEAP_REGION_SLOTS       (1ull << (HEAP_ADDRESS_BITS - HEAP_REGION_SHIFT))
+
+STATIC_ASSERT((1ull << HEAP_REGION_SHIFT) == MI_REGION_SIZE);
+STATIC_ASSERT(MI_REGION_MAX < UINT16_MAX);
+
+static _Atomic(uint16_t) m_heap_region_index[HEAP_REGION_SLOTS];
+
+static void heap_update_bounds() {
+    size_t count = mi_regions_count;
+    if (atomic_load_explicit(&m_heap_bounds_regions, memory_order_acquire) == count) return;
+
+    for (size_t i = 0; i < count; i++) {
+        uintptr_t start = (uintptr_t)mi_regions[i].start;
+
+        // the region is still being created, try again next time
+        if (start == 0) return;
+
+        if ((start >> HEAP_REGION_SHIFT) < HEAP_REGION_SLOTS) {
+            atomic_store_explicit(&m_heap_region_index[start >> HEAP_REGION_SHIFT], i + 1, memory_order_relaxed);
+        }
+
+        uintptr_t low = atomic_load(&m_heap_low);
+        while (start < low && !atomic_compare_exchange_weak(&m_heap_low, &low, start));
+
+        uintptr_t high = atomic_load(&m_heap_high);
+        while (start + MI_REGION_SIZE > high && !atomic_compare_exchange_weak(&m_heap_high, &high, start + MI_REGION_SIZE));
+    }
+
+    atomic_store_explicit(&m_heap_bounds_regions, count, memory_order_release);
+}
+
 System_Object heap_find(uintptr_t p) {
     if (!p) return NULL;
+
+    // most values are not even near the heap
+    heap_update_bounds();
+    if (p < m_heap_low || p >= m_heap_high) return NULL;
+    if ((p >> HEAP_REGION_SHIFT) >= HEAP_REGION_SLOTS) return NULL;
+
+    // find the region, and make sure the segment is in use so we
+    // won't touch the header of a free segment
+    size_t index = atomic_load_explicit(&m_heap_region_index[p >> HEAP_REGION_SHIFT], memory_order_relaxed);
+    if (index == 0) return NULL;
+    mem_region_t* region = &mi_regions[index - 1];
+    uintptr_t start = (uintptr_t)region->start;
+    if (!(region->in_use & (1ull << ((p - start) / MI_SEGMENT_SIZE)))) return NULL;
+
     void* ptr = (void*)p;
-    if (!mi_is_in_heap_region(ptr)) return NULL;
     mi_segment_t* segment = _mi_ptr_segment(ptr);
     if (_mi_ptr_cookie(segment) != segment->cookie) { return NULL; }
+
+    // pages that have nothing allocated can't have objects
     mi_page_t* page = _mi_segment_page_of(segment, ptr);
-    uintptr_t page_start = (uintptr_t)_mi_segment_page_start(segment, page, page->xblock_size, NULL, NULL);
-    uintptr_t diff = ((uintptr_t)ptr - page_start) % page->xblock_size;
-    uintptr_t start = (uintptr_t)ptr - diff;
-    return (void*)start;
+    if (!page->xblock_size || !page->used) return NULL;
+
+    System_Object object = heap_find_in_segment(segment, ptr);
+
+    // slots past the capacity were never allocated, and a pointer into
+    // the segment header will end up outside of the page
+    if (!heap_is_large_segment(segment)) {
+        uintptr_t page_start = (uintptr_t)_mi_page_start(segment, page, NULL);
+        uintptr_t page_end = page_start + page->capacity * page->xblock_size;
+        if ((uintptr_t)object < page_start || (uintptr_t)object >= page_end) return NULL;
+    }
+
+    return object;
+}
+
+static void heap_iterate_page_objects(mi_segment_t* seg, mi_page_t* p, object_callback_t callback) {
+    // skip pages which are not used by anything
+    if (!p->xblock_size || !p->used) return;
+
+#ifdef TDN_GC_SIDE_COLORS
+    // free slots are skipped by looking at the side table, so
+    // their memory is never touched
+    uint8_t* colors = heap_side_colors(seg);
+#endif
+
+    uintptr_t obj = (uintptr_t)_mi_page_start(seg, p, NULL);
+    for (size_t l = 0; l < p->capacity; l++) {
+        System_Object o = (void*)obj;
+#ifdef TDN_GC_SIDE_COLORS
+        if (colors == NULL || colors[HEAP_COLOR_INDEX(seg, o)] != COLOR_BLUE) {
+            callback(o);
+        }
+#else
+        callback(o);
+#endif
+        obj += p->xblock_size;
+    }
+}
+
+static void heap_iterate_segment_pages(mi_segment_t* seg, object_callback_t callback) {
+    // large objects are iterated from their own list
+    if (heap_is_large_segment(seg)) return;
+    for (size_t k = 0; k < MI_SMALL_PAGES_PER_SEGMENT; k++) { // iterate through pages: page_small case
+        heap_iterate_page_objects(seg, &seg->pages[k], callback);
+    }
 }
-    
+
 void heap_iterate_objects(object_callback_t callback) {
     size_t count = mi_regions_count;
     for (size_t i = 0; i < count; i++) { // iterate through regions
@@ -40,35 +407,147 @@ void heap_iterate_objects(object_callback_t callback) {
             for (size_t j = 0; j < MI_BITMAP_FIELD_BITS; j++) { // iterate through segments in region
                 if (bitmap & (1UL << j)) { // segment is in use
                     mi_segment_t *seg = (void*)(start + j * MI_SEGMENT_SIZE);
-                    ASSERT(seg->page_kind == MI_PAGE_SMALL);
-                    for (size_t k = 0; k < MI_SMALL_PAGES_PER_SEGMENT; k++) { // iterate through pages: page_small case
-                        mi_page_t *p = &seg->pages[k];
-                        if (!p->xblock_size) continue;
-                        uintptr_t obj = (uintptr_t)_mi_page_start(seg, p, NULL);
-                        for (size_t l = 0; l < p->capacity; l++) { 
-                            System_Object o = (void*)obj;
-                            callback(o);
-                            obj += p->xblock_size;
-                        }
-                    }
+                    heap_iterate_segment_pages(seg, callback);
                 }
             }
         }
     }
+
+    heap_iterate_large_objects(callback);
+}
+
+size_t heap_segments_count() {
+    return mi_regions_count * MI_BITMAP_FIELD_BITS;
+}
+
+void heap_iterate_segment_objects(size_t index, object_callback_t callback) {
+    size_t i = index / MI_BITMAP_FIELD_BITS;
+    size_t j = index % MI_BITMAP_FIELD_BITS;
+    if (i >= mi_regions_count) return;
+
+    uint8_t* start = mi_regions[i].start;
+    if (start == NULL) return;
+    if (!(mi_regions[i].in_use & (1UL << j))) return;
+
+    mi_segment_t *seg = (void*)(start + j * MI_SEGMENT_SIZE);
+    heap_iterate_segment_pages(seg, callback);
+}
+
+void heap_mark_card(System_Object object) {
+    mi_segment_t* segment = _mi_ptr_segment(object);
+
+    // large objects have their own card
+    if (heap_is_large_segment(segment)) {
+        heap_large_object_t* header = LARGE_OBJECT_HEADER(object);
+        if (!atomic_load_explicit(&header->dirty, memory_order_relaxed)) {
+            atomic_store_explicit(&header->dirty, true, memory_order_relaxed);
+        }
+        return;
+    }
+
+    // segments that come from an arena have no place in
+    // the card table, and their objects are never scanned
+    if (segment->memid & 1) return;
+
+    mi_page_t* page = _mi_segment_page_of(segment, object);
+    size_t card = page - segment->pages;
+    uint64_t bit = 1ull << card;
+
+    // only do the atomic op if the card is not already dirty, this
+    // keeps the cache line shared across cpus in the common case
+    _Atomic(uint64_t)* cards = &m_cards[segment->memid >> 1];
+    if ((atomic_load_explicit(cards, memory_order_relaxed) & bit) == 0) {
+        atomic_fetch_or_explicit(cards, bit, memory_order_relaxed);
+    }
 }
 
-// TODO: actually only iterate through dirty objects
 void heap_iterate_dirty_objects(object_callback_t callback) {
-    if (callback) heap_iterate_objects(callback);
+    size_t count = mi_regions_count;
+    for (size_t i = 0; i < count; i++) { // iterate through regions
+        uint8_t* start = mi_regions[i].start;
+        if (start == NULL) continue;
+
+        size_t bitmap = mi_regions[i].in_use;
+        for (size_t j = 0; j < MI_BITMAP_FIELD_BITS; j++) { // iterate through segments in region
+            if (!(bitmap & (1UL << j))) continue;
+
+            // take and clear all the cards of this segment at once, anything that is marked
+            // after this point will be caught on the next iteration
+            uint64_t cards = atomic_exchange(&m_cards[i * MI_BITMAP_FIELD_BITS + j], 0);
+            if (cards == 0 || callback == NULL) continue;
+
+            mi_segment_t *seg = (void*)(start + j * MI_SEGMENT_SIZE);
+            if (heap_is_large_segment(seg)) continue;
+            while (cards != 0) {
+                size_t k = __builtin_ctzll(cards);
+                cards &= cards - 1;
+
+                heap_iterate_page_objects(seg, &seg->pages[k], callback);
+            }
+        }
+    }
+
+    heap_iterate_dirty_large_objects(callback);
 }
 
 System_Object heap_alloc(size_t size, int color) {
-    System_Object o = mi_malloc(size);
-    memset(o, 0, size);
-    o->color = color;
+    if (m_heap_collected_epoch != atomic_load_explicit(&m_heap_reclaim_epoch, memory_order_relaxed)) {
+        heap_collect_local();
+    }
+
+    // mimalloc allocates from a thread local heap, and knows if the page it
+    // allocates from is fresh from the os, in which case no memset is needed
+    System_Object o;
+    if (size <= MI_SMALL_OBJ_SIZE_MAX) {
+        o = mi_zalloc(size);
+    } else {
+        o = heap_alloc_large(size);
+    }
+    if (o == NULL) return NULL;
+
+#ifdef TDN_GC_SIDE_COLORS
+    // only small objects need a table, so we can free directly
+    if (!heap_prepare_side_colors(_mi_ptr_segment(o))) {
+        mi_free(o);
+        return NULL;
+    }
+#endif
+
+    heap_set_color(o, color);
     return o;
 }
 
+void heap_get_stats(heap_stats_t* stats) {
+    size_t segments = 0;
+    size_t committed = 0;
+
+    size_t count = mi_regions_count;
+    for (size_t i = 0; i < count; i++) {
+        if (mi_regions[i].start == NULL) continue;
+        segments += __builtin_popcountll(mi_regions[i].in_use);
+        committed += __builtin_popcountll(mi_regions[i].commit);
+    }
+
+    // the large objects that are inside the regions are already
+    // counted as part of the segments
+    stats->heap_size_bytes = MAX(segments * MI_SEGMENT_SIZE, m_large_objects_bytes);
+    stats->committed_bytes = MAX(committed * MI_SEGMENT_SIZE, stats->heap_size_bytes);
+}
+
+size_t heap_object_size(System_Object o) {
+    if (heap_is_large_segment(_mi_ptr_segment(o))) {
+        return mi_usable_size(LARGE_OBJECT_HEADER(o)) - sizeof(heap_large_object_t);
+    }
+    return mi_usable_size(o);
+}
+
 void heap_free(System_Object o) {
-    mi_free(o);
+    // the header survives the free, make sure that this slot won't
+    // look like a live object on the next iterations
+    heap_set_color(o, COLOR_BLUE);
+    if (heap_is_large_segment(_mi_ptr_segment(o))) {
+        heap_free_large(o);
+    } else {
+        mi_free(o);
+    }
 }
@@ -33,6 +33,14 @@ Possible issues:
 -----------------------------------------------------------------------------*/
 #include "mimalloc_region.h"
 
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// from linux/mempolicy.h
+#define MI_MPOL_PREFERRED 1
+
 // Internal raw OS interface
 size_t  _mi_os_large_page_size(void);
 bool    _mi_os_protect(void* addr, size_t size);
@@ -120,6 +128,63 @@ static bool mi_memid_is_arena(size_t id, mem_region_t** region, mi_bitmap_index_
   Allocate a region is allocated from the OS (or an arena)
 -----------------------------------------------------------------------------*/
 
+// The online numa nodes as the kernel numbers them, read from sysfs. The kernel
+// numbering may have holes (e.g. "0-1,4"), so regions are tagged with the index
+// into this list rather than with mimalloc's node id, which is taken modulo the
+// node count and may not be a real node at all.
+#define MI_REGION_NUMA_MAX  (8 * sizeof(unsigned long) * 4)  // 256 nodes
+
+static int     mi_numa_nodes[MI_REGION_NUMA_MAX];
+static size_t  mi_numa_nodes_count; // = 0, no numa support until _mi_mem_numa_init
+
+void _mi_mem_numa_init(void) {
+  char buf[256];
+  FILE* f = fopen("/sys/devices/system/node/online", "r");
+  if (f == NULL) return;
+  const bool ok = (fgets(buf, sizeof(buf), f) != NULL);
+  fclose(f);
+  if (!ok) return;
+
+  // a comma separated list of ranges, like "0-1,4"
+  size_t count = 0;
+  char* p = buf;
+  while (*p >= '0' && *p <= '9') {
+    long first = strtol(p, &p, 10);
+    long last = first;
+    if (*p == '-') last = strtol(p + 1, &p, 10);
+    for (long node = first; node <= last && count < MI_REGION_NUMA_MAX; node++) {
+      mi_numa_nodes[count++] = (int)node;
+    }
+    if (*p != ',') break;
+    p++;
+  }
+  mi_numa_nodes_count = count;
+}
+
+// The index of the node of the cpu we are running on, -1 if there is only a single node
+static int mi_region_numa_node(void) {
+  if (mi_numa_nodes_count <= 1) return -1;
+  unsigned cpu = 0;
+  unsigned node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) return -1;
+  for (size_t i = 0; i < mi_numa_nodes_count; i++) {
+    if (mi_numa_nodes[i] == (int)node) return (int)i;
+  }
+  return -1;
+}
+
+// Prefer the memory of the region to come from the given node, so threads get
+// node local memory even if the pages are first touched from another node
+static void mi_region_bind_numa_node(void* start, int numa_node) {
+  if (numa_node < 0 || (size_t)numa_node >= mi_numa_nodes_count) return;
+  const int os_node = mi_numa_nodes[numa_node];
+  if (os_node >= (int)MI_REGION_NUMA_MAX) return;
+  unsigned long mask[MI_REGION_NUMA_MAX / (8 * sizeof(unsigned long))] = { 0 };
+  mask[os_node / (8 * sizeof(unsigned long))] = 1ul << (os_node % (8 * sizeof(unsigned long)));
+  // failing is fine, the memory just stays wherever it is first touched
+  syscall(SYS_mbind, start, MI_REGION_SIZE, MI_MPOL_PREFERRED, mask, MI_REGION_NUMA_MAX + 1, 0);
+}
+
 static bool mi_region_try_alloc_os(size_t blocks, bool commit, bool allow_large, mem_region_t** region, mi_bitmap_index_t* bit_idx, mi_os_tld_t* tld)
 {
   // not out of regions yet?
@@ -131,7 +196,8 @@ static bool mi_region_try_alloc_os(size_t blocks, bool commit, bool allow_large,
   bool is_zero = false;
   bool is_pinned = false;
   size_t arena_memid = 0;
-  void* const start = _mi_arena_alloc_aligned(MI_REGION_SIZE, MI_SEGMENT_ALIGN, &region_commit, &region_large, &is_pinned, &is_zero, &arena_memid, tld);
+  // aligned to the region size, so the runtime can find the region of an address without searching
+  void* const start = _mi_arena_alloc_aligned(MI_REGION_SIZE, MI_REGION_SIZE, &region_commit, &region_large, &is_pinned, &is_zero, &arena_memid, tld);
   if (start == NULL) return false;
   mi_assert_internal(!(region_large && !allow_large));
   mi_assert_internal(!region_large || region_commit);
@@ -162,7 +228,8 @@ static bool mi_region_try_alloc_os(size_t blocks, bool commit, bool allow_large,
   info.x.valid = true;
   info.x.is_large = region_large;
   info.x.is_pinned = is_pinned;
-  info.x.numa_node = (short)_mi_os_numa_node(tld);
+  info.x.numa_node = (short)mi_region_numa_node();
+  mi_region_bind_numa_node(start, info.x.numa_node);
   mi_atomic_store_release(&r->info, info.value); // now make it available to others
   *region = r;
   return true;
@@ -218,7 +285,7 @@ static void* mi_region_try_alloc(size_t blocks, bool* commit, bool* large, bool*
   mi_assert_internal(blocks <= MI_BITMAP_FIELD_BITS);
   mem_region_t* region;
   mi_bitmap_index_t bit_idx;
-  const int numa_node = (_mi_os_numa_node_count() <= 1 ? -1 : _mi_os_numa_node(tld));
+  const int numa_node = mi_region_numa_node();
   // try to claim in existing regions
   if (!mi_region_try_claim(numa_node, blocks, *large, &region, &bit_idx, tld)) {
     // otherwise try to allocate a fresh region and claim in there
@@ -427,6 +494,44 @@ void _mi_mem_collect(mi_os_tld_t* tld) {
 }
 
 
+/* ----------------------------------------------------------------------------
+  decommit the free blocks, the region recommits them once they are claimed again
+-----------------------------------------------------------------------------*/
+void _mi_mem_decommit_free(size_t retain) {
+  size_t retained = 0;
+  size_t rcount = mi_atomic_load_relaxed(&mi_regions_count);
+  for (size_t i = 0; i < rcount; i++) {
+    mem_region_t* region = &mi_regions[i];
+    uint8_t* start = (uint8_t*)mi_atomic_load_ptr_acquire(uint8_t, &region->start);
+    if (start == NULL) continue;
+
+    mi_region_info_t info = { .value = mi_atomic_load_relaxed(&region->info) };
+    if (info.x.is_large || info.x.is_pinned) continue;
+
+    for (size_t j = 0; j < MI_BITMAP_FIELD_BITS; j++) {
+      size_t bit = (size_t)1 << j;
+      if ((mi_atomic_load_relaxed(&region->commit) & bit) == 0) continue;
+
+      // claim the block so no one allocates it while we decommit it
+      size_t in_use = mi_atomic_load_relaxed(&region->in_use);
+      if ((in_use & bit) != 0) continue;
+      if (!mi_atomic_cas_strong_acq_rel(&region->in_use, &in_use, in_use | bit)) continue;
+
+      if (retained + MI_SEGMENT_SIZE <= retain) {
+        retained += MI_SEGMENT_SIZE;
+      } else {
+        _mi_abandoned_await_readers(); // ensure no pending reads
+        if (_mi_os_decommit(start + j * MI_SEGMENT_SIZE, MI_SEGMENT_SIZE, &_mi_stats_main)) {
+          mi_atomic_and_acq_rel(&region->commit, ~bit);
+        }
+      }
+
+      mi_atomic_and_acq_rel(&region->in_use, ~bit);
+    }
+  }
+}
+
+
 /* ----------------------------------------------------------------------------
   Other
 -----------------------------------------------------------------------------*/
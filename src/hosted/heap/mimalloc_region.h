@@ -48,3 +48,9 @@ typedef struct mem_region_s {
   _Atomic(size_t)           arena_memid; // if allocated from a (huge page) arena
   _Atomic(size_t)           padding;     // round to 8 fields (needs to be atomic for msvc, see issue #508)
 } mem_region_t;
+
+// Read the online numa nodes, regions are only tagged and bound to nodes after this
+void _mi_mem_numa_init(void);
+
+// Decommit the free blocks of the regions, keeping up to `retain` bytes of them committed
+void _mi_mem_decommit_free(size_t retain);
@@ -0,0 +1,587 @@
+#define _GNU_SOURCE
+#include "io.h"
+
+#include <thread/scheduler.h>
+#include <thread/waitable.h>
+#include <util/except.h>
+
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+
+// the most events we take from epoll at once
+#define IO_POLLER_BATCH     128
+
+// set on the ref count of a handle once it is closed
+#define IO_HANDLE_CLOSED    (1u << 31)
+
+struct io_handle {
+    int fd;
+
+    // is it registered with the poller, otherwise every operation blocks
+    bool pollable;
+
+    // use send/recv rather than write/read
+    bool socket;
+
+    // a reference for the open fd and one for every operation in progress,
+    // the fd is closed once it was closed and the last one is gone
+    _Atomic(uint32_t) refs;
+
+    // one for the owner and one for the fd, the handle is freed once the
+    // owner released it and the fd is closed
+    _Atomic(uint32_t) holders;
+
+    // sent to by the poller when the fd becomes readable/writable, a single
+    // buffered slot so an edge is never lost, a spurious one only costs a retry
+    waitable_t* readable;
+    waitable_t* writable;
+
+    // handles to free, only touched once the fd is closed
+    struct io_handle* next_free;
+};
+
+static int m_io_epoll = -1;
+static int m_io_wakeup = -1;
+static int m_io_poller_error = 0;
+static pthread_once_t m_io_poller_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Closed handles, freed by the poller once it is done with the events it already got,
+ * since those might still point to them
+ */
+static _Atomic(io_handle_t*) m_io_free_handles = NULL;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// The poller
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void io_free_closed_handles() {
+    io_handle_t* handle = atomic_exchange(&m_io_free_handles, NULL);
+    while (handle != NULL) {
+        io_handle_t* next = handle->next_free;
+        release_waitable(handle->readable);
+        release_waitable(handle->writable);
+        free(handle);
+        handle = next;
+    }
+}
+
+static void* io_poller_thread(void* arg) {
+    struct epoll_event events[IO_POLLER_BATCH];
+
+    while (true) {
+        int count = epoll_wait(m_io_epoll, events, IO_POLLER_BATCH, -1);
+        if (count < 0) {
+            if (errno != EINTR) {
+                WARN("io: epoll_wait failed: %d", errno);
+            }
+            continue;
+        }
+
+        for (int i = 0; i < count; i++) {
+            io_handle_t* handle = events[i].data.ptr;
+            uint32_t ready = events[i].events;
+
+            if (handle == NULL) {
+                // someone closed a handle, the counter itself does not matter
+                uint64_t value;
+                (void)read(m_io_wakeup, &value, sizeof(value));
+                continue;
+            }
+
+            // errors and hangups wake both sides, the operation itself reports them
+            if (ready & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                waitable_send(handle->readable, false);
+            }
+            if (ready & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+                waitable_send(handle->writable, false);
+            }
+        }
+
+        io_free_closed_handles();
+    }
+
+    return NULL;
+}
+
+static void io_poller_init() {
+    pthread_t thread;
+
+    m_io_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (m_io_epoll < 0) {
+        goto error;
+    }
+
+    m_io_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_io_wakeup < 0) {
+        goto error;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(m_io_epoll, EPOLL_CTL_ADD, m_io_wakeup, &event) != 0) {
+        goto error;
+    }
+
+    int err = pthread_create(&thread, NULL, io_poller_thread, NULL);
+    if (err != 0) {
+        m_io_poller_error = -err;
+        return;
+    }
+    pthread_detach(thread);
+    return;
+
+error:
+    m_io_poller_error = -errno;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Handles
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static int io_handle_create(int fd, bool pollable, bool socket, io_handle_t** out) {
+    io_handle_t* handle = calloc(1, sizeof(io_handle_t));
+    if (handle == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+
+    handle->fd = fd;
+    handle->socket = socket;
+    handle->refs = 1;
+    handle->holders = 2;
+
+    if (pollable) {
+        pthread_once(&m_io_poller_once, io_poller_init);
+        if (m_io_poller_error != 0) {
+            close(fd);
+            free(handle);
+            return m_io_poller_error;
+        }
+
+        int err = 0;
+        handle->readable = create_waitable(1);
+        handle->writable = create_waitable(1);
+        if (handle->readable == NULL || handle->writable == NULL) {
+            err = -ENOMEM;
+        } else {
+            // edge triggered, the waitables remember the edges until someone waits
+            struct epoll_event event = {
+                .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                .data.ptr = handle,
+            };
+            if (epoll_ctl(m_io_epoll, EPOLL_CTL_ADD, fd, &event) == 0) {
+                handle->pollable = true;
+            } else if (errno == EPERM) {
+                // the kernel can't poll it, treat it like a file
+                (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            } else {
+                err = -errno;
+            }
+        }
+
+        if (!handle->pollable) {
+            SAFE_RELEASE_WAITABLE(handle->readable);
+            SAFE_RELEASE_WAITABLE(handle->writable);
+        }
+
+        if (err != 0) {
+            close(fd);
+            free(handle);
+            return err;
+        }
+    }
+
+    *out = handle;
+    return 0;
+}
+
+static bool io_handle_acquire(io_handle_t* handle) {
+    uint32_t refs = atomic_load_explicit(&handle->refs, memory_order_relaxed);
+    do {
+        if (refs & IO_HANDLE_CLOSED) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&handle->refs, &refs, refs + 1,
+                                                    memory_order_acquire, memory_order_relaxed));
+    return true;
+}
+
+static void io_handle_put(io_handle_t* handle) {
+    if (atomic_fetch_sub_explicit(&handle->holders, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    if (!handle->pollable) {
+        free(handle);
+        return;
+    }
+
+    // the poller frees it once it is done with the events of its current batch
+    handle->next_free = atomic_load_explicit(&m_io_free_handles, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&m_io_free_handles, &handle->next_free, handle,
+                                                  memory_order_release, memory_order_relaxed));
+
+    uint64_t value = 1;
+    (void)write(m_io_wakeup, &value, sizeof(value));
+}
+
+static void io_handle_release(io_handle_t* handle) {
+    if (atomic_fetch_sub_explicit(&handle->refs, 1, memory_order_acq_rel) != (IO_HANDLE_CLOSED | 1)) {
+        return;
+    }
+
+    if (handle->pollable) {
+        epoll_ctl(m_io_epoll, EPOLL_CTL_DEL, handle->fd, NULL);
+    }
+    close(handle->fd);
+
+    io_handle_put(handle);
+}
+
+void io_close(io_handle_t* handle) {
+    if (atomic_fetch_or(&handle->refs, IO_HANDLE_CLOSED) & IO_HANDLE_CLOSED) {
+        return;
+    }
+
+    // wake anyone waiting on it, they will see it closed
+    if (handle->pollable) {
+        waitable_close(handle->readable);
+        waitable_close(handle->writable);
+    }
+
+    io_handle_release(handle);
+}
+
+void io_release(io_handle_t* handle) {
+    io_close(handle);
+    io_handle_put(handle);
+}
+
+/**
+ * Wait for the poller to say the fd might be ready
+ */
+static int io_wait(waitable_t* waitable) {
+    return waitable_wait(waitable, true) == WAITABLE_CLOSED ? -EBADF : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Files
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int io_open(const char* path, int flags, int mode, io_handle_t** out) {
+    // opening can block as well, think network filesystems
+    bool released = scheduler_block_enter();
+    int fd = open(path, flags | O_CLOEXEC, mode);
+    int err = fd < 0 ? -errno : 0;
+    scheduler_block_exit(released);
+    if (fd < 0) {
+        return err;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        err = -errno;
+        close(fd);
+        return err;
+    }
+
+    bool pollable = !S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode) && !S_ISDIR(st.st_mode);
+    if (pollable && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
+        pollable = false;
+    }
+
+    return io_handle_create(fd, pollable, false, out);
+}
+
+static int64_t io_read_once(io_handle_t* handle, void* buffer, size_t size, int64_t offset) {
+    ssize_t result;
+    if (handle->socket) {
+        result = recv(handle->fd, buffer, size, 0);
+    } else if (offset < 0) {
+        result = read(handle->fd, buffer, size);
+    } else {
+        result = pread(handle->fd, buffer, size, offset);
+    }
+    return result < 0 ? -errno : result;
+}
+
+static int64_t io_write_once(io_handle_t* handle, const void* buffer, size_t size, int64_t offset) {
+    ssize_t result;
+    if (handle->socket) {
+        // a closed peer should be an error, not a signal
+        result = send(handle->fd, buffer, size, MSG_NOSIGNAL);
+    } else if (offset < 0) {
+        result = write(handle->fd, buffer, size);
+    } else {
+        result = pwrite(handle->fd, buffer, size, offset);
+    }
+    return result < 0 ? -errno : result;
+}
+
+int64_t io_read(io_handle_t* handle, void* buffer, size_t size, int64_t offset) {
+    if (!io_handle_acquire(handle)) {
+        return -EBADF;
+    }
+
+    int64_t result;
+    if (!handle->pollable) {
+        bool released = scheduler_block_enter();
+        do {
+            result = io_read_once(handle, buffer, size, offset);
+        } while (result == -EINTR);
+        scheduler_block_exit(released);
+    } else {
+        while (true) {
+            result = io_read_once(handle, buffer, size, offset);
+            if (result >= 0) {
+                break;
+            }
+
+            if (result == -EINTR) {
+                continue;
+            }
+
+            if (result != -EAGAIN && result != -EWOULDBLOCK) {
+                break;
+            }
+
+            result = io_wait(handle->readable);
+            if (result < 0) {
+                break;
+            }
+        }
+    }
+
+    io_handle_release(handle);
+    return result;
+}
+
+int64_t io_write(io_handle_t* handle, const void* buffer, size_t size, int64_t offset) {
+    if (!io_handle_acquire(handle)) {
+        return -EBADF;
+    }
+
+    bool released = false;
+    if (!handle->pollable) {
+        released = scheduler_block_enter();
+    }
+
+    const uint8_t* data = buffer;
+    size_t written = 0;
+    int64_t result = 0;
+    while (written < size) {
+        result = io_write_once(handle, data + written, size - written, offset < 0 ? offset : offset + (int64_t)written);
+        if (result >= 0) {
+            written += result;
+            continue;
+        }
+
+        if (result == -EINTR) {
+            continue;
+        }
+
+        if (!handle->pollable || (result != -EAGAIN && result != -EWOULDBLOCK)) {
+            break;
+        }
+
+        result = io_wait(handle->writable);
+        if (result < 0) {
+            break;
+        }
+    }
+
+    if (!handle->pollable) {
+        scheduler_block_exit(released);
+    }
+
+    io_handle_release(handle);
+
+    // whatever got written before an error still counts
+    return result < 0 && written == 0 ? result : (int64_t)written;
+}
+
+int64_t io_seek(io_handle_t* handle, int64_t offset, int whence) {
+    if (!io_handle_acquire(handle)) {
+        return -EBADF;
+    }
+
+    off_t result = lseek(handle->fd, offset, whence);
+    int64_t ret = result < 0 ? -errno : result;
+
+    io_handle_release(handle);
+    return ret;
+}
+
+int64_t io_get_length(io_handle_t* handle) {
+    if (!io_handle_acquire(handle)) {
+        return -EBADF;
+    }
+
+    struct stat st;
+    int64_t ret = fstat(handle->fd, &st) != 0 ? -errno : st.st_size;
+
+    io_handle_release(handle);
+    return ret;
+}
+
+int io_set_length(io_handle_t* handle, int64_t length) {
+    if (!io_handle_acquire(handle)) {
+        return -EBADF;
+    }
+
+    bool released = scheduler_block_enter();
+    int ret = ftruncate(handle->fd, length) != 0 ? -errno : 0;
+    scheduler_block_exit(released);
+
+    io_handle_release(handle);
+    return ret;
+}
+
+int io_flush(io_handle_t* handle) {
+    if (!io_handle_acquire(handle)) {
+        return -EBADF;
+    }
+
+    int ret = 0;
+    if (!handle->pollable) {
+        bool released = scheduler_block_enter();
+        if (fsync(handle->fd) != 0) {
+            ret = -errno;
+        }
+        scheduler_block_exit(released);
+    }
+
+    io_handle_release(handle);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sockets
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int io_socket(int domain, int type, int protocol, io_handle_t** out) {
+    int fd = socket(domain, type | SOCK_NONBLOCK | SOCK_CLOEXEC, protocol);
+    if (fd < 0) {
+        return -errno;
+    }
+    return io_handle_create(fd, true, true, out);
+}
+
+int io_bind(io_handle_t* handle, const struct sockaddr* address, socklen_t length) {
+    if (!io_handle_acquire(handle)) {
+        return -EBADF;
+    }
+
+    int ret = bind(handle->fd, address, length) != 0 ? -errno : 0;
+
+    io_handle_release(handle);
+    return ret;
+}
+
+int io_listen(io_handle_t* handle, int backlog) {
+    if (!io_handle_acquire(handle)) {
+        return -EBADF;
+    }
+
+    int ret = listen(handle->fd, backlog) != 0 ? -errno : 0;
+
+    io_handle_release(handle);
+    return ret;
+}
+
+int io_accept(io_handle_t* handle, io_handle_t** out) {
+    if (!io_handle_acquire(handle)) {
+        return -EBADF;
+    }
+
+    int ret;
+    while (true) {
+        int fd = accept4(handle->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd >= 0) {
+            ret = io_handle_create(fd, true, true, out);
+            break;
+        }
+
+        ret = -errno;
+        if (ret == -EINTR || ret == -ECONNABORTED) {
+            continue;
+        }
+
+        if (ret != -EAGAIN && ret != -EWOULDBLOCK) {
+            break;
+        }
+
+        ret = io_wait(handle->readable);
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    io_handle_release(handle);
+    return ret;
+}
+
+int io_connect(io_handle_t* handle, const struct sockaddr* address, socklen_t length) {
+    if (!io_handle_acquire(handle)) {
+        return -EBADF;
+    }
+
+    int ret = 0;
+    if (connect(handle->fd, address, length) != 0) {
+        ret = -errno;
+    }
+
+    if (ret == -EINPROGRESS || ret == -EINTR) {
+        while (true) {
+            // an unconnected socket already reports as writable, so
+            // the first wake up might be before the connection is done
+            ret = io_wait(handle->writable);
+            if (ret < 0) {
+                break;
+            }
+
+            int error = 0;
+            socklen_t error_length = sizeof(error);
+            if (getsockopt(handle->fd, SOL_SOCKET, SO_ERROR, &error, &error_length) != 0) {
+                ret = -errno;
+                break;
+            }
+            if (error != 0) {
+                ret = -error;
+                break;
+            }
+
+            struct sockaddr_storage peer;
+            socklen_t peer_length = sizeof(peer);
+            if (getpeername(handle->fd, (struct sockaddr*)&peer, &peer_length) == 0) {
+                ret = 0;
+                break;
+            }
+            if (errno != ENOTCONN) {
+                ret = -errno;
+                break;
+            }
+        }
+    }
+
+    io_handle_release(handle);
+    return ret;
+}
+
+int io_shutdown(io_handle_t* handle, int how) {
+    if (!io_handle_acquire(handle)) {
+        return -EBADF;
+    }
+
+    int ret = shutdown(handle->fd, how) != 0 ? -errno : 0;
+
+    io_handle_release(handle);
+    return ret;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+//
+// Native file and socket I/O for the runtime threads. Sockets, pipes and anything else the
+// kernel can poll are non-blocking, an operation that would block waits on a waitable that
+// the poller thread sends to once epoll reports the fd ready, so the thread is parked like
+// on any other wait. Regular files can't be polled, they are read and written directly with
+// the cpu handed to another thread for the duration of the call.
+//
+// All the calls return a negative errno on failure.
+//
+
+typedef struct io_handle io_handle_t;
+
+/**
+ * Open a file
+ *
+ * @param path      [IN] The path
+ * @param flags     [IN] The open(2) flags, O_NONBLOCK and O_CLOEXEC are added as needed
+ * @param mode      [IN] The mode of a created file
+ * @param out       [OUT] The new handle
+ */
+int io_open(const char* path, int flags, int mode, io_handle_t** out);
+
+/**
+ * Create a socket, same arguments as socket(2)
+ */
+int io_socket(int domain, int type, int protocol, io_handle_t** out);
+
+/**
+ * Close the handle, operations that are waiting on it, or that are started
+ * after it, fail with -EBADF, the fd itself is closed once the last of them
+ * returns, closing it again does nothing
+ */
+void io_close(io_handle_t* handle);
+
+/**
+ * Release the handle of the owner, closing it if it is still open, the handle
+ * must not be used after this
+ */
+void io_release(io_handle_t* handle);
+
+/**
+ * Read into the buffer, at the given offset or at the current position if negative
+ *
+ * @return The amount of bytes read, zero at the end
+ */
+int64_t io_read(io_handle_t* handle, void* buffer, size_t size, int64_t offset);
+
+/**
+ * Write the buffer, at the given offset or at the current position if negative,
+ * a write to a socket or a pipe only returns once all of it was written
+ *
+ * @return The amount of bytes written
+ */
+int64_t io_write(io_handle_t* handle, const void* buffer, size_t size, int64_t offset);
+
+/**
+ * Same as lseek(2)
+ */
+int64_t io_seek(io_handle_t* handle, int64_t offset, int whence);
+
+/**
+ * The size of the file
+ */
+int64_t io_get_length(io_handle_t* handle);
+
+/**
+ * Truncate or extend the file
+ */
+int io_set_length(io_handle_t* handle, int64_t length);
+
+/**
+ * Write out everything the kernel has buffered for the file
+ */
+int io_flush(io_handle_t* handle);
+
+int io_bind(io_handle_t* handle, const struct sockaddr* address, socklen_t length);
+
+int io_listen(io_handle_t* handle, int backlog);
+
+/**
+ * Wait for a connection on a listening socket
+ */
+int io_accept(io_handle_t* handle, io_handle_t** out);
+
+/**
+ * Connect the socket, waits until the connection is done
+ */
+int io_connect(io_handle_t* handle, const struct sockaddr* address, socklen_t length);
+
+/**
+ * Same as shutdown(2)
+ */
+int io_shutdown(io_handle_t* handle, int how);
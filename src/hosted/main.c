@@ -1,17 +1,23 @@
 
 #include <dotnet/jit/jit.h>
 #include <dotnet/gc/gc.h>
+#include <dotnet/gc/alloc_profiler.h>
+#include <dotnet/monitor.h>
 #include <dotnet/loader.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
 #include "time/tsc.h"
+#include "thread/profiler.h"
+#include "sync/lock_stats.h"
+#include "util/trace_event.h"
+#include "util/stb_ds.h"
 
 void *corelib_file, *kernel_file;
 size_t corelib_file_size, kernel_file_size;
 
-int get_cpu_count() { return 8; }
-
 void load_file(const char* name, void** file, uint64_t* size) {
     struct stat s;
     int fd = open(name, O_RDONLY);
@@ -23,22 +29,70 @@ void load_file(const char* name, void** file, uint64_t* size) {
 int main() {
     load_file("Pentagon/Corelib/bin/Release/net6.0/Corelib.dll", &corelib_file, &corelib_file_size);
     load_file("Pentagon/Pentagon/bin/Release/net6.0/Pentagon.dll", &kernel_file, &kernel_file_size);
+
+    // the events are written out in the background, TDN_TRACE picks the categories
+    init_trace_events();
+
     //init_gc();
+    jit_set_perf_map(getenv("TDN_PERF_MAP") != NULL);
     init_jit();
 
+    // the profiler can also be started later with PROFILER_TOGGLE_SIGNAL
+    init_profiler();
+    if (getenv("TDN_PROFILE") != NULL) {
+        profiler_start(atoi(getenv("TDN_PROFILE")));
+    }
+
+    // sample the allocations, the profile is written once the kernel returns
+    if (getenv("TDN_ALLOC_PROFILE") != NULL) {
+        alloc_profiler_start(atoi(getenv("TDN_ALLOC_PROFILE")));
+    }
+
     // load the corelib
     uint64_t start = microtime();
     loader_load_corelib(corelib_file, corelib_file_size);
     printf("corelib loading took %lums\n", (microtime() - start) / 1000);
 
+    // the assemblies the kernel uses besides the corelib, separated by `:`, they are all
+    // loaded together with the kernel and may only reference the ones before them
+    void** buffers = NULL;
+    size_t* buffer_sizes = NULL;
+    if (getenv("TDN_ASSEMBLIES") != NULL) {
+        char* assemblies = strdup(getenv("TDN_ASSEMBLIES"));
+        for (char* name = strtok(assemblies, ":"); name != NULL; name = strtok(NULL, ":")) {
+            void* file;
+            size_t file_size;
+            load_file(name, &file, &file_size);
+            arrpush(buffers, file);
+            arrpush(buffer_sizes, file_size);
+        }
+        free(assemblies);
+    }
+    arrpush(buffers, kernel_file);
+    arrpush(buffer_sizes, kernel_file_size);
+
     start = microtime();
-    System_Reflection_Assembly kernel_asm = NULL;
-    loader_load_assembly(kernel_file, kernel_file_size, &kernel_asm);
+    System_Reflection_Assembly* loaded = calloc(arrlen(buffers), sizeof(System_Reflection_Assembly));
+    loader_load_assemblies(buffers, buffer_sizes, arrlen(buffers), loaded);
+    System_Reflection_Assembly kernel_asm = loaded[arrlen(buffers) - 1];
     printf("kernel loading took %dms\n", (microtime() - start) / 1000);
 
     method_result_t(*entry_point)() = kernel_asm->EntryPoint->MirFunc->addr;
     method_result_t result = entry_point();
     //CHECK(result.exception == NULL, "Got exception: \"%U\"", result.exception->Message);
     printf("Kernel output: %d\n", result.value);
+
+    alloc_profiler_stop();
+    trace_events_flush();
+
+    // a snapshot of whatever the kernel left behind, for the heap analyzer
+    if (getenv("TDN_HEAP_SNAPSHOT") != NULL) {
+        gc_write_heap_snapshot(getenv("TDN_HEAP_SNAPSHOT"));
+    }
+
+#ifdef TDN_LOCK_STATS
+    lock_stats_dump();
+    monitor_dump_stats();
+#endif
 }
 
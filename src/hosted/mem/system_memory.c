@@ -0,0 +1,76 @@
+#include "system_memory.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+
+//
+// Only the cgroup the process sees as the root of the hierarchy is checked, which is
+// the one a container is limited by, both the unified (v2) and the v1 memory controller
+// layouts are supported.
+//
+
+#define CGROUP_V2_LIMIT     "/sys/fs/cgroup/memory.max"
+#define CGROUP_V2_USAGE     "/sys/fs/cgroup/memory.current"
+#define CGROUP_V1_LIMIT     "/sys/fs/cgroup/memory/memory.limit_in_bytes"
+#define CGROUP_V1_USAGE     "/sys/fs/cgroup/memory/memory.usage_in_bytes"
+
+/**
+ * Read a single number from a file, false if it is missing or says "max"
+ */
+static bool read_size_file(const char* path, size_t* value) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+
+    unsigned long long number;
+    bool found = fscanf(file, "%llu", &number) == 1;
+    fclose(file);
+
+    if (found) {
+        *value = number;
+    }
+    return found;
+}
+
+static size_t get_physical_memory() {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    return pages > 0 && page_size > 0 ? (size_t)pages * page_size : 0;
+}
+
+size_t get_cgroup_memory_limit() {
+    size_t limit;
+    if (!read_size_file(CGROUP_V2_LIMIT, &limit) && !read_size_file(CGROUP_V1_LIMIT, &limit)) {
+        return 0;
+    }
+
+    // v1 reports no limit as a huge number
+    size_t physical = get_physical_memory();
+    if (physical != 0 && limit >= physical) {
+        return 0;
+    }
+
+    return limit;
+}
+
+size_t get_total_memory() {
+    size_t limit = get_cgroup_memory_limit();
+    return limit != 0 ? limit : get_physical_memory();
+}
+
+size_t get_used_memory() {
+    size_t used;
+    if (get_cgroup_memory_limit() != 0 &&
+        (read_size_file(CGROUP_V2_USAGE, &used) || read_size_file(CGROUP_V1_USAGE, &used))) {
+        return used;
+    }
+
+    long available = sysconf(_SC_AVPHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t physical = get_physical_memory();
+    size_t free = available > 0 && page_size > 0 ? (size_t)available * page_size : 0;
+    return physical > free ? physical - free : 0;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * The memory limit of the cgroup we run in, 0 if there is none
+ */
+size_t get_cgroup_memory_limit();
+
+/**
+ * The memory available to the process, the cgroup limit if there is
+ * one, otherwise the physical memory
+ */
+size_t get_total_memory();
+
+/**
+ * The memory in use, by the cgroup if there is a limit on it, otherwise
+ * by the whole system
+ */
+size_t get_used_memory();
@@ -1,13 +1,49 @@
 #include "conditional.h"
 
+#include <thread/scheduler.h>
+
+#include <errno.h>
+#include <time.h>
+
 void conditional_signal(conditional_t* cond) {
     pthread_cond_signal(cond);
 }
 
-void conditional_wait(conditional_t* conditional, mutex_t* mutex) {
+void (conditional_wait)(conditional_t* conditional, mutex_t* mutex) {
+    bool released = scheduler_block_enter();
     pthread_cond_wait(conditional, mutex);
+    scheduler_block_exit(released);
+}
+
+bool (conditional_wait_until)(conditional_t* conditional, mutex_t* mutex, uint64_t deadline) {
+    // microtime is based on the realtime clock, same as the timed wait
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000,
+        .tv_nsec = (deadline % 1000000) * 1000
+    };
+    bool released = scheduler_block_enter();
+    bool signaled = pthread_cond_timedwait(conditional, mutex, &ts) != ETIMEDOUT;
+    scheduler_block_exit(released);
+    return signaled;
 }
 
 void conditional_broadcast(conditional_t* conditional) {
     pthread_cond_broadcast(conditional);
-}
\ No newline at end of file
+}
+
+#ifdef TDN_LOCK_STATS
+
+void conditional_wait_site(conditional_t* conditional, mutex_t* mutex, lock_site_t* site) {
+    lock_stats_released(mutex);
+    (conditional_wait)(conditional, mutex);
+    lock_stats_acquired(mutex, site, 0, false);
+}
+
+bool conditional_wait_until_site(conditional_t* conditional, mutex_t* mutex, uint64_t deadline, lock_site_t* site) {
+    lock_stats_released(mutex);
+    bool signaled = (conditional_wait_until)(conditional, mutex, deadline);
+    lock_stats_acquired(mutex, site, 0, false);
+    return signaled;
+}
+
+#endif
@@ -10,6 +10,31 @@ typedef pthread_cond_t conditional_t;
 
 void conditional_wait(conditional_t* conditional, mutex_t* mutex);
 
+/**
+ * Wait on the conditional, giving up once the deadline passes, the mutex
+ * is locked again in either case
+ *
+ * @param deadline  the deadline, in microtime() units
+ * @return true if signaled, false on timeout
+ */
+bool conditional_wait_until(conditional_t* conditional, mutex_t* mutex, uint64_t deadline);
+
 void conditional_signal(conditional_t* conditional);
 
 void conditional_broadcast(conditional_t* conditional);
+
+#ifdef TDN_LOCK_STATS
+
+// the mutex is released while waiting, and taken again as another acquire
+// of the site of the wait, it does not count as contention
+
+void conditional_wait_site(conditional_t* conditional, mutex_t* mutex, lock_site_t* site);
+
+bool conditional_wait_until_site(conditional_t* conditional, mutex_t* mutex, uint64_t deadline, lock_site_t* site);
+
+#define conditional_wait(conditional, mutex) \
+    conditional_wait_site(conditional, mutex, LOCK_SITE(mutex))
+#define conditional_wait_until(conditional, mutex, deadline) \
+    conditional_wait_until_site(conditional, mutex, deadline, LOCK_SITE(mutex))
+
+#endif
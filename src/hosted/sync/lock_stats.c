@@ -0,0 +1,107 @@
+#include "lock_stats.h"
+
+#include <thread/thread.h>
+#include <util/fastrand.h>
+#include <util/stb_ds.h>
+#include <time/tsc.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+
+// the most sampled locks a thread can hold at once, more are not sampled
+#define LOCK_STATS_MAX_HELD 16
+
+typedef struct held_lock {
+    void* lock;
+    lock_site_t* site;
+    uint64_t acquired;
+} held_lock_t;
+
+/**
+ * The sampled locks the current thread holds, innermost last
+ */
+static THREAD_LOCAL held_lock_t m_held_locks[LOCK_STATS_MAX_HELD];
+static THREAD_LOCAL int m_held_lock_count = 0;
+
+/**
+ * All the sites that were used at least once, only ever pushed to
+ */
+static _Atomic(lock_site_t*) m_lock_sites = NULL;
+
+static void lock_site_register(lock_site_t* site) {
+    bool expected = false;
+    if (!atomic_compare_exchange_strong(&site->registered, &expected, true)) {
+        return;
+    }
+
+    site->next = atomic_load_explicit(&m_lock_sites, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&m_lock_sites, &site->next, site,
+                                                  memory_order_release, memory_order_relaxed));
+}
+
+void lock_stats_acquired(void* lock, lock_site_t* site, uint64_t wait_time, bool contended) {
+    if (!atomic_load_explicit(&site->registered, memory_order_relaxed)) {
+        lock_site_register(site);
+    }
+
+    atomic_fetch_add_explicit(&site->acquires, 1, memory_order_relaxed);
+    if (contended) {
+        atomic_fetch_add_explicit(&site->contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&site->wait_time, wait_time, memory_order_relaxed);
+
+        uint64_t max = atomic_load_explicit(&site->max_wait_time, memory_order_relaxed);
+        while (wait_time > max && !atomic_compare_exchange_weak_explicit(&site->max_wait_time, &max, wait_time,
+                                                                           memory_order_relaxed, memory_order_relaxed));
+    }
+
+    if (m_held_lock_count < LOCK_STATS_MAX_HELD && fastrandn(LOCK_STATS_HOLD_SAMPLE_RATE) == 0) {
+        m_held_locks[m_held_lock_count++] = (held_lock_t){
+            .lock = lock,
+            .site = site,
+            .acquired = get_tsc(),
+        };
+    }
+}
+
+void lock_stats_released(void* lock) {
+    // usually the innermost one
+    for (int i = m_held_lock_count - 1; i >= 0; i--) {
+        if (m_held_locks[i].lock != lock) {
+            continue;
+        }
+
+        lock_site_t* site = m_held_locks[i].site;
+        atomic_fetch_add_explicit(&site->hold_samples, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&site->hold_time, get_tsc() - m_held_locks[i].acquired, memory_order_relaxed);
+
+        m_held_locks[i] = m_held_locks[--m_held_lock_count];
+        break;
+    }
+}
+
+static int lock_site_compare(const void* a, const void* b) {
+    uint64_t wa = atomic_load((*(lock_site_t**)a)->wait_time);
+    uint64_t wb = atomic_load((*(lock_site_t**)b)->wait_time);
+    return wa < wb ? 1 : wa > wb ? -1 : 0;
+}
+
+void lock_stats_dump() {
+    lock_site_t** sites = NULL;
+    for (lock_site_t* site = atomic_load(&m_lock_sites); site != NULL; site = site->next) {
+        arrpush(sites, site);
+    }
+    qsort(sites, arrlen(sites), sizeof(lock_site_t*), lock_site_compare);
+
+    printf("%12s %12s %14s %12s %12s  %s\n", "acquires", "contended", "wait(us)", "max(us)", "avg hold(us)", "site");
+    for (int i = 0; i < arrlen(sites); i++) {
+        lock_site_t* site = sites[i];
+        uint64_t hold_samples = atomic_load(&site->hold_samples);
+        printf("%12lu %12lu %14.0f %12.0f %12.2f  %s (%s:%d)\n",
+               atomic_load(&site->acquires), atomic_load(&site->contended),
+               tsc_to_us(atomic_load(&site->wait_time)), tsc_to_us(atomic_load(&site->max_wait_time)),
+               hold_samples == 0 ? 0.0 : tsc_to_us(atomic_load(&site->hold_time)) / (double)hold_samples,
+               site->name, site->file, site->line);
+    }
+
+    arrfree(sites);
+}
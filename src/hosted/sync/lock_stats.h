@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Lock contention tracking, only built with TDN_LOCK_STATS. Every place that takes a
+// mutex or a spinlock gets its own site, named after the lock expression, which counts
+// the acquires, the ones that had to wait and how long they waited. The hold time is
+// only measured for a sample of the acquires, since it needs the time on both ends.
+//
+
+typedef struct lock_site {
+    // the lock expression and where it was taken
+    const char* name;
+    const char* file;
+    int line;
+
+    // all the sites that were used at least once
+    struct lock_site* next;
+    _Atomic(bool) registered;
+
+    _Atomic(uint64_t) acquires;
+    _Atomic(uint64_t) contended;
+    _Atomic(uint64_t) wait_time;
+    _Atomic(uint64_t) max_wait_time;
+    _Atomic(uint64_t) hold_samples;
+    _Atomic(uint64_t) hold_time;
+} lock_site_t;
+
+/**
+ * The site of the current source line, a single static per use
+ */
+#define LOCK_SITE(lock) \
+    ({ \
+        static lock_site_t __site = { .name = #lock, .file = __FILE__, .line = __LINE__ }; \
+        &__site; \
+    })
+
+/**
+ * One in this many acquires has its hold time measured
+ */
+#define LOCK_STATS_HOLD_SAMPLE_RATE 16
+
+/**
+ * Count a lock that was just taken
+ *
+ * @param lock      [IN] The lock, to match the release
+ * @param site      [IN] Where it was taken
+ * @param wait_time [IN] How long it took to get it, in get_tsc() ticks
+ * @param contended [IN] Did it have to wait for another thread
+ */
+void lock_stats_acquired(void* lock, lock_site_t* site, uint64_t wait_time, bool contended);
+
+/**
+ * Count a lock that is about to be released
+ *
+ * @param lock      [IN] The lock
+ */
+void lock_stats_released(void* lock);
+
+/**
+ * Print all the sites, the ones that waited the longest first
+ */
+void lock_stats_dump();
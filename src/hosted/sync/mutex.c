@@ -1,9 +1,78 @@
 #include "mutex.h"
 
-void mutex_lock(mutex_t* mutex) {
+#include <thread/scheduler.h>
+#include <time/tsc.h>
+
+#include <time.h>
+
+void (mutex_lock)(mutex_t* mutex) {
+    if (pthread_mutex_trylock(mutex) == 0) {
+        return;
+    }
+
+    // going to block, let someone else use the cpu
+    bool released = scheduler_block_enter();
     pthread_mutex_lock(mutex);
+    scheduler_block_exit(released);
 }
 
-void mutex_unlock(mutex_t* mutex) {
+void (mutex_unlock)(mutex_t* mutex) {
     pthread_mutex_unlock(mutex);
 }
+
+bool (mutex_try_lock)(mutex_t* mutex) {
+    return pthread_mutex_trylock(mutex) == 0;
+}
+
+bool (mutex_lock_until)(mutex_t* mutex, uint64_t deadline) {
+    // microtime is based on the realtime clock, same as the timed lock
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000,
+        .tv_nsec = (deadline % 1000000) * 1000
+    };
+    if (pthread_mutex_trylock(mutex) == 0) {
+        return true;
+    }
+
+    bool released = scheduler_block_enter();
+    bool locked = pthread_mutex_timedlock(mutex, &ts) == 0;
+    scheduler_block_exit(released);
+    return locked;
+}
+
+#ifdef TDN_LOCK_STATS
+
+void mutex_lock_site(mutex_t* mutex, lock_site_t* site) {
+    if (pthread_mutex_trylock(mutex) == 0) {
+        lock_stats_acquired(mutex, site, 0, false);
+        return;
+    }
+
+    uint64_t start = get_tsc();
+    (mutex_lock)(mutex);
+    lock_stats_acquired(mutex, site, get_tsc() - start, true);
+}
+
+bool mutex_try_lock_site(mutex_t* mutex, lock_site_t* site) {
+    if (pthread_mutex_trylock(mutex) != 0) {
+        return false;
+    }
+    lock_stats_acquired(mutex, site, 0, false);
+    return true;
+}
+
+bool mutex_lock_until_site(mutex_t* mutex, uint64_t deadline, lock_site_t* site) {
+    if (pthread_mutex_trylock(mutex) == 0) {
+        lock_stats_acquired(mutex, site, 0, false);
+        return true;
+    }
+
+    uint64_t start = get_tsc();
+    if (!(mutex_lock_until)(mutex, deadline)) {
+        return false;
+    }
+    lock_stats_acquired(mutex, site, get_tsc() - start, true);
+    return true;
+}
+
+#endif
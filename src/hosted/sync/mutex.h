@@ -14,4 +14,34 @@ void mutex_lock(mutex_t* mutex);
 
 bool mutex_try_lock(mutex_t* mutex);
 
+/**
+ * Lock the mutex, giving up once the deadline passes
+ *
+ * @param deadline  the deadline, in microtime() units
+ * @return true if the mutex was locked, false on timeout
+ */
+bool mutex_lock_until(mutex_t* mutex, uint64_t deadline);
+
 void mutex_unlock(mutex_t* mutex);
+
+#ifdef TDN_LOCK_STATS
+
+#include "lock_stats.h"
+
+void mutex_lock_site(mutex_t* mutex, lock_site_t* site);
+
+bool mutex_try_lock_site(mutex_t* mutex, lock_site_t* site);
+
+bool mutex_lock_until_site(mutex_t* mutex, uint64_t deadline, lock_site_t* site);
+
+#define mutex_lock(mutex)                   mutex_lock_site(mutex, LOCK_SITE(mutex))
+#define mutex_try_lock(mutex)               mutex_try_lock_site(mutex, LOCK_SITE(mutex))
+#define mutex_lock_until(mutex, deadline)   mutex_lock_until_site(mutex, deadline, LOCK_SITE(mutex))
+#define mutex_unlock(mutex) \
+    ({ \
+        mutex_t* __mutex = mutex; \
+        lock_stats_released(__mutex); \
+        (mutex_unlock)(__mutex); \
+    })
+
+#endif
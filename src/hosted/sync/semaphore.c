@@ -1,7 +1,18 @@
 #include "semaphore.h"
 
+#include <thread/scheduler.h>
+
+#include <errno.h>
+
 void semaphore_acquire(semaphore_t* semaphore, bool lifo) {
-    sem_wait(semaphore);
+    if (sem_trywait(semaphore) == 0) {
+        return;
+    }
+
+    // going to block, let someone else use the cpu
+    bool released = scheduler_block_enter();
+    while (sem_wait(semaphore) != 0 && errno == EINTR);
+    scheduler_block_exit(released);
 }
 void semaphore_release(semaphore_t* semaphore, bool handoff) {
     sem_post(semaphore);
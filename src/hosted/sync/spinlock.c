@@ -1,9 +1,38 @@
 #include "spinlock.h"
 
-void spinlock_lock(spinlock_t* spinlock) {
+#include <time/tsc.h>
+
+void (spinlock_lock)(spinlock_t* spinlock) {
     pthread_mutex_lock(spinlock);
 }
 
-void spinlock_unlock(spinlock_t* spinlock) {
+void (spinlock_unlock)(spinlock_t* spinlock) {
     pthread_mutex_unlock(spinlock);
 }
+
+bool (spinlock_try_lock)(spinlock_t* spinlock) {
+    return pthread_mutex_trylock(spinlock) == 0;
+}
+
+#ifdef TDN_LOCK_STATS
+
+void spinlock_lock_site(spinlock_t* spinlock, lock_site_t* site) {
+    if (pthread_mutex_trylock(spinlock) == 0) {
+        lock_stats_acquired(spinlock, site, 0, false);
+        return;
+    }
+
+    uint64_t start = get_tsc();
+    pthread_mutex_lock(spinlock);
+    lock_stats_acquired(spinlock, site, get_tsc() - start, true);
+}
+
+bool spinlock_try_lock_site(spinlock_t* spinlock, lock_site_t* site) {
+    if (pthread_mutex_trylock(spinlock) != 0) {
+        return false;
+    }
+    lock_stats_acquired(spinlock, site, 0, false);
+    return true;
+}
+
+#endif
@@ -15,3 +15,22 @@ bool spinlock_try_lock(spinlock_t* spinlock);
 void spinlock_unlock(spinlock_t* spinlock);
 
 bool spinlock_is_locked(spinlock_t* spinlock);
+
+#ifdef TDN_LOCK_STATS
+
+#include "lock_stats.h"
+
+void spinlock_lock_site(spinlock_t* spinlock, lock_site_t* site);
+
+bool spinlock_try_lock_site(spinlock_t* spinlock, lock_site_t* site);
+
+#define spinlock_lock(spinlock)             spinlock_lock_site(spinlock, LOCK_SITE(spinlock))
+#define spinlock_try_lock(spinlock)         spinlock_try_lock_site(spinlock, LOCK_SITE(spinlock))
+#define spinlock_unlock(spinlock) \
+    ({ \
+        spinlock_t* __spinlock = spinlock; \
+        lock_stats_released(__spinlock); \
+        (spinlock_unlock)(__spinlock); \
+    })
+
+#endif
@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include "scheduler.h"
+
+#include <util/except.h>
+
+#include <pthread.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sched.h>
+#include <unistd.h>
+
+//
+// The topology is read once from the os, only the cpus we are allowed to run on are
+// counted, and they are ordered by their numa node so the scheduler cpus of the same
+// node are next to each other.
+//
+
+typedef struct cpu_info {
+    // the id of the cpu as the os knows it
+    int os_id;
+
+    // the numa node of the cpu
+    int numa_node;
+} cpu_info_t;
+
+static cpu_info_t* m_cpu_infos = NULL;
+static int m_cpu_info_count = 0;
+static int m_numa_node_count = 1;
+
+static pthread_once_t m_topology_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Find the numa node of the cpu, the cpu directory in sysfs
+ * has a nodeN link for the node it belongs to
+ */
+static int read_cpu_numa_node(int os_id) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", os_id);
+
+    int node = 0;
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return node;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int value;
+        if (sscanf(entry->d_name, "node%d", &value) == 1) {
+            node = value;
+            break;
+        }
+    }
+
+    closedir(dir);
+    return node;
+}
+
+static int compare_cpu_info(const void* a, const void* b) {
+    const cpu_info_t* ca = a;
+    const cpu_info_t* cb = b;
+    if (ca->numa_node != cb->numa_node) {
+        return ca->numa_node - cb->numa_node;
+    }
+    return ca->os_id - cb->os_id;
+}
+
+static void topology_init() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        // no affinity info, assume we can use all the online cpus
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long i = 0; i < online && i < CPU_SETSIZE; i++) {
+            CPU_SET(i, &set);
+        }
+    }
+
+    int count = CPU_COUNT(&set);
+    if (count <= 0) {
+        CPU_SET(0, &set);
+        count = 1;
+    }
+
+    m_cpu_infos = malloc(count * sizeof(cpu_info_t));
+    ASSERT(m_cpu_infos != NULL);
+
+    for (int i = 0; i < CPU_SETSIZE && m_cpu_info_count < count; i++) {
+        if (!CPU_ISSET(i, &set)) continue;
+
+        cpu_info_t* info = &m_cpu_infos[m_cpu_info_count++];
+        info->os_id = i;
+        info->numa_node = read_cpu_numa_node(i);
+        if (info->numa_node + 1 > m_numa_node_count) {
+            m_numa_node_count = info->numa_node + 1;
+        }
+    }
+
+    qsort(m_cpu_infos, m_cpu_info_count, sizeof(cpu_info_t), compare_cpu_info);
+}
+
+int get_cpu_count() {
+    pthread_once(&m_topology_once, topology_init);
+    return m_cpu_info_count;
+}
+
+int get_numa_node_count() {
+    pthread_once(&m_topology_once, topology_init);
+    return m_numa_node_count;
+}
+
+int get_cpu_numa_node(int cpu) {
+    pthread_once(&m_topology_once, topology_init);
+    return m_cpu_infos[cpu % m_cpu_info_count].numa_node;
+}
+
+int get_cpu_os_id(int cpu) {
+    pthread_once(&m_topology_once, topology_init);
+    return m_cpu_infos[cpu % m_cpu_info_count].os_id;
+}
@@ -0,0 +1,362 @@
+#define _GNU_SOURCE
+#include "profiler.h"
+#include "scheduler.h"
+
+#include <dotnet/jit/jit.h>
+#include <util/stb_ds.h>
+#include <util/trace.h>
+
+#include <sys/time.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+//
+// The cpu time timer delivers SIGPROF to whichever thread was running when it fired, the
+// handler takes the pc from the interrupted context, same as the thread pausing code does,
+// and follows the frame pointers up the stack of the thread. Every thread has its own ring
+// which only it writes to, so taking a sample needs no locks or allocations.
+//
+// A collector thread empties the rings a few times a second and counts the unique stacks,
+// the addresses are only turned into method names once the profile is written.
+//
+
+// the most frames we keep for a single sample, leaf first
+#define PROFILER_MAX_FRAMES         32
+
+// samples every thread can hold until the collector gets to them
+#define PROFILER_RING_SIZE          128
+
+// how often the collector empties the rings
+#define PROFILER_COLLECT_INTERVAL   (100 * 1000 * 1000)
+
+typedef struct profiler_sample {
+    int frame_count;
+    uintptr_t frames[PROFILER_MAX_FRAMES];
+} profiler_sample_t;
+
+typedef struct profiler_ring {
+    // only advanced by the thread itself, from the signal handler
+    _Atomic(size_t) head;
+
+    // only touched by the collector
+    size_t tail;
+
+    profiler_sample_t samples[PROFILER_RING_SIZE];
+} profiler_ring_t;
+
+typedef struct profiler_stack {
+    size_t count;
+    profiler_sample_t sample;
+} profiler_stack_t;
+
+/**
+ * The unique stacks seen since the start, and a map from the hash of
+ * the stack to its index, protected by the profiler lock
+ */
+static profiler_stack_t* m_profiler_stacks = NULL;
+static struct {
+    size_t key;
+    int value;
+}* m_profiler_stack_map = NULL;
+
+/**
+ * Samples overwritten before the collector got to them
+ */
+static size_t m_profiler_lost = 0;
+
+static pthread_mutex_t m_profiler_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(bool) m_profiler_running = false;
+
+/**
+ * Wakes the collector, set along with the toggle flag from the toggle signal
+ */
+static sem_t m_profiler_wakeup;
+static volatile sig_atomic_t m_profiler_toggle = 0;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Sampling
+//----------------------------------------------------------------------------------------------------------------------
+
+static void profiler_sample_handler(int signum, siginfo_t* info, void* arg) {
+    thread_t* thread = get_current_thread();
+    if (thread == NULL) {
+        return;
+    }
+
+    // the collector did not see this thread yet
+    profiler_ring_t* ring = atomic_load_explicit(&thread->profile, memory_order_acquire);
+    if (ring == NULL) {
+        return;
+    }
+
+    ucontext_t* context = arg;
+    greg_t* gregs = context->uc_mcontext.gregs;
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    profiler_sample_t* sample = &ring->samples[head % PROFILER_RING_SIZE];
+    sample->frames[0] = gregs[REG_RIP];
+    int count = 1;
+
+    // the jitted code always keeps a frame pointer, native code might not, so only follow
+    // it while it stays on our own stack and keeps going up, which makes it safe to read
+    uintptr_t low = gregs[REG_RSP];
+    uintptr_t frame = gregs[REG_RBP];
+    while (count < PROFILER_MAX_FRAMES && frame >= low && frame + 16 <= thread->stack_top && (frame & 7) == 0) {
+        uintptr_t* words = (uintptr_t*)frame;
+        if (words[1] == 0) {
+            break;
+        }
+        sample->frames[count++] = words[1];
+        low = frame + 16;
+        frame = words[0];
+    }
+    sample->frame_count = count;
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void profiler_toggle_handler(int signum) {
+    m_profiler_toggle = 1;
+    sem_post(&m_profiler_wakeup);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Collecting
+//----------------------------------------------------------------------------------------------------------------------
+
+static void profiler_record(profiler_sample_t* sample) {
+    size_t size = sample->frame_count * sizeof(uintptr_t);
+    size_t hash = stbds_hash_bytes(sample->frames, size, sample->frame_count);
+
+    // collisions simply move on to the next hash
+    while (true) {
+        int index = hmgeti(m_profiler_stack_map, hash);
+        if (index < 0) {
+            break;
+        }
+
+        profiler_stack_t* stack = &m_profiler_stacks[m_profiler_stack_map[index].value];
+        if (stack->sample.frame_count == sample->frame_count && memcmp(stack->sample.frames, sample->frames, size) == 0) {
+            stack->count++;
+            return;
+        }
+
+        hash++;
+    }
+
+    hmput(m_profiler_stack_map, hash, arrlen(m_profiler_stacks));
+    arrpush(m_profiler_stacks, ((profiler_stack_t){ .count = 1, .sample = *sample }));
+}
+
+/**
+ * Take all the samples out of the ring, or throw them away if not recording
+ */
+static void profiler_drain_ring(profiler_ring_t* ring, bool record) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head - ring->tail > PROFILER_RING_SIZE) {
+        if (record) {
+            m_profiler_lost += head - ring->tail - PROFILER_RING_SIZE;
+        }
+        ring->tail = head - PROFILER_RING_SIZE;
+    }
+
+    if (!record) {
+        ring->tail = head;
+        return;
+    }
+
+    while (ring->tail != head) {
+        size_t position = ring->tail++;
+        profiler_sample_t sample = ring->samples[position % PROFILER_RING_SIZE];
+
+        // the thread keeps sampling, it might have wrapped around and
+        // started writing over the sample while we copied it
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&ring->head, memory_order_relaxed) - position >= PROFILER_RING_SIZE) {
+            m_profiler_lost++;
+            continue;
+        }
+
+        profiler_record(&sample);
+    }
+}
+
+/**
+ * Go over all the threads, giving a ring to the ones that don't have one yet,
+ * called with the profiler lock held
+ */
+static void profiler_collect(bool record) {
+    lock_all_threads();
+    for (int i = 0; i < arrlen(g_all_threads); i++) {
+        thread_t* thread = g_all_threads[i];
+        profiler_ring_t* ring = atomic_load_explicit(&thread->profile, memory_order_relaxed);
+        if (ring != NULL) {
+            profiler_drain_ring(ring, record);
+            continue;
+        }
+
+        // the samples of the thread start from the next tick
+        ring = calloc(1, sizeof(profiler_ring_t));
+        if (ring != NULL) {
+            atomic_store_explicit(&thread->profile, ring, memory_order_release);
+        }
+    }
+    unlock_all_threads();
+}
+
+/**
+ * Write the collected stacks, root first, called with the profiler lock held
+ */
+static void profiler_write() {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/tdn-profile-%d.folded", getpid());
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        WARN("profiler: failed to open %s", path);
+        return;
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < arrlen(m_profiler_stacks); i++) {
+        profiler_stack_t* stack = &m_profiler_stacks[i];
+        bool last_native = false;
+        bool first = true;
+        for (int j = stack->sample.frame_count - 1; j >= 0; j--) {
+            // return addresses point past the call, which might already be the next method
+            uintptr_t pc = stack->sample.frames[j];
+            const char* name = jit_get_code_name(j == 0 ? pc : pc - 1);
+
+            // native code doesn't have names, so fold it into a single frame
+            bool native = name == NULL;
+            if (native) {
+                if (last_native) {
+                    continue;
+                }
+                name = "[native]";
+            }
+            last_native = native;
+
+            fprintf(file, "%s%s", first ? "" : ";", name);
+            first = false;
+        }
+        fprintf(file, " %zu\n", stack->count);
+        total += stack->count;
+    }
+
+    fclose(file);
+
+    TRACE("profiler: wrote %zu samples to %s, %zu lost", total, path, m_profiler_lost);
+}
+
+static void* profiler_thread(void* arg) {
+    while (true) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += PROFILER_COLLECT_INTERVAL;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        sem_timedwait(&m_profiler_wakeup, &deadline);
+
+        if (m_profiler_toggle) {
+            m_profiler_toggle = 0;
+            if (profiler_is_running()) {
+                profiler_stop();
+            } else {
+                profiler_start(0);
+            }
+        } else if (profiler_is_running()) {
+            pthread_mutex_lock(&m_profiler_lock);
+            profiler_collect(true);
+            pthread_mutex_unlock(&m_profiler_lock);
+        }
+    }
+
+    return NULL;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Control
+//----------------------------------------------------------------------------------------------------------------------
+
+static void profiler_set_timer(int hz) {
+    struct itimerval timer = { 0 };
+    if (hz > 0) {
+        timer.it_interval.tv_usec = 1000000 / hz;
+        timer.it_value = timer.it_interval;
+    }
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void init_profiler() {
+    sem_init(&m_profiler_wakeup, 0, 0);
+
+    // handlers are shared by all the threads, so this is enough for all of them
+    struct sigaction sa = {
+        .sa_sigaction = &profiler_sample_handler,
+        .sa_flags = SA_SIGINFO | SA_RESTART
+    };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    signal(PROFILER_TOGGLE_SIGNAL, profiler_toggle_handler);
+
+    // a plain pthread, it never touches managed state and
+    // must not get in the way of the scheduler
+    pthread_t thread;
+    pthread_attr_t attrs;
+    pthread_attr_init(&attrs);
+    pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attrs, profiler_thread, NULL) != 0) {
+        WARN("profiler: failed to start the collector thread");
+    }
+    pthread_attr_destroy(&attrs);
+}
+
+void profiler_start(int hz) {
+    if (hz <= 0) {
+        hz = PROFILER_DEFAULT_HZ;
+    }
+
+    pthread_mutex_lock(&m_profiler_lock);
+
+    if (!atomic_load(&m_profiler_running)) {
+        // start from a clean profile, and forget whatever the
+        // threads still had from the last time
+        arrfree(m_profiler_stacks);
+        hmfree(m_profiler_stack_map);
+        m_profiler_lost = 0;
+        profiler_collect(false);
+
+        profiler_set_timer(hz);
+        atomic_store(&m_profiler_running, true);
+        TRACE("profiler: sampling at %dhz", hz);
+    }
+
+    pthread_mutex_unlock(&m_profiler_lock);
+}
+
+void profiler_stop() {
+    pthread_mutex_lock(&m_profiler_lock);
+
+    if (atomic_load(&m_profiler_running)) {
+        profiler_set_timer(0);
+        atomic_store(&m_profiler_running, false);
+
+        profiler_collect(true);
+        profiler_write();
+    }
+
+    pthread_mutex_unlock(&m_profiler_lock);
+}
+
+bool profiler_is_running() {
+    return atomic_load(&m_profiler_running);
+}
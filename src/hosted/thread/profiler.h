@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <signal.h>
+
+/**
+ * The sampling rate used when none is given
+ */
+#define PROFILER_DEFAULT_HZ 99
+
+/**
+ * Sending this signal to the process starts the profiler, or stops it and writes
+ * the profile, so a running process can be profiled without a restart:
+ *
+ *      kill -s RTMIN+1 <pid>
+ */
+#define PROFILER_TOGGLE_SIGNAL (SIGRTMIN + 1)
+
+/**
+ * Install the signal handlers and start the thread that collects the samples,
+ * the profiler itself stays off until started
+ */
+void init_profiler();
+
+/**
+ * Start sampling all the runtime threads
+ *
+ * @param hz    [IN] Samples per second of cpu time, PROFILER_DEFAULT_HZ if zero
+ */
+void profiler_start(int hz);
+
+/**
+ * Stop sampling, and write everything collected since the start to
+ * /tmp/tdn-profile-<pid>.folded in the collapsed stack format used
+ * by flamegraph and speedscope
+ */
+void profiler_stop();
+
+/**
+ * Is the profiler currently sampling
+ */
+bool profiler_is_running();
@@ -7,12 +7,643 @@
 #include <sys/syscall.h>
 #include <sys/user.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
 #include <util/stb_ds.h>
+#include <util/except.h>
+#include <util/fastrand.h>
+#include <sync/spinlock.h>
+#include <time/tsc.h>
 
-void scheduler_preempt_disable() {}
-void scheduler_preempt_enable() {}
-void scheduler_ready_thread() {} // TODO: repurpose the same waitgroup here
-void scheduler_yield() {}
+//
+// Managed threads are still backed by pthreads, but only as many of them as we have
+// cpus may run at the same time. Each cpu is a token that has its own run queue, a
+// thread that yields, blocks or exits hands its cpu to the next thread from the local
+// queue, and if that is empty steals half of the queue of another cpu, preferring cpus
+// of the same numa node. A thread that holds its cpu for longer than a time slice while
+// others are runnable gets preempted by the monitor thread.
+//
+// Threads bound to a cpu sit in a separate queue of that cpu that is never stolen from,
+// and are not part of the global runnable count.
+//
+// Threads that are not part of the scheduler (like the main thread) run freely.
+//
+
+// the time slice before a thread is preempted, in microseconds
+#define SCHEDULER_TIME_SLICE        10000
+
+// the signal used to preempt a running thread
+#define SCHEDULER_PREEMPT_SIGNAL    SIGURG
+
+typedef struct cpu {
+    // protects the run queue
+    spinlock_t lock;
+
+    // the local run queue
+    thread_t* head;
+    thread_t* tail;
+    int length;
+
+    // threads bound to this cpu, protected by the same lock
+    thread_t* bound_head;
+    thread_t* bound_tail;
+    atomic_int bound_length;
+
+    // the numa node of the cpu
+    int numa_node;
+
+    // the thread holding the cpu, NULL if idle
+    thread_t* _Atomic current;
+} cpu_t;
+
+static cpu_t* m_cpus = NULL;
+static int m_cpu_count = 0;
+
+// stack of idle cpus, protected by the lock
+static spinlock_t m_idle_lock = { 0 };
+static int* m_idle_cpus = NULL;
+static atomic_int m_idle_count = 0;
+
+// the amount of threads sitting in all the run queues
+static atomic_int m_runnable_count = 0;
+
+// used to spread threads readied from outside the scheduler
+static atomic_int m_next_cpu = 0;
+
+static pthread_once_t m_scheduler_once = PTHREAD_ONCE_INIT;
+static pthread_t m_sysmon;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Run queues
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void run_queue_push(cpu_t* cpu, thread_t* thread) {
+    thread->sched_link = NULL;
+
+    spinlock_lock(&cpu->lock);
+    if (cpu->tail != NULL) {
+        cpu->tail->sched_link = thread;
+    } else {
+        cpu->head = thread;
+    }
+    cpu->tail = thread;
+    cpu->length++;
+    spinlock_unlock(&cpu->lock);
+}
+
+static thread_t* run_queue_pop(cpu_t* cpu) {
+    spinlock_lock(&cpu->lock);
+    thread_t* thread = cpu->head;
+    if (thread != NULL) {
+        cpu->head = thread->sched_link;
+        if (cpu->head == NULL) {
+            cpu->tail = NULL;
+        }
+        cpu->length--;
+        thread->sched_link = NULL;
+    }
+    spinlock_unlock(&cpu->lock);
+    return thread;
+}
+
+static void bound_queue_push(cpu_t* cpu, thread_t* thread) {
+    thread->sched_link = NULL;
+
+    spinlock_lock(&cpu->lock);
+    if (cpu->bound_tail != NULL) {
+        cpu->bound_tail->sched_link = thread;
+    } else {
+        cpu->bound_head = thread;
+    }
+    cpu->bound_tail = thread;
+    atomic_fetch_add(&cpu->bound_length, 1);
+    spinlock_unlock(&cpu->lock);
+}
+
+static thread_t* bound_queue_pop(cpu_t* cpu) {
+    if (atomic_load(&cpu->bound_length) == 0) {
+        return NULL;
+    }
+
+    spinlock_lock(&cpu->lock);
+    thread_t* thread = cpu->bound_head;
+    if (thread != NULL) {
+        cpu->bound_head = thread->sched_link;
+        if (cpu->bound_head == NULL) {
+            cpu->bound_tail = NULL;
+        }
+        atomic_fetch_sub(&cpu->bound_length, 1);
+        thread->sched_link = NULL;
+    }
+    spinlock_unlock(&cpu->lock);
+    return thread;
+}
+
+/**
+ * Steal half of the run queue of the victim, the first stolen thread is
+ * returned and the rest are moved to the local run queue
+ */
+static thread_t* run_queue_steal(cpu_t* cpu, cpu_t* victim) {
+    spinlock_lock(&victim->lock);
+
+    int count = (victim->length + 1) / 2;
+    if (count == 0) {
+        spinlock_unlock(&victim->lock);
+        return NULL;
+    }
+
+    thread_t* first = victim->head;
+    thread_t* last = first;
+    for (int i = 1; i < count; i++) {
+        last = last->sched_link;
+    }
+
+    victim->head = last->sched_link;
+    if (victim->head == NULL) {
+        victim->tail = NULL;
+    }
+    victim->length -= count;
+    last->sched_link = NULL;
+
+    spinlock_unlock(&victim->lock);
+
+    // keep the rest in our own queue
+    thread_t* rest = first->sched_link;
+    first->sched_link = NULL;
+    if (rest != NULL) {
+        spinlock_lock(&cpu->lock);
+        if (cpu->tail != NULL) {
+            cpu->tail->sched_link = rest;
+        } else {
+            cpu->head = rest;
+        }
+        cpu->tail = last;
+        cpu->length += count - 1;
+        spinlock_unlock(&cpu->lock);
+    }
+
+    return first;
+}
+
+/**
+ * Find the next thread to run on the given cpu
+ */
+static thread_t* find_runnable(int cpu) {
+    // bound threads have nowhere else to run
+    thread_t* thread = bound_queue_pop(&m_cpus[cpu]);
+    if (thread != NULL) {
+        return thread;
+    }
+
+    thread = run_queue_pop(&m_cpus[cpu]);
+
+    // steal from our own node first, and only then from the others
+    if (thread == NULL && atomic_load(&m_runnable_count) > 0) {
+        int node = m_cpus[cpu].numa_node;
+        int start = fastrandn(m_cpu_count);
+        for (int pass = 0; pass < 2 && thread == NULL; pass++) {
+            for (int i = 0; i < m_cpu_count && thread == NULL; i++) {
+                int victim = (start + i) % m_cpu_count;
+                if (victim == cpu) continue;
+                if ((m_cpus[victim].numa_node == node) != (pass == 0)) continue;
+                thread = run_queue_steal(&m_cpus[cpu], &m_cpus[victim]);
+            }
+        }
+    }
+
+    if (thread != NULL) {
+        atomic_fetch_sub(&m_runnable_count, 1);
+    }
+
+    return thread;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Cpu handoff
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void push_idle_cpu(int cpu) {
+    spinlock_lock(&m_idle_lock);
+    m_idle_cpus[atomic_load(&m_idle_count)] = cpu;
+    atomic_fetch_add(&m_idle_count, 1);
+    spinlock_unlock(&m_idle_lock);
+}
+
+static int pop_idle_cpu() {
+    int cpu = -1;
+    spinlock_lock(&m_idle_lock);
+    int count = atomic_load(&m_idle_count);
+    if (count != 0) {
+        cpu = m_idle_cpus[count - 1];
+        atomic_fetch_sub(&m_idle_count, 1);
+    }
+    spinlock_unlock(&m_idle_lock);
+    return cpu;
+}
+
+/**
+ * Take a specific cpu out of the idle stack, returns false if it is not idle
+ */
+static bool take_idle_cpu(int cpu) {
+    bool found = false;
+    spinlock_lock(&m_idle_lock);
+    int count = atomic_load(&m_idle_count);
+    for (int i = 0; i < count; i++) {
+        if (m_idle_cpus[i] == cpu) {
+            m_idle_cpus[i] = m_idle_cpus[count - 1];
+            atomic_fetch_sub(&m_idle_count, 1);
+            found = true;
+            break;
+        }
+    }
+    spinlock_unlock(&m_idle_lock);
+    return found;
+}
+
+/**
+ * Give the cpu to the thread and wake it up
+ */
+static void run_on(int cpu, thread_t* thread) {
+    thread->cpu = cpu;
+    thread->slice_start = microtime();
+    atomic_store(&m_cpus[cpu].current, thread);
+    atomic_store(&thread->status, THREAD_STATUS_RUNNING);
+    sem_post(&thread->park);
+}
+
+/**
+ * Make sure no cpu stays idle while there are runnable threads, both a thread
+ * becoming runnable and a cpu becoming idle check the other counter after
+ * updating their own one, so one of them is going to see the other
+ */
+static void wake_idle_cpus() {
+    while (atomic_load(&m_runnable_count) > 0 && atomic_load(&m_idle_count) > 0) {
+        int cpu = pop_idle_cpu();
+        if (cpu < 0) {
+            break;
+        }
+
+        thread_t* next = find_runnable(cpu);
+        if (next == NULL) {
+            // someone else took it, check again
+            push_idle_cpu(cpu);
+            continue;
+        }
+
+        run_on(cpu, next);
+    }
+}
+
+/**
+ * Pass the cpu to the next runnable thread, or mark it as idle
+ *
+ * @return the thread that got the cpu
+ */
+static thread_t* handoff_cpu(int cpu) {
+    thread_t* next = find_runnable(cpu);
+    if (next != NULL) {
+        run_on(cpu, next);
+        return next;
+    }
+
+    atomic_store(&m_cpus[cpu].current, NULL);
+    push_idle_cpu(cpu);
+
+    // a thread bound to us might have been queued right before we went idle
+    if (atomic_load(&m_cpus[cpu].bound_length) > 0 && take_idle_cpu(cpu)) {
+        next = find_runnable(cpu);
+        if (next != NULL) {
+            run_on(cpu, next);
+            return next;
+        }
+        push_idle_cpu(cpu);
+    }
+
+    wake_idle_cpus();
+    return NULL;
+}
+
+static void make_runnable(thread_t* thread, int cpu) {
+    atomic_store(&thread->status, THREAD_STATUS_RUNNABLE);
+
+    int affinity = thread->affinity;
+    if (affinity >= 0) {
+        // only the bound cpu can run it, so wake it if it is idle, the
+        // idle stack is checked after queueing just like the counters
+        bound_queue_push(&m_cpus[affinity], thread);
+        if (take_idle_cpu(affinity)) {
+            thread_t* next = find_runnable(affinity);
+            if (next != NULL) {
+                run_on(affinity, next);
+            } else {
+                push_idle_cpu(affinity);
+                wake_idle_cpus();
+            }
+        }
+        return;
+    }
+
+    run_queue_push(&m_cpus[cpu], thread);
+    atomic_fetch_add(&m_runnable_count, 1);
+    wake_idle_cpus();
+}
+
+static void pin_to_cpu(thread_t* thread) {
+    if (thread->pinned_cpu == thread->cpu) {
+        return;
+    }
+
+    // failing is fine, we just stay unpinned
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(get_cpu_os_id(thread->cpu), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    thread->pinned_cpu = thread->cpu;
+}
+
+/**
+ * Enter a region in which the thread doesn't touch the heap, the gc may
+ * handshake on our behalf instead of waiting for us to get to a safepoint
+ */
+static bool gc_safe_region_enter(thread_t* thread) {
+    if (thread->gc_safe) {
+        return false;
+    }
+
+    spinlock_lock(&thread->gc_lock);
+    thread_save_registers(&thread->save_state);
+    thread->gc_safe = true;
+    spinlock_unlock(&thread->gc_lock);
+    return true;
+}
+
+static void gc_safe_region_exit(thread_t* thread, bool entered) {
+    if (!entered) {
+        return;
+    }
+
+    // waits for any handshake done on our behalf
+    spinlock_lock(&thread->gc_lock);
+    thread->gc_safe = false;
+    spinlock_unlock(&thread->gc_lock);
+}
+
+/**
+ * Take the pending preemption of the thread, if any
+ */
+static bool take_preempt_pending(thread_t* thread) {
+    if (!thread->preempt_pending) {
+        return false;
+    }
+
+    thread->preempt_pending = false;
+    return true;
+}
+
+/**
+ * Wait until we are given a cpu
+ */
+static void park(thread_t* thread) {
+    bool safe = gc_safe_region_enter(thread);
+
+    // the gc suspend signal can interrupt the wait
+    while (sem_wait(&thread->park) != 0 && errno == EINTR);
+    pin_to_cpu(thread);
+
+    // we gave the cpu away anyways
+    take_preempt_pending(thread);
+
+    gc_safe_region_exit(thread, safe);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Preemption
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Polled by threads that are not scheduled by us, it is never set
+ */
+static volatile bool m_no_preempt_pending = false;
+
+volatile bool* scheduler_get_preempt_flag() {
+    thread_t* thread = get_current_thread();
+    return thread != NULL ? &thread->preempt_pending : &m_no_preempt_pending;
+}
+
+/**
+ * The thread might be anywhere, holding a lock or inside of malloc, so the handler only
+ * marks the preemption as pending and the thread yields on its next preemption point
+ */
+static void scheduler_preempt_handler(int signum, siginfo_t* info, void* arg) {
+    thread_t* thread = get_current_thread();
+    if (thread == NULL || atomic_load(&thread->status) != THREAD_STATUS_RUNNING) {
+        return;
+    }
+
+    thread->preempt_pending = true;
+}
+
+/**
+ * Preempts threads that ran for more than a time slice while other threads
+ * are waiting for a cpu
+ */
+static void* scheduler_sysmon(void* arg) {
+    while (true) {
+        usleep(SCHEDULER_TIME_SLICE);
+
+        bool runnable = atomic_load(&m_runnable_count) > 0;
+
+        uint64_t now = microtime();
+        for (int i = 0; i < m_cpu_count; i++) {
+            if (!runnable && atomic_load(&m_cpus[i].bound_length) == 0) continue;
+
+            thread_t* thread = atomic_load(&m_cpus[i].current);
+            if (thread != NULL && now - thread->slice_start >= SCHEDULER_TIME_SLICE) {
+                pthread_kill(thread->pthread, SCHEDULER_PREEMPT_SIGNAL);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void scheduler_init() {
+    m_cpu_count = get_cpu_count();
+    m_cpus = calloc(m_cpu_count, sizeof(cpu_t));
+    m_idle_cpus = malloc(m_cpu_count * sizeof(int));
+    ASSERT(m_cpus != NULL && m_idle_cpus != NULL);
+
+    // all the cpus start idle, lowest one is taken first
+    for (int i = 0; i < m_cpu_count; i++) {
+        m_cpus[i].lock = INIT_SPINLOCK();
+        m_cpus[i].numa_node = get_cpu_numa_node(i);
+        m_idle_cpus[i] = m_cpu_count - 1 - i;
+    }
+    m_idle_count = m_cpu_count;
+
+    // the preemption signal, restart syscalls so preemption is transparent
+    struct sigaction sa = {
+        .sa_sigaction = &scheduler_preempt_handler,
+        .sa_flags = SA_SIGINFO | SA_RESTART
+    };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SCHEDULER_PREEMPT_SIGNAL, &sa, NULL);
+
+    // the monitor is a plain pthread, it is not part of the scheduler
+    pthread_create(&m_sysmon, NULL, scheduler_sysmon, NULL);
+}
+
+void scheduler_preempt_disable() {
+    thread_t* thread = get_current_thread();
+    if (thread != NULL) {
+        thread->preempt_count++;
+    }
+}
+
+void scheduler_preempt_enable() {
+    thread_t* thread = get_current_thread();
+    if (thread == NULL) {
+        return;
+    }
+
+    ASSERT(thread->preempt_count > 0);
+    if (--thread->preempt_count == 0 && take_preempt_pending(thread)) {
+        scheduler_yield();
+    }
+}
+
+void scheduler_preempt_point() {
+    thread_t* thread = get_current_thread();
+    if (thread == NULL || thread->preempt_count > 0) {
+        return;
+    }
+
+    if (take_preempt_pending(thread)) {
+        scheduler_yield();
+    }
+}
+
+bool scheduler_is_preemption() {
+    thread_t* thread = get_current_thread();
+    return thread != NULL && thread->preempt_count == 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Scheduling
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void scheduler_ready_thread(thread_t* thread) {
+    pthread_once(&m_scheduler_once, scheduler_init);
+
+    scheduler_preempt_disable();
+
+    // prefer our own cpu, threads outside of the scheduler spread them around
+    thread_t* current = get_current_thread();
+    int cpu;
+    if (current != NULL && atomic_load(&current->status) == THREAD_STATUS_RUNNING) {
+        cpu = current->cpu;
+    } else {
+        cpu = (atomic_fetch_add(&m_next_cpu, 1) & INT32_MAX) % m_cpu_count;
+    }
+    make_runnable(thread, cpu);
+
+    scheduler_preempt_enable();
+}
+
+void scheduler_park(void(*callback)(void* arg), void* arg) {
+    thread_t* thread = get_current_thread();
+    ASSERT(thread != NULL && atomic_load(&thread->status) == THREAD_STATUS_RUNNING);
+
+    thread->preempt_count++;
+
+    // we might get readied on another cpu as soon as the callback
+    // returns, so remember which one we are giving away
+    int cpu = thread->cpu;
+    atomic_store(&thread->status, THREAD_STATUS_WAITING);
+    if (callback != NULL) {
+        callback(arg);
+    }
+
+    handoff_cpu(cpu);
+    park(thread);
+
+    thread->preempt_count--;
+}
+
+void scheduler_thread_start(thread_t* thread) {
+    thread->preempt_count++;
+    park(thread);
+    thread->preempt_count--;
+}
+
+void scheduler_thread_exit(thread_t* thread) {
+    thread->preempt_count++;
+    atomic_store(&thread->status, THREAD_STATUS_DEAD);
+    handoff_cpu(thread->cpu);
+}
+
+bool scheduler_yield() {
+    thread_t* thread = get_current_thread();
+    if (thread == NULL || atomic_load(&thread->status) != THREAD_STATUS_RUNNING) {
+        // not ours, let the os handle it
+        sched_yield();
+        return true;
+    }
+
+    // can't switch with preemption disabled, and no need to if no one is waiting
+    if (
+        thread->preempt_count > 0 ||
+        (atomic_load(&m_runnable_count) <= 0 && atomic_load(&m_cpus[thread->cpu].bound_length) == 0)
+    ) {
+        return false;
+    }
+
+    thread->preempt_count++;
+
+    // queue ourselves and pass the cpu on
+    int cpu = thread->cpu;
+    make_runnable(thread, cpu);
+    thread_t* next = handoff_cpu(cpu);
+    park(thread);
+
+    thread->preempt_count--;
+
+    return next != thread;
+}
+
+bool scheduler_block_enter() {
+    thread_t* thread = get_current_thread();
+    if (thread == NULL || thread->preempt_count > 0 || atomic_load(&thread->status) != THREAD_STATUS_RUNNING) {
+        // we keep the cpu while blocking
+        return false;
+    }
+
+    thread->preempt_count++;
+    gc_safe_region_enter(thread);
+    atomic_store(&thread->status, THREAD_STATUS_WAITING);
+    handoff_cpu(thread->cpu);
+    thread->preempt_count--;
+
+    return true;
+}
+
+void scheduler_block_exit(bool released) {
+    if (!released) {
+        return;
+    }
+
+    thread_t* thread = get_current_thread();
+    thread->preempt_count++;
+    make_runnable(thread, thread->cpu);
+    park(thread);
+    gc_safe_region_exit(thread, true);
+    thread->preempt_count--;
+}
+
+void scheduler_set_affinity(thread_t* thread, int cpu) {
+    pthread_once(&m_scheduler_once, scheduler_init);
+    thread->affinity = cpu < 0 ? -1 : cpu % m_cpu_count;
+}
 
 suspend_state_t scheduler_suspend_thread(thread_t* thread) {
     if (thread->dead) {
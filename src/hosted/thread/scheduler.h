@@ -3,6 +3,7 @@
 #include "thread.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Get the current running thread
@@ -15,6 +16,36 @@
  */
 void scheduler_ready_thread(thread_t* thread);
 
+/**
+ * Park the current thread until someone calls scheduler_ready_thread on it
+ *
+ * @param callback  [IN] Called once the thread is marked as waiting, used to
+ *                       release the locks protecting the wait
+ * @param arg       [IN] Passed to the callback
+ */
+void scheduler_park(void(*callback)(void* arg), void* arg);
+
+/**
+ * Called by a new thread before it runs its entry, waits until
+ * the thread is readied and given a cpu
+ */
+void scheduler_thread_start(thread_t* thread);
+
+/**
+ * Called by a thread once its entry returned, gives the cpu to the
+ * next runnable thread
+ */
+void scheduler_thread_exit(thread_t* thread);
+
+/**
+ * Bind the thread to a single cpu, it will only run on that cpu from the next
+ * time it is scheduled, and other cpus won't steal it
+ *
+ * @param thread    [IN] The thread to bind
+ * @param cpu       [IN] The cpu, or -1 to let the thread run anywhere
+ */
+void scheduler_set_affinity(thread_t* thread, int cpu);
+
 typedef struct suspend_state {
     thread_t* thread;
     bool stopped;
@@ -37,6 +68,31 @@ suspend_state_t scheduler_suspend_thread(thread_t* thread);
  */
 void scheduler_resume_thread(suspend_state_t status);
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// CPU information
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Get the amount of cpus the runtime can run on, these are the cpus in the
+ * affinity mask of the process, ordered by their numa node
+ */
+int get_cpu_count();
+
+/**
+ * Get the amount of numa nodes
+ */
+int get_numa_node_count();
+
+/**
+ * Get the numa node of the given cpu
+ */
+int get_cpu_numa_node(int cpu);
+
+/**
+ * Get the id the os uses for the given cpu
+ */
+int get_cpu_os_id(int cpu);
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Preemption stuff
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -56,6 +112,43 @@ void scheduler_preempt_enable(void);
  */
 bool scheduler_is_preemption(void);
 
+/**
+ * Get the flag the monitor sets when the current thread should yield, the
+ * preemption signal only sets it so the thread yields where it is safe to,
+ * any code that runs for long without enabling preemption should poll it
+ * and call scheduler_preempt_point when it is set.
+ *
+ * The flag is per thread, so a pending preemption only sends the thread
+ * that has to yield down the slow path. The JIT loads it on method entry
+ * and polls it together with the gc safepoint.
+ */
+volatile bool* scheduler_get_preempt_flag(void);
+
+/**
+ * Yield if the current thread was asked to by the monitor and preemption is enabled
+ */
+void scheduler_preempt_point(void);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Blocking
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Called right before the current thread blocks in the kernel, passes
+ * its cpu to the next runnable thread
+ *
+ * @return true if the cpu was released, pass it to scheduler_block_exit
+ */
+bool scheduler_block_enter(void);
+
+/**
+ * Called once the current thread is done blocking, waits until
+ * it gets a cpu again
+ *
+ * @param released  [IN] The value returned from scheduler_block_enter
+ */
+void scheduler_block_exit(bool released);
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Get the current running thread
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -68,5 +161,7 @@ thread_t* get_current_thread();
 /**
  * Request the scheduler to yield from our thread, passing our time-slice to the caller,
  * putting us at the CPU's local run-queue
+ *
+ * @return true if another thread got to run
  */
-void scheduler_yield();
\ No newline at end of file
+bool scheduler_yield();
\ No newline at end of file
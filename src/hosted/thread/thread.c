@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 #include "thread.h"
+#include "scheduler.h"
 #include <stdarg.h>
 #include <stdio.h>
 #include <pthread.h>
@@ -9,8 +10,9 @@
 #include <stdlib.h>
 #include <util/stb_ds.h>
 #include <sync/mutex.h>
+#include <dotnet/monitor.h>
 
-// all threads list, TODO: threads aren't removed yet
+// all threads list, threads remove themselves once they exit
 thread_t** g_all_threads = NULL;
 
 mutex_t m_all_threads_lock = { 0 };
@@ -21,13 +23,49 @@ void unlock_all_threads() {
     mutex_unlock(&m_all_threads_lock);
 }
 
+// the most exited threads we keep around for reuse
+#define THREAD_CACHE_SIZE 64
+
+// threads that exited and nobody references anymore, their pthread
+// and stack wait to be given a new entry
+static spinlock_t m_thread_cache_lock = { 0 };
+static thread_t* m_thread_cache[THREAD_CACHE_SIZE];
+static int m_thread_cache_count = 0;
 
 thread_t* put_thread(thread_t* thread) {
+    atomic_fetch_add(&thread->ref_count, 1);
     return thread;
 }
 
 void release_thread(thread_t* thread) {
-    
+    if (atomic_fetch_sub(&thread->ref_count, 1) != 1) {
+        return;
+    }
+
+    // the last reference is only dropped once the thread
+    // exited, try to keep it around for later
+    spinlock_lock(&m_thread_cache_lock);
+    bool cached = m_thread_cache_count < THREAD_CACHE_SIZE;
+    if (cached) {
+        m_thread_cache[m_thread_cache_count++] = thread;
+    }
+    spinlock_unlock(&m_thread_cache_lock);
+
+    if (!cached) {
+        // no room, let the pthread exit
+        thread->entry = NULL;
+        sem_post(&thread->reuse);
+    }
+}
+
+static thread_t* get_cached_thread() {
+    thread_t* thread = NULL;
+    spinlock_lock(&m_thread_cache_lock);
+    if (m_thread_cache_count > 0) {
+        thread = m_thread_cache[--m_thread_cache_count];
+    }
+    spinlock_unlock(&m_thread_cache_lock);
+    return thread;
 }
 
 // cursed thread pausing hack;
@@ -69,17 +107,29 @@ thread_t* get_current_thread() {
 }
 
 static void add_to_all_threads(thread_t* thread) {
+    lock_all_threads();
     // set the default gc thread data, updated by the gc whenever it iterates the
     // thread list and does stuff
     thread->tcb->gc_data = m_default_gc_thread_data;
     arrpush(g_all_threads, thread);
+    unlock_all_threads();
+}
+
+static void remove_from_all_threads(thread_t* thread) {
+    lock_all_threads();
+    for (int i = 0; i < arrlen(g_all_threads); i++) {
+        if (g_all_threads[i] == thread) {
+            arrdelswap(g_all_threads, i);
+            break;
+        }
+    }
+    unlock_all_threads();
 }
 
 // i need to get the thread id and install signal handlers
 // which i cannot do from the parent thread
 void* thread_entrypoint(void* arg) {
     thread_t* thread = arg;
-    thread_entry_t entry = (thread_entry_t)thread->entry;
     
     current_thread = thread; // this is thread local
 
@@ -97,48 +147,128 @@ void* thread_entrypoint(void* arg) {
         .sa_sigaction = &sigusr1_handler,
         .sa_flags = SA_SIGINFO
     };
+    // don't get preempted while paused, we would miss the resume
+    sigemptyset(&sa.sa_mask);
+    sigaddset(&sa.sa_mask, SIGURG);
     sigaction(SIGUSR1, &sa, NULL);
     signal(SIGUSR2, sigusr2_handler); // SIGUSR2 is used to resume, as it's just empty
 
-
-    // enter the thread
-    entry(thread->ctx);
-    
-    // user function returned, the thread is dead
-    // TODO: remove the thread from g_all_threads
-    thread->dead = true;
-    free(thread->tcb);
-    
     // wait for stack base calculation and g_all_threads
     wait_group_wait(&thread->wg);
 
+    do {
+        // wait until we are readied and get a cpu
+        scheduler_thread_start(thread);
+
+        // enter the thread, the second argument is only used by managed
+        // threads, it is the parameter given on start
+        thread_entry_t entry = (thread_entry_t)thread->entry;
+        ((void(*)(void*, void*))entry)(thread->ctx, (void*)thread->save_state.rsi);
+
+        // user function returned, the thread is dead, once it is out of the
+        // list the gc won't look at it anymore
+        monitor_thread_exit();
+        remove_from_all_threads(thread);
+        thread->dead = true;
+        scheduler_thread_exit(thread);
+
+        // drop our own reference, and wait until we are either
+        // reused for a new thread or told to exit
+        release_thread(thread);
+        while (sem_wait(&thread->reuse) != 0);
+    } while (thread->entry != NULL);
+
+    sem_destroy(&thread->park);
+    sem_destroy(&thread->reuse);
+    free(thread->profile);
+    free(thread->tcb);
+    free(thread);
+
     return NULL;
 }
 
+/**
+ * Reset the state of the thread for a new entry
+ */
+static void init_thread(thread_t* thread, thread_entry_t entry, void* ctx) {
+    thread->entry = (void*)entry;
+    thread->ctx = ctx;
+    thread->tcb->tcb = thread->tcb;
+    thread->tcb->managed_thread = NULL;
+    thread->dead = false;
+    atomic_store(&thread->ref_count, 1);
+    thread->save_state.rsi = 0;
+    thread->status = THREAD_STATUS_IDLE;
+    thread->affinity = -1;
+    thread->sched_link = NULL;
+    thread->slice_start = 0;
+    thread->preempt_count = 0;
+    thread->preempt_pending = false;
+    thread->gc_request = THREAD_GC_REQUEST_NONE;
+    thread->gc_safe = false;
+}
+
 thread_t* create_thread(thread_entry_t entry, void* ctx, const char* fmt, ...) {
-    thread_t* thread = malloc(sizeof(thread_t));
+    // reuse the pthread and stack of an exited thread if we can
+    thread_t* thread = get_cached_thread();
+    bool reused = thread != NULL;
+    if (!reused) {
+        thread = malloc(sizeof(thread_t));
+        if (thread == NULL) {
+            return NULL;
+        }
+
+        thread->tcb = malloc(sizeof(thread_control_block_t)); // TODO: alignment
+        if (thread->tcb == NULL) {
+            free(thread);
+            return NULL;
+        }
+
+        thread->wg = (wait_group_t)INIT_WAIT_GROUP();
+        thread->cpu = 0;
+        thread->pinned_cpu = -1;
+        thread->gc_lock = INIT_SPINLOCK();
+        thread->profile = NULL;
+        sem_init(&thread->park, 0, 0);
+        sem_init(&thread->reuse, 0, 0);
+    }
+
     va_list ap;
     va_start(ap, fmt);
     vsnprintf(thread->name, sizeof(thread->name), fmt, ap);
     va_end(ap);
-    thread->entry = (void*)entry;
-    thread->ctx = ctx;
-    thread->tcb = malloc(sizeof(thread_control_block_t)); // TODO: alignment
-    thread->tcb->tcb = thread->tcb;
-    thread->dead = false;
-    thread->wg = (wait_group_t)INIT_WAIT_GROUP();
+    init_thread(thread, entry, ctx);
+
+    if (reused) {
+        // the pthread is waiting for us, it keeps its stack and pinning
+        add_to_all_threads(thread);
+        sem_post(&thread->reuse);
+        return thread;
+    }
 
-    pthread_create(&thread->pthread, NULL, thread_entrypoint, thread);
-    
     wait_group_add(&thread->wg, 1);
-    
+
+    pthread_attr_t create_attrs;
+    pthread_attr_init(&create_attrs);
+    pthread_attr_setdetachstate(&create_attrs, PTHREAD_CREATE_DETACHED);
+    int result = pthread_create(&thread->pthread, &create_attrs, thread_entrypoint, thread);
+    pthread_attr_destroy(&create_attrs);
+    if (result != 0) {
+        sem_destroy(&thread->park);
+        sem_destroy(&thread->reuse);
+        free(thread->tcb);
+        free(thread);
+        return NULL;
+    }
+
     // get the stack base and size
     pthread_attr_t attrs;
     pthread_getattr_np(thread->pthread, &attrs);
     void* stack_ptr;
     size_t stack_size;
     pthread_attr_getstack(&attrs, &stack_ptr, &stack_size);
-    thread->stack_top = (size_t)stack_ptr;
+    pthread_attr_destroy(&attrs);
+    thread->stack_top = (size_t)stack_ptr + stack_size;
 
     // add to g_all_threads
     add_to_all_threads(thread);
@@ -149,7 +279,22 @@ thread_t* create_thread(thread_entry_t entry, void* ctx, const char* fmt, ...) {
 }
 
 
+void thread_save_registers(thread_save_state_t* state) {
+    // the rest of the registers are clobbered by the call anyways, clear
+    // them so nothing stale from a previous suspend is seen as a root
+    state->rax = state->rcx = state->rdx = state->rsi = state->rdi = 0;
+    state->r8 = state->r9 = state->r10 = state->r11 = 0;
+
+    asm volatile ("movq %%rbx, %0" : "=m"(state->rbx));
+    asm volatile ("movq %%rbp, %0" : "=m"(state->rbp));
+    asm volatile ("movq %%r12, %0" : "=m"(state->r12));
+    asm volatile ("movq %%r13, %0" : "=m"(state->r13));
+    asm volatile ("movq %%r14, %0" : "=m"(state->r14));
+    asm volatile ("movq %%r15, %0" : "=m"(state->r15));
+    asm volatile ("movq %%rsp, %0" : "=m"(state->rsp));
+}
+
 thread_status_t get_thread_status(thread_t* thread) {
-    return THREAD_STATUS_RUNNING;
+    return atomic_load(&thread->status) & ~THREAD_SUSPEND;
 }
 
@@ -2,9 +2,12 @@
 
 #include <dotnet/gc/gc_thread_data.h>
 #include <hosted/sync/wait_group.h>
+#include <hosted/sync/spinlock.h>
 #include <util/defs.h>
 
 #include <sys/types.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
 
@@ -150,7 +153,7 @@ typedef struct thread {
     void* entry;
     // ctx passed to chreate_thread
     void* ctx;
-    // base of the stack (smallest valid addr)
+    // top of the stack (highest addr, exclusive)
     uintptr_t stack_top;
     // used for gc_data
     thread_control_block_t* tcb;
@@ -164,19 +167,63 @@ typedef struct thread {
     uid_t uid;
     pid_t pid;
     pid_t tid;
-    // TODO: remove dead thread from g_all_threads
-    // for now this is enough 
+    // the entry returned, the thread is no longer in g_all_threads
     bool dead;
+    // references from put_thread, the running thread holds one itself,
+    // once the last one is gone the thread may be reused
+    atomic_int ref_count;
+    // posted when the exited thread is given a new entry, or should exit
+    sem_t reuse;
     // waitgroup for syncronization: used to make sure all init has completed
     // and to ensure the register save has completed before returning
     wait_group_t wg;
+
+    // --- scheduler state
+    _Atomic(thread_status_t) status;
+    // the cpu this thread runs on, or last ran on
+    int cpu;
+    // the cpu the pthread is pinned to, -1 if not pinned yet
+    int pinned_cpu;
+    // the only cpu the thread may run on, -1 for any
+    int affinity;
+    // link in the cpu run queue
+    struct thread* sched_link;
+    // posted whenever the thread is given a cpu
+    sem_t park;
+    // when the thread got its cpu, used for preemption
+    uint64_t slice_start;
+    // preemption disable nesting, and if preemption was requested meanwhile,
+    // both are also accessed from the preemption signal, the jitted code
+    // polls preempt_pending directly
+    volatile int preempt_count;
+    volatile bool preempt_pending;
+
+    // --- gc handshake state
+    // a handshake the collector asked the thread to do at its next safepoint
+    _Atomic(int) gc_request;
+    // the thread is blocked and won't touch the heap, so the collector does the
+    // handshake on its behalf, only changed and read with gc_lock taken
+    spinlock_t gc_lock;
+    bool gc_safe;
+
+    // --- profiler state
+    // the samples the profiler took of this thread, NULL until the profiler
+    // first sees the thread, kept for the lifetime of the thread struct
+    _Atomic(struct profiler_ring*) profile;
 } thread_t;
 
+#define THREAD_GC_REQUEST_NONE      0
+#define THREAD_GC_REQUEST_PENDING   1
+#define THREAD_GC_REQUEST_HANDLING  2
+
 typedef struct waiting_thread waiting_thread_t;
 struct waiting_thread {
     thread_t* thread;
 
-    // only used in the cache
+    // used to wake threads that are not part of the scheduler
+    sem_t* sema;
+
+    // links in the wait queue of the waitable
     waiting_thread_t* next;
     waiting_thread_t* prev;
 
@@ -188,6 +235,12 @@ struct waiting_thread {
     bool is_select;
     bool success;
     struct waitable* waitable;
+
+    // shared between all the cases of a select, only the
+    // first one to set it may wake the thread
+    _Atomic(uint32_t)* select_done;
+    // set on the case that woke the thread
+    bool selected;
 };
 
 
@@ -203,7 +256,14 @@ struct waiting_thread {
 typedef void(*thread_entry_t)(void* ctx);
 
 /**
- * Create a new thread
+ * Save the callee-saved registers and the stack pointer of the caller, this is
+ * all the gc needs to scan a thread that stopped at a known point
+ */
+void thread_save_registers(thread_save_state_t* state);
+
+/**
+ * Create a new thread, the thread starts with a single reference which is
+ * dropped once its entry returns, returns NULL on failure
  */
 thread_t* create_thread(thread_entry_t entry, void* ctx, const char* fmt, ...);
 
@@ -226,7 +286,8 @@ void unlock_all_threads();
 thread_t* put_thread(thread_t* thread);
 
 /**
- * Free a thread
+ * Decreases the ref count of a thread, once the thread exited and the last
+ * reference is gone its pthread and stack are kept for reuse by create_thread
  *
  * Must be called from a context with no preemption
  */
@@ -1,36 +1,609 @@
 #include "waitable.h"
 #include "scheduler.h"
 #include "time/tsc.h"
+#include "time/timer.h"
 #include "util/fastrand.h"
 
+#include <util/except.h>
 #include <mem/malloc.h>
 
+#include <string.h>
+#include <errno.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Wait queues
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void wait_queue_push(wait_queue_t* queue, waiting_thread_t* wt) {
+    wt->next = NULL;
+    wt->prev = queue->last;
+    if (queue->last != NULL) {
+        queue->last->next = wt;
+    } else {
+        queue->first = wt;
+    }
+    queue->last = wt;
+}
+
+static void wait_queue_remove(wait_queue_t* queue, waiting_thread_t* wt) {
+    if (wt->prev != NULL) {
+        wt->prev->next = wt->next;
+    } else if (queue->first == wt) {
+        queue->first = wt->next;
+    } else {
+        // not in the queue
+        return;
+    }
+
+    if (wt->next != NULL) {
+        wt->next->prev = wt->prev;
+    } else {
+        queue->last = wt->prev;
+    }
+
+    wt->next = NULL;
+    wt->prev = NULL;
+}
+
+/**
+ * Take the first waiting thread that can be woken up, a thread sitting in
+ * a select can only be taken by the first waitable that gets to it
+ */
+static waiting_thread_t* wait_queue_pop(wait_queue_t* queue) {
+    while (true) {
+        waiting_thread_t* wt = queue->first;
+        if (wt == NULL) {
+            return NULL;
+        }
+        wait_queue_remove(queue, wt);
+
+        if (wt->is_select) {
+            uint32_t expected = 0;
+            if (!atomic_compare_exchange_strong(wt->select_done, &expected, 1)) {
+                continue;
+            }
+        }
+
+        wt->selected = true;
+        return wt;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Parking
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static bool is_scheduled(thread_t* thread) {
+    return thread != NULL && atomic_load(&thread->status) == THREAD_STATUS_RUNNING;
+}
+
+static void wake_waiting_thread(waiting_thread_t* wt) {
+    if (wt->thread != NULL) {
+        scheduler_ready_thread(wt->thread);
+    } else {
+        sem_post(wt->sema);
+    }
+}
+
+typedef struct unlock_ctx {
+    waitable_t** waitables;
+    int count;
+} unlock_ctx_t;
+
+static void unlock_waitables(void* arg) {
+    unlock_ctx_t* ctx = arg;
+    for (int i = 0; i < ctx->count; i++) {
+        spinlock_unlock(&ctx->waitables[i]->lock);
+    }
+}
+
+/**
+ * Park the current thread until woken from the waitables, the given
+ * (locked) waitables are unlocked once it is safe to be woken up
+ */
+static void park_waiting_thread(waiting_thread_t* wt, waitable_t** locked, int count) {
+    unlock_ctx_t ctx = { .waitables = locked, .count = count };
+    if (wt->thread != NULL) {
+        scheduler_park(unlock_waitables, &ctx);
+    } else {
+        unlock_waitables(&ctx);
+        while (sem_wait(wt->sema) != 0 && errno == EINTR);
+    }
+}
+
+/**
+ * Update the waiter flags after the queues changed, must be called with the lock held
+ */
+static void update_state_flags(waitable_t* w) {
+    uint64_t set = 0;
+    uint64_t clear = 0;
+
+    if (w->wait_queue.first != NULL) {
+        set |= WAITABLE_STATE_WAITERS;
+    } else {
+        clear |= WAITABLE_STATE_WAITERS;
+    }
+
+    if (w->send_queue.first != NULL) {
+        set |= WAITABLE_STATE_SENDERS;
+    } else {
+        clear |= WAITABLE_STATE_SENDERS;
+    }
+
+    atomic_fetch_or(&w->state, set);
+    atomic_fetch_and(&w->state, ~clear);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Lock free buffer access
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//
+// The waitables don't carry any data, so the buffer is just the count of pending
+// sends. Buffered sends and waits only touch the count as long as nobody is sitting
+// on the opposite queue, otherwise they have to go through the lock to hand off to
+// the waiting thread. The slow paths set the flag of the queue they are about to use
+// before checking the count, so the fast paths can't race with a thread going to sleep.
+//
+
+static bool try_buffered_send(waitable_t* w, uint64_t blocking_flags) {
+    uint64_t state = atomic_load(&w->state);
+    while (true) {
+        if ((state & blocking_flags) != 0 || (state & WAITABLE_STATE_COUNT_MASK) >= w->size) {
+            return false;
+        }
+
+        if (atomic_compare_exchange_weak(&w->state, &state, state + 1)) {
+            return true;
+        }
+    }
+}
+
+static bool try_buffered_wait(waitable_t* w, uint64_t blocking_flags) {
+    uint64_t state = atomic_load(&w->state);
+    while (true) {
+        if ((state & blocking_flags) != 0 || (state & WAITABLE_STATE_COUNT_MASK) == 0) {
+            return false;
+        }
+
+        if (atomic_compare_exchange_weak(&w->state, &state, state - 1)) {
+            return true;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Polling, all must be called with the lock held
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Try to complete a send without blocking
+ *
+ * @return true if the send could complete, with the result in success
+ */
+static bool poll_send(waitable_t* w, bool* success) {
+    if (atomic_load(&w->state) & WAITABLE_STATE_CLOSED) {
+        *success = false;
+        return true;
+    }
+
+    // someone is waiting, hand it directly
+    waiting_thread_t* wt = wait_queue_pop(&w->wait_queue);
+    if (wt != NULL) {
+        wt->success = true;
+        wake_waiting_thread(wt);
+        *success = true;
+        return true;
+    }
+
+    // space in the buffer, we hold the senders flag so only buffered
+    // sends can race with us
+    if (try_buffered_send(w, WAITABLE_STATE_CLOSED)) {
+        *success = true;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Try to complete a wait without blocking
+ *
+ * @return true if the wait could complete, with the result in success
+ */
+static bool poll_wait(waitable_t* w, bool* success) {
+    // a sender is blocked, which means the buffer is full, take from the buffer
+    // and put the item of the sender instead, keeping the count the same
+    waiting_thread_t* wt = wait_queue_pop(&w->send_queue);
+    if (wt != NULL) {
+        wt->success = true;
+        wake_waiting_thread(wt);
+        *success = true;
+        return true;
+    }
+
+    // something in the buffer
+    if (try_buffered_wait(w, 0)) {
+        *success = true;
+        return true;
+    }
+
+    // closed and drained
+    if (atomic_load(&w->state) & WAITABLE_STATE_CLOSED) {
+        *success = false;
+        return true;
+    }
+
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Waitable API
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 waitable_t* create_waitable(size_t size) {
-    return NULL;
+    if (size > WAITABLE_STATE_COUNT_MASK) {
+        return NULL;
+    }
+
+    waitable_t* waitable = malloc(sizeof(waitable_t));
+    if (waitable == NULL) {
+        return NULL;
+    }
+
+    waitable->state = 0;
+    waitable->size = size;
+    waitable->wait_queue = (wait_queue_t){ 0 };
+    waitable->send_queue = (wait_queue_t){ 0 };
+    waitable->lock = INIT_SPINLOCK();
+    waitable->ref_count = 1;
+
+    return waitable;
 }
 
 waitable_t* put_waitable(waitable_t* waitable) {
-    return NULL;
+    atomic_fetch_add(&waitable->ref_count, 1);
+    return waitable;
 }
 
 void release_waitable(waitable_t* waitable) {
+    if (atomic_fetch_sub(&waitable->ref_count, 1) == 1) {
+        free(waitable);
+    }
 }
 
 bool waitable_send(waitable_t* w, bool block) {
-    return true;
+    // fast path, space in the buffer and nobody is waiting
+    if (try_buffered_send(w, WAITABLE_STATE_WAITERS | WAITABLE_STATE_CLOSED)) {
+        return true;
+    }
+
+    // fast path, non-blocking send that can't complete
+    uint64_t state = atomic_load(&w->state);
+    if (!block && !(state & (WAITABLE_STATE_WAITERS | WAITABLE_STATE_CLOSED)) && (state & WAITABLE_STATE_COUNT_MASK) >= w->size) {
+        return false;
+    }
+
+    spinlock_lock(&w->lock);
+
+    // stop buffered waits from racing with us
+    atomic_fetch_or(&w->state, WAITABLE_STATE_SENDERS);
+
+    bool success = false;
+    if (poll_send(w, &success) || !block) {
+        update_state_flags(w);
+        spinlock_unlock(&w->lock);
+        return success;
+    }
+
+    // need to block
+    thread_t* thread = get_current_thread();
+    sem_t sema;
+    waiting_thread_t wt = {
+        .thread = is_scheduled(thread) ? thread : NULL,
+        .sema = &sema,
+        .waitable = w,
+    };
+    if (wt.thread == NULL) {
+        sem_init(&sema, 0, 0);
+    }
+    wait_queue_push(&w->send_queue, &wt);
+
+    park_waiting_thread(&wt, &w, 1);
+
+    if (wt.thread == NULL) {
+        sem_destroy(&sema);
+    }
+
+    return wt.success;
 }
 
 waitable_result_t waitable_wait(waitable_t* w, bool block) {
-    return WAITABLE_SUCCESS;
+    // fast path, something in the buffer and nobody is blocked on send
+    if (try_buffered_wait(w, WAITABLE_STATE_SENDERS)) {
+        return WAITABLE_SUCCESS;
+    }
+
+    // fast path, non-blocking wait that can't complete
+    uint64_t state = atomic_load(&w->state);
+    if (!block && !(state & (WAITABLE_STATE_SENDERS | WAITABLE_STATE_CLOSED)) && (state & WAITABLE_STATE_COUNT_MASK) == 0) {
+        return WAITABLE_EMPTY;
+    }
+
+    spinlock_lock(&w->lock);
+
+    // stop buffered sends from racing with us
+    atomic_fetch_or(&w->state, WAITABLE_STATE_WAITERS);
+
+    bool success = false;
+    if (poll_wait(w, &success)) {
+        update_state_flags(w);
+        spinlock_unlock(&w->lock);
+        return success ? WAITABLE_SUCCESS : WAITABLE_CLOSED;
+    }
+
+    if (!block) {
+        update_state_flags(w);
+        spinlock_unlock(&w->lock);
+        return WAITABLE_EMPTY;
+    }
+
+    // need to block
+    thread_t* thread = get_current_thread();
+    sem_t sema;
+    waiting_thread_t wt = {
+        .thread = is_scheduled(thread) ? thread : NULL,
+        .sema = &sema,
+        .waitable = w,
+    };
+    if (wt.thread == NULL) {
+        sem_init(&sema, 0, 0);
+    }
+    wait_queue_push(&w->wait_queue, &wt);
+
+    park_waiting_thread(&wt, &w, 1);
+
+    if (wt.thread == NULL) {
+        sem_destroy(&sema);
+    }
+
+    return wt.success ? WAITABLE_SUCCESS : WAITABLE_CLOSED;
+}
+
+void waitable_close(waitable_t* w) {
+    spinlock_lock(&w->lock);
+
+    if (atomic_fetch_or(&w->state, WAITABLE_STATE_CLOSED) & WAITABLE_STATE_CLOSED) {
+        // already closed
+        spinlock_unlock(&w->lock);
+        return;
+    }
+
+    // wake everyone, the waiters are going to see the waitable as closed
+    waiting_thread_t* wt;
+    while ((wt = wait_queue_pop(&w->wait_queue)) != NULL) {
+        wt->success = false;
+        wake_waiting_thread(wt);
+    }
+    while ((wt = wait_queue_pop(&w->send_queue)) != NULL) {
+        wt->success = false;
+        wake_waiting_thread(wt);
+    }
+
+    update_state_flags(w);
+    spinlock_unlock(&w->lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Select
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static int compare_waitables(const void* a, const void* b) {
+    uintptr_t wa = (uintptr_t)*(waitable_t**)a;
+    uintptr_t wb = (uintptr_t)*(waitable_t**)b;
+    return wa < wb ? -1 : (wa > wb ? 1 : 0);
+}
+
+// selects with up to this many cases don't allocate
+#define SELECT_INLINE_CASES 8
+
+/**
+ * Try to complete one of the cases with the buffered fast paths, without taking any lock
+ */
+static int select_poll_buffered(waitable_t** waitables, int send_count, int count, int* order) {
+    for (int i = 0; i < count; i++) {
+        int index = order[i];
+        if (index < send_count) {
+            if (try_buffered_send(waitables[index], WAITABLE_STATE_WAITERS | WAITABLE_STATE_CLOSED)) {
+                return index;
+            }
+        } else {
+            if (try_buffered_wait(waitables[index], WAITABLE_STATE_SENDERS)) {
+                return index;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * Check if any of the cases could complete if we took the locks, that is if
+ * someone is blocked on the other side or the waitable is closed
+ */
+static bool select_may_complete(waitable_t** waitables, int send_count, int count) {
+    for (int i = 0; i < count; i++) {
+        uint64_t state = atomic_load(&waitables[i]->state);
+        uint64_t flags = WAITABLE_STATE_CLOSED | (i < send_count ? WAITABLE_STATE_WAITERS : WAITABLE_STATE_SENDERS);
+        if (state & flags) {
+            return true;
+        }
+    }
+    return false;
 }
 
 selected_waitable_t waitable_select(waitable_t** waitables, int send_count, int wait_count, bool block) {
-    return (selected_waitable_t){};
+    int count = send_count + wait_count;
+    selected_waitable_t selected = { .index = -1, .success = false };
+
+    // small selects are all on the stack
+    waitable_t* inline_locked[SELECT_INLINE_CASES];
+    int inline_order[SELECT_INLINE_CASES];
+    waiting_thread_t inline_wts[SELECT_INLINE_CASES];
+    waitable_t** locked = inline_locked;
+    int* order = inline_order;
+    waiting_thread_t* wts = inline_wts;
+    if (count > SELECT_INLINE_CASES) {
+        locked = malloc(count * sizeof(waitable_t*));
+        order = malloc(count * sizeof(int));
+        wts = malloc(count * sizeof(waiting_thread_t));
+        ASSERT(locked != NULL && order != NULL && wts != NULL);
+    }
+
+    // poll in a random order, so no case gets starved
+    for (int i = 0; i < count; i++) {
+        int j = fastrandn(i + 1);
+        order[i] = order[j];
+        order[j] = i;
+    }
+
+    // most selects complete on a buffered waitable, try that before locking anything
+    int index = select_poll_buffered(waitables, send_count, count, order);
+    if (index >= 0) {
+        selected.index = index;
+        selected.success = true;
+        goto cleanup;
+    }
+
+    // nothing we can do without blocking, no need to lock
+    if (!block && !select_may_complete(waitables, send_count, count)) {
+        goto cleanup;
+    }
+
+    // lock everything in address order, skipping duplicates
+    memcpy(locked, waitables, count * sizeof(waitable_t*));
+    qsort(locked, count, sizeof(waitable_t*), compare_waitables);
+    int locked_count = 0;
+    for (int i = 0; i < count; i++) {
+        if (locked_count == 0 || locked[locked_count - 1] != locked[i]) {
+            locked[locked_count++] = locked[i];
+        }
+    }
+
+    for (int i = 0; i < locked_count; i++) {
+        spinlock_lock(&locked[i]->lock);
+    }
+
+    // keep the fast paths away while we look at everything
+    for (int i = 0; i < count; i++) {
+        atomic_fetch_or(&waitables[i]->state, i < send_count ? WAITABLE_STATE_SENDERS : WAITABLE_STATE_WAITERS);
+    }
+
+    for (int i = 0; i < count; i++) {
+        index = order[i];
+        bool success = false;
+        bool done = index < send_count ? poll_send(waitables[index], &success) : poll_wait(waitables[index], &success);
+        if (done) {
+            selected.index = index;
+            selected.success = success;
+            goto unlock;
+        }
+    }
+
+    if (!block) {
+        goto unlock;
+    }
+
+    // a single waiter for all the queues, each case has its own link
+    // in the queue but they all share the thread and the select state
+    thread_t* thread = get_current_thread();
+    sem_t sema;
+    _Atomic(uint32_t) select_done = 0;
+    bool scheduled = is_scheduled(thread);
+    if (!scheduled) {
+        sem_init(&sema, 0, 0);
+    }
+
+    for (int i = 0; i < count; i++) {
+        wts[i] = (waiting_thread_t){
+            .thread = scheduled ? thread : NULL,
+            .sema = &sema,
+            .is_select = true,
+            .waitable = waitables[i],
+            .select_done = &select_done,
+        };
+        wait_queue_push(i < send_count ? &waitables[i]->send_queue : &waitables[i]->wait_queue, &wts[i]);
+    }
+
+    park_waiting_thread(&wts[0], locked, locked_count);
+
+    if (!scheduled) {
+        sem_destroy(&sema);
+    }
+
+    // find the case that woke us, and only take the locks of the waitables
+    // we are still queued on
+    for (int i = 0; i < count; i++) {
+        if (wts[i].selected) {
+            selected.index = i;
+            selected.success = wts[i].success;
+            continue;
+        }
+
+        waitable_t* w = waitables[i];
+        spinlock_lock(&w->lock);
+        wait_queue_remove(i < send_count ? &w->send_queue : &w->wait_queue, &wts[i]);
+        update_state_flags(w);
+        spinlock_unlock(&w->lock);
+    }
+    goto cleanup;
+
+unlock:
+    for (int i = 0; i < locked_count; i++) {
+        update_state_flags(locked[i]);
+        spinlock_unlock(&locked[i]->lock);
+    }
+
+cleanup:
+    if (count > SELECT_INLINE_CASES) {
+        free(wts);
+        free(order);
+        free(locked);
+    }
+
+    return selected;
 }
 
-waitable_t* after(int64_t microseconds) {
-    return NULL;
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Timers
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct waitable_timer {
+    wheel_timer_t timer;
+    waitable_t* waitable;
+} waitable_timer_t;
+
+static void waitable_timer_fire(void* ctx) {
+    waitable_timer_t* timer = ctx;
+    waitable_send(timer->waitable, false);
+    release_waitable(timer->waitable);
+    free(timer);
 }
 
-void waitable_close(waitable_t* w) {
-}
\ No newline at end of file
+waitable_t* after(int64_t microseconds) {
+    waitable_t* waitable = create_waitable(1);
+    if (waitable == NULL) {
+        return NULL;
+    }
+
+    waitable_timer_t* timer = malloc(sizeof(waitable_timer_t));
+    if (timer == NULL) {
+        release_waitable(waitable);
+        return NULL;
+    }
+
+    // the timer keeps its own reference until it fires
+    timer->waitable = put_waitable(waitable);
+    timer_arm(&timer->timer, microtime() + (microseconds > 0 ? microseconds : 0), waitable_timer_fire, timer);
+
+    return waitable;
+}
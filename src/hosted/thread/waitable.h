@@ -9,9 +9,11 @@ typedef struct wait_queue {
 } wait_queue_t;
 
 typedef struct waitable {
-    size_t count;
+    // the count of the buffer in the low 32 bits, and the WAITABLE_STATE_* flags,
+    // buffered send and wait are done with a single cas on it as long as
+    // nobody is waiting on the queues
+    _Atomic(uint64_t) state;
     size_t size;
-    uint32_t closed;
     wait_queue_t wait_queue;
     wait_queue_t send_queue;
     spinlock_t lock;
@@ -19,6 +21,11 @@ typedef struct waitable {
     atomic_size_t ref_count;
 } waitable_t;
 
+#define WAITABLE_STATE_COUNT_MASK   0xFFFFFFFFull
+#define WAITABLE_STATE_WAITERS      (1ull << 32)    /* the wait queue is not empty */
+#define WAITABLE_STATE_SENDERS      (1ull << 33)    /* the send queue is not empty */
+#define WAITABLE_STATE_CLOSED       (1ull << 34)    /* the waitable was closed */
+
 typedef enum waitable_result {
     WAITABLE_EMPTY = 0,
     WAITABLE_CLOSED = 1,
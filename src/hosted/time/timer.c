@@ -0,0 +1,282 @@
+#include "timer.h"
+#include "tsc.h"
+
+#include <thread/scheduler.h>
+#include <util/fastrand.h>
+#include <util/except.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+//
+// Hierarchical timing wheel, every level has 64 slots and each slot of a level covers
+// a whole revolution of the level below it. A timer is placed on the lowest level that
+// can hold its deadline, and whenever a level wraps around the next slot of the level
+// above is cascaded down. Arm and cancel are O(1), and every tick only touches one slot.
+//
+// There is a wheel and a timer thread per cpu, timers are armed on the wheel of the
+// cpu the caller runs on.
+//
+
+// the size of a tick, in microseconds
+#define TIMER_TICK          1000
+
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SIZE    (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS  4
+
+// the furthest a timer can be placed in the wheel, anything
+// further is placed at the end and re-armed once it gets there
+#define TIMER_WHEEL_RANGE   (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+struct timer_wheel {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    // the next tick to process
+    uint64_t current_tick;
+
+    // the amount of pending timers
+    size_t pending;
+
+    wheel_timer_t* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+
+    pthread_t thread;
+};
+
+static timer_wheel_t* m_timer_wheels = NULL;
+static int m_timer_wheel_count = 0;
+
+static pthread_once_t m_timer_once = PTHREAD_ONCE_INIT;
+
+static uint64_t get_current_tick() {
+    return microtime() / TIMER_TICK;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Wheel management, all must be called with the wheel lock held
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void slot_push(wheel_timer_t** slot, wheel_timer_t* timer) {
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+    timer->slot = slot;
+}
+
+static void slot_remove(wheel_timer_t* timer) {
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->slot = timer->next;
+    }
+
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->slot = NULL;
+}
+
+static void wheel_insert(timer_wheel_t* wheel, wheel_timer_t* timer) {
+    uint64_t expires = timer->expires;
+
+    // already expired, fire on the next tick
+    if (expires < wheel->current_tick) {
+        expires = wheel->current_tick;
+    }
+
+    // too far away, put it at the end of the wheel
+    uint64_t delta = expires - wheel->current_tick;
+    if (delta >= TIMER_WHEEL_RANGE) {
+        delta = TIMER_WHEEL_RANGE - 1;
+        expires = wheel->current_tick + delta;
+    }
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ull << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    int index = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    slot_push(&wheel->slots[level][index], timer);
+}
+
+/**
+ * Move all the timers of a slot down the levels
+ *
+ * @return the index of the slot
+ */
+static int wheel_cascade(timer_wheel_t* wheel, int level) {
+    int index = (wheel->current_tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+    wheel_timer_t* timer = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    while (timer != NULL) {
+        wheel_timer_t* next = timer->next;
+        wheel_insert(wheel, timer);
+        timer = next;
+    }
+
+    return index;
+}
+
+/**
+ * Process the current tick, returns the list of expired timers linked by next
+ */
+static wheel_timer_t* wheel_tick(timer_wheel_t* wheel) {
+    // cascade the upper levels whenever the lower level wraps around
+    int index = wheel->current_tick & TIMER_WHEEL_MASK;
+    if (index == 0) {
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if (wheel_cascade(wheel, level) != 0) {
+                break;
+            }
+        }
+    }
+
+    wheel_timer_t* expired = NULL;
+    wheel_timer_t* timer = wheel->slots[0][index];
+    while (timer != NULL) {
+        wheel_timer_t* next = timer->next;
+        slot_remove(timer);
+
+        if (timer->expires > wheel->current_tick) {
+            // was placed at the end of the wheel, not there yet
+            wheel_insert(wheel, timer);
+        } else {
+            wheel->pending--;
+            timer->next = expired;
+            expired = timer;
+        }
+
+        timer = next;
+    }
+
+    wheel->current_tick++;
+    return expired;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Timer threads
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The timer thread is a plain pthread, it is not part of the scheduler
+ */
+static void* timer_thread(void* arg) {
+    timer_wheel_t* wheel = arg;
+
+    pthread_mutex_lock(&wheel->lock);
+    while (true) {
+        if (wheel->pending == 0) {
+            pthread_cond_wait(&wheel->cond, &wheel->lock);
+            continue;
+        }
+
+        // process everything up to now
+        uint64_t now = get_current_tick();
+        wheel_timer_t* expired = NULL;
+        while (wheel->current_tick <= now && expired == NULL) {
+            expired = wheel_tick(wheel);
+        }
+
+        if (expired != NULL) {
+            // run the callbacks without the lock, the timers
+            // might get freed or re-armed by them
+            pthread_mutex_unlock(&wheel->lock);
+            while (expired != NULL) {
+                wheel_timer_t* next = expired->next;
+                expired->next = NULL;
+                expired->callback(expired->ctx);
+                expired = next;
+            }
+            pthread_mutex_lock(&wheel->lock);
+            continue;
+        }
+
+        // sleep until the next tick
+        uint64_t deadline = wheel->current_tick * TIMER_TICK;
+        struct timespec ts = {
+            .tv_sec = deadline / 1000000,
+            .tv_nsec = (deadline % 1000000) * 1000
+        };
+        pthread_cond_timedwait(&wheel->cond, &wheel->lock, &ts);
+    }
+    return NULL;
+}
+
+static void timer_init() {
+    m_timer_wheel_count = get_cpu_count();
+    m_timer_wheels = calloc(m_timer_wheel_count, sizeof(timer_wheel_t));
+    ASSERT(m_timer_wheels != NULL);
+
+    for (int i = 0; i < m_timer_wheel_count; i++) {
+        timer_wheel_t* wheel = &m_timer_wheels[i];
+        pthread_mutex_init(&wheel->lock, NULL);
+        pthread_cond_init(&wheel->cond, NULL);
+        wheel->current_tick = get_current_tick();
+        pthread_create(&wheel->thread, NULL, timer_thread, wheel);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Timer API
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void timer_arm(wheel_timer_t* timer, uint64_t deadline, timer_callback_t callback, void* ctx) {
+    pthread_once(&m_timer_once, timer_init);
+
+    // use the wheel of our cpu
+    thread_t* thread = get_current_thread();
+    int index;
+    if (thread != NULL && atomic_load(&thread->status) == THREAD_STATUS_RUNNING) {
+        index = thread->cpu % m_timer_wheel_count;
+    } else {
+        index = fastrandn(m_timer_wheel_count);
+    }
+    timer_wheel_t* wheel = &m_timer_wheels[index];
+
+    timer->wheel = wheel;
+    timer->callback = callback;
+    timer->ctx = ctx;
+    timer->expires = (deadline + TIMER_TICK - 1) / TIMER_TICK;
+
+    pthread_mutex_lock(&wheel->lock);
+
+    // the wheel was idle, skip all the ticks we missed
+    if (wheel->pending == 0) {
+        wheel->current_tick = get_current_tick();
+    }
+
+    wheel_insert(wheel, timer);
+    if (wheel->pending++ == 0) {
+        pthread_cond_signal(&wheel->cond);
+    }
+
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+bool timer_cancel(wheel_timer_t* timer) {
+    timer_wheel_t* wheel = timer->wheel;
+    if (wheel == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&wheel->lock);
+    bool pending = timer->slot != NULL;
+    if (pending) {
+        slot_remove(timer);
+        wheel->pending--;
+    }
+    pthread_mutex_unlock(&wheel->lock);
+
+    return pending;
+}
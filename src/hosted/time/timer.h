@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef void (*timer_callback_t)(void* ctx);
+
+typedef struct timer_wheel timer_wheel_t;
+
+typedef struct wheel_timer {
+    // links in the wheel slot
+    struct wheel_timer* next;
+    struct wheel_timer* prev;
+
+    // the slot we are in, NULL if not pending
+    struct wheel_timer** slot;
+
+    // the wheel we were armed on
+    timer_wheel_t* wheel;
+
+    // when to fire, in ticks
+    uint64_t expires;
+
+    // called from the timer thread once the timer fires
+    timer_callback_t callback;
+    void* ctx;
+} wheel_timer_t;
+
+/**
+ * Arm the timer to fire at the given deadline, the timer must not be pending
+ *
+ * @param timer     [IN] The timer, must stay alive until it either fires or is canceled
+ * @param deadline  [IN] The deadline, in microtime() units
+ * @param callback  [IN] Called from the timer thread, must not block
+ * @param ctx       [IN] Passed to the callback
+ */
+void timer_arm(wheel_timer_t* timer, uint64_t deadline, timer_callback_t callback, void* ctx);
+
+/**
+ * Cancel a pending timer
+ *
+ * @return true if the timer was canceled before it fired, false if it already
+ *         fired or is currently firing
+ */
+bool timer_cancel(wheel_timer_t* timer);
@@ -1,6 +1,45 @@
+#include "tsc.h"
+
 #include <sys/time.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+    #include <cpuid.h>
+    #include <x86intrin.h>
+#endif
+
+//
+// The timestamp counter comes from rdtsc when the cpu has an invariant tsc, which ticks
+// at a constant rate no matter the power state and is synced between the cores. Its
+// frequency is taken from cpuid when it reports it, otherwise it is measured against the
+// monotonic clock, starting when the process loads and finishing on the first request
+// for it, so it usually costs nothing. Without an invariant tsc the monotonic clock is
+// used as is, in nanoseconds.
+//
+
+// how long to measure the tsc against the monotonic clock
+#define TSC_CALIBRATION_NS  10000000ull
+
+/**
+ * Do we read the tsc directly
+ */
+static bool m_use_rdtsc = false;
+
+/**
+ * The frequency, in ticks per second
+ */
+static uint64_t m_tsc_freq = 1000000000ull;
+static pthread_once_t m_tsc_freq_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Where the calibration started
+ */
+static uint64_t m_calibration_tsc = 0;
+static uint64_t m_calibration_ns = 0;
 
 uint64_t microtime() {
     struct timeval t;
@@ -8,10 +47,89 @@ uint64_t microtime() {
     return ((uint64_t)t.tv_sec * 1000000) + t.tv_usec;
 }
 
+static uint64_t monotonic_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+    return ((uint64_t)t.tv_sec * 1000000000ull) + t.tv_nsec;
+}
+
+#if defined(__x86_64__)
+
+/**
+ * The frequency as reported by cpuid, 0 if it does not say
+ */
+static uint64_t cpuid_tsc_freq() {
+    uint32_t eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0, NULL) < 0x15) {
+        return 0;
+    }
+
+    // tsc/crystal ratio and the crystal frequency, the latter is not always there
+    __cpuid(0x15, eax, ebx, ecx, edx);
+    if (eax == 0 || ebx == 0 || ecx == 0) {
+        return 0;
+    }
+
+    return (uint64_t)ecx * ebx / eax;
+}
+
+static bool has_invariant_tsc() {
+    uint32_t eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0x80000000, NULL) < 0x80000007) {
+        return false;
+    }
+
+    __cpuid(0x80000007, eax, ebx, ecx, edx);
+    return (edx & (1 << 8)) != 0;
+}
+
+__attribute__((constructor))
+static void init_tsc() {
+    if (!has_invariant_tsc()) {
+        return;
+    }
+
+    m_use_rdtsc = true;
+    m_calibration_ns = monotonic_ns();
+    m_calibration_tsc = __rdtsc();
+}
+
+#endif
+
+static void calibrate_tsc() {
+    if (!m_use_rdtsc) {
+        return;
+    }
+
+#if defined(__x86_64__)
+    uint64_t freq = cpuid_tsc_freq();
+    if (freq != 0) {
+        m_tsc_freq = freq;
+        return;
+    }
+
+    // wait out whatever is left of the calibration window
+    uint64_t ns;
+    uint64_t tsc;
+    do {
+        ns = monotonic_ns();
+        tsc = __rdtsc();
+    } while (ns - m_calibration_ns < TSC_CALIBRATION_NS);
+
+    m_tsc_freq = (uint64_t)((double)(tsc - m_calibration_tsc) * 1e9 / (double)(ns - m_calibration_ns));
+#endif
+}
+
 uint64_t get_tsc_freq() {
-    return 1; // 1 tick per microsecond
+    pthread_once(&m_tsc_freq_once, calibrate_tsc);
+    return m_tsc_freq;
 }
 
 uint64_t get_tsc() {
-    return microtime();
+#if defined(__x86_64__)
+    if (m_use_rdtsc) {
+        return __rdtsc();
+    }
+#endif
+    return monotonic_ns();
 }
@@ -9,11 +9,19 @@
 uint64_t microtime();
 
 /**
- * Gets the TSC frequency
+ * Gets the TSC frequency, in ticks per second
  */
 uint64_t get_tsc_freq();
 
 /**
- * Get the current TSC
+ * Get the current TSC, cheap and monotonic but with no relation to the
+ * wall clock, use microtime() for deadlines
  */
 uint64_t get_tsc();
+
+/**
+ * Turn a TSC delta into microseconds
+ */
+static inline double tsc_to_us(uint64_t ticks) {
+    return (double)ticks * 1000000.0 / (double)get_tsc_freq();
+}
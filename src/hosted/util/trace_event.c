@@ -0,0 +1,315 @@
+#include "trace_event.h"
+#include "trace.h"
+
+#include <thread/thread.h>
+#include <time/tsc.h>
+
+#include <sys/syscall.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+// the events each thread can have pending, must be a power of two
+#define TRACE_BUFFER_SIZE       4096
+
+// how long the writer sleeps when there is nothing to write
+#define TRACE_WRITER_SLEEP_NS   (5 * 1000 * 1000)
+
+typedef struct trace_event {
+    uint64_t tsc;
+    const char* fmt;
+    uint64_t args[4];
+    uint32_t category;
+    uint32_t thread_id;
+} trace_event_t;
+
+typedef struct trace_buffer {
+    // all the buffers ever created, only ever pushed to
+    struct trace_buffer* next;
+
+    // does a live thread own it, a buffer of a thread that exited is reused
+    _Atomic(bool) owned;
+
+    // head is only written by the owner, tail only by the writer
+    _Atomic(uint64_t) head;
+    _Atomic(uint64_t) tail;
+    _Atomic(uint64_t) dropped;
+
+    trace_event_t events[TRACE_BUFFER_SIZE];
+} trace_buffer_t;
+
+uint32_t g_trace_event_mask = 0;
+
+static _Atomic(trace_buffer_t*) m_trace_buffers = NULL;
+
+static THREAD_LOCAL trace_buffer_t* m_trace_buffer = NULL;
+static THREAD_LOCAL uint32_t m_trace_thread_id = 0;
+
+/**
+ * Releases the buffer of a thread once it exits
+ */
+static pthread_key_t m_trace_buffer_key;
+static pthread_once_t m_trace_buffer_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Only one thread writes the events out at a time, this is the only lock and it is never
+ * taken by the threads that write events
+ */
+static pthread_mutex_t m_trace_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* m_trace_output = NULL;
+static uint64_t m_trace_start = 0;
+
+/**
+ * The events of a single pass, only used under the writer lock
+ */
+static trace_event_t* m_trace_batch = NULL;
+static size_t m_trace_batch_capacity = 0;
+
+static const char* m_trace_category_names[] = {
+    "gc",
+    "jit",
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Writing events
+//----------------------------------------------------------------------------------------------------------------------
+
+static void trace_buffer_release(void* arg) {
+    trace_buffer_t* buffer = arg;
+    atomic_store_explicit(&buffer->owned, false, memory_order_release);
+}
+
+static void trace_buffer_key_init() {
+    pthread_key_create(&m_trace_buffer_key, trace_buffer_release);
+}
+
+static trace_buffer_t* trace_buffer_claim() {
+    pthread_once(&m_trace_buffer_key_once, trace_buffer_key_init);
+
+    // reuse the buffer of a thread that is gone
+    trace_buffer_t* buffer = NULL;
+    for (trace_buffer_t* it = atomic_load(&m_trace_buffers); it != NULL; it = it->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&it->owned, &expected, true)) {
+            buffer = it;
+            break;
+        }
+    }
+
+    if (buffer == NULL) {
+        buffer = calloc(1, sizeof(trace_buffer_t));
+        if (buffer == NULL) {
+            return NULL;
+        }
+        buffer->owned = true;
+
+        buffer->next = atomic_load_explicit(&m_trace_buffers, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&m_trace_buffers, &buffer->next, buffer,
+                                                      memory_order_release, memory_order_relaxed));
+    }
+
+    pthread_setspecific(m_trace_buffer_key, buffer);
+    m_trace_thread_id = syscall(SYS_gettid);
+    m_trace_buffer = buffer;
+    return buffer;
+}
+
+void trace_event_write(trace_category_t category, const char* fmt, uint64_t a, uint64_t b, uint64_t c, uint64_t d) {
+    trace_buffer_t* buffer = m_trace_buffer;
+    if (buffer == NULL) {
+        buffer = trace_buffer_claim();
+        if (buffer == NULL) {
+            return;
+        }
+    }
+
+    uint64_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&buffer->tail, memory_order_acquire);
+    if (head - tail >= TRACE_BUFFER_SIZE) {
+        atomic_fetch_add_explicit(&buffer->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    trace_event_t* event = &buffer->events[head & (TRACE_BUFFER_SIZE - 1)];
+    event->tsc = get_tsc();
+    event->fmt = fmt;
+    event->args[0] = a;
+    event->args[1] = b;
+    event->args[2] = c;
+    event->args[3] = d;
+    event->category = category;
+    event->thread_id = m_trace_thread_id;
+
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Writing the events out
+//----------------------------------------------------------------------------------------------------------------------
+
+static void trace_output_char(char character, void* arg) {
+    putc_unlocked(character, arg);
+}
+
+static int trace_event_compare(const void* a, const void* b) {
+    uint64_t ta = ((const trace_event_t*)a)->tsc;
+    uint64_t tb = ((const trace_event_t*)b)->tsc;
+    return ta < tb ? -1 : ta > tb ? 1 : 0;
+}
+
+static const char* trace_category_name(uint32_t category) {
+    int index = __builtin_ctz(category);
+    return index < ARRAY_LEN(m_trace_category_names) ? m_trace_category_names[index] : "?";
+}
+
+/**
+ * Writes out everything that is pending, returns false if there was nothing,
+ * must be called with the writer lock held
+ */
+static bool trace_events_write_pending() {
+    size_t count = 0;
+    uint64_t dropped = 0;
+
+    for (trace_buffer_t* buffer = atomic_load(&m_trace_buffers); buffer != NULL; buffer = buffer->next) {
+        uint64_t tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        if (head == tail) {
+            continue;
+        }
+
+        if (count + (head - tail) > m_trace_batch_capacity) {
+            size_t capacity = m_trace_batch_capacity == 0 ? TRACE_BUFFER_SIZE : m_trace_batch_capacity;
+            while (count + (head - tail) > capacity) {
+                capacity *= 2;
+            }
+
+            trace_event_t* batch = realloc(m_trace_batch, capacity * sizeof(trace_event_t));
+            if (batch == NULL) {
+                break;
+            }
+            m_trace_batch = batch;
+            m_trace_batch_capacity = capacity;
+        }
+
+        for (uint64_t i = tail; i < head; i++) {
+            m_trace_batch[count++] = buffer->events[i & (TRACE_BUFFER_SIZE - 1)];
+        }
+        atomic_store_explicit(&buffer->tail, head, memory_order_release);
+
+        dropped += atomic_exchange_explicit(&buffer->dropped, 0, memory_order_relaxed);
+    }
+
+    if (count == 0 && dropped == 0) {
+        return false;
+    }
+
+    // the buffers are each in order, merge them for a roughly global order
+    qsort(m_trace_batch, count, sizeof(trace_event_t), trace_event_compare);
+
+    // the output is written unlocked, it might be stdout
+    flockfile(m_trace_output);
+
+    for (size_t i = 0; i < count; i++) {
+        trace_event_t* event = &m_trace_batch[i];
+        fctprintf(trace_output_char, m_trace_output, "%14.3f %6u %-6s ",
+                  tsc_to_us(event->tsc - m_trace_start), event->thread_id, trace_category_name(event->category));
+        fctprintf(trace_output_char, m_trace_output, event->fmt,
+                  event->args[0], event->args[1], event->args[2], event->args[3]);
+        putc_unlocked('\n', m_trace_output);
+    }
+
+    if (dropped != 0) {
+        fctprintf(trace_output_char, m_trace_output, "trace: dropped %lu events\n", dropped);
+    }
+
+    fflush(m_trace_output);
+    funlockfile(m_trace_output);
+    return true;
+}
+
+static void* trace_writer_thread(void* arg) {
+    for (;;) {
+        pthread_mutex_lock(&m_trace_writer_lock);
+        bool wrote = trace_events_write_pending();
+        pthread_mutex_unlock(&m_trace_writer_lock);
+
+        if (!wrote) {
+            struct timespec sleep = { .tv_nsec = TRACE_WRITER_SLEEP_NS };
+            nanosleep(&sleep, NULL);
+        }
+    }
+    return NULL;
+}
+
+void trace_events_flush() {
+    if (m_trace_output == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&m_trace_writer_lock);
+    trace_events_write_pending();
+    pthread_mutex_unlock(&m_trace_writer_lock);
+}
+
+static uint32_t trace_parse_categories(const char* str) {
+    uint32_t mask = 0;
+    while (*str != '\0') {
+        size_t len = strcspn(str, ",");
+        if (len == 3 && strncmp(str, "all", len) == 0) {
+            mask |= TRACE_CATEGORY_ALL;
+        } else {
+            bool found = false;
+            for (int i = 0; i < ARRAY_LEN(m_trace_category_names); i++) {
+                if (strlen(m_trace_category_names[i]) == len && strncmp(str, m_trace_category_names[i], len) == 0) {
+                    mask |= 1 << i;
+                    found = true;
+                    break;
+                }
+            }
+
+            if (!found) {
+                WARN("trace: unknown category `%.*s`", (int)len, str);
+            }
+        }
+
+        str += len;
+        if (*str == ',') {
+            str++;
+        }
+    }
+    return mask & TRACE_EVENT_CATEGORIES;
+}
+
+void init_trace_events() {
+    const char* categories = getenv("TDN_TRACE");
+    if (categories == NULL) {
+        return;
+    }
+
+    uint32_t mask = trace_parse_categories(categories);
+    if (mask == 0) {
+        return;
+    }
+
+    const char* path = getenv("TDN_TRACE_OUTPUT");
+    m_trace_output = path != NULL ? fopen(path, "w") : stdout;
+    if (m_trace_output == NULL) {
+        WARN("trace: failed to open `%s`", path);
+        return;
+    }
+    m_trace_start = get_tsc();
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, trace_writer_thread, NULL) != 0) {
+        WARN("trace: failed to start the writer thread");
+        return;
+    }
+    pthread_detach(thread);
+
+    __atomic_store_n(&g_trace_event_mask, mask, __ATOMIC_RELAXED);
+}
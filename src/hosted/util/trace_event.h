@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+
+//
+// Structured tracing, cheap enough to leave on. Every thread writes its events into its
+// own ring buffer, an event is a timestamp, a format and up to four integer or pointer
+// arguments, and a background thread formats them and writes them out in time order.
+// When a buffer is full the events are dropped and counted instead of waiting.
+//
+// The categories are filtered twice, when built with TRACE_EVENT_CATEGORIES, which leaves
+// out the code of the rest, and at runtime with the TDN_TRACE variable, a comma separated
+// list of categories or "all". The output goes to TDN_TRACE_OUTPUT, or stdout without it.
+//
+// The format is only read when the event is written out, so it and any string arguments
+// must stay around until then, a literal or the name of something that is never freed.
+//
+
+typedef enum trace_category {
+    TRACE_CATEGORY_GC       = 1 << 0,
+    TRACE_CATEGORY_JIT      = 1 << 1,
+
+    TRACE_CATEGORY_ALL      = (1 << 2) - 1,
+} trace_category_t;
+
+#ifndef TRACE_EVENT_CATEGORIES
+    #define TRACE_EVENT_CATEGORIES TRACE_CATEGORY_ALL
+#endif
+
+/**
+ * The categories enabled at runtime
+ */
+extern uint32_t g_trace_event_mask;
+
+/**
+ * Write an event to the buffer of the current thread, use TRACE_EVENT instead
+ */
+void trace_event_write(trace_category_t category, const char* fmt, uint64_t a, uint64_t b, uint64_t c, uint64_t d);
+
+/**
+ * Is any of the given categories enabled, to skip work that is only
+ * needed for the events
+ */
+#define TRACE_EVENT_ENABLED(category) \
+    (((category) & TRACE_EVENT_CATEGORIES) && (__atomic_load_n(&g_trace_event_mask, __ATOMIC_RELAXED) & (category)))
+
+/**
+ * Trace an event with up to four integer or pointer arguments, the
+ * arguments are widened to 64bit so the format should use %lu/%lx/%p
+ */
+#define TRACE_EVENT(category, fmt, ...) \
+    TRACE_EVENT_(category, fmt, ## __VA_ARGS__, 0, 0, 0, 0)
+
+#define TRACE_EVENT_(category, fmt, a, b, c, d, ...) \
+    do { \
+        if (TRACE_EVENT_ENABLED(category)) { \
+            trace_event_write(category, fmt, (uint64_t)(a), (uint64_t)(b), (uint64_t)(c), (uint64_t)(d)); \
+        } \
+    } while (0)
+
+/**
+ * Read the categories from the environment and start writing the events out,
+ * does nothing if none are enabled
+ */
+void init_trace_events();
+
+/**
+ * Write out all the events written so far
+ */
+void trace_events_flush();
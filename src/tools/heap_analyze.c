@@ -0,0 +1,467 @@
+#include <dotnet/gc/heap_snapshot.h>
+
+#include <util/stb_ds.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+//
+// Offline analyzer for the heap snapshots written by gc_write_heap_snapshot:
+//
+//      tinydotnet-heap-analyze <snapshot> [count]
+//
+// The objects and the roots are turned into a graph with a single virtual root, the
+// dominator tree is built with the iterative algorithm of Cooper, Harvey and Kennedy, and
+// the retained size of every object is the size of its subtree in the dominator tree.
+//
+// The snapshot doesn't have the stacks of the threads, so objects which are not reachable
+// from any of the roots get a root of their own, they are counted as unrooted.
+//
+
+// the index of the virtual root
+#define ROOT_NODE       0
+
+// a node without a dominator yet
+#define NO_DOMINATOR    UINT32_MAX
+
+typedef struct node {
+    uint64_t address;
+    uint64_t type;
+    uint64_t size;
+
+    // the references, straight from the snapshot
+    const uint8_t* refs;
+    uint32_t ref_count;
+} node_t;
+
+typedef struct type_info {
+    char* name;
+    uint64_t count;
+    uint64_t shallow;
+    uint64_t retained;
+} type_info_t;
+
+static node_t* m_nodes = NULL;
+static type_info_t* m_types = NULL;
+static struct { uint64_t key; uint32_t value; }* m_type_index = NULL;
+static struct { uint64_t key; uint32_t value; }* m_node_index = NULL;
+
+// the successors of every node, the root's are kept aside since they only
+// become known once the objects that have no root are found
+static uint32_t* m_succ_start = NULL;
+static uint32_t* m_succ = NULL;
+static uint32_t* m_root_succ = NULL;
+
+static uint32_t* m_pred_start = NULL;
+static uint32_t* m_pred = NULL;
+
+// the nodes in post order, and the post order number of every node
+static uint32_t* m_post_order = NULL;
+static uint32_t* m_post_number = NULL;
+
+static uint32_t* m_idom = NULL;
+static uint64_t* m_retained = NULL;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Parsing
+//----------------------------------------------------------------------------------------------------------------------
+
+static bool read_bytes(const uint8_t** ptr, const uint8_t* end, void* out, size_t size) {
+    if ((size_t)(end - *ptr) < size) {
+        return false;
+    }
+    memcpy(out, *ptr, size);
+    *ptr += size;
+    return true;
+}
+
+static uint64_t read_ref(const node_t* node, uint32_t index) {
+    uint64_t ref;
+    memcpy(&ref, node->refs + index * sizeof(uint64_t), sizeof(ref));
+    return ref;
+}
+
+static bool parse_snapshot(const uint8_t* ptr, const uint8_t* end, uint64_t** roots) {
+    heap_snapshot_header_t header;
+    if (!read_bytes(&ptr, end, &header, sizeof(header)) ||
+        header.magic != HEAP_SNAPSHOT_MAGIC || header.version != HEAP_SNAPSHOT_VERSION) {
+        fprintf(stderr, "not a heap snapshot, or of another version\n");
+        return false;
+    }
+
+    // the virtual root
+    arrpush(m_nodes, (node_t){ 0 });
+
+    while (true) {
+        uint8_t tag;
+        if (!read_bytes(&ptr, end, &tag, sizeof(tag))) {
+            fprintf(stderr, "truncated snapshot\n");
+            return false;
+        }
+
+        switch (tag) {
+            case HEAP_SNAPSHOT_END:
+                return true;
+
+            case HEAP_SNAPSHOT_TYPE: {
+                heap_snapshot_type_t record;
+                if (!read_bytes(&ptr, end, &record, sizeof(record)) || (size_t)(end - ptr) < record.name_length) {
+                    fprintf(stderr, "truncated type record\n");
+                    return false;
+                }
+
+                type_info_t type = { .name = strndup((const char*)ptr, record.name_length) };
+                ptr += record.name_length;
+
+                hmput(m_type_index, record.id, arrlen(m_types));
+                arrpush(m_types, type);
+            } break;
+
+            case HEAP_SNAPSHOT_OBJECT: {
+                heap_snapshot_object_t record;
+                if (!read_bytes(&ptr, end, &record, sizeof(record)) ||
+                    (size_t)(end - ptr) / sizeof(uint64_t) < record.ref_count) {
+                    fprintf(stderr, "truncated object record\n");
+                    return false;
+                }
+
+                node_t node = {
+                    .address = record.address,
+                    .type = record.type,
+                    .size = record.size,
+                    .refs = ptr,
+                    .ref_count = record.ref_count,
+                };
+                ptr += record.ref_count * sizeof(uint64_t);
+
+                hmput(m_node_index, record.address, arrlen(m_nodes));
+                arrpush(m_nodes, node);
+            } break;
+
+            case HEAP_SNAPSHOT_ROOT: {
+                heap_snapshot_root_t record;
+                if (!read_bytes(&ptr, end, &record, sizeof(record))) {
+                    fprintf(stderr, "truncated root record\n");
+                    return false;
+                }
+                arrpush(*roots, record.address);
+            } break;
+
+            default:
+                fprintf(stderr, "unknown record %d\n", tag);
+                return false;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Graph
+//----------------------------------------------------------------------------------------------------------------------
+
+static int64_t node_lookup(uint64_t address) {
+    if (address == 0) {
+        return -1;
+    }
+    int64_t index = hmgeti(m_node_index, address);
+    return index < 0 ? -1 : m_node_index[index].value;
+}
+
+static void build_successors() {
+    uint32_t count = arrlen(m_nodes);
+    m_succ_start = calloc(count + 1, sizeof(uint32_t));
+
+    for (uint32_t i = 1; i < count; i++) {
+        m_succ_start[i] = arrlen(m_succ);
+        for (uint32_t j = 0; j < m_nodes[i].ref_count; j++) {
+            int64_t target = node_lookup(read_ref(&m_nodes[i], j));
+            if (target > 0) {
+                arrpush(m_succ, target);
+            }
+        }
+    }
+    m_succ_start[count] = arrlen(m_succ);
+}
+
+static uint32_t* successors(uint32_t node, uint32_t* count) {
+    if (node == ROOT_NODE) {
+        *count = arrlen(m_root_succ);
+        return m_root_succ;
+    }
+    *count = m_succ_start[node + 1] - m_succ_start[node];
+    return m_succ + m_succ_start[node];
+}
+
+typedef struct dfs_frame {
+    uint32_t node;
+    uint32_t next;
+} dfs_frame_t;
+
+/**
+ * Number the nodes reachable from the given one in post order
+ */
+static void dfs(uint32_t start, bool* visited) {
+    dfs_frame_t* stack = NULL;
+    visited[start] = true;
+    arrpush(stack, ((dfs_frame_t){ .node = start }));
+
+    while (arrlen(stack) != 0) {
+        dfs_frame_t* frame = &arrlast(stack);
+        uint32_t count;
+        uint32_t* succ = successors(frame->node, &count);
+
+        if (frame->next < count) {
+            uint32_t target = succ[frame->next++];
+            if (!visited[target]) {
+                visited[target] = true;
+                arrpush(stack, ((dfs_frame_t){ .node = target }));
+            }
+            continue;
+        }
+
+        m_post_number[frame->node] = arrlen(m_post_order);
+        arrpush(m_post_order, frame->node);
+        arrpop(stack);
+    }
+
+    arrfree(stack);
+}
+
+/**
+ * Order all the nodes, the ones which are not reachable from the real roots
+ * become roots themselves, returns the amount of those
+ */
+static uint32_t order_nodes(uint64_t* roots) {
+    uint32_t count = arrlen(m_nodes);
+    bool* visited = calloc(count, sizeof(bool));
+    m_post_number = calloc(count, sizeof(uint32_t));
+
+    for (int i = 0; i < arrlen(roots); i++) {
+        int64_t target = node_lookup(roots[i]);
+        if (target > 0) {
+            arrpush(m_root_succ, target);
+        }
+    }
+
+    // first go over everything the roots keep alive, then give a root to
+    // the first object of every part that is left
+    size_t real_roots = arrlen(m_root_succ);
+    for (size_t i = 0; i < real_roots; i++) {
+        if (!visited[m_root_succ[i]]) {
+            dfs(m_root_succ[i], visited);
+        }
+    }
+
+    uint32_t unrooted = 0;
+    for (uint32_t i = 1; i < count; i++) {
+        if (!visited[i]) {
+            arrpush(m_root_succ, i);
+            dfs(i, visited);
+            unrooted++;
+        }
+    }
+
+    // the root is the last one in post order
+    m_post_number[ROOT_NODE] = arrlen(m_post_order);
+    arrpush(m_post_order, ROOT_NODE);
+
+    free(visited);
+    return unrooted;
+}
+
+static void build_predecessors() {
+    uint32_t count = arrlen(m_nodes);
+    uint32_t* fill = calloc(count + 1, sizeof(uint32_t));
+    m_pred_start = calloc(count + 1, sizeof(uint32_t));
+
+    for (uint32_t node = 0; node < count; node++) {
+        uint32_t succ_count;
+        uint32_t* succ = successors(node, &succ_count);
+        for (uint32_t i = 0; i < succ_count; i++) {
+            m_pred_start[succ[i] + 1]++;
+        }
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        m_pred_start[i + 1] += m_pred_start[i];
+    }
+
+    m_pred = malloc((m_pred_start[count] + 1) * sizeof(uint32_t));
+    for (uint32_t node = 0; node < count; node++) {
+        uint32_t succ_count;
+        uint32_t* succ = successors(node, &succ_count);
+        for (uint32_t i = 0; i < succ_count; i++) {
+            uint32_t target = succ[i];
+            m_pred[m_pred_start[target] + fill[target]++] = node;
+        }
+    }
+
+    free(fill);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Dominators
+//----------------------------------------------------------------------------------------------------------------------
+
+static uint32_t intersect(uint32_t a, uint32_t b) {
+    while (a != b) {
+        while (m_post_number[a] < m_post_number[b]) a = m_idom[a];
+        while (m_post_number[b] < m_post_number[a]) b = m_idom[b];
+    }
+    return a;
+}
+
+static void build_dominators() {
+    uint32_t count = arrlen(m_nodes);
+    m_idom = malloc(count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        m_idom[i] = NO_DOMINATOR;
+    }
+    m_idom[ROOT_NODE] = ROOT_NODE;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        // reverse post order, skipping the root which is last
+        for (int64_t i = (int64_t)arrlen(m_post_order) - 2; i >= 0; i--) {
+            uint32_t node = m_post_order[i];
+
+            uint32_t new_idom = NO_DOMINATOR;
+            for (uint32_t j = m_pred_start[node]; j < m_pred_start[node + 1]; j++) {
+                uint32_t pred = m_pred[j];
+                if (m_idom[pred] == NO_DOMINATOR) {
+                    continue;
+                }
+                new_idom = new_idom == NO_DOMINATOR ? pred : intersect(pred, new_idom);
+            }
+
+            if (new_idom != m_idom[node]) {
+                m_idom[node] = new_idom;
+                changed = true;
+            }
+        }
+    }
+
+    // a dominator always comes later in post order, so by the time we get
+    // to a node all of the ones it dominates were added to it
+    m_retained = calloc(count, sizeof(uint64_t));
+    for (uint32_t i = 0; i < count; i++) {
+        m_retained[i] += m_nodes[i].size;
+    }
+    for (size_t i = 0; i < arrlen(m_post_order); i++) {
+        uint32_t node = m_post_order[i];
+        if (node != ROOT_NODE) {
+            m_retained[m_idom[node]] += m_retained[node];
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Report
+//----------------------------------------------------------------------------------------------------------------------
+
+static type_info_t m_unknown_type = { .name = "[unknown]" };
+
+static type_info_t* node_type(uint32_t node) {
+    int64_t index = hmgeti(m_type_index, m_nodes[node].type);
+    return index < 0 ? &m_unknown_type : &m_types[m_type_index[index].value];
+}
+
+static int compare_types(const void* a, const void* b) {
+    const type_info_t* ta = a;
+    const type_info_t* tb = b;
+    return ta->retained < tb->retained ? 1 : ta->retained > tb->retained ? -1 : 0;
+}
+
+static int compare_nodes(const void* a, const void* b) {
+    uint64_t ra = m_retained[*(const uint32_t*)a];
+    uint64_t rb = m_retained[*(const uint32_t*)b];
+    return ra < rb ? 1 : ra > rb ? -1 : 0;
+}
+
+static void report(int top, size_t root_count, uint32_t unrooted) {
+    uint32_t count = arrlen(m_nodes);
+
+    uint64_t total = 0;
+    for (uint32_t i = 1; i < count; i++) {
+        type_info_t* type = node_type(i);
+        type->count++;
+        type->shallow += m_nodes[i].size;
+        total += m_nodes[i].size;
+
+        // a chain of objects of the same type only counts once
+        uint32_t idom = m_idom[i];
+        if (idom == ROOT_NODE || node_type(idom) != type) {
+            type->retained += m_retained[i];
+        }
+    }
+
+    printf("objects: %u, bytes: %lu, types: %d, roots: %zu, unrooted: %u\n\n",
+           count - 1, total, (int)arrlen(m_types), root_count, unrooted);
+
+    // by object, before the types are sorted so they can still be looked up
+    uint32_t* nodes = malloc(count * sizeof(uint32_t));
+    for (uint32_t i = 1; i < count; i++) {
+        nodes[i - 1] = i;
+    }
+    qsort(nodes, count - 1, sizeof(uint32_t), compare_nodes);
+
+    printf("%18s %16s %16s  %s\n", "address", "shallow", "retained", "type");
+    for (uint32_t i = 0; i < count - 1 && i < (uint32_t)top; i++) {
+        node_t* node = &m_nodes[nodes[i]];
+        printf("%#18lx %16lu %16lu  %s\n", node->address, node->size, m_retained[nodes[i]], node_type(nodes[i])->name);
+    }
+    printf("\n");
+
+    // by type
+    qsort(m_types, arrlen(m_types), sizeof(type_info_t), compare_types);
+
+    printf("%16s %16s %16s  %s\n", "count", "shallow", "retained", "type");
+    for (int i = 0; i < arrlen(m_types) && i < top; i++) {
+        type_info_t* type = &m_types[i];
+        printf("%16lu %16lu %16lu  %s\n", type->count, type->shallow, type->retained, type->name);
+    }
+
+    free(nodes);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <snapshot> [count]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int top = argc > 2 ? atoi(argv[2]) : 30;
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    struct stat s;
+    fstat(fd, &s);
+    const uint8_t* data = mmap(0, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "failed to map %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t* roots = NULL;
+    if (!parse_snapshot(data, data + s.st_size, &roots)) {
+        return EXIT_FAILURE;
+    }
+
+    build_successors();
+    uint32_t unrooted = order_nodes(roots);
+    build_predecessors();
+    build_dominators();
+    report(top, arrlen(roots), unrooted);
+
+    return EXIT_SUCCESS;
+}